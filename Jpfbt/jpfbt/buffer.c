@@ -16,41 +16,882 @@ PJPFBT_GLOBAL_DATA JpfbtpGlobalState = NULL;
  *
  */
 
-static PSLIST_ENTRY JpfbtsReverseSlist(
-	__in PSLIST_ENTRY List
+/*++
+	Routine Description:
+		Determine the number of pools to use - one per processor,
+		but no more pools than buffers.
+--*/
+static ULONG JpfbtsGetPoolCount(
+	__in ULONG BufferCount
+	)
+{
+	ULONG ProcessorCount;
+
+#if defined( JPFBT_TARGET_USERMODE )
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo( &SystemInfo );
+	ProcessorCount = SystemInfo.dwNumberOfProcessors;
+#else
+	ProcessorCount = ( ULONG ) KeNumberProcessors;
+#endif
+
+	ProcessorCount = min( ProcessorCount, JPFBT_MAX_BUFFER_POOLS );
+	ProcessorCount = min( ProcessorCount, BufferCount );
+
+	return max( ProcessorCount, 1 );
+}
+
+/*++
+	Routine Description:
+		Get the index of the pool associated with the current 
+		processor.
+
+		User mode cannot cheaply query the current processor on 
+		all supported systems, so threads are spread over the
+		pools by their ID instead.
+--*/
+static ULONG JpfbtsGetCurrentPoolIndex()
+{
+#if defined( JPFBT_TARGET_USERMODE )
+	return ( GetCurrentThreadId() >> 2 ) % JpfbtpGlobalState->PoolCount;
+#else
+	return KeGetCurrentProcessorNumber() % JpfbtpGlobalState->PoolCount;
+#endif
+}
+
+/*++
+	Routine Description:
+		Obtain a free buffer from the pool of the current processor.
+		If this pool is depleted, a buffer is stolen from one of the
+		other pools, starting with the next neighbour.
+
+	Return Value:
+		Buffer or NULL if all free lists are depleted.
+--*/
+static PJPFBT_BUFFER JpfbtsPopFreeBuffer()
+{
+	ULONG Index;
+	PSLIST_ENTRY ListEntry;
+	PJPFBT_BUFFER_POOL LocalPool;
+	ULONG LocalPoolIndex;
+
+	LocalPoolIndex	= JpfbtsGetCurrentPoolIndex();
+	LocalPool		= &JpfbtpGlobalState->Pools[ LocalPoolIndex ];
+
+	ListEntry = InterlockedPopEntrySList( &LocalPool->FreeBuffersList );
+	if ( ListEntry != NULL )
+	{
+		return CONTAINING_RECORD( ListEntry, JPFBT_BUFFER, ListEntry );
+	}
+
+	InterlockedIncrement( &LocalPool->Depletions );
+
+	for ( Index = 1; Index < JpfbtpGlobalState->PoolCount; Index++ )
+	{
+		PJPFBT_BUFFER_POOL Neighbour = &JpfbtpGlobalState->Pools[
+			( LocalPoolIndex + Index ) % JpfbtpGlobalState->PoolCount ];
+
+		ListEntry = InterlockedPopEntrySList( &Neighbour->FreeBuffersList );
+		if ( ListEntry != NULL )
+		{
+			//
+			// N.B. The buffer is returned to the pool of the processor
+			// that retires it, so buffers migrate towards busy
+			// processors.
+			//
+			InterlockedIncrement( &LocalPool->Steals );
+			return CONTAINING_RECORD( ListEntry, JPFBT_BUFFER, ListEntry );
+		}
+	}
+
+	//
+	// Ask the collector for more buffers.
+	//
+	JpfbtpGlobalState->BufferSlabs.GrowRequested = TRUE;
+
+	return NULL;
+}
+
+static PSLIST_ENTRY JpfbtsGetNextEntry(
+	__in PSLIST_ENTRY Entry
+	)
+{
+	return *( PSLIST_ENTRY volatile * ) &Entry->Next;
+}
+
+/*++
+	Routine Description:
+		Append an entry to the dirty queue.
+
+		Callable at any IRQL.
+--*/
+static VOID JpfbtsEnqueueDirtyEntry(
+	__in PJPFBT_DIRTY_QUEUE Queue,
+	__in PSLIST_ENTRY Entry
+	)
+{
+	PSLIST_ENTRY Previous;
+
+	Entry->Next = NULL;
+
+	Previous = ( PSLIST_ENTRY ) InterlockedExchangePointer(
+		( PVOID* ) &Queue->Last,
+		Entry );
+
+	//
+	// Until the entry is linked, the consumer cannot see it nor
+	// any of its successors.
+	//
+	*( PSLIST_ENTRY volatile * ) &Previous->Next = Entry;
+}
+
+/*++
+	Routine Description:
+		Remove the oldest entry from the dirty queue. The caller 
+		must hold the collector lock.
+
+	Return Value:
+		Entry or NULL if the queue is empty or the oldest entry has
+		not been linked yet.
+--*/
+static PSLIST_ENTRY JpfbtsDequeueDirtyEntry(
+	__in PJPFBT_DIRTY_QUEUE Queue
+	)
+{
+	PSLIST_ENTRY First = Queue->First;
+	PSLIST_ENTRY Next = JpfbtsGetNextEntry( First );
+
+	if ( First == &Queue->Stub )
+	{
+		if ( Next == NULL )
+		{
+			//
+			// Empty.
+			//
+			return NULL;
+		}
+
+		//
+		// Skip stub.
+		//
+		Queue->First	= Next;
+		First			= Next;
+		Next			= JpfbtsGetNextEntry( Next );
+	}
+
+	if ( Next != NULL )
+	{
+		Queue->First = Next;
+		return First;
+	}
+
+	if ( First != Queue->Last )
+	{
+		//
+		// A producer is about to link its entry to First.
+		//
+		return NULL;
+	}
+
+	//
+	// First is the only entry. Re-enqueue the stub s.t. First can
+	// be removed.
+	//
+	JpfbtsEnqueueDirtyEntry( Queue, &Queue->Stub );
+
+	Next = JpfbtsGetNextEntry( First );
+	if ( Next != NULL )
+	{
+		Queue->First = Next;
+		return First;
+	}
+
+	return NULL;
+}
+
+/*++
+	Routine Description:
+		Put a buffer on the dirty queue. Once processed, it is 
+		returned to the pool of the current processor.
+
+		Callable at any IRQL.
+--*/
+static VOID JpfbtsEnqueueDirtyBuffer(
+	__in PJPFBT_BUFFER Buffer
+	)
+{
+	PJPFBT_DIRTY_QUEUE DirtyQueue = JpfbtpGlobalState->DirtyQueue;
+
+	Buffer->PoolIndex = JpfbtsGetCurrentPoolIndex();
+
+	//
+	// All buffers share a single queue, so they are processed in the
+	// order they have been retired, across threads and processors.
+	//
+	JpfbtsEnqueueDirtyEntry( DirtyQueue, &Buffer->ListEntry );
+	InterlockedIncrement( &DirtyQueue->Enqueued );
+}
+
+static VOID JpfbtsAcquireCollectorLock()
+{
+#if defined(JPFBT_TARGET_USERMODE)
+	EnterCriticalSection( &JpfbtpGlobalState->CollectorLock );
+#else
+	KeAcquireGuardedMutex( &JpfbtpGlobalState->CollectorLock );
+#endif
+}
+
+static VOID JpfbtsReleaseCollectorLock()
+{
+#if defined(JPFBT_TARGET_USERMODE)
+	LeaveCriticalSection( &JpfbtpGlobalState->CollectorLock );
+#else
+	KeReleaseGuardedMutex( &JpfbtpGlobalState->CollectorLock );
+#endif
+}
+
+/*++
+	Routine Description:
+		Signal the collector event unconditionally, i.e. regardless 
+		of DisableTriggerBufferCollection. Only to be called by the
+		collector itself.
+--*/
+static VOID JpfbtsSignalCollector()
+{
+#if defined(JPFBT_TARGET_USERMODE)
+	VERIFY( SetEvent( JpfbtpGlobalState->BufferCollectorEvent ) );
+#else
+	( VOID ) KeSetEvent( 
+		&JpfbtpGlobalState->BufferCollectorEvent,
+		IO_NO_INCREMENT,
+		FALSE );
+#endif
+}
+
+static ULONG JpfbtsGetTickCount()
+{
+#if defined(JPFBT_TARGET_USERMODE)
+	return GetTickCount();
+#else
+	return ( ULONG ) ( KeQueryInterruptTime() / ( 10 * 1000 ) );
+#endif
+}
+
+static ULONG JpfbtsGetFreeBufferCount()
+{
+	ULONG Free = 0;
+	ULONG PoolIndex;
+
+	for ( PoolIndex = 0; PoolIndex < JpfbtpGlobalState->PoolCount; PoolIndex++ )
+	{
+		Free += ExQueryDepthSList( 
+			&JpfbtpGlobalState->Pools[ PoolIndex ].FreeBuffersList );
+	}
+
+	return Free;
+}
+
+/*++
+	Routine Description:
+		Check whether the pool of the current processor holds less
+		than its share of the low watermark. Unlike 
+		JpfbtsIsBelowLowWatermark, only the local pool is touched,
+		so this is cheap enough for producers.
+--*/
+static BOOLEAN JpfbtsIsLocalPoolBelowLowWatermark()
+{
+	ULONG LowWatermark = JpfbtpGlobalState->BufferSlabs.Limits.LowWatermark;
+	ULONG PoolCount = JpfbtpGlobalState->PoolCount;
+
+	if ( LowWatermark == 0 )
+	{
+		return FALSE;
+	}
+
+	return ( BOOLEAN ) ( ExQueryDepthSList( &JpfbtpGlobalState->Pools[ 
+		JpfbtsGetCurrentPoolIndex() ].FreeBuffersList ) < 
+		( LowWatermark + PoolCount - 1 ) / PoolCount );
+}
+
+static BOOLEAN JpfbtsIsBelowLowWatermark()
+{
+	//
+	// N.B. Reading the limits without holding the collector lock
+	// is benign.
+	//
+	ULONG LowWatermark = JpfbtpGlobalState->BufferSlabs.Limits.LowWatermark;
+
+	return ( BOOLEAN ) ( LowWatermark != 0 && 
+		JpfbtsGetFreeBufferCount() < LowWatermark );
+}
+
+//
+// Slab routines. All require the collector lock to be held.
+//
+
+/*++
+	Routine Description:
+		Initialize a contiguous range of buffers and spread them
+		over the free lists of all pools.
+--*/
+static VOID JpfbtsAddBuffers(
+	__in PJPFBT_GLOBAL_DATA GlobalState,
+	__in PJPFBT_BUFFER FirstBuffer,
+	__in ULONG BufferCount,
+	__in ULONG SlabIndex
+	)
+{
+	ULONG BufferStructSize;
+	PJPFBT_BUFFER CurrentBuffer = FirstBuffer;
+	ULONG CurrentBufferIndex;
+
+	BufferStructSize = 
+		FIELD_OFFSET( JPFBT_BUFFER, Buffer ) +
+		GlobalState->BufferSize * sizeof( UCHAR );
+
+	for ( CurrentBufferIndex = 0; CurrentBufferIndex < BufferCount; CurrentBufferIndex++ )
+	{
+		CurrentBuffer->ThreadId = 0xDEADBEEF;				// initialized later
+		CurrentBuffer->ProcessId = 0xDEADBEEF;				// initialized later
+		CurrentBuffer->BufferSize = GlobalState->BufferSize;
+		CurrentBuffer->UsedSize = 0;
+		CurrentBuffer->PoolIndex = CurrentBufferIndex % GlobalState->PoolCount;
+		CurrentBuffer->SlabIndex = SlabIndex;
+
+#if DBG
+		CurrentBuffer->Guard = 0xDEADBEEF;
+#endif
+
+		ASSERT( ( ( ULONG_PTR ) &CurrentBuffer->ListEntry ) % 
+			MEMORY_ALLOCATION_ALIGNMENT == 0 );
+
+		InterlockedPushEntrySList( 
+			&GlobalState->Pools[ CurrentBuffer->PoolIndex ].FreeBuffersList,
+			&CurrentBuffer->ListEntry );
+
+		//
+		// N.B. JPFBT_BUFFER is variable length, so CurrentBuffer++
+		// does not work.
+		//
+		CurrentBuffer = ( PJPFBT_BUFFER ) 
+			( ( PUCHAR ) CurrentBuffer + BufferStructSize );
+	}
+}
+
+/*++
+	Routine Description:
+		Allocate another slab and put its buffers on the free lists.
+--*/
+static VOID JpfbtsGrowBuffers()
+{
+	ULONG BufferCount;
+	ULONG BufferStructSize;
+	PJPFBT_BUFFER_SLAB Slab;
+	ULONG SlabIndex;
+	
+	BufferCount = JpfbtpGlobalState->BufferSlabs.Limits.SlabBufferCount;
+	ASSERT( BufferCount > 0 );
+
+	for ( SlabIndex = 1; SlabIndex < JPFBT_MAX_BUFFER_SLABS; SlabIndex++ )
+	{
+		if ( JpfbtpGlobalState->BufferSlabs.Slots[ SlabIndex ] == NULL )
+		{
+			break;
+		}
+	}
+
+	if ( SlabIndex == JPFBT_MAX_BUFFER_SLABS )
+	{
+		return;
+	}
+
+	BufferStructSize = 
+		FIELD_OFFSET( JPFBT_BUFFER, Buffer ) +
+		JpfbtpGlobalState->BufferSize * sizeof( UCHAR );
+
+	//
+	// N.B. Size has been checked for overflows when the limits 
+	// were set.
+	//
+	Slab = ( PJPFBT_BUFFER_SLAB ) JpfbtpAllocateNonPagedMemory(
+		sizeof( JPFBT_BUFFER_SLAB ) + BufferCount * BufferStructSize,
+		FALSE );
+	if ( Slab == NULL )
+	{
+		JpfbtpGlobalState->BufferSlabs.FailedAllocations++;
+		return;
+	}
+
+	Slab->BufferCount	= BufferCount;
+	Slab->Reclaimed		= 0;
+	Slab->Retiring		= FALSE;
+
+	JpfbtpGlobalState->BufferSlabs.Slots[ SlabIndex ] = Slab;
+	JpfbtpGlobalState->BufferSlabs.Count++;
+	JpfbtpGlobalState->BufferSlabs.BufferCount += BufferCount;
+	JpfbtpGlobalState->BufferSlabs.Allocated++;
+
+	JpfbtsAddBuffers( 
+		JpfbtpGlobalState,
+		( PJPFBT_BUFFER ) ( Slab + 1 ), 
+		BufferCount, 
+		SlabIndex );
+
+	TRACE( ( "JPFBT: Slab %d allocated\n", SlabIndex ) );
+}
+
+/*++
+	Routine Description:
+		Withdraw a buffer of a retiring slab from circulation. The
+		slab is freed along with its last buffer.
+--*/
+static VOID JpfbtsReclaimBuffer(
+	__in PJPFBT_BUFFER Buffer
+	)
+{
+	PJPFBT_BUFFER_SLAB Slab;
+
+	Slab = JpfbtpGlobalState->BufferSlabs.Slots[ Buffer->SlabIndex ];
+	ASSERT( Slab != NULL );
+	ASSERT( Slab->Retiring );
+	ASSERT( Slab->Reclaimed < Slab->BufferCount );
+
+	if ( ++Slab->Reclaimed == Slab->BufferCount )
+	{
+		TRACE( ( "JPFBT: Slab %d released\n", Buffer->SlabIndex ) );
+
+		JpfbtpGlobalState->BufferSlabs.Slots[ Buffer->SlabIndex ] = NULL;
+		JpfbtpGlobalState->BufferSlabs.Count--;
+		JpfbtpGlobalState->BufferSlabs.Released++;
+
+		JpfbtpFreeNonPagedMemory( Slab );
+	}
+}
+
+static BOOLEAN JpfbtsIsRetiringBuffer(
+	__in PJPFBT_BUFFER Buffer
+	)
+{
+	return ( BOOLEAN ) ( Buffer->SlabIndex != 0 &&
+		JpfbtpGlobalState->BufferSlabs.Slots[ Buffer->SlabIndex ]->Retiring );
+}
+
+/*++
+	Routine Description:
+		Retire a slab. Buffers in use are withdrawn as soon as they
+		have been processed, free buffers as their free lists are
+		swept.
+--*/
+static VOID JpfbtsRetireSlab(
+	__in ULONG SlabIndex
+	)
+{
+	PJPFBT_BUFFER_SLAB Slab;
+
+	Slab = JpfbtpGlobalState->BufferSlabs.Slots[ SlabIndex ];
+	ASSERT( Slab != NULL );
+	ASSERT( ! Slab->Retiring );
+
+	Slab->Retiring = TRUE;
+	JpfbtpGlobalState->BufferSlabs.BufferCount -= Slab->BufferCount;
+
+	//
+	// Only the collector puts buffers on free lists, so once each
+	// list has been swept after this point, no buffer of this slab
+	// will show up on a free list again. Restarting the cycle also
+	// covers slabs retired earlier.
+	//
+	JpfbtpGlobalState->BufferSlabs.PendingSweeps = JpfbtpGlobalState->PoolCount;
+}
+
+/*++
+	Routine Description:
+		Withdraw the free buffers of retiring slabs from the free 
+		list of the next pool to be swept.
+
+		Only this pool's free list is emptied for the duration of
+		the sweep - producers running short meanwhile steal from 
+		the other pools.
+--*/
+static VOID JpfbtsSweepNextPool()
+{
+	PSLIST_ENTRY ListEntry;
+	PJPFBT_BUFFER_POOL Pool;
+
+	ASSERT( JpfbtpGlobalState->BufferSlabs.PendingSweeps > 0 );
+	ASSERT( JpfbtpGlobalState->BufferSlabs.NextSweepPool < JpfbtpGlobalState->PoolCount );
+
+	Pool = &JpfbtpGlobalState->Pools[ JpfbtpGlobalState->BufferSlabs.NextSweepPool ];
+
+	ListEntry = InterlockedFlushSList( &Pool->FreeBuffersList );
+	while ( ListEntry != NULL )
+	{
+		PJPFBT_BUFFER Buffer;
+
+		Buffer		= CONTAINING_RECORD( ListEntry, JPFBT_BUFFER, ListEntry );
+		ListEntry	= ListEntry->Next;
+
+		if ( JpfbtsIsRetiringBuffer( Buffer ) )
+		{
+			JpfbtsReclaimBuffer( Buffer );
+		}
+		else
+		{
+			InterlockedPushEntrySList( 
+				&Pool->FreeBuffersList,
+				&Buffer->ListEntry );
+		}
+	}
+
+	JpfbtpGlobalState->BufferSlabs.NextSweepPool = 
+		( JpfbtpGlobalState->BufferSlabs.NextSweepPool + 1 ) % 
+		JpfbtpGlobalState->PoolCount;
+	JpfbtpGlobalState->BufferSlabs.PendingSweeps--;
+}
+
+/*++
+	Routine Description:
+		Grow or shrink the set of buffers according to the limits.
+		Called after each round of processing dirty buffers.
+--*/
+static VOID JpfbtsMaintainBufferSlabs()
+{
+	ULONG Free;
+	PJPFBT_BUFFER_POOL_LIMITS Limits = &JpfbtpGlobalState->BufferSlabs.Limits;
+	ULONG Now;
+	ULONG SlabIndex;
+
+	if ( Limits->MaxBufferCount <= JpfbtpGlobalState->BufferSlabs.InitialBufferCount &&
+		 JpfbtpGlobalState->BufferSlabs.Count == 0 )
+	{
+		//
+		// Fixed number of buffers.
+		//
+		return;
+	}
+
+	if ( JpfbtpGlobalState->BufferSlabs.PendingSweeps > 0 )
+	{
+		JpfbtsSweepNextPool();
+	}
+
+	Free	= JpfbtsGetFreeBufferCount();
+	Now		= JpfbtsGetTickCount();
+
+	if ( InterlockedExchange( &JpfbtpGlobalState->BufferSlabs.GrowRequested, 0 ) ||
+		 Free < Limits->LowWatermark )
+	{
+		JpfbtpGlobalState->BufferSlabs.LastShortageTime = Now;
+
+		if ( ( ULONG64 ) JpfbtpGlobalState->BufferSlabs.BufferCount + 
+				Limits->SlabBufferCount <= Limits->MaxBufferCount )
+		{
+			JpfbtsGrowBuffers();
+		}
+
+		return;
+	}
+
+	//
+	// Release candidate is the most recently allocated slab still
+	// in circulation.
+	//
+	for ( SlabIndex = JPFBT_MAX_BUFFER_SLABS - 1; SlabIndex > 0; SlabIndex-- )
+	{
+		PJPFBT_BUFFER_SLAB Slab = JpfbtpGlobalState->BufferSlabs.Slots[ SlabIndex ];
+
+		if ( Slab != NULL && ! Slab->Retiring )
+		{
+			break;
+		}
+	}
+
+	if ( SlabIndex == 0 )
+	{
+		return;
+	}
+
+	if ( JpfbtpGlobalState->BufferSlabs.BufferCount > Limits->MaxBufferCount )
+	{
+		//
+		// Limit has been lowered.
+		//
+		JpfbtsRetireSlab( SlabIndex );
+	}
+	else if ( Limits->IdleReleaseTimeout != 0 &&
+			  JpfbtpGlobalState->BufferSlabs.PendingSweeps == 0 &&
+			  Now - JpfbtpGlobalState->BufferSlabs.LastShortageTime >= 
+				Limits->IdleReleaseTimeout &&
+			  Free >= ( ULONG64 ) Limits->LowWatermark + 
+				2 * ( ULONG64 ) JpfbtpGlobalState->BufferSlabs.Slots[ SlabIndex ]->BufferCount )
+	{
+		//
+		// Idle for long enough. 
+		//
+		// To avoid oscillating between growing and shrinking, at 
+		// least another slab worth of buffers must remain above the
+		// low watermark after the release. Free only counts buffers
+		// of slabs in circulation as long as no sweep is pending.
+		//
+		// Restart the clock s.t. further slabs are released one 
+		// interval at a time.
+		//
+		JpfbtsRetireSlab( SlabIndex );
+		JpfbtpGlobalState->BufferSlabs.LastShortageTime = Now;
+	}
+}
+
+/*++
+	Routine Description:
+		Hand buffers that threads have been writing to for more 
+		than PartialBufferTimeout over to the dirty queue, so that
+		events of threads that have gone quiet do not linger.
+
+		A buffer is only taken away while its thread is not writing
+		to it. The thread obtains a new buffer the next time it 
+		needs one.
+
+		Requires the collector lock to be held.
+--*/
+static VOID JpfbtsFlushPartialBuffers()
+{
+	ULONG FlushCount;
+	PJPFBT_BUFFER FlushedBuffers[ JPFBT_PARTIAL_BUFFER_FLUSH_BATCH ];
+	ULONG Index;
+	PLIST_ENTRY ListEntry;
+	PLIST_ENTRY ListHead;
+	ULONG Now;
+	ULONG Timeout;
+#if defined(JPFBT_TARGET_KERNELMODE)
+	KIRQL OldIrql;
+#endif
+
+	Timeout = JpfbtpGlobalState->BufferSlabs.Limits.PartialBufferTimeout;
+	if ( Timeout == 0 )
+	{
+		return;
+	}
+
+	//
+	// Checking twice per timeout limits the delay to 1.5 times the
+	// timeout.
+	//
+	Now = JpfbtsGetTickCount();
+	if ( Now - JpfbtpGlobalState->BufferSlabs.LastFlushTime < Timeout / 2 )
+	{
+		return;
+	}
+
+	JpfbtpGlobalState->BufferSlabs.LastFlushTime = Now;
+
+#if defined(JPFBT_TARGET_KERNELMODE)
+	//
+	// Thread data may be registered at IRQL > DISPATCH_LEVEL by means
+	// of ExInterlockedInsertTailList. Such registrations spin (with 
+	// interrupts disabled) until the walk below has finished, which 
+	// is why the walk is kept short. 
+	//
+	// An interrupt on this processor must not attempt to register
+	// thread data for the current thread though, as it would spin
+	// forever - so make sure this thread is registered beforehand.
+	//
+	if ( JpfbtpGetCurrentThreadData() == NULL )
+	{
+		return;
+	}
+#endif
+
+	ListHead = &JpfbtpGlobalState->PatchDatabase.ThreadData.ListHead;
+
+	do
+	{
+		//
+		// Holding the lock keeps threads from freeing their thread 
+		// data, so buffers have to be taken away while walking the
+		// list. Enqueueing them is deferred until the lock has been
+		// released.
+		//
+#if defined(JPFBT_TARGET_USERMODE)
+		JpfbtpAcquirePatchDatabaseLock();
+#else
+		KeAcquireSpinLock( 
+			&JpfbtpGlobalState->PatchDatabase.ThreadData.Lock,
+			&OldIrql );
+#endif
+
+		FlushCount = 0;
+
+		for ( ListEntry = ListHead->Flink; 
+			  ListEntry != ListHead && 
+				FlushCount < JPFBT_PARTIAL_BUFFER_FLUSH_BATCH; 
+			  ListEntry = ListEntry->Flink )
+		{
+			PJPFBT_BUFFER Buffer;
+			PJPFBT_THREAD_DATA ThreadData;
+
+			ThreadData = CONTAINING_RECORD( 
+				ListEntry, 
+				JPFBT_THREAD_DATA, 
+				u.ListEntry );
+
+			Buffer = ThreadData->CurrentBuffer;
+			if ( Buffer == NULL ||
+				 ( ( ULONG_PTR ) Buffer & JPFBT_CURRENT_BUFFER_BUSY ) ||
+				 Buffer->UsedSize == 0 ||
+				 Now - ThreadData->CurrentBufferTime < Timeout )
+			{
+				continue;
+			}
+
+			//
+			// The thread may have started writing in the meantime, in
+			// which case the busy bit is set and the exchange fails.
+			//
+			// N.B. Buffer cannot have been recycled in between as
+			// buffers are only processed by the collector.
+			//
+			if ( InterlockedCompareExchangePointer(
+					( PVOID volatile * ) &ThreadData->CurrentBuffer,
+					NULL,
+					Buffer ) == Buffer )
+			{
+				FlushedBuffers[ FlushCount++ ] = Buffer;
+			}
+		}
+
+#if defined(JPFBT_TARGET_USERMODE)
+		JpfbtpReleasePatchDatabaseLock();
+#else
+		KeReleaseSpinLock( 
+			&JpfbtpGlobalState->PatchDatabase.ThreadData.Lock,
+			OldIrql );
+#endif
+
+		for ( Index = 0; Index < FlushCount; Index++ )
+		{
+			JpfbtsEnqueueDirtyBuffer( FlushedBuffers[ Index ] );
+			InterlockedIncrement( 
+				&JpfbtpGlobalState->Counters.PartialBuffersFlushed );
+		}
+
+		//
+		// Threads whose buffers have been taken away are skipped
+		// on the next walk.
+		//
+	} while ( FlushCount == JPFBT_PARTIAL_BUFFER_FLUSH_BATCH );
+}
+
+/*++
+	Routine Description:
+		Process the buffers on the dirty queue in FIFO order and put 
+		them back on the free list of their pools. Buffers enqueued
+		while this routine is running are left for the next call.
+
+	Return Value:
+		# of buffers processed.
+--*/
+static ULONG JpfbtsProcessDirtyBuffers(
+	__in JPFBT_PROCESS_BUFFER_ROUTINE ProcessBufferRoutine,
+	__in_opt PVOID UserPointer
 	)
 {
-	PSLIST_ENTRY Current = List;
-	PSLIST_ENTRY Next;
-	PSLIST_ENTRY Prev = NULL;
+	ULONG Available;
+	PSLIST_ENTRY ListEntry;
+	ULONG Processed = 0;
+	PJPFBT_DIRTY_QUEUE Queue = JpfbtpGlobalState->DirtyQueue;
+
+	JpfbtsAcquireCollectorLock();
+
+	//
+	// Producers observing a shortage from now on may wake the
+	// collector again.
+	//
+	InterlockedExchange( 
+		&JpfbtpGlobalState->BufferSlabs.LowWatermarkSignalled, 
+		FALSE );
+
+	JpfbtsFlushPartialBuffers();
+
+	Available = ( ULONG ) ( Queue->Enqueued - Queue->Dequeued );
+
+	while ( Processed < Available )
+	{
+		PJPFBT_BUFFER Buffer;
+		ULONG Spins = 0;
+
+		//
+		// Enqueued is only incremented after the producer has linked
+		// its entry, so Available buffers are known to be on the 
+		// queue. Nevertheless, an entry cannot be removed before its
+		// successor has been linked - if another producer has swapped
+		// Last but not linked its entry yet, dequeueing fails. This 
+		// window is short unless the producer has been preempted, so
+		// spin briefly.
+		//
+		while ( ( ListEntry = JpfbtsDequeueDirtyEntry( Queue ) ) == NULL &&
+				Spins++ < JPFBT_DIRTY_QUEUE_LINK_SPIN_COUNT )
+		{
+			YieldProcessor();
+		}
+
+		if ( ListEntry == NULL )
+		{
+			//
+			// Producer still has not linked its entry. Do not block 
+			// on it, but make sure the collector comes back soon 
+			// rather than waiting for the next trigger or timeout.
+			//
+			JpfbtsSignalCollector();
+			break;
+		}
+	
+		Buffer = CONTAINING_RECORD( ListEntry, JPFBT_BUFFER, ListEntry );
 
-	while ( Current != NULL )
-	{
-		Next = Current->Next;
-		Current->Next = Prev;
+		ASSERT( ( Buffer->ProcessId % 4 ) == 0 );
+		ASSERT( ( Buffer->ThreadId % 4 ) == 0 );
 
-		Prev = Current;
-		Current = Next;
-	}
+		( ProcessBufferRoutine )(
+			Buffer->UsedSize,
+			Buffer->Buffer,
+			Buffer->ProcessId,
+			Buffer->ThreadId,
+			UserPointer );
 
-	return Prev;
-}
+		//
+		// Reuse buffer.
+		//
+		Buffer->UsedSize = 0;
+	#if DBG
+		Buffer->ProcessId = 0xDEADBEEF;
+		Buffer->ThreadId = 0xDEADBEEF;
+	#endif
 
-static VOID JpfbtsCheckSlist( 
-	__in PSLIST_ENTRY List 
-	)
-{
-#if defined(DBG) && defined(JPFBT_TARGET_KERNELMODE)
-	PSLIST_ENTRY ListEntry = List;
-	while ( ListEntry != NULL )
-	{
-		ASSERT( ListEntry->Next == NULL ||
-				MmIsAddressValid( ListEntry->Next ) );
-		ListEntry = ListEntry->Next;
+		ASSERT( Buffer->PoolIndex < JpfbtpGlobalState->PoolCount );
+
+		if ( JpfbtsIsRetiringBuffer( Buffer ) )
+		{
+			JpfbtsReclaimBuffer( Buffer );
+		}
+		else
+		{
+			//
+			// Release this entry and put it back on the free list.
+			//
+			InterlockedPushEntrySList(
+				 &JpfbtpGlobalState->Pools[ Buffer->PoolIndex ].FreeBuffersList,
+				 &Buffer->ListEntry );
+		}
+
+		InterlockedIncrement( &Queue->Dequeued );
+		InterlockedIncrement( &JpfbtpGlobalState->Counters.NumberOfBuffersCollected );
+		Processed++;
 	}
-#else
-	UNREFERENCED_PARAMETER( List );
-#endif
+
+	JpfbtsMaintainBufferSlabs();
+
+	JpfbtsReleaseCollectorLock();
+
+	return Processed;
 }
 
 static VOID JpfbtsCheckForSuspiciousThunkStackFrameDuplicates( 
@@ -85,6 +926,50 @@ static VOID JpfbtsCheckForSuspiciousThunkStackFrameDuplicates(
 	ASSERT( Occurences <= 3 );
 }
 
+/*++
+	Routine Description:
+		Set JPFBT_CURRENT_BUFFER_BUSY s.t. the collector does not 
+		take the current buffer away while the thread is using it.
+		Must be called by the owning thread or while it is not 
+		running.
+
+	Return Value:
+		Current buffer, may be NULL.
+--*/
+static PJPFBT_BUFFER JpfbtsAcquireCurrentBuffer(
+	__in PJPFBT_THREAD_DATA ThreadData
+	)
+{
+	ULONG_PTR Current;
+
+	for ( ;; )
+	{
+		Current = ( ULONG_PTR ) ThreadData->CurrentBuffer;
+		if ( Current & JPFBT_CURRENT_BUFFER_BUSY )
+		{
+			//
+			// Already acquired.
+			//
+			break;
+		}
+
+		if ( ( ULONG_PTR ) InterlockedCompareExchangePointer(
+			( PVOID volatile * ) &ThreadData->CurrentBuffer,
+			( PVOID ) ( Current | JPFBT_CURRENT_BUFFER_BUSY ),
+			( PVOID ) Current ) == Current )
+		{
+			break;
+		}
+
+		//
+		// The collector has flushed the buffer in the meantime.
+		//
+		ASSERT( ThreadData->CurrentBuffer == NULL );
+	}
+
+	return ( PJPFBT_BUFFER ) ( Current & ~JPFBT_CURRENT_BUFFER_BUSY );
+}
+
 /*++
 	Routine Description:
 		Retrieve current buffer from thread data. If no buffer
@@ -92,6 +977,9 @@ static VOID JpfbtsCheckForSuspiciousThunkStackFrameDuplicates(
 		is obtained from the free list and the old buffer is put on
 		the dirty list.
 
+		The buffer remains acquired until JpfbtpReleaseCurrentBuffer
+		is called.
+
 	Parameters:
 		ThreadData	 - current thread's thread data.
 		RequiredSize - minimum size required.
@@ -104,47 +992,48 @@ static PJPFBT_BUFFER JpfbtsGetBuffer(
 	__in ULONG RequiredSize
 	)
 {
+	PJPFBT_BUFFER Buffer;
+	BOOLEAN Triggered = FALSE;
+
 	ASSERT( RequiredSize <= JpfbtpGlobalState->BufferSize );
 
-	if ( ThreadData->CurrentBuffer == NULL )
+	Buffer = JpfbtsAcquireCurrentBuffer( ThreadData );
+
+	if ( Buffer == NULL )
 	{
 		//
 		// No buffer -> get fresh buffer.
 		//
 	}
-	else if ( ThreadData->CurrentBuffer->BufferSize - 
-			  ThreadData->CurrentBuffer->UsedSize < RequiredSize )
+	else if ( Buffer->BufferSize - Buffer->UsedSize < RequiredSize )
 	{
 		//
 		// We have a buffer, but there is to little space left.
 		// Get rid of the old, dirty buffer.
 		//
-		ASSERT( ThreadData->CurrentBuffer->ProcessId != 0xDEADBEEF );
-		ASSERT( ThreadData->CurrentBuffer->ThreadId != 0xDEADBEEF );
-
-		InterlockedPushEntrySList( 
-			&JpfbtpGlobalState->DirtyBuffersList,
-			&ThreadData->CurrentBuffer->ListEntry );
+		ASSERT( Buffer->ProcessId != 0xDEADBEEF );
+		ASSERT( Buffer->ThreadId != 0xDEADBEEF );
 
-		ThreadData->CurrentBuffer = NULL;
+		JpfbtpRetireCurrentBuffer( ThreadData );
+		Buffer = NULL;
 
 		//
 		// Notify.
 		//
 		JpfbtpTriggerDirtyBufferCollection();
+		Triggered = TRUE;
 
 		//
 		// Now get new one.
 		//
 	}
 
-	if ( ThreadData->CurrentBuffer == NULL )
+	if ( Buffer == NULL )
 	{
 		//
 		// Get fresh buffer.
 		//
-		PJPFBT_BUFFER NewBuffer = ( PJPFBT_BUFFER )
-			InterlockedPopEntrySList( &JpfbtpGlobalState->FreeBuffersList );
+		PJPFBT_BUFFER NewBuffer = JpfbtsPopFreeBuffer();
 
 		ASSERT( ( ( ULONG_PTR ) &NewBuffer->ListEntry ) % 
 			MEMORY_ALLOCATION_ALIGNMENT == 0 );
@@ -152,7 +1041,7 @@ static PJPFBT_BUFFER JpfbtsGetBuffer(
 		if ( NewBuffer == NULL )
 		{
 			//
-			// Oh-oh, free list depleted - we are out of buffers!
+			// Oh-oh, all free lists depleted - we are out of buffers!
 			//
 			TRACE( ( "Out of free buffers!\n" ) );
 			return NULL;
@@ -179,17 +1068,38 @@ static PJPFBT_BUFFER JpfbtsGetBuffer(
 			NewBuffer->OwningThreadData = ThreadData;
 #endif
 
-			ThreadData->CurrentBuffer = NewBuffer;
+			//
+			// N.B. The collector leaves CurrentBuffer alone as long
+			// as the busy bit is set.
+			//
+			ThreadData->CurrentBufferTime	= JpfbtsGetTickCount();
+			ThreadData->CurrentBuffer		= ( PJPFBT_BUFFER ) 
+				( ( ULONG_PTR ) NewBuffer | JPFBT_CURRENT_BUFFER_BUSY );
+			Buffer = NewBuffer;
+
+			//
+			// Wake the collector early if the free lists are about
+			// to run dry. Once signalled, further producers leave the
+			// collector alone until it has run.
+			//
+			if ( ! Triggered && 
+				 ! JpfbtpGlobalState->BufferSlabs.LowWatermarkSignalled &&
+				 JpfbtsIsLocalPoolBelowLowWatermark() &&
+				 0 == InterlockedExchange( 
+					&JpfbtpGlobalState->BufferSlabs.LowWatermarkSignalled, 
+					TRUE ) )
+			{
+				InterlockedIncrement( 
+					&JpfbtpGlobalState->Counters.LowWatermarkTriggers );
+				JpfbtpTriggerDirtyBufferCollection();
+			}
 		}
 	}
 
-	if ( ThreadData->CurrentBuffer != NULL )
-	{
-		ASSERT( ( ThreadData->CurrentBuffer->ProcessId % 4 ) == 0 );
-		ASSERT( ( ThreadData->CurrentBuffer->ThreadId % 4 ) == 0 );
-	}
+	ASSERT( ( Buffer->ProcessId % 4 ) == 0 );
+	ASSERT( ( Buffer->ThreadId % 4 ) == 0 );
 
-	return ThreadData->CurrentBuffer;
+	return Buffer;
 }
 
 /*----------------------------------------------------------------------
@@ -204,6 +1114,8 @@ NTSTATUS JpfbtpAllocateGlobalStateAndBuffers(
 	)
 {
 	ULONG BufferStructSize;
+	ULONG_PTR DirtyQueue;
+	ULONG PoolCount;
 	ULONG64 TotalAllocationSize = 0;
 
 	ASSERT_IRQL_LTE( DISPATCH_LEVEL );
@@ -211,6 +1123,8 @@ NTSTATUS JpfbtpAllocateGlobalStateAndBuffers(
 
 	*GlobalState = 0;
 
+	PoolCount = JpfbtsGetPoolCount( BufferCount );
+
 	//
 	// Calculate effective size of JPFBT_BUFFER structure.
 	//
@@ -221,9 +1135,11 @@ NTSTATUS JpfbtpAllocateGlobalStateAndBuffers(
 	//
 	// As we allocate multiple structs as a single blob, we must
 	// make sure that each struct is properly aligned s.t.
-	// all ListEntry-fields are aligned.
+	// all ListEntry-fields are aligned. The dirty queue and the
+	// pools are aligned to cache lines, which also aligns the first 
+	// buffer.
 	//
-	ASSERT( sizeof( JPFBT_GLOBAL_DATA ) % MEMORY_ALLOCATION_ALIGNMENT == 0 );
+	C_ASSERT( JPFBT_CACHE_LINE_SIZE % MEMORY_ALLOCATION_ALIGNMENT == 0 );
 
 	//
 	// Each buffer must be of appropriate size.
@@ -233,15 +1149,20 @@ NTSTATUS JpfbtpAllocateGlobalStateAndBuffers(
 	//
 	// Calculate allocation size:
 	//  BufferCount * JPFBT_BUFFER structs
-	//  1 * JPFBT_BUFFER_LIST struct
+	//  PoolCount * JPFBT_BUFFER_POOL structs
+	//  1 * JPFBT_DIRTY_QUEUE struct + alignment slack
+	//  1 * JPFBT_GLOBAL_DATA struct
 	//
-	TotalAllocationSize = BufferCount * BufferStructSize;
+	TotalAllocationSize = ( ULONG64 ) BufferCount * BufferStructSize;
 	if ( TotalAllocationSize > 0xffffffff )
 	{
 		return STATUS_INVALID_PARAMETER;
 	}
 	
-	TotalAllocationSize += sizeof( JPFBT_GLOBAL_DATA );
+	TotalAllocationSize += sizeof( JPFBT_GLOBAL_DATA ) +
+		sizeof( JPFBT_DIRTY_QUEUE ) +
+		PoolCount * sizeof( JPFBT_BUFFER_POOL ) +
+		JPFBT_CACHE_LINE_SIZE;
 	if ( TotalAllocationSize > 0xffffffff)
 	{
 		return STATUS_INVALID_PARAMETER;
@@ -256,6 +1177,15 @@ NTSTATUS JpfbtpAllocateGlobalStateAndBuffers(
 
 	ASSERT( ( ( ULONG_PTR ) *GlobalState ) % MEMORY_ALLOCATION_ALIGNMENT == 0 );
 
+	DirtyQueue = ( ULONG_PTR ) *GlobalState + sizeof( JPFBT_GLOBAL_DATA );
+	DirtyQueue = ( DirtyQueue + JPFBT_CACHE_LINE_SIZE - 1 ) & 
+		~( ( ULONG_PTR ) JPFBT_CACHE_LINE_SIZE - 1 );
+
+	( *GlobalState )->DirtyQueue	= ( PJPFBT_DIRTY_QUEUE ) DirtyQueue;
+	( *GlobalState )->PoolCount		= PoolCount;
+	( *GlobalState )->Pools			= ( PJPFBT_BUFFER_POOL ) 
+		( DirtyQueue + sizeof( JPFBT_DIRTY_QUEUE ) );
+
 	return STATUS_SUCCESS;
 }
 
@@ -265,58 +1195,97 @@ VOID JpfbtpInitializeBuffersGlobalState(
 	__in PJPFBT_GLOBAL_DATA GlobalState
 	)
 {
-	ULONG BufferStructSize;
-	ULONG CurrentBufferIndex;
-	PJPFBT_BUFFER CurrentBuffer;
+	PJPFBT_DIRTY_QUEUE DirtyQueue;
+	ULONG PoolIndex;
+	ULONG SlabIndex;
 
 	ASSERT_IRQL_LTE( APC_LEVEL );
 	ASSERT( GlobalState );
+	ASSERT( GlobalState->PoolCount > 0 );
 
 	GlobalState->BufferSize							= BufferSize;
 	GlobalState->Counters.NumberOfBuffersCollected	= 0;
 
-	BufferStructSize = 
-		FIELD_OFFSET( JPFBT_BUFFER, Buffer ) +
-		BufferSize * sizeof( UCHAR );
+	//
+	// Dirty queue starts with the stub only.
+	//
+	DirtyQueue = GlobalState->DirtyQueue;
+	ASSERT( ( ( ULONG_PTR ) DirtyQueue ) % JPFBT_CACHE_LINE_SIZE == 0 );
 
-	InitializeSListHead( &GlobalState->FreeBuffersList );
-	InitializeSListHead( &GlobalState->DirtyBuffersList );
+	DirtyQueue->Stub.Next	= NULL;
+	DirtyQueue->Last		= &DirtyQueue->Stub;
+	DirtyQueue->First		= &DirtyQueue->Stub;
+	DirtyQueue->Enqueued	= 0;
+	DirtyQueue->Dequeued	= 0;
+
+	for ( PoolIndex = 0; PoolIndex < GlobalState->PoolCount; PoolIndex++ )
+	{
+		PJPFBT_BUFFER_POOL Pool = &GlobalState->Pools[ PoolIndex ];
+
+		ASSERT( ( ( ULONG_PTR ) Pool ) % JPFBT_CACHE_LINE_SIZE == 0 );
+
+		InitializeSListHead( &Pool->FreeBuffersList );
+		Pool->Depletions	= 0;
+		Pool->Steals		= 0;
+	}
 
 	//
-	// ...buffers.
-	//
-	// First buffer is right after JPFBT_BUFFER_LIST structure.
+	// ...slabs...
 	//
-	CurrentBuffer = ( PJPFBT_BUFFER ) 
-		( ( PUCHAR ) GlobalState + sizeof( JPFBT_GLOBAL_DATA ) );
-	for ( CurrentBufferIndex = 0; CurrentBufferIndex < BufferCount; CurrentBufferIndex++ )
+	GlobalState->BufferSlabs.Limits.MaxBufferCount		= BufferCount;
+	GlobalState->BufferSlabs.Limits.SlabBufferCount		= 0;
+	GlobalState->BufferSlabs.Limits.LowWatermark		= 0;
+	GlobalState->BufferSlabs.Limits.IdleReleaseTimeout	= 0;
+	GlobalState->BufferSlabs.Limits.PartialBufferTimeout = 0;
+	GlobalState->BufferSlabs.InitialBufferCount			= BufferCount;
+	GlobalState->BufferSlabs.BufferCount				= BufferCount;
+	GlobalState->BufferSlabs.Count						= 0;
+	GlobalState->BufferSlabs.LastShortageTime			= 0;
+	GlobalState->BufferSlabs.GrowRequested				= FALSE;
+	GlobalState->BufferSlabs.LowWatermarkSignalled		= FALSE;
+	GlobalState->BufferSlabs.PendingSweeps				= 0;
+	GlobalState->BufferSlabs.NextSweepPool				= 0;
+	GlobalState->BufferSlabs.LastFlushTime				= 0;
+	GlobalState->BufferSlabs.Allocated					= 0;
+	GlobalState->BufferSlabs.Released					= 0;
+	GlobalState->BufferSlabs.FailedAllocations			= 0;
+
+	for ( SlabIndex = 0; SlabIndex < JPFBT_MAX_BUFFER_SLABS; SlabIndex++ )
 	{
-		//
-		// Initialize and push onto free list.
-		//
-		CurrentBuffer->ThreadId = 0xDEADBEEF;				// initialized later
-		CurrentBuffer->ProcessId = 0xDEADBEEF;				// initialized later
-		CurrentBuffer->BufferSize = BufferSize;
-		CurrentBuffer->UsedSize = 0;
+		GlobalState->BufferSlabs.Slots[ SlabIndex ] = NULL;
+	}
 
-#if DBG
-		CurrentBuffer->Guard = 0xDEADBEEF;
-#endif
+	//
+	// ...buffers.
+	//
+	// First buffer is right after the pools.
+	//
+	JpfbtsAddBuffers(
+		GlobalState,
+		( PJPFBT_BUFFER ) &GlobalState->Pools[ GlobalState->PoolCount ],
+		BufferCount,
+		0 );
+}
 
-		ASSERT( ( ( ULONG_PTR ) &CurrentBuffer->ListEntry ) % 
-			MEMORY_ALLOCATION_ALIGNMENT == 0 );
+VOID JpfbtpFreeBufferSlabs(
+	__in PJPFBT_GLOBAL_DATA GlobalState
+	)
+{
+	ULONG SlabIndex;
 
-		InterlockedPushEntrySList( 
-			&GlobalState->FreeBuffersList,
-			&CurrentBuffer->ListEntry );
+	ASSERT_IRQL_LTE( DISPATCH_LEVEL );
+	ASSERT( GlobalState );
 
-		//
-		// N.B. JPFBT_BUFFER is variable length, so CurrentBuffer++
-		// does not work.
-		//
-		CurrentBuffer = ( PJPFBT_BUFFER )
-			( ( PUCHAR ) CurrentBuffer + BufferStructSize );
+	for ( SlabIndex = 1; SlabIndex < JPFBT_MAX_BUFFER_SLABS; SlabIndex++ )
+	{
+		if ( GlobalState->BufferSlabs.Slots[ SlabIndex ] != NULL )
+		{
+			JpfbtpFreeNonPagedMemory( GlobalState->BufferSlabs.Slots[ SlabIndex ] );
+			GlobalState->BufferSlabs.Slots[ SlabIndex ] = NULL;
+		}
 	}
+
+	GlobalState->BufferSlabs.Count = 0;
 }
 
 PJPFBT_THREAD_DATA JpfbtpGetCurrentThreadData()
@@ -353,6 +1322,7 @@ PJPFBT_THREAD_DATA JpfbtpGetCurrentThreadData()
 		// Initialize stack.
 		//
 		ThreadData->CurrentBuffer			= NULL;
+		ThreadData->EventFrame				= NULL;
 		ThreadData->ThunkStack.StackPointer	= 
 			&ThreadData->ThunkStack.Stack[ JPFBT_THUNK_STACK_LOCATIONS - 1 ];
 		ThreadData->ThunkStack.Stack[ JPFBT_THUNK_STACK_LOCATIONS - 1 ].Procedure = 0xDEADBEEF;
@@ -378,6 +1348,119 @@ PJPFBT_THREAD_DATA JpfbtpGetCurrentThreadData()
 	return ThreadData;
 }
 
+VOID JpfbtpRetireCurrentBuffer(
+	__in PJPFBT_THREAD_DATA ThreadData
+	)
+{
+	ULONG_PTR Current = ( ULONG_PTR ) ThreadData->CurrentBuffer;
+
+	ASSERT( JpfbtpGetCurrentBufferPointer( ThreadData ) != NULL );
+
+	JpfbtsEnqueueDirtyBuffer( JpfbtpGetCurrentBufferPointer( ThreadData ) );
+
+	//
+	// Retain the busy bit.
+	//
+	ThreadData->CurrentBuffer = ( PJPFBT_BUFFER ) 
+		( Current & JPFBT_CURRENT_BUFFER_BUSY );
+}
+
+VOID JPFBTCALLTYPE JpfbtCompleteBuffer()
+{
+	PJPFBT_THREAD_DATA ThreadData;
+
+	if ( JpfbtpGlobalState == NULL ||
+		 ! NT_SUCCESS( JpfbtpGetCurrentThreadDataIfAvailable( &ThreadData ) ) ||
+		 ThreadData == NULL )
+	{
+		return;
+	}
+
+	if ( ThreadData->EventFrame == NULL )
+	{
+		//
+		// Not called from within an event routine, so the thunk
+		// will not release the buffer.
+		//
+		JpfbtpReleaseCurrentBuffer( ThreadData );
+	}
+}
+
+VOID JpfbtpReleaseCurrentBuffer(
+	__in PJPFBT_THREAD_DATA ThreadData
+	)
+{
+	ULONG_PTR Current = ( ULONG_PTR ) ThreadData->CurrentBuffer;
+
+	if ( Current & JPFBT_CURRENT_BUFFER_BUSY )
+	{
+		//
+		// N.B. As long as the busy bit is set, CurrentBuffer is only
+		// modified by the owning thread. The exchange also makes the
+		// buffer's contents visible before the collector may take it.
+		//
+		InterlockedExchangePointer(
+			( PVOID volatile * ) &ThreadData->CurrentBuffer,
+			( PVOID ) ( Current & ~JPFBT_CURRENT_BUFFER_BUSY ) );
+	}
+}
+
+ULONG JpfbtpGetBufferCollectorTimeout()
+{
+	PJPFBT_BUFFER_POOL_LIMITS Limits = &JpfbtpGlobalState->BufferSlabs.Limits;
+	ULONG Timeout = INFINITE;
+
+	//
+	// N.B. Reading the limits without holding the collector lock
+	// is benign.
+	//
+	if ( JpfbtpGlobalState->BufferSlabs.PendingSweeps > 0 )
+	{
+		//
+		// Sweep the remaining pools soon, but not back to back.
+		//
+		Timeout = JPFBT_COLLECTOR_SHORTAGE_INTERVAL;
+	}
+	else if ( JpfbtpGlobalState->BufferSlabs.Count > 0 )
+	{
+		Timeout = JPFBT_COLLECTOR_MAINTENANCE_INTERVAL;
+	}
+
+	if ( Limits->PartialBufferTimeout != 0 )
+	{
+		Timeout = min( Timeout, max( Limits->PartialBufferTimeout / 2, 1 ) );
+	}
+
+#if defined(JPFBT_TARGET_KERNELMODE)
+	if ( JpfbtpGlobalState->DisableTriggerBufferCollection )
+	{
+		//
+		// Producers do not signal the collector, so it has to poll -
+		// more frequently while the free lists are about to run dry.
+		//
+		if ( JpfbtsIsBelowLowWatermark() )
+		{
+			Timeout = JPFBT_COLLECTOR_SHORTAGE_INTERVAL;
+		}
+		else
+		{
+			Timeout = min( Timeout, JPFBT_COLLECTOR_MAINTENANCE_INTERVAL );
+		}
+	}
+#endif
+
+	return Timeout;
+}
+
+VOID JpfbtpStopFlushingPartialBuffers()
+{
+	ASSERT_IRQL_LTE( APC_LEVEL );
+
+	JpfbtsAcquireCollectorLock();
+	JpfbtpGlobalState->BufferSlabs.Limits.PartialBufferTimeout = 0;
+	JpfbtsReleaseCollectorLock();
+}
+
 VOID JpfbtpCheckForBufferOverflow()
 {
 #if 0
@@ -486,8 +1569,7 @@ NTSTATUS JpfbtProcessBuffers(
 	__in_opt PVOID UserPointer
 	)
 {
-	PSLIST_ENTRY DirtyList;
-	PSLIST_ENTRY ListEntry;
+	ULONG Processed;
 
 	if ( ! ProcessBufferRoutine )
 	{
@@ -499,11 +1581,27 @@ NTSTATUS JpfbtProcessBuffers(
 		return STATUS_FBT_NOT_INITIALIZED;
 	}
 
-	DirtyList = InterlockedFlushSList( &JpfbtpGlobalState->DirtyBuffersList );
-	while ( ! DirtyList && ! JpfbtpGlobalState->StopBufferCollector )
+	for ( ;; )
 	{
+		Processed = JpfbtsProcessDirtyBuffers(
+			ProcessBufferRoutine,
+			UserPointer );
+
+		if ( Processed > 0 )
+		{
+			return STATUS_SUCCESS;
+		}
+		else if ( JpfbtpGlobalState->StopBufferCollector )
+		{
+			//
+			// BufferCollectorEvent must have been signalled due to
+			// shutdown.
+			//
+			return STATUS_UNSUCCESSFUL;
+		}
+
 		//
-		// List is empty, block.
+		// Queue is empty, block.
 		//
 #if defined(JPFBT_TARGET_USERMODE)
 		if ( WAIT_TIMEOUT == WaitForSingleObject( 
@@ -513,85 +1611,62 @@ NTSTATUS JpfbtProcessBuffers(
 			return STATUS_TIMEOUT;
 		}
 #else
-		LARGE_INTEGER WaitTimeout;
-		WaitTimeout.QuadPart = - ( ( LONGLONG ) Timeout );
-
-		if ( STATUS_TIMEOUT == KeWaitForSingleObject(
-			&JpfbtpGlobalState->BufferCollectorEvent,
-			Executive,
-			KernelMode,
-			FALSE,
-			Timeout == INFINITE
-				? NULL
-				: &WaitTimeout ) )
 		{
-			return STATUS_TIMEOUT;
+			LARGE_INTEGER WaitTimeout;
+			WaitTimeout.QuadPart = - ( ( LONGLONG ) Timeout );
+
+			if ( STATUS_TIMEOUT == KeWaitForSingleObject(
+				&JpfbtpGlobalState->BufferCollectorEvent,
+				Executive,
+				KernelMode,
+				FALSE,
+				Timeout == INFINITE
+					? NULL
+					: &WaitTimeout ) )
+			{
+				return STATUS_TIMEOUT;
+			}
 		}
 #endif
-
-		DirtyList = InterlockedFlushSList( &JpfbtpGlobalState->DirtyBuffersList );
 	}
+}
 
-	if ( ! DirtyList )
-	{
-		//
-		// BufferCollectorEvent must have been signalled due to
-		// shutdown.
-		//
-		ASSERT( JpfbtpGlobalState->StopBufferCollector );
+NTSTATUS JpfbtSetBufferPoolLimits(
+	__in PJPFBT_BUFFER_POOL_LIMITS Limits
+	)
+{
+	ULONG64 SlabSize;
 
-		return STATUS_UNSUCCESSFUL;
+	if ( ! Limits )
+	{
+		return STATUS_INVALID_PARAMETER;
 	}
 
-	//
-	// Now we have a DirtyList. As the list is LIFO but we have to process
-	// buffers FIFO, we have to reverse this list first.
-	//
-	JpfbtsCheckSlist( DirtyList );
-	DirtyList = JpfbtsReverseSlist( DirtyList );
-	JpfbtsCheckSlist( DirtyList );
-
-	//
-	// Process all entries. We own the DirytList, thus, there is no
-	// need to use interlocked operations any more.
-	//
-	ListEntry = DirtyList;
-	while ( ListEntry != NULL )
+	if ( JpfbtpGlobalState == NULL )
 	{
-		PJPFBT_BUFFER Buffer;
-	
-		Buffer = CONTAINING_RECORD( ListEntry, JPFBT_BUFFER, ListEntry );
-
-		ASSERT( ( Buffer->ProcessId % 4 ) == 0 );
-		ASSERT( ( Buffer->ThreadId % 4 ) == 0 );
-
-		( ProcessBufferRoutine )(
-			Buffer->UsedSize,
-			Buffer->Buffer,
-			Buffer->ProcessId,
-			Buffer->ThreadId,
-			UserPointer );
+		return STATUS_FBT_NOT_INITIALIZED;
+	}
 
-		//
-		// Reuse buffer.
-		//
-		Buffer->UsedSize = 0;
-	#if DBG
-		Buffer->ProcessId = 0xDEADBEEF;
-		Buffer->ThreadId = 0xDEADBEEF;
-	#endif
+	ASSERT_IRQL_LTE( APC_LEVEL );
 
-		ListEntry = ListEntry->Next;
+	if ( Limits->MaxBufferCount > JpfbtpGlobalState->BufferSlabs.InitialBufferCount )
+	{
+		SlabSize = sizeof( JPFBT_BUFFER_SLAB ) + ( ULONG64 ) Limits->SlabBufferCount * 
+			( FIELD_OFFSET( JPFBT_BUFFER, Buffer ) + JpfbtpGlobalState->BufferSize );
+		if ( Limits->SlabBufferCount == 0 || SlabSize > 0xffffffff )
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
 
-		//
-		// Release this entry and put it back on the free list.
-		//
-		InterlockedPushEntrySList(
-			 &JpfbtpGlobalState->FreeBuffersList,
-			 &Buffer->ListEntry );
+	JpfbtsAcquireCollectorLock();
+	JpfbtpGlobalState->BufferSlabs.Limits = *Limits;
+	JpfbtsReleaseCollectorLock();
 
-		InterlockedIncrement( &JpfbtpGlobalState->Counters.NumberOfBuffersCollected );
-	}
+	//
+	// Let the collector apply the new limits.
+	//
+	JpfbtpTriggerDirtyBufferCollection();
 
 	return STATUS_SUCCESS;
 }
@@ -632,15 +1707,16 @@ VOID JpfbtpTeardownThreadDataForExitingThread(
 	{
 		ASSERT( ThreadData->Signature == JPFBT_THREAD_DATA_SIGNATURE );
 
-		if ( ThreadData->CurrentBuffer )
+		//
+		// N.B. The collector may attempt to flush the buffer 
+		// concurrently.
+		//
+		if ( JpfbtsAcquireCurrentBuffer( ThreadData ) != NULL )
 		{
 			//
 			// Get rid of old, dirty buffer.
 			//
-			InterlockedPushEntrySList( 
-				&JpfbtpGlobalState->DirtyBuffersList,
-				&ThreadData->CurrentBuffer->ListEntry );
-			ThreadData->CurrentBuffer = NULL;
+			JpfbtpRetireCurrentBuffer( ThreadData );
 		}
 
 #if defined( JPFBT_TARGET_USERMODE )
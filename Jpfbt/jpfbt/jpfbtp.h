@@ -145,8 +145,24 @@ typedef struct _JPFBT_THUNK_STACK_FRAME
 			struct _JPFBT_THUNK_STACK_FRAME *RegisteringFrame;
 		} u;
 	} Seh;
+
+	//
+	// Flags owned by event routines, see JPFBT_ACTIVE_CALL.
+	//
+	ULONG Flags;
+
+	//
+	// Timestamp counter read on procedure entry.
+	//
+	ULONGLONG EntryTimestamp;
 } JPFBT_THUNK_STACK_FRAME, *PJPFBT_THUNK_STACK_FRAME;
 
+//
+// N.B. Keep in sync with equates in thunks.asm.
+//
+C_ASSERT( FIELD_OFFSET( JPFBT_THUNK_STACK_FRAME, Seh ) == 8 );
+C_ASSERT( sizeof( JPFBT_THUNK_STACK_FRAME ) == 32 );
+
 
 #define JPFBT_THUNK_STACK_LOCATIONS 256
 
@@ -203,6 +219,17 @@ typedef struct _JPFBT_BUFFER
 	ULONG ProcessId;
 	ULONG ThreadId;
 
+	//
+	// Pool to return this buffer to once it has been processed.
+	//
+	ULONG PoolIndex;
+
+	//
+	// Slab this buffer has been allocated from, 0 for buffers 
+	// allocated during initialization.
+	//
+	ULONG SlabIndex;
+
 #if defined( JPFBT_TARGET_KERNELMODE ) && defined( DBG )
 	PETHREAD OwningThread;
 	PVOID OwningThreadData;
@@ -234,6 +261,146 @@ typedef struct _JPFBT_BUFFER
 
 C_ASSERT( ( FIELD_OFFSET( JPFBT_BUFFER, Buffer ) % MEMORY_ALLOCATION_ALIGNMENT ) == 0 );
 
+#define JPFBT_CACHE_LINE_SIZE	64
+
+//
+// Upper bound for the number of buffer pools. Processors beyond
+// this limit share pools.
+//
+#define JPFBT_MAX_BUFFER_POOLS	64
+
+//
+// Upper bound for the number of slabs, including the (implicit)
+// slab of buffers allocated during initialization.
+//
+#define JPFBT_MAX_BUFFER_SLABS	32
+
+//
+// Intervals (in ms) in which the collector wakes up by itself to 
+// maintain slabs and, if triggers are disabled, while buffers run
+// short.
+//
+#define JPFBT_COLLECTOR_MAINTENANCE_INTERVAL	1000
+#define JPFBT_COLLECTOR_SHORTAGE_INTERVAL		10
+
+//
+// # of times the collector retries dequeueing a dirty buffer whose
+// producer has been preempted between publishing and linking it.
+//
+#define JPFBT_DIRTY_QUEUE_LINK_SPIN_COUNT		64
+
+//
+// Max # of partial buffers taken away from threads per walk of the
+// thread data list.
+//
+#define JPFBT_PARTIAL_BUFFER_FLUSH_BATCH		32
+
+/*++
+	Structure Description:
+		Slab of buffers allocated at runtime. The JPFBT_BUFFERs
+		immediately follow this structure.
+
+		May only be accessed while holding the collector lock.
+--*/
+typedef struct _JPFBT_BUFFER_SLAB
+{
+	ULONG BufferCount;
+
+	//
+	// # of buffers withdrawn from circulation since the slab
+	// has been retired. Once all buffers have been withdrawn, the
+	// slab is freed.
+	//
+	ULONG Reclaimed;
+
+	BOOLEAN Retiring;
+
+	UCHAR Padding[ 16 - 2 * sizeof( ULONG ) - sizeof( BOOLEAN ) ];
+} JPFBT_BUFFER_SLAB, *PJPFBT_BUFFER_SLAB;
+
+C_ASSERT( sizeof( JPFBT_BUFFER_SLAB ) % MEMORY_ALLOCATION_ALIGNMENT == 0 );
+
+/*++
+	Structure Description:
+		Per-processor buffer pool. Each pool occupies a cache line
+		of its own so that processors do not contend for list heads
+		while switching buffers.
+--*/
+typedef struct _JPFBT_BUFFER_POOL
+{
+	//
+	// List of free JPFBT_BUFFERs.
+	//
+	SLIST_HEADER FreeBuffersList;
+
+	//
+	// # of times the free list was found empty.
+	//
+	volatile LONG Depletions;
+
+	//
+	// # of buffers taken from the free lists of other pools.
+	//
+	volatile LONG Steals;
+
+	UCHAR Padding[ JPFBT_CACHE_LINE_SIZE - 
+		sizeof( SLIST_HEADER ) - 2 * sizeof( LONG ) ];
+} JPFBT_BUFFER_POOL, *PJPFBT_BUFFER_POOL;
+
+C_ASSERT( sizeof( JPFBT_BUFFER_POOL ) == JPFBT_CACHE_LINE_SIZE );
+
+/*++
+	Structure Description:
+		Queue of JPFBT_BUFFERs that contain data which has yet to 
+		be processed.
+
+		The queue is a FIFO s.t. buffers are processed in the order 
+		in which they became dirty, across all threads and 
+		processors. Producers enqueue by swapping a buffer into Last
+		and linking it to its predecessor afterwards, which takes a 
+		single interlocked operation. Only one consumer may dequeue
+		at a time.
+
+		Entries are linked via JPFBT_BUFFER::ListEntry. The producer
+		and consumer parts occupy separate cache lines.
+--*/
+typedef struct _JPFBT_DIRTY_QUEUE
+{
+	//
+	// Most recently enqueued entry.
+	//
+	PSLIST_ENTRY volatile Last;
+
+	//
+	// # of entries ever enqueued.
+	//
+	volatile LONG Enqueued;
+
+	UCHAR Padding1[ JPFBT_CACHE_LINE_SIZE - 
+		sizeof( PSLIST_ENTRY ) - sizeof( LONG ) ];
+
+	//
+	// Placeholder entry, on the queue whenever the queue would 
+	// otherwise run empty.
+	//
+	SLIST_ENTRY Stub;
+
+	//
+	// Oldest entry - owned by the consumer.
+	//
+	PSLIST_ENTRY First;
+
+	//
+	// # of entries ever dequeued.
+	//
+	volatile LONG Dequeued;
+
+	UCHAR Padding2[ JPFBT_CACHE_LINE_SIZE - 
+		sizeof( SLIST_ENTRY ) - sizeof( PSLIST_ENTRY ) - sizeof( LONG ) ];
+} JPFBT_DIRTY_QUEUE, *PJPFBT_DIRTY_QUEUE;
+
+C_ASSERT( sizeof( JPFBT_DIRTY_QUEUE ) == 2 * JPFBT_CACHE_LINE_SIZE );
+
 /*----------------------------------------------------------------------
  *
  * Thread data
@@ -277,9 +444,19 @@ typedef struct _JPFBT_THREAD_DATA
 	} u;
 
 	//
-	// Current buffer (obtained from FreeBuffersList).
+	// Current buffer (obtained from a pool's FreeBuffersList).
+	//
+	// The lowest bit (JPFBT_CURRENT_BUFFER_BUSY) is set while the
+	// thread is writing to the buffer. The collector may only take
+	// the buffer away while the bit is clear, see 
+	// JpfbtpReleaseCurrentBuffer.
+	//
+	PJPFBT_BUFFER volatile CurrentBuffer;
+
+	//
+	// Time (in ms) CurrentBuffer has been obtained.
 	//
-	PJPFBT_BUFFER CurrentBuffer;
+	ULONG CurrentBufferTime;
 
 	JPFBTP_THREAD_DATA_ALLOCATION_TYPE AllocationType;
 
@@ -304,6 +481,12 @@ typedef struct _JPFBT_THREAD_DATA
 	//
 	ULONG EventsCaptured;
 
+	//
+	// Frame of the call the current event is reported for, NULL
+	// while no event is being reported. See JpfbtGetActiveCall.
+	//
+	PJPFBT_THUNK_STACK_FRAME EventFrame;
+
 	JPFBT_THUNK_STACK ThunkStack;
 } JPFBT_THREAD_DATA, *PJPFBT_THREAD_DATA;
 
@@ -326,6 +509,38 @@ PJPFBT_THREAD_DATA JpfbtpGetCurrentThreadData();
 --*/
 VOID JpfbtpCheckForBufferOverflow();
 
+#define JPFBT_CURRENT_BUFFER_BUSY ( ( ULONG_PTR ) 1 )
+
+#define JpfbtpGetCurrentBufferPointer( ThreadData )				\
+	( ( PJPFBT_BUFFER ) ( ( ULONG_PTR ) ( ThreadData )->CurrentBuffer &	\
+		~JPFBT_CURRENT_BUFFER_BUSY ) )
+
+/*++
+	Routine Description:
+		Put the current buffer of a thread on the dirty queue and
+		reset CurrentBuffer. The caller must either be the owning 
+		thread having set JPFBT_CURRENT_BUFFER_BUSY or the thread
+		must not be running.
+
+		Callable at any IRQL.
+--*/
+VOID JpfbtpRetireCurrentBuffer(
+	__in PJPFBT_THREAD_DATA ThreadData
+	);
+
+/*++
+	Routine Description:
+		Called on the owning thread after an event routine has 
+		returned. Clears JPFBT_CURRENT_BUFFER_BUSY s.t. the 
+		collector may flush the buffer if the thread does not
+		fill it in time.
+
+		Callable at any IRQL.
+--*/
+VOID JpfbtpReleaseCurrentBuffer(
+	__in PJPFBT_THREAD_DATA ThreadData
+	);
+
 /*++
 	Routine Description:
 		Can be called during thread teardown. Any resources
@@ -486,26 +701,100 @@ struct _JPFBT_CODE_PATCH;
 typedef struct _JPFBT_GLOBAL_DATA
 {
 	//
-	// List of free JPFBT_BUFFERs.
+	// Per-processor buffer pools. The array is part of the same
+	// allocation and is located between the dirty queue and the 
+	// buffers.
 	//
-	SLIST_HEADER FreeBuffersList;
-	
+	ULONG PoolCount;
+	PJPFBT_BUFFER_POOL Pools;
+
+	//
+	// Dirty buffers. Part of the same allocation, located right
+	// after this structure.
 	//
-	// List of JPFBT_BUFFER that contain data which has yet to be
-	// processed.
+	PJPFBT_DIRTY_QUEUE DirtyQueue;
+
 	//
-	// N.B. This is a LIFO although only a FIFO would be semantically 
-	// correct to retain timed order. This stems from the fact that
-	// interlocked Slist-LIFOs are dirt cheap while a FIFO would require a 
-	// doubly linked list, which is not nearly as cheap to interlock.
+	// Lock serializing consumers of DirtyQueue.
 	//
-	SLIST_HEADER DirtyBuffersList;
+#if defined(JPFBT_TARGET_USERMODE)
+	CRITICAL_SECTION CollectorLock;
+#elif defined(JPFBT_TARGET_KERNELMODE)
+	KGUARDED_MUTEX CollectorLock;
+#endif
 
 	//
 	// Size of each buffer.
 	//
 	ULONG BufferSize;
 
+	//
+	// Buffers allocated at runtime. Except for GrowRequested and 
+	// LowWatermarkSignalled, all fields are guarded by CollectorLock.
+	//
+	struct
+	{
+		JPFBT_BUFFER_POOL_LIMITS Limits;
+
+		//
+		// # of buffers allocated during initialization.
+		//
+		ULONG InitialBufferCount;
+
+		//
+		// # of buffers in circulation, including the initial 
+		// ones.
+		//
+		ULONG BufferCount;
+
+		//
+		// Slab slots. Slot 0 stands for the initial buffers and
+		// is always NULL.
+		//
+		PJPFBT_BUFFER_SLAB Slots[ JPFBT_MAX_BUFFER_SLABS ];
+
+		//
+		// # of non-NULL slots.
+		//
+		ULONG Count;
+
+		//
+		// Time (in ms) a shortage of free buffers was last 
+		// observed.
+		//
+		ULONG LastShortageTime;
+
+		//
+		// Set by producers that found all free lists empty.
+		//
+		volatile LONG GrowRequested;
+
+		//
+		// Set by the first producer per collector run that found 
+		// its pool below its share of the low watermark, reset by
+		// the collector.
+		//
+		volatile LONG LowWatermarkSignalled;
+
+		//
+		// Free lists still to be swept for buffers of retiring 
+		// slabs, and the pool to be swept next. One pool is swept
+		// per collector round.
+		//
+		ULONG PendingSweeps;
+		ULONG NextSweepPool;
+
+		//
+		// Time (in ms) threads have last been checked for 
+		// partially filled buffers to be flushed.
+		//
+		ULONG LastFlushTime;
+
+		ULONG Allocated;
+		ULONG Released;
+		ULONG FailedAllocations;
+	} BufferSlabs;
+
 	struct
 	{
 		//
@@ -623,9 +912,17 @@ typedef struct _JPFBT_GLOBAL_DATA
 		volatile LONG EventsCaptured;
 		volatile LONG ExceptionsUnwindings;
 		volatile LONG ThreadTeardowns;
+		volatile LONG PartialBuffersFlushed;
+		volatile LONG LowWatermarkTriggers;
 	} Counters;
 
 	PVOID UserPointer;
+
+	//
+	// Stamp thunk stack frames on entry, see 
+	// JPFBT_FLAG_TRACK_ACTIVE_CALLS.
+	//
+	BOOLEAN TrackActiveCalls;
 	struct
 	{
 		JPFBT_EVENT_ROUTINE EntryEvent;
@@ -745,7 +1042,9 @@ NTSTATUS JpfbtpPatchCode(
 /*++
 	Routine Description:
 		Allocate enough memory to hold the global state structure as well
-		as [BufferSize] subsequent buffers. 
+		as the dirty queue, one pool per processor and [BufferSize] 
+		subsequent buffers. PoolCount, Pools and DirtyQueue are 
+		initialized.
 
 		KM: NonPaged memory is used.
 
@@ -777,6 +1076,17 @@ VOID JpfbtpInitializeBuffersGlobalState(
 	__in PJPFBT_GLOBAL_DATA GlobalState
 	);
 
+/*++
+	Routine Description:
+		Free all slabs allocated at runtime. To be called during
+		uninitialization, after the collector has been shut down.
+
+		Callable at IRQL <= DISPATCH_LEVEL.
+--*/
+VOID JpfbtpFreeBufferSlabs(
+	__in PJPFBT_GLOBAL_DATA GlobalState
+	);
+
 /*++
 	Routine Description:
 		Initialize the global buffer list and allocate buffers.
@@ -865,6 +1175,26 @@ VOID JpfbtpTriggerDirtyBufferCollection();
 --*/
 VOID JpfbtpShutdownDirtyBufferCollector();
 
+/*++
+	Routine Description:
+		Determine how long (in ms) the collector thread may wait
+		for a trigger before it has to look after slabs or
+		partially filled buffers.
+
+	Return Value:
+		Timeout or INFINITE.
+--*/
+ULONG JpfbtpGetBufferCollectorTimeout();
+
+/*++
+	Routine Description:
+		Stop flushing partially filled buffers. To be called during
+		uninitialization before thread data is freed.
+
+		Callable at IRQL <= APC_LEVEL.
+--*/
+VOID JpfbtpStopFlushingPartialBuffers();
+
 /*----------------------------------------------------------------------
  * 
  * Memory allocation.
@@ -163,6 +163,7 @@ NTSTATUS JpfbtpCreateGlobalState(
 	// Do kernel-specific initialization.
 	//
 	KeInitializeGuardedMutex( &TempState->PatchDatabase.Lock );
+	KeInitializeGuardedMutex( &TempState->CollectorLock );
 	KeInitializeEvent( 
 		&TempState->BufferCollectorEvent, 
 		SynchronizationEvent ,
@@ -247,6 +248,7 @@ VOID JpfbtpFreeGlobalState()
 		ASSERT( JpfbtpGlobalState->BufferCollectorThread == NULL );
 
 		JpfbtsFreePreallocatedThreadData( JpfbtpGlobalState );
+		JpfbtpFreeBufferSlabs( JpfbtpGlobalState );
 		JpfbtpFreeNonPagedMemory( JpfbtpGlobalState );
 		JpfbtpGlobalState = NULL;
 
@@ -435,22 +437,24 @@ static VOID JpfbtsBufferCollectorThreadProc(  __in PVOID Unused )
 
 	UNREFERENCED_PARAMETER( Unused );
 
-	if ( JpfbtpGlobalState->DisableTriggerBufferCollection )
+	while ( ! JpfbtpGlobalState->StopBufferCollector )
 	{
 		//
-		// If we specified INFINITE, nothing would happen as the
-		// event will not ever be signalled. Thus, specify a low
-		// timeout, which effetively is the a period.
+		// If triggers are disabled, specifying INFINITE would mean
+		// that nothing happens as the event will not ever be 
+		// signalled. Thus, JpfbtpGetBufferCollectorTimeout returns
+		// a low timeout, which effetively is the a period.
 		//
-		Timeout = 1 * 1000 * 1000 * 10;	// 1 second.
-	}
-	else
-	{
-		Timeout = INFINITE;
-	}
+		Timeout = JpfbtpGetBufferCollectorTimeout();
+		if ( Timeout != INFINITE )
+		{
+			//
+			// Convert to 100ns units. Waking up more often than 
+			// required is harmless, so avoid overflows by capping.
+			//
+			Timeout = min( Timeout, JPFBT_COLLECTOR_MAINTENANCE_INTERVAL ) * 10 * 1000;
+		}
 
-	while ( ! JpfbtpGlobalState->StopBufferCollector )
-	{
 		JpfbtProcessBuffers( 
 			JpfbtpGlobalState->Routines.ProcessBuffer,
 			Timeout,
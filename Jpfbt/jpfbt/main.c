@@ -59,7 +59,8 @@ NTSTATUS JpfbtInitializeEx(
 	if ( Flags > 
 		( JPFBT_FLAG_AUTOCOLLECT | 
 		  JPFBT_FLAG_DISABLE_LAZY_ALLOCATION |
-		  JPFBT_FLAG_DISABLE_EAGER_BUFFER_COLLECTION ) )
+		  JPFBT_FLAG_DISABLE_EAGER_BUFFER_COLLECTION |
+		  JPFBT_FLAG_TRACK_ACTIVE_CALLS ) )
 	{
 		return STATUS_INVALID_PARAMETER;
 	}
@@ -77,7 +78,8 @@ NTSTATUS JpfbtInitializeEx(
 	}
 
 #else
-	if ( Flags > JPFBT_FLAG_AUTOCOLLECT )
+	if ( ( Flags & ~( JPFBT_FLAG_AUTOCOLLECT | 
+					  JPFBT_FLAG_TRACK_ACTIVE_CALLS ) ) != 0 )
 	{
 		return STATUS_INVALID_PARAMETER;
 	}
@@ -127,6 +129,8 @@ NTSTATUS JpfbtInitializeEx(
 #endif
 
 	JpfbtpGlobalState->UserPointer			  = UserPointer;
+	JpfbtpGlobalState->TrackActiveCalls		  = 
+		( Flags & JPFBT_FLAG_TRACK_ACTIVE_CALLS ) ? TRUE : FALSE;
 
 	JpfbtpGlobalState->Routines.EntryEvent	  = EntryEventRoutine;
 	JpfbtpGlobalState->Routines.ExitEvent	  = ExitEventRoutine;
@@ -181,6 +185,11 @@ NTSTATUS JpfbtUninitialize()
 	// From now on, operations are not threadsafe any more!
 	//
 
+	//
+	// Keep the collector from accessing per-thread data.
+	//
+	JpfbtpStopFlushingPartialBuffers();
+
 	//
 	// Free per-thread data. As we do not need to be threadsafe any
 	// more, we can safely walk the list and not use ExInterlocked*
@@ -224,14 +233,12 @@ NTSTATUS JpfbtUninitialize()
 		ASSERT( ThreadData->ThunkStack.Stack[ JPFBT_THUNK_STACK_LOCATIONS - 1 ].Procedure == 0xDEADBEEF );
 		ASSERT( ThreadData->ThunkStack.Stack[ JPFBT_THUNK_STACK_LOCATIONS - 1 ].ReturnAddress == 0xDEADBEEF );
 
-		if ( ThreadData->CurrentBuffer )
+		if ( JpfbtpGetCurrentBufferPointer( ThreadData ) != NULL )
 		{
 			//
 			// Get rid of old, dirty buffer.
 			//
-			InterlockedPushEntrySList( 
-				&JpfbtpGlobalState->DirtyBuffersList,
-				&ThreadData->CurrentBuffer->ListEntry );
+			JpfbtpRetireCurrentBuffer( ThreadData );
 		}
 
 		//
@@ -275,6 +282,8 @@ NTSTATUS JpfbtQueryStatistics(
 	__out PJPFBT_STATISTICS Statistics
 	)
 {
+	ULONG Index;
+
 	if ( Statistics == NULL )
 	{
 		return STATUS_INVALID_PARAMETER;
@@ -288,15 +297,34 @@ NTSTATUS JpfbtQueryStatistics(
 	Statistics->PatchCount = JphtGetEntryCountHashtable(
 		&JpfbtpGlobalState->PatchDatabase.PatchTable );
 
-	Statistics->Buffers.Free = ExQueryDepthSList(
-		&JpfbtpGlobalState->FreeBuffersList );
+	Statistics->Buffers.Free			= 0;
+	Statistics->Buffers.Dirty			= ( ULONG ) ( 
+		JpfbtpGlobalState->DirtyQueue->Enqueued - 
+		JpfbtpGlobalState->DirtyQueue->Dequeued );
+	Statistics->BufferPools.Count		= JpfbtpGlobalState->PoolCount;
+	Statistics->BufferPools.Depletions	= 0;
+	Statistics->BufferPools.Steals		= 0;
 
-	Statistics->Buffers.Dirty = ExQueryDepthSList(
-		&JpfbtpGlobalState->DirtyBuffersList );
+	for ( Index = 0; Index < JpfbtpGlobalState->PoolCount; Index++ )
+	{
+		PJPFBT_BUFFER_POOL Pool = &JpfbtpGlobalState->Pools[ Index ];
+
+		Statistics->Buffers.Free			+= ExQueryDepthSList( &Pool->FreeBuffersList );
+		Statistics->BufferPools.Depletions	+= Pool->Depletions;
+		Statistics->BufferPools.Steals		+= Pool->Steals;
+	}
 
 	Statistics->Buffers.Collected = 
 		JpfbtpGlobalState->Counters.NumberOfBuffersCollected;
 
+	Statistics->BufferSlabs.BufferCount			= JpfbtpGlobalState->BufferSlabs.BufferCount;
+	Statistics->BufferSlabs.Count				= JpfbtpGlobalState->BufferSlabs.Count;
+	Statistics->BufferSlabs.Allocated			= JpfbtpGlobalState->BufferSlabs.Allocated;
+	Statistics->BufferSlabs.Released			= JpfbtpGlobalState->BufferSlabs.Released;
+	Statistics->BufferSlabs.FailedAllocations	= JpfbtpGlobalState->BufferSlabs.FailedAllocations;
+	Statistics->Collector.PartialBuffersFlushed	= JpfbtpGlobalState->Counters.PartialBuffersFlushed;
+	Statistics->Collector.LowWatermarkTriggers	= JpfbtpGlobalState->Counters.LowWatermarkTriggers;
+
 #if defined(JPFBT_TARGET_KERNELMODE)
 	Statistics->ThreadData.FreePreallocationPoolSize = ExQueryDepthSList( 
 		&JpfbtpGlobalState->ThreadDataPreallocationList );
@@ -319,5 +347,42 @@ NTSTATUS JpfbtQueryStatistics(
 	Statistics->ThreadTeardowns = 
 		JpfbtpGlobalState->Counters.ThreadTeardowns;
 
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS JpfbtQueryBufferPoolStatistics(
+	__in ULONG MaxPools,
+	__out_ecount_part( MaxPools, *PoolCount ) PJPFBT_BUFFER_POOL_STATISTICS Pools,
+	__out PULONG PoolCount
+	)
+{
+	ULONG Index;
+
+	if ( Pools == NULL || PoolCount == NULL )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ( JpfbtpGlobalState == NULL )
+	{
+		return STATUS_FBT_NOT_INITIALIZED;
+	}
+
+	*PoolCount = JpfbtpGlobalState->PoolCount;
+
+	if ( MaxPools < JpfbtpGlobalState->PoolCount )
+	{
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	for ( Index = 0; Index < JpfbtpGlobalState->PoolCount; Index++ )
+	{
+		PJPFBT_BUFFER_POOL Pool = &JpfbtpGlobalState->Pools[ Index ];
+
+		Pools[ Index ].Free			= ExQueryDepthSList( &Pool->FreeBuffersList );
+		Pools[ Index ].Depletions	= Pool->Depletions;
+		Pools[ Index ].Steals		= Pool->Steals;
+	}
+
 	return STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -10,6 +10,10 @@
 #include <jpfbt.h>
 #include "jpfbtp.h"
 
+#if defined(JPFBT_TARGET_USERMODE)
+#include <intrin.h>
+#endif
+
 extern EXCEPTION_DISPOSITION JpfbtpThunkExceptionHandlerThunk();
 extern EXCEPTION_DISPOSITION JpfbtpUnwindThunkstackThunk();
 
@@ -54,13 +58,37 @@ VOID __stdcall JpfbtpProcedureEntry(
 	__in PVOID Function
 	)
 {
+	PJPFBT_THUNK_STACK_FRAME Frame;
+	PJPFBT_THREAD_DATA ThreadData;
+
+	//
+	// N.B. The thunk has obtained the thunk stack, so ThreadData
+	// cannot be NULL. The frame has already been pushed.
+	//
+	ThreadData = JpfbtpGetCurrentThreadData();
+	ASSERT( ThreadData != NULL );
+	__assume( ThreadData != NULL );
+
+	Frame = ThreadData->ThunkStack.StackPointer;
+	if ( JpfbtpGlobalState->TrackActiveCalls )
+	{
+		Frame->Flags			= 0;
+		Frame->EntryTimestamp	= __rdtsc();
+	}
+
 	if ( JpfbtpGlobalState->Routines.EntryEvent )
 	{
+		ThreadData->EventFrame	= Frame;
+
 		JpfbtpGlobalState->Routines.EntryEvent( 
 			Context, 
 			Function,
 			JpfbtpGlobalState->UserPointer );
+
+		ThreadData->EventFrame	= NULL;
+
 		JpfbtpCheckForBufferOverflow();
+		JpfbtpReleaseCurrentBuffer( ThreadData );
 	}
 }
 
@@ -77,14 +105,75 @@ VOID __stdcall JpfbtpProcedureExit(
 	__in PVOID Function
 	)
 {
+	PJPFBT_THREAD_DATA ThreadData;
+
 	if ( JpfbtpGlobalState->Routines.ExitEvent )
 	{
+		ThreadData = JpfbtpGetCurrentThreadData();
+		ASSERT( ThreadData != NULL );
+		__assume( ThreadData != NULL );
+
+		//
+		// The thunk has already popped the frame, but it is left
+		// intact until the next entry.
+		//
+		ThreadData->EventFrame = ThreadData->ThunkStack.StackPointer - 1;
+		ASSERT( ThreadData->EventFrame->Procedure == ( ULONG_PTR ) Function );
+
 		JpfbtpGlobalState->Routines.ExitEvent( 
 			Context, 
 			Function,
 			JpfbtpGlobalState->UserPointer );
+
+		ThreadData->EventFrame = NULL;
+
 		JpfbtpCheckForBufferOverflow();
+		JpfbtpReleaseCurrentBuffer( ThreadData );
+	}
+}
+
+BOOLEAN JPFBTCALLTYPE JpfbtGetActiveCall(
+	__in ULONG Depth,
+	__out PJPFBT_ACTIVE_CALL Call
+	)
+{
+	PJPFBT_THUNK_STACK_FRAME Bottom;
+	PJPFBT_THUNK_STACK_FRAME Frame;
+	PJPFBT_THREAD_DATA ThreadData;
+
+	ASSERT( Call != NULL );
+
+	ThreadData = JpfbtpGetCurrentThreadData();
+	if ( ThreadData == NULL || ThreadData->EventFrame == NULL )
+	{
+		return FALSE;
 	}
+
+	//
+	// The stack grows downwards, callers reside above EventFrame.
+	//
+	Bottom = &ThreadData->ThunkStack.Stack[ JPFBT_THUNK_STACK_LOCATIONS - 1 ];
+	if ( Depth >= ( ULONG ) ( Bottom - ThreadData->EventFrame ) )
+	{
+		return FALSE;
+	}
+
+	Frame = ThreadData->EventFrame + Depth;
+
+	Call->Procedure			= ( PVOID ) Frame->Procedure;
+	Call->ReturnAddress		= Frame->ReturnAddress;
+	if ( JpfbtpGlobalState->TrackActiveCalls )
+	{
+		Call->EntryTimestamp	= Frame->EntryTimestamp;
+		Call->Flags				= &Frame->Flags;
+	}
+	else
+	{
+		Call->EntryTimestamp	= 0;
+		Call->Flags				= NULL;
+	}
+
+	return TRUE;
 }
 
 /*++
@@ -330,10 +419,16 @@ EXCEPTION_DISPOSITION JpfbtpUnwindThunkstack(
 	//
 	if ( JpfbtpGlobalState->Routines.ExceptionEvent != NULL )
 	{
+		ThreadData->EventFrame = ThreadData->ThunkStack.StackPointer;
+
 		( JpfbtpGlobalState->Routines.ExceptionEvent )(
 			ThreadData->PendingException,
 			( PVOID ) ThreadData->ThunkStack.StackPointer->Procedure,
 			JpfbtpGlobalState->UserPointer );
+
+		ThreadData->EventFrame = NULL;
+
+		JpfbtpReleaseCurrentBuffer( ThreadData );
 	}
 
 	//
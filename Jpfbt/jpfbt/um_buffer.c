@@ -126,6 +126,7 @@ NTSTATUS JpfbtpCreateGlobalState(
 	}
 
 	InitializeCriticalSection( &TempState->PatchDatabase.Lock );
+	InitializeCriticalSection( &TempState->CollectorLock );
 
 	JpfbtsThreadDataTlsIndex = TlsIndex;
 	JpfbtpGlobalState = TempState;
@@ -177,6 +178,7 @@ VOID JpfbtpFreeGlobalState()
 		VERIFY( HeapDestroy( JpfbtpGlobalState->PatchDatabase.SpecialHeap ) );
 		
 		DeleteCriticalSection( &JpfbtpGlobalState->PatchDatabase.Lock );
+		DeleteCriticalSection( &JpfbtpGlobalState->CollectorLock );
 
 		VERIFY( TlsFree( JpfbtsThreadDataTlsIndex ) );
 		JpfbtsThreadDataTlsIndex = TLS_OUT_OF_INDEXES;
@@ -187,6 +189,7 @@ VOID JpfbtpFreeGlobalState()
 		ASSERT( JpfbtpGlobalState->BufferCollectorThread == NULL );
 		ASSERT( JpfbtpGlobalState->BufferCollectorEvent == NULL );
 
+		JpfbtpFreeBufferSlabs( JpfbtpGlobalState );
 		JpfbtpFreeNonPagedMemory( JpfbtpGlobalState );
 		JpfbtpGlobalState = NULL;
 	}
@@ -265,7 +268,7 @@ static ULONG CALLBACK JpfbtsBufferCollectorThreadProc( __in PVOID Unused )
 	{
 		JpfbtProcessBuffers( 
 			JpfbtpGlobalState->Routines.ProcessBuffer,
-			INFINITE,
+			JpfbtpGetBufferCollectorTimeout(),
 			JpfbtpGlobalState->UserPointer );
 	}
 
@@ -0,0 +1,790 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for the per-processor buffer pools, the order
+ *		in which buffers are processed and growing/shrinking
+ *		the set of buffers.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include "test.h"
+
+#define PRODUCER_THREAD_COUNT	8
+#define RECORDS_PER_THREAD		20000
+#define BUFFER_COUNT			32
+#define BUFFER_SIZE				64
+#define RECORDS_PER_ORDER_THREAD	12
+#define SLAB_BUFFER_COUNT		16
+
+typedef struct _RECORD
+{
+	ULONG Producer;
+	ULONG Sequence;
+} RECORD, *PRECORD;
+
+typedef struct _POOL_TEST_STATE
+{
+	//
+	// Per-producer state.
+	//
+	struct
+	{
+		ULONG ThreadId;
+		ULONG NextSequence;
+	} Producers[ PRODUCER_THREAD_COUNT ];
+
+	volatile LONG ProducersRunning;
+	ULONG NextGlobalSequence;
+	ULONG RecordsProcessed;
+	ULONG BuffersProcessed;
+} POOL_TEST_STATE, *PPOOL_TEST_STATE;
+
+static POOL_TEST_STATE State;
+
+static VOID __stdcall ProcedureEvent(
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Function,
+	__in_opt PVOID UserPointer
+	)
+{
+	UNREFERENCED_PARAMETER( Context );
+	UNREFERENCED_PARAMETER( Function );
+	UNREFERENCED_PARAMETER( UserPointer );
+}
+
+/*++
+	Routine Description:
+		Check that the records of each producer arrive completely
+		and in order.
+--*/
+static VOID ProcessBuffer(
+	__in SIZE_T BufferSize,
+	__in_bcount(BufferSize) PUCHAR Buffer,
+	__in ULONG ProcessId,
+	__in ULONG ThreadId,
+	__in_opt PVOID UserPointer
+	)
+{
+	PPOOL_TEST_STATE TestState = ( PPOOL_TEST_STATE ) UserPointer;
+	PRECORD Record = ( PRECORD ) Buffer;
+	ULONG Index;
+
+	TEST( TestState == &State );
+	TEST( ProcessId == GetCurrentProcessId() );
+	TEST( BufferSize > 0 );
+	TEST( BufferSize % sizeof( RECORD ) == 0 );
+
+	for ( Index = 0; Index < BufferSize / sizeof( RECORD ); Index++ )
+	{
+		TEST( Record[ Index ].Producer < PRODUCER_THREAD_COUNT );
+		TEST( TestState->Producers[ Record[ Index ].Producer ].ThreadId == ThreadId );
+		TEST( TestState->Producers[ Record[ Index ].Producer ].NextSequence ==
+			  Record[ Index ].Sequence );
+
+		TestState->Producers[ Record[ Index ].Producer ].NextSequence++;
+		TestState->RecordsProcessed++;
+	}
+
+	TestState->BuffersProcessed++;
+}
+
+/*++
+	Routine Description:
+		Check that records arrive in the order they have been
+		written, regardless of the producer.
+--*/
+static VOID ProcessBufferInOrder(
+	__in SIZE_T BufferSize,
+	__in_bcount(BufferSize) PUCHAR Buffer,
+	__in ULONG ProcessId,
+	__in ULONG ThreadId,
+	__in_opt PVOID UserPointer
+	)
+{
+	PPOOL_TEST_STATE TestState = ( PPOOL_TEST_STATE ) UserPointer;
+	PRECORD Record = ( PRECORD ) Buffer;
+	ULONG Index;
+
+	TEST( TestState == &State );
+	TEST( ProcessId == GetCurrentProcessId() );
+	TEST( BufferSize % sizeof( RECORD ) == 0 );
+
+	for ( Index = 0; Index < BufferSize / sizeof( RECORD ); Index++ )
+	{
+		TEST( Record[ Index ].Producer < PRODUCER_THREAD_COUNT );
+		TEST( TestState->Producers[ Record[ Index ].Producer ].ThreadId == ThreadId );
+		TEST( TestState->NextGlobalSequence == Record[ Index ].Sequence );
+
+		TestState->NextGlobalSequence++;
+		TestState->RecordsProcessed++;
+	}
+
+	TestState->BuffersProcessed++;
+}
+
+static DWORD CALLBACK ProducerThreadProc(
+	__in PVOID Parameter
+	)
+{
+	ULONG Producer = ( ULONG ) ( ULONG_PTR ) Parameter;
+	ULONG Sequence;
+
+	State.Producers[ Producer ].ThreadId = GetCurrentThreadId();
+
+	for ( Sequence = 0; Sequence < RECORDS_PER_THREAD; Sequence++ )
+	{
+		PRECORD Record;
+
+		//
+		// The pools are kept small, so expect to run dry every
+		// now and then.
+		//
+		while ( ( Record = ( PRECORD ) JpfbtGetBuffer( sizeof( RECORD ) ) ) == NULL )
+		{
+			SwitchToThread();
+		}
+
+		Record->Producer = Producer;
+		Record->Sequence = Sequence;
+
+		JpfbtCompleteBuffer();
+	}
+
+	//
+	// Hand out partially filled buffer.
+	//
+	JpfbtCleanupThread( NULL );
+
+	InterlockedDecrement( &State.ProducersRunning );
+	return 0;
+}
+
+static DWORD CALLBACK OrderedProducerThreadProc(
+	__in PVOID Parameter
+	)
+{
+	ULONG Producer = ( ULONG ) ( ULONG_PTR ) Parameter;
+	ULONG Index;
+
+	State.Producers[ Producer ].ThreadId = GetCurrentThreadId();
+
+	for ( Index = 0; Index < RECORDS_PER_ORDER_THREAD; Index++ )
+	{
+		PRECORD Record = ( PRECORD ) JpfbtGetBuffer( sizeof( RECORD ) );
+		TEST( Record != NULL );
+		if ( Record == NULL )
+		{
+			break;
+		}
+
+		Record->Producer = Producer;
+		Record->Sequence = State.NextGlobalSequence++;
+
+		JpfbtCompleteBuffer();
+	}
+
+	JpfbtCleanupThread( NULL );
+	return 0;
+}
+
+/*++
+	Routine Description:
+		Run OrderedProducerThreadProc on a new thread and wait for
+		it to finish.
+--*/
+static VOID RunOrderedProducer(
+	__in ULONG Producer
+	)
+{
+	HANDLE Thread = CfixCreateThread(
+		NULL,
+		0,
+		OrderedProducerThreadProc,
+		( PVOID ) ( ULONG_PTR ) Producer,
+		0,
+		NULL );
+	TEST( Thread );
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( Thread, INFINITE ) );
+	TEST( CloseHandle( Thread ) );
+}
+
+static VOID CheckPoolStatistics()
+{
+	ULONG Index;
+	JPFBT_BUFFER_POOL_STATISTICS Pools[ 64 ];
+	ULONG PoolCount;
+	JPFBT_STATISTICS Statistics;
+	JPFBT_BUFFER_POOL_STATISTICS Totals = { 0 };
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.BufferPools.Count > 0 );
+	TEST( Statistics.BufferPools.Count <= BUFFER_COUNT );
+	TEST( Statistics.BufferPools.Steals <= Statistics.BufferPools.Depletions );
+
+	//
+	// All buffers have been collected.
+	//
+	TEST( Statistics.Buffers.Free == BUFFER_COUNT );
+	TEST( Statistics.Buffers.Dirty == 0 );
+
+	TEST_STATUS( STATUS_INVALID_PARAMETER,
+		JpfbtQueryBufferPoolStatistics( 0, NULL, &PoolCount ) );
+	TEST_STATUS( STATUS_BUFFER_TOO_SMALL,
+		JpfbtQueryBufferPoolStatistics( 0, Pools, &PoolCount ) );
+	TEST( PoolCount == Statistics.BufferPools.Count );
+
+	TEST_SUCCESS( JpfbtQueryBufferPoolStatistics(
+		_countof( Pools ), Pools, &PoolCount ) );
+	TEST( PoolCount == Statistics.BufferPools.Count );
+
+	for ( Index = 0; Index < PoolCount; Index++ )
+	{
+		Totals.Free			+= Pools[ Index ].Free;
+		Totals.Depletions	+= Pools[ Index ].Depletions;
+		Totals.Steals		+= Pools[ Index ].Steals;
+	}
+
+	TEST( Totals.Free == Statistics.Buffers.Free );
+	TEST( Totals.Depletions == Statistics.BufferPools.Depletions );
+	TEST( Totals.Steals == Statistics.BufferPools.Steals );
+}
+
+static VOID StressBufferPools()
+{
+	ULONG Index;
+	HANDLE Threads[ PRODUCER_THREAD_COUNT ];
+
+	ZeroMemory( &State, sizeof( POOL_TEST_STATE ) );
+	State.ProducersRunning = PRODUCER_THREAD_COUNT;
+
+	TEST_SUCCESS( JpfbtInitialize(
+		BUFFER_COUNT,
+		BUFFER_SIZE,
+		0,
+		ProcedureEvent,
+		ProcedureEvent,
+		ProcessBuffer,
+		&State ) );
+
+	for ( Index = 0; Index < PRODUCER_THREAD_COUNT; Index++ )
+	{
+		Threads[ Index ] = CfixCreateThread(
+			NULL,
+			0,
+			ProducerThreadProc,
+			( PVOID ) ( ULONG_PTR ) Index,
+			0,
+			NULL );
+		TEST( Threads[ Index ] );
+	}
+
+	//
+	// Collect while the producers are running...
+	//
+	while ( State.ProducersRunning > 0 )
+	{
+		NTSTATUS Status = JpfbtProcessBuffers( ProcessBuffer, 10, &State );
+		TEST( Status == STATUS_SUCCESS || Status == STATUS_TIMEOUT );
+	}
+
+	TEST( WAIT_OBJECT_0 == WaitForMultipleObjects(
+		_countof( Threads ), Threads, TRUE, INFINITE ) );
+
+	for ( Index = 0; Index < PRODUCER_THREAD_COUNT; Index++ )
+	{
+		TEST( CloseHandle( Threads[ Index ] ) );
+	}
+
+	//
+	// ...and drain the rest.
+	//
+	while ( STATUS_TIMEOUT != JpfbtProcessBuffers( ProcessBuffer, 0, &State ) );
+
+	for ( Index = 0; Index < PRODUCER_THREAD_COUNT; Index++ )
+	{
+		TEST( State.Producers[ Index ].NextSequence == RECORDS_PER_THREAD );
+	}
+
+	TEST( State.RecordsProcessed == PRODUCER_THREAD_COUNT * RECORDS_PER_THREAD );
+
+	CheckPoolStatistics();
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+}
+
+/*++
+	Routine Description:
+		Let producers run one after another, each on a different
+		thread (and thus, likely on a different pool), and check 
+		that buffers are processed in the order they have been
+		retired.
+--*/
+static VOID ProcessBuffersInGlobalOrder()
+{
+	ULONG Index;
+	JPFBT_STATISTICS Statistics;
+
+	ZeroMemory( &State, sizeof( POOL_TEST_STATE ) );
+
+	TEST_SUCCESS( JpfbtInitialize(
+		BUFFER_COUNT,
+		BUFFER_SIZE,
+		0,
+		ProcedureEvent,
+		ProcedureEvent,
+		ProcessBufferInOrder,
+		&State ) );
+
+	for ( Index = 0; Index < PRODUCER_THREAD_COUNT; Index++ )
+	{
+		RunOrderedProducer( Index );
+	}
+
+	//
+	// Nothing has been collected so far, so all buffers are 
+	// still queued.
+	//
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Buffers.Dirty > PRODUCER_THREAD_COUNT );
+	TEST( Statistics.Buffers.Free + Statistics.Buffers.Dirty == BUFFER_COUNT );
+
+	State.NextGlobalSequence = 0;
+	while ( STATUS_TIMEOUT != JpfbtProcessBuffers( ProcessBufferInOrder, 0, &State ) );
+
+	TEST( State.NextGlobalSequence == PRODUCER_THREAD_COUNT * RECORDS_PER_ORDER_THREAD );
+	TEST( State.RecordsProcessed == PRODUCER_THREAD_COUNT * RECORDS_PER_ORDER_THREAD );
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Buffers.Free == BUFFER_COUNT );
+	TEST( Statistics.Buffers.Dirty == 0 );
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+}
+
+static ULONG WriteSequence;
+static HANDLE BuffersBusyEvent;
+static HANDLE ReleaseBuffersEvent;
+
+/*++
+	Routine Description:
+		Write a record on the current thread.
+
+	Return Value:
+		FALSE if out of buffers.
+--*/
+static BOOL WriteRecord()
+{
+	PRECORD Record = ( PRECORD ) JpfbtGetBuffer( sizeof( RECORD ) );
+	if ( Record == NULL )
+	{
+		return FALSE;
+	}
+
+	Record->Producer = 0;
+	Record->Sequence = WriteSequence++;
+
+	JpfbtCompleteBuffer();
+	return TRUE;
+}
+
+static DWORD CALLBACK ExhaustBuffersThreadProc(
+	__in PVOID Unused
+	)
+{
+	UNREFERENCED_PARAMETER( Unused );
+
+	State.Producers[ 0 ].ThreadId = GetCurrentThreadId();
+
+	while ( WriteRecord() );
+
+	JpfbtCleanupThread( NULL );
+	return 0;
+}
+
+/*++
+	Routine Description:
+		Take all free buffers and keep the last one until 
+		ReleaseBuffersEvent is signalled.
+--*/
+static DWORD CALLBACK HoldBuffersThreadProc(
+	__in PVOID Unused
+	)
+{
+	JPFBT_STATISTICS Statistics;
+
+	UNREFERENCED_PARAMETER( Unused );
+
+	State.Producers[ 0 ].ThreadId = GetCurrentThreadId();
+
+	do
+	{
+		TEST( WriteRecord() );
+		TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	} while ( Statistics.Buffers.Free > 0 );
+
+	TEST( SetEvent( BuffersBusyEvent ) );
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( ReleaseBuffersEvent, INFINITE ) );
+
+	JpfbtCleanupThread( NULL );
+	return 0;
+}
+
+static HANDLE StartProducer(
+	__in LPTHREAD_START_ROUTINE Routine
+	)
+{
+	HANDLE Thread = CfixCreateThread(
+		NULL,
+		0,
+		Routine,
+		NULL,
+		0,
+		NULL );
+	TEST( Thread );
+	return Thread;
+}
+
+static VOID JoinProducer(
+	__in HANDLE Thread
+	)
+{
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( Thread, INFINITE ) );
+	TEST( CloseHandle( Thread ) );
+}
+
+static VOID DrainBuffers()
+{
+	while ( STATUS_TIMEOUT != JpfbtProcessBuffers( ProcessBufferInOrder, 0, &State ) );
+}
+
+/*++
+	Routine Description:
+		Run enough collector rounds for free buffers of retired 
+		slabs to be swept off all free lists - one pool is swept
+		per round.
+--*/
+static VOID SweepBufferPools()
+{
+	ULONG Round;
+	JPFBT_STATISTICS Statistics;
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+
+	for ( Round = 0; Round < Statistics.BufferPools.Count; Round++ )
+	{
+		DrainBuffers();
+	}
+}
+
+static VOID CheckSlabs(
+	__in ULONG BufferCount,
+	__in ULONG Count,
+	__in ULONG Allocated,
+	__in ULONG Released
+	)
+{
+	JPFBT_STATISTICS Statistics;
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.BufferSlabs.BufferCount == BufferCount );
+	TEST( Statistics.BufferSlabs.Count == Count );
+	TEST( Statistics.BufferSlabs.Allocated == Allocated );
+	TEST( Statistics.BufferSlabs.Released == Released );
+	TEST( Statistics.BufferSlabs.FailedAllocations == 0 );
+}
+
+static VOID GrowAndShrinkBufferPool()
+{
+	JPFBT_BUFFER_POOL_LIMITS Limits;
+	JPFBT_STATISTICS Statistics;
+	HANDLE Thread;
+
+	ZeroMemory( &State, sizeof( POOL_TEST_STATE ) );
+	WriteSequence = 0;
+
+	BuffersBusyEvent	= CreateEvent( NULL, FALSE, FALSE, NULL );
+	ReleaseBuffersEvent	= CreateEvent( NULL, FALSE, FALSE, NULL );
+	TEST( BuffersBusyEvent != NULL );
+	TEST( ReleaseBuffersEvent != NULL );
+
+	TEST_SUCCESS( JpfbtInitialize(
+		BUFFER_COUNT,
+		BUFFER_SIZE,
+		0,
+		ProcedureEvent,
+		ProcedureEvent,
+		ProcessBufferInOrder,
+		&State ) );
+
+	CheckSlabs( BUFFER_COUNT, 0, 0, 0 );
+
+	Limits.MaxBufferCount		= BUFFER_COUNT + 2 * SLAB_BUFFER_COUNT;
+	Limits.SlabBufferCount		= 0;
+	Limits.LowWatermark			= 4;
+	Limits.IdleReleaseTimeout	= 0;
+
+	TEST_STATUS( STATUS_INVALID_PARAMETER, JpfbtSetBufferPoolLimits( NULL ) );
+	TEST_STATUS( STATUS_INVALID_PARAMETER, JpfbtSetBufferPoolLimits( &Limits ) );
+
+	Limits.SlabBufferCount		= SLAB_BUFFER_COUNT;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	//
+	// Running out of buffers lets the collector add a slab...
+	//
+	JoinProducer( StartProducer( ExhaustBuffersThreadProc ) );
+	DrainBuffers();
+	CheckSlabs( BUFFER_COUNT + SLAB_BUFFER_COUNT, 1, 1, 0 );
+
+	JoinProducer( StartProducer( ExhaustBuffersThreadProc ) );
+	DrainBuffers();
+	CheckSlabs( BUFFER_COUNT + 2 * SLAB_BUFFER_COUNT, 2, 2, 0 );
+
+	//
+	// ...until MaxBufferCount has been reached.
+	//
+	JoinProducer( StartProducer( ExhaustBuffersThreadProc ) );
+	DrainBuffers();
+	CheckSlabs( BUFFER_COUNT + 2 * SLAB_BUFFER_COUNT, 2, 2, 0 );
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Buffers.Free == BUFFER_COUNT + 2 * SLAB_BUFFER_COUNT );
+
+	//
+	// Keep all buffers busy, then lower the limit. Slabs are 
+	// released one at a time, the buffer still in use is 
+	// withdrawn once it has been processed.
+	//
+	Thread = StartProducer( HoldBuffersThreadProc );
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( BuffersBusyEvent, INFINITE ) );
+
+	Limits.MaxBufferCount = BUFFER_COUNT;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	TEST_SUCCESS( JpfbtProcessBuffers( ProcessBufferInOrder, 0, &State ) );
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.BufferSlabs.BufferCount == BUFFER_COUNT + SLAB_BUFFER_COUNT );
+
+	TEST_STATUS( STATUS_TIMEOUT, JpfbtProcessBuffers( ProcessBufferInOrder, 0, &State ) );
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.BufferSlabs.BufferCount == BUFFER_COUNT );
+
+	TEST( SetEvent( ReleaseBuffersEvent ) );
+	JoinProducer( Thread );
+	DrainBuffers();
+	SweepBufferPools();
+	CheckSlabs( BUFFER_COUNT, 0, 2, 2 );
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Buffers.Free == BUFFER_COUNT );
+
+	//
+	// Idle slabs are released after IdleReleaseTimeout.
+	//
+	Limits.MaxBufferCount		= BUFFER_COUNT + SLAB_BUFFER_COUNT;
+	Limits.IdleReleaseTimeout	= 1;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	JoinProducer( StartProducer( ExhaustBuffersThreadProc ) );
+	DrainBuffers();
+	CheckSlabs( BUFFER_COUNT + SLAB_BUFFER_COUNT, 1, 3, 2 );
+
+	//
+	// No release unless another slab worth of buffers would remain
+	// above the low watermark.
+	//
+	Limits.LowWatermark = BUFFER_COUNT - SLAB_BUFFER_COUNT + 1;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	Sleep( 50 );
+	DrainBuffers();
+	SweepBufferPools();
+	CheckSlabs( BUFFER_COUNT + SLAB_BUFFER_COUNT, 1, 3, 2 );
+
+	Limits.LowWatermark = 4;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	//
+	// Retired slab is only released once all pools have been swept.
+	//
+	Sleep( 50 );
+	DrainBuffers();
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.BufferSlabs.BufferCount == BUFFER_COUNT );
+
+	SweepBufferPools();
+	CheckSlabs( BUFFER_COUNT, 0, 3, 3 );
+
+	TEST( State.NextGlobalSequence == WriteSequence );
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+
+	TEST( CloseHandle( BuffersBusyEvent ) );
+	TEST( CloseHandle( ReleaseBuffersEvent ) );
+}
+
+/*++
+	Routine Description:
+		Write a record, but only complete the buffer after 
+		ReleaseBuffersEvent has been signalled.
+--*/
+static DWORD CALLBACK DirectWriterThreadProc(
+	__in PVOID Unused
+	)
+{
+	PRECORD Record;
+
+	UNREFERENCED_PARAMETER( Unused );
+
+	State.Producers[ 0 ].ThreadId = GetCurrentThreadId();
+
+	Record = ( PRECORD ) JpfbtGetBuffer( sizeof( RECORD ) );
+	TEST( Record != NULL );
+	if ( Record != NULL )
+	{
+		Record->Producer = 0;
+		Record->Sequence = WriteSequence++;
+	}
+
+	TEST( SetEvent( BuffersBusyEvent ) );
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( ReleaseBuffersEvent, INFINITE ) );
+
+	JpfbtCompleteBuffer();
+
+	TEST( SetEvent( BuffersBusyEvent ) );
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( ReleaseBuffersEvent, INFINITE ) );
+
+	JpfbtCleanupThread( NULL );
+	return 0;
+}
+
+static VOID FlushPartialBufferOfDirectWriter()
+{
+	JPFBT_BUFFER_POOL_LIMITS Limits;
+	JPFBT_STATISTICS Statistics;
+	HANDLE Thread;
+
+	ZeroMemory( &State, sizeof( POOL_TEST_STATE ) );
+	WriteSequence = 0;
+
+	BuffersBusyEvent	= CreateEvent( NULL, FALSE, FALSE, NULL );
+	ReleaseBuffersEvent	= CreateEvent( NULL, FALSE, FALSE, NULL );
+	TEST( BuffersBusyEvent != NULL );
+	TEST( ReleaseBuffersEvent != NULL );
+
+	TEST_SUCCESS( JpfbtInitialize(
+		BUFFER_COUNT,
+		BUFFER_SIZE,
+		0,
+		ProcedureEvent,
+		ProcedureEvent,
+		ProcessBufferInOrder,
+		&State ) );
+
+	Limits.MaxBufferCount		= BUFFER_COUNT;
+	Limits.SlabBufferCount		= 0;
+	Limits.LowWatermark			= 0;
+	Limits.IdleReleaseTimeout	= 0;
+	Limits.PartialBufferTimeout	= 10;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	Thread = StartProducer( DirectWriterThreadProc );
+
+	//
+	// Buffer must not be flushed while it may still be written to...
+	//
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( BuffersBusyEvent, INFINITE ) );
+	Sleep( 50 );
+	TEST_STATUS( STATUS_TIMEOUT, JpfbtProcessBuffers( ProcessBufferInOrder, 0, &State ) );
+
+	//
+	// ...but once it has been completed.
+	//
+	TEST( SetEvent( ReleaseBuffersEvent ) );
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( BuffersBusyEvent, INFINITE ) );
+	Sleep( 50 );
+	TEST_SUCCESS( JpfbtProcessBuffers( ProcessBufferInOrder, 0, &State ) );
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Collector.PartialBuffersFlushed == 1 );
+	TEST( State.RecordsProcessed == 1 );
+
+	TEST( SetEvent( ReleaseBuffersEvent ) );
+	JoinProducer( Thread );
+	DrainBuffers();
+
+	TEST( State.NextGlobalSequence == WriteSequence );
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+
+	TEST( CloseHandle( BuffersBusyEvent ) );
+	TEST( CloseHandle( ReleaseBuffersEvent ) );
+}
+
+/*++
+	Routine Description:
+		Let producers take fresh buffers while all pools are below
+		their share of the low watermark. The collector is only 
+		woken once until it has run.
+--*/
+static VOID WakeCollectorOncePerRun()
+{
+	ULONG Index;
+	JPFBT_BUFFER_POOL_LIMITS Limits;
+	ULONG Sequence;
+	JPFBT_STATISTICS Statistics;
+
+	ZeroMemory( &State, sizeof( POOL_TEST_STATE ) );
+
+	TEST_SUCCESS( JpfbtInitialize(
+		BUFFER_COUNT,
+		BUFFER_SIZE,
+		0,
+		ProcedureEvent,
+		ProcedureEvent,
+		ProcessBufferInOrder,
+		&State ) );
+
+	Limits.MaxBufferCount		= BUFFER_COUNT;
+	Limits.SlabBufferCount		= 0;
+	Limits.LowWatermark			= BUFFER_COUNT;
+	Limits.IdleReleaseTimeout	= 0;
+	Limits.PartialBufferTimeout	= 0;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	for ( Index = 0; Index < PRODUCER_THREAD_COUNT; Index++ )
+	{
+		RunOrderedProducer( Index );
+	}
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Collector.LowWatermarkTriggers == 1 );
+
+	State.NextGlobalSequence = 0;
+	DrainBuffers();
+
+	//
+	// Collector has run, so the next shortage wakes it again.
+	//
+	Sequence = State.NextGlobalSequence;
+	RunOrderedProducer( 0 );
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Collector.LowWatermarkTriggers == 2 );
+
+	State.NextGlobalSequence = Sequence;
+	DrainBuffers();
+
+	TEST( State.RecordsProcessed == 
+		( PRODUCER_THREAD_COUNT + 1 ) * RECORDS_PER_ORDER_THREAD );
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+}
+
+CFIX_BEGIN_FIXTURE( BufferPools )
+	CFIX_FIXTURE_ENTRY( StressBufferPools )
+	CFIX_FIXTURE_ENTRY( ProcessBuffersInGlobalOrder )
+	CFIX_FIXTURE_ENTRY( GrowAndShrinkBufferPool )
+	CFIX_FIXTURE_ENTRY( FlushPartialBufferOfDirectWriter )
+	CFIX_FIXTURE_ENTRY( WakeCollectorOncePerRun )
+CFIX_END_FIXTURE()
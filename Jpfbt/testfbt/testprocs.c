@@ -388,6 +388,108 @@ static VOID PatchAndTestAllProcsSinglethreaded()
 	TEST_SUCCESS( JpfbtUninitialize() );
 }
 
+/*----------------------------------------------------------------------
+ *
+ * Test case.
+ *
+ */
+#define ACTIVE_CALL_MARKER 0xCA11
+
+static volatile LONG ActiveCallsChecked;
+
+static VOID __stdcall ProcedureEntryCheckActiveCall( 
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Function,
+	__in_opt PVOID UserPointer
+	)
+{
+	JPFBT_ACTIVE_CALL Call;
+
+	UNREFERENCED_PARAMETER( Context );
+	UNREFERENCED_PARAMETER( UserPointer );
+
+	TEST( JpfbtGetActiveCall( 0, &Call ) );
+	TEST( Call.Procedure == Function );
+	TEST( Call.ReturnAddress != 0 );
+	TEST( Call.EntryTimestamp != 0 );
+	TEST( *Call.Flags == 0 );
+
+	*Call.Flags = ACTIVE_CALL_MARKER;
+}
+
+static VOID __stdcall ProcedureExitCheckActiveCall( 
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Function,
+	__in_opt PVOID UserPointer
+	)
+{
+	JPFBT_ACTIVE_CALL Call;
+	ULONG Depth;
+	ULONGLONG EntryTimestamp;
+
+	UNREFERENCED_PARAMETER( Context );
+	UNREFERENCED_PARAMETER( UserPointer );
+
+	TEST( JpfbtGetActiveCall( 0, &Call ) );
+	TEST( Call.Procedure == Function );
+	TEST( *Call.Flags == ACTIVE_CALL_MARKER );
+
+	//
+	// Callers must have been entered before.
+	//
+	EntryTimestamp = Call.EntryTimestamp;
+	for ( Depth = 1; JpfbtGetActiveCall( Depth, &Call ); Depth++ )
+	{
+		TEST( *Call.Flags == ACTIVE_CALL_MARKER );
+		TEST( Call.EntryTimestamp <= EntryTimestamp );
+		EntryTimestamp = Call.EntryTimestamp;
+	}
+
+	InterlockedIncrement( &ActiveCallsChecked );
+}
+
+static VOID ReportActiveCalls()
+{
+	JPFBT_ACTIVE_CALL Call;
+	LONG ExpectedCount = 0;
+	ULONG Index;
+	PSAMPLE_PROC_SET ProcSet = GetSampleProcs();
+
+	ActiveCallsChecked = 0;
+
+	TEST_SUCCESS( JpfbtInitialize( 
+		16, 
+		64,
+		JPFBT_FLAG_AUTOCOLLECT | JPFBT_FLAG_TRACK_ACTIVE_CALLS,
+		ProcedureEntryCheckActiveCall, 
+		ProcedureExitCheckActiveCall,
+		ProcessBuffer,
+		NULL ) );
+
+	TEST( PatchAll() );
+
+	for ( Index = 0; Index < ProcSet->SampleProcCount; Index++ )
+	{
+		ProcSet->SampleProcs[ Index ].DriverProcedure();
+
+		if ( ProcSet->SampleProcs[ Index ].Patchable )
+		{
+			ExpectedCount += ProcSet->SampleProcs[ Index ].CallMultiplier;
+		}
+	}
+
+	TEST( ActiveCallsChecked == ExpectedCount );
+
+	//
+	// No event is being reported.
+	//
+	TEST( ! JpfbtGetActiveCall( 0, &Call ) );
+
+	UnpatchAll();
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+}
+
 #ifdef JPFBT_TARGET_USERMODE
 /*----------------------------------------------------------------------
  *
@@ -556,6 +658,89 @@ static VOID PatchAndTestAllProcsMultithreaded()
 	}
 }
 
+/*----------------------------------------------------------------------
+ *
+ * Test case.
+ *
+ */
+static ULONG QuietThreadId;
+static HANDLE QuietThreadBufferProcessed;
+
+static VOID ProcessBufferOfQuietThread(
+	__in SIZE_T BufferSize,
+	__in_bcount(BufferSize) PUCHAR Buffer,
+	__in ULONG ProcessId,
+	__in ULONG ThreadId,
+	__in_opt PVOID UserPointer
+	)
+{
+	UNREFERENCED_PARAMETER( Buffer );
+	UNREFERENCED_PARAMETER( ProcessId );
+	UNREFERENCED_PARAMETER( UserPointer );
+
+	if ( ThreadId == QuietThreadId )
+	{
+		TEST( BufferSize > 0 );
+		TEST( SetEvent( QuietThreadBufferProcessed ) );
+	}
+}
+
+static VOID FlushPartialBufferOfQuietThread()
+{
+	JPFBT_BUFFER_POOL_LIMITS Limits;
+	PSAMPLE_PROC_SET ProcSet = GetSampleProcs();
+	JPFBT_STATISTICS Statistics;
+	ULONG Index;
+
+	QuietThreadBufferProcessed = CreateEvent( NULL, FALSE, FALSE, NULL );
+	TEST( QuietThreadBufferProcessed );
+
+	QuietThreadId = GetCurrentThreadId();
+
+	//
+	// Buffers are large enough to never fill up.
+	//
+	TEST_SUCCESS( JpfbtInitialize( 
+		16, 
+		1024,
+		JPFBT_FLAG_AUTOCOLLECT,
+		ProcedureEntry, 
+		ProcedureExit,
+		ProcessBufferOfQuietThread,
+		NULL ) );
+
+	Limits.MaxBufferCount		= 16;
+	Limits.SlabBufferCount		= 0;
+	Limits.LowWatermark			= 0;
+	Limits.IdleReleaseTimeout	= 0;
+	Limits.PartialBufferTimeout	= 50;
+	TEST_SUCCESS( JpfbtSetBufferPoolLimits( &Limits ) );
+
+	TEST( PatchAll() );
+
+	for ( Index = 0; Index < ProcSet->SampleProcCount; Index++ )
+	{
+		if ( ProcSet->SampleProcs[ Index ].Patchable )
+		{
+			ProcSet->SampleProcs[ Index ].DriverProcedure();
+			break;
+		}
+	}
+
+	//
+	// Go quiet - the events must show up nevertheless.
+	//
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( QuietThreadBufferProcessed, 5000 ) );
+
+	TEST_SUCCESS( JpfbtQueryStatistics( &Statistics ) );
+	TEST( Statistics.Collector.PartialBuffersFlushed > 0 );
+
+	UnpatchAll();
+
+	TEST_SUCCESS( JpfbtUninitialize() );
+	TEST( CloseHandle( QuietThreadBufferProcessed ) );
+}
+
 void Setup()
 {
 	ProcsCalled = CreateEvent( NULL, TRUE, FALSE, NULL );
@@ -572,9 +757,11 @@ void Teardown()
 CFIX_BEGIN_FIXTURE( ConcurrentPatching )
 	CFIX_FIXTURE_ENTRY( PatchAndTestAllProcsSinglethreaded )
 	CFIX_FIXTURE_ENTRY( PatchAndUnpatchAll )
+	CFIX_FIXTURE_ENTRY( ReportActiveCalls )
 #ifdef JPFBT_TARGET_USERMODE
 	CFIX_FIXTURE_SETUP( Setup )
 	CFIX_FIXTURE_TEARDOWN( Teardown )
 	CFIX_FIXTURE_ENTRY( PatchAndTestAllProcsMultithreaded )
+	CFIX_FIXTURE_ENTRY( FlushPartialBufferOfQuietThread )
 #endif
 CFIX_END_FIXTURE()
\ No newline at end of file
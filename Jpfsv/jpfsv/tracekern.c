@@ -8,6 +8,7 @@
 #include "internal.h"
 #include <jpfbtdef.h>
 #include <jpkfbt.h>
+#include <dbghelp.h>
 #include <stdlib.h>
 
 #pragma warning( push )
@@ -21,6 +22,11 @@ typedef struct _JPFSVP_KM_TRACE_SESSION
 
 	LONG ReferenceCount;
 
+	//
+	// Context the session belongs to, used for resolving symbols.
+	//
+	JPFSV_HANDLE ContextHandle;
+
 	JPKFBT_TRACING_TYPE TracingType;
 	JPKFBT_SESSION KfbtSession;
 
@@ -30,6 +36,101 @@ typedef struct _JPFSVP_KM_TRACE_SESSION
 	WCHAR __LogFilePathBuffer[ MAX_PATH ];
 } JPFSVP_KM_TRACE_SESSION, *PJPFSVP_KM_TRACE_SESSION;
 
+/*----------------------------------------------------------------------
+ *
+ * Helpers.
+ *
+ */
+
+/*++
+	Routine Description:
+		Resolve the symbols of newly instrumented procedures and
+		have them recorded in the trace file s.t. the trace can 
+		later be read without access to symbols. 
+
+		Recording symbols is best effort - procedures whose symbols 
+		cannot be resolved are skipped, the reader falls back to 
+		loading symbols for them.
+--*/
+static HRESULT JpfsvsRecordSymbolsKernelTraceSession(
+	__in PJPFSVP_KM_TRACE_SESSION Session,
+	__in UINT ProcedureCount,
+	__in_ecount(ProcedureCount) CONST PJPFBT_PROCEDURE Procedures
+	)
+{
+	HANDLE Process;
+	UINT Index;
+	NTSTATUS Status;
+	ULONG SymbolCount = 0;
+	PJPKFBT_SYMBOL Symbols;
+
+	UCHAR SymInfoBuffer[ sizeof( SYMBOL_INFO ) + MAX_SYM_NAME ];
+	PSYMBOL_INFO SymInfo = ( PSYMBOL_INFO ) SymInfoBuffer;
+
+	Process = JpfsvGetProcessHandleContext( Session->ContextHandle );
+	if ( Process == NULL )
+	{
+		return E_UNEXPECTED;
+	}
+
+	Symbols = ( PJPKFBT_SYMBOL ) malloc( 
+		ProcedureCount * sizeof( JPKFBT_SYMBOL ) );
+	if ( Symbols == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	//
+	// N.B. Called with the context lock held, like 
+	// JpfsvpAddEntryTracepointTable, which resolves symbols the 
+	// same way.
+	//
+	for ( Index = 0; Index < ProcedureCount; Index++ )
+	{
+		DWORD64 Displacement;
+		PSTR Name;
+
+		ZeroMemory( SymInfo, sizeof( SYMBOL_INFO ) );
+		SymInfo->SizeOfStruct	= sizeof( SYMBOL_INFO );
+		SymInfo->MaxNameLen		= MAX_SYM_NAME;
+
+		if ( ! SymFromAddr(
+				Process,
+				Procedures[ Index ].u.ProcedureVa,
+				&Displacement,
+				SymInfo ) ||
+			 Displacement != 0 )
+		{
+			continue;
+		}
+
+		Name = _strdup( SymInfo->Name );
+		if ( Name == NULL )
+		{
+			continue;
+		}
+
+		Symbols[ SymbolCount ].Procedure	= Procedures[ Index ];
+		Symbols[ SymbolCount ].ModuleBase	= SymInfo->ModBase;
+		Symbols[ SymbolCount ].Name			= Name;
+		SymbolCount++;
+	}
+
+	Status = JpkfbtRecordSymbols(
+		Session->KfbtSession,
+		SymbolCount,
+		Symbols );
+
+	for ( Index = 0; Index < SymbolCount; Index++ )
+	{
+		free( ( PVOID ) Symbols[ Index ].Name );
+	}
+
+	free( Symbols );
+
+	return NT_SUCCESS( Status ) ? S_OK : HRESULT_FROM_NT( Status );
+}
+
 /*----------------------------------------------------------------------
  *
  * Methods.
@@ -117,6 +218,19 @@ static HRESULT JpfsvsInstrumentProcedureKernelTraceSession(
 		FailedProcedure	);
 	if ( NT_SUCCESS( Status ) )
 	{
+		if ( Action == JpfsvAddTracepoint &&
+			 Session->TracingType == JpkfbtTracingTypeDefault )
+		{
+			//
+			// Failing to record symbols does not render the trace
+			// unusable, so do not fail the instrumentation.
+			//
+			( VOID ) JpfsvsRecordSymbolsKernelTraceSession(
+				Session,
+				ProcedureCount,
+				Procedures );
+		}
+
 		return S_OK;
 	}
 	else
@@ -293,6 +407,7 @@ HRESULT JpfsvpCreateKernelTraceSession(
 	TempSession->Base.Stop					= JpfsvsStopKernelTraceSession;
 
 	TempSession->ReferenceCount				= 1;
+	TempSession->ContextHandle				= ContextHandle;
 	TempSession->TracingType				= KfbtTracingType;
 	TempSession->TraceActive				= FALSE;
 
@@ -39,10 +39,12 @@ typedef struct _JPKFAG_IOCTL_INITIALIZE_TRACING_REQUEST
 
 	//
 	// Log file information - must be an empty string (i.e. 
-	// FilePathLength = 0 for WMK tracing.
+	// FilePathLength = 0 and zeroed options) for WMK tracing.
 	//
 	struct
 	{
+		JPKFBT_LOG_OPTIONS Options;
+
 		//
 		// Length, in chars.
 		//
@@ -201,3 +203,85 @@ typedef struct _JPKFAG_IOCTL_QUERY_STATISTICS_RESPONSE
 	METHOD_BUFFERED,										\
 	FILE_READ_DATA )
 
+/*----------------------------------------------------------------------
+ *
+ * JPKFAG_IOCTL_RECORD_SYMBOLS
+ *
+ */
+
+/*++
+	IOCTL Description:
+		Record symbols of instrumented procedures in the trace
+		file. See JpkfbtRecordSymbols.
+
+	Input:
+		JPTRC_SYMBOL_TABLE_CHUNK structure, the input buffer length
+		must equal the chunk size, which must not exceed
+		JPTRCSYM_MAX_CHUNK_SIZE.
+	
+	Output:
+		None.
+--*/
+#define JPKFAG_IOCTL_RECORD_SYMBOLS				CTL_CODE(	\
+	JPKFAG_TYPE,											\
+	JPKFAG_IOCTL_BASE + 6,									\
+	METHOD_BUFFERED,										\
+	FILE_WRITE_DATA )
+
+/*----------------------------------------------------------------------
+ *
+ * JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS
+ *
+ */
+typedef struct _JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST
+{
+	JPFBT_BUFFER_POOL_LIMITS Limits;
+} JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST,
+*PJPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST;
+
+/*++
+	IOCTL Description:
+		Set limits for growing and shrinking the set of buffers
+		at runtime. See JpfbtSetBufferPoolLimits.
+
+	Input:
+		JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST structure.
+	
+	Output:
+		None.
+--*/
+#define JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS		CTL_CODE(	\
+	JPKFAG_TYPE,											\
+	JPKFAG_IOCTL_BASE + 7,									\
+	METHOD_BUFFERED,										\
+	FILE_WRITE_DATA )
+
+/*----------------------------------------------------------------------
+ *
+ * JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS
+ *
+ */
+typedef struct _JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST
+{
+	ULONG ThresholdCount;
+	JPKFBT_PROCEDURE_THRESHOLD Thresholds[ ANYSIZE_ARRAY ];
+} JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST,
+*PJPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST;
+
+/*++
+	IOCTL Description:
+		Replace the procedure-specific thresholds used in filtered
+		mode. See JpkfbtSetProcedureThresholds.
+
+	Input:
+		JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST structure.
+	
+	Output:
+		None.
+--*/
+#define JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS	CTL_CODE(	\
+	JPKFAG_TYPE,											\
+	JPKFAG_IOCTL_BASE + 8,									\
+	METHOD_BUFFERED,										\
+	FILE_WRITE_DATA )
+
@@ -10,6 +10,7 @@
 #include <ntddk.h>
 #include <aux_klib.h>
 #include <stdlib.h>
+#include <jptrcsym.h>
 #include "jpkfagp.h"
 
 /*++
@@ -355,6 +356,17 @@ NTSTATUS JpkfagpInitializeTracingIoctl(
 			 Request->BufferSize == 0 ||
 			 Request->BufferSize > JPKFAGP_MAX_BUFFER_SIZE ||
 			 Request->BufferSize < JPKFAGP_MIN_BUFFER_SIZE ||
+			 ( Request->Log.Options.Flags & ~( JPKFBT_LOG_FLAG_CIRCULAR |
+				JPKFBT_LOG_FLAG_FILTER_DURATION | 
+				JPKFBT_LOG_FLAG_KEEP_ANCESTORS ) ) != 0 ||
+			 ( ! ( Request->Log.Options.Flags & JPKFBT_LOG_FLAG_FILTER_DURATION ) &&
+			   ( ( Request->Log.Options.Flags & JPKFBT_LOG_FLAG_KEEP_ANCESTORS ) ||
+				 Request->Log.Options.DurationThreshold != 0 ) ) ||
+			 ( ( Request->Log.Options.Flags & JPKFBT_LOG_FLAG_CIRCULAR ) &&
+			   ( Request->Log.Options.MaximumFileSize < 
+					JPKFBT_LOG_MIN_CIRCULAR_FILE_SIZE ||
+				 Request->Log.Options.RotationInterval != 0 ||
+				 Request->BufferSize > JPKFAGP_MAX_CIRCULAR_BUFFER_SIZE ) ) ||
 			 Request->Log.FilePathLength == 0 ||
 			 ( ULONG ) FIELD_OFFSET( 
 				JPKFAG_IOCTL_INITIALIZE_TRACING_REQUEST,
@@ -367,12 +379,22 @@ NTSTATUS JpkfagpInitializeTracingIoctl(
 		InitFlags |= JPFBT_FLAG_AUTOCOLLECT;
 #endif
 
+		if ( Request->Log.Options.Flags & JPKFBT_LOG_FLAG_FILTER_DURATION )
+		{
+			//
+			// Filtering relies on entry timestamps.
+			//
+			InitFlags |= JPFBT_FLAG_TRACK_ACTIVE_CALLS;
+		}
+
 		LogFilePath.MaximumLength	= Request->Log.FilePathLength * sizeof( WCHAR );
 		LogFilePath.Length			= Request->Log.FilePathLength * sizeof( WCHAR );
 		LogFilePath.Buffer			= Request->Log.FilePath;
 
 		Status = JpkfagpCreateDefaultEventSink( 
 			&LogFilePath, 
+			Request->BufferSize,
+			&Request->Log.Options,
 			&DevExtension->Statistics,
 			&EventSink );
 		
@@ -382,6 +404,11 @@ NTSTATUS JpkfagpInitializeTracingIoctl(
 	case JpkfbtTracingTypeWmk:
 		if ( Request->BufferCount != 0 ||
 			 Request->BufferSize != 0 ||
+			 Request->Log.Options.FlushInterval != 0 ||
+			 Request->Log.Options.Flags != 0 ||
+			 Request->Log.Options.MaximumFileSize != 0 ||
+			 Request->Log.Options.RotationInterval != 0 ||
+			 Request->Log.Options.DurationThreshold != 0 ||
 			 Request->Log.FilePathLength != 0 )
 		{
 			return STATUS_INVALID_PARAMETER;
@@ -668,15 +695,146 @@ NTSTATUS JpkfagpQueryStatisticsIoctl(
 		Response->Data.Tracing.UnwindEventsDropped	 = DevExtension->Statistics.UnwindEventsDropped;
 		Response->Data.Tracing.ImageInfoEventsDropped= DevExtension->Statistics.ImageInfoEventsDropped;
 		Response->Data.Tracing.FailedChunkFlushes	 = DevExtension->Statistics.FailedChunkFlushes;
+		Response->Data.Tracing.FilteredCallsLost	 = DevExtension->Statistics.FilteredCallsLost;
 		Response->Data.EventsCaptured				 = Statistics.EventsCaptured;
 		Response->Data.ExceptionsUnwindings			 = Statistics.ExceptionsUnwindings;
 		Response->Data.ThreadTeardowns				 = Statistics.ThreadTeardowns;
+		Response->Data.BufferSlabs.BufferCount		 = Statistics.BufferSlabs.BufferCount;
+		Response->Data.BufferSlabs.Count			 = Statistics.BufferSlabs.Count;
+		Response->Data.BufferSlabs.Allocated		 = Statistics.BufferSlabs.Allocated;
+		Response->Data.BufferSlabs.Released			 = Statistics.BufferSlabs.Released;
+		Response->Data.BufferSlabs.FailedAllocations = Statistics.BufferSlabs.FailedAllocations;
+		Response->Data.Collector.PartialBuffersFlushed = Statistics.Collector.PartialBuffersFlushed;
+		Response->Data.Collector.LowWatermarkTriggers  = Statistics.Collector.LowWatermarkTriggers;
 
 		*BytesWritten = sizeof( JPKFAG_IOCTL_QUERY_STATISTICS_RESPONSE );
 	}
 	return STATUS_SUCCESS;
 }
 
+NTSTATUS JpkfagpRecordSymbolsIoctl(
+	__in PJPKFAGP_DEVICE_EXTENSION DevExtension,
+	__in PVOID Buffer,
+	__in ULONG InputBufferLength,
+	__in ULONG OutputBufferLength,
+	__out PULONG BytesWritten
+	)
+{
+	PJPTRC_SYMBOL_TABLE_CHUNK Request;
+
+	UNREFERENCED_PARAMETER( OutputBufferLength );
+
+	ASSERT( BytesWritten );
+	*BytesWritten = 0;
+
+	if ( ! Buffer ||
+		   InputBufferLength < ( ULONG ) FIELD_OFFSET( 
+				JPTRC_SYMBOL_TABLE_CHUNK,
+				Symbols ) )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Request = ( PJPTRC_SYMBOL_TABLE_CHUNK ) Buffer;
+
+	//
+	// The chunk is written to the file as is, so validate it
+	// entirely.
+	//
+	if ( Request->Header.Size != InputBufferLength ||
+		 ! JptrcsymIsValidChunk( Request ) )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ( DevExtension->EventSink == NULL )
+	{
+		return STATUS_FBT_NOT_INITIALIZED;
+	}
+
+	return DevExtension->EventSink->OnSymbolTable( 
+		Request,
+		DevExtension->EventSink );
+}
+
+NTSTATUS JpkfagpSetBufferPoolLimitsIoctl(
+	__in PJPKFAGP_DEVICE_EXTENSION DevExtension,
+	__in PVOID Buffer,
+	__in ULONG InputBufferLength,
+	__in ULONG OutputBufferLength,
+	__out PULONG BytesWritten
+	)
+{
+	PJPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST Request;
+
+	UNREFERENCED_PARAMETER( OutputBufferLength );
+
+	ASSERT( BytesWritten );
+	*BytesWritten = 0;
+
+	if ( ! Buffer ||
+		   InputBufferLength < sizeof( JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST ) )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Request = ( PJPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST ) Buffer;
+
+	if ( DevExtension->EventSink == NULL )
+	{
+		return STATUS_FBT_NOT_INITIALIZED;
+	}
+
+	return JpfbtSetBufferPoolLimits( &Request->Limits );
+}
+
+NTSTATUS JpkfagpSetProcedureThresholdsIoctl(
+	__in PJPKFAGP_DEVICE_EXTENSION DevExtension,
+	__in PVOID Buffer,
+	__in ULONG InputBufferLength,
+	__in ULONG OutputBufferLength,
+	__out PULONG BytesWritten
+	)
+{
+	PJPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST Request;
+
+	UNREFERENCED_PARAMETER( OutputBufferLength );
+
+	ASSERT( BytesWritten );
+	*BytesWritten = 0;
+
+	if ( ! Buffer ||
+		   InputBufferLength < ( ULONG ) FIELD_OFFSET( 
+				JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST,
+				Thresholds[ 0 ] ) )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Request = ( PJPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST ) Buffer;
+
+	//
+	// Check array bounds.
+	//
+	if ( Request->ThresholdCount > JPKFBT_MAX_PROCEDURE_THRESHOLDS ||
+		 ( ULONG ) FIELD_OFFSET(
+			JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST,
+			Thresholds[ Request->ThresholdCount ] ) > InputBufferLength )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ( DevExtension->EventSink == NULL )
+	{
+		return STATUS_FBT_NOT_INITIALIZED;
+	}
+
+	return DevExtension->EventSink->OnProcedureThresholds( 
+		Request->ThresholdCount,
+		Request->Thresholds,
+		DevExtension->EventSink );
+}
+
 VOID JpkfagpCleanupThread(
 	__in PETHREAD Thread
 	)
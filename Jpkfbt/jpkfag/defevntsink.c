@@ -7,18 +7,192 @@
  */
 #include <ntddk.h>
 #include <ntimage.h>
+#include <ntstrsafe.h>
 #include <jptrcfmt.h>
+#include <jptrccmp.h>
+#include <jptrcstg.h>
 #include "jpkfagp.h"
 
 #define JpkfagsPtrFromRva( base, rva ) ( ( ( PUCHAR ) base ) + rva )
 #define JpkfagsAlignUpToQword( p ) ( ( ( p ) + 15 ) & ~15 )
 
+//
+// Limits of a single index chunk. An index chunk is written whenever
+// any of these limits is reached, so the maximum size of an index
+// chunk is well below JPTRC_SEGMENT_SIZE.
+//
+#define JPKFAGS_INDEX_MAX_CHUNKS		4096
+#define JPKFAGS_INDEX_MAX_SEGMENTS		256
+#define JPKFAGS_INDEX_MAX_IMAGE_INFOS	256
+
+#define JPKFAGS_INDEX_MAX_SIZE JPTRC_INDEX_CHUNK_SIZE(	\
+	JPKFAGS_INDEX_MAX_IMAGE_INFOS,						\
+	JPKFAGS_INDEX_MAX_SEGMENTS,							\
+	JPKFAGS_INDEX_MAX_CHUNKS,							\
+	JPKFAGS_INDEX_MAX_CHUNKS )
+
+C_ASSERT( JPKFAGS_INDEX_MAX_SIZE <= JPTRC_SEGMENT_SIZE );
+
+//
+// Chunks are gathered in staging blocks, which are written 
+// asynchronously. While one block is being filled, the writes of
+// the others may be in flight.
+//
+#define JPKFAGS_STAGING_BLOCK_COUNT		4
+#define JPKFAGS_STAGING_BLOCK_SIZE		( 4 * JPTRC_SEGMENT_SIZE )
+
+//
+// Default interval in which file buffers are flushed, in ms.
+//
+#define JPKFAGS_DEFAULT_FLUSH_INTERVAL	1000
+
+//
+// For circular files, staging blocks in flight must never overlap,
+// so the ring must be able to hold all staging blocks at once.
+//
+#define JPKFAGS_MEGABYTE				( 1024 * 1024 )
+
+C_ASSERT( ( JPKFAGS_MEGABYTE % JPTRC_SEGMENT_SIZE ) == 0 );
+C_ASSERT( JPKFBT_LOG_MIN_CIRCULAR_FILE_SIZE * 
+			( JPKFAGS_MEGABYTE / JPTRC_SEGMENT_SIZE ) - 1 >=
+		  JPKFAGS_STAGING_BLOCK_COUNT * 
+			( JPKFAGS_STAGING_BLOCK_SIZE / JPTRC_SEGMENT_SIZE ) );
+
+//
+// Maximum number of characters of the sequence number that is part
+// of the names of rotated log files.
+//
+#define JPKFAGS_MAX_SEQUENCE_NUMBER_CCH	10
+
+//
+// Interval in which calibration chunks are written, and time spent
+// on the initial measurement of the timestamp frequency, in 100ns 
+// units.
+//
+#define JPKFAGS_CALIBRATION_INTERVAL	( 60 * 10000000ULL )
+#define JPKFAGS_CALIBRATION_DELAY		( 10 * 10000 )
+
+//
+// Maximum time span, in 100ns units, covered by a frequency 
+// measurement. Longer spans could overflow the computation, so
+// the reference point is renewed.
+//
+#define JPKFAGS_CALIBRATION_MAX_SPAN	( 24 * 3600 * 10000000ULL )
+
+//
+// Number of buckets of the image info cache. Images are hashed by
+// load address.
+//
+#define JPKFAGS_IMAGE_CACHE_BUCKETS		64
+
+#define JpkfagsImageCacheBucket( LoadAddress )					\
+	( ( ULONG ) ( ( LoadAddress ) >> PAGE_SHIFT ) % JPKFAGS_IMAGE_CACHE_BUCKETS )
+
+//
+// Filtered mode: Flags in JPFBT_ACTIVE_CALL.Flags indicating that the
+// entry of the call has been recorded on behalf of a slow callee, or
+// that the call is not to be recorded as a callee has been recorded
+// before its entry could be.
+//
+#define JPKFAGS_CALL_ENTRY_RECORDED		1
+#define JPKFAGS_CALL_SKIPPED			2
+
+/*++
+	Structure Description:
+		Image info chunk, built once per image. Events are owned by
+		the image cache and only freed when the sink is deleted.
+--*/
 typedef struct _JPKFAGP_IMAGE_INFO_EVENT
 {
 	SLIST_ENTRY ListEntry;
+
+	//
+	// Entry in a bucket of Sink->ImageCache.Buckets or, once 
+	// superseded by another image loaded at the same address, in
+	// Sink->ImageCache.Evicted. Protected by Sink->ImageCache.Lock.
+	//
+	LIST_ENTRY CacheListEntry;
+
+	//
+	// Entry in Sink->ImageCache.Written, only valid if Written
+	// is TRUE. Only accessed by the collector thread.
+	//
+	LIST_ENTRY WrittenListEntry;
+	BOOLEAN Written;
+
+	//
+	// For circular files, indicates that the chunk has been placed
+	// in segment 0 and thus does not need to be written again when
+	// the ring wraps.
+	//
+	BOOLEAN InFixedSegment;
+
 	JPTRC_IMAGE_INFO_CHUNK Event;
 } JPKFAGP_IMAGE_INFO_EVENT, *PJPKFAGP_IMAGE_INFO_EVENT;
 
+typedef struct _JPKFAGP_SYMBOL_TABLE_EVENT
+{
+	SLIST_ENTRY ListEntry;
+
+	//
+	// If rotation is enabled, the event is retained in
+	// Sink->Rotation.SymbolTables after having been written.
+	//
+	LIST_ENTRY RetainedListEntry;
+
+	JPTRC_SYMBOL_TABLE_CHUNK Event;
+} JPKFAGP_SYMBOL_TABLE_EVENT, *PJPKFAGP_SYMBOL_TABLE_EVENT;
+
+typedef struct _JPKFAGS_INDEX_ENTRY
+{
+	ULONG ProcessId;
+	ULONG ThreadId;
+	ULONGLONG Offset;
+} JPKFAGS_INDEX_ENTRY, *PJPKFAGS_INDEX_ENTRY;
+
+typedef struct _JPKFAGS_THRESHOLD
+{
+	ULONG_PTR Procedure;
+
+	//
+	// Threshold in timestamp ticks.
+	//
+	ULONGLONG Threshold;
+} JPKFAGS_THRESHOLD, *PJPKFAGS_THRESHOLD;
+
+/*++
+	Structure Description:
+		Procedure-specific thresholds for filtered mode. A table is
+		not modified while published.
+--*/
+typedef struct _JPKFAGS_THRESHOLD_TABLE
+{
+	ULONG Count;
+
+	//
+	// Sorted by Procedure.
+	//
+	JPKFAGS_THRESHOLD Entries[ ANYSIZE_ARRAY ];
+} JPKFAGS_THRESHOLD_TABLE, *PJPKFAGS_THRESHOLD_TABLE;
+
+typedef struct _JPKFAGS_STAGING_BLOCK
+{
+	JPTRCSTG_BLOCK Block;
+
+	//
+	// Number of bytes of Block that have already been submitted
+	// to ZwWriteFile.
+	//
+	ULONG BytesSubmitted;
+
+	//
+	// Write state. At most one write per block is in flight.
+	//
+	BOOLEAN WritePending;
+	HANDLE Event;
+	IO_STATUS_BLOCK StatusBlock;
+} JPKFAGS_STAGING_BLOCK, *PJPKFAGS_STAGING_BLOCK;
+
 typedef struct _JPKFAGP_DEF_EVENT_SINK
 {
 	JPKFAGP_EVENT_SINK Base;
@@ -27,6 +201,29 @@ typedef struct _JPKFAGP_DEF_EVENT_SINK
 
 	HANDLE LogFile;
 
+	//
+	// Cache of all JPKFAGP_IMAGE_INFO_EVENTs built so far. Repeated
+	// notifications for the same image are satisfied from the cache
+	// s.t. each image info chunk is built only once.
+	//
+	struct
+	{
+		//
+		// Protects Buckets and Evicted.
+		//
+		KGUARDED_MUTEX Lock;
+
+		LIST_ENTRY Buckets[ JPKFAGS_IMAGE_CACHE_BUCKETS ];
+		LIST_ENTRY Evicted;
+
+		//
+		// Events written to the current file, in the order they have
+		// been written. These are written again to each new file
+		// and, for circular files, whenever the ring wraps.
+		//
+		LIST_ENTRY Written;
+	} ImageCache;
+
 	//
 	// Queue of JPKFAGP_IMAGE_INFO_EVENT that need to be written
 	// the next time the ProcessBuffersCallback is called.
@@ -37,10 +234,208 @@ typedef struct _JPKFAGP_DEF_EVENT_SINK
 	SLIST_HEADER ImageInfoEventQueue;
 
 	//
-	// Maintain position to avoid repeatedly having to query it.
-	// After all, we are the only writer to the file.
+	// Queue of JPKFAGP_SYMBOL_TABLE_EVENT, flushed along with
+	// ImageInfoEventQueue. Also LIFO, the order is restored when
+	// flushing.
+	//
+	SLIST_HEADER SymbolTableEventQueue;
+
+	//
+	// Position at which the next chunk will be placed. As data is
+	// staged, this is usually beyond the end of the file.
 	//
 	LARGE_INTEGER FilePosition;
+
+	struct
+	{
+		JPKFAGS_STAGING_BLOCK Blocks[ JPKFAGS_STAGING_BLOCK_COUNT ];
+
+		//
+		// Index of block currently being filled.
+		//
+		ULONG CurrentBlock;
+
+		//
+		// Interval, in 100ns units, and interrupt time of last flush.
+		//
+		ULONGLONG FlushInterval;
+		ULONGLONG LastFlushTime;
+	} Writer;
+
+	//
+	// State for circular files (JPKFBT_LOG_FLAG_CIRCULAR). Segment 0
+	// is staged separately and holds the file header, the circular 
+	// header chunk and, as long as space permits, image info chunks.
+	// Staging blocks only cover the ring, i.e. segments 1..n.
+	//
+	struct
+	{
+		BOOLEAN Enabled;
+
+		//
+		// Covers segment 0.
+		//
+		JPKFAGS_STAGING_BLOCK FixedBlock;
+
+		//
+		// Preallocated size of file, end of the ring.
+		//
+		ULONGLONG FileSize;
+
+		//
+		// Set when the ring has wrapped and image info chunks placed
+		// in the ring have to be written again.
+		//
+		BOOLEAN Wrapped;
+	} Circular;
+
+	//
+	// State for rotating the log file. Only used for non-circular
+	// files.
+	//
+	struct
+	{
+		BOOLEAN Enabled;
+
+		//
+		// Size in bytes (0: unlimited) and interval in 100ns units
+		// (0: never) after which the file is rotated.
+		//
+		ULONGLONG MaximumFileSize;
+		ULONGLONG Interval;
+
+		//
+		// Interrupt time at which the current file has been begun.
+		//
+		ULONGLONG FileCreationTime;
+
+		//
+		// Directory containing the log file. Rotated files are
+		// created relative to this directory.
+		//
+		HANDLE Directory;
+
+		//
+		// Base name and extension of the log file, and a buffer for
+		// the names of rotated files.
+		//
+		UNICODE_STRING BaseName;
+		UNICODE_STRING Extension;
+		UNICODE_STRING FileName;
+
+		//
+		// Position of the current file within the set, and the 
+		// set id.
+		//
+		ULONG SequenceNumber;
+		ULONGLONG SetId;
+
+		//
+		// List of JPKFAGP_SYMBOL_TABLE_EVENTs written so far, in
+		// the order they have been written.
+		//
+		LIST_ENTRY SymbolTables;
+	} Rotation;
+
+	//
+	// State for writing JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT chunks.
+	// Buffers are processed one at a time, so a single encoder and
+	// chunk buffer suffice.
+	//
+	struct
+	{
+		JPTRCCMP_ENCODER Encoder;
+
+		ULONG ChunkCapacity;
+		PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 Chunk;
+	} Compact;
+
+	//
+	// State for writing JPTRC_CHUNK_TYPE_CALIBRATION chunks. The 
+	// timestamp frequency is measured against the performance 
+	// counter, relative to a reference point taken when the sink
+	// has been created.
+	//
+	struct
+	{
+		ULONGLONG ReferenceTimestamp;
+		ULONGLONG ReferenceCounter;
+		ULONGLONG CounterFrequency;
+
+		//
+		// Interrupt time of last calibration chunk.
+		//
+		ULONGLONG LastCalibrationTime;
+
+		//
+		// Chunk buffer, ProcessorOffsets are filled once.
+		//
+		PJPTRC_CALIBRATION_CHUNK Chunk;
+	} Calibration;
+
+	//
+	// State for writing JPTRC_CHUNK_TYPE_INDEX chunks. Chunks written
+	// since the last index chunk are recorded here.
+	//
+	struct
+	{
+		ULONGLONG PreviousIndexOffset;
+		ULONGLONG StartOffset;
+
+		ULONG ChunkCount;
+		ULONG SegmentCount;
+		ULONG ImageInfoCount;
+
+		PJPKFAGS_INDEX_ENTRY Chunks;
+		PJPTRC_INDEX_SEGMENT Segments;
+		PULONGLONG ImageInfoOffsets;
+
+		//
+		// Buffer for building the index chunk, 
+		// JPKFAGS_INDEX_MAX_SIZE bytes.
+		//
+		PJPTRC_INDEX_CHUNK Chunk;
+	} Index;
+
+	//
+	// State for filtered mode (JPKFBT_LOG_FLAG_FILTER_DURATION).
+	//
+	struct
+	{
+		BOOLEAN Enabled;
+		BOOLEAN KeepAncestors;
+
+		//
+		// Timestamp frequency used for converting thresholds.
+		//
+		ULONGLONG Frequency;
+
+		//
+		// Threshold, in timestamp ticks, of procedures not listed
+		// in Thresholds.
+		//
+		ULONGLONG Threshold;
+
+		//
+		// Procedure-specific thresholds, NULL if none.
+		//
+		PJPKFAGS_THRESHOLD_TABLE volatile Thresholds;
+
+		//
+		// # of event routines currently looking up Thresholds, 
+		// counted separately per epoch. A replaced table is freed
+		// once the readers of both epochs have drained. Event 
+		// routines may run at any IRQL, which rules out rundown
+		// protection.
+		//
+		volatile LONG Readers[ 2 ];
+		volatile LONG ReaderEpoch;
+
+		//
+		// Serializes replacing Thresholds.
+		//
+		KGUARDED_MUTEX Lock;
+	} Filter;
 } JPKFAGP_DEF_EVENT_SINK, *PJPKFAGP_DEF_EVENT_SINK;
 
 typedef NTSTATUS ( * ZWFLUSHBUFFERSFILE_ROUTINE )(
@@ -55,224 +450,1921 @@ ZWFLUSHBUFFERSFILE_ROUTINE JpkfagsZwFlushBuffersFile;
  * Privates.
  *
  */
-static BOOLEAN JpkfagsIsFilePositionConsistent(
+static NTSTATUS JpkfagsInitializeCompactEncoder(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in ULONG BufferSize
+	)
+{
+	ULONG MaxTransitions;
+	ULONG SlotCount;
+
+	ASSERT( Sink );
+	ASSERT( BufferSize <= JPKFAGP_MAX_BUFFER_SIZE );
+
+	RtlZeroMemory( &Sink->Compact, sizeof( Sink->Compact ) );
+
+	MaxTransitions = BufferSize / sizeof( JPTRC_PROCEDURE_TRANSITION32 );
+
+	//
+	// Keep the hashtable at most half full.
+	//
+	Sink->Compact.Encoder.DictionaryCapacity = min( MaxTransitions, MAXUSHORT );
+	SlotCount = 1;
+	while ( SlotCount < 2 * Sink->Compact.Encoder.DictionaryCapacity )
+	{
+		SlotCount <<= 1;
+	}
+	Sink->Compact.Encoder.SlotCount = SlotCount;
+
+	//
+	// The encoder requires space for the dictionary at maximum 
+	// capacity. The chunk is only used if it ends up being smaller
+	// than the uncompressed chunk, so the stream never needs more
+	// space than that.
+	//
+	Sink->Compact.ChunkCapacity = 
+		FIELD_OFFSET( 
+			JPTRC_COMPACT_TRACE_BUFFER_CHUNK32, 
+			Procedures[ Sink->Compact.Encoder.DictionaryCapacity ] ) +
+		FIELD_OFFSET( 
+			JPTRC_TRACE_BUFFER_CHUNK32, 
+			Transitions[ MaxTransitions ] );
+
+	Sink->Compact.Encoder.Slots = ( PJPTRCCMP_SLOT ) ExAllocatePoolWithTag(
+		PagedPool,
+		SlotCount * sizeof( JPTRCCMP_SLOT ),
+		JPKFAG_POOL_TAG );
+	Sink->Compact.Encoder.Dictionary = ( PULONG ) ExAllocatePoolWithTag(
+		PagedPool,
+		Sink->Compact.Encoder.DictionaryCapacity * sizeof( ULONG ),
+		JPKFAG_POOL_TAG );
+	Sink->Compact.Chunk = ( PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 ) 
+		ExAllocatePoolWithTag(
+			PagedPool,
+			Sink->Compact.ChunkCapacity,
+			JPKFAG_POOL_TAG );
+
+	if ( Sink->Compact.Encoder.Slots == NULL ||
+		 Sink->Compact.Encoder.Dictionary == NULL ||
+		 Sink->Compact.Chunk == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	RtlZeroMemory( 
+		Sink->Compact.Encoder.Slots, 
+		SlotCount * sizeof( JPTRCCMP_SLOT ) );
+
+	return STATUS_SUCCESS;
+}
+
+static VOID JpkfagsDeleteCompactEncoder(
 	__in PJPKFAGP_DEF_EVENT_SINK Sink
 	)
 {
-	FILE_POSITION_INFORMATION Position;
-	NTSTATUS Status;
-	IO_STATUS_BLOCK StatusBlock;
+	ASSERT( Sink );
 
-	Status = ZwQueryInformationFile(
-		Sink->LogFile,
-		&StatusBlock,
-		&Position,
-		sizeof( FILE_POSITION_INFORMATION ),
-		FilePositionInformation );
-	if ( ! NT_SUCCESS( Status ) )
+	if ( Sink->Compact.Encoder.Slots != NULL )
 	{
-		TRACE( ( "JPKFAG: Failed to obtain file position: %x\n", Status ) );
-		return FALSE;
+		ExFreePoolWithTag( Sink->Compact.Encoder.Slots, JPKFAG_POOL_TAG );
 	}
-	else
+
+	if ( Sink->Compact.Encoder.Dictionary != NULL )
+	{
+		ExFreePoolWithTag( Sink->Compact.Encoder.Dictionary, JPKFAG_POOL_TAG );
+	}
+
+	if ( Sink->Compact.Chunk != NULL )
 	{
-		return Position.CurrentByteOffset.QuadPart ==
-			Sink->FilePosition.QuadPart ? TRUE : FALSE;
+		ExFreePoolWithTag( Sink->Compact.Chunk, JPKFAG_POOL_TAG );
 	}
 }
 
-static NTSTATUS JpkfagsWrite(
-	__in PJPKFAGP_DEF_EVENT_SINK Sink,
-	__in PVOID Buffer,
-	__in ULONG Size 
+static NTSTATUS JpkfagsInitializeIndex(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
 	)
 {
-	IO_STATUS_BLOCK StatusBlock;
+	ASSERT( Sink );
 
-	return ZwWriteFile(
-		Sink->LogFile,
-		NULL,
-		NULL,
-		NULL,
-		&StatusBlock,
-		Buffer,
-		Size,
-		&Sink->FilePosition,
-		NULL );
+	RtlZeroMemory( &Sink->Index, sizeof( Sink->Index ) );
+
+	Sink->Index.StartOffset = sizeof( JPTRC_FILE_HEADER );
+
+	Sink->Index.Chunks = ( PJPKFAGS_INDEX_ENTRY ) ExAllocatePoolWithTag(
+		PagedPool,
+		JPKFAGS_INDEX_MAX_CHUNKS * sizeof( JPKFAGS_INDEX_ENTRY ),
+		JPKFAG_POOL_TAG );
+	Sink->Index.Segments = ( PJPTRC_INDEX_SEGMENT ) ExAllocatePoolWithTag(
+		PagedPool,
+		JPKFAGS_INDEX_MAX_SEGMENTS * sizeof( JPTRC_INDEX_SEGMENT ),
+		JPKFAG_POOL_TAG );
+	Sink->Index.ImageInfoOffsets = ( PULONGLONG ) ExAllocatePoolWithTag(
+		PagedPool,
+		JPKFAGS_INDEX_MAX_IMAGE_INFOS * sizeof( ULONGLONG ),
+		JPKFAG_POOL_TAG );
+	Sink->Index.Chunk = ( PJPTRC_INDEX_CHUNK ) ExAllocatePoolWithTag(
+		PagedPool,
+		JPKFAGS_INDEX_MAX_SIZE,
+		JPKFAG_POOL_TAG );
+
+	if ( Sink->Index.Chunks == NULL ||
+		 Sink->Index.Segments == NULL ||
+		 Sink->Index.ImageInfoOffsets == NULL ||
+		 Sink->Index.Chunk == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	return STATUS_SUCCESS;
 }
 
 /*++
 	Routine Description:
-		Write a chunk to the file.
+		Compute Value * Numerator / Denominator without overflowing
+		as long as Numerator * Denominator does not overflow.
+--*/
+static ULONGLONG JpkfagsScale(
+	__in ULONGLONG Value,
+	__in ULONGLONG Numerator,
+	__in ULONGLONG Denominator
+	)
+{
+	ASSERT( Denominator != 0 );
 
-	Parameters:
-		Chunk		- Header, always defines overall size.
-		Body		- if non-null, chunk header and body are written 
-					  separately. 
-		BodySize	- Size of body. This size is included in Chunk->Size.
+	return ( Value / Denominator ) * Numerator +
+		( ( Value % Denominator ) * Numerator ) / Denominator;
+}
+
+/*++
+	Routine Description:
+		Read the timestamp counter, the performance counter and,
+		optionally, the system time as close together as possible.
 --*/
-static NTSTATUS JpkfagsFlushChunk(
-	__in PJPKFAGP_DEF_EVENT_SINK Sink,
-	__in PJPTRC_CHUNK_HEADER Chunk,
-	__in_opt /*_bcount( BodySize )*/ PVOID Body,
-	__in_opt ULONG BodySize
+static VOID JpkfagsReadClocks(
+	__out PULONGLONG Timestamp,
+	__out PULONGLONG Counter,
+	__out_opt PULONGLONG SystemTime
 	)
 {
-	ULONG RemainingSizeWithinCurrentSegment;
-	NTSTATUS Status;
+	KIRQL OldIrql;
+	LARGE_INTEGER Time;
 
-	ASSERT( Sink );
-	ASSERT( Chunk );
-	ASSERT( Chunk->Reserved == 0 );
-	ASSERT( Chunk->Size > sizeof( JPTRC_CHUNK_HEADER ) );
-	ASSERT( ( Body == NULL ) == ( BodySize == 0 ) );
-	ASSERT( BodySize == 0 || BodySize <= Chunk->Size - sizeof( JPTRC_CHUNK_HEADER ) );
-	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
-	ASSERT( JpkfagsIsFilePositionConsistent( Sink ) );
-	ASSERT( ( Chunk->Size % JPTRC_CHUNK_ALIGNMENT ) == 0 );
-	ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+	KeRaiseIrql( HIGH_LEVEL, &OldIrql );
 
-	RemainingSizeWithinCurrentSegment = JPTRC_SEGMENT_SIZE - 
-		( ULONG ) ( Sink->FilePosition.QuadPart % JPTRC_SEGMENT_SIZE );
+	*Counter	= KeQueryPerformanceCounter( NULL ).QuadPart;
+	*Timestamp	= __rdtsc();
 
-	if ( RemainingSizeWithinCurrentSegment < Chunk->Size )
+	if ( SystemTime != NULL )
 	{
-		//
-		// Write would straddle segment boundary, padding required.
-		//
-		JPTRC_PAD_CHUNK PadChunk;
+		KeQuerySystemTime( &Time );
+		*SystemTime = Time.QuadPart;
+	}
 
-		PadChunk.Header.Type		= JPTRC_CHUNK_TYPE_PAD;
-		PadChunk.Header.Reserved	= 0;
-		PadChunk.Header.Size		= RemainingSizeWithinCurrentSegment;
+	KeLowerIrql( OldIrql );
+}
 
-		//
-		// Write header, the body of the pad chunk will contain
-		// junk.
-		//
-		ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+/*++
+	Routine Description:
+		Measure the timestamp frequency relative to the reference
+		point.
 
-		Status = JpkfagsWrite(
-			Sink,
-			&PadChunk,
-			sizeof( JPTRC_PAD_CHUNK ) );
-		if ( ! NT_SUCCESS( Status ) )
-		{
-			//
-			// To at least avoid the file from becoming corrupted,
-			// we do not adjust the file pointer.
-			//
+	Return Value:
+		Frequency, 0 if no time has elapsed.
+--*/
+static ULONGLONG JpkfagsMeasureFrequency(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in ULONGLONG Timestamp,
+	__in ULONGLONG Counter,
+	__out PULONGLONG Elapsed
+	)
+{
+	*Elapsed = JpkfagsScale( 
+		Counter - Sink->Calibration.ReferenceCounter,
+		10000000,
+		Sink->Calibration.CounterFrequency );
+	if ( *Elapsed == 0 )
+	{
+		return 0;
+	}
 
-			TRACE( ( "JPKFAG: Failed to flush pad chunk: %x\n", Status ) );
-			InterlockedIncrement( &Sink->Statistics->FailedChunkFlushes );
+	return JpkfagsScale( 
+		Timestamp - Sink->Calibration.ReferenceTimestamp,
+		10000000,
+		*Elapsed );
+}
 
-			return Status;
-		}
+/*++
+	Routine Description:
+		Take the reference point, measure the initial frequency and
+		the offsets of the processors' timestamp counters.
 
-		//
-		// Advance file pointer.
-		//
-		Sink->FilePosition.QuadPart += RemainingSizeWithinCurrentSegment;
+		Only to be called from the context of the thread that 
+		creates the sink.
+--*/
+static NTSTATUS JpkfagsInitializeCalibration(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	KAFFINITY ActiveProcessors;
+	ULONGLONG Counter;
+	LARGE_INTEGER CounterFrequency;
+	LARGE_INTEGER Delay;
+	ULONGLONG Elapsed;
+	ULONGLONG Frequency;
+	ULONG Processor;
+	ULONG ProcessorCount;
+	PJPTRC_CALIBRATION_CHUNK Chunk;
+	ULONGLONG Timestamp;
 
-		ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_SEGMENT_SIZE ) == 0 );
-	}
+	ASSERT( Sink );
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	ActiveProcessors = KeQueryActiveProcessors();
+	ProcessorCount = 0;
+	for ( Processor = 0; Processor < sizeof( KAFFINITY ) * 8; Processor++ )
+	{
+		if ( ActiveProcessors & ( ( KAFFINITY ) 1 << Processor ) )
+		{
+			ProcessorCount++;
+		}
+	}
+
+	Chunk = ( PJPTRC_CALIBRATION_CHUNK ) ExAllocatePoolWithTag(
+		PagedPool,
+		JPTRC_CALIBRATION_CHUNK_SIZE( ProcessorCount ),
+		JPKFAG_POOL_TAG );
+	if ( Chunk == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	RtlZeroMemory( Chunk, JPTRC_CALIBRATION_CHUNK_SIZE( ProcessorCount ) );
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_CALIBRATION;
+	Chunk->Header.Size		= JPTRC_CALIBRATION_CHUNK_SIZE( ProcessorCount );
+	Chunk->ProcessorCount	= ProcessorCount;
+
+	Sink->Calibration.Chunk = Chunk;
+
+	KeQueryPerformanceCounter( &CounterFrequency );
+	Sink->Calibration.CounterFrequency = CounterFrequency.QuadPart;
+
+	JpkfagsReadClocks(
+		&Sink->Calibration.ReferenceTimestamp,
+		&Sink->Calibration.ReferenceCounter,
+		NULL );
 
 	//
-	// Synchronous write.
+	// Wait a little to get a first estimate of the frequency.
 	//
-	ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+	Delay.QuadPart = - ( LONGLONG ) JPKFAGS_CALIBRATION_DELAY;
+	( VOID ) KeDelayExecutionThread( KernelMode, FALSE, &Delay );
 
-	if ( Body == NULL )
+	JpkfagsReadClocks( &Timestamp, &Counter, NULL );
+	Frequency = JpkfagsMeasureFrequency( Sink, Timestamp, Counter, &Elapsed );
+	if ( Frequency == 0 )
 	{
 		//
-		// Write entire chunk.
+		// Performance counter unusable, do not bother measuring
+		// the offsets.
 		//
-		Status = JpkfagsWrite(
-			Sink,
-			Chunk,
-			Chunk->Size );
-		if ( NT_SUCCESS( Status ) )
+		Chunk->ProcessorCount	= 0;
+		Chunk->Header.Size		= JPTRC_CALIBRATION_CHUNK_SIZE( 0 );
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// The performance counter is system-wide, so comparing it to the
+	// timestamp counter on each processor yields the offsets of the
+	// timestamp counters.
+	//
+	ProcessorCount = 0;
+	for ( Processor = 0; Processor < sizeof( KAFFINITY ) * 8; Processor++ )
+	{
+		if ( ! ( ActiveProcessors & ( ( KAFFINITY ) 1 << Processor ) ) )
 		{
-			Sink->FilePosition.QuadPart += Chunk->Size;
+			continue;
 		}
+
+		KeSetSystemAffinityThread( ( KAFFINITY ) 1 << Processor );
+
+		JpkfagsReadClocks( &Timestamp, &Counter, NULL );
+		Elapsed = JpkfagsScale( 
+			Counter - Sink->Calibration.ReferenceCounter,
+			10000000,
+			Sink->Calibration.CounterFrequency );
+
+		Chunk->ProcessorOffsets[ ProcessorCount++ ] = 
+			( LONGLONG ) ( Timestamp - Sink->Calibration.ReferenceTimestamp ) -
+			( LONGLONG ) JpkfagsScale( Elapsed, Frequency, 10000000 );
 	}
-	else
+
+	KeRevertToUserAffinityThread();
+
+	for ( Processor = ProcessorCount; Processor > 0; Processor-- )
+	{
+		Chunk->ProcessorOffsets[ Processor - 1 ] -= Chunk->ProcessorOffsets[ 0 ];
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static VOID JpkfagsDeleteCalibration(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ASSERT( Sink );
+
+	if ( Sink->Calibration.Chunk != NULL )
+	{
+		ExFreePoolWithTag( Sink->Calibration.Chunk, JPKFAG_POOL_TAG );
+	}
+}
+
+/*++
+	Routine Description:
+		Set up filtered mode if requested. Thresholds are converted
+		to timestamp ticks, so calibration must have been 
+		initialized.
+--*/
+static NTSTATUS JpkfagsInitializeFilter(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPKFBT_LOG_OPTIONS LogOptions
+	)
+{
+	ULONGLONG Counter;
+	ULONGLONG Elapsed;
+	ULONGLONG Timestamp;
+
+	ASSERT( Sink );
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	KeInitializeGuardedMutex( &Sink->Filter.Lock );
+
+	if ( ! ( LogOptions->Flags & JPKFBT_LOG_FLAG_FILTER_DURATION ) )
+	{
+		return STATUS_SUCCESS;
+	}
+
+	JpkfagsReadClocks( &Timestamp, &Counter, NULL );
+	Sink->Filter.Frequency = JpkfagsMeasureFrequency( 
+		Sink, 
+		Timestamp, 
+		Counter, 
+		&Elapsed );
+	if ( Sink->Filter.Frequency == 0 )
 	{
 		//
-		// Chunk does not contain body, need to do two writes.
+		// Performance counter unusable, thresholds cannot be
+		// converted.
 		//
-		Status = JpkfagsWrite(
-			Sink,
-			Chunk,
-			Chunk->Size - BodySize );
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	Sink->Filter.Enabled		= TRUE;
+	Sink->Filter.KeepAncestors	= 
+		( LogOptions->Flags & JPKFBT_LOG_FLAG_KEEP_ANCESTORS ) ? TRUE : FALSE;
+	Sink->Filter.Threshold		= JpkfagsScale(
+		LogOptions->DurationThreshold,
+		Sink->Filter.Frequency,
+		1000000 );
+
+	return STATUS_SUCCESS;
+}
+
+static VOID JpkfagsDeleteFilter(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ASSERT( Sink );
+
+	//
+	// N.B. Tracing has been shut down, so no readers are left.
+	//
+	if ( Sink->Filter.Thresholds != NULL )
+	{
+		ExFreePoolWithTag( Sink->Filter.Thresholds, JPKFAG_POOL_TAG );
+		Sink->Filter.Thresholds = NULL;
+	}
+}
+
+static VOID JpkfagsSiftDownThreshold(
+	__inout_ecount( Count ) PJPKFAGS_THRESHOLD Entries,
+	__in ULONG Root,
+	__in ULONG Count
+	)
+{
+	ULONG Child;
+	JPKFAGS_THRESHOLD Temp;
+
+	while ( ( ULONG64 ) Root * 2 + 1 < Count )
+	{
+		Child = Root * 2 + 1;
+		if ( Child + 1 < Count && 
+			 Entries[ Child ].Procedure < Entries[ Child + 1 ].Procedure )
+		{
+			Child++;
+		}
+
+		if ( Entries[ Root ].Procedure >= Entries[ Child ].Procedure )
+		{
+			break;
+		}
+
+		Temp				= Entries[ Root ];
+		Entries[ Root ]		= Entries[ Child ];
+		Entries[ Child ]	= Temp;
+
+		Root = Child;
+	}
+}
+
+/*++
+	Routine Description:
+		Sort thresholds by procedure (heapsort - in place and 
+		without recursion).
+--*/
+static VOID JpkfagsSortThresholds(
+	__inout_ecount( Count ) PJPKFAGS_THRESHOLD Entries,
+	__in ULONG Count
+	)
+{
+	ULONG Index;
+	JPKFAGS_THRESHOLD Temp;
+
+	if ( Count < 2 )
+	{
+		return;
+	}
+
+	for ( Index = Count / 2; Index > 0; Index-- )
+	{
+		JpkfagsSiftDownThreshold( Entries, Index - 1, Count );
+	}
+
+	for ( Index = Count - 1; Index > 0; Index-- )
+	{
+		Temp				= Entries[ 0 ];
+		Entries[ 0 ]		= Entries[ Index ];
+		Entries[ Index ]	= Temp;
+
+		JpkfagsSiftDownThreshold( Entries, 0, Index );
+	}
+}
+
+/*++
+	Routine Description:
+		Wait until no event routine can be using a threshold table
+		that has been unpublished before.
+
+		Readers that have entered before the call are tracked by 
+		one of the two epoch counters. The epoch is flipped before
+		draining either counter s.t. new readers cannot keep it 
+		from draining.
+
+		Callable at PASSIVE_LEVEL, filter lock must be held.
+--*/
+static VOID JpkfagsWaitForThresholdReaders(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	LARGE_INTEGER Delay;
+	ULONG Round;
+	LONG Epoch;
+
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	Delay.QuadPart = -10 * 1000;	// 1 ms.
+
+	for ( Round = 0; Round < 2; Round++ )
+	{
+		Epoch = Sink->Filter.ReaderEpoch;
+		InterlockedExchange( &Sink->Filter.ReaderEpoch, Epoch ^ 1 );
+
+		while ( Sink->Filter.Readers[ Epoch ] != 0 )
+		{
+			( VOID ) KeDelayExecutionThread( KernelMode, FALSE, &Delay );
+		}
+	}
+}
+
+static VOID JpkfagsDeleteIndex(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ASSERT( Sink );
 
-		if ( NT_SUCCESS( Status ) )
+	if ( Sink->Index.Chunks != NULL )
+	{
+		ExFreePoolWithTag( Sink->Index.Chunks, JPKFAG_POOL_TAG );
+	}
+
+	if ( Sink->Index.Segments != NULL )
+	{
+		ExFreePoolWithTag( Sink->Index.Segments, JPKFAG_POOL_TAG );
+	}
+
+	if ( Sink->Index.ImageInfoOffsets != NULL )
+	{
+		ExFreePoolWithTag( Sink->Index.ImageInfoOffsets, JPKFAG_POOL_TAG );
+	}
+
+	if ( Sink->Index.Chunk != NULL )
+	{
+		ExFreePoolWithTag( Sink->Index.Chunk, JPKFAG_POOL_TAG );
+	}
+}
+
+static NTSTATUS JpkfagsInitializeStagingBlock(
+	__in PJPKFAGS_STAGING_BLOCK StagingBlock,
+	__in ULONG Capacity
+	)
+{
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	NTSTATUS Status;
+
+	ASSERT( StagingBlock );
+	ASSERT( ( Capacity % JPTRC_SEGMENT_SIZE ) == 0 );
+
+	InitializeObjectAttributes(
+		&ObjectAttributes,
+		NULL,
+		OBJ_KERNEL_HANDLE,
+		NULL,
+		NULL );
+
+	StagingBlock->Block.Capacity	= Capacity;
+	StagingBlock->Block.Buffer		= ( PUCHAR ) ExAllocatePoolWithTag(
+		PagedPool,
+		Capacity,
+		JPKFAG_POOL_TAG );
+	if ( StagingBlock->Block.Buffer == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	Status = ZwCreateEvent(
+		&StagingBlock->Event,
+		EVENT_ALL_ACCESS,
+		&ObjectAttributes,
+		NotificationEvent,
+		FALSE );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		StagingBlock->Event = NULL;
+		return Status;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static VOID JpkfagsDeleteStagingBlock(
+	__in PJPKFAGS_STAGING_BLOCK StagingBlock
+	)
+{
+	ASSERT( StagingBlock );
+	ASSERT( ! StagingBlock->WritePending );
+
+	if ( StagingBlock->Block.Buffer != NULL )
+	{
+		ExFreePoolWithTag( StagingBlock->Block.Buffer, JPKFAG_POOL_TAG );
+	}
+
+	if ( StagingBlock->Event != NULL )
+	{
+		ZwClose( StagingBlock->Event );
+	}
+}
+
+static NTSTATUS JpkfagsInitializeWriter(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in ULONG FlushInterval
+	)
+{
+	ULONG Index;
+	NTSTATUS Status;
+
+	ASSERT( Sink );
+
+	RtlZeroMemory( &Sink->Writer, sizeof( Sink->Writer ) );
+
+	if ( FlushInterval == 0 )
+	{
+		FlushInterval = JPKFAGS_DEFAULT_FLUSH_INTERVAL;
+	}
+
+	//
+	// Milliseconds -> 100ns units.
+	//
+	Sink->Writer.FlushInterval = ( ULONGLONG ) FlushInterval * 10000;
+	Sink->Writer.LastFlushTime = KeQueryInterruptTime();
+
+	for ( Index = 0; Index < JPKFAGS_STAGING_BLOCK_COUNT; Index++ )
+	{
+		Status = JpkfagsInitializeStagingBlock(
+			&Sink->Writer.Blocks[ Index ],
+			JPKFAGS_STAGING_BLOCK_SIZE );
+		if ( ! NT_SUCCESS( Status ) )
 		{
-			Sink->FilePosition.QuadPart += ( Chunk->Size - BodySize );
+			return Status;
+		}
+	}
+
+	if ( Sink->Circular.Enabled )
+	{
+		Status = JpkfagsInitializeStagingBlock(
+			&Sink->Circular.FixedBlock,
+			JPTRC_SEGMENT_SIZE );
+		if ( ! NT_SUCCESS( Status ) )
+		{
+			return Status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static VOID JpkfagsDeleteWriter(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ULONG Index;
+
+	ASSERT( Sink );
+
+	for ( Index = 0; Index < JPKFAGS_STAGING_BLOCK_COUNT; Index++ )
+	{
+		JpkfagsDeleteStagingBlock( &Sink->Writer.Blocks[ Index ] );
+	}
+
+	JpkfagsDeleteStagingBlock( &Sink->Circular.FixedBlock );
+}
+
+/*++
+	Routine Description:
+		Wait for the write of a staging block to complete.
+--*/
+static VOID JpkfagsWaitForStagingBlock(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPKFAGS_STAGING_BLOCK StagingBlock
+	)
+{
+	NTSTATUS Status;
+
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	if ( ! StagingBlock->WritePending )
+	{
+		return;
+	}
+
+	Status = ZwWaitForSingleObject( StagingBlock->Event, FALSE, NULL );
+	ASSERT( Status == STATUS_SUCCESS );
+	StagingBlock->WritePending = FALSE;
+
+	if ( ! NT_SUCCESS( Status ) || 
+		 ! NT_SUCCESS( StagingBlock->StatusBlock.Status ) )
+	{
+		TRACE( ( "JPKFAG: Failed to write staging block: %x\n", 
+			StagingBlock->StatusBlock.Status ) );
+		InterlockedIncrement( &Sink->Statistics->FailedChunkFlushes );
+	}
+}
+
+/*++
+	Routine Description:
+		Issue an asynchronous write for the portion of a staging
+		block that has not been written yet.
+--*/
+static VOID JpkfagsSubmitStagingBlock(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPKFAGS_STAGING_BLOCK StagingBlock
+	)
+{
+	LARGE_INTEGER Offset;
+	NTSTATUS Status;
+
+	ASSERT( StagingBlock->BytesSubmitted <= StagingBlock->Block.Used );
+
+	if ( StagingBlock->BytesSubmitted == StagingBlock->Block.Used )
+	{
+		return;
+	}
+
+	//
+	// At most one write per block may be in flight - the status block
+	// is reused.
+	//
+	JpkfagsWaitForStagingBlock( Sink, StagingBlock );
+
+	Offset.QuadPart = StagingBlock->Block.FileOffset + 
+		StagingBlock->BytesSubmitted;
+
+	Status = ZwWriteFile(
+		Sink->LogFile,
+		StagingBlock->Event,
+		NULL,
+		NULL,
+		&StagingBlock->StatusBlock,
+		StagingBlock->Block.Buffer + StagingBlock->BytesSubmitted,
+		StagingBlock->Block.Used - StagingBlock->BytesSubmitted,
+		&Offset,
+		NULL );
+	if ( Status == STATUS_PENDING )
+	{
+		StagingBlock->WritePending = TRUE;
+	}
+	else if ( ! NT_SUCCESS( Status ) )
+	{
+		TRACE( ( "JPKFAG: Failed to write staging block: %x\n", Status ) );
+		InterlockedIncrement( &Sink->Statistics->FailedChunkFlushes );
+	}
+
+	//
+	// N.B. Even if the write failed, the block is considered written
+	// to keep the file layout consistent.
+	//
+	StagingBlock->BytesSubmitted = StagingBlock->Block.Used;
+}
+
+/*++
+	Routine Description:
+		Prepare a staging block for being filled, starting at the
+		given file offset. For circular files, the offset wraps 
+		around at the end of the file.
+--*/
+static VOID JpkfagsResetStagingBlock(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPKFAGS_STAGING_BLOCK StagingBlock,
+	__in ULONGLONG FileOffset,
+	__in ULONGLONG NextSequenceNumber
+	)
+{
+	ASSERT( ! StagingBlock->WritePending );
+
+	if ( Sink->Circular.Enabled )
+	{
+		ASSERT( FileOffset >= JPTRC_SEGMENT_SIZE );
+		ASSERT( FileOffset <= Sink->Circular.FileSize );
+
+		if ( FileOffset == Sink->Circular.FileSize )
+		{
+			FileOffset = JPTRC_SEGMENT_SIZE;
+			Sink->Circular.Wrapped = TRUE;
+		}
+
+		//
+		// The last block of the ring may be smaller than the others.
+		//
+		StagingBlock->Block.Capacity = ( ULONG ) min(
+			( ULONGLONG ) JPKFAGS_STAGING_BLOCK_SIZE,
+			Sink->Circular.FileSize - FileOffset );
+	}
+
+	JptrcstgResetBlock( &StagingBlock->Block, FileOffset );
+	StagingBlock->Block.NextSequenceNumber	= NextSequenceNumber;
+	StagingBlock->BytesSubmitted			= 0;
+}
+
+/*++
+	Routine Description:
+		Update the circular header chunk s.t. it covers all data
+		written so far. 
+		
+		Must only be called after all staged data has been written 
+		and flushed - the header must never refer to data that may 
+		not have reached the disk yet.
+--*/
+static VOID JpkfagsUpdateCircularHeader(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	PJPKFAGS_STAGING_BLOCK CurrentBlock;
+	PJPKFAGS_STAGING_BLOCK FixedBlock;
+	PJPTRC_CIRCULAR_HEADER_CHUNK Header;
+	LARGE_INTEGER Offset;
+	NTSTATUS Status;
+
+	ASSERT( Sink->Circular.Enabled );
+
+	CurrentBlock	= &Sink->Writer.Blocks[ Sink->Writer.CurrentBlock ];
+	FixedBlock		= &Sink->Circular.FixedBlock;
+
+	ASSERT( ! FixedBlock->WritePending );
+
+	Header = ( PJPTRC_CIRCULAR_HEADER_CHUNK ) 
+		( FixedBlock->Block.Buffer + sizeof( JPTRC_FILE_HEADER ) );
+
+	Header->FixedDataEnd		= FixedBlock->Block.Used;
+	Header->HeadSequenceNumber	= CurrentBlock->Block.NextSequenceNumber - 1;
+	Header->HeadOffset			= Sink->FilePosition.QuadPart;
+
+	Offset.QuadPart = sizeof( JPTRC_FILE_HEADER );
+
+	Status = ZwWriteFile(
+		Sink->LogFile,
+		FixedBlock->Event,
+		NULL,
+		NULL,
+		&FixedBlock->StatusBlock,
+		Header,
+		sizeof( JPTRC_CIRCULAR_HEADER_CHUNK ),
+		&Offset,
+		NULL );
+	if ( Status == STATUS_PENDING )
+	{
+		FixedBlock->WritePending = TRUE;
+		JpkfagsWaitForStagingBlock( Sink, FixedBlock );
+	}
+	else if ( ! NT_SUCCESS( Status ) )
+	{
+		TRACE( ( "JPKFAG: Failed to write circular header: %x\n", Status ) );
+		InterlockedIncrement( &Sink->Statistics->FailedChunkFlushes );
+	}
+}
+
+/*++
+	Routine Description:
+		Write all staged data and flush file buffers.
+--*/
+static VOID JpkfagsFlushStagingBlocks(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ULONG Index;
+	IO_STATUS_BLOCK StatusBlock;
+
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	JpkfagsSubmitStagingBlock( 
+		Sink, 
+		&Sink->Writer.Blocks[ Sink->Writer.CurrentBlock ] );
+
+	if ( Sink->Circular.Enabled )
+	{
+		JpkfagsSubmitStagingBlock( Sink, &Sink->Circular.FixedBlock );
+		JpkfagsWaitForStagingBlock( Sink, &Sink->Circular.FixedBlock );
+	}
+
+	for ( Index = 0; Index < JPKFAGS_STAGING_BLOCK_COUNT; Index++ )
+	{
+		JpkfagsWaitForStagingBlock( Sink, &Sink->Writer.Blocks[ Index ] );
+	}
+
+	if ( JpkfagsZwFlushBuffersFile != NULL )
+	{
+		( VOID ) ( JpkfagsZwFlushBuffersFile )( 
+			Sink->LogFile, 
+			&StatusBlock );
+	}
+
+	if ( Sink->Circular.Enabled )
+	{
+		//
+		// N.B. The header itself reaches the disk with the next flush
+		// or when the file is closed.
+		//
+		JpkfagsUpdateCircularHeader( Sink );
+	}
+
+	Sink->Writer.LastFlushTime = KeQueryInterruptTime();
+}
+
+/*++
+	Routine Description:
+		Append a chunk to the current staging block. Full staging 
+		blocks are written asynchronously. 
+
+		Write errors are reported asynchronously by incrementing
+		FailedChunkFlushes.
+
+	Parameters:
+		Chunk		- Header, always defines overall size.
+		Body		- if non-null, chunk header and body are written 
+					  separately. 
+		BodySize	- Size of body. This size is included in Chunk->Size.
+--*/
+static VOID JpkfagsWriteChunk(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPTRC_CHUNK_HEADER Chunk,
+	__in_opt /*_bcount( BodySize )*/ PVOID Body,
+	__in_opt ULONG BodySize
+	)
+{
+	PJPKFAGS_STAGING_BLOCK StagingBlock;
+
+	ASSERT( Sink );
+	ASSERT( Chunk );
+	ASSERT( Chunk->Reserved == 0 );
+	ASSERT( Chunk->Size > sizeof( JPTRC_CHUNK_HEADER ) );
+	ASSERT( Chunk->Size <= JPTRC_SEGMENT_SIZE );
+	ASSERT( ( Body == NULL ) == ( BodySize == 0 ) );
+	ASSERT( BodySize == 0 || BodySize <= Chunk->Size - sizeof( JPTRC_CHUNK_HEADER ) );
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+	ASSERT( ( Chunk->Size % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+	ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+
+	StagingBlock = &Sink->Writer.Blocks[ Sink->Writer.CurrentBlock ];
+
+	if ( ! JptrcstgAppendChunk( &StagingBlock->Block, Chunk, Body, BodySize, NULL ) )
+	{
+		ULONGLONG NextFileOffset = 
+			StagingBlock->Block.FileOffset + StagingBlock->Block.Capacity;
+		ULONGLONG NextSequenceNumber = StagingBlock->Block.NextSequenceNumber;
+
+		//
+		// Block full (and possibly padded) - write it and continue
+		// with the next block, which may have to be waited for.
+		//
+		JpkfagsSubmitStagingBlock( Sink, StagingBlock );
+
+		Sink->Writer.CurrentBlock = 
+			( Sink->Writer.CurrentBlock + 1 ) % JPKFAGS_STAGING_BLOCK_COUNT;
+		StagingBlock = &Sink->Writer.Blocks[ Sink->Writer.CurrentBlock ];
+
+		JpkfagsWaitForStagingBlock( Sink, StagingBlock );
+		JpkfagsResetStagingBlock( 
+			Sink, 
+			StagingBlock, 
+			NextFileOffset, 
+			NextSequenceNumber );
+
+		VERIFY( JptrcstgAppendChunk( &StagingBlock->Block, Chunk, Body, BodySize, NULL ) );
+	}
+
+	Sink->FilePosition.QuadPart = 
+		StagingBlock->Block.FileOffset + StagingBlock->Block.Used;
+
+	if ( StagingBlock->Block.Used == StagingBlock->Block.Capacity )
+	{
+		//
+		// Do not wait for the next chunk to get the write started.
+		//
+		JpkfagsSubmitStagingBlock( Sink, StagingBlock );
+	}
+
+	ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+}
+
+/*++
+	Routine Description:
+		Build an index chunk covering all chunks recorded since the
+		last index chunk and write it to the file.
+--*/
+static VOID JpkfagsFlushIndex(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	PJPTRC_INDEX_CHUNK Chunk;
+	PJPTRC_INDEX_CLIENT Clients;
+	PULONGLONG ChunkOffsets;
+	ULONG ClientIndex;
+	ULONG ClientCount;
+	ULONG EntryIndex;
+	ULONG NextChunk;
+
+	ASSERT( Sink );
+
+	Chunk = Sink->Index.Chunk;
+
+	//
+	// Determine clients and the number of chunks per client. Buffers
+	// of the same client tend to be flushed in succession, so check the
+	// last client found first.
+	//
+	Clients		= ( PJPTRC_INDEX_CLIENT ) 
+		( ( PUCHAR ) Chunk + JPTRC_INDEX_CHUNK_SIZE( 
+			Sink->Index.ImageInfoCount, Sink->Index.SegmentCount, 0, 0 ) );
+	ClientCount	= 0;
+	ClientIndex	= 0;
+
+	for ( EntryIndex = 0; EntryIndex < Sink->Index.ChunkCount; EntryIndex++ )
+	{
+		PJPKFAGS_INDEX_ENTRY Entry = &Sink->Index.Chunks[ EntryIndex ];
+
+		if ( ClientIndex >= ClientCount ||
+			 Clients[ ClientIndex ].ProcessId != Entry->ProcessId ||
+			 Clients[ ClientIndex ].ThreadId != Entry->ThreadId )
+		{
+			for ( ClientIndex = 0; ClientIndex < ClientCount; ClientIndex++ )
+			{
+				if ( Clients[ ClientIndex ].ProcessId == Entry->ProcessId &&
+					 Clients[ ClientIndex ].ThreadId == Entry->ThreadId )
+				{
+					break;
+				}
+			}
+
+			if ( ClientIndex == ClientCount )
+			{
+				Clients[ ClientIndex ].ProcessId	= Entry->ProcessId;
+				Clients[ ClientIndex ].ThreadId		= Entry->ThreadId;
+				Clients[ ClientIndex ].FirstChunk	= 0;
+				Clients[ ClientIndex ].ChunkCount	= 0;
+				ClientCount++;
+			}
+		}
+
+		Clients[ ClientIndex ].ChunkCount++;
+	}
+
+	//
+	// Fill header and copy image info offsets and segments.
+	//
+	Chunk->Header.Type			= JPTRC_CHUNK_TYPE_INDEX;
+	Chunk->Header.Reserved		= 0;
+	Chunk->Header.Size			= JPTRC_INDEX_CHUNK_SIZE(
+		Sink->Index.ImageInfoCount,
+		Sink->Index.SegmentCount,
+		ClientCount,
+		Sink->Index.ChunkCount );
+	Chunk->PreviousIndexOffset	= Sink->Index.PreviousIndexOffset;
+	Chunk->StartOffset			= Sink->Index.StartOffset;
+	Chunk->EndOffset			= Sink->FilePosition.QuadPart;
+	Chunk->ImageInfoCount		= Sink->Index.ImageInfoCount;
+	Chunk->SegmentCount			= Sink->Index.SegmentCount;
+	Chunk->ClientCount			= ClientCount;
+	Chunk->ChunkCount			= Sink->Index.ChunkCount;
+
+	ASSERT( Chunk->Header.Size <= JPKFAGS_INDEX_MAX_SIZE );
+	ASSERT( JPTRC_INDEX_CLIENTS( Chunk ) == Clients );
+
+	RtlCopyMemory(
+		JPTRC_INDEX_IMAGE_INFO_OFFSETS( Chunk ),
+		Sink->Index.ImageInfoOffsets,
+		Sink->Index.ImageInfoCount * sizeof( ULONGLONG ) );
+	RtlCopyMemory(
+		JPTRC_INDEX_SEGMENTS( Chunk ),
+		Sink->Index.Segments,
+		Sink->Index.SegmentCount * sizeof( JPTRC_INDEX_SEGMENT ) );
+
+	//
+	// Assign ranges of the offset array to clients, then distribute
+	// offsets. ChunkCount is recalculated in the process.
+	//
+	NextChunk = 0;
+	for ( ClientIndex = 0; ClientIndex < ClientCount; ClientIndex++ )
+	{
+		Clients[ ClientIndex ].FirstChunk	= NextChunk;
+		NextChunk							+= Clients[ ClientIndex ].ChunkCount;
+		Clients[ ClientIndex ].ChunkCount	= 0;
+	}
+
+	ChunkOffsets = JPTRC_INDEX_CHUNK_OFFSETS( Chunk );
+	ClientIndex = 0;
+	for ( EntryIndex = 0; EntryIndex < Sink->Index.ChunkCount; EntryIndex++ )
+	{
+		PJPKFAGS_INDEX_ENTRY Entry = &Sink->Index.Chunks[ EntryIndex ];
+
+		if ( Clients[ ClientIndex ].ProcessId != Entry->ProcessId ||
+			 Clients[ ClientIndex ].ThreadId != Entry->ThreadId )
+		{
+			for ( ClientIndex = 0; ClientIndex < ClientCount; ClientIndex++ )
+			{
+				if ( Clients[ ClientIndex ].ProcessId == Entry->ProcessId &&
+					 Clients[ ClientIndex ].ThreadId == Entry->ThreadId )
+				{
+					break;
+				}
+			}
+
+			ASSERT( ClientIndex < ClientCount );
+		}
+
+		ChunkOffsets[ Clients[ ClientIndex ].FirstChunk + 
+			Clients[ ClientIndex ].ChunkCount++ ] = Entry->Offset;
+	}
+
+	JpkfagsWriteChunk( Sink, &Chunk->Header, NULL, 0 );
+
+	//
+	// N.B. A pad chunk may have been written in front of the index
+	// chunk.
+	//
+	Sink->Index.PreviousIndexOffset	= 
+		Sink->FilePosition.QuadPart - Chunk->Header.Size;
+	Sink->Index.StartOffset			= Sink->FilePosition.QuadPart;
+	Sink->Index.ChunkCount			= 0;
+	Sink->Index.SegmentCount		= 0;
+	Sink->Index.ImageInfoCount		= 0;
+}
+
+/*++
+	Routine Description:
+		Record a chunk that has just been written in the index.
+
+	Parameters:
+		Chunk			- Chunk written. Must be an image info, 
+						  symbol table or trace buffer chunk.
+		ProcessId, 
+		ThreadId		- Client, only used for trace buffer chunks.
+		MinTimestamp, 
+		MaxTimestamp	- Range of timestamps, only used for trace 
+						  buffer chunks.
+--*/
+static VOID JpkfagsRecordChunk(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPTRC_CHUNK_HEADER Chunk,
+	__in ULONG ProcessId,
+	__in ULONG ThreadId,
+	__in ULONGLONG MinTimestamp,
+	__in ULONGLONG MaxTimestamp
+	)
+{
+	ULONGLONG Offset;
+
+	ASSERT( Sink );
+	ASSERT( Chunk );
+
+	if ( Sink->Circular.Enabled )
+	{
+		//
+		// Offsets become stale as the ring wraps around, so circular
+		// files do not have an index.
+		//
+		return;
+	}
+
+	Offset = Sink->FilePosition.QuadPart - Chunk->Size;
+
+	if ( Chunk->Type == JPTRC_CHUNK_TYPE_IMAGE_INFO ||
+		 Chunk->Type == JPTRC_CHUNK_TYPE_SYMBOL_TABLE ||
+		 Chunk->Type == JPTRC_CHUNK_TYPE_CALIBRATION )
+	{
+		Sink->Index.ImageInfoOffsets[ Sink->Index.ImageInfoCount++ ] = Offset;
+	}
+	else
+	{
+		PJPKFAGS_INDEX_ENTRY Entry;
+		ULONGLONG SegmentOffset = Offset - ( Offset % JPTRC_SEGMENT_SIZE );
+		PJPTRC_INDEX_SEGMENT Segment = Sink->Index.SegmentCount > 0
+			? &Sink->Index.Segments[ Sink->Index.SegmentCount - 1 ]
+			: NULL;
+
+		ASSERT( Chunk->Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER ||
+				Chunk->Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT );
+
+		Entry = &Sink->Index.Chunks[ Sink->Index.ChunkCount++ ];
+		Entry->ProcessId	= ProcessId;
+		Entry->ThreadId		= ThreadId;
+		Entry->Offset		= Offset;
+
+		//
+		// Chunks are written in file order, so only the last segment
+		// can be the current one.
+		//
+		if ( Segment != NULL && Segment->Offset == SegmentOffset )
+		{
+			Segment->MinTimestamp = min( Segment->MinTimestamp, MinTimestamp );
+			Segment->MaxTimestamp = max( Segment->MaxTimestamp, MaxTimestamp );
+		}
+		else
+		{
+			Segment = &Sink->Index.Segments[ Sink->Index.SegmentCount++ ];
+			Segment->Offset			= SegmentOffset;
+			Segment->MinTimestamp	= MinTimestamp;
+			Segment->MaxTimestamp	= MaxTimestamp;
+		}
+	}
+
+	if ( Sink->Index.ChunkCount == JPKFAGS_INDEX_MAX_CHUNKS ||
+		 Sink->Index.SegmentCount == JPKFAGS_INDEX_MAX_SEGMENTS ||
+		 Sink->Index.ImageInfoCount == JPKFAGS_INDEX_MAX_IMAGE_INFOS )
+	{
+		JpkfagsFlushIndex( Sink );
+	}
+}
+
+/*++
+	Routine Description:
+		Write the final index chunk and the trailer.
+--*/
+static VOID JpkfagsFinalizeIndex(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	JPTRC_INDEX_TRAILER_CHUNK Trailer;
+
+	ASSERT( Sink );
+
+	if ( Sink->Circular.Enabled )
+	{
+		return;
+	}
+
+	JpkfagsFlushIndex( Sink );
+
+	Trailer.Header.Type			= JPTRC_CHUNK_TYPE_INDEX_TRAILER;
+	Trailer.Header.Reserved		= 0;
+	Trailer.Header.Size			= sizeof( JPTRC_INDEX_TRAILER_CHUNK );
+	Trailer.LastIndexOffset		= Sink->Index.PreviousIndexOffset;
+
+	//
+	// N.B. A pad chunk may precede the trailer, the trailer is still
+	// located at the very end of the file.
+	//
+	JpkfagsWriteChunk( Sink, &Trailer.Header, NULL, 0 );
+}
+
+/*++
+	Routine Description:
+		Write an image info or symbol table chunk.
+
+	Return Value:
+		TRUE if the chunk has been placed in segment 0 of a
+		circular file.
+--*/
+static BOOLEAN JpkfagsWriteMetadataChunk(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPTRC_CHUNK_HEADER Chunk
+	)
+{
+	//
+	// For circular files, these chunks are preferably placed
+	// in segment 0 as they must outlive the ring. Once segment 0
+	// is full, they go to the ring like any other chunk.
+	//
+	if ( Sink->Circular.Enabled &&
+		 JptrcstgAppendChunk( 
+			&Sink->Circular.FixedBlock.Block, 
+			Chunk, 
+			NULL, 
+			0, 
+			NULL ) )
+	{
+		return TRUE;
+	}
+	else
+	{
+		JpkfagsWriteChunk( Sink, Chunk, NULL, 0 );
+		JpkfagsRecordChunk( Sink, Chunk, 0, 0, 0, 0 );
+		return FALSE;
+	}
+}
+
+/*++
+	Routine Description:
+		Write a calibration chunk covering the current time.
+--*/
+static VOID JpkfagsWriteCalibrationChunk(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	PJPTRC_CALIBRATION_CHUNK Chunk = Sink->Calibration.Chunk;
+	ULONGLONG Counter;
+	ULONGLONG Elapsed;
+	ULONGLONG Frequency;
+
+	JpkfagsReadClocks( &Chunk->Timestamp, &Counter, &Chunk->SystemTime );
+
+	Frequency = JpkfagsMeasureFrequency( 
+		Sink, 
+		Chunk->Timestamp, 
+		Counter, 
+		&Elapsed );
+	if ( Frequency != 0 )
+	{
+		Chunk->Frequency = Frequency;
+	}
+
+	if ( Elapsed >= JPKFAGS_CALIBRATION_MAX_SPAN )
+	{
+		Sink->Calibration.ReferenceTimestamp	= Chunk->Timestamp;
+		Sink->Calibration.ReferenceCounter		= Counter;
+	}
+
+	( VOID ) JpkfagsWriteMetadataChunk( Sink, &Chunk->Header );
+
+	Sink->Calibration.LastCalibrationTime = KeQueryInterruptTime();
+}
+
+/*++
+	Routine Description:
+		Write an image info event and add it to the list of written
+		events. An event written earlier for the same load address 
+		is superseded.
+--*/
+static VOID JpkfagsWriteImageInfoEvent(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPKFAGP_IMAGE_INFO_EVENT Event
+	)
+{
+	PLIST_ENTRY ListEntry;
+
+	ASSERT( ! Event->Written );
+
+	for ( ListEntry = Sink->ImageCache.Written.Flink;
+		  ListEntry != &Sink->ImageCache.Written;
+		  ListEntry = ListEntry->Flink )
+	{
+		PJPKFAGP_IMAGE_INFO_EVENT WrittenEvent = CONTAINING_RECORD(
+			ListEntry,
+			JPKFAGP_IMAGE_INFO_EVENT,
+			WrittenListEntry );
+
+		if ( WrittenEvent->Event.LoadAddress == Event->Event.LoadAddress )
+		{
+			RemoveEntryList( &WrittenEvent->WrittenListEntry );
+			WrittenEvent->Written = FALSE;
+			break;
+		}
+	}
+
+	Event->InFixedSegment = JpkfagsWriteMetadataChunk( 
+		Sink, 
+		&Event->Event.Header );
+
+	InsertTailList( &Sink->ImageCache.Written, &Event->WrittenListEntry );
+	Event->Written = TRUE;
+}
+
+/*++
+	Routine Description:
+		Write all image info events written so far again.
+
+	Parameters:
+		RingOnly	- Skip events residing in segment 0 of a 
+					  circular file.
+--*/
+static VOID JpkfagsRewriteImageInfoEvents(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in BOOLEAN RingOnly
+	)
+{
+	PLIST_ENTRY ListEntry;
+
+	for ( ListEntry = Sink->ImageCache.Written.Flink;
+		  ListEntry != &Sink->ImageCache.Written;
+		  ListEntry = ListEntry->Flink )
+	{
+		PJPKFAGP_IMAGE_INFO_EVENT Event = CONTAINING_RECORD(
+			ListEntry,
+			JPKFAGP_IMAGE_INFO_EVENT,
+			WrittenListEntry );
+
+		if ( RingOnly && Event->InFixedSegment )
+		{
+			continue;
+		}
+
+		Event->InFixedSegment = JpkfagsWriteMetadataChunk( 
+			Sink, 
+			&Event->Event.Header );
+	}
+}
+
+static VOID JpkfagsFlushImageInfoEventQueue(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink 
+	)
+{
+	PSLIST_ENTRY ListEntry;
+	PJPKFAGP_IMAGE_INFO_EVENT Event;
+
+	ASSERT( Sink );
+
+	while ( ( ListEntry = InterlockedPopEntrySList( &Sink->ImageInfoEventQueue ) ) != NULL )
+	{
+		Event = CONTAINING_RECORD(
+			ListEntry,
+			JPKFAGP_IMAGE_INFO_EVENT,
+			ListEntry );
+
+		//
+		// N.B. The event remains owned by the cache.
+		//
+		JpkfagsWriteImageInfoEvent( Sink, Event );
+	}
+
+	if ( Sink->Circular.Wrapped )
+	{
+		//
+		// The chunks placed in the ring during the previous pass are 
+		// about to be overwritten.
+		//
+		Sink->Circular.Wrapped = FALSE;
+		JpkfagsRewriteImageInfoEvents( Sink, TRUE );
+	}
+}
+
+static VOID JpkfagsFlushSymbolTableEventQueue(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink 
+	)
+{
+	PSLIST_ENTRY ListEntry;
+	PSLIST_ENTRY Reversed = NULL;
+
+	ASSERT( Sink );
+
+	//
+	// Later tables supersede earlier ones, so restore the order in
+	// which the events have been queued.
+	//
+	ListEntry = InterlockedFlushSList( &Sink->SymbolTableEventQueue );
+	while ( ListEntry != NULL )
+	{
+		PSLIST_ENTRY Next = ListEntry->Next;
+		ListEntry->Next = Reversed;
+		Reversed = ListEntry;
+		ListEntry = Next;
+	}
+
+	while ( Reversed != NULL )
+	{
+		PJPKFAGP_SYMBOL_TABLE_EVENT Event = CONTAINING_RECORD(
+			Reversed,
+			JPKFAGP_SYMBOL_TABLE_EVENT,
+			ListEntry );
+		Reversed = Reversed->Next;
+
+		JpkfagsWriteMetadataChunk( Sink, &Event->Event.Header );
+
+		if ( Sink->Rotation.Enabled )
+		{
+			InsertTailList( 
+				&Sink->Rotation.SymbolTables, 
+				&Event->RetainedListEntry );
+		}
+		else
+		{
+			ExFreePoolWithTag( Event, JPKFAG_POOL_TAG );
+		}
+	}
+}
+
+/*++
+	Routine Description:
+		Fill the file header at the beginning of a block.
+--*/
+static VOID JpkfagsStageFileHeader(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PJPTRCSTG_BLOCK HeaderBlock
+	)
+{
+	PJPTRC_FILE_HEADER FileHeader;
+
+	ASSERT( HeaderBlock->FileOffset == 0 );
+	ASSERT( HeaderBlock->Used == 0 );
+
+	FileHeader = ( PJPTRC_FILE_HEADER ) HeaderBlock->Buffer;
+	FileHeader->Signature				= JPTRC_HEADER_SIGNATURE;
+	FileHeader->Version					= JPTRC_HEADER_VERSION;
+	FileHeader->Characteristics			= 
+		JPTRC_CHARACTERISTIC_TIMESTAMP_TSC |
+		JPTRC_CHARACTERISTIC_32BIT |
+		( Sink->Circular.Enabled ? JPTRC_CHARACTERISTIC_CIRCULAR : 0 );
+	FileHeader->__Reserved[ 0 ]			= 0;
+	FileHeader->__Reserved[ 1 ]			= 0;
+
+	HeaderBlock->Used					= sizeof( JPTRC_FILE_HEADER );
+}
+
+/*++
+	Routine Description:
+		Prepare writing to a new, empty, non-circular log file: Stage
+		the file header, followed by a continuation chunk if rotation
+		is enabled, and reset the index.
+
+		All staging blocks must have been written.
+--*/
+static VOID JpkfagsBeginLogFile(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	PJPTRCSTG_BLOCK HeaderBlock;
+
+	ASSERT( ! Sink->Circular.Enabled );
+
+	Sink->Writer.CurrentBlock = 0;
+	JpkfagsResetStagingBlock( Sink, &Sink->Writer.Blocks[ 0 ], 0, 0 );
+
+	HeaderBlock = &Sink->Writer.Blocks[ 0 ].Block;
+	JpkfagsStageFileHeader( Sink, HeaderBlock );
+
+	if ( Sink->Rotation.Enabled )
+	{
+		PJPTRC_CONTINUATION_CHUNK Continuation = 
+			( PJPTRC_CONTINUATION_CHUNK ) 
+			( HeaderBlock->Buffer + HeaderBlock->Used );
+
+		HeaderBlock->Used += sizeof( JPTRC_CONTINUATION_CHUNK );
+
+		Continuation->Header.Type		= JPTRC_CHUNK_TYPE_CONTINUATION;
+		Continuation->Header.Reserved	= 0;
+		Continuation->Header.Size		= sizeof( JPTRC_CONTINUATION_CHUNK );
+		Continuation->SequenceNumber	= Sink->Rotation.SequenceNumber;
+		Continuation->Reserved			= 0;
+		Continuation->SetId				= Sink->Rotation.SetId;
+
+		Sink->Rotation.FileCreationTime	= KeQueryInterruptTime();
+	}
+
+	Sink->FilePosition.QuadPart = HeaderBlock->Used;
+
+	//
+	// The first index chunk covers the continuation chunk, which
+	// does not require any index entries.
+	//
+	Sink->Index.PreviousIndexOffset	= 0;
+	Sink->Index.StartOffset			= sizeof( JPTRC_FILE_HEADER );
+	Sink->Index.ChunkCount			= 0;
+	Sink->Index.SegmentCount		= 0;
+	Sink->Index.ImageInfoCount		= 0;
+}
+
+/*++
+	Routine Description:
+		Prepare rotation: Open the directory containing the log file
+		and split the file name into base name and extension.
+
+		N.B. Must be called in the context of the requestor - the
+		directory is opened with access checks applied. Subsequent
+		files are created relative to this directory from the
+		context of the collector thread.
+--*/
+static NTSTATUS JpkfagsInitializeRotation(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PUNICODE_STRING LogFilePath,
+	__in PJPKFBT_LOG_OPTIONS LogOptions
+	)
+{
+	UNICODE_STRING DirectoryPath;
+	USHORT DotIndex;
+	IO_STATUS_BLOCK IoStatus;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	PWSTR NameBuffer;
+	USHORT NameIndex;
+	USHORT PathLength;
+	NTSTATUS Status;
+	LARGE_INTEGER SystemTime;
+
+	ASSERT( ! Sink->Circular.Enabled );
+
+	InitializeListHead( &Sink->Rotation.SymbolTables );
+
+	if ( LogOptions->MaximumFileSize == 0 &&
+		 LogOptions->RotationInterval == 0 )
+	{
+		return STATUS_SUCCESS;
+	}
+
+	Sink->Rotation.MaximumFileSize	= 
+		( ULONGLONG ) LogOptions->MaximumFileSize * JPKFAGS_MEGABYTE;
+	Sink->Rotation.Interval			= 
+		( ULONGLONG ) LogOptions->RotationInterval * 10000000;
+
+	KeQuerySystemTime( &SystemTime );
+	Sink->Rotation.SetId			= SystemTime.QuadPart;
+	Sink->Rotation.SequenceNumber	= 0;
+
+	//
+	// Split path into directory and file name.
+	//
+	PathLength = LogFilePath->Length / sizeof( WCHAR );
+	for ( NameIndex = PathLength; NameIndex > 0; NameIndex-- )
+	{
+		if ( LogFilePath->Buffer[ NameIndex - 1 ] == L'\\' )
+		{
+			break;
+		}
+	}
+
+	if ( NameIndex <= 1 || NameIndex == PathLength )
+	{
+		return STATUS_OBJECT_PATH_SYNTAX_BAD;
+	}
+
+	//
+	// N.B. The directory path retains the trailing backslash s.t.
+	// root directories can be opened.
+	//
+	DirectoryPath.Buffer		= LogFilePath->Buffer;
+	DirectoryPath.Length		= NameIndex * sizeof( WCHAR );
+	DirectoryPath.MaximumLength	= DirectoryPath.Length;
+
+	//
+	// Split off the extension, including the dot. A leading dot
+	// does not start an extension.
+	//
+	for ( DotIndex = PathLength - 1; DotIndex > NameIndex; DotIndex-- )
+	{
+		if ( LogFilePath->Buffer[ DotIndex ] == L'.' )
+		{
+			break;
+		}
+	}
+
+	if ( DotIndex == NameIndex )
+	{
+		DotIndex = PathLength;
+	}
+
+	//
+	// Copy the name as the path is not retained. The buffer holds
+	// base name and extension, followed by the name of the 
+	// current rotated file.
+	//
+	NameBuffer = ( PWSTR ) ExAllocatePoolWithTag(
+		PagedPool,
+		2 * ( PathLength - NameIndex ) * sizeof( WCHAR ) +
+			( 1 + JPKFAGS_MAX_SEQUENCE_NUMBER_CCH ) * sizeof( WCHAR ),
+		JPKFAG_POOL_TAG );
+	if ( NameBuffer == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	RtlCopyMemory(
+		NameBuffer,
+		LogFilePath->Buffer + NameIndex,
+		( PathLength - NameIndex ) * sizeof( WCHAR ) );
+
+	Sink->Rotation.BaseName.Buffer			= NameBuffer;
+	Sink->Rotation.BaseName.Length			= 
+		( DotIndex - NameIndex ) * sizeof( WCHAR );
+	Sink->Rotation.BaseName.MaximumLength	= Sink->Rotation.BaseName.Length;
+
+	Sink->Rotation.Extension.Buffer			= 
+		NameBuffer + ( DotIndex - NameIndex );
+	Sink->Rotation.Extension.Length			= 
+		( PathLength - DotIndex ) * sizeof( WCHAR );
+	Sink->Rotation.Extension.MaximumLength	= Sink->Rotation.Extension.Length;
+
+	Sink->Rotation.FileName.Buffer			= 
+		NameBuffer + ( PathLength - NameIndex );
+	Sink->Rotation.FileName.Length			= 0;
+	Sink->Rotation.FileName.MaximumLength	= ( USHORT ) ( 
+		( PathLength - NameIndex ) * sizeof( WCHAR ) +
+		( 1 + JPKFAGS_MAX_SEQUENCE_NUMBER_CCH ) * sizeof( WCHAR ) );
+
+	//
+	// Open directory.
+	//
+	InitializeObjectAttributes(
+		&ObjectAttributes,
+		&DirectoryPath,
+		OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE | OBJ_FORCE_ACCESS_CHECK,
+		NULL,
+		NULL );
+
+	Status = ZwCreateFile(
+		&Sink->Rotation.Directory,
+		FILE_TRAVERSE | FILE_ADD_FILE | SYNCHRONIZE,
+		&ObjectAttributes,
+		&IoStatus,
+		NULL,
+		0,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		FILE_OPEN,
+		FILE_DIRECTORY_FILE,
+		NULL,
+		0 );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		TRACE( ( "JPKFAG: Opening log directory '%wZ' failed: %x\n", 
+			&DirectoryPath, Status ) );
+		Sink->Rotation.Directory = NULL;
+		return Status;
+	}
+
+	Sink->Rotation.Enabled = TRUE;
+
+	return STATUS_SUCCESS;
+}
+
+static VOID JpkfagsDeleteRotation(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ASSERT( Sink );
+
+	if ( Sink->Rotation.SymbolTables.Flink != NULL )
+	{
+		while ( ! IsListEmpty( &Sink->Rotation.SymbolTables ) )
+		{
+			PJPKFAGP_SYMBOL_TABLE_EVENT Event = CONTAINING_RECORD(
+				RemoveHeadList( &Sink->Rotation.SymbolTables ),
+				JPKFAGP_SYMBOL_TABLE_EVENT,
+				RetainedListEntry );
+			ExFreePoolWithTag( Event, JPKFAG_POOL_TAG );
+		}
+	}
+
+	if ( Sink->Rotation.Directory != NULL )
+	{
+		ZwClose( Sink->Rotation.Directory );
+	}
+
+	//
+	// N.B. BaseName points to the beginning of the buffer.
+	//
+	if ( Sink->Rotation.BaseName.Buffer != NULL )
+	{
+		ExFreePoolWithTag( Sink->Rotation.BaseName.Buffer, JPKFAG_POOL_TAG );
+	}
+}
+
+/*++
+	Routine Description:
+		Close the current log file and continue in a new one. 
+		
+		If the new file cannot be created, rotation is disabled and
+		tracing continues in the current file.
+--*/
+static VOID JpkfagsRotateLogFile(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	IO_STATUS_BLOCK IoStatus;
+	PLIST_ENTRY ListEntry;
+	HANDLE NewFile;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	NTSTATUS Status;
+
+	ASSERT( Sink->Rotation.Enabled );
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	Status = RtlUnicodeStringPrintf(
+		&Sink->Rotation.FileName,
+		L"%wZ.%04u%wZ",
+		&Sink->Rotation.BaseName,
+		Sink->Rotation.SequenceNumber + 1,
+		&Sink->Rotation.Extension );
+	if ( NT_SUCCESS( Status ) )
+	{
+		InitializeObjectAttributes(
+			&ObjectAttributes,
+			&Sink->Rotation.FileName,
+			OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+			Sink->Rotation.Directory,
+			NULL );
+
+		Status = ZwCreateFile(
+			&NewFile,
+			GENERIC_WRITE,
+			&ObjectAttributes,
+			&IoStatus,
+			NULL,
+			FILE_ATTRIBUTE_NORMAL,
+			FILE_SHARE_READ,
+			FILE_CREATE,
+			0,
+			NULL,
+			0 );
+	}
+
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		TRACE( ( "JPKFAG: Rotating log file failed: %x\n", Status ) );
+		Sink->Rotation.Enabled = FALSE;
+		return;
+	}
+
+	TRACE( ( "JPKFAG: Rotated log file to '%wZ'\n", 
+		&Sink->Rotation.FileName ) );
+
+	//
+	// Complete and close current file.
+	//
+	JpkfagsFinalizeIndex( Sink );
+	JpkfagsFlushStagingBlocks( Sink );
+
+	ZwClose( Sink->LogFile );
+
+	Sink->LogFile = NewFile;
+	Sink->Rotation.SequenceNumber++;
+
+	JpkfagsBeginLogFile( Sink );
+
+	//
+	// Make the new file self-contained.
+	//
+	JpkfagsRewriteImageInfoEvents( Sink, FALSE );
+	JpkfagsWriteCalibrationChunk( Sink );
+
+	for ( ListEntry = Sink->Rotation.SymbolTables.Flink;
+		  ListEntry != &Sink->Rotation.SymbolTables;
+		  ListEntry = ListEntry->Flink )
+	{
+		PJPKFAGP_SYMBOL_TABLE_EVENT Event = CONTAINING_RECORD(
+			ListEntry,
+			JPKFAGP_SYMBOL_TABLE_EVENT,
+			RetainedListEntry );
+
+		JpkfagsWriteMetadataChunk( Sink, &Event->Event.Header );
+	}
+}
+
+static VOID JpkfagsInitializeImageCache(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ULONG Index;
 
-			Status = JpkfagsWrite(
-				Sink,
-				Body,
-				BodySize );
-			if ( NT_SUCCESS( Status ) )
-			{
-				Sink->FilePosition.QuadPart += BodySize;
-			}
-		}
+	KeInitializeGuardedMutex( &Sink->ImageCache.Lock );
 
+	for ( Index = 0; Index < JPKFAGS_IMAGE_CACHE_BUCKETS; Index++ )
+	{
+		InitializeListHead( &Sink->ImageCache.Buckets[ Index ] );
 	}
 
-	if ( NT_SUCCESS( Status ) )
+	InitializeListHead( &Sink->ImageCache.Evicted );
+	InitializeListHead( &Sink->ImageCache.Written );
+}
+
+static VOID JpkfagsDeleteImageCacheList(
+	__in PLIST_ENTRY ListHead
+	)
+{
+	while ( ! IsListEmpty( ListHead ) )
 	{
-		IO_STATUS_BLOCK StatusBlock;
-		if ( JpkfagsZwFlushBuffersFile != NULL )
-		{
-			Status = ( JpkfagsZwFlushBuffersFile )( 
-				Sink->LogFile, 
-				&StatusBlock );
-		}
-		else
-		{
-			Status = STATUS_SUCCESS;
-		}
+		PJPKFAGP_IMAGE_INFO_EVENT Event = CONTAINING_RECORD(
+			RemoveHeadList( ListHead ),
+			JPKFAGP_IMAGE_INFO_EVENT,
+			CacheListEntry );
+		ExFreePoolWithTag( Event, JPKFAG_POOL_TAG );
 	}
-	else
-	{
-		//
-		// To at least avoid the file from becomming corrupted,
-		// we do not adjust the file pointer.
-		//
+}
 
-		TRACE( ( "JPKFAG: Failed to flush chunk: %x\n", Status ) );
-		InterlockedIncrement( &Sink->Statistics->FailedChunkFlushes );
+/*++
+	Routine Description:
+		Free all cached events. The image info event queue must
+		have been flushed.
+--*/
+static VOID JpkfagsDeleteImageCache(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink
+	)
+{
+	ULONG Index;
+
+	ASSERT( ExQueryDepthSList( &Sink->ImageInfoEventQueue ) == 0 );
+
+	for ( Index = 0; Index < JPKFAGS_IMAGE_CACHE_BUCKETS; Index++ )
+	{
+		JpkfagsDeleteImageCacheList( &Sink->ImageCache.Buckets[ Index ] );
 	}
 
-	ASSERT( JpkfagsIsFilePositionConsistent( Sink ) );
-	ASSERT( ( Sink->FilePosition.QuadPart % JPTRC_CHUNK_ALIGNMENT ) == 0 );
-	
-	return Status;
+	JpkfagsDeleteImageCacheList( &Sink->ImageCache.Evicted );
 }
 
-static VOID JpkfagsFlushImageInfoEventQueue(
-	__in PJPKFAGP_DEF_EVENT_SINK Sink 
+/*++
+	Routine Description:
+		Look up the cached event of an image. Events of other images
+		loaded at the same address are evicted from the cache.
+
+		Sink->ImageCache.Lock must be held.
+
+	Return Value:
+		Event or NULL if the image has not been cached yet.
+--*/
+static PJPKFAGP_IMAGE_INFO_EVENT JpkfagsLookupImageInfoEvent(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in ULONGLONG ImageLoadAddress,
+	__in ULONG ImageSize,
+	__in PANSI_STRING Path
 	)
 {
-	PSLIST_ENTRY ListEntry;
-	PJPKFAGP_IMAGE_INFO_EVENT Event;
+	PLIST_ENTRY Bucket;
+	PLIST_ENTRY ListEntry;
 
-	ASSERT( Sink );
+	Bucket = &Sink->ImageCache.Buckets[ 
+		JpkfagsImageCacheBucket( ImageLoadAddress ) ];
 
-	while ( ( ListEntry = InterlockedPopEntrySList( &Sink->ImageInfoEventQueue ) ) != NULL )
+	for ( ListEntry = Bucket->Flink;
+		  ListEntry != Bucket;
+		  ListEntry = ListEntry->Flink )
 	{
-		Event = CONTAINING_RECORD(
+		PJPKFAGP_IMAGE_INFO_EVENT Event = CONTAINING_RECORD(
 			ListEntry,
 			JPKFAGP_IMAGE_INFO_EVENT,
-			ListEntry );
+			CacheListEntry );
 
-		( VOID ) JpkfagsFlushChunk( Sink, &Event->Event.Header, NULL, 0 );
+		if ( Event->Event.LoadAddress != ImageLoadAddress )
+		{
+			continue;
+		}
 
-		ExFreePoolWithTag( Event, JPKFAG_POOL_TAG );
+		if ( Event->Event.Size == ImageSize &&
+			 Event->Event.PathSize == Path->Length &&
+			 RtlCompareMemory( 
+				Event->Event.Path, 
+				Path->Buffer, 
+				Path->Length ) == Path->Length )
+		{
+			return Event;
+		}
+		else
+		{
+			//
+			// Image has been unloaded and another one has taken its
+			// place. The event may still be queued, so it cannot
+			// be freed yet.
+			//
+			RemoveEntryList( &Event->CacheListEntry );
+			InsertTailList( &Sink->ImageCache.Evicted, &Event->CacheListEntry );
+			return NULL;
+		}
 	}
+
+	return NULL;
 }
 
 static PIMAGE_DATA_DIRECTORY JpkfagsGetDebugDataDirectory(
@@ -324,6 +2416,23 @@ static VOID JpkfagsOnImageLoadDefEventSink(
 		return;
 	}
 
+	//
+	// This routine is called for each tracepoint, so most calls refer
+	// to images that have already been cached. The lock is held while
+	// building the event to avoid building it twice.
+	//
+	KeAcquireGuardedMutex( &Sink->ImageCache.Lock );
+
+	if ( JpkfagsLookupImageInfoEvent( 
+		Sink, 
+		ImageLoadAddress, 
+		ImageSize, 
+		Path ) != NULL )
+	{
+		KeReleaseGuardedMutex( &Sink->ImageCache.Lock );
+		return;
+	}
+
 	//
 	// We need to log two things. First, the basic module info - 
 	// name, path etc. Secondly, in order to be able to load proper
@@ -450,115 +2559,387 @@ static VOID JpkfagsOnImageLoadDefEventSink(
 			EventPaddingStart,
 			( PUCHAR ) &Event->Event + EventSize - EventPaddingStart );
 
+		Event->Written			= FALSE;
+		Event->InFixedSegment	= FALSE;
+
 		//
-		// Enqueue.
+		// Cache and enqueue.
 		//
+		InsertTailList( 
+			&Sink->ImageCache.Buckets[ 
+				JpkfagsImageCacheBucket( ImageLoadAddress ) ],
+			&Event->CacheListEntry );
+
 		InterlockedPushEntrySList(
 			&Sink->ImageInfoEventQueue,
 			&Event->ListEntry );
 	}
 	else
 	{
-		//
-		// Event lost.
-		//
-		InterlockedIncrement( &Sink->Statistics->ImageInfoEventsDropped );
+		//
+		// Event lost. As it has not been cached, the next call for
+		// this image will retry.
+		//
+		InterlockedIncrement( &Sink->Statistics->ImageInfoEventsDropped );
+	}
+
+	KeReleaseGuardedMutex( &Sink->ImageCache.Lock );
+}
+
+static VOID JpkfagsOnProcedureEntryDefEventSink(
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	PJPTRC_PROCEDURE_TRANSITION32 Event;
+	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
+
+	ASSERT( Sink );
+
+	Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
+		JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+
+	if ( Event != NULL )
+	{
+#ifdef _M_IX86
+		PULONG Esp = ( PULONG ) ( PVOID ) ( ULONG_PTR ) Context->Esp;
+		ULONG ReturnAddress = *Esp;
+#else
+#error Unsupported architecture
+#endif
+
+		Event->Type				= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+		Event->Timestamp		= __rdtsc(); //KeQueryPerformanceCounter( NULL ).QuadPart;
+		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
+		Event->Info.CallerIp	= ReturnAddress;
+	}
+	else if ( Sink != NULL )
+	{
+		//
+		// Event lost.
+		//
+		InterlockedIncrement( &Sink->Statistics->EntryEventsDropped );
+	}
+}
+
+static VOID JpkfagsOnProcedureUnwindDefEventSink(
+	__in ULONG ExceptionCode,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	PJPTRC_PROCEDURE_TRANSITION32 Event;
+	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
+
+	ASSERT( Sink );
+
+	Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
+		JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+
+	if ( Event != NULL )
+	{
+		Event->Type				= JPTRC_PROCEDURE_TRANSITION_UNWIND;
+		Event->Timestamp		= __rdtsc(); //KeQueryPerformanceCounter( NULL ).QuadPart;
+		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
+		Event->Info.Exception.Code	= ExceptionCode;
+	}
+	else if ( Sink != NULL )
+	{
+		//
+		// Event lost.
+		//
+		InterlockedIncrement( &Sink->Statistics->UnwindEventsDropped );
+	}
+}
+
+static VOID JpkfagsOnProcedureExitDefEventSink(
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	PJPTRC_PROCEDURE_TRANSITION32 Event;
+	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
+
+	ASSERT( Sink );
+
+	Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
+		JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+
+	if ( Event != NULL )
+	{
+		Event->Type				= JPTRC_PROCEDURE_TRANSITION_EXIT;
+		Event->Timestamp		= __rdtsc(); //KeQueryPerformanceCounter( NULL ).QuadPart;
+		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
+		Event->Info.ReturnValue	= Context->Eax;
+	}
+	else if ( Sink != NULL )
+	{
+		//
+		// Event lost.
+		//
+		InterlockedIncrement( &Sink->Statistics->ExitEventsDropped );
+	}
+}
+
+/*++
+	Routine Description:
+		Look up the threshold, in timestamp ticks, applying to a 
+		procedure.
+
+		Callable at any IRQL.
+--*/
+static ULONGLONG JpkfagsGetThreshold(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in PVOID Procedure
+	)
+{
+	LONG Epoch;
+	ULONG Lower;
+	ULONG Middle;
+	PJPKFAGS_THRESHOLD_TABLE Table;
+	ULONGLONG Threshold = Sink->Filter.Threshold;
+	ULONG Upper;
+
+	if ( Sink->Filter.Thresholds == NULL )
+	{
+		return Threshold;
+	}
+
+	//
+	// Keep the table from being freed while in use, see
+	// JpkfagsWaitForThresholdReaders.
+	//
+	Epoch = Sink->Filter.ReaderEpoch;
+	InterlockedIncrement( &Sink->Filter.Readers[ Epoch ] );
+
+	Table = Sink->Filter.Thresholds;
+	if ( Table != NULL )
+	{
+		Lower = 0;
+		Upper = Table->Count;
+		while ( Lower < Upper )
+		{
+			Middle = Lower + ( Upper - Lower ) / 2;
+			if ( Table->Entries[ Middle ].Procedure < ( ULONG_PTR ) Procedure )
+			{
+				Lower = Middle + 1;
+			}
+			else if ( Table->Entries[ Middle ].Procedure > ( ULONG_PTR ) Procedure )
+			{
+				Upper = Middle;
+			}
+			else
+			{
+				Threshold = Table->Entries[ Middle ].Threshold;
+				break;
+			}
+		}
+	}
+
+	InterlockedDecrement( &Sink->Filter.Readers[ Epoch ] );
+
+	return Threshold;
+}
+
+/*++
+	Routine Description:
+		Called before a call is recorded. Decide for each caller 
+		that has not been decided on yet whether it is recorded, 
+		and record the entries of these callers, outermost first.
+
+		The entry of a caller precedes the call in the trace, so the
+		decision cannot be deferred until the caller returns. Callers
+		that have already exceeded their threshold are recorded - with
+		JPKFBT_LOG_FLAG_KEEP_ANCESTORS or procedure-specific thresholds,
+		all callers are. Any other caller is skipped.
+
+		With a single threshold, a caller has always exceeded it by the
+		time a call it contains is recorded, so only a caller that has
+		a higher threshold than the call could be skipped and still 
+		turn out to be slow later - hence all callers are retained 
+		while procedure-specific thresholds are set.
+--*/
+static VOID JpkfagsRecordCallerEntries(
+	__in PJPKFAGP_DEF_EVENT_SINK Sink,
+	__in ULONGLONG Timestamp
+	)
+{
+	JPFBT_ACTIVE_CALL Call;
+	ULONG Depth;
+	PJPTRC_PROCEDURE_TRANSITION32 Event;
+
+	//
+	// If a call has been decided on, so have its callers.
+	//
+	Depth = 1;
+	while ( JpfbtGetActiveCall( Depth, &Call ) &&
+			! ( *Call.Flags & ( JPKFAGS_CALL_ENTRY_RECORDED | 
+								JPKFAGS_CALL_SKIPPED ) ) )
+	{
+		Depth++;
+	}
+
+	while ( --Depth > 0 )
+	{
+		VERIFY( JpfbtGetActiveCall( Depth, &Call ) );
+
+		if ( ! Sink->Filter.KeepAncestors &&
+			 Sink->Filter.Thresholds == NULL &&
+			 ( LONGLONG ) ( Timestamp - Call.EntryTimestamp ) < 
+			 ( LONGLONG ) JpkfagsGetThreshold( Sink, Call.Procedure ) )
+		{
+			*Call.Flags |= JPKFAGS_CALL_SKIPPED;
+			continue;
+		}
+
+		Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
+			JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+		if ( Event == NULL )
+		{
+			//
+			// Recording the call when it returns would misorder the
+			// trace.
+			//
+			InterlockedIncrement( &Sink->Statistics->EntryEventsDropped );
+			*Call.Flags |= JPKFAGS_CALL_SKIPPED;
+			continue;
+		}
+
+		Event->Type				= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+		Event->Timestamp		= Call.EntryTimestamp;
+		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Call.Procedure;
+		Event->Info.CallerIp	= ( ULONG ) Call.ReturnAddress;
+
+		//
+		// The exit of this call is now recorded unconditionally.
+		//
+		*Call.Flags |= JPKFAGS_CALL_ENTRY_RECORDED;
+	}
+}
+
+static VOID JpkfagsOnProcedureEntryFilteredDefEventSink(
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	UNREFERENCED_PARAMETER( Context );
+	UNREFERENCED_PARAMETER( Procedure );
+	UNREFERENCED_PARAMETER( This );
+
+	//
+	// JPFBT has taken the entry timestamp, whether the call is
+	// recorded is decided on exit.
+	//
+}
+
+static VOID JpkfagsOnProcedureUnwindFilteredDefEventSink(
+	__in ULONG ExceptionCode,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	JPFBT_ACTIVE_CALL Call;
+
+	//
+	// Only calls whose entry has been recorded require an unwind
+	// transition.
+	//
+	if ( JpfbtGetActiveCall( 0, &Call ) &&
+		 ( *Call.Flags & JPKFAGS_CALL_ENTRY_RECORDED ) )
+	{
+		JpkfagsOnProcedureUnwindDefEventSink( ExceptionCode, Procedure, This );
 	}
 }
 
-static VOID JpkfagsOnProcedureEntryDefEventSink(
+/*++
+	Routine Description:
+		Record the call if it has taken at least as long as the 
+		threshold. The call is recorded as an entry transition 
+		immediately followed by the exit transition, so the trace
+		format is the same as in unfiltered mode.
+
+		Callers whose entries have to be recorded are recorded first
+		s.t. the transitions of a thread remain in timestamp order,
+		see JpkfagsRecordCallerEntries.
+--*/
+static VOID JpkfagsOnProcedureExitFilteredDefEventSink(
 	__in CONST PJPFBT_CONTEXT Context,
 	__in PVOID Procedure,
 	__in_opt PVOID This
 	)
 {
+	JPFBT_ACTIVE_CALL Call;
 	PJPTRC_PROCEDURE_TRANSITION32 Event;
 	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
+	ULONGLONG Timestamp;
 
 	ASSERT( Sink );
 
-	Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
-		JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+	Timestamp = __rdtsc();
 
-	if ( Event != NULL )
+	if ( ! JpfbtGetActiveCall( 0, &Call ) )
 	{
-#ifdef _M_IX86
-		PULONG Esp = ( PULONG ) ( PVOID ) ( ULONG_PTR ) Context->Esp;
-		ULONG ReturnAddress = *Esp;
-#else
-#error Unsupported architecture
-#endif
-
-		Event->Type				= JPTRC_PROCEDURE_TRANSITION_ENTRY;
-		Event->Timestamp		= __rdtsc(); //KeQueryPerformanceCounter( NULL ).QuadPart;
-		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
-		Event->Info.CallerIp	= ReturnAddress;
+		ASSERT( !"No active call" );
+		return;
 	}
-	else if ( Sink != NULL )
+
+	if ( *Call.Flags & JPKFAGS_CALL_ENTRY_RECORDED )
 	{
 		//
-		// Event lost.
+		// Entry has been recorded on behalf of a slow callee.
 		//
-		InterlockedIncrement( &Sink->Statistics->EntryEventsDropped );
+		JpkfagsOnProcedureExitDefEventSink( Context, Procedure, This );
+		return;
 	}
-}
-
-static VOID JpkfagsOnProcedureUnwindDefEventSink(
-	__in ULONG ExceptionCode,
-	__in PVOID Procedure,
-	__in_opt PVOID This
-	)
-{
-	PJPTRC_PROCEDURE_TRANSITION32 Event;
-	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
-
-	ASSERT( Sink );
 
-	Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
-		JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
-
-	if ( Event != NULL )
+	//
+	// N.B. The thread may have migrated to a processor whose 
+	// timestamp counter lags behind, hence the signed comparison.
+	//
+	if ( ( LONGLONG ) ( Timestamp - Call.EntryTimestamp ) < 
+		 ( LONGLONG ) JpkfagsGetThreshold( Sink, Procedure ) )
 	{
-		Event->Type				= JPTRC_PROCEDURE_TRANSITION_UNWIND;
-		Event->Timestamp		= __rdtsc(); //KeQueryPerformanceCounter( NULL ).QuadPart;
-		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
-		Event->Info.Exception.Code	= ExceptionCode;
+		return;
 	}
-	else if ( Sink != NULL )
+	else if ( *Call.Flags & JPKFAGS_CALL_SKIPPED )
 	{
 		//
-		// Event lost.
+		// Slow, but recording it now would misorder the trace.
 		//
-		InterlockedIncrement( &Sink->Statistics->UnwindEventsDropped );
+		InterlockedIncrement( &Sink->Statistics->FilteredCallsLost );
+		return;
 	}
-}
-
-static VOID JpkfagsOnProcedureExitDefEventSink(
-	__in CONST PJPFBT_CONTEXT Context,
-	__in PVOID Procedure,
-	__in_opt PVOID This
-	)
-{
-	PJPTRC_PROCEDURE_TRANSITION32 Event;
-	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
 
-	ASSERT( Sink );
+	JpkfagsRecordCallerEntries( Sink, Timestamp );
 
+	//
+	// Obtain space for both transitions at once s.t. they are
+	// either both recorded or both lost.
+	//
 	Event = ( PJPTRC_PROCEDURE_TRANSITION32 )
-		JpfbtGetBuffer( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+		JpfbtGetBuffer( 2 * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
 
 	if ( Event != NULL )
 	{
-		Event->Type				= JPTRC_PROCEDURE_TRANSITION_EXIT;
-		Event->Timestamp		= __rdtsc(); //KeQueryPerformanceCounter( NULL ).QuadPart;
-		Event->Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
-		Event->Info.ReturnValue	= Context->Eax;
+		Event[ 0 ].Type				= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+		Event[ 0 ].Timestamp		= Call.EntryTimestamp;
+		Event[ 0 ].Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
+		Event[ 0 ].Info.CallerIp	= ( ULONG ) Call.ReturnAddress;
+
+		Event[ 1 ].Type				= JPTRC_PROCEDURE_TRANSITION_EXIT;
+		Event[ 1 ].Timestamp		= Timestamp;
+		Event[ 1 ].Procedure		= ( ULONG ) ( ULONG_PTR ) Procedure;
+		Event[ 1 ].Info.ReturnValue	= Context->Eax;
 	}
-	else if ( Sink != NULL )
+	else
 	{
 		//
-		// Event lost.
+		// Events lost.
 		//
+		InterlockedIncrement( &Sink->Statistics->EntryEventsDropped );
 		InterlockedIncrement( &Sink->Statistics->ExitEventsDropped );
 	}
 }
@@ -572,6 +2953,10 @@ static VOID JpkfagsOnProcessBufferDefEventSink(
 	)
 {
 	JPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+	PJPTRC_CHUNK_HEADER FlushedChunk;
+	SIZE_T Index;
+	ULONGLONG MaxTimestamp;
+	ULONGLONG MinTimestamp;
 	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
 	SIZE_T TotalSize;
 	SIZE_T Transitions;
@@ -587,31 +2972,141 @@ static VOID JpkfagsOnProcessBufferDefEventSink(
 	// to by the chunk we are about to flush here.
 	//
 	JpkfagsFlushImageInfoEventQueue( Sink );
+	JpkfagsFlushSymbolTableEventQueue( Sink );
+
+	if ( KeQueryInterruptTime() - Sink->Calibration.LastCalibrationTime >= 
+		 JPKFAGS_CALIBRATION_INTERVAL )
+	{
+		JpkfagsWriteCalibrationChunk( Sink );
+	}
 
-	//
-	// Fill header.
-	//
 	TotalSize = RTL_SIZEOF_THROUGH_FIELD(
 		JPTRC_TRACE_BUFFER_CHUNK32,
 		Transitions[ Transitions - 1 ] );
 
 	ASSERT( TotalSize <= JPKFAGP_MAX_BUFFER_SIZE );
-	Chunk.Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
-	Chunk.Header.Reserved	= 0;
-	Chunk.Header.Size		= ( ULONG ) TotalSize;
 
-	Chunk.Client.ProcessId	= ProcessId;
-	Chunk.Client.ThreadId	= ThreadId;
+	//
+	// Determine timestamp range for the index. Timestamps are not
+	// necessarily monotonic as the thread may have migrated between
+	// CPUs.
+	//
+	MinTimestamp = MaxTimestamp = 
+		( ( PJPTRC_PROCEDURE_TRANSITION32 ) Buffer )[ 0 ].Timestamp;
+	for ( Index = 1; Index < Transitions; Index++ )
+	{
+		ULONGLONG Timestamp = 
+			( ( PJPTRC_PROCEDURE_TRANSITION32 ) Buffer )[ Index ].Timestamp;
+		MinTimestamp = min( MinTimestamp, Timestamp );
+		MaxTimestamp = max( MaxTimestamp, Timestamp );
+	}
 
 	//
-	// To avoid copying the buffer into Event->Transitions,
-	// we issue two writes by passing the buffer as body.
+	// Prefer writing a compact chunk. If the buffer does not compress
+	// well, fall back to an uncompressed chunk.
 	//
-	( VOID ) JpkfagsFlushChunk( 
+	Sink->Compact.Chunk->Client.ProcessId	= ProcessId;
+	Sink->Compact.Chunk->Client.ThreadId	= ThreadId;
+
+	if ( JptrccmpEncodeTransitions(
+			&Sink->Compact.Encoder,
+			( ULONG ) Transitions,
+			( PJPTRC_PROCEDURE_TRANSITION32 ) Buffer,
+			Sink->Compact.ChunkCapacity,
+			Sink->Compact.Chunk ) &&
+		 Sink->Compact.Chunk->Header.Size < TotalSize )
+	{
+		FlushedChunk = &Sink->Compact.Chunk->Header;
+		JpkfagsWriteChunk( 
+			Sink,
+			FlushedChunk,
+			NULL,
+			0 );
+	}
+	else
+	{
+		//
+		// Fill header.
+		//
+		Chunk.Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+		Chunk.Header.Reserved	= 0;
+		Chunk.Header.Size		= ( ULONG ) TotalSize;
+
+		Chunk.Client.ProcessId	= ProcessId;
+		Chunk.Client.ThreadId	= ThreadId;
+
+		//
+		// To avoid copying the buffer into Event->Transitions,
+		// we pass the buffer as body.
+		//
+		FlushedChunk = &Chunk.Header;
+		JpkfagsWriteChunk( 
+			Sink,
+			FlushedChunk,
+			Buffer,
+			( ULONG ) BufferSize );
+	}
+
+	JpkfagsRecordChunk(
 		Sink,
-		&Chunk.Header,
-		Buffer,
-		( ULONG ) BufferSize );
+		FlushedChunk,
+		ProcessId,
+		ThreadId,
+		MinTimestamp,
+		MaxTimestamp );
+
+	if ( KeQueryInterruptTime() - Sink->Writer.LastFlushTime >= 
+		 Sink->Writer.FlushInterval )
+	{
+		JpkfagsFlushStagingBlocks( Sink );
+	}
+
+	if ( Sink->Rotation.Enabled &&
+		 ( ( Sink->Rotation.MaximumFileSize != 0 &&
+			 ( ULONGLONG ) Sink->FilePosition.QuadPart >= 
+				Sink->Rotation.MaximumFileSize ) ||
+		   ( Sink->Rotation.Interval != 0 &&
+			 KeQueryInterruptTime() - Sink->Rotation.FileCreationTime >= 
+				Sink->Rotation.Interval ) ) )
+	{
+		JpkfagsRotateLogFile( Sink );
+	}
+}
+
+static NTSTATUS JpkfagsOnSymbolTableDefEventSink(
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+	__in PJPKFAGP_EVENT_SINK This
+	)
+{
+	PJPKFAGP_SYMBOL_TABLE_EVENT Event;
+	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
+
+	ASSERT( Sink );
+	ASSERT( Chunk );
+	ASSERT( Chunk->Header.Type == JPTRC_CHUNK_TYPE_SYMBOL_TABLE );
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	Event = ( PJPKFAGP_SYMBOL_TABLE_EVENT )
+		ExAllocatePoolWithTag( 
+			PagedPool, 
+			FIELD_OFFSET( JPKFAGP_SYMBOL_TABLE_EVENT, Event ) + 
+				Chunk->Header.Size,
+			JPKFAG_POOL_TAG );
+	if ( Event == NULL )
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlCopyMemory( &Event->Event, Chunk, Chunk->Header.Size );
+
+	//
+	// Written by the collector thread along with the next buffer.
+	//
+	InterlockedPushEntrySList(
+		&Sink->SymbolTableEventQueue,
+		&Event->ListEntry );
+
+	return STATUS_SUCCESS;
 }
 #else  // JPFBT_NO_TRACING
 static VOID JpkfagsOnImageLoadDefEventSink(
@@ -660,6 +3155,39 @@ static VOID JpkfagsOnProcedureExitDefEventSink(
 	UNREFERENCED_PARAMETER( This );
 }
 
+static VOID JpkfagsOnProcedureEntryFilteredDefEventSink(
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	UNREFERENCED_PARAMETER( Context );
+	UNREFERENCED_PARAMETER( Procedure );
+	UNREFERENCED_PARAMETER( This );
+}
+
+static VOID JpkfagsOnProcedureUnwindFilteredDefEventSink(
+	__in ULONG ExceptionCode,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	UNREFERENCED_PARAMETER( ExceptionCode );
+	UNREFERENCED_PARAMETER( Procedure );
+	UNREFERENCED_PARAMETER( This );
+}
+
+static VOID JpkfagsOnProcedureExitFilteredDefEventSink(
+	__in CONST PJPFBT_CONTEXT Context,
+	__in PVOID Procedure,
+	__in_opt PVOID This
+	)
+{
+	UNREFERENCED_PARAMETER( Context );
+	UNREFERENCED_PARAMETER( Procedure );
+	UNREFERENCED_PARAMETER( This );
+}
+
 static VOID JpkfagsOnProcessBufferDefEventSink(
 	__in SIZE_T BufferSize,
 	__in_bcount( BufferSize ) PUCHAR Buffer,
@@ -675,8 +3203,84 @@ static VOID JpkfagsOnProcessBufferDefEventSink(
 	UNREFERENCED_PARAMETER( This );
 }
 
+static NTSTATUS JpkfagsOnSymbolTableDefEventSink(
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+	__in PJPKFAGP_EVENT_SINK This
+	)
+{
+	UNREFERENCED_PARAMETER( Chunk );
+	UNREFERENCED_PARAMETER( This );
+
+	return STATUS_SUCCESS;
+}
+
 #endif // JPFBT_NO_TRACING
 
+static NTSTATUS JpkfagsOnProcedureThresholdsDefEventSink(
+	__in ULONG ThresholdCount,
+	__in_ecount( ThresholdCount ) PJPKFBT_PROCEDURE_THRESHOLD Thresholds,
+	__in PJPKFAGP_EVENT_SINK This
+	)
+{
+	ULONG Index;
+	PJPKFAGS_THRESHOLD_TABLE Replaced;
+	PJPKFAGP_DEF_EVENT_SINK Sink = ( PJPKFAGP_DEF_EVENT_SINK ) This;
+	PJPKFAGS_THRESHOLD_TABLE Table = NULL;
+
+	ASSERT( Sink );
+	ASSERT( ThresholdCount <= JPKFBT_MAX_PROCEDURE_THRESHOLDS );
+	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
+
+	if ( ! Sink->Filter.Enabled )
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if ( ThresholdCount > 0 )
+	{
+		//
+		// N.B. Looked up by event routines, i.e. at any IRQL.
+		//
+		Table = ( PJPKFAGS_THRESHOLD_TABLE ) ExAllocatePoolWithTag(
+			NonPagedPool,
+			FIELD_OFFSET( JPKFAGS_THRESHOLD_TABLE, Entries[ ThresholdCount ] ),
+			JPKFAG_POOL_TAG );
+		if ( Table == NULL )
+		{
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		Table->Count	= ThresholdCount;
+
+		for ( Index = 0; Index < ThresholdCount; Index++ )
+		{
+			Table->Entries[ Index ].Procedure	= 
+				Thresholds[ Index ].Procedure.u.ProcedureVa;
+			Table->Entries[ Index ].Threshold	= JpkfagsScale(
+				Thresholds[ Index ].DurationThreshold,
+				Sink->Filter.Frequency,
+				1000000 );
+		}
+
+		JpkfagsSortThresholds( Table->Entries, ThresholdCount );
+	}
+
+	KeAcquireGuardedMutex( &Sink->Filter.Lock );
+
+	Replaced = ( PJPKFAGS_THRESHOLD_TABLE ) InterlockedExchangePointer(
+		( PVOID* ) &Sink->Filter.Thresholds,
+		Table );
+	if ( Replaced != NULL )
+	{
+		JpkfagsWaitForThresholdReaders( Sink );
+		ExFreePoolWithTag( Replaced, JPKFAG_POOL_TAG );
+	}
+
+	KeReleaseGuardedMutex( &Sink->Filter.Lock );
+
+	return STATUS_SUCCESS;
+}
+
 static VOID JpkfagsDeleteDefEventSink(
 	__in PJPKFAGP_EVENT_SINK This
 	)
@@ -690,9 +3294,25 @@ static VOID JpkfagsDeleteDefEventSink(
 	// N.B. Writer thread has already been stopped by now.
 	//
 	JpkfagsFlushImageInfoEventQueue( Sink );
+	JpkfagsFlushSymbolTableEventQueue( Sink );
+
+	//
+	// The frequency measured last is the most accurate one.
+	//
+	JpkfagsWriteCalibrationChunk( Sink );
+	JpkfagsFinalizeIndex( Sink );
+	JpkfagsFlushStagingBlocks( Sink );
 
 	ZwClose( Sink->LogFile );
 
+	JpkfagsDeleteCompactEncoder( Sink );
+	JpkfagsDeleteIndex( Sink );
+	JpkfagsDeleteWriter( Sink );
+	JpkfagsDeleteRotation( Sink );
+	JpkfagsDeleteImageCache( Sink );
+	JpkfagsDeleteCalibration( Sink );
+	JpkfagsDeleteFilter( Sink );
+
 	if ( This != NULL )
 	{
 		ExFreePoolWithTag( This, JPKFAG_POOL_TAG );
@@ -706,12 +3326,16 @@ static VOID JpkfagsDeleteDefEventSink(
  */
 NTSTATUS JpkfagpCreateDefaultEventSink(
 	__in PUNICODE_STRING LogFilePath,
+	__in ULONG BufferSize,
+	__in PJPKFBT_LOG_OPTIONS LogOptions,
 	__in PJPKFAGP_STATISTICS Statistics,
 	__out PJPKFAGP_EVENT_SINK *Sink
 	)
 {
+	BOOLEAN Circular;
+	LARGE_INTEGER CircularFileSize;
 	HANDLE FileHandle = NULL;
-	JPTRC_FILE_HEADER FileHeader;
+	PJPTRCSTG_BLOCK HeaderBlock;
 	IO_STATUS_BLOCK IoStatus;
 	OBJECT_ATTRIBUTES ObjectAttributes;
     NTSTATUS Status;
@@ -721,9 +3345,19 @@ NTSTATUS JpkfagpCreateDefaultEventSink(
 
 	ASSERT( KeGetCurrentIrql() == PASSIVE_LEVEL );
 	ASSERT( LogFilePath );
+	ASSERT( LogOptions );
 	ASSERT( Statistics );
 	ASSERT( Sink );
 
+	Circular = ( LogOptions->Flags & JPKFBT_LOG_FLAG_CIRCULAR ) 
+		? TRUE : FALSE;
+	CircularFileSize.QuadPart = 
+		( LONGLONG ) LogOptions->MaximumFileSize * JPKFAGS_MEGABYTE;
+
+	ASSERT( ! Circular || 
+		LogOptions->MaximumFileSize >= JPKFBT_LOG_MIN_CIRCULAR_FILE_SIZE );
+	ASSERT( ! Circular || BufferSize <= JPKFAGP_MAX_CIRCULAR_BUFFER_SIZE );
+
 	//
 	// Dynamically import ZwFlushBuffersFile (not in ntoskrnl.lib).
 	//
@@ -741,6 +3375,11 @@ NTSTATUS JpkfagpCreateDefaultEventSink(
 	//
 	// N.B. We are in non-arbitrary thread context.
 	//
+	// N.B. The file is opened for asynchronous I/O.
+	//
+	// N.B. Circular files are preallocated s.t. writing never 
+	// requires the file to be extended.
+	//
 	InitializeObjectAttributes(
 		&ObjectAttributes,
 		LogFilePath,
@@ -753,11 +3392,11 @@ NTSTATUS JpkfagpCreateDefaultEventSink(
 		GENERIC_WRITE,
 		&ObjectAttributes,
 		&IoStatus,
-		NULL,
+		Circular ? &CircularFileSize : NULL,
 		FILE_ATTRIBUTE_NORMAL,
 		FILE_SHARE_READ,
 		FILE_CREATE,
-		FILE_SYNCHRONOUS_IO_NONALERT,
+		0,
 		NULL,
 		0 );
 
@@ -772,6 +3411,24 @@ NTSTATUS JpkfagpCreateDefaultEventSink(
 		TRACE( ( "JPKFAG: Created log file '%wZ'\n", LogFilePath ) );
 	}
 
+	if ( Circular )
+	{
+		FILE_END_OF_FILE_INFORMATION EndOfFile;
+
+		EndOfFile.EndOfFile = CircularFileSize;
+		Status = ZwSetInformationFile(
+			FileHandle,
+			&IoStatus,
+			&EndOfFile,
+			sizeof( FILE_END_OF_FILE_INFORMATION ),
+			FileEndOfFileInformation );
+		if ( ! NT_SUCCESS( Status ) )
+		{
+			TRACE( ( "JPKFAG: Preallocating log file failed: %x\n", Status ) );
+			goto Cleanup;
+		}
+	}
+
 	TempSink = ( PJPKFAGP_DEF_EVENT_SINK ) ExAllocatePoolWithTag(
 		NonPagedPool,
 		sizeof( JPKFAGP_DEF_EVENT_SINK ),
@@ -782,39 +3439,116 @@ NTSTATUS JpkfagpCreateDefaultEventSink(
 		goto Cleanup;
 	}
 
+	RtlZeroMemory( TempSink, sizeof( JPKFAGP_DEF_EVENT_SINK ) );
+
+	TempSink->Circular.Enabled			= Circular;
+	TempSink->Circular.FileSize			= CircularFileSize.QuadPart;
+
+	JpkfagsInitializeImageCache( TempSink );
+
+	Status = JpkfagsInitializeCompactEncoder( TempSink, BufferSize );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		goto Cleanup;
+	}
+
+	Status = JpkfagsInitializeIndex( TempSink );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		goto Cleanup;
+	}
+
+	Status = JpkfagsInitializeWriter( TempSink, LogOptions->FlushInterval );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		goto Cleanup;
+	}
+
+	Status = JpkfagsInitializeCalibration( TempSink );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		goto Cleanup;
+	}
+
+	Status = JpkfagsInitializeFilter( TempSink, LogOptions );
+	if ( ! NT_SUCCESS( Status ) )
+	{
+		goto Cleanup;
+	}
+
+	if ( ! Circular )
+	{
+		Status = JpkfagsInitializeRotation( TempSink, LogFilePath, LogOptions );
+		if ( ! NT_SUCCESS( Status ) )
+		{
+			goto Cleanup;
+		}
+	}
+
 	TempSink->Base.OnImageInvolved		= JpkfagsOnImageLoadDefEventSink;
-	TempSink->Base.OnProcedureEntry		= JpkfagsOnProcedureEntryDefEventSink;
-	TempSink->Base.OnProcedureExit		= JpkfagsOnProcedureExitDefEventSink;
-	TempSink->Base.OnProcedureUnwind	= JpkfagsOnProcedureUnwindDefEventSink;
+	if ( TempSink->Filter.Enabled )
+	{
+		TempSink->Base.OnProcedureEntry		= JpkfagsOnProcedureEntryFilteredDefEventSink;
+		TempSink->Base.OnProcedureExit		= JpkfagsOnProcedureExitFilteredDefEventSink;
+		TempSink->Base.OnProcedureUnwind	= JpkfagsOnProcedureUnwindFilteredDefEventSink;
+	}
+	else
+	{
+		TempSink->Base.OnProcedureEntry		= JpkfagsOnProcedureEntryDefEventSink;
+		TempSink->Base.OnProcedureExit		= JpkfagsOnProcedureExitDefEventSink;
+		TempSink->Base.OnProcedureUnwind	= JpkfagsOnProcedureUnwindDefEventSink;
+	}
 	TempSink->Base.OnProcessBuffer		= JpkfagsOnProcessBufferDefEventSink;
+	TempSink->Base.OnSymbolTable		= JpkfagsOnSymbolTableDefEventSink;
+	TempSink->Base.OnProcedureThresholds	= JpkfagsOnProcedureThresholdsDefEventSink;
 	TempSink->Base.Delete				= JpkfagsDeleteDefEventSink;
 	TempSink->Statistics				= Statistics;
 	TempSink->LogFile					= FileHandle;
 	TempSink->FilePosition.QuadPart		= 0;
 
 	InitializeSListHead( &TempSink->ImageInfoEventQueue );
+	InitializeSListHead( &TempSink->SymbolTableEventQueue );
 
 	//
-	// Write file header.
+	// Stage file header, it is written along with the first chunks.
+	// For circular files, the header resides in segment 0 and the
+	// ring starts at segment 1.
 	//
-	FileHeader.Signature				= JPTRC_HEADER_SIGNATURE;
-	FileHeader.Version					= JPTRC_HEADER_VERSION;
-	FileHeader.Characteristics			= 
-		JPTRC_CHARACTERISTIC_TIMESTAMP_TSC |
-		JPTRC_CHARACTERISTIC_32BIT;
-	FileHeader.__Reserved[ 0 ]			= 0;
-	FileHeader.__Reserved[ 1 ]			= 0;
-
-	Status = JpkfagsWrite(
-		TempSink,
-		&FileHeader,
-		sizeof( JPTRC_FILE_HEADER ) );
-	if ( ! NT_SUCCESS( Status ) )
+	if ( Circular )
 	{
-		goto Cleanup;
+		PJPTRC_CIRCULAR_HEADER_CHUNK CircularHeader;
+		
+		HeaderBlock = &TempSink->Circular.FixedBlock.Block;
+		JptrcstgResetBlock( HeaderBlock, 0 );
+		JpkfagsStageFileHeader( TempSink, HeaderBlock );
+
+		JpkfagsResetStagingBlock(
+			TempSink,
+			&TempSink->Writer.Blocks[ 0 ],
+			JPTRC_SEGMENT_SIZE,
+			1 );
+		TempSink->FilePosition.QuadPart	= JPTRC_SEGMENT_SIZE;
+
+		CircularHeader = 
+			( PJPTRC_CIRCULAR_HEADER_CHUNK ) 
+			( HeaderBlock->Buffer + HeaderBlock->Used );
+
+		HeaderBlock->Used += sizeof( JPTRC_CIRCULAR_HEADER_CHUNK );
+
+		CircularHeader->Header.Type			= JPTRC_CHUNK_TYPE_CIRCULAR_HEADER;
+		CircularHeader->Header.Reserved		= 0;
+		CircularHeader->Header.Size			= sizeof( JPTRC_CIRCULAR_HEADER_CHUNK );
+		CircularHeader->FixedDataEnd		= HeaderBlock->Used;
+		CircularHeader->Reserved			= 0;
+		CircularHeader->HeadSequenceNumber	= 0;
+		CircularHeader->HeadOffset			= JPTRC_SEGMENT_SIZE;
+	}
+	else
+	{
+		JpkfagsBeginLogFile( TempSink );
 	}
 
-	TempSink->FilePosition.QuadPart += sizeof( JPTRC_FILE_HEADER );
+	JpkfagsWriteCalibrationChunk( TempSink );
 
 	*Sink = &TempSink->Base;
 	Status = STATUS_SUCCESS;
@@ -829,6 +3563,12 @@ Cleanup:
 
 		if ( TempSink != NULL )
 		{
+			JpkfagsDeleteCompactEncoder( TempSink );
+			JpkfagsDeleteIndex( TempSink );
+			JpkfagsDeleteWriter( TempSink );
+			JpkfagsDeleteRotation( TempSink );
+			JpkfagsDeleteCalibration( TempSink );
+			JpkfagsDeleteFilter( TempSink );
 			ExFreePoolWithTag( TempSink, JPKFAG_POOL_TAG );
 		}
 	}
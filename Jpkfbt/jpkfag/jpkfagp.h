@@ -24,6 +24,12 @@
 #define JPKFAGP_MAX_BUFFER_SIZE				\
 	( JPTRC_SEGMENT_SIZE - FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, Transitions ) ) 
 
+//
+// In circular files, each segment starts with a segment header chunk.
+//
+#define JPKFAGP_MAX_CIRCULAR_BUFFER_SIZE	\
+	( JPKFAGP_MAX_BUFFER_SIZE - sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) )
+
 /*----------------------------------------------------------------------
  *
  * Utility routines.
@@ -54,6 +60,7 @@ typedef struct _JPKFAGP_STATISTICS
 	volatile LONG UnwindEventsDropped;
 	volatile LONG ImageInfoEventsDropped;
 	volatile LONG FailedChunkFlushes;
+	volatile LONG FilteredCallsLost;
 } JPKFAGP_STATISTICS, *PJPKFAGP_STATISTICS;
 
 typedef struct _JPKFAGP_EVENT_SINK
@@ -144,6 +151,43 @@ typedef struct _JPKFAGP_EVENT_SINK
 		__in PVOID This
 		);
 
+	/*++
+		Routine Description:
+			Event: The controller has supplied symbols of 
+			instrumented procedures. Does not apply to WMK.
+
+			Callable at PASSIVE_LEVEL.
+
+		Parameters:
+			Chunk				- Symbol table chunk, validated
+								  by the caller. The chunk is copied.
+			This				- Pointer to self.
+	--*/
+	NTSTATUS ( *OnSymbolTable )(
+		__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+		__in struct _JPKFAGP_EVENT_SINK *This
+		);
+
+	/*++
+		Routine Description:
+			The controller has replaced the procedure-specific 
+			thresholds for filtered mode. Only applies to sinks
+			in filtered mode.
+
+			Callable at PASSIVE_LEVEL.
+
+		Parameters:
+			ThresholdCount		- # of thresholds, validated by the
+								  caller.
+			Thresholds			- Thresholds. The array is copied.
+			This				- Pointer to self.
+	--*/
+	NTSTATUS ( *OnProcedureThresholds )(
+		__in ULONG ThresholdCount,
+		__in_ecount( ThresholdCount ) PJPKFBT_PROCEDURE_THRESHOLD Thresholds,
+		__in struct _JPKFAGP_EVENT_SINK *This
+		);
+
 	/*++
 		Routine Description:
 			Delete object.
@@ -158,9 +202,19 @@ typedef struct _JPKFAGP_EVENT_SINK
 /*++
 	Routine Description:
 		Create a default event sink.
+
+	Parameters:
+		LogFilePath		- Path of trace file to create.
+		BufferSize		- Size of buffers that will be passed to
+						  OnProcessBuffer.
+		LogOptions		- Options, validated by the caller.
+		Statistics		- Statistics to update.
+		Sink			- Result.
 --*/
 NTSTATUS JpkfagpCreateDefaultEventSink(
 	__in PUNICODE_STRING LogFilePath,
+	__in ULONG BufferSize,
+	__in PJPKFBT_LOG_OPTIONS LogOptions,
 	__in PJPKFAGP_STATISTICS Statistics,
 	__out PJPKFAGP_EVENT_SINK *Sink
 	);
@@ -258,6 +312,30 @@ NTSTATUS JpkfagpQueryStatisticsIoctl(
 	__out PULONG BytesWritten
 	);
 
+NTSTATUS JpkfagpRecordSymbolsIoctl(
+	__in PJPKFAGP_DEVICE_EXTENSION DevExtension,
+	__in PVOID Buffer,
+	__in ULONG InputBufferLength,
+	__in ULONG OutputBufferLength,
+	__out PULONG BytesWritten
+	);
+
+NTSTATUS JpkfagpSetBufferPoolLimitsIoctl(
+	__in PJPKFAGP_DEVICE_EXTENSION DevExtension,
+	__in PVOID Buffer,
+	__in ULONG InputBufferLength,
+	__in ULONG OutputBufferLength,
+	__out PULONG BytesWritten
+	);
+
+NTSTATUS JpkfagpSetProcedureThresholdsIoctl(
+	__in PJPKFAGP_DEVICE_EXTENSION DevExtension,
+	__in PVOID Buffer,
+	__in ULONG InputBufferLength,
+	__in ULONG OutputBufferLength,
+	__out PULONG BytesWritten
+	);
+
 /*----------------------------------------------------------------------
  *
  * WMK routines.
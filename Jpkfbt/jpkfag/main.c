@@ -124,6 +124,33 @@ NTSTATUS JpkfagpDispatchDeviceControl(
 			&ResultSize );
 		break;
 
+	case JPKFAG_IOCTL_RECORD_SYMBOLS:
+		Status		= JpkfagpRecordSymbolsIoctl(
+			DevExtension,
+			Irp->AssociatedIrp.SystemBuffer,
+			StackLocation->Parameters.DeviceIoControl.InputBufferLength,
+			StackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+			&ResultSize );
+		break;
+
+	case JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS:
+		Status		= JpkfagpSetBufferPoolLimitsIoctl(
+			DevExtension,
+			Irp->AssociatedIrp.SystemBuffer,
+			StackLocation->Parameters.DeviceIoControl.InputBufferLength,
+			StackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+			&ResultSize );
+		break;
+
+	case JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS:
+		Status		= JpkfagpSetProcedureThresholdsIoctl(
+			DevExtension,
+			Irp->AssociatedIrp.SystemBuffer,
+			StackLocation->Parameters.DeviceIoControl.InputBufferLength,
+			StackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+			&ResultSize );
+		break;
+
 	default:
 		ResultSize	= 0;
 		Status		= STATUS_INVALID_DEVICE_REQUEST;
@@ -92,6 +92,36 @@ static VOID JpkfagsOnProcessBufferWmkEventSink(
 	UNREFERENCED_PARAMETER( This );
 }
 
+static NTSTATUS JpkfagsOnSymbolTableWmkEventSink(
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+	__in PJPKFAGP_EVENT_SINK This
+	)
+{
+	UNREFERENCED_PARAMETER( Chunk );
+	UNREFERENCED_PARAMETER( This );
+
+	//
+	// WMK does not provide a means to log symbols.
+	//
+	return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS JpkfagsOnProcedureThresholdsWmkEventSink(
+	__in ULONG ThresholdCount,
+	__in_ecount( ThresholdCount ) PJPKFBT_PROCEDURE_THRESHOLD Thresholds,
+	__in PJPKFAGP_EVENT_SINK This
+	)
+{
+	UNREFERENCED_PARAMETER( ThresholdCount );
+	UNREFERENCED_PARAMETER( Thresholds );
+	UNREFERENCED_PARAMETER( This );
+
+	//
+	// Filtered mode does not apply to WMK.
+	//
+	return STATUS_NOT_SUPPORTED;
+}
+
 static VOID JpkfagsDeleteWmkEventSink(
 	__in PJPKFAGP_EVENT_SINK This
 	)
@@ -128,6 +158,8 @@ NTSTATUS JpkfagpCreateWmkEventSink(
 	TempSink->Base.OnProcedureExit		= JpkfagsOnProcedureExitWmkEventSink;
 	TempSink->Base.OnProcedureUnwind	= JpkfagsOnProcedureUnwindWmkEventSink;
 	TempSink->Base.OnProcessBuffer		= JpkfagsOnProcessBufferWmkEventSink;
+	TempSink->Base.OnSymbolTable		= JpkfagsOnSymbolTableWmkEventSink;
+	TempSink->Base.OnProcedureThresholds	= JpkfagsOnProcedureThresholdsWmkEventSink;
 	TempSink->Base.Delete				= JpkfagsDeleteWmkEventSink;
 
 	*Sink = &TempSink->Base;
@@ -6,6 +6,7 @@
  *		Johannes Passing (johannes.passing@googlemail.com)
  */
 #include <stdlib.h>
+#include <jptrcsym.h>
 #include "jpkfbtp.h"
 #include "nativeapi.h"
 
@@ -218,6 +219,24 @@ NTSTATUS JpkfbtInitializeTracing(
 	__in ULONG BufferSize,
 	__in_opt PCWSTR LogFilePath
 	)
+{
+	return JpkfbtInitializeTracingEx(
+		SessionHandle,
+		Type,
+		BufferCount,
+		BufferSize,
+		LogFilePath,
+		NULL );
+}
+
+NTSTATUS JpkfbtInitializeTracingEx(
+	__in JPKFBT_SESSION SessionHandle,
+	__in JPKFBT_TRACING_TYPE Type,
+	__in ULONG BufferCount,
+	__in ULONG BufferSize,
+	__in_opt PCWSTR LogFilePath,
+	__in_opt PJPKFBT_LOG_OPTIONS LogOptions
+	)
 {
 	UNICODE_STRING NtLogFilePath;
 	PJPKFAG_IOCTL_INITIALIZE_TRACING_REQUEST Request;
@@ -228,7 +247,8 @@ NTSTATUS JpkfbtInitializeTracing(
 
 	if ( SessionHandle == NULL ||
 		 Type > JpkfbtTracingTypeMax ||
-		 ( LogFilePath == NULL ) != ( Type == JpkfbtTracingTypeWmk ) )
+		 ( LogFilePath == NULL ) != ( Type == JpkfbtTracingTypeWmk ) ||
+		 ( LogOptions != NULL && Type == JpkfbtTracingTypeWmk ) )
 	{
 		return STATUS_INVALID_PARAMETER;
 	}
@@ -284,6 +304,15 @@ NTSTATUS JpkfbtInitializeTracing(
 	Request->BufferSize			= BufferSize;
 	Request->Log.FilePathLength	= ( USHORT ) ( NtLogFilePath.Length / 2 );
 
+	if ( LogOptions != NULL )
+	{
+		Request->Log.Options = *LogOptions;
+	}
+	else
+	{
+		ZeroMemory( &Request->Log.Options, sizeof( JPKFBT_LOG_OPTIONS ) );
+	}
+
 	if ( NtLogFilePath.Length > 0 )
 	{
 		CopyMemory(
@@ -547,4 +576,209 @@ NTSTATUS JpkfbtQueryStatistics(
 	{
 		return Status;
 	}
+}
+
+/*++
+	Routine Description:
+		Issue a JPKFAG_IOCTL_RECORD_SYMBOLS request.
+--*/
+static NTSTATUS JpkfbtsRecordSymbolTableChunk(
+	__in PJPKBTP_SESSION Session,
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk
+	)
+{
+	IO_STATUS_BLOCK StatusBlock;
+
+	//
+	// Use NtDeviceIoControlFile rather than DeviceIoControl in 
+	// order to circumvent NTSTATUS -> DOS return value mapping.
+	//
+	return NtDeviceIoControlFile(
+		Session->DeviceHandle,
+		NULL,
+		NULL,
+		NULL,
+		&StatusBlock,
+		JPKFAG_IOCTL_RECORD_SYMBOLS,
+		Chunk,
+		Chunk->Header.Size,
+		NULL,
+		0 );
+}
+
+NTSTATUS JpkfbtRecordSymbols(
+	__in JPKFBT_SESSION SessionHandle,
+	__in ULONG SymbolCount,
+	__in_ecount( SymbolCount ) CONST JPKFBT_SYMBOL *Symbols
+	)
+{
+	PJPTRC_SYMBOL_TABLE_CHUNK Chunk;
+	ULONG Index;
+	PJPKBTP_SESSION Session;
+	NTSTATUS Status = STATUS_SUCCESS;
+
+	if ( SessionHandle == NULL ||
+		 ( SymbolCount > 0 && Symbols == NULL ) )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for ( Index = 0; Index < SymbolCount; Index++ )
+	{
+		if ( Symbols[ Index ].Procedure.u.Procedure == NULL ||
+			 Symbols[ Index ].Name == NULL ||
+			 strlen( Symbols[ Index ].Name ) > MAX_USHORT )
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	Session = ( PJPKBTP_SESSION ) SessionHandle;
+
+	Chunk = ( PJPTRC_SYMBOL_TABLE_CHUNK ) malloc( JPTRCSYM_MAX_CHUNK_SIZE );
+	if ( Chunk == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	JptrcsymInitializeChunk( Chunk );
+
+	Index = 0;
+	while ( Index < SymbolCount )
+	{
+		PCSTR Name = Symbols[ Index ].Name;
+
+		if ( JptrcsymAppendSymbol(
+			Chunk,
+			JPTRCSYM_MAX_CHUNK_SIZE,
+			Symbols[ Index ].Procedure.u.ProcedureVa,
+			Symbols[ Index ].ModuleBase,
+			Name,
+			( USHORT ) strlen( Name ) ) )
+		{
+			Index++;
+			continue;
+		}
+
+		//
+		// Chunk full - send it and continue with an empty one.
+		//
+		if ( Chunk->SymbolCount == 0 )
+		{
+			//
+			// Name too long to fit into any chunk.
+			//
+			Status = STATUS_INVALID_PARAMETER;
+			goto Cleanup;
+		}
+
+		Status = JpkfbtsRecordSymbolTableChunk( Session, Chunk );
+		if ( ! NT_SUCCESS( Status ) )
+		{
+			goto Cleanup;
+		}
+
+		JptrcsymInitializeChunk( Chunk );
+	}
+
+	if ( Chunk->SymbolCount > 0 )
+	{
+		Status = JpkfbtsRecordSymbolTableChunk( Session, Chunk );
+	}
+
+Cleanup:
+	free( Chunk );
+	return Status;
+}
+
+NTSTATUS JpkfbtSetBufferPoolLimits(
+	__in JPKFBT_SESSION SessionHandle,
+	__in PJPFBT_BUFFER_POOL_LIMITS Limits
+	)
+{
+	JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST Request;
+	PJPKBTP_SESSION Session;
+	IO_STATUS_BLOCK StatusBlock;
+
+	if ( SessionHandle == NULL || Limits == NULL )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Session = ( PJPKBTP_SESSION ) SessionHandle;
+
+	Request.Limits = *Limits;
+
+	//
+	// Use NtDeviceIoControlFile rather than DeviceIoControl in 
+	// order to circumvent NTSTATUS -> DOS return value mapping.
+	//
+	return NtDeviceIoControlFile(
+		Session->DeviceHandle,
+		NULL,
+		NULL,
+		NULL,
+		&StatusBlock,
+		JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS,
+		&Request,
+		sizeof( JPKFAG_IOCTL_SET_BUFFER_POOL_LIMITS_REQUEST ),
+		NULL,
+		0 );
+}
+
+NTSTATUS JpkfbtSetProcedureThresholds(
+	__in JPKFBT_SESSION SessionHandle,
+	__in ULONG ThresholdCount,
+	__in_ecount( ThresholdCount ) CONST JPKFBT_PROCEDURE_THRESHOLD *Thresholds
+	)
+{
+	PJPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST Request;
+	PJPKBTP_SESSION Session;
+	ULONG SizeOfRequest;
+	NTSTATUS Status;
+	IO_STATUS_BLOCK StatusBlock;
+
+	if ( SessionHandle == NULL ||
+		 ThresholdCount > JPKFBT_MAX_PROCEDURE_THRESHOLDS ||
+		 ( ThresholdCount > 0 && Thresholds == NULL ) )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Session = ( PJPKBTP_SESSION ) SessionHandle;
+
+	SizeOfRequest = FIELD_OFFSET(
+		JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST,
+		Thresholds[ ThresholdCount ] );
+	Request = ( PJPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS_REQUEST )
+		malloc( SizeOfRequest );
+	if ( Request == NULL )
+	{
+		return STATUS_NO_MEMORY;
+	}
+
+	Request->ThresholdCount = ThresholdCount;
+	CopyMemory( 
+		Request->Thresholds, 
+		Thresholds,
+		ThresholdCount * sizeof( JPKFBT_PROCEDURE_THRESHOLD ) );
+
+	//
+	// Use NtDeviceIoControlFile rather than DeviceIoControl in 
+	// order to circumvent NTSTATUS -> DOS return value mapping.
+	//
+	Status = NtDeviceIoControlFile(
+		Session->DeviceHandle,
+		NULL,
+		NULL,
+		NULL,
+		&StatusBlock,
+		JPKFAG_IOCTL_SET_PROCEDURE_THRESHOLDS,
+		Request,
+		SizeOfRequest,
+		NULL,
+		0 );
+
+	free( Request );
+	return Status;
 }
\ No newline at end of file
@@ -0,0 +1,306 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Filtered mode (JPKFBT_LOG_FLAG_FILTER_DURATION) test.
+ *
+ *		A blocking read on a pipe makes NtReadFile wait in
+ *		KeWaitForSingleObject until another thread writes to the pipe,
+ *		so both calls exceed the threshold and the wait is nested in
+ *		the read. The log is then checked for the expected call
+ *		hierarchy.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <cfix.h>
+#include <jpkfbt.h>
+#include <jpfbtdef.h>
+#include <jptrcr.h>
+#include <psapi.h>
+#include "util.h"
+
+#define FILTER_LOG_FILE			L"__testkfbtfilter.log"
+#define FILTER_THRESHOLD		1000		// us
+#define FILTER_WRITE_DELAY		200			// ms
+
+typedef struct _FILTERED_CALLS
+{
+	JPTRCRHANDLE File;
+	ULONGLONG Read;
+	ULONGLONG Wait;
+
+	//
+	// Calls of the reader thread.
+	//
+	ULONG ReadCalls;
+	ULONG TopLevelWaitCalls;
+	ULONG NestedWaitCalls;
+
+	ULONGLONG ReadEntry;
+	ULONGLONG ReadExit;
+
+	ULONG CallsLost;
+} FILTERED_CALLS, *PFILTERED_CALLS;
+
+static JPFBT_PROCEDURE GetKernelProcedure(
+	__in PCSTR Name
+	)
+{
+	static PVOID Drivers[ 1024 ];
+	DWORD Needed;
+	WCHAR KernelName[ MAX_PATH ];
+	HMODULE Kernel;
+	FARPROC Export;
+	JPFBT_PROCEDURE Procedure;
+
+	//
+	// The kernel is the first driver listed. Load the image as
+	// data file to obtain the RVA of the export.
+	//
+	TEST( EnumDeviceDrivers( Drivers, sizeof( Drivers ), &Needed ) );
+	TEST( GetDeviceDriverBaseName(
+		Drivers[ 0 ],
+		KernelName,
+		_countof( KernelName ) ) );
+
+	Kernel = LoadLibraryEx( KernelName, NULL, DONT_RESOLVE_DLL_REFERENCES );
+	TEST( Kernel );
+
+	Export = GetProcAddress( Kernel, Name );
+	TEST( Export );
+
+	Procedure.u.ProcedureVa = ( ULONG_PTR ) Drivers[ 0 ] +
+		( ( PUCHAR ) Export - ( PUCHAR ) Kernel );
+
+	FreeLibrary( Kernel );
+	return Procedure;
+}
+
+static DWORD CALLBACK WriterThreadProc(
+	__in PVOID Pipe
+	)
+{
+	UCHAR Data = 0;
+	DWORD Written;
+
+	Sleep( FILTER_WRITE_DELAY );
+	return WriteFile( ( HANDLE ) Pipe, &Data, sizeof( Data ), &Written, NULL )
+		? 0
+		: GetLastError();
+}
+
+static VOID BlockingRead()
+{
+	HANDLE Read, Write;
+	HANDLE Writer;
+	UCHAR Data;
+	DWORD BytesRead;
+
+	TEST( CreatePipe( &Read, &Write, NULL, 0 ) );
+
+	Writer = CreateThread( NULL, 0, WriterThreadProc, Write, 0, NULL );
+	TEST( Writer );
+
+	TEST( ReadFile( Read, &Data, sizeof( Data ), &BytesRead, NULL ) );
+	TEST( BytesRead == sizeof( Data ) );
+
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( Writer, INFINITE ) );
+
+	TEST( CloseHandle( Writer ) );
+	TEST( CloseHandle( Read ) );
+	TEST( CloseHandle( Write ) );
+}
+
+static VOID JPTRCRCALLTYPE OnChildCall(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PFILTERED_CALLS Calls = ( PFILTERED_CALLS ) Context;
+
+	if ( Call->Procedure == Calls->Wait )
+	{
+		TEST( Call->EntryType == JptrcrNormalEntry );
+		TEST( Call->EntryTimestamp >= Calls->ReadEntry );
+		TEST( Call->ExitTimestamp <= Calls->ReadExit );
+
+		Calls->NestedWaitCalls++;
+	}
+}
+
+static VOID JPTRCRCALLTYPE OnTopLevelCall(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PFILTERED_CALLS Calls = ( PFILTERED_CALLS ) Context;
+
+	TEST( Call->EntryTimestamp <= Call->ExitTimestamp );
+
+	if ( Call->Procedure == Calls->Read )
+	{
+		TEST( Call->EntryType == JptrcrNormalEntry );
+		TEST( Call->ExitType == JptrcrNormalExit );
+
+		Calls->ReadCalls++;
+		Calls->ReadEntry = Call->EntryTimestamp;
+		Calls->ReadExit = Call->ExitTimestamp;
+
+		TEST( S_OK == JptrcrEnumChildCalls(
+			Calls->File,
+			&Call->CallHandle,
+			OnChildCall,
+			Calls ) );
+	}
+	else if ( Call->Procedure == Calls->Wait )
+	{
+		TEST( Call->EntryType == JptrcrNormalEntry );
+		Calls->TopLevelWaitCalls++;
+	}
+}
+
+/*++
+	Routine Description:
+		Trace a blocking read in filtered mode and collect the
+		calls of the reading thread.
+--*/
+static VOID TraceBlockingRead(
+	__in ULONG Flags,
+	__in ULONG ReadThreshold,
+	__out PFILTERED_CALLS Calls
+	)
+{
+	BOOL KernelSupported;
+	JPFBT_PROCEDURE FailedProcedure;
+	JPKFBT_LOG_OPTIONS Options;
+	JPFBT_PROCEDURE Procedures[ 2 ];
+	JPKFBT_SESSION Session;
+	JPKFBT_STATISTICS Statistics;
+	JPKFBT_PROCEDURE_THRESHOLD Threshold;
+	JPTRCR_CLIENT Client;
+
+	TEST_SUCCESS( JpkfbtIsKernelTypeSupported(
+		JpkfbtKernelRetail, &KernelSupported ) );
+	if ( ! KernelSupported )
+	{
+		CFIX_INCONCLUSIVE( L"Kernel not Retail-compatible." );
+	}
+
+	ZeroMemory( Calls, sizeof( FILTERED_CALLS ) );
+
+	Procedures[ 0 ] = GetKernelProcedure( "NtReadFile" );
+	Procedures[ 1 ] = GetKernelProcedure( "KeWaitForSingleObject" );
+	Calls->Read = Procedures[ 0 ].u.ProcedureVa;
+	Calls->Wait = Procedures[ 1 ].u.ProcedureVa;
+
+	TEST_SUCCESS( JpkfbtAttach( JpkfbtKernelRetail, &Session ) );
+	TEST( Session );
+
+	ZeroMemory( &Options, sizeof( Options ) );
+	Options.Flags = JPKFBT_LOG_FLAG_FILTER_DURATION | Flags;
+	Options.DurationThreshold = FILTER_THRESHOLD;
+
+	DeleteFile( FILTER_LOG_FILE );
+	TEST_SUCCESS( JpkfbtInitializeTracingEx(
+		Session,
+		JpkfbtTracingTypeDefault,
+		64,
+		0x1000,
+		FILTER_LOG_FILE,
+		&Options ) );
+
+	if ( ReadThreshold != FILTER_THRESHOLD )
+	{
+		Threshold.Procedure = Procedures[ 0 ];
+		Threshold.DurationThreshold = ReadThreshold;
+		TEST_SUCCESS( JpkfbtSetProcedureThresholds(
+			Session, 1, &Threshold ) );
+	}
+
+	TEST_SUCCESS( JpkfbtInstrumentProcedure(
+		Session,
+		JpfbtAddInstrumentation,
+		_countof( Procedures ),
+		Procedures,
+		&FailedProcedure ) );
+
+	BlockingRead();
+
+	TEST_SUCCESS( JpkfbtInstrumentProcedure(
+		Session,
+		JpfbtRemoveInstrumentation,
+		_countof( Procedures ),
+		Procedures,
+		&FailedProcedure ) );
+
+	TEST_SUCCESS( JpkfbtQueryStatistics( Session, &Statistics ) );
+	Calls->CallsLost = Statistics.Tracing.FilteredCallsLost;
+
+	TEST_SUCCESS( JpkfbtShutdownTracing( Session ) );
+	TEST_SUCCESS( JpkfbtDetach( Session, TRUE ) );
+
+	//
+	// Read back.
+	//
+	Client.ProcessId = GetCurrentProcessId();
+	Client.ThreadId = GetCurrentThreadId();
+
+	TEST( S_OK == JptrcrOpenFile( FILTER_LOG_FILE, &Calls->File ) );
+	TEST( S_OK == JptrcrEnumCalls(
+		Calls->File,
+		&Client,
+		OnTopLevelCall,
+		Calls ) );
+	TEST( S_OK == JptrcrCloseFile( Calls->File ) );
+}
+
+void TestFilteredNestedCalls()
+{
+	FILTERED_CALLS Calls;
+
+	TraceBlockingRead( 0, FILTER_THRESHOLD, &Calls );
+
+	TEST( Calls.ReadCalls == 1 );
+	TEST( Calls.NestedWaitCalls >= 1 );
+	TEST( Calls.TopLevelWaitCalls == 0 );
+}
+
+void TestFilteredThresholdsKeepCallers()
+{
+	FILTERED_CALLS Calls;
+
+	//
+	// NtReadFile stays below its threshold, but as procedure-specific
+	// thresholds are set, the wait retains its caller anyway and 
+	// nothing is lost.
+	//
+	TraceBlockingRead( 0, 60 * 1000 * 1000, &Calls );
+
+	TEST( Calls.ReadCalls == 1 );
+	TEST( Calls.NestedWaitCalls >= 1 );
+	TEST( Calls.TopLevelWaitCalls == 0 );
+	TEST( Calls.CallsLost == 0 );
+}
+
+void TestFilteredKeepAncestors()
+{
+	FILTERED_CALLS Calls;
+
+	//
+	// Same, with the flag given explicitly.
+	//
+	TraceBlockingRead(
+		JPKFBT_LOG_FLAG_KEEP_ANCESTORS,
+		60 * 1000 * 1000,
+		&Calls );
+
+	TEST( Calls.ReadCalls == 1 );
+	TEST( Calls.NestedWaitCalls >= 1 );
+	TEST( Calls.TopLevelWaitCalls == 0 );
+	TEST( Calls.CallsLost == 0 );
+}
+
+CFIX_BEGIN_FIXTURE( FilteredTracing )
+	CFIX_FIXTURE_ENTRY( TestFilteredNestedCalls )
+	CFIX_FIXTURE_ENTRY( TestFilteredThresholdsKeepCallers )
+	CFIX_FIXTURE_ENTRY( TestFilteredKeepAncestors )
+CFIX_END_FIXTURE()
\ No newline at end of file
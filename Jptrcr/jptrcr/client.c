@@ -10,8 +10,142 @@
 
 #include <stdlib.h>
 #include <jptrcrp.h>
+#include <jptrccmp.h>
+
+//
+// JPTRCR_CALL_CURSOR::Flags. The lower bits hold the number of calls
+// of the current node that have already been read - a node may
+// yield two calls, see JptrcrsDeliverCall.
+//
+#define JPTRCRP_CURSOR_FLAG_END		0x80000000
+#define JPTRCRP_CURSOR_SKIP_MASK	0x0000FFFF
+
+//
+// Capacity of the first chunk ref block of a client. Subsequent 
+// blocks double in size up to the maximum.
+//
+#define JPTRCRP_INITIAL_CHUNK_REF_BLOCK_CAPACITY	16
+#define JPTRCRP_MAXIMUM_CHUNK_REF_BLOCK_CAPACITY	65536
+
+//
+// JPTRCRP_CALL_NODE::Parent etc. if there is no such call, and
+// JPTRCRP_TRANSITION_READER slot not in use.
+//
+#define JPTRCRP_NO_CALL		( ( ULONG ) -1 )
+#define JPTRCRP_NO_CHUNK	( ( ULONG ) -1 )
+
+//
+// Number of decoded compact chunks kept by a transition reader.
+// Two suffice for the entry and exit transition of a call to be
+// read without decoding either chunk twice.
+//
+#define JPTRCRP_TRANSITION_READER_SLOTS		2
+
+/*++
+	Structure Description:
+		Entry of the call nesting index of a client. Calls are 
+		numbered in order of their entry transitions, and the nodes
+		of all calls of a client form an array indexed by this 
+		number.
+
+		All calls numbered [Sequence + 1, SubtreeEnd) are direct 
+		or indirect callees of this call. Thus, the first callee
+		(if any) is Sequence + 1 and the next call of the same 
+		caller (if any) is SubtreeEnd.
+
+		Transitions are not copied into the node but referred to
+		by location, see JptrcrsReadTransition. Chunks are 
+		identified by their position in the client's chunk list.
+--*/
+typedef struct _JPTRCRP_CALL_NODE
+{
+	//
+	// Enclosing call, JPTRCRP_NO_CALL for top level calls.
+	//
+	ULONG Parent;
+
+	//
+	// 0 if the call has not returned before the end of the trace.
+	//
+	ULONG SubtreeEnd;
+
+	//
+	// Location of the entry transition, i.e. the call handle.
+	//
+	ULONG EntryChunk;
+	ULONG EntryIndex;
+
+	//
+	// Location of the exit transition, 0 if the call has not
+	// returned.
+	//
+	ULONG ExitChunk;
+	ULONG ExitIndex;
+} JPTRCRP_CALL_NODE, *PJPTRCRP_CALL_NODE;
+
+/*++
+	Structure Description:
+		Per-chunk part of the call nesting index.
+--*/
+typedef struct _JPTRCRP_CHUNK_CALLS
+{
+	struct _JPTRCRP_CHUNK_REF *ChunkRef;
+
+	//
+	// Calls entered in this chunk are numbered 
+	// [FirstCall, FirstCall + CallCount).
+	//
+	ULONG FirstCall;
+	ULONG CallCount;
 
-#define JPTRCRP_MAX_SYM_LENGTH	64
+	//
+	// Innermost call pending at the start of the chunk, 
+	// JPTRCRP_NO_CALL if none. Along with the parents of this 
+	// call, this forms a snapshot of the call stack at the chunk
+	// boundary.
+	//
+	ULONG PendingCall;
+
+	//
+	// Timestamp of the last transition. Empty chunks assume the
+	// last timestamp of the preceding chunk.
+	//
+	ULONGLONG LastTimestamp;
+} JPTRCRP_CHUNK_CALLS, *PJPTRCRP_CHUNK_CALLS;
+
+/*++
+	Structure Description:
+		Call nesting index of a client. Built under the file lock 
+		and not modified once published, so calls can be enumerated
+		without holding the lock.
+
+		Referenced by the client until chunk refs are added and by
+		each enumeration in progress.
+--*/
+typedef struct _JPTRCRP_CALL_INDEX
+{
+	volatile LONG ReferenceCount;
+
+	//
+	// All calls, indexed by sequence number. The first call,
+	// if any, is a top level call.
+	//
+	PJPTRCRP_CALL_NODE Calls;
+	ULONG CallCount;
+
+	//
+	// Innermost call that has not returned by the end of the
+	// trace, JPTRCRP_NO_CALL if none.
+	//
+	ULONG PendingCall;
+
+	//
+	// All chunks in order, indexed by JPTRCRP_CHUNK_REF::Position.
+	// Used for seeking by timestamp.
+	//
+	PJPTRCRP_CHUNK_CALLS Chunks;
+	ULONG ChunkCount;
+} JPTRCRP_CALL_INDEX, *PJPTRCRP_CALL_INDEX;
 
 typedef struct _JPTRCRP_CLIENT
 {
@@ -25,31 +159,155 @@ typedef struct _JPTRCRP_CLIENT
 	} u;
 
 	//
-	// List of JPTRCRP_CHUNK_REF.
+	// Chunk refs in file order, stored in blocks allocated from the
+	// file's chunk ref arena. Refs never move, so their addresses
+	// may be used as call handles.
+	//
+	struct
+	{
+		struct _JPTRCRP_CHUNK_REF_BLOCK *FirstBlock;
+		struct _JPTRCRP_CHUNK_REF_BLOCK *LastBlock;
+		ULONG Count;
+	} ChunkRefs;
+
+	//
+	// List of JPTRCRP_INDEX_REF. Turned into chunk refs on first use.
+	//
+	LIST_ENTRY IndexRefListHead;
+
+	//
+	// Call nesting index. Built on first enumeration of calls and 
+	// released whenever chunk refs are added, NULL if not built.
+	//
+	PJPTRCRP_CALL_INDEX CallIndex;
+
+	//
+	// Changes since the last JptrcrpResetClientUpdates, see 
+	// JptrcrRefreshFile.
 	//
-	LIST_ENTRY ChunkRefListHead;
+	struct
+	{
+		//
+		// FALSE if the client has not been reported yet.
+		//
+		BOOL Reported;
+		ULONG NewChunks;
+	} Updates;
 
 	JPTRCR_CLIENT Information;
 } JPTRCRP_CLIENT, *PJPTRCRP_CLIENT;
 
 typedef struct _JPTRCRP_CHUNK_REF
 {
-	LIST_ENTRY ListEntry;
 	ULONGLONG FileOffset;
 	PJPTRCRP_CLIENT Client;
+
+	//
+	// Position among the chunk refs of the client.
+	//
+	ULONG Position;
 } JPTRCRP_CHUNK_REF, *PJPTRCRP_CHUNK_REF;
 
+/*++
+	Structure Description:
+		Contiguous array of chunk refs of a client.
+--*/
+typedef struct _JPTRCRP_CHUNK_REF_BLOCK
+{
+	struct _JPTRCRP_CHUNK_REF_BLOCK *Next;
+	ULONG Count;
+	ULONG Capacity;
+	JPTRCRP_CHUNK_REF Refs[ ANYSIZE_ARRAY ];
+} JPTRCRP_CHUNK_REF_BLOCK, *PJPTRCRP_CHUNK_REF_BLOCK;
+
+typedef struct _JPTRCRP_INDEX_REF
+{
+	LIST_ENTRY ListEntry;
+	ULONGLONG IndexChunkOffset;
+	ULONGLONG BaseOffset;
+	ULONG FirstChunk;
+	ULONG ChunkCount;
+} JPTRCRP_INDEX_REF, *PJPTRCRP_INDEX_REF;
+
 typedef struct _JPTRCRP_CLIENT_ENUM_CONTEXT
 {
 	JPTRCR_ENUM_CLIENTS_ROUTINE Callback;
 	PVOID Context;
 } JPTRCRP_CLIENT_ENUM_CONTEXT, *PJPTRCRP_CLIENT_ENUM_CONTEXT;
 
-typedef struct _JPTRCRP_SYMBOL_INFO
+typedef struct _JPTRCRP_CLIENT_UPDATES_CONTEXT
+{
+	JPTRCR_REFRESH_ROUTINE Callback;
+	PVOID Context;
+	ULONG ClientsReported;
+} JPTRCRP_CLIENT_UPDATES_CONTEXT, *PJPTRCRP_CLIENT_UPDATES_CONTEXT;
+
+typedef struct _JPTRCRP_CLIENT_CHUNKS_CONTEXT
+{
+	PJPTRCRP_FILE File;
+	HRESULT Hr;
+
+	ULONG ClientCount;
+	ULONGLONG ChunkCount;
+
+	//
+	// NULL during the first pass, which only counts.
+	//
+	PJPTRCRP_CLIENT_CHUNKS Clients;
+	PULONGLONG NextChunkOffset;
+} JPTRCRP_CLIENT_CHUNKS_CONTEXT, *PJPTRCRP_CLIENT_CHUNKS_CONTEXT;
+
+typedef struct _JPTRCRP_READ_CALLS_CONTEXT
+{
+	PJPTRCRP_FILE File;
+
+	PJPTRCR_CALL_RECORD Records;
+	ULONG MaxRecords;
+	ULONG RecordsRead;
+
+	//
+	// Calls of the current node to be skipped as they have been
+	// read before.
+	//
+	ULONG Skip;
+
+	//
+	// Calls of the current node skipped or read, and calls that
+	// did not fit.
+	//
+	ULONG Consumed;
+	ULONG Dropped;
+} JPTRCRP_READ_CALLS_CONTEXT, *PJPTRCRP_READ_CALLS_CONTEXT;
+
+/*++
+	Structure Description:
+		Provides access to the transitions referred to by the call
+		nodes of a call index. Chunks are read through a private 
+		mapping, so the reader can be used without holding the file
+		lock. Compact chunks are decoded on first access and kept 
+		for subsequent accesses.
+--*/
+typedef struct _JPTRCRP_TRANSITION_READER
 {
-	SYMBOL_INFO Info;
-	WCHAR __NameBuffer[ JPTRCRP_MAX_SYM_LENGTH - 1 ];
-} JPTRCRP_SYMBOL_INFO, *PJPTRCRP_SYMBOL_INFO;
+	PJPTRCRP_FILE File;
+	PJPTRCRP_CALL_INDEX Index;
+	JPTRCRP_PRIVATE_MAPPING Mapping;
+
+	struct
+	{
+		//
+		// Position of the decoded chunk, JPTRCRP_NO_CHUNK if none.
+		//
+		ULONG Chunk;
+		ULONG TransitionCount;
+		JPTRCRP_TRANSITION_BUFFER Buffer;
+	} Slots[ JPTRCRP_TRANSITION_READER_SLOTS ];
+
+	//
+	// Slot to be reused next.
+	//
+	ULONG NextSlot;
+} JPTRCRP_TRANSITION_READER, *PJPTRCRP_TRANSITION_READER;
 
 /*----------------------------------------------------------------------
  *
@@ -64,437 +322,1671 @@ static VOID JptrcrsResolveSymbolAndDeliverCallback(
 	__in_opt PVOID Context
 	)
 {
-	DWORD64 Displacement;
-	JPTRCRP_SYMBOL_INFO SymbolInfo;
-
 	ASSERT( File );
 	ASSERT( Call );
 	ASSERT( Callback );
 
-	SymbolInfo.Info.SizeOfStruct	= sizeof( SYMBOL_INFO );
-	SymbolInfo.Info.MaxNameLen		= JPTRCRP_MAX_SYM_LENGTH;
+	//
+	// Symbol cache and clock are shared - resolve under the lock, 
+	// but invoke the callback without it. Symbols remain valid 
+	// until the file is closed.
+	//
+	EnterCriticalSection( &File->Lock );
+
+	//
+	// Timestamps of different processors may be slightly skewed.
+	//
+	Call->Duration = ( Call->ExitTimestamp >= Call->EntryTimestamp )
+		? JptrcrpTicksToNanoseconds( 
+			File, 
+			Call->ExitTimestamp - Call->EntryTimestamp )
+		: 0;
 
-	if ( SymFromAddr(
-		File->SymHandle,
+	//
+	// N.B. Symbol and module are cached, so this is cheap for all
+	// but the first call of a procedure.
+	//
+	JptrcrpResolveSymbol(
+		File,
 		Call->Procedure,
-		&Displacement,
-		&SymbolInfo.Info ) )
+		&Call->Symbol,
+		&Call->Module );
+
+	LeaveCriticalSection( &File->Lock );
+
+	( Callback )( Call, Context );
+}
+
+static VOID JptrcrsReferenceCallIndex(
+	__in PJPTRCRP_CALL_INDEX Index
+	)
+{
+	ASSERT( Index );
+	ASSERT( Index->ReferenceCount > 0 );
+
+	InterlockedIncrement( &Index->ReferenceCount );
+}
+
+static VOID JptrcrsReleaseCallIndex(
+	__in PJPTRCRP_CALL_INDEX Index
+	)
+{
+	ASSERT( Index );
+	ASSERT( Index->ReferenceCount > 0 );
+
+	if ( InterlockedDecrement( &Index->ReferenceCount ) == 0 )
 	{
-		ASSERT( Displacement == 0 );
-	
-		Call->Symbol = &SymbolInfo.Info;
+		free( Index->Calls );
+		free( Index->Chunks );
+		free( Index );
+	}
+}
 
-		VERIFY( S_OK == JptrcrGetModule( 
-			File, 
-			SymbolInfo.Info.ModBase,
-			&Call->Module ) );
+/*++
+	Routine Description:
+		Make room for at least Count more nodes in the call array
+		of an index being built.
+--*/
+static HRESULT JptrcrsReserveCallNodes(
+	__in PJPTRCRP_CALL_INDEX Index,
+	__inout PULONG Capacity,
+	__in ULONG Count
+	)
+{
+	ULONG NewCapacity;
+	PJPTRCRP_CALL_NODE NewCalls;
+
+	ASSERT( Index );
+	ASSERT( Capacity );
+	ASSERT( Index->CallCount <= *Capacity );
+
+	if ( Count <= *Capacity - Index->CallCount )
+	{
+		return S_OK;
 	}
-	else
+
+	//
+	// Sequence numbers must not collide with JPTRCRP_NO_CALL.
+	//
+	if ( Count >= JPTRCRP_NO_CALL - Index->CallCount )
 	{
-		Call->Symbol = NULL;
-		Call->Module = NULL;
+		return E_OUTOFMEMORY;
 	}
 
-	( Callback )( Call, Context );
+	NewCapacity = Index->CallCount + Count;
+	if ( *Capacity < JPTRCRP_NO_CALL / 2 )
+	{
+		NewCapacity = max( NewCapacity, 2 * *Capacity );
+	}
+
+	if ( NewCapacity > ( ( SIZE_T ) -1 ) / sizeof( JPTRCRP_CALL_NODE ) )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	NewCalls = ( PJPTRCRP_CALL_NODE ) realloc(
+		Index->Calls,
+		( SIZE_T ) NewCapacity * sizeof( JPTRCRP_CALL_NODE ) );
+	if ( NewCalls == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	Index->Calls	= NewCalls;
+	*Capacity		= NewCapacity;
+
+	return S_OK;
 }
 
-static HRESULT JptrcrsEnumCalls(
+/*++
+	Routine Description:
+		Build the call nesting index of a client by walking all
+		transitions once. Each exit transition is matched with the
+		innermost pending entry transition.
+--*/
+static HRESULT JptrcrsBuildCallIndex(
 	__in PJPTRCRP_FILE File,
-	__in PJPTRCR_CALL_HANDLE CallerHandle,
-	__in BOOL SkipFirst,
-	__in BOOL IncludeAllTopLevelCalls,
-	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
-	__in_opt PVOID Context
+	__in PJPTRCRP_CLIENT Client,
+	__out PJPTRCRP_CALL_INDEX *CallIndex
 	)
 {
-	PJPTRCRP_CHUNK_REF ChunkRef;
-	JPTRCR_CALL Call;
-	PJPTRCRP_CLIENT Client;
-	ULONG CurrentIndex;
-	LONG Depth = 0;
-	PLIST_ENTRY ListEntry;
-	
+	PJPTRCRP_CHUNK_REF_BLOCK Block;
+	ULONG CallCapacity = 0;
+	ULONG ChunkIndex;
+
+	//
+	// Innermost call that has not returned yet.
+	//
+	ULONG Current = JPTRCRP_NO_CALL;
+	JPTRCRP_TRANSITION_BUFFER DecodeBuffer = { NULL, 0 };
+	HRESULT Hr;
+	ULONGLONG LastChunkTimestamp = 0;
+	PJPTRCRP_CALL_INDEX NewIndex;
+
 #if DBG
 	ULONGLONG LastTimestamp = 0;
-	ULONG ThreadId = 0;
 #endif
 
 	ASSERT( File );
-	ASSERT( CallerHandle );
-	ASSERT( Callback );
+	ASSERT( Client );
+	ASSERT( CallIndex );
 
-	CurrentIndex	= CallerHandle->Index;
-	ChunkRef		= ( PJPTRCRP_CHUNK_REF ) CallerHandle->Chunk;
-	Client			= ChunkRef->Client;
+	*CallIndex = NULL;
 
-	ZeroMemory( &Call, sizeof( JPTRCR_CALL ) );
+	NewIndex = ( PJPTRCRP_CALL_INDEX ) malloc( sizeof( JPTRCRP_CALL_INDEX ) );
+	if ( NewIndex == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	NewIndex->ReferenceCount	= 1;
+	NewIndex->Calls				= NULL;
+	NewIndex->CallCount			= 0;
+	NewIndex->PendingCall		= JPTRCRP_NO_CALL;
+	NewIndex->Chunks			= NULL;
+	NewIndex->ChunkCount		= 0;
 
 	//
-	// Beginning with the chunk referred to by ChunkRef (which may
-	// or may not be the first chunk of this client), we walk
-	// the list of sibling chunks.
+	// Array of chunks, used for seeking.
 	//
+	if ( Client->ChunkRefs.Count > 0 )
+	{
+		if ( Client->ChunkRefs.Count > 
+			 ( ( SIZE_T ) -1 ) / sizeof( JPTRCRP_CHUNK_CALLS ) )
+		{
+			Hr = E_OUTOFMEMORY;
+			goto Cleanup;
+		}
+
+		NewIndex->Chunks = ( PJPTRCRP_CHUNK_CALLS ) malloc(
+			( SIZE_T ) Client->ChunkRefs.Count * sizeof( JPTRCRP_CHUNK_CALLS ) );
+		if ( NewIndex->Chunks == NULL )
+		{
+			Hr = E_OUTOFMEMORY;
+			goto Cleanup;
+		}
+
+		for ( Block = Client->ChunkRefs.FirstBlock; 
+			  Block != NULL; 
+			  Block = Block->Next )
+		{
+			ULONG Index;
+
+			for ( Index = 0; Index < Block->Count; Index++ )
+			{
+				ASSERT( Block->Refs[ Index ].Position == 
+					NewIndex->ChunkCount );
+
+				NewIndex->Chunks[ NewIndex->ChunkCount++ ].ChunkRef =
+					&Block->Refs[ Index ];
+			}
+		}
+
+		ASSERT( NewIndex->ChunkCount == Client->ChunkRefs.Count );
+	}
 
-	ListEntry = &ChunkRef->ListEntry;
-	while ( ListEntry != &Client->ChunkRefListHead )
+	for ( ChunkIndex = 0; 
+		  ChunkIndex < NewIndex->ChunkCount; 
+		  ChunkIndex++ )
 	{
 		PJPTRC_TRACE_BUFFER_CHUNK32 Chunk;
-		PJPTRCRP_CHUNK_REF CurrentChunkRef;
-		HRESULT Hr;
+		PJPTRCRP_CHUNK_CALLS ChunkCalls;
+		ULONG Index;
+		JPTRCRP_DEPTH_SCAN Scan;
 		ULONG TransitionCount;
+		PJPTRC_PROCEDURE_TRANSITION32 Transitions;
 		
-		CurrentChunkRef = CONTAINING_RECORD(
-			ListEntry,
-			JPTRCRP_CHUNK_REF,
-			ListEntry );
+		ChunkCalls = &NewIndex->Chunks[ ChunkIndex ];
 
-		ASSERT( CurrentChunkRef->Client == Client );
+		ASSERT( ChunkCalls->ChunkRef->Client == Client );
 
-		//
-		// Map in entire chunk.
-		//
-		Hr = JptrcrpMap( File, CurrentChunkRef->FileOffset, &Chunk );
+		ChunkCalls->FirstCall	= NewIndex->CallCount;
+		ChunkCalls->CallCount	= 0;
+		ChunkCalls->PendingCall	= Current;
+
+		Hr = JptrcrpMap( File, ChunkCalls->ChunkRef->FileOffset, &Chunk );
 		if ( FAILED( Hr ) )
 		{
-			return Hr;
+			goto Cleanup;
 		}
 
-		ASSERT( ( PVOID ) Chunk >= File->CurrentMapping.MappedAddress );
-		ASSERT( Chunk->Header.Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER );
-		if ( Chunk->Header.Type != JPTRC_CHUNK_TYPE_TRACE_BUFFER )
-		{
-			return JPTRCR_E_INVALID_CALL_HANDLE;
-		}
+		ASSERT( Chunk->Header.Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER ||
+				Chunk->Header.Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT );
+		ASSERT( Chunk->Client.ThreadId == Client->Information.ThreadId );
 
-#if DBG
-		if ( ThreadId == 0 )
+		//
+		// N.B. The transitions of the previous chunk are not needed
+		// any more, so the buffer can be reused.
+		//
+		Hr = JptrcrpGetChunkTransitions(
+			&Chunk->Header,
+			&DecodeBuffer,
+			&Transitions,
+			&TransitionCount );
+		if ( FAILED( Hr ) )
 		{
-			ThreadId = Chunk->Client.ThreadId;
+			goto Cleanup;
 		}
-		else
+
+		if ( TransitionCount > 0 )
 		{
-			ASSERT( ThreadId == CurrentChunkRef->Client->Information.ThreadId );
-			ASSERT( ThreadId == Chunk->Client.ThreadId );
+			LastChunkTimestamp = Transitions[ TransitionCount - 1 ].Timestamp;
 		}
-#endif
+
+		ChunkCalls->LastTimestamp = LastChunkTimestamp;
 
 		//
-		// See how many tranitions this chunk holds.
+		// Validate and count entries s.t. the call array has to be
+		// grown at most once per chunk.
 		//
-		ASSERT( ( ( Chunk->Header.Size - FIELD_OFFSET(
-			JPTRC_TRACE_BUFFER_CHUNK32, Transitions ) ) %
-			sizeof( JPTRC_PROCEDURE_TRANSITION32 ) ) == 0 );
-
-		TransitionCount = ( Chunk->Header.Size - FIELD_OFFSET(
-			JPTRC_TRACE_BUFFER_CHUNK32, Transitions ) ) /
-			sizeof( JPTRC_PROCEDURE_TRANSITION32 );
-
-		if ( CurrentIndex > TransitionCount )
+		Hr = JptrcrpScanTransitionDepth(
+			Transitions,
+			TransitionCount,
+			JPTRCRP_NO_TARGET_DEPTH,
+			&Scan );
+		if ( FAILED( Hr ) )
 		{
-			return JPTRCR_E_INVALID_CALL_HANDLE;
+			goto Cleanup;
 		}
 
-		if ( SkipFirst )
+		Hr = JptrcrsReserveCallNodes( NewIndex, &CallCapacity, Scan.EntryCount );
+		if ( FAILED( Hr ) )
 		{
-			//
-			// Advance index - index may now be == TransitionCount,
-			// s.t. the loop is skipped and the next chunk will
-			// be examined.
-			//
-			CurrentIndex++;
-			SkipFirst = FALSE;
+			goto Cleanup;
 		}
 
-		//
-		// Scan transitions of Depth 0.
-		//
-		for ( ; CurrentIndex < TransitionCount; CurrentIndex++ )
+		for ( Index = 0; Index < TransitionCount; Index++ )
 		{
-			LONG DepthDelta;
-			BOOL IsEntry;
-			PJPTRC_PROCEDURE_TRANSITION32 Transition = 
-				&Chunk->Transitions[ CurrentIndex ];
-
-			switch ( Transition->Type )
-			{
-			case JPTRC_PROCEDURE_TRANSITION_ENTRY:
-				//
-				// Adjust depth at end of iteration.
-				//
-				ASSERT( Depth >= 0 );
-
-				DepthDelta = 1;
-				IsEntry = TRUE;
-				break;
-
-			case JPTRC_PROCEDURE_TRANSITION_EXIT:
-			case JPTRC_PROCEDURE_TRANSITION_UNWIND:
-				//
-				// Adjust depth immediately.
-				//
-				DepthDelta = 0;
-				Depth--;
-				IsEntry = FALSE;
-				break;
-
-			default:
-				return JPTRCR_E_INVALID_TRANSITION;
-			}
+			PJPTRC_PROCEDURE_TRANSITION32 Transition = &Transitions[ Index ];
+			PJPTRCRP_CALL_NODE Call;
 
 #if DBG
 			ASSERT( Transition->Timestamp >= LastTimestamp );
 			LastTimestamp = Transition->Timestamp;
 #endif
 
-			if ( Depth < 0 )
+			if ( Transition->Type == JPTRC_PROCEDURE_TRANSITION_ENTRY )
 			{
-				if ( IncludeAllTopLevelCalls )
-				{
-					ASSERT( ! IsEntry );
-
-					//
-					// We are enumerating top level calls and depth has
-					// dropped below 0. This should not happen, but
-					// is possible because of missed entry transitions. 
-					// If we were to stop here, the remaining calls of this 
-					// client can never be enumerated - this is bad. Therefore,
-					// we ignore this exit.
-					//
-					TRACE( ( L"Missing entry transition\n" ) );
-						
-					Depth = 0;
-				}
-				else
-				{
-					//
-					// Any subsequent transitions do not affect us any
-					// more - quit.
-					//
-					return S_OK;
-				}
+				ASSERT( ChunkCalls->CallCount < Scan.EntryCount );
+				ChunkCalls->CallCount++;
+
+				Call = &NewIndex->Calls[ NewIndex->CallCount ];
+				Call->Parent		= Current;
+				Call->SubtreeEnd	= 0;
+				Call->EntryChunk	= ChunkIndex;
+				Call->EntryIndex	= Index;
+				Call->ExitChunk		= 0;
+				Call->ExitIndex		= 0;
+
+				Current = NewIndex->CallCount++;
 			}
-			else if ( Depth == 0 )
+			else if ( Current != JPTRCRP_NO_CALL )
 			{
 				//
-				// Good one - either its the entry or the exit for
-				// a call we are interested in.
+				// N.B. The procedures of entry and exit may not match
+				// if transitions have been lost. This is dealt with
+				// when the call is reported.
 				//
-				if ( IsEntry )
-				{
-					//TRACE( ( L"Entry [Index %d]\n", CurrentIndex ) );
-
-					ASSERT( Call.CallHandle.Chunk == NULL );
-
-					//
-					// N.B. The entry transition is significant for 
-					// examining child calls, not the exit transition.
-					//
-					Call.EntryType			= JptrcrNormalEntry;
-
-					Call.CallHandle.Chunk 	= CurrentChunkRef;
-					Call.CallHandle.Index 	= CurrentIndex;
-
-					Call.Procedure			= Transition->Procedure;
-
-					Call.EntryTimestamp		= Transition->Timestamp;
-					Call.CallerIp			= Transition->Info.CallerIp;
-
-					Call.ChildCalls			= 0;
-					
-					//
-					// The rest is captured on exit.
-					//
-				}
-				else // Exit
-				{
-					//TRACE( ( L"Exit [Index %d]\n", CurrentIndex ) );
-	
-					Call.ExitTimestamp = Transition->Timestamp;
-						
-					if ( Call.Procedure != Transition->Procedure )
-					{
-						TRACE( ( L"Missing exit transition\n" ) );
-						
-						//
-						// Exit transition does not match entry transition -
-						// either an exit or an entry transition must have
-						// been lost. We try to avoid larger damage
-						// by introducing 2 synthetic transitions.
-						//
-
-						//
-						// End the previous call with a syntehtic exit.
-						//
-						Call.Result.ReturnValue	= 0;
-						Call.ExitType			= JptrcrSyntheticExit;
-
-						ASSERT( Call.ExitTimestamp > Call.EntryTimestamp );
-
-						JptrcrsResolveSymbolAndDeliverCallback(
-							File,
-							&Call,
-							Callback,
-							Context );
-
-						//
-						// Create a synthetic entry for this exit.
-						//
-						Call.EntryType			= JptrcrSyntheticEntry;
-
-						Call.CallHandle.Chunk 	= 0;
-						Call.CallHandle.Index 	= 0;
-
-						Call.Procedure			= Transition->Procedure;
-
-						Call.EntryTimestamp		= Transition->Timestamp;
-						Call.CallerIp			= 0;
-
-						Call.ChildCalls			= 0;
-
-						//
-						// Continue with exit handling.
-						//
-					}
-
-					if ( Transition->Type == JPTRC_PROCEDURE_TRANSITION_EXIT )
-					{
-						Call.ExitType			= JptrcrNormalExit;
-						Call.Result.ReturnValue = Transition->Info.ReturnValue;
-					}
-					else
-					{
-						ASSERT( Transition->Type == JPTRC_PROCEDURE_TRANSITION_UNWIND );
-
-						Call.ExitType			= JptrcrException;
-						Call.Result.ExceptionCode = Transition->Info.Exception.Code;
-					}
-
-					ASSERT( Call.ExitTimestamp >= Call.EntryTimestamp );
-
-					JptrcrsResolveSymbolAndDeliverCallback(
-						File,
-						&Call,
-						Callback,
-						Context );
-
-					Call.Procedure = 0;
-#if DBG
-					ZeroMemory( &Call, sizeof( JPTRCR_CALL ) );
-#else
-					Call.CallHandle.Chunk = NULL;
-#endif
-				}
+				Call = &NewIndex->Calls[ Current ];
+				Call->SubtreeEnd	= NewIndex->CallCount;
+				Call->ExitChunk		= ChunkIndex;
+				Call->ExitIndex		= Index;
+
+				Current = Call->Parent;
 			}
-			else // Depth > 0
+			else
 			{
-				//TRACE( ( L"Indirect/Ignored [Index %d]\n", CurrentIndex ) );
-
 				//
-				// Indirect call - ignore.
+				// Exit on top level. This should not happen, but is
+				// possible because of missed entry transitions. The
+				// exit cannot be attributed to any call - ignore it
+				// and continue with the next top level call.
 				//
-				if ( IsEntry )
-				{
-					Call.ChildCalls++;
-				}
+				TRACE( ( L"Missing entry transition\n" ) );
 			}
-
-			//
-			// Adjust depth for subsequent iterations.
-			//
-			Depth += DepthDelta;
 		}
 
-		//
-		// Proceed at beginning of next chunk.
-		//
-		ListEntry		= ListEntry->Flink;
-		CurrentIndex	= 0;
+		ASSERT( ChunkCalls->CallCount == Scan.EntryCount );
 	}
 
-	return S_OK;
+	NewIndex->PendingCall	= Current;
+	*CallIndex				= NewIndex;
+	Hr = S_OK;
+
+Cleanup:
+	JptrcrpDeleteTransitionBuffer( &DecodeBuffer );
+
+	if ( FAILED( Hr ) )
+	{
+		JptrcrsReleaseCallIndex( NewIndex );
+	}
+
+	return Hr;
 }
 
-/*----------------------------------------------------------------------
- *
- * Hashtable routines.
- *
- */
-ULONG JptrcrpHashClient(
-	__in ULONG_PTR ClientPtr
+/*++
+	Routine Description:
+		Get the end of the range of callees of a call. For a call
+		that has not returned, all calls entered later are callees.
+--*/
+static ULONG JptrcrsGetSubtreeEnd(
+	__in PJPTRCRP_CALL_INDEX Index,
+	__in ULONG Call
 	)
 {
-	PJPTRCR_CLIENT Client = ( PJPTRCR_CLIENT ) ( PVOID ) ClientPtr;
+	ASSERT( Index );
+	ASSERT( Call < Index->CallCount );
 
-	//
-	// Despite the chance of being reused, ThreadId is pretty unique.
-	//
-	return Client->ThreadId;
+	return Index->Calls[ Call ].SubtreeEnd != 0
+		? Index->Calls[ Call ].SubtreeEnd
+		: Index->CallCount;
 }
 
-BOOLEAN JptrcrpEqualsClient(
-	__in ULONG_PTR ClientPtrLhs,
-	__in ULONG_PTR ClientPtrRhs
+/*++
+	Return Value:
+		First callee of a call, JPTRCRP_NO_CALL if none.
+--*/
+static ULONG JptrcrsGetFirstChild(
+	__in PJPTRCRP_CALL_INDEX Index,
+	__in ULONG Call
 	)
 {
-	PJPTRCR_CLIENT ClientLhs = ( PJPTRCR_CLIENT ) ( PVOID ) ClientPtrLhs;
-	PJPTRCR_CLIENT ClientRhs = ( PJPTRCR_CLIENT ) ( PVOID ) ClientPtrRhs;
-	
-	return ( ClientLhs->ThreadId == ClientRhs->ThreadId &&
-			 ClientLhs->ProcessId == ClientRhs->ProcessId ) ? TRUE : FALSE;
+	return ( Call + 1 < JptrcrsGetSubtreeEnd( Index, Call ) )
+		? Call + 1
+		: JPTRCRP_NO_CALL;
 }
 
-VOID JptrcrsRemoveAndDeleteClient(
-	__in PJPHT_HASHTABLE Hashtable,
-	__in PJPHT_HASHTABLE_ENTRY Entry,
-	__in_opt PVOID Context
+/*++
+	Return Value:
+		Next call of the same caller, JPTRCRP_NO_CALL if none.
+--*/
+static ULONG JptrcrsGetNextSibling(
+	__in PJPTRCRP_CALL_INDEX Index,
+	__in ULONG Call
 	)
 {
-	PJPTRCRP_CLIENT Client;
-	PJPHT_HASHTABLE_ENTRY RemovedEntry;
+	PJPTRCRP_CALL_NODE Node;
+	ULONG ParentEnd;
 
-	UNREFERENCED_PARAMETER( Context );
-
-	//
-	// Remove this entry from the table.
-	//
-	JphtRemoveEntryHashtable(
-		Hashtable,
-		Entry->Key,
-		&RemovedEntry );
-	ASSERT( RemovedEntry == Entry );
+	ASSERT( Index );
+	ASSERT( Call < Index->CallCount );
+
+	Node = &Index->Calls[ Call ];
+	if ( Node->SubtreeEnd == 0 )
+	{
+		//
+		// Call has not returned before the end of the trace -
+		// it cannot have any subsequent siblings.
+		//
+		return JPTRCRP_NO_CALL;
+	}
+
+	ParentEnd = ( Node->Parent != JPTRCRP_NO_CALL )
+		? JptrcrsGetSubtreeEnd( Index, Node->Parent )
+		: Index->CallCount;
+
+	return ( Node->SubtreeEnd < ParentEnd )
+		? Node->SubtreeEnd
+		: JPTRCRP_NO_CALL;
+}
+
+/*++
+	Routine Description:
+		Initialize a reader for the transitions of a call index. 
+		The reader does not reference the index, the caller has to
+		keep it alive while the reader is in use.
+--*/
+static VOID JptrcrsInitializeTransitionReader(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_CALL_INDEX Index,
+	__out PJPTRCRP_TRANSITION_READER Reader
+	)
+{
+	ULONG Slot;
+
+	ASSERT( File );
+	ASSERT( Index );
+	ASSERT( Reader );
+
+	Reader->File		= File;
+	Reader->Index		= Index;
+	Reader->NextSlot	= 0;
+
+	JptrcrpInitializePrivateMapping( &Reader->Mapping );
+
+	for ( Slot = 0; Slot < JPTRCRP_TRANSITION_READER_SLOTS; Slot++ )
+	{
+		Reader->Slots[ Slot ].Chunk				= JPTRCRP_NO_CHUNK;
+		Reader->Slots[ Slot ].TransitionCount	= 0;
+		Reader->Slots[ Slot ].Buffer.Transitions	= NULL;
+		Reader->Slots[ Slot ].Buffer.Capacity		= 0;
+	}
+}
+
+static VOID JptrcrsDeleteTransitionReader(
+	__in PJPTRCRP_TRANSITION_READER Reader
+	)
+{
+	ULONG Slot;
+
+	ASSERT( Reader );
+
+	for ( Slot = 0; Slot < JPTRCRP_TRANSITION_READER_SLOTS; Slot++ )
+	{
+		JptrcrpDeleteTransitionBuffer( &Reader->Slots[ Slot ].Buffer );
+	}
+
+	JptrcrpUnmapPrivate( &Reader->Mapping );
+}
+
+/*++
+	Routine Description:
+		Get the transitions of a chunk of the reader's client.
+
+		The transitions remain valid until the next call of this 
+		routine or of JptrcrsReadTransition.
+
+	Parameters:
+		Chunk	- Position of the chunk.
+--*/
+static HRESULT JptrcrsGetReaderTransitions(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONG Chunk,
+	__out PJPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__out PULONG TransitionCount
+	)
+{
+	PJPTRC_CHUNK_HEADER Header;
+	HRESULT Hr;
+	ULONGLONG Offset;
+	ULONG Slot;
+
+	ASSERT( Reader );
+	ASSERT( Chunk < Reader->Index->ChunkCount );
+
+	for ( Slot = 0; Slot < JPTRCRP_TRANSITION_READER_SLOTS; Slot++ )
+	{
+		if ( Reader->Slots[ Slot ].Chunk == Chunk )
+		{
+			*Transitions		= Reader->Slots[ Slot ].Buffer.Transitions;
+			*TransitionCount	= Reader->Slots[ Slot ].TransitionCount;
+			return S_OK;
+		}
+	}
+
+	Offset = Reader->Index->Chunks[ Chunk ].ChunkRef->FileOffset;
+	if ( JptrcrpIsMappedPrivate( &Reader->Mapping, Offset ) )
+	{
+		Hr = JptrcrpMapPrivate( Reader->File, &Reader->Mapping, Offset, &Header );
+	}
+	else
+	{
+		//
+		// Mapping another window requires the file parts, which may
+		// be replaced by JptrcrRefreshFile.
+		//
+		EnterCriticalSection( &Reader->File->Lock );
+		Hr = JptrcrpMapPrivate( Reader->File, &Reader->Mapping, Offset, &Header );
+		LeaveCriticalSection( &Reader->File->Lock );
+	}
+
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	if ( Header->Type != JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT )
+	{
+		//
+		// Used in place, the buffer is not touched.
+		//
+		return JptrcrpGetChunkTransitions(
+			Header,
+			&Reader->Slots[ 0 ].Buffer,
+			Transitions,
+			TransitionCount );
+	}
+
+	Slot = Reader->NextSlot;
+	Reader->NextSlot = ( Slot + 1 ) % JPTRCRP_TRANSITION_READER_SLOTS;
+
+	Reader->Slots[ Slot ].Chunk = JPTRCRP_NO_CHUNK;
+
+	Hr = JptrcrpGetChunkTransitions(
+		Header,
+		&Reader->Slots[ Slot ].Buffer,
+		Transitions,
+		TransitionCount );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	Reader->Slots[ Slot ].Chunk				= Chunk;
+	Reader->Slots[ Slot ].TransitionCount	= *TransitionCount;
+
+	return S_OK;
+}
+
+static HRESULT JptrcrsReadTransition(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONG Chunk,
+	__in ULONG Index,
+	__out PJPTRC_PROCEDURE_TRANSITION32 Transition
+	)
+{
+	HRESULT Hr;
+	ULONG TransitionCount;
+	PJPTRC_PROCEDURE_TRANSITION32 Transitions;
+
+	Hr = JptrcrsGetReaderTransitions(
+		Reader,
+		Chunk,
+		&Transitions,
+		&TransitionCount );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	ASSERT( Index < TransitionCount );
+	if ( Index >= TransitionCount )
+	{
+		return JPTRCR_E_CORRUPT_CHUNK;
+	}
+
+	*Transition = Transitions[ Index ];
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Find the call whose entry transition is located at the 
+		given index of a chunk.
+
+	Return Value:
+		Call or JPTRCRP_NO_CALL if there is no entry transition at
+		this index.
+--*/
+static ULONG JptrcrsLookupCall(
+	__in PJPTRCRP_CALL_INDEX Index,
+	__in PJPTRCRP_CHUNK_REF ChunkRef,
+	__in ULONG EntryIndex
+	)
+{
+	PJPTRCRP_CHUNK_CALLS ChunkCalls;
+	ULONG Lower;
+	ULONG Upper;
+
+	ASSERT( Index );
+	ASSERT( ChunkRef );
+
+	if ( ChunkRef->Position >= Index->ChunkCount )
+	{
+		return JPTRCRP_NO_CALL;
+	}
+
+	ChunkCalls = &Index->Chunks[ ChunkRef->Position ];
+	ASSERT( ChunkCalls->ChunkRef == ChunkRef );
+
+	Lower = ChunkCalls->FirstCall;
+	Upper = ChunkCalls->FirstCall + ChunkCalls->CallCount;
+	while ( Lower < Upper )
+	{
+		ULONG Middle = Lower + ( Upper - Lower ) / 2;
+		PJPTRCRP_CALL_NODE Call = &Index->Calls[ Middle ];
+
+		if ( Call->EntryIndex == EntryIndex )
+		{
+			return Middle;
+		}
+		else if ( Call->EntryIndex < EntryIndex )
+		{
+			Lower = Middle + 1;
+		}
+		else
+		{
+			Upper = Middle;
+		}
+	}
+
+	return JPTRCRP_NO_CALL;
+}
+
+static HRESULT JptrcrsDeliverCall(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONG CallIndex,
+	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	JPTRCR_CALL Call;
+	JPTRC_PROCEDURE_TRANSITION32 Entry;
+	JPTRC_PROCEDURE_TRANSITION32 Exit;
+	HRESULT Hr;
+	PJPTRCRP_CALL_NODE Node;
+
+	ASSERT( Reader );
+	ASSERT( Callback );
+
+	Node = &Reader->Index->Calls[ CallIndex ];
+	ASSERT( Node->SubtreeEnd > CallIndex );
+
+	Hr = JptrcrsReadTransition( 
+		Reader, 
+		Node->EntryChunk, 
+		Node->EntryIndex, 
+		&Entry );
+	if ( SUCCEEDED( Hr ) )
+	{
+		Hr = JptrcrsReadTransition( 
+			Reader, 
+			Node->ExitChunk, 
+			Node->ExitIndex, 
+			&Exit );
+	}
+
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	ZeroMemory( &Call, sizeof( JPTRCR_CALL ) );
+
+	//
+	// N.B. The entry transition is significant for 
+	// examining child calls, not the exit transition.
+	//
+	Call.EntryType			= JptrcrNormalEntry;
+
+	Call.CallHandle.Chunk 	= 
+		Reader->Index->Chunks[ Node->EntryChunk ].ChunkRef;
+	Call.CallHandle.Index 	= Node->EntryIndex;
+
+	Call.Procedure			= Entry.Procedure;
+
+	Call.EntryTimestamp		= Entry.Timestamp;
+	Call.ExitTimestamp		= Exit.Timestamp;
+	Call.CallerIp			= Entry.Info.CallerIp;
+
+	Call.ChildCalls			= Node->SubtreeEnd - CallIndex - 1;
+
+	if ( Entry.Procedure != Exit.Procedure )
+	{
+		TRACE( ( L"Missing exit transition\n" ) );
+		
+		//
+		// Exit transition does not match entry transition -
+		// either an exit or an entry transition must have
+		// been lost. We try to avoid larger damage
+		// by introducing 2 synthetic transitions.
+		//
+
+		//
+		// End the call with a synthetic exit.
+		//
+		Call.Result.ReturnValue	= 0;
+		Call.ExitType			= JptrcrSyntheticExit;
+
+		ASSERT( Call.ExitTimestamp >= Call.EntryTimestamp );
+
+		JptrcrsResolveSymbolAndDeliverCallback(
+			Reader->File,
+			&Call,
+			Callback,
+			Context );
+
+		//
+		// Create a synthetic entry for this exit.
+		//
+		Call.EntryType			= JptrcrSyntheticEntry;
+
+		Call.CallHandle.Chunk 	= NULL;
+		Call.CallHandle.Index 	= 0;
+
+		Call.Procedure			= Exit.Procedure;
+
+		Call.EntryTimestamp		= Exit.Timestamp;
+		Call.CallerIp			= 0;
+
+		Call.ChildCalls			= 0;
+
+		//
+		// Continue with exit handling.
+		//
+	}
+
+	if ( Exit.Type == JPTRC_PROCEDURE_TRANSITION_EXIT )
+	{
+		Call.ExitType			= JptrcrNormalExit;
+		Call.Result.ReturnValue = Exit.Info.ReturnValue;
+	}
+	else
+	{
+		ASSERT( Exit.Type == JPTRC_PROCEDURE_TRANSITION_UNWIND );
+
+		Call.ExitType			= JptrcrException;
+		Call.Result.ExceptionCode = Exit.Info.Exception.Code;
+	}
+
+	ASSERT( Call.ExitTimestamp >= Call.EntryTimestamp );
+
+	JptrcrsResolveSymbolAndDeliverCallback(
+		Reader->File,
+		&Call,
+		Callback,
+		Context );
+
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Report a call and all subsequent calls of the same caller.
+--*/
+static HRESULT JptrcrsEnumSiblingCalls(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONG FirstCall,
+	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	ULONG Call;
+	HRESULT Hr;
+
+	ASSERT( Reader );
+	ASSERT( Callback );
+
+	for ( Call = FirstCall; 
+		  Call != JPTRCRP_NO_CALL; 
+		  Call = JptrcrsGetNextSibling( Reader->Index, Call ) )
+	{
+		if ( Reader->Index->Calls[ Call ].SubtreeEnd == 0 )
+		{
+			//
+			// Call has not returned before the end of the trace.
+			//
+			break;
+		}
+
+		Hr = JptrcrsDeliverCall( Reader, Call, Callback, Context );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+	}
+
+	return S_OK;
+}
+
+static VOID JPTRCRCALLTYPE JptrcrsStoreCallRecord(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_READ_CALLS_CONTEXT Context = 
+		( PJPTRCRP_READ_CALLS_CONTEXT ) PvContext;
+	PJPTRCR_CALL_RECORD Record;
+
+	ASSERT( Context );
+
+	if ( Context->Consumed < Context->Skip )
+	{
+		Context->Consumed++;
+		return;
+	}
+	else if ( Context->RecordsRead == Context->MaxRecords )
+	{
+		Context->Dropped++;
+		return;
+	}
+
+	Record = &Context->Records[ Context->RecordsRead++ ];
+	Context->Consumed++;
+
+	EnterCriticalSection( &Context->File->Lock );
+	Record->SymbolId		= JptrcrpGetSymbolId( Context->File, Call->Symbol );
+	LeaveCriticalSection( &Context->File->Lock );
+
+	Record->CallHandle		= Call->CallHandle;
+	Record->Procedure		= Call->Procedure;
+	Record->EntryTimestamp	= Call->EntryTimestamp;
+	Record->ExitTimestamp	= Call->ExitTimestamp;
+	Record->Duration		= Call->Duration;
+	Record->CallerIp		= Call->CallerIp;
+	Record->ChildCalls		= Call->ChildCalls;
+	Record->Result			= Call->Result.ReturnValue;
+	Record->EntryType		= ( USHORT ) Call->EntryType;
+	Record->ExitType		= ( USHORT ) Call->ExitType;
+}
+
+static VOID JptrcrsPositionCursor(
+	__in_opt PJPTRCRP_CALL_INDEX Index,
+	__in ULONG Call,
+	__in ULONG Skip,
+	__out PJPTRCR_CALL_CURSOR Cursor
+	)
+{
+	if ( Call == JPTRCRP_NO_CALL || 
+		 Index->Calls[ Call ].SubtreeEnd == 0 )
+	{
+		//
+		// See JptrcrsEnumSiblingCalls.
+		//
+		Cursor->Chunk	= NULL;
+		Cursor->Index	= 0;
+		Cursor->Flags	= JPTRCRP_CURSOR_FLAG_END;
+	}
+	else
+	{
+		PJPTRCRP_CALL_NODE Node = &Index->Calls[ Call ];
+
+		ASSERT( Skip <= JPTRCRP_CURSOR_SKIP_MASK );
+
+		Cursor->Chunk	= Index->Chunks[ Node->EntryChunk ].ChunkRef;
+		Cursor->Index	= Node->EntryIndex;
+		Cursor->Flags	= Skip;
+	}
+}
+
+/*++
+	Routine Description:
+		Find the index of the first transition with a timestamp 
+		at or after (After == FALSE) or strictly after (After == 
+		TRUE) the given timestamp.
+
+	Return Value:
+		Index, TransitionCount if there is no such transition.
+--*/
+static ULONG JptrcrsSearchTransitions(
+	__in_ecount( TransitionCount ) PJPTRC_PROCEDURE_TRANSITION32 Transitions,
+	__in ULONG TransitionCount,
+	__in ULONGLONG Timestamp,
+	__in BOOL After
+	)
+{
+	ULONG Lower = 0;
+	ULONG Upper = TransitionCount;
+
+	while ( Lower < Upper )
+	{
+		ULONG Middle = Lower + ( Upper - Lower ) / 2;
+
+		if ( Transitions[ Middle ].Timestamp < Timestamp ||
+			 ( After && Transitions[ Middle ].Timestamp == Timestamp ) )
+		{
+			Lower = Middle + 1;
+		}
+		else
+		{
+			Upper = Middle;
+		}
+	}
+
+	return Lower;
+}
+
+/*++
+	Routine Description:
+		Find the innermost call active at a given time, i.e. 
+		entered at or before and not returned before the timestamp.
+
+		The chunk containing the timestamp is located by binary 
+		search, as are the transitions of this chunk surrounding
+		the timestamp and the last call entered by then. If no
+		call has been entered in this chunk by then, the call stack
+		snapshot taken at the chunk boundary is used instead. Calls
+		active at the timestamp are this call and its parents, 
+		save for those whose exit transition precedes the 
+		timestamp.
+
+	Parameters:
+		Call	- Call or JPTRCRP_NO_CALL if no call is active.
+--*/
+static HRESULT JptrcrsFindActiveCall(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONGLONG Timestamp,
+	__out PULONG Call
+	)
+{
+	PJPTRCRP_CHUNK_CALLS ChunkCalls;
+	HRESULT Hr;
+	PJPTRCRP_CALL_INDEX Index = Reader->Index;
+	ULONG Lower = 0;
+	ULONG TransitionCount;
+	PJPTRC_PROCEDURE_TRANSITION32 Transitions;
+	ULONG Upper;
+
+	//
+	// Transitions of the chunk located before ExitEnd precede the
+	// timestamp, those located before EntryEnd occur at or before
+	// the timestamp.
+	//
+	ULONG EntryEnd;
+	ULONG ExitEnd;
+	ULONG Position;
+
+	ASSERT( Index );
+
+	//
+	// Find the first chunk ending at or after the timestamp.
+	//
+	Upper = Index->ChunkCount;
+	while ( Lower < Upper )
+	{
+		ULONG Middle = Lower + ( Upper - Lower ) / 2;
+
+		if ( Index->Chunks[ Middle ].LastTimestamp < Timestamp )
+		{
+			Lower = Middle + 1;
+		}
+		else
+		{
+			Upper = Middle;
+		}
+	}
+
+	if ( Lower == Index->ChunkCount )
+	{
+		//
+		// Beyond the end of the trace - all calls that have 
+		// returned did so before the timestamp.
+		//
+		*Call = Index->PendingCall;
+		return S_OK;
+	}
+
+	Position	= Lower;
+	ChunkCalls	= &Index->Chunks[ Position ];
+
+	Hr = JptrcrsGetReaderTransitions( 
+		Reader, 
+		Position, 
+		&Transitions, 
+		&TransitionCount );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	ExitEnd		= JptrcrsSearchTransitions( 
+		Transitions, 
+		TransitionCount, 
+		Timestamp, 
+		FALSE );
+	EntryEnd	= JptrcrsSearchTransitions( 
+		Transitions, 
+		TransitionCount, 
+		Timestamp, 
+		TRUE );
+
+	//
+	// Find the last call entered at or before the timestamp.
+	//
+	Upper = ChunkCalls->FirstCall + ChunkCalls->CallCount;
+	Lower = ChunkCalls->FirstCall;
+	while ( Lower < Upper )
+	{
+		ULONG Middle = Lower + ( Upper - Lower ) / 2;
+
+		if ( Index->Calls[ Middle ].EntryIndex < EntryEnd )
+		{
+			Lower = Middle + 1;
+		}
+		else
+		{
+			Upper = Middle;
+		}
+	}
+
+	*Call = ( Lower > ChunkCalls->FirstCall )
+		? Lower - 1
+		: ChunkCalls->PendingCall;
+
+	//
+	// N.B. Timestamps are monotonic, so comparing locations of 
+	// transitions is equivalent to comparing their timestamps.
+	//
+	while ( *Call != JPTRCRP_NO_CALL )
+	{
+		PJPTRCRP_CALL_NODE Node = &Index->Calls[ *Call ];
+
+		if ( Node->SubtreeEnd == 0 ||
+			 Node->ExitChunk > Position ||
+			 ( Node->ExitChunk == Position && Node->ExitIndex >= ExitEnd ) )
+		{
+			break;
+		}
+
+		*Call = Node->Parent;
+	}
+
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Report a call that is active at some point in time. As 
+		opposed to JptrcrsDeliverCall, calls that have not returned
+		are reported as well, and a mismatching exit does not yield
+		a second, synthetic call.
+--*/
+static HRESULT JptrcrsDeliverActiveCall(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONG CallIndex,
+	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	JPTRCR_CALL Call;
+	JPTRC_PROCEDURE_TRANSITION32 Entry;
+	JPTRC_PROCEDURE_TRANSITION32 Exit;
+	HRESULT Hr;
+	PJPTRCRP_CALL_INDEX Index = Reader->Index;
+	PJPTRCRP_CALL_NODE Node;
+
+	Node = &Index->Calls[ CallIndex ];
+
+	Hr = JptrcrsReadTransition( 
+		Reader, 
+		Node->EntryChunk, 
+		Node->EntryIndex, 
+		&Entry );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	ZeroMemory( &Call, sizeof( JPTRCR_CALL ) );
+
+	Call.EntryType			= JptrcrNormalEntry;
+
+	Call.CallHandle.Chunk 	= Index->Chunks[ Node->EntryChunk ].ChunkRef;
+	Call.CallHandle.Index 	= Node->EntryIndex;
+
+	Call.Procedure			= Entry.Procedure;
+	Call.EntryTimestamp		= Entry.Timestamp;
+	Call.CallerIp			= Entry.Info.CallerIp;
+
+	if ( Node->SubtreeEnd == 0 )
+	{
+		//
+		// All calls entered later are callees of this call.
+		//
+		Call.ExitType			= JptrcrSyntheticExit;
+		Call.ExitTimestamp		= 0;
+		Call.ChildCalls			= 
+			Index->CallCount - CallIndex - 1;
+	}
+	else
+	{
+		Hr = JptrcrsReadTransition( 
+			Reader, 
+			Node->ExitChunk, 
+			Node->ExitIndex, 
+			&Exit );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+
+		Call.ExitTimestamp		= Exit.Timestamp;
+		Call.ChildCalls			= Node->SubtreeEnd - CallIndex - 1;
+
+		if ( Entry.Procedure != Exit.Procedure )
+		{
+			Call.ExitType			= JptrcrSyntheticExit;
+		}
+		else if ( Exit.Type == JPTRC_PROCEDURE_TRANSITION_EXIT )
+		{
+			Call.ExitType			= JptrcrNormalExit;
+			Call.Result.ReturnValue = Exit.Info.ReturnValue;
+		}
+		else
+		{
+			Call.ExitType			= JptrcrException;
+			Call.Result.ExceptionCode = Exit.Info.Exception.Code;
+		}
+	}
+
+	JptrcrsResolveSymbolAndDeliverCallback(
+		Reader->File,
+		&Call,
+		Callback,
+		Context );
+
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Report all calls active at some point in time, outermost
+		call first.
+
+	Return Value:
+		S_OK, S_FALSE if no call is active, or failure HRESULT.
+--*/
+static HRESULT JptrcrsEnumActiveCalls(
+	__in PJPTRCRP_TRANSITION_READER Reader,
+	__in ULONGLONG Timestamp,
+	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	ULONG Call;
+	ULONG Depth;
+	HRESULT Hr;
+	PJPTRCRP_CALL_INDEX Index = Reader->Index;
+	ULONG Parent;
+	PULONG Stack;
+
+	Hr = JptrcrsFindActiveCall( Reader, Timestamp, &Call );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+	else if ( Call == JPTRCRP_NO_CALL )
+	{
+		return S_FALSE;
+	}
+
+	//
+	// Nodes do not record their depth - count parents first.
+	//
+	Depth = 0;
+	for ( Parent = Call; 
+		  Parent != JPTRCRP_NO_CALL; 
+		  Parent = Index->Calls[ Parent ].Parent )
+	{
+		Depth++;
+	}
+
+	Stack = ( PULONG ) malloc( Depth * sizeof( ULONG ) );
+	if ( Stack == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	Depth = 0;
+	for ( ; Call != JPTRCRP_NO_CALL; Call = Index->Calls[ Call ].Parent )
+	{
+		Stack[ Depth++ ] = Call;
+	}
+
+	while ( Depth > 0 )
+	{
+		Hr = JptrcrsDeliverActiveCall(
+			Reader,
+			Stack[ --Depth ],
+			Callback,
+			Context );
+		if ( FAILED( Hr ) )
+		{
+			break;
+		}
+	}
+
+	free( Stack );
+	return Hr;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Hashtable routines.
+ *
+ */
+ULONG JptrcrpHashClient(
+	__in ULONG_PTR ClientPtr
+	)
+{
+	PJPTRCR_CLIENT Client = ( PJPTRCR_CLIENT ) ( PVOID ) ClientPtr;
+
+	//
+	// Despite the chance of being reused, ThreadId is pretty unique.
+	//
+	return Client->ThreadId;
+}
+
+BOOLEAN JptrcrpEqualsClient(
+	__in ULONG_PTR ClientPtrLhs,
+	__in ULONG_PTR ClientPtrRhs
+	)
+{
+	PJPTRCR_CLIENT ClientLhs = ( PJPTRCR_CLIENT ) ( PVOID ) ClientPtrLhs;
+	PJPTRCR_CLIENT ClientRhs = ( PJPTRCR_CLIENT ) ( PVOID ) ClientPtrRhs;
+	
+	return ( ClientLhs->ThreadId == ClientRhs->ThreadId &&
+			 ClientLhs->ProcessId == ClientRhs->ProcessId ) ? TRUE : FALSE;
+}
+
+VOID JptrcrsRemoveAndDeleteClient(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID Context
+	)
+{
+	PJPTRCRP_CLIENT Client;
+	PJPHT_HASHTABLE_ENTRY RemovedEntry;
+
+	UNREFERENCED_PARAMETER( Context );
+
+	//
+	// Remove this entry from the table.
+	//
+	JphtRemoveEntryHashtable(
+		Hashtable,
+		Entry->Key,
+		&RemovedEntry );
+	ASSERT( RemovedEntry == Entry );
+
+	//
+	// Delete it.
+	//
+	Client = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_CLIENT,
+		u.HashtableEntry );
+	JptrcrpDeleteClient( Client );
+}
+
+static VOID JptrcrsEnumClients(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_CLIENT_ENUM_CONTEXT Context = ( PJPTRCRP_CLIENT_ENUM_CONTEXT ) PvContext;
+	PJPTRCRP_CLIENT Client;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+
+	Client = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_CLIENT,
+		u.HashtableEntry );
+
+	if ( Context )
+	{
+		( Context->Callback )( 
+			&Client->Information, 
+			Context->Context );
+	}
+}
+
+static VOID JptrcrsResetClientUpdates(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID Context
+	)
+{
+	PJPTRCRP_CLIENT Client;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	UNREFERENCED_PARAMETER( Context );
+
+	Client = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_CLIENT,
+		u.HashtableEntry );
+
+	Client->Updates.Reported	= TRUE;
+	Client->Updates.NewChunks	= 0;
+}
+
+static VOID JptrcrsReportClientUpdates(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_CLIENT_UPDATES_CONTEXT Context = 
+		( PJPTRCRP_CLIENT_UPDATES_CONTEXT ) PvContext;
+	PJPTRCRP_CLIENT Client;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	Client = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_CLIENT,
+		u.HashtableEntry );
+
+	if ( Client->Updates.Reported && Client->Updates.NewChunks == 0 )
+	{
+		return;
+	}
+
+	if ( Context->Callback != NULL )
+	{
+		( Context->Callback )( 
+			&Client->Information, 
+			! Client->Updates.Reported,
+			Client->Updates.NewChunks,
+			Context->Context );
+	}
+
+	Context->ClientsReported++;
+
+	Client->Updates.Reported	= TRUE;
+	Client->Updates.NewChunks	= 0;
+}
+
+static HRESULT JptrcrsGetOrCreateClient(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCR_CLIENT Client,
+	__out PJPTRCRP_CLIENT *ClientData
+	)
+{
+	PJPHT_HASHTABLE_ENTRY Entry;
+
+	ASSERT( File );
+	ASSERT( Client );
+	ASSERT( ClientData );
+
+	//
+	// Check if we already know this client.
+	//
+	Entry = JphtGetEntryHashtable(
+		&File->ClientsTable,
+		( ULONG_PTR ) ( PVOID ) Client );
+	if ( Entry == NULL )
+	{
+		PJPHT_HASHTABLE_ENTRY OldEntry;
+		PJPTRCRP_CLIENT NewClient;
+
+		NewClient = ( PJPTRCRP_CLIENT ) malloc( sizeof( JPTRCRP_CLIENT ) );
+		if ( NewClient == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		NewClient->ChunkRefs.FirstBlock	= NULL;
+		NewClient->ChunkRefs.LastBlock	= NULL;
+		NewClient->ChunkRefs.Count		= 0;
+		InitializeListHead( &NewClient->IndexRefListHead );
+		NewClient->CallIndex			= NULL;
+		NewClient->Updates.Reported		= FALSE;
+		NewClient->Updates.NewChunks	= 0;
+		NewClient->Information		= *Client;
+		NewClient->u.Information	= &NewClient->Information;
+
+		//ASSERT( NewClient->Information.ThreadId != 0 );
+
+		JphtPutEntryHashtable(
+			&File->ClientsTable,
+			&NewClient->u.HashtableEntry,
+			&OldEntry );
+		ASSERT( OldEntry == NULL );
+
+		*ClientData = NewClient;
+	}
+	else
+	{
+		*ClientData = CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_CLIENT,
+			u.HashtableEntry );
+	}
+
+	return S_OK;
+}
+
+static HRESULT JptrcrsAddChunkRef(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_CLIENT ClientData,
+	__in ULONGLONG ChunkOffset
+	)
+{
+	PJPTRCRP_CHUNK_REF_BLOCK Block;
+	PJPTRCRP_CHUNK_REF ChunkRef;
+
+	ASSERT( File );
+	ASSERT( ClientData );
+	ASSERT( ChunkOffset > 0 );
+
+	Block = ClientData->ChunkRefs.LastBlock;
+	if ( Block == NULL || Block->Count == Block->Capacity )
+	{
+		PJPTRCRP_CHUNK_REF_BLOCK NewBlock;
+		ULONG Capacity;
+
+		Capacity = ( Block == NULL )
+			? JPTRCRP_INITIAL_CHUNK_REF_BLOCK_CAPACITY
+			: min( 2 * Block->Capacity, 
+				   JPTRCRP_MAXIMUM_CHUNK_REF_BLOCK_CAPACITY );
+
+		NewBlock = ( PJPTRCRP_CHUNK_REF_BLOCK ) JptrcrpAllocateArena(
+			&File->ChunkRefArena,
+			FIELD_OFFSET( JPTRCRP_CHUNK_REF_BLOCK, Refs[ Capacity ] ) );
+		if ( NewBlock == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		NewBlock->Next		= NULL;
+		NewBlock->Count		= 0;
+		NewBlock->Capacity	= Capacity;
+
+		if ( Block == NULL )
+		{
+			ClientData->ChunkRefs.FirstBlock = NewBlock;
+		}
+		else
+		{
+			Block->Next = NewBlock;
+		}
+
+		ClientData->ChunkRefs.LastBlock = NewBlock;
+		Block = NewBlock;
+	}
+
+	ChunkRef = &Block->Refs[ Block->Count++ ];
+
+	ChunkRef->FileOffset	= ChunkOffset;
+	ChunkRef->Client		= ClientData;
+	ChunkRef->Position		= ClientData->ChunkRefs.Count++;
 
 	//
-	// Delete it.
-	//
-	Client = CONTAINING_RECORD(
-		Entry,
-		JPTRCRP_CLIENT,
-		u.HashtableEntry );
-	JptrcrpDeleteClient( Client );
+	// The index does not cover the new chunk, rebuild on next use.
+	// Enumerations in progress keep using the old index.
+	//
+	if ( ClientData->CallIndex != NULL )
+	{
+		JptrcrsReleaseCallIndex( ClientData->CallIndex );
+		ClientData->CallIndex = NULL;
+	}
+
+	return S_OK;
 }
 
-static VOID JptrcrsEnumClients(
+/*++
+	Routine Description:
+		Turn all index refs of a client into chunk refs.
+--*/
+static HRESULT JptrcrsLoadIndexedChunkRefs(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_CLIENT ClientData
+	)
+{
+	HRESULT Hr;
+
+	ASSERT( File );
+	ASSERT( ClientData );
+
+	while ( ! IsListEmpty( &ClientData->IndexRefListHead ) )
+	{
+		PJPTRC_INDEX_CHUNK IndexChunk;
+		PJPTRCRP_INDEX_REF IndexRef;
+		ULONG Index;
+		PULONGLONG Offsets;
+
+		IndexRef = CONTAINING_RECORD(
+			ClientData->IndexRefListHead.Flink,
+			JPTRCRP_INDEX_REF,
+			ListEntry );
+
+		//
+		// N.B. The index chunk has been validated during inventory.
+		//
+		Hr = JptrcrpMap( File, IndexRef->IndexChunkOffset, &IndexChunk );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+
+		ASSERT( IndexChunk->Header.Type == JPTRC_CHUNK_TYPE_INDEX );
+		ASSERT( IndexRef->FirstChunk + IndexRef->ChunkCount <= 
+			IndexChunk->ChunkCount );
+
+		Offsets = JPTRC_INDEX_CHUNK_OFFSETS( IndexChunk ) + IndexRef->FirstChunk;
+		for ( Index = 0; Index < IndexRef->ChunkCount; Index++ )
+		{
+			if ( Offsets[ Index ] < IndexChunk->StartOffset ||
+				 Offsets[ Index ] >= IndexChunk->EndOffset ||
+				 ( Offsets[ Index ] % JPTRC_CHUNK_ALIGNMENT ) != 0 )
+			{
+				return JPTRCR_E_CORRUPT_CHUNK;
+			}
+		}
+
+		//
+		// Remove the index ref before adding chunk refs s.t. chunks
+		// cannot be added twice.
+		//
+		RemoveEntryList( &IndexRef->ListEntry );
+
+		for ( Index = 0; Index < IndexRef->ChunkCount; Index++ )
+		{
+			Hr = JptrcrsAddChunkRef( 
+				File,
+				ClientData, 
+				IndexRef->BaseOffset + Offsets[ Index ] );
+			if ( FAILED( Hr ) )
+			{
+				free( IndexRef );
+				return Hr;
+			}
+		}
+
+		free( IndexRef );
+	}
+
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Make sure all chunk refs of a client are loaded and the
+		call index has been built. Must be called with the file 
+		lock held.
+
+	Parameters:
+		CallIndex	- Referenced index. The reference has to be 
+					  released by JptrcrsReleaseCallIndex, which
+					  may be done without holding the lock.
+--*/
+static HRESULT JptrcrsLoadCallIndex(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_CLIENT ClientData,
+	__out PJPTRCRP_CALL_INDEX *CallIndex
+	)
+{
+	HRESULT Hr;
+
+	ASSERT( File );
+	ASSERT( ClientData );
+	ASSERT( CallIndex );
+
+	*CallIndex = NULL;
+
+	//
+	// If the file has been opened using its index, chunk refs 
+	// may not have been created yet.
+	//
+	Hr = JptrcrsLoadIndexedChunkRefs( File, ClientData );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	if ( ClientData->CallIndex == NULL )
+	{
+		Hr = JptrcrsBuildCallIndex( 
+			File, 
+			ClientData, 
+			&ClientData->CallIndex );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+	}
+
+	JptrcrsReferenceCallIndex( ClientData->CallIndex );
+	*CallIndex = ClientData->CallIndex;
+
+	return S_OK;
+}
+
+static VOID JptrcrsCollectClientChunks(
 	__in PJPHT_HASHTABLE Hashtable,
 	__in PJPHT_HASHTABLE_ENTRY Entry,
 	__in_opt PVOID PvContext
 	)
 {
-	PJPTRCRP_CLIENT_ENUM_CONTEXT Context = ( PJPTRCRP_CLIENT_ENUM_CONTEXT ) PvContext;
+	PJPTRCRP_CLIENT_CHUNKS_CONTEXT Context = 
+		( PJPTRCRP_CLIENT_CHUNKS_CONTEXT ) PvContext;
+	PJPTRCRP_CHUNK_REF_BLOCK Block;
 	PJPTRCRP_CLIENT Client;
 
 	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	if ( FAILED( Context->Hr ) )
+	{
+		return;
+	}
 
 	Client = CONTAINING_RECORD(
 		Entry,
 		JPTRCRP_CLIENT,
 		u.HashtableEntry );
 
-	if ( Context )
+	if ( Context->Clients == NULL )
 	{
-		( Context->Callback )( 
-			&Client->Information, 
-			Context->Context );
+		Context->Hr = JptrcrsLoadIndexedChunkRefs( Context->File, Client );
+		if ( FAILED( Context->Hr ) )
+		{
+			return;
+		}
+
+		Context->ChunkCount += Client->ChunkRefs.Count;
+	}
+	else
+	{
+		PJPTRCRP_CLIENT_CHUNKS ClientChunks = 
+			&Context->Clients[ Context->ClientCount ];
+
+		ClientChunks->Information	= Client->Information;
+		ClientChunks->ChunkCount	= 0;
+		ClientChunks->ChunkOffsets	= Context->NextChunkOffset;
+
+		for ( Block = Client->ChunkRefs.FirstBlock; 
+			  Block != NULL; 
+			  Block = Block->Next )
+		{
+			ULONG Index;
+
+			for ( Index = 0; Index < Block->Count; Index++ )
+			{
+				ClientChunks->ChunkOffsets[ ClientChunks->ChunkCount++ ] =
+					Block->Refs[ Index ].FileOffset;
+			}
+		}
+
+		Context->NextChunkOffset += ClientChunks->ChunkCount;
 	}
+
+	Context->ClientCount++;
 }
 
 /*----------------------------------------------------------------------
@@ -503,72 +1995,251 @@ static VOID JptrcrsEnumClients(
  *
  */
 
+HRESULT JptrcrpReserveTransitionBuffer(
+	__inout PJPTRCRP_TRANSITION_BUFFER Buffer,
+	__in ULONG Count
+	)
+{
+	ULONG NewCapacity;
+	PJPTRC_PROCEDURE_TRANSITION32 NewTransitions;
+
+	ASSERT( Buffer );
+
+	if ( Count <= Buffer->Capacity )
+	{
+		return S_OK;
+	}
+
+	//
+	// Chunks are of similar size - grow generously s.t. the buffer
+	// settles quickly.
+	//
+	NewCapacity = max( Count, 2 * Buffer->Capacity );
+	if ( NewCapacity > ( ( SIZE_T ) -1 ) / sizeof( JPTRC_PROCEDURE_TRANSITION32 ) )
+	{
+		NewCapacity = Count;
+	}
+
+	NewTransitions = ( PJPTRC_PROCEDURE_TRANSITION32 ) malloc(
+		( SIZE_T ) NewCapacity * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+	if ( NewTransitions == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	free( Buffer->Transitions );
+	Buffer->Transitions	= NewTransitions;
+	Buffer->Capacity	= NewCapacity;
+
+	return S_OK;
+}
+
+VOID JptrcrpDeleteTransitionBuffer(
+	__inout PJPTRCRP_TRANSITION_BUFFER Buffer
+	)
+{
+	ASSERT( Buffer );
+
+	free( Buffer->Transitions );
+	Buffer->Transitions	= NULL;
+	Buffer->Capacity	= 0;
+}
+
+HRESULT JptrcrpGetChunkTransitions(
+	__in PJPTRC_CHUNK_HEADER Chunk,
+	__inout PJPTRCRP_TRANSITION_BUFFER Buffer,
+	__out PJPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__out PULONG TransitionCount
+	)
+{
+	ASSERT( Chunk );
+	ASSERT( Buffer );
+	ASSERT( Transitions );
+	ASSERT( TransitionCount );
+
+	if ( Chunk->Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER )
+	{
+		PJPTRC_TRACE_BUFFER_CHUNK32 PlainChunk = 
+			( PJPTRC_TRACE_BUFFER_CHUNK32 ) Chunk;
+
+		ASSERT( ( ( Chunk->Size - FIELD_OFFSET(
+			JPTRC_TRACE_BUFFER_CHUNK32, Transitions ) ) %
+			sizeof( JPTRC_PROCEDURE_TRANSITION32 ) ) == 0 );
+
+		*Transitions		= PlainChunk->Transitions;
+		*TransitionCount	= ( Chunk->Size - FIELD_OFFSET(
+			JPTRC_TRACE_BUFFER_CHUNK32, Transitions ) ) /
+			sizeof( JPTRC_PROCEDURE_TRANSITION32 );
+
+		return S_OK;
+	}
+	else if ( Chunk->Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT )
+	{
+		PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 CompactChunk = 
+			( PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 ) Chunk;
+		HRESULT Hr;
+
+		if ( CompactChunk->TransitionCount == 0 )
+		{
+			*Transitions		= NULL;
+			*TransitionCount	= 0;
+			return S_OK;
+		}
+
+		//
+		// Each transition occupies at least 3 bytes - reject 
+		// implausible counts before allocating.
+		//
+		if ( CompactChunk->TransitionCount > Chunk->Size / 3 )
+		{
+			return JPTRCR_E_CORRUPT_CHUNK;
+		}
+
+		Hr = JptrcrpReserveTransitionBuffer(
+			Buffer,
+			CompactChunk->TransitionCount );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+
+		if ( ! JptrccmpDecodeTransitions(
+			CompactChunk,
+			CompactChunk->TransitionCount,
+			Buffer->Transitions ) )
+		{
+			return JPTRCR_E_CORRUPT_CHUNK;
+		}
+
+		*Transitions		= Buffer->Transitions;
+		*TransitionCount	= CompactChunk->TransitionCount;
+
+		return S_OK;
+	}
+	else
+	{
+		return JPTRCR_E_INVALID_CALL_HANDLE;
+	}
+}
+
 HRESULT JptrcrpRegisterTraceBufferClient(
 	__in PJPTRCRP_FILE File,
 	__in PJPTRCR_CLIENT Client,
 	__in ULONGLONG ChunkOffset
 	)
 {
-	PJPTRCRP_CHUNK_REF ChunkRef;
 	PJPTRCRP_CLIENT ClientData;
-	PJPHT_HASHTABLE_ENTRY Entry;
+	HRESULT Hr;
 
 	ASSERT( File );
 	ASSERT( ChunkOffset > 0 );
 
+	Hr = JptrcrsGetOrCreateClient( File, Client, &ClientData );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
 	//
-	// Check if we already know this client.
+	// Chunk refs must remain in file order. If a preceding part of
+	// a file set has been indexed, resolve its index refs first.
 	//
-	Entry = JphtGetEntryHashtable(
-		&File->ClientsTable,
-		( ULONG_PTR ) ( PVOID ) Client );
-	if ( Entry == NULL )
+	Hr = JptrcrsLoadIndexedChunkRefs( File, ClientData );
+	if ( FAILED( Hr ) )
 	{
-		PJPHT_HASHTABLE_ENTRY OldEntry;
+		return Hr;
+	}
+
+	Hr = JptrcrsAddChunkRef( File, ClientData, ChunkOffset );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	ClientData->Updates.NewChunks++;
+	return S_OK;
+}
+
+HRESULT JptrcrpRegisterTraceBufferChunks(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONG ChunkCount,
+	__in_ecount( ChunkCount ) PULONGLONG ChunkOffsets
+	)
+{
+	PJPTRCRP_CLIENT ClientData;
+	HRESULT Hr;
+	ULONG Index;
+
+	ASSERT( File );
+	ASSERT( ChunkOffsets );
+
+	Hr = JptrcrsGetOrCreateClient( File, Client, &ClientData );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	Hr = JptrcrsLoadIndexedChunkRefs( File, ClientData );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	for ( Index = 0; Index < ChunkCount; Index++ )
+	{
+		ASSERT( ChunkOffsets[ Index ] > 0 );
 
-		ClientData = ( PJPTRCRP_CLIENT ) malloc( sizeof( JPTRCRP_CLIENT ) );
-		if ( ClientData == NULL )
+		Hr = JptrcrsAddChunkRef( File, ClientData, ChunkOffsets[ Index ] );
+		if ( FAILED( Hr ) )
 		{
-			return E_OUTOFMEMORY;
+			return Hr;
 		}
 
-		InitializeListHead( &ClientData->ChunkRefListHead );
-		ClientData->Information		= *Client;
-		ClientData->u.Information	= &ClientData->Information;
+		ClientData->Updates.NewChunks++;
+	}
 
-		//ASSERT( ClientData->Information.ThreadId != 0 );
+	return S_OK;
+}
 
-		JphtPutEntryHashtable(
-			&File->ClientsTable,
-			&ClientData->u.HashtableEntry,
-			&OldEntry );
-		ASSERT( OldEntry == NULL );
-	}
-	else
+HRESULT JptrcrpRegisterIndexedClient(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONGLONG IndexChunkOffset,
+	__in ULONGLONG BaseOffset,
+	__in ULONG FirstChunk,
+	__in ULONG ChunkCount
+	)
+{
+	PJPTRCRP_CLIENT ClientData;
+	HRESULT Hr;
+	PJPTRCRP_INDEX_REF IndexRef;
+
+	ASSERT( File );
+	ASSERT( IndexChunkOffset > 0 );
+	ASSERT( ChunkCount > 0 );
+
+	Hr = JptrcrsGetOrCreateClient( File, Client, &ClientData );
+	if ( FAILED( Hr ) )
 	{
-		ClientData = CONTAINING_RECORD(
-			Entry,
-			JPTRCRP_CLIENT,
-			u.HashtableEntry );
+		return Hr;
 	}
 
-	//
-	// Add chunk ref.
-	//
-	ChunkRef = ( PJPTRCRP_CHUNK_REF) malloc( sizeof( JPTRCRP_CHUNK_REF ) );
-	if ( ChunkRef == NULL )
+	IndexRef = ( PJPTRCRP_INDEX_REF ) malloc( sizeof( JPTRCRP_INDEX_REF ) );
+	if ( IndexRef == NULL )
 	{
 		return E_OUTOFMEMORY;
 	}
 
-	ChunkRef->FileOffset	= ChunkOffset;
-	ChunkRef->Client		= ClientData;
-	InsertTailList( &ClientData->ChunkRefListHead, &ChunkRef->ListEntry );
-
+	IndexRef->IndexChunkOffset	= IndexChunkOffset;
+	IndexRef->BaseOffset		= BaseOffset;
+	IndexRef->FirstChunk		= FirstChunk;
+	IndexRef->ChunkCount		= ChunkCount;
+	InsertTailList( &ClientData->IndexRefListHead, &IndexRef->ListEntry );
+
 	return S_OK;
 }
 
-
 VOID JptrcrpDeleteClient(
 	__in PJPTRCRP_CLIENT Client
 	)
@@ -581,28 +2252,138 @@ VOID JptrcrpDeleteClient(
 		return;
 	}
 
+	if ( Client->CallIndex != NULL )
+	{
+		JptrcrsReleaseCallIndex( Client->CallIndex );
+	}
+
+	//
+	// N.B. Chunk refs are released along with the file's chunk
+	// ref arena.
+	//
+
 	//
-	// Delete all chunk refs.
+	// Delete index refs not turned into chunk refs.
 	//
-	ListEntry = Client->ChunkRefListHead.Flink;
-	while ( ListEntry != &Client->ChunkRefListHead )
+	ListEntry = Client->IndexRefListHead.Flink;
+	while ( ListEntry != &Client->IndexRefListHead )
 	{
-		PJPTRCRP_CHUNK_REF ChunkRef;
-		ChunkRef = CONTAINING_RECORD(
+		PJPTRCRP_INDEX_REF IndexRef;
+		IndexRef = CONTAINING_RECORD(
 			ListEntry,
-			JPTRCRP_CHUNK_REF,
+			JPTRCRP_INDEX_REF,
 			ListEntry );
 
-		ASSERT( ChunkRef->Client == Client );
-
 		ListEntry = ListEntry->Flink;
 
-		free( ChunkRef );
+		free( IndexRef );
 	}
 
 	free( Client );
 }
 
+HRESULT JptrcrpGetClientChunks(
+	__in PJPTRCRP_FILE File,
+	__out PJPTRCRP_CLIENT_CHUNKS *Clients,
+	__out PULONG ClientCount
+	)
+{
+	JPTRCRP_CLIENT_CHUNKS_CONTEXT Context;
+	SIZE_T Size;
+
+	ASSERT( File );
+	ASSERT( Clients );
+	ASSERT( ClientCount );
+
+	*Clients		= NULL;
+	*ClientCount	= 0;
+
+	//
+	// Count clients and chunks first s.t. the snapshot can be 
+	// allocated as a single block.
+	//
+	ZeroMemory( &Context, sizeof( JPTRCRP_CLIENT_CHUNKS_CONTEXT ) );
+	Context.File	= File;
+	Context.Hr		= S_OK;
+
+	JphtEnumerateEntries(
+		&File->ClientsTable,
+		JptrcrsCollectClientChunks,
+		&Context );
+	if ( FAILED( Context.Hr ) )
+	{
+		return Context.Hr;
+	}
+	else if ( Context.ClientCount == 0 )
+	{
+		return S_FALSE;
+	}
+
+	if ( Context.ChunkCount > ( ( SIZE_T ) -1 - 
+			Context.ClientCount * sizeof( JPTRCRP_CLIENT_CHUNKS ) ) /
+			sizeof( ULONGLONG ) )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	Size = Context.ClientCount * sizeof( JPTRCRP_CLIENT_CHUNKS ) +
+		( SIZE_T ) Context.ChunkCount * sizeof( ULONGLONG );
+
+	Context.Clients = ( PJPTRCRP_CLIENT_CHUNKS ) malloc( Size );
+	if ( Context.Clients == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	Context.NextChunkOffset = ( PULONGLONG ) 
+		&Context.Clients[ Context.ClientCount ];
+	Context.ClientCount = 0;
+
+	JphtEnumerateEntries(
+		&File->ClientsTable,
+		JptrcrsCollectClientChunks,
+		&Context );
+
+	*Clients		= Context.Clients;
+	*ClientCount	= Context.ClientCount;
+
+	return S_OK;
+}
+
+VOID JptrcrpResetClientUpdates(
+	__in PJPTRCRP_FILE File
+	)
+{
+	ASSERT( File );
+
+	JphtEnumerateEntries(
+		&File->ClientsTable,
+		JptrcrsResetClientUpdates,
+		NULL );
+}
+
+ULONG JptrcrpReportClientUpdates(
+	__in PJPTRCRP_FILE File,
+	__in_opt JPTRCR_REFRESH_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	JPTRCRP_CLIENT_UPDATES_CONTEXT UpdatesContext;
+
+	ASSERT( File );
+
+	UpdatesContext.Callback			= Callback;
+	UpdatesContext.Context			= Context;
+	UpdatesContext.ClientsReported	= 0;
+
+	JphtEnumerateEntries(
+		&File->ClientsTable,
+		JptrcrsReportClientUpdates,
+		&UpdatesContext );
+
+	return UpdatesContext.ClientsReported;
+}
+
 /*----------------------------------------------------------------------
  *
  * Exports.
@@ -628,11 +2409,15 @@ HRESULT JptrcrEnumClients(
 	EnumContext.Callback	= Callback;
 	EnumContext.Context		= Context;
 
+	EnterCriticalSection( &File->Lock );
+
 	JphtEnumerateEntries(
 		&File->ClientsTable,
 		JptrcrsEnumClients,
 		&EnumContext );
 
+	LeaveCriticalSection( &File->Lock );
+
 	return S_OK;
 }
 
@@ -643,10 +2428,12 @@ HRESULT JptrcrEnumCalls(
 	__in_opt PVOID Context
 	)
 {
+	PJPTRCRP_CALL_INDEX CallIndex = NULL;
 	PJPTRCRP_CLIENT ClientData;
 	PJPHT_HASHTABLE_ENTRY Entry;
 	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
-	JPTRCR_CALL_HANDLE PseudoCallerHandle;
+	HRESULT Hr;
+	JPTRCRP_TRANSITION_READER Reader;
 
 	if ( File == NULL ||
 		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
@@ -656,6 +2443,8 @@ HRESULT JptrcrEnumCalls(
 		return E_INVALIDARG;
 	}
 
+	EnterCriticalSection( &File->Lock );
+
 	//
 	// Get client entry.
 	//
@@ -667,31 +2456,52 @@ HRESULT JptrcrEnumCalls(
 		//
 		// Client unknown - no calls.
 		//
-		return S_FALSE;
+		Hr = S_FALSE;
+	}
+	else
+	{
+		ClientData = CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_CLIENT,
+			u.HashtableEntry );
+
+		Hr = JptrcrsLoadCallIndex( File, ClientData, &CallIndex );
 	}
 
-	ClientData = CONTAINING_RECORD(
-		Entry,
-		JPTRCRP_CLIENT,
-		u.HashtableEntry );
+	LeaveCriticalSection( &File->Lock );
+
+	if ( Hr != S_OK )
+	{
+		goto Cleanup;
+	}
+
+	if ( CallIndex->ChunkCount == 0 )
+	{
+		Hr = S_FALSE;
+		goto Cleanup;
+	}
 
 	//
-	// Now we construct a pseudo CallerHandle that points to
-	// the very beginning of the first chunk of this client.
+	// N.B. The index is not modified any more, so calls are 
+	// enumerated without holding the lock.
 	//
-	PseudoCallerHandle.Index = 0;
-	PseudoCallerHandle.Chunk = CONTAINING_RECORD(
-		ClientData->ChunkRefListHead.Flink,
-		JPTRCRP_CHUNK_REF,
-		ListEntry );
-
-	return JptrcrsEnumCalls(
-		File,
-		&PseudoCallerHandle,
-		FALSE,
-		TRUE,
+	// The first call, if any, is a top level call.
+	//
+	JptrcrsInitializeTransitionReader( File, CallIndex, &Reader );
+	Hr = JptrcrsEnumSiblingCalls(
+		&Reader,
+		CallIndex->CallCount > 0 ? 0 : JPTRCRP_NO_CALL,
 		Callback,
 		Context );
+	JptrcrsDeleteTransitionReader( &Reader );
+
+Cleanup:
+	if ( CallIndex != NULL )
+	{
+		JptrcrsReleaseCallIndex( CallIndex );
+	}
+
+	return Hr;
 }
 
 HRESULT JptrcrEnumChildCalls(
@@ -701,7 +2511,12 @@ HRESULT JptrcrEnumChildCalls(
 	__in_opt PVOID Context
 	)
 {
+	ULONG Caller;
+	PJPTRCRP_CALL_INDEX CallIndex;
+	PJPTRCRP_CHUNK_REF ChunkRef;
 	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+	JPTRCRP_TRANSITION_READER Reader;
 
 	if ( File == NULL ||
 		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
@@ -712,16 +2527,313 @@ HRESULT JptrcrEnumChildCalls(
 		return E_INVALIDARG;
 	}
 
+	ChunkRef = ( PJPTRCRP_CHUNK_REF ) CallerHandle->Chunk;
+
+	EnterCriticalSection( &File->Lock );
+	Hr = JptrcrsLoadCallIndex( File, ChunkRef->Client, &CallIndex );
+	LeaveCriticalSection( &File->Lock );
+
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	Caller = JptrcrsLookupCall( CallIndex, ChunkRef, CallerHandle->Index );
+	if ( Caller == JPTRCRP_NO_CALL )
+	{
+		Hr = JPTRCR_E_INVALID_CALL_HANDLE;
+		goto Cleanup;
+	}
+
 	//
-	// If we passed CallerHandle, the same call would be examined. 
-	// Thus, we have to start at the first callee, which is one
-	// index further.
+	// Jump from callee to callee, skipping their subtrees.
 	//
-	return JptrcrsEnumCalls(
-		File,
-		CallerHandle,
-		TRUE,
-		FALSE,
+	JptrcrsInitializeTransitionReader( File, CallIndex, &Reader );
+	Hr = JptrcrsEnumSiblingCalls(
+		&Reader,
+		JptrcrsGetFirstChild( CallIndex, Caller ),
 		Callback,
 		Context );
-}
\ No newline at end of file
+	JptrcrsDeleteTransitionReader( &Reader );
+
+Cleanup:
+	JptrcrsReleaseCallIndex( CallIndex );
+
+	return Hr;
+}
+
+HRESULT JptrcrInitializeCallCursor(
+	__in JPTRCRHANDLE FileHandle,
+	__in_opt PJPTRCR_CLIENT Client,
+	__in_opt PJPTRCR_CALL_HANDLE CallerHandle,
+	__out PJPTRCR_CALL_CURSOR Cursor
+	)
+{
+	PJPTRCRP_CALL_INDEX CallIndex = NULL;
+	PJPTRCRP_CLIENT ClientData;
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	ULONG FirstCall;
+	HRESULT Hr;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 ( Client == NULL ) == ( CallerHandle == NULL ) ||
+		 ( CallerHandle != NULL && CallerHandle->Chunk == NULL ) ||
+		 Cursor == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnterCriticalSection( &File->Lock );
+
+	if ( Client != NULL )
+	{
+		PJPHT_HASHTABLE_ENTRY Entry;
+
+		Entry = JphtGetEntryHashtable(
+			&File->ClientsTable,
+			( ULONG_PTR ) ( PVOID ) Client );
+		if ( Entry == NULL )
+		{
+			//
+			// Client unknown - no calls.
+			//
+			JptrcrsPositionCursor( NULL, JPTRCRP_NO_CALL, 0, Cursor );
+			Hr = S_FALSE;
+			goto Cleanup;
+		}
+
+		ClientData = CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_CLIENT,
+			u.HashtableEntry );
+
+		Hr = JptrcrsLoadCallIndex( File, ClientData, &CallIndex );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		FirstCall = CallIndex->CallCount > 0 
+			? 0 
+			: JPTRCRP_NO_CALL;
+	}
+	else
+	{
+		ULONG Caller;
+		PJPTRCRP_CHUNK_REF ChunkRef = 
+			( PJPTRCRP_CHUNK_REF ) CallerHandle->Chunk;
+
+		ClientData = ChunkRef->Client;
+
+		Hr = JptrcrsLoadCallIndex( File, ClientData, &CallIndex );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		Caller = JptrcrsLookupCall( CallIndex, ChunkRef, CallerHandle->Index );
+		if ( Caller == JPTRCRP_NO_CALL )
+		{
+			Hr = JPTRCR_E_INVALID_CALL_HANDLE;
+			goto Cleanup;
+		}
+
+		FirstCall = JptrcrsGetFirstChild( CallIndex, Caller );
+	}
+
+	JptrcrsPositionCursor( CallIndex, FirstCall, 0, Cursor );
+
+	Hr = ( Cursor->Flags & JPTRCRP_CURSOR_FLAG_END ) ? S_FALSE : S_OK;
+
+Cleanup:
+	LeaveCriticalSection( &File->Lock );
+
+	if ( CallIndex != NULL )
+	{
+		JptrcrsReleaseCallIndex( CallIndex );
+	}
+
+	return Hr;
+}
+
+HRESULT JptrcrReadCalls(
+	__in JPTRCRHANDLE FileHandle,
+	__inout PJPTRCR_CALL_CURSOR Cursor,
+	__in ULONG MaxRecords,
+	__out_ecount_part( MaxRecords, *RecordsRead ) PJPTRCR_CALL_RECORD Records,
+	__out PULONG RecordsRead
+	)
+{
+	PJPTRCRP_CALL_INDEX CallIndex;
+	PJPTRCRP_CHUNK_REF ChunkRef;
+	JPTRCRP_READ_CALLS_CONTEXT Context;
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+	ULONG Node;
+	JPTRCRP_TRANSITION_READER Reader;
+	ULONG Skip;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 Cursor == NULL ||
+		 MaxRecords == 0 ||
+		 Records == NULL ||
+		 RecordsRead == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	*RecordsRead = 0;
+
+	if ( Cursor->Flags & JPTRCRP_CURSOR_FLAG_END )
+	{
+		return S_FALSE;
+	}
+	else if ( Cursor->Chunk == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	//
+	// The cursor refers to the call by its handle rather than by
+	// node as the index may have been rebuilt in the meantime.
+	//
+	ChunkRef = ( PJPTRCRP_CHUNK_REF ) Cursor->Chunk;
+
+	EnterCriticalSection( &File->Lock );
+	Hr = JptrcrsLoadCallIndex( File, ChunkRef->Client, &CallIndex );
+	LeaveCriticalSection( &File->Lock );
+
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	Node = JptrcrsLookupCall( CallIndex, ChunkRef, Cursor->Index );
+	if ( Node == JPTRCRP_NO_CALL )
+	{
+		Hr = JPTRCR_E_INVALID_CALL_HANDLE;
+		goto Cleanup;
+	}
+
+	Context.File		= File;
+	Context.Records		= Records;
+	Context.MaxRecords	= MaxRecords;
+	Context.RecordsRead	= 0;
+
+	Skip				= Cursor->Flags & JPTRCRP_CURSOR_SKIP_MASK;
+
+	JptrcrsInitializeTransitionReader( File, CallIndex, &Reader );
+
+	while ( Node != JPTRCRP_NO_CALL && 
+			CallIndex->Calls[ Node ].SubtreeEnd != 0 &&
+			Context.RecordsRead < MaxRecords )
+	{
+		Context.Skip		= Skip;
+		Context.Consumed	= 0;
+		Context.Dropped		= 0;
+
+		Hr = JptrcrsDeliverCall( 
+			&Reader, 
+			Node, 
+			JptrcrsStoreCallRecord, 
+			&Context );
+		if ( FAILED( Hr ) )
+		{
+			break;
+		}
+
+		if ( Context.Dropped > 0 )
+		{
+			//
+			// Out of room - resume with the remaining calls of 
+			// this node.
+			//
+			Skip = Context.Consumed;
+			break;
+		}
+
+		Skip = 0;
+		Node = JptrcrsGetNextSibling( CallIndex, Node );
+	}
+
+	JptrcrsDeleteTransitionReader( &Reader );
+
+	if ( FAILED( Hr ) )
+	{
+		goto Cleanup;
+	}
+
+	JptrcrsPositionCursor( CallIndex, Node, Skip, Cursor );
+	*RecordsRead = Context.RecordsRead;
+
+	Hr = ( Cursor->Flags & JPTRCRP_CURSOR_FLAG_END ) ? S_FALSE : S_OK;
+
+Cleanup:
+	JptrcrsReleaseCallIndex( CallIndex );
+
+	return Hr;
+}
+
+HRESULT JptrcrEnumActiveCalls(
+	__in JPTRCRHANDLE FileHandle,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONGLONG Timestamp,
+	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	PJPTRCRP_CALL_INDEX CallIndex = NULL;
+	PJPTRCRP_CLIENT ClientData;
+	PJPHT_HASHTABLE_ENTRY Entry;
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+	JPTRCRP_TRANSITION_READER Reader;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 Client == NULL ||
+		 Callback == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnterCriticalSection( &File->Lock );
+
+	Entry = JphtGetEntryHashtable(
+		&File->ClientsTable,
+		( ULONG_PTR ) ( PVOID ) Client );
+	if ( Entry == NULL )
+	{
+		Hr = S_FALSE;
+	}
+	else
+	{
+		ClientData = CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_CLIENT,
+			u.HashtableEntry );
+
+		Hr = JptrcrsLoadCallIndex( File, ClientData, &CallIndex );
+	}
+
+	LeaveCriticalSection( &File->Lock );
+
+	if ( Hr != S_OK )
+	{
+		goto Cleanup;
+	}
+
+	JptrcrsInitializeTransitionReader( File, CallIndex, &Reader );
+	Hr = JptrcrsEnumActiveCalls( &Reader, Timestamp, Callback, Context );
+	JptrcrsDeleteTransitionReader( &Reader );
+
+Cleanup:
+	if ( CallIndex != NULL )
+	{
+		JptrcrsReleaseCallIndex( CallIndex );
+	}
+
+	return Hr;
+}
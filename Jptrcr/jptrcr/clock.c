@@ -0,0 +1,237 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Timestamp calibration.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#define JPTRCRAPI
+
+#include <jptrcrp.h>
+
+//
+// Minimum span, in 100ns units, between the earliest and latest 
+// calibration point for deriving the frequency from these points.
+//
+#define JPTRCRP_MIN_CALIBRATION_SPAN	10000000
+
+/*----------------------------------------------------------------------
+ *
+ * Private routines.
+ *
+ */
+
+static ULONGLONG JptrcrsScale(
+	__in ULONGLONG Value,
+	__in ULONGLONG Numerator,
+	__in ULONGLONG Denominator
+	)
+{
+	ASSERT( Denominator != 0 );
+
+	return ( Value / Denominator ) * Numerator +
+		( ( Value % Denominator ) * Numerator ) / Denominator;
+}
+
+/*++
+	Routine Description:
+		Determine the frequency to be used for conversions.
+
+	Return Value:
+		Frequency, 0 if unknown.
+--*/
+static ULONGLONG JptrcrsGetFrequency(
+	__in PJPTRCRP_FILE File
+	)
+{
+	ULONGLONG Span;
+
+	if ( File->Clock.Frequency != 0 )
+	{
+		//
+		// Measured by the producer against a high resolution clock,
+		// which is preferable over the system time.
+		//
+		return File->Clock.Frequency;
+	}
+
+	Span = File->Clock.LastSystemTime - File->Clock.FirstSystemTime;
+	if ( File->Clock.CalibrationCount < 2 ||
+		 File->Clock.LastSystemTime < File->Clock.FirstSystemTime ||
+		 Span < JPTRCRP_MIN_CALIBRATION_SPAN ||
+		 File->Clock.LastTimestamp <= File->Clock.FirstTimestamp )
+	{
+		return 0;
+	}
+
+	return JptrcrsScale(
+		File->Clock.LastTimestamp - File->Clock.FirstTimestamp,
+		10000000,
+		Span );
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Internal routines.
+ *
+ */
+
+HRESULT JptrcrpLoadCalibration(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRC_CALIBRATION_CHUNK Chunk
+	)
+{
+	ULONG Index;
+	LONGLONG MinOffset;
+	LONGLONG MaxOffset;
+
+	ASSERT( File );
+	ASSERT( Chunk );
+
+	if ( Chunk->Header.Size < FIELD_OFFSET( JPTRC_CALIBRATION_CHUNK, ProcessorOffsets ) ||
+		 Chunk->Reserved != 0 ||
+		 Chunk->ProcessorCount > 
+			( Chunk->Header.Size - FIELD_OFFSET( JPTRC_CALIBRATION_CHUNK, ProcessorOffsets ) ) / 
+				sizeof( LONGLONG ) )
+	{
+		return JPTRCR_E_CORRUPT_CHUNK;
+	}
+
+	if ( File->Clock.CalibrationCount == 0 ||
+		 Chunk->Timestamp < File->Clock.FirstTimestamp )
+	{
+		File->Clock.FirstTimestamp	= Chunk->Timestamp;
+		File->Clock.FirstSystemTime	= Chunk->SystemTime;
+	}
+
+	if ( File->Clock.CalibrationCount == 0 ||
+		 Chunk->Timestamp > File->Clock.LastTimestamp )
+	{
+		File->Clock.LastTimestamp	= Chunk->Timestamp;
+		File->Clock.LastSystemTime	= Chunk->SystemTime;
+	}
+
+	if ( Chunk->Frequency != 0 &&
+		 ( File->Clock.Frequency == 0 ||
+		   Chunk->Timestamp >= File->Clock.FrequencyTimestamp ) )
+	{
+		File->Clock.Frequency			= Chunk->Frequency;
+		File->Clock.FrequencyTimestamp	= Chunk->Timestamp;
+	}
+
+	if ( Chunk->ProcessorCount > 0 )
+	{
+		MinOffset = MaxOffset = Chunk->ProcessorOffsets[ 0 ];
+		for ( Index = 1; Index < Chunk->ProcessorCount; Index++ )
+		{
+			MinOffset = min( MinOffset, Chunk->ProcessorOffsets[ Index ] );
+			MaxOffset = max( MaxOffset, Chunk->ProcessorOffsets[ Index ] );
+		}
+
+		File->Clock.MaximumProcessorSkew = max( 
+			File->Clock.MaximumProcessorSkew,
+			( ULONGLONG ) ( MaxOffset - MinOffset ) );
+	}
+
+	File->Clock.CalibrationCount++;
+
+	return S_OK;
+}
+
+ULONGLONG JptrcrpTicksToNanoseconds(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG Ticks
+	)
+{
+	ULONGLONG Frequency = JptrcrsGetFrequency( File );
+
+	if ( Frequency == 0 )
+	{
+		return 0;
+	}
+
+	return JptrcrsScale( Ticks, 1000000000, Frequency );
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Exports.
+ *
+ */
+
+HRESULT JptrcrGetClockInfo(
+	__in JPTRCRHANDLE FileHandle,
+	__out PJPTRCR_CLOCK_INFO ClockInfo
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+	ULARGE_INTEGER SystemTime;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 ClockInfo == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	//
+	// Calibration information may be extended by JptrcrRefreshFile.
+	//
+	EnterCriticalSection( &File->Lock );
+
+	ClockInfo->Frequency = JptrcrsGetFrequency( File );
+	if ( ClockInfo->Frequency == 0 )
+	{
+		Hr = JPTRCR_E_NO_CALIBRATION;
+		goto Cleanup;
+	}
+
+	SystemTime.QuadPart = File->Clock.FirstSystemTime;
+
+	ClockInfo->Timestamp					= File->Clock.FirstTimestamp;
+	ClockInfo->SystemTime.dwLowDateTime		= SystemTime.LowPart;
+	ClockInfo->SystemTime.dwHighDateTime	= SystemTime.HighPart;
+	ClockInfo->MaximumProcessorSkew			= File->Clock.MaximumProcessorSkew;
+
+	Hr = S_OK;
+
+Cleanup:
+	LeaveCriticalSection( &File->Lock );
+
+	return Hr;
+}
+
+HRESULT JptrcrTicksToNanoseconds(
+	__in JPTRCRHANDLE FileHandle,
+	__in ULONGLONG Ticks,
+	__out PULONGLONG Nanoseconds
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 Nanoseconds == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnterCriticalSection( &File->Lock );
+
+	if ( JptrcrsGetFrequency( File ) == 0 )
+	{
+		Hr = JPTRCR_E_NO_CALIBRATION;
+	}
+	else
+	{
+		*Nanoseconds = JptrcrpTicksToNanoseconds( File, Ticks );
+		Hr = S_OK;
+	}
+
+	LeaveCriticalSection( &File->Lock );
+
+	return Hr;
+}
@@ -0,0 +1,694 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Parallel inventory of files.
+ *
+ *		As chunks must not straddle segment boundaries, each segment
+ *		boundary is also a chunk boundary. The file is thus split into
+ *		tasks of several segments which are scanned by a pool of
+ *		worker threads. Workers only collect chunk offsets - loading
+ *		images and symbols as well as registering trace buffers is
+ *		performed afterwards on the calling thread, task by task,
+ *		s.t. file order is retained.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#define JPTRCRAPI
+
+#include <stdlib.h>
+#include <jptrcrp.h>
+
+#define JPTRCRP_SEGMENTS_PER_SCAN_TASK	16
+#define JPTRCRP_MAX_SCAN_THREADS		16
+
+/*++
+	Structure Description:
+		Trace buffer chunks of a single client found by a task.
+--*/
+typedef struct _JPTRCRP_SCAN_CLIENT
+{
+	union
+	{
+		//
+		// Backpointer to JPTRCRP_SCAN_CLIENT::Information.
+		//
+		PJPTRCR_CLIENT Information;
+		JPHT_HASHTABLE_ENTRY HashtableEntry;
+	} u;
+
+	JPTRCR_CLIENT Information;
+
+	//
+	// Logical offsets, in file order.
+	//
+	ULONG ChunkCount;
+	ULONG Capacity;
+	PULONGLONG ChunkOffsets;
+} JPTRCRP_SCAN_CLIENT, *PJPTRCRP_SCAN_CLIENT;
+
+/*++
+	Structure Description:
+		Chunk that has to be loaded by the calling thread, i.e.
+		an image info, symbol table or calibration chunk.
+--*/
+typedef struct _JPTRCRP_SCAN_METADATA
+{
+	ULONGLONG Offset;
+	ULONG Size;
+} JPTRCRP_SCAN_METADATA, *PJPTRCRP_SCAN_METADATA;
+
+typedef struct _JPTRCRP_SCAN_TASK
+{
+	//
+	// Logical range, StartOffset is segment-aligned.
+	//
+	ULONGLONG StartOffset;
+	ULONGLONG EndOffset;
+
+	//
+	// Set for the last task of a file that may still be written to -
+	// an incomplete trailing chunk then ends the task rather than
+	// failing it. ScannedEnd receives the offset of that chunk.
+	//
+	BOOL AllowIncomplete;
+	ULONGLONG ScannedEnd;
+
+	HRESULT Result;
+
+	//
+	// Metadata chunks, in file order.
+	//
+	ULONG MetadataCount;
+	ULONG MetadataCapacity;
+	PJPTRCRP_SCAN_METADATA Metadata;
+
+	//
+	// Table of JPTRCRP_SCAN_CLIENT, indexed by JPTRCR_CLIENT*.
+	//
+	JPHT_HASHTABLE ClientsTable;
+} JPTRCRP_SCAN_TASK, *PJPTRCRP_SCAN_TASK;
+
+typedef struct _JPTRCRP_SCAN
+{
+	PJPTRCRP_FILE_PART Part;
+
+	ULONG TaskCount;
+	PJPTRCRP_SCAN_TASK Tasks;
+
+	//
+	// Index of the next task to be picked up.
+	//
+	volatile LONG NextTask;
+
+	//
+	// Set when a task has failed - remaining tasks are skipped.
+	//
+	volatile LONG Failed;
+} JPTRCRP_SCAN, *PJPTRCRP_SCAN;
+
+typedef struct _JPTRCRP_REGISTER_CONTEXT
+{
+	PJPTRCRP_FILE File;
+	HRESULT Hr;
+} JPTRCRP_REGISTER_CONTEXT, *PJPTRCRP_REGISTER_CONTEXT;
+
+/*----------------------------------------------------------------------
+ *
+ * Private routines.
+ *
+ */
+
+/*++
+	Routine Description:
+		Make room for at least one more element in a growable array.
+--*/
+static HRESULT JptrcrsGrowArray(
+	__inout PVOID *Array,
+	__inout PULONG Capacity,
+	__in ULONG Count,
+	__in SIZE_T ElementSize
+	)
+{
+	PVOID NewArray;
+	ULONG NewCapacity;
+
+	if ( Count < *Capacity )
+	{
+		return S_OK;
+	}
+
+	NewCapacity = *Capacity == 0 ? 16 : *Capacity * 2;
+	if ( NewCapacity <= *Capacity ||
+		 NewCapacity > ( ( SIZE_T ) -1 ) / ElementSize )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	NewArray = realloc( *Array, NewCapacity * ElementSize );
+	if ( NewArray == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	*Array		= NewArray;
+	*Capacity	= NewCapacity;
+	return S_OK;
+}
+
+static HRESULT JptrcrsAddScanMetadata(
+	__in PJPTRCRP_SCAN_TASK Task,
+	__in ULONGLONG Offset,
+	__in ULONG Size
+	)
+{
+	HRESULT Hr;
+
+	Hr = JptrcrsGrowArray(
+		( PVOID* ) &Task->Metadata,
+		&Task->MetadataCapacity,
+		Task->MetadataCount,
+		sizeof( JPTRCRP_SCAN_METADATA ) );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	Task->Metadata[ Task->MetadataCount ].Offset	= Offset;
+	Task->Metadata[ Task->MetadataCount ].Size		= Size;
+	Task->MetadataCount++;
+
+	return S_OK;
+}
+
+static HRESULT JptrcrsAddScanChunk(
+	__in PJPTRCRP_SCAN_TASK Task,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONGLONG Offset
+	)
+{
+	PJPHT_HASHTABLE_ENTRY Entry;
+	HRESULT Hr;
+	PJPTRCRP_SCAN_CLIENT ScanClient;
+
+	Entry = JphtGetEntryHashtable(
+		&Task->ClientsTable,
+		( ULONG_PTR ) ( PVOID ) Client );
+	if ( Entry == NULL )
+	{
+		PJPHT_HASHTABLE_ENTRY OldEntry;
+
+		ScanClient = ( PJPTRCRP_SCAN_CLIENT ) malloc(
+			sizeof( JPTRCRP_SCAN_CLIENT ) );
+		if ( ScanClient == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		ScanClient->Information		= *Client;
+		ScanClient->u.Information	= &ScanClient->Information;
+		ScanClient->ChunkCount		= 0;
+		ScanClient->Capacity		= 0;
+		ScanClient->ChunkOffsets	= NULL;
+
+		JphtPutEntryHashtable(
+			&Task->ClientsTable,
+			&ScanClient->u.HashtableEntry,
+			&OldEntry );
+		ASSERT( OldEntry == NULL );
+	}
+	else
+	{
+		ScanClient = CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_SCAN_CLIENT,
+			u.HashtableEntry );
+	}
+
+	Hr = JptrcrsGrowArray(
+		( PVOID* ) &ScanClient->ChunkOffsets,
+		&ScanClient->Capacity,
+		ScanClient->ChunkCount,
+		sizeof( ULONGLONG ) );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	ScanClient->ChunkOffsets[ ScanClient->ChunkCount++ ] = Offset;
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Scan the chunks of a task. Performs the same checks as
+		JptrcrpScanChunks and additionally requires chunks not to
+		straddle segment boundaries.
+
+		Called on a worker thread - the file structure must not be
+		touched.
+--*/
+static HRESULT JptrcrsScanTask(
+	__in PJPTRCRP_FILE_PART Part,
+	__in PJPTRCRP_SCAN_TASK Task
+	)
+{
+	PUCHAR Base;
+	HRESULT Hr;
+	LARGE_INTEGER Li;
+	ULONG Position;
+	ULONG Size;
+
+	ASSERT( Task->EndOffset - Task->StartOffset <=
+		JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_PER_SCAN_TASK );
+	ASSERT( ( ( Task->StartOffset - Part->BaseOffset ) %
+		JPTRC_SEGMENT_SIZE ) == 0 );
+
+	Size = ( ULONG ) ( Task->EndOffset - Task->StartOffset );
+
+	//
+	// Map the task's range in its entirety. As the offset is
+	// segment-aligned, it is also aligned to the allocation
+	// granularity.
+	//
+	Li.QuadPart = Task->StartOffset - Part->BaseOffset;
+	Base = ( PUCHAR ) MapViewOfFile(
+		Part->Mapping,
+		FILE_MAP_READ,
+		Li.HighPart,
+		Li.LowPart,
+		Size );
+	if ( Base == NULL )
+	{
+		return HRESULT_FROM_WIN32( GetLastError() );
+	}
+
+	Position = ( Task->StartOffset == Part->BaseOffset )
+		? sizeof( JPTRC_FILE_HEADER )
+		: 0;
+
+	Hr = S_OK;
+	while ( Position < Size )
+	{
+		PJPTRC_CHUNK_HEADER Chunk = ( PJPTRC_CHUNK_HEADER ) ( Base + Position );
+		ULONGLONG Offset = Task->StartOffset + Position;
+
+		Task->ScannedEnd = Offset;
+
+		if ( Size - Position < sizeof( JPTRC_CHUNK_HEADER ) )
+		{
+			Hr = JPTRCR_E_TRUNCATED_CHUNK;
+			break;
+		}
+		else if ( Chunk->Reserved != 0 )
+		{
+			Hr = JPTRCR_E_RESERVED_FIELDS_USED;
+			break;
+		}
+		else if ( Chunk->Size < sizeof( JPTRC_CHUNK_HEADER ) ||
+				  Chunk->Size > Size - Position )
+		{
+			Hr = JPTRCR_E_TRUNCATED_CHUNK;
+			break;
+		}
+		else if ( Chunk->Size > JPTRC_SEGMENT_SIZE -
+				( Position % JPTRC_SEGMENT_SIZE ) )
+		{
+			Hr = JPTRCR_E_CHUNK_STRADDLES_SEGMENT;
+			break;
+		}
+
+		switch ( Chunk->Type )
+		{
+		case JPTRC_CHUNK_TYPE_PAD:
+		case JPTRC_CHUNK_TYPE_INDEX:
+		case JPTRC_CHUNK_TYPE_INDEX_TRAILER:
+		case JPTRC_CHUNK_TYPE_CIRCULAR_HEADER:
+		case JPTRC_CHUNK_TYPE_SEGMENT_HEADER:
+		case JPTRC_CHUNK_TYPE_CONTINUATION:
+			//
+			// See JptrcrpScanChunks.
+			//
+			break;
+
+		case JPTRC_CHUNK_TYPE_IMAGE_INFO:
+		case JPTRC_CHUNK_TYPE_CALIBRATION:
+		case JPTRC_CHUNK_TYPE_SYMBOL_TABLE:
+			Hr = JptrcrsAddScanMetadata( Task, Offset, Chunk->Size );
+			break;
+
+		case JPTRC_CHUNK_TYPE_TRACE_BUFFER:
+		case JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT:
+			if ( Chunk->Size < FIELD_OFFSET(
+				JPTRC_TRACE_BUFFER_CHUNK32,
+				Transitions ) )
+			{
+				Hr = JPTRCR_E_TRUNCATED_CHUNK;
+			}
+			else
+			{
+				PJPTRC_TRACE_BUFFER_CHUNK32 TraceChunk =
+					( PJPTRC_TRACE_BUFFER_CHUNK32 ) Chunk;
+				JPTRCR_CLIENT Client;
+
+				Client.ProcessId	= TraceChunk->Client.ProcessId;
+				Client.ThreadId		= TraceChunk->Client.ThreadId;
+
+				Hr = JptrcrsAddScanChunk( Task, &Client, Offset );
+			}
+			break;
+
+		default:
+			Hr = JPTRCR_E_UNRECOGNIZED_CHUNK_TYPE;
+			break;
+		}
+
+		if ( FAILED( Hr ) )
+		{
+			break;
+		}
+
+		Position += Chunk->Size;
+	}
+
+	if ( SUCCEEDED( Hr ) )
+	{
+		Task->ScannedEnd = Task->EndOffset;
+	}
+	else if ( Hr == JPTRCR_E_TRUNCATED_CHUNK && Task->AllowIncomplete )
+	{
+		//
+		// The chunk at ScannedEnd is still being written.
+		//
+		Hr = S_OK;
+	}
+
+	VERIFY( UnmapViewOfFile( Base ) );
+	return Hr;
+}
+
+static DWORD CALLBACK JptrcrsScanWorker(
+	__in PVOID PvScan
+	)
+{
+	PJPTRCRP_SCAN Scan = ( PJPTRCRP_SCAN ) PvScan;
+
+	for ( ;; )
+	{
+		LONG Index;
+		PJPTRCRP_SCAN_TASK Task;
+
+		if ( Scan->Failed )
+		{
+			break;
+		}
+
+		Index = InterlockedIncrement( &Scan->NextTask ) - 1;
+		if ( Index >= ( LONG ) Scan->TaskCount )
+		{
+			break;
+		}
+
+		Task = &Scan->Tasks[ Index ];
+		Task->Result = JptrcrsScanTask( Scan->Part, Task );
+		if ( FAILED( Task->Result ) )
+		{
+			InterlockedExchange( &Scan->Failed, TRUE );
+		}
+	}
+
+	return 0;
+}
+
+static VOID JptrcrsRemoveAndDeleteScanClient(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID Context
+	)
+{
+	PJPTRCRP_SCAN_CLIENT ScanClient;
+	PJPHT_HASHTABLE_ENTRY RemovedEntry;
+
+	UNREFERENCED_PARAMETER( Context );
+
+	JphtRemoveEntryHashtable(
+		Hashtable,
+		Entry->Key,
+		&RemovedEntry );
+	ASSERT( RemovedEntry == Entry );
+
+	ScanClient = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_SCAN_CLIENT,
+		u.HashtableEntry );
+
+	free( ScanClient->ChunkOffsets );
+	free( ScanClient );
+}
+
+static VOID JptrcrsRegisterScanClient(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_REGISTER_CONTEXT Context = ( PJPTRCRP_REGISTER_CONTEXT ) PvContext;
+	PJPTRCRP_SCAN_CLIENT ScanClient;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	if ( FAILED( Context->Hr ) )
+	{
+		return;
+	}
+
+	ScanClient = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_SCAN_CLIENT,
+		u.HashtableEntry );
+
+	Context->Hr = JptrcrpRegisterTraceBufferChunks(
+		Context->File,
+		&ScanClient->Information,
+		ScanClient->ChunkCount,
+		ScanClient->ChunkOffsets );
+}
+
+/*++
+	Routine Description:
+		Load the metadata chunks and register the trace buffer
+		chunks found by a task.
+--*/
+static HRESULT JptrcrsMergeScanTask(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_SCAN_TASK Task
+	)
+{
+	JPTRCRP_REGISTER_CONTEXT Context;
+	HRESULT Hr;
+	ULONG Index;
+
+	//
+	// Load images etc. first - trace buffers may refer to them.
+	//
+	for ( Index = 0; Index < Task->MetadataCount; Index++ )
+	{
+		Hr = JptrcrpScanChunks(
+			File,
+			Task->Metadata[ Index ].Offset,
+			Task->Metadata[ Index ].Offset + Task->Metadata[ Index ].Size,
+			NULL );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+	}
+
+	//
+	// Chunks of each client are in file order, and tasks are merged
+	// in file order - thus chunk refs end up in file order.
+	//
+	Context.File	= File;
+	Context.Hr		= S_OK;
+
+	JphtEnumerateEntries(
+		&Task->ClientsTable,
+		JptrcrsRegisterScanClient,
+		&Context );
+
+	return Context.Hr;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Internal routines.
+ *
+ */
+
+HRESULT JptrcrpPerformParallelInventory(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__out_opt PULONGLONG ScannedEnd
+	)
+{
+	HRESULT Hr;
+	ULONG Index;
+	ULONG InitializedTasks = 0;
+	JPTRCRP_SCAN Scan;
+	ULONGLONG SegmentCount;
+	SYSTEM_INFO SystemInfo;
+	ULONG ThreadCount;
+	ULONG Thread;
+	HANDLE Threads[ JPTRCRP_MAX_SCAN_THREADS - 1 ];
+	ULONG WorkerCount = 0;
+
+	ASSERT( File );
+	ASSERT( Part );
+
+	GetSystemInfo( &SystemInfo );
+
+	SegmentCount = ( Part->Size + JPTRC_SEGMENT_SIZE - 1 ) / JPTRC_SEGMENT_SIZE;
+	if ( SegmentCount / JPTRCRP_SEGMENTS_PER_SCAN_TASK >= MAXLONG )
+	{
+		return S_FALSE;
+	}
+
+	ZeroMemory( &Scan, sizeof( JPTRCRP_SCAN ) );
+	Scan.Part		= Part;
+	Scan.TaskCount	= ( ULONG ) ( ( SegmentCount +
+		JPTRCRP_SEGMENTS_PER_SCAN_TASK - 1 ) / JPTRCRP_SEGMENTS_PER_SCAN_TASK );
+
+	ThreadCount = min(
+		min( SystemInfo.dwNumberOfProcessors, Scan.TaskCount ),
+		JPTRCRP_MAX_SCAN_THREADS );
+	if ( ThreadCount < 2 )
+	{
+		//
+		// Not worth it.
+		//
+		return S_FALSE;
+	}
+
+	Scan.Tasks = ( PJPTRCRP_SCAN_TASK ) malloc(
+		Scan.TaskCount * sizeof( JPTRCRP_SCAN_TASK ) );
+	if ( Scan.Tasks == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	ZeroMemory( Scan.Tasks, Scan.TaskCount * sizeof( JPTRCRP_SCAN_TASK ) );
+
+	for ( Index = 0; Index < Scan.TaskCount; Index++ )
+	{
+		PJPTRCRP_SCAN_TASK Task = &Scan.Tasks[ Index ];
+
+		Task->StartOffset	= Part->BaseOffset + ( ULONGLONG ) Index *
+			JPTRCRP_SEGMENTS_PER_SCAN_TASK * JPTRC_SEGMENT_SIZE;
+		Task->EndOffset		= min(
+			Task->StartOffset +
+				JPTRCRP_SEGMENTS_PER_SCAN_TASK * JPTRC_SEGMENT_SIZE,
+			Part->BaseOffset + Part->Size );
+
+		if ( ! JphtInitializeHashtable(
+			&Task->ClientsTable,
+			JptrcrpAllocateHashtableMemory,
+			JptrcrpFreeHashtableMemory,
+			JptrcrpHashClient,
+			JptrcrpEqualsClient,
+			63 ) )
+		{
+			Hr = E_OUTOFMEMORY;
+			goto Cleanup;
+		}
+
+		InitializedTasks++;
+	}
+
+	Scan.Tasks[ Scan.TaskCount - 1 ].AllowIncomplete = ( ScannedEnd != NULL );
+
+	//
+	// The calling thread participates, so start one thread less.
+	//
+	for ( Thread = 0; Thread < ThreadCount - 1; Thread++ )
+	{
+		Threads[ WorkerCount ] = CreateThread(
+			NULL,
+			0,
+			JptrcrsScanWorker,
+			&Scan,
+			0,
+			NULL );
+		if ( Threads[ WorkerCount ] == NULL )
+		{
+			//
+			// Make do with fewer threads.
+			//
+			break;
+		}
+
+		WorkerCount++;
+	}
+
+	( VOID ) JptrcrsScanWorker( &Scan );
+
+	if ( WorkerCount > 0 )
+	{
+		VERIFY( WAIT_OBJECT_0 == WaitForMultipleObjects(
+			WorkerCount,
+			Threads,
+			TRUE,
+			INFINITE ) );
+
+		for ( Thread = 0; Thread < WorkerCount; Thread++ )
+		{
+			VERIFY( CloseHandle( Threads[ Thread ] ) );
+		}
+	}
+
+	if ( Scan.Failed )
+	{
+		//
+		// The file may violate the segment constraint or be damaged.
+		// Leave it to the sequential scan to either cope with the
+		// file or to report the first error in file order.
+		//
+		TRACE( ( L"Parallel inventory failed\n" ) );
+		Hr = S_FALSE;
+		goto Cleanup;
+	}
+
+	for ( Index = 0; Index < Scan.TaskCount; Index++ )
+	{
+		Hr = JptrcrsMergeScanTask( File, &Scan.Tasks[ Index ] );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+	}
+
+	if ( ScannedEnd != NULL )
+	{
+		*ScannedEnd = Scan.Tasks[ Scan.TaskCount - 1 ].ScannedEnd;
+	}
+
+	Hr = S_OK;
+
+Cleanup:
+	for ( Index = 0; Index < InitializedTasks; Index++ )
+	{
+		PJPTRCRP_SCAN_TASK Task = &Scan.Tasks[ Index ];
+
+		JphtEnumerateEntries(
+			&Task->ClientsTable,
+			JptrcrsRemoveAndDeleteScanClient,
+			NULL );
+		JphtDeleteHashtable( &Task->ClientsTable );
+
+		free( Task->Metadata );
+	}
+
+	free( Scan.Tasks );
+
+	return Hr;
+}
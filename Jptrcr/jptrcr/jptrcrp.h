@@ -30,10 +30,59 @@ typedef struct _ANSI_STRING
 
 #define JPTRCRP_FILE_SIGNATURE 'crtJ'
 
+/*++
+	Structure Description:
+		Arena for allocations that share the same lifetime. There
+		is no way to free individual allocations - all memory is
+		released at once by JptrcrpDeleteArena.
+--*/
+typedef struct _JPTRCRP_ARENA
+{
+	struct _JPTRCRP_ARENA_BLOCK *CurrentBlock;
+} JPTRCRP_ARENA, *PJPTRCRP_ARENA;
+
+/*++
+	Structure Description:
+		A single file. When a set of rotated files is opened, the
+		files are concatenated to a single logical file: each part
+		occupies the range [BaseOffset, BaseOffset + Size). All
+		offsets used outside of open.c are logical offsets.
+--*/
+typedef struct _JPTRCRP_FILE_PART
+{
+	HANDLE Handle;
+	HANDLE Mapping;
+	ULONGLONG Size;
+
+	//
+	// Logical offset of the first byte of the file. Parts are
+	// aligned s.t. a mapping never spans multiple parts.
+	//
+	ULONGLONG BaseOffset;
+
+	//
+	// Position within the set, only used while opening a set.
+	//
+	ULONG SequenceNumber;
+} JPTRCRP_FILE_PART, *PJPTRCRP_FILE_PART;
+
 typedef struct _JPTRCRP_FILE
 {
 	ULONG Signature;
 
+	//
+	// Lock guarding all state that is built lazily or changed after
+	// the file has been opened, i.e. the mapping cache, call indexes,
+	// the symbol cache and everything touched by JptrcrRefreshFile.
+	// Acquired by all exports operating on the file, callbacks are 
+	// invoked with the lock held - except for calls, which are 
+	// enumerated from an immutable call index, see client.c.
+	//
+	// Important: If both this lock and JptrcrpDbghelpLock are 
+	// required, this lock has to be acquired first!
+	//
+	CRITICAL_SECTION Lock;
+
 	//
 	// Table of JPTRCRP_LOADED_MODULE, indexed by ULONG_PTR LoadAddress.
 	//
@@ -44,31 +93,119 @@ typedef struct _JPTRCRP_FILE
 	//
 	JPHT_HASHTABLE ClientsTable;
 
+	//
+	// Backs the chunk refs of all clients. Released when the file
+	// is closed.
+	//
+	JPTRCRP_ARENA ChunkRefArena;
+
+	//
+	// Table of JPTRCRP_CACHED_SYMBOL, indexed by ULONGLONG procedure
+	// VA. Populated from symbol table chunks and, on first use of 
+	// a procedure, from dbghelp.
+	//
+	JPHT_HASHTABLE SymbolsTable;
+
+	//
+	// JPTRCRP_CACHED_SYMBOLs that have been assigned an ID, indexed
+	// by ID - 1. See JptrcrpGetSymbolId.
+	//
 	struct
 	{
-		HANDLE Handle;
-		HANDLE Mapping;
-		ULONGLONG Size;
-	} File;
+		struct _JPTRCRP_CACHED_SYMBOL **Entries;
+		ULONG Count;
+		ULONG Capacity;
+	} SymbolIds;
+
+	//
+	// JPTRCRP_CACHED_SYMBOLs that have been superseded by a later
+	// symbol table chunk after having been handed out. Kept alive
+	// until the file is closed.
+	//
+	struct _JPTRCRP_CACHED_SYMBOL *RetiredSymbols;
 
 	//
 	// Pseudo-process handle used for dbghelp.
 	//
 	HANDLE SymHandle;
 
+	//
+	// Calibration information gathered from calibration chunks,
+	// see clock.c.
+	//
 	struct
 	{
-		ULONGLONG Offset;
-		PVOID MappedAddress;
+		ULONG CalibrationCount;
 
-		ULONGLONG MapIndex;
-	} CurrentMapping;
+		//
+		// Frequency measured last, i.e. the one of the chunk with
+		// the highest timestamp, 0 if none.
+		//
+		ULONGLONG Frequency;
+		ULONGLONG FrequencyTimestamp;
+
+		//
+		// Earliest and latest calibration point.
+		//
+		ULONGLONG FirstTimestamp;
+		ULONGLONG FirstSystemTime;
+		ULONGLONG LastTimestamp;
+		ULONGLONG LastSystemTime;
+
+		ULONGLONG MaximumProcessorSkew;
+	} Clock;
+
+	//
+	// Cache of mapped windows, see JptrcrpMap.
+	//
+	struct
+	{
+		//
+		// List of JPTRCRP_MAPPING, most recently used first.
+		//
+		LIST_ENTRY LruListHead;
+		ULONG Count;
+		ULONG Capacity;
+
+		//
+		// Window accessed last. Used to detect sequential scans.
+		//
+		ULONGLONG LastMapIndex;
+
+		JPTRCR_MAPPING_STATISTICS Statistics;
+	} Mappings;
+
+	//
+	// State of the last part used by JptrcrRefreshFile.
+	//
+	struct
+	{
+		//
+		// FALSE for files that cannot grow at the end, i.e.
+		// circular files.
+		//
+		BOOL Supported;
+
+		//
+		// Logical offset of the first chunk not inventoried yet.
+		//
+		ULONGLONG ScannedEnd;
+	} Tail;
+
+	//
+	// Parts in logical offset order.
+	//
+	ULONG PartCount;
+	JPTRCRP_FILE_PART Parts[ ANYSIZE_ARRAY ];
 } JPTRCRP_FILE, *PJPTRCRP_FILE;
 
 /*++
 	Routine Description:
-		Maps in the given offset. At least the entire segment
+		Maps in the given logical offset. At least the entire segment
 		surrounding the offset is mapped in.
+
+		The most recently used windows remain mapped. Addresses 
+		obtained by previous calls may become invalid, however.
 --*/
 HRESULT JptrcrpMap( 
 	__in PJPTRCRP_FILE File,
@@ -76,11 +213,84 @@ HRESULT JptrcrpMap(
 	__out PVOID *MappedAddress
 	);
 
+/*++
+	Structure Description:
+		Single window mapped independently of the mapping cache, 
+		see JptrcrpMapPrivate.
+--*/
+typedef struct _JPTRCRP_PRIVATE_MAPPING
+{
+	ULONGLONG MapIndex;
+	PVOID MappedAddress;
+} JPTRCRP_PRIVATE_MAPPING, *PJPTRCRP_PRIVATE_MAPPING;
+
+VOID JptrcrpInitializePrivateMapping(
+	__out PJPTRCRP_PRIVATE_MAPPING Mapping
+	);
+
+/*++
+	Routine Description:
+		Like JptrcrpMap, but uses a caller-provided mapping rather
+		than the mapping cache. The window previously mapped by
+		this mapping is unmapped if the offset lies in a different
+		window.
+
+		The file structure is not modified, so multiple threads may
+		use this routine concurrently, each using its own mapping.
+--*/
+HRESULT JptrcrpMapPrivate( 
+	__in PJPTRCRP_FILE File,
+	__inout PJPTRCRP_PRIVATE_MAPPING Mapping,
+	__in ULONGLONG Offset,
+	__out PVOID *MappedAddress
+	);
+
+VOID JptrcrpUnmapPrivate(
+	__inout PJPTRCRP_PRIVATE_MAPPING Mapping
+	);
+
+/*++
+	Routine Description:
+		Check whether the given logical offset lies in the window
+		currently mapped by a private mapping, i.e. whether 
+		JptrcrpMapPrivate will not have to access the file parts.
+--*/
+BOOL JptrcrpIsMappedPrivate(
+	__in PJPTRCRP_PRIVATE_MAPPING Mapping,
+	__in ULONGLONG Offset
+	);
+
 /*----------------------------------------------------------------------
  *
  * Utility routines.
  *
  */
+
+typedef struct _JPTRCRP_MEMORY_RANGE_ENTRY
+{
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+} JPTRCRP_MEMORY_RANGE_ENTRY, *PJPTRCRP_MEMORY_RANGE_ENTRY;
+
+typedef BOOL ( WINAPI * JPTRCRP_PREFETCH_VIRTUAL_MEMORY_ROUTINE ) (
+	__in HANDLE Process,
+	__in ULONG_PTR NumberOfEntries,
+	__in_ecount( NumberOfEntries ) PJPTRCRP_MEMORY_RANGE_ENTRY Addresses,
+	__in ULONG Flags
+	);
+
+//
+// PrefetchVirtualMemory, NULL if not supported by the OS. Set
+// in DllMain.
+//
+extern JPTRCRP_PREFETCH_VIRTUAL_MEMORY_ROUTINE JptrcrpPrefetchVirtualMemory;
+
+//
+// Lock protecting all dbghelp activity (dbghelp is not threadsafe).
+// Shared by all files as they share the dbghelp session.
+//
+extern CRITICAL_SECTION JptrcrpDbghelpLock;
+
 PVOID JptrcrpAllocateHashtableMemory(
 	__in SIZE_T Size 
 	);
@@ -100,6 +310,32 @@ VOID JptrcrpDbgPrint(
 	...
 	);
 
+VOID JptrcrpInitializeArena(
+	__out PJPTRCRP_ARENA Arena
+	);
+
+/*++
+	Routine Description:
+		Allocate memory from an arena. The memory is 8-byte aligned
+		and not initialized.
+
+	Return Value:
+		Memory or NULL if out of memory.
+--*/
+PVOID JptrcrpAllocateArena(
+	__in PJPTRCRP_ARENA Arena,
+	__in SIZE_T Size
+	);
+
+/*++
+	Routine Description:
+		Free all memory allocated from the arena. The arena can
+		be reused afterwards.
+--*/
+VOID JptrcrpDeleteArena(
+	__in PJPTRCRP_ARENA Arena
+	);
+
 /*----------------------------------------------------------------------
  *
  * Modules routines.
@@ -163,6 +399,108 @@ HRESULT JptrcrGetModule(
 	__out PJPTRCR_MODULE *Module 
 	);
 
+/*----------------------------------------------------------------------
+ *
+ * Clock routines.
+ *
+ */
+
+/*++
+	Routine Description:
+		Merge a calibration chunk into the file's calibration
+		information. Chunks may be loaded in any order.
+--*/
+HRESULT JptrcrpLoadCalibration(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRC_CALIBRATION_CHUNK Chunk
+	);
+
+/*++
+	Routine Description:
+		Convert a timestamp difference to nanoseconds.
+
+	Return Value:
+		Nanoseconds, 0 if the file does not contain calibration
+		information.
+--*/
+ULONGLONG JptrcrpTicksToNanoseconds(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG Ticks
+	);
+
+/*----------------------------------------------------------------------
+ *
+ * Symbol routines.
+ *
+ */
+
+ULONG JptrcrpHashSymbol(
+	__in ULONG_PTR ProcedurePtr
+	);
+
+BOOLEAN JptrcrpEqualsSymbol(
+	__in ULONG_PTR KeyLhs,
+	__in ULONG_PTR KeyRhs
+	);
+
+VOID JptrcrpRemoveAndDeleteSymbol(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Register all symbols of a symbol table chunk with the file
+		structure. Symbols override earlier symbols of the same
+		procedure.
+--*/
+HRESULT JptrcrpLoadSymbolTable(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk
+	);
+
+/*++
+	Routine Description:
+		Obtain symbol and module of a procedure. Symbols embedded
+		in the file take precedence over dbghelp. Results, including
+		failures, are cached s.t. each procedure is resolved at most 
+		once. The pointers are valid as long as the file remains open.
+
+	Parameters:
+		Symbol		- Symbol or NULL if the procedure cannot be 
+					  resolved.
+		Module		- Module or NULL if unknown.
+--*/
+VOID JptrcrpResolveSymbol(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG Procedure,
+	__out PSYMBOL_INFO *Symbol,
+	__out PJPTRCR_MODULE *Module
+	);
+
+/*++
+	Routine Description:
+		Obtain the ID of a symbol returned by JptrcrpResolveSymbol.
+		IDs are assigned on first use, starting at 1.
+
+	Return Value:
+		ID or JPTRCR_INVALID_SYMBOL_ID if Symbol is NULL or no
+		ID could be assigned due to lack of memory.
+--*/
+ULONG JptrcrpGetSymbolId(
+	__in PJPTRCRP_FILE File,
+	__in_opt PSYMBOL_INFO Symbol
+	);
+
+/*++
+	Routine Description:
+		Free symbols retired by JptrcrpLoadSymbolTable.
+--*/
+VOID JptrcrpDeleteRetiredSymbols(
+	__in PJPTRCRP_FILE File
+	);
+
 /*----------------------------------------------------------------------
  *
  * Client routines.
@@ -197,6 +535,45 @@ HRESULT JptrcrpRegisterTraceBufferClient(
 	__in ULONGLONG ChunkOffset
 	);
 
+/*++
+	Routine Description:
+		Register multiple chunks of a client at once, see
+		JptrcrpRegisterTraceBufferClient.
+
+	Parameters:
+		ChunkOffsets		- Logical offsets, in file order.
+--*/
+HRESULT JptrcrpRegisterTraceBufferChunks(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONG ChunkCount,
+	__in_ecount( ChunkCount ) PULONGLONG ChunkOffsets
+	);
+
+/*++
+	Routine Description:
+		Register a range of the chunk offset array of an index 
+		chunk and create a client entry if none exists yet. The 
+		chunk offsets are only read when the calls of this client 
+		are enumerated for the first time.
+
+		Ranges must be registered in file order.
+
+	Parameters:
+		IndexChunkOffset	- Logical offset of index chunk.
+		BaseOffset			- Logical offset of the part containing
+							  the index chunk. Offsets stored in the
+							  index chunk are relative to this offset.
+--*/
+HRESULT JptrcrpRegisterIndexedClient(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONGLONG IndexChunkOffset,
+	__in ULONGLONG BaseOffset,
+	__in ULONG FirstChunk,
+	__in ULONG ChunkCount
+	);
+
 /*++
 	Routine Description:
 		Delete module. The client must have previously been
@@ -204,4 +581,227 @@ HRESULT JptrcrpRegisterTraceBufferClient(
 --*/
 VOID JptrcrpDeleteClient(
 	__in PJPTRCRP_CLIENT Client
+	);
+
+/*++
+	Structure Description:
+		Snapshot of the trace buffer chunks of a client, see
+		JptrcrpGetClientChunks.
+--*/
+typedef struct _JPTRCRP_CLIENT_CHUNKS
+{
+	JPTRCR_CLIENT Information;
+
+	//
+	// Logical offsets, in file order.
+	//
+	ULONG ChunkCount;
+	PULONGLONG ChunkOffsets;
+} JPTRCRP_CLIENT_CHUNKS, *PJPTRCRP_CLIENT_CHUNKS;
+
+/*++
+	Routine Description:
+		Take a snapshot of the chunks of all clients. As opposed to
+		the client structures, the snapshot may be read by multiple
+		threads concurrently.
+
+	Parameters:
+		Clients		- Array to be freed by the caller using free().
+
+	Return Value:
+		S_OK on success.
+		S_FALSE if there are no clients.
+		Failure HRESULT otherwise.
+--*/
+HRESULT JptrcrpGetClientChunks(
+	__in PJPTRCRP_FILE File,
+	__out PJPTRCRP_CLIENT_CHUNKS *Clients,
+	__out PULONG ClientCount
+	);
+
+/*++
+	Structure Description:
+		Buffer that compact chunks are decoded into. Grows as needed
+		and is reused for subsequent chunks s.t. reading a sequence
+		of chunks does not allocate memory per chunk.
+
+		Zero-initialize before first use.
+--*/
+typedef struct _JPTRCRP_TRANSITION_BUFFER
+{
+	PJPTRC_PROCEDURE_TRANSITION32 Transitions;
+
+	//
+	// Capacity, in transitions.
+	//
+	ULONG Capacity;
+} JPTRCRP_TRANSITION_BUFFER, *PJPTRCRP_TRANSITION_BUFFER;
+
+/*++
+	Routine Description:
+		Make sure the buffer can hold at least Count transitions.
+		The contents of the buffer are not retained.
+--*/
+HRESULT JptrcrpReserveTransitionBuffer(
+	__inout PJPTRCRP_TRANSITION_BUFFER Buffer,
+	__in ULONG Count
+	);
+
+VOID JptrcrpDeleteTransitionBuffer(
+	__inout PJPTRCRP_TRANSITION_BUFFER Buffer
+	);
+
+/*++
+	Routine Description:
+		Obtain the transitions of a trace buffer chunk. Compact chunks
+		are decoded into the buffer, replacing any transitions 
+		decoded previously.
+
+	Parameters:
+		Chunk			- Mapped chunk.
+		Buffer			- Buffer to decode into.
+		Transitions		- Transitions of this chunk. Point either into
+						  the mapped chunk or into Buffer.
+		TransitionCount	- Number of transitions.
+--*/
+HRESULT JptrcrpGetChunkTransitions(
+	__in PJPTRC_CHUNK_HEADER Chunk,
+	__inout PJPTRCRP_TRANSITION_BUFFER Buffer,
+	__out PJPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__out PULONG TransitionCount
+	);
+
+/*++
+	Routine Description:
+		Mark all clients as reported and reset their new chunk
+		counts. Called before chunks are added by JptrcrRefreshFile.
+--*/
+VOID JptrcrpResetClientUpdates(
+	__in PJPTRCRP_FILE File
+	);
+
+/*++
+	Routine Description:
+		Report clients that have been created or have been assigned
+		new chunks since the last call to JptrcrpResetClientUpdates.
+
+	Return Value:
+		Number of clients reported.
+--*/
+ULONG JptrcrpReportClientUpdates(
+	__in PJPTRCRP_FILE File,
+	__in_opt JPTRCR_REFRESH_ROUTINE Callback,
+	__in_opt PVOID Context
+	);
+
+/*----------------------------------------------------------------------
+ *
+ * Inventory routines.
+ *
+ */
+
+/*++
+	Routine Description:
+		Load images and register trace buffers of all chunks
+		located in the logical range [StartOffset, EndOffset).
+
+	Parameters:
+		ScannedEnd	- If non-NULL, the range may end with an 
+					  incomplete chunk, i.e. one that is still being
+					  written. Receives the logical offset of this
+					  chunk or EndOffset if the range is complete.
+--*/
+HRESULT JptrcrpScanChunks(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG StartOffset,
+	__in ULONGLONG EndOffset,
+	__out_opt PULONGLONG ScannedEnd
+	);
+
+/*++
+	Routine Description:
+		Scan a part using multiple threads. Relies on chunks not
+		straddling segment boundaries.
+
+	Parameters:
+		ScannedEnd	- See JptrcrpScanChunks.
+
+	Return Value:
+		S_OK on success.
+		S_FALSE if the part is too small or does not conform
+			to the segment constraint - the part should then
+			be scanned sequentially using JptrcrpScanChunks.
+		Failure HRESULT otherwise.
+--*/
+HRESULT JptrcrpPerformParallelInventory(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__out_opt PULONGLONG ScannedEnd
+	);
+/*----------------------------------------------------------------------
+ *
+ * Transition scanning routines.
+ *
+ */
+
+//
+// TargetDepth to use if no boundary needs to be located.
+//
+#define JPTRCRP_NO_TARGET_DEPTH MINLONG
+
+/*++
+	Structure Description:
+		Result of scanning a sequence of transitions. Depths are
+		relative to the depth before the first transition, i.e.
+		each entry counts +1, each exit or unwind -1.
+--*/
+typedef struct _JPTRCRP_DEPTH_SCAN
+{
+	ULONG EntryCount;
+
+	//
+	// Depth after the last transition.
+	//
+	LONG FinalDepth;
+
+	//
+	// Index of the first transition after which the depth equals
+	// the target depth, transition count if there is none.
+	//
+	ULONG BoundaryIndex;
+} JPTRCRP_DEPTH_SCAN, *PJPTRCRP_DEPTH_SCAN;
+
+/*++
+	Routine Description:
+		Validate the types of a sequence of transitions, count
+		entries, and locate the first position at which the depth
+		reaches TargetDepth. Uses SSE2 if available.
+
+		To locate the end of the call entered by the first 
+		transition, use a TargetDepth of 0, to locate the exit
+		of the caller, -1.
+
+	Return Value:
+		S_OK on success.
+		JPTRCR_E_INVALID_TRANSITION if a transition has an invalid 
+			type. Scan is undefined in this case.
+--*/
+HRESULT JptrcrpScanTransitionDepth(
+	__in_ecount( TransitionCount ) CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG TransitionCount,
+	__in LONG TargetDepth,
+	__out PJPTRCRP_DEPTH_SCAN Scan
+	);
+
+/*++
+	Routine Description:
+		Scalar implementation of JptrcrpScanTransitionDepth. Used
+		if SSE2 is unavailable and for the remainder of sequences 
+		not filling an entire block.
+--*/
+HRESULT JptrcrpScanTransitionDepthScalar(
+	__in_ecount( TransitionCount ) CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG TransitionCount,
+	__in LONG TargetDepth,
+	__out PJPTRCRP_DEPTH_SCAN Scan
 	);
\ No newline at end of file
@@ -8,6 +8,13 @@
 #include <jptrcrp.h>
 #include <crtdbg.h>
 
+JPTRCRP_PREFETCH_VIRTUAL_MEMORY_ROUTINE JptrcrpPrefetchVirtualMemory = NULL;
+
+/*++
+	Lock protecting all dbghelp activity (dbghelp is not threadsafe).
+--*/
+CRITICAL_SECTION JptrcrpDbghelpLock;
+
 /*++
 	Routine Description:
 		Entry point.
@@ -24,9 +31,19 @@ BOOL WINAPI DllMain(
 	switch ( Reason )
 	{
 	case DLL_PROCESS_ATTACH:
+		InitializeCriticalSection( &JptrcrpDbghelpLock );
+
+		//
+		// Only available as of Windows 8.
+		//
+		JptrcrpPrefetchVirtualMemory = 
+			( JPTRCRP_PREFETCH_VIRTUAL_MEMORY_ROUTINE ) GetProcAddress(
+				GetModuleHandle( L"kernel32.dll" ),
+				"PrefetchVirtualMemory" );
 		return TRUE;
 
 	case DLL_PROCESS_DETACH:
+		DeleteCriticalSection( &JptrcrpDbghelpLock );
 #ifdef DBG
 		_CrtDumpMemoryLeaks();
 #endif
@@ -205,6 +205,7 @@ HRESULT JptrcrpLoadModule(
 	ModLoadData.size	= DebugSize;
 	ModLoadData.flags	= 0;
 
+	EnterCriticalSection( &JptrcrpDbghelpLock );
 	SymBase = SymLoadModuleEx(
 		File->SymHandle,
 		NULL,
@@ -214,6 +215,7 @@ HRESULT JptrcrpLoadModule(
 		Size,
 		&ModLoadData,
 		0 );
+	LeaveCriticalSection( &JptrcrpDbghelpLock );
 	ASSERT( SymBase == 0 || SymBase == LoadAddress );
 
 	Module->Information.LoadAddress	= LoadAddress;
@@ -262,9 +264,11 @@ VOID JptrcrpDeleteModule(
 	
 	if ( Module->SymbolsLoaded )
 	{
+		EnterCriticalSection( &JptrcrpDbghelpLock );
 		VERIFY( SymUnloadModule64( 
 			Module->File->SymHandle,
 			Module->Information.LoadAddress ) );
+		LeaveCriticalSection( &JptrcrpDbghelpLock );
 	}
 
 	free( Module );
@@ -295,11 +299,15 @@ HRESULT JptrcrEnumModules(
 	EnumContext.Callback	= Callback;
 	EnumContext.Context		= Context;
 
+	EnterCriticalSection( &File->Lock );
+
 	JphtEnumerateEntries(
 		&File->ModulesTable,
 		JptrcrsEnumModules,
 		&EnumContext );
 
+	LeaveCriticalSection( &File->Lock );
+
 	return S_OK;
 }
 
@@ -322,9 +330,14 @@ HRESULT JptrcrGetModule(
 
 	*Module = NULL;
 
+	EnterCriticalSection( &File->Lock );
+
 	Entry = JphtGetEntryHashtable( 
 		&File->ModulesTable,
 		( ULONG_PTR ) &LoadAddress );
+
+	LeaveCriticalSection( &File->Lock );
+
 	if ( Entry == NULL )
 	{
 		return JPTRCR_E_MODULE_UNKNOWN;
@@ -13,15 +13,270 @@
 
 #define JPTRCRP_SYM_PSEUDO_HANDLE		( ( HANDLE ) ( ULONG_PTR ) 0xF0F0F0F0 )
 #define JPTRCRP_SEGMENTS_MAP_AT_ONCE	4
+#define JPTRCRP_MAPPING_WINDOW_SIZE		( JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_MAP_AT_ONCE )
+
+#define JPTRCRP_DEFAULT_MAPPING_CAPACITY	16
+#define JPTRCRP_MAX_MAPPING_CAPACITY		128
+
+/*++
+	Structure Description:
+		A mapped window of JPTRCRP_MAPPING_WINDOW_SIZE bytes. Windows 
+		are aligned to JPTRCRP_MAPPING_WINDOW_SIZE. The last window of
+		a part may be smaller.
+--*/
+typedef struct _JPTRCRP_MAPPING
+{
+	LIST_ENTRY ListEntry;
+	ULONGLONG MapIndex;
+	PVOID MappedAddress;
+} JPTRCRP_MAPPING, *PJPTRCRP_MAPPING;
+
+/*++
+	Routine Description:
+		Unmap least recently used windows until at most Capacity
+		windows remain mapped.
+
+	Return Value:
+		Number of windows unmapped.
+--*/
+static ULONG JptrcrsTrimMappings(
+	__in PJPTRCRP_FILE File,
+	__in ULONG Capacity
+	)
+{
+	ULONG Unmapped = 0;
+
+	while ( File->Mappings.Count > Capacity )
+	{
+		PJPTRCRP_MAPPING Mapping;
+
+		ASSERT( ! IsListEmpty( &File->Mappings.LruListHead ) );
+
+		Mapping = CONTAINING_RECORD(
+			RemoveTailList( &File->Mappings.LruListHead ),
+			JPTRCRP_MAPPING,
+			ListEntry );
+
+		VERIFY( UnmapViewOfFile( Mapping->MappedAddress ) );
+		free( Mapping );
+
+		File->Mappings.Count--;
+		Unmapped++;
+	}
+
+	return Unmapped;
+}
+
+/*++
+	Routine Description:
+		Find a mapped window.
+--*/
+static PJPTRCRP_MAPPING JptrcrsLookupMapping(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG MapIndex
+	)
+{
+	PLIST_ENTRY ListEntry;
+
+	//
+	// The number of windows is small, a linear search suffices.
+	//
+	for ( ListEntry = File->Mappings.LruListHead.Flink;
+		  ListEntry != &File->Mappings.LruListHead;
+		  ListEntry = ListEntry->Flink )
+	{
+		PJPTRCRP_MAPPING Mapping = CONTAINING_RECORD(
+			ListEntry,
+			JPTRCRP_MAPPING,
+			ListEntry );
+		if ( Mapping->MapIndex == MapIndex )
+		{
+			return Mapping;
+		}
+	}
+
+	return NULL;
+}
+
+/*++
+	Routine Description:
+		Map a window and make it the most recently used one. The
+		least recently used window is unmapped if the cache is full.
+--*/
+static HRESULT JptrcrsMapWindow(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__in ULONGLONG MapIndex,
+	__out PJPTRCRP_MAPPING *Mapping
+	)
+{
+	LARGE_INTEGER Li;
+	PJPTRCRP_MAPPING NewMapping;
+	ULONGLONG Offset;
+	ULONG SizeToMap;
+
+	ASSERT( File->Mappings.Capacity > 0 );
+
+	Offset = MapIndex * JPTRCRP_MAPPING_WINDOW_SIZE;
+
+	ASSERT( Offset >= Part->BaseOffset );
+	ASSERT( Offset < Part->BaseOffset + Part->Size );
+
+	NewMapping = ( PJPTRCRP_MAPPING ) malloc( sizeof( JPTRCRP_MAPPING ) );
+	if ( NewMapping == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	File->Mappings.Statistics.Remaps += JptrcrsTrimMappings( 
+		File, 
+		File->Mappings.Capacity - 1 );
+
+	//
+	// If we are at the end of the part, we may have to map
+	// less than JPTRCRP_MAPPING_WINDOW_SIZE.
+	//
+	SizeToMap = ( ULONG ) min( 
+		( ULONGLONG ) JPTRCRP_MAPPING_WINDOW_SIZE,
+		( Part->BaseOffset + Part->Size - Offset ) );
+
+	Li.QuadPart = Offset - Part->BaseOffset;
+	NewMapping->MappedAddress = MapViewOfFile(
+		Part->Mapping,
+		FILE_MAP_READ,
+		Li.HighPart,
+		Li.LowPart,
+		SizeToMap );
+	if ( NewMapping->MappedAddress == NULL )
+	{
+		free( NewMapping );
+		return HRESULT_FROM_WIN32( GetLastError() );
+	}
+
+	NewMapping->MapIndex = MapIndex;
+	InsertHeadList( &File->Mappings.LruListHead, &NewMapping->ListEntry );
+	File->Mappings.Count++;
+
+	*Mapping = NewMapping;
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Find the part containing a logical offset. Offsets in the 
+		gap following a part are invalid.
+
+	Return Value:
+		Part or NULL if the offset is invalid.
+--*/
+static PJPTRCRP_FILE_PART JptrcrsFindPart(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG Offset
+	)
+{
+	ULONG PartIndex;
+
+	for ( PartIndex = 0; PartIndex < File->PartCount; PartIndex++ )
+	{
+		if ( Offset >= File->Parts[ PartIndex ].BaseOffset &&
+			 Offset < File->Parts[ PartIndex ].BaseOffset + 
+				File->Parts[ PartIndex ].Size )
+		{
+			return &File->Parts[ PartIndex ];
+		}
+	}
+
+	return NULL;
+}
+
+/*++
+	Routine Description:
+		Map the window following the given one in advance and have 
+		the OS read it in asynchronously, if supported. Failures 
+		are ignored.
+--*/
+static VOID JptrcrsPrefetchWindow(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__in ULONGLONG MapIndex
+	)
+{
+	ULONGLONG NextMapIndex = MapIndex + 1;
+	PJPTRCRP_MAPPING Mapping;
+
+	//
+	// The requested window must not be evicted.
+	//
+	if ( File->Mappings.Capacity < 2 ||
+		 NextMapIndex * JPTRCRP_MAPPING_WINDOW_SIZE >= 
+			Part->BaseOffset + Part->Size ||
+		 JptrcrsLookupMapping( File, NextMapIndex ) != NULL )
+	{
+		return;
+	}
+
+	if ( FAILED( JptrcrsMapWindow( File, Part, NextMapIndex, &Mapping ) ) )
+	{
+		return;
+	}
+
+	//
+	// Not used yet - rank it behind the requested window.
+	//
+	RemoveEntryList( &Mapping->ListEntry );
+	InsertHeadList( 
+		File->Mappings.LruListHead.Flink, 
+		&Mapping->ListEntry );
+
+	File->Mappings.Statistics.Prefetches++;
+
+	if ( JptrcrpPrefetchVirtualMemory != NULL )
+	{
+		JPTRCRP_MEMORY_RANGE_ENTRY Range;
+
+		Range.VirtualAddress	= Mapping->MappedAddress;
+		Range.NumberOfBytes		= ( SIZE_T ) min(
+			( ULONGLONG ) JPTRCRP_MAPPING_WINDOW_SIZE,
+			Part->BaseOffset + Part->Size - 
+				NextMapIndex * JPTRCRP_MAPPING_WINDOW_SIZE );
+
+		( VOID ) ( JptrcrpPrefetchVirtualMemory )(
+			GetCurrentProcess(),
+			1,
+			&Range,
+			0 );
+	}
+}
+
+/*++
+	Routine Description:
+		Map an offset relative to the beginning of a part.
+--*/
+static HRESULT JptrcrsMapPart(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__in ULONGLONG Offset,
+	__out PVOID *MappedAddress
+	)
+{
+	if ( Offset >= Part->Size )
+	{
+		return JPTRCR_E_EOF;
+	}
+
+	return JptrcrpMap( File, Part->BaseOffset + Offset, MappedAddress );
+}
 
 static HRESULT JptrcrsReadFileHeader(
-	__in PJPTRCRP_FILE File
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__out PUSHORT Characteristics
 	)
 {
 	PJPTRC_FILE_HEADER Header;
 	HRESULT Hr;
 
-	Hr = JptrcrpMap( File, 0, &Header );
+	Hr = JptrcrsMapPart( File, Part, 0, &Header );
 	if ( FAILED( Hr ) )
 	{
 		return Hr;
@@ -50,6 +305,7 @@ static HRESULT JptrcrsReadFileHeader(
 		return JPTRCR_E_BITNESS_NOT_SUPPRTED;
 	}
 
+	*Characteristics = Header->Characteristics;
 	return S_OK;
 }
 
@@ -95,40 +351,50 @@ static HRESULT JptrcrsRegisterTraceBuffer(
 		Offset );
 }
 
-static HRESULT JptrcrsPerformFileInventory(
-	__in PJPTRCRP_FILE File
+HRESULT JptrcrpScanChunks(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG StartOffset,
+	__in ULONGLONG EndOffset,
+	__out_opt PULONGLONG ScannedEnd
 	)
 {
 	PJPTRC_CHUNK_HEADER Chunk;
-	HRESULT Hr;
-	ULONGLONG CurrentOffset = sizeof( JPTRC_FILE_HEADER );
+	HRESULT Hr = S_OK;
+	ULONGLONG CurrentOffset = StartOffset;
+
 
 	//
 	// Traverse list of chunks.
 	//
-	for ( ;; )
+	while ( CurrentOffset < EndOffset )
 	{
-		Hr = JptrcrpMap( File, CurrentOffset, &Chunk );
-		if ( Hr == JPTRCR_E_EOF )
+		if ( EndOffset - CurrentOffset < sizeof( JPTRC_CHUNK_HEADER ) )
 		{
-			break;
+			Hr = JPTRCR_E_TRUNCATED_CHUNK;
+			goto Cleanup;
 		}
-		else if ( FAILED( Hr ) )
+
+		Hr = JptrcrpMap( File, CurrentOffset, &Chunk );
+		if ( FAILED( Hr ) )
 		{
-			return Hr;
+			goto Cleanup;
 		}
 
 		if ( Chunk->Reserved != 0 )
 		{
-			return JPTRCR_E_RESERVED_FIELDS_USED;
+			Hr = JPTRCR_E_RESERVED_FIELDS_USED;
+			goto Cleanup;
 		}
-		else if ( Chunk->Size < sizeof( JPTRC_CHUNK_HEADER ) )
+		else if ( Chunk->Size < sizeof( JPTRC_CHUNK_HEADER ) ||
+				  Chunk->Size > EndOffset - CurrentOffset )
 		{
-			return JPTRCR_E_TRUNCATED_CHUNK;
+			Hr = JPTRCR_E_TRUNCATED_CHUNK;
+			goto Cleanup;
 		}
 		else if ( Chunk->Size > JPTRC_SEGMENT_SIZE )
 		{
-			return JPTRCR_E_CHUNK_STRADDLES_SEGMENT;
+			Hr = JPTRCR_E_CHUNK_STRADDLES_SEGMENT;
+			goto Cleanup;
 		}
 
 		switch ( Chunk->Type )
@@ -140,6 +406,27 @@ static HRESULT JptrcrsPerformFileInventory(
 			//TRACE( ( L"Pad chunk @ %I64u\n", CurrentOffset ) );
 			break;
 
+		case JPTRC_CHUNK_TYPE_INDEX:
+		case JPTRC_CHUNK_TYPE_INDEX_TRAILER:
+			//
+			// Index is incomplete or unusable, otherwise we would not
+			// be scanning - skip.
+			//
+			break;
+
+		case JPTRC_CHUNK_TYPE_CIRCULAR_HEADER:
+		case JPTRC_CHUNK_TYPE_SEGMENT_HEADER:
+			//
+			// Interpreted by JptrcrsPerformCircularFileInventory.
+			//
+			break;
+
+		case JPTRC_CHUNK_TYPE_CONTINUATION:
+			//
+			// Interpreted by JptrcrsOrderFileSet.
+			//
+			break;
+
 		case JPTRC_CHUNK_TYPE_IMAGE_INFO:
 			//
 			// Subsequent chunks may refer to this image - load.
@@ -151,14 +438,57 @@ static HRESULT JptrcrsPerformFileInventory(
 				( PJPTRC_IMAGE_INFO_CHUNK ) Chunk );
 			if ( FAILED( Hr ) )
 			{
-				return Hr;
+				goto Cleanup;
+			}
+
+			break;
+
+		case JPTRC_CHUNK_TYPE_CALIBRATION:
+			if ( Chunk->Size > JPTRC_SEGMENT_SIZE -
+					( CurrentOffset % JPTRC_SEGMENT_SIZE ) )
+			{
+				Hr = JPTRCR_E_CHUNK_STRADDLES_SEGMENT;
+				goto Cleanup;
+			}
+
+			Hr = JptrcrpLoadCalibration(
+				File,
+				( PJPTRC_CALIBRATION_CHUNK ) Chunk );
+			if ( FAILED( Hr ) )
+			{
+				goto Cleanup;
+			}
+
+			break;
+
+		case JPTRC_CHUNK_TYPE_SYMBOL_TABLE:
+			//
+			// Subsequent chunks may refer to these symbols - load. The
+			// chunk is read in its entirety, so it must not cross a
+			// segment boundary.
+			//
+			if ( Chunk->Size > JPTRC_SEGMENT_SIZE -
+					( CurrentOffset % JPTRC_SEGMENT_SIZE ) )
+			{
+				Hr = JPTRCR_E_CHUNK_STRADDLES_SEGMENT;
+				goto Cleanup;
+			}
+
+			Hr = JptrcrpLoadSymbolTable(
+				File,
+				( PJPTRC_SYMBOL_TABLE_CHUNK ) Chunk );
+			if ( FAILED( Hr ) )
+			{
+				goto Cleanup;
 			}
 
 			break;
 
 		case JPTRC_CHUNK_TYPE_TRACE_BUFFER:
+		case JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT:
 			//
-			// Trace chunk - register for later retrieval.
+			// Trace chunk - register for later retrieval. Both chunk
+			// types share the same layout up to and including Client.
 			//
 			//TRACE( ( L"Trace chunk @ %I64u\n", CurrentOffset ) );
 			
@@ -168,129 +498,931 @@ static HRESULT JptrcrsPerformFileInventory(
 				CurrentOffset );
 			if ( FAILED( Hr ) )
 			{
-				return Hr;
+				goto Cleanup;
 			}
 
 			break;
 
 		default:
-			return JPTRCR_E_UNRECOGNIZED_CHUNK_TYPE;
+			Hr = JPTRCR_E_UNRECOGNIZED_CHUNK_TYPE;
+			goto Cleanup;
 		}
 
 		CurrentOffset += Chunk->Size;
 	}
-	
-	return S_OK;
+
+	Hr = S_OK;
+
+Cleanup:
+	if ( ScannedEnd != NULL )
+	{
+		if ( Hr == JPTRCR_E_TRUNCATED_CHUNK )
+		{
+			//
+			// The chunk may still be being written.
+			//
+			Hr = S_OK;
+		}
+
+		*ScannedEnd = CurrentOffset;
+	}
+
+	return Hr;
 }
 
-/*----------------------------------------------------------------------
- *
- * Exports.
- *
- */
+/*++
+	Routine Description:
+		Scan a part lacking a usable index.
 
-HRESULT JptrcrOpenFile(
-	__in PCWSTR FilePath,
-	__out JPTRCRHANDLE *Handle
+	Parameters:
+		ScannedEnd		- See JptrcrpScanChunks.
+--*/
+static HRESULT JptrcrsPerformFileInventory(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__out_opt PULONGLONG ScannedEnd
 	)
 {
-	DWORD AdditionalOptions;
-	PJPTRCRP_FILE File = NULL;
-	HANDLE FileHandle;
-	HANDLE FileMapping = NULL;
-	LARGE_INTEGER FileSize;
 	HRESULT Hr;
-	
-	BOOL ClientsTableInitialited = FALSE;
-	BOOL ModulesTableInitialited = FALSE;
-	BOOL SymInitialized = FALSE;
 
-	if ( ! FilePath || ! Handle )
+	Hr = JptrcrpPerformParallelInventory( File, Part, ScannedEnd );
+	if ( Hr != S_FALSE )
 	{
-		return E_INVALIDARG;
+		return Hr;
 	}
 
-	*Handle = NULL;
+	return JptrcrpScanChunks( 
+		File, 
+		Part->BaseOffset + sizeof( JPTRC_FILE_HEADER ), 
+		Part->BaseOffset + Part->Size,
+		ScannedEnd );
+}
 
-	//
-	// Open the file for reading.
-	//
-	FileHandle = CreateFile(
-		FilePath,
-		GENERIC_READ,
-		FILE_SHARE_READ,
-		NULL,
-		OPEN_EXISTING,
-		0,
-		NULL );
-	if ( FileHandle == INVALID_HANDLE_VALUE )
-	{
-		return HRESULT_FROM_WIN32( GetLastError() );
-	}
+/*++
+	Routine Description:
+		Perform inventory of a circular file. Segment 0 and all
+		live segments of the ring are scanned, oldest segment
+		first. See JPTRC_CIRCULAR_HEADER_CHUNK.
 
-	if ( GetFileType( FileHandle ) != FILE_TYPE_DISK )
+		Circular files cannot be part of a file set, so logical
+		offsets equal file offsets.
+--*/
+static HRESULT JptrcrsPerformCircularFileInventory(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part
+	)
+{
+	ULONGLONG FixedDataEnd;
+	PJPTRC_CIRCULAR_HEADER_CHUNK Header;
+	ULONG HeadSegment;
+	ULONGLONG HeadOffset;
+	ULONGLONG HeadSequenceNumber;
+	HRESULT Hr;
+	ULONG LiveSegments;
+	ULONG RingSegments;
+	ULONG Segment;
+	ULONG Index;
+
+	ASSERT( File->PartCount == 1 );
+	ASSERT( Part->BaseOffset == 0 );
+
+	if ( ( Part->Size % JPTRC_SEGMENT_SIZE ) != 0 ||
+		 Part->Size < 2 * JPTRC_SEGMENT_SIZE ||
+		 Part->Size / JPTRC_SEGMENT_SIZE > MAXULONG )
 	{
-		Hr = E_INVALIDARG;
-		goto Cleanup;
+		return JPTRCR_E_CORRUPT_CHUNK;
 	}
 
-	FileSize.LowPart = GetFileSize( FileHandle, ( PDWORD ) &FileSize.HighPart );
-	if ( FileSize.LowPart == INVALID_FILE_SIZE &&
-		 GetLastError() != ERROR_SUCCESS )
+	RingSegments = ( ULONG ) ( Part->Size / JPTRC_SEGMENT_SIZE ) - 1;
+
+	Hr = JptrcrpMap( File, sizeof( JPTRC_FILE_HEADER ), &Header );
+	if ( FAILED( Hr ) )
 	{
-		Hr = HRESULT_FROM_WIN32( GetLastError() );
-		goto Cleanup;
+		return Hr;
 	}
 
-	if ( FileSize.QuadPart == 0 )
+	if ( Header->Header.Type != JPTRC_CHUNK_TYPE_CIRCULAR_HEADER ||
+		 Header->Header.Reserved != 0 ||
+		 Header->Header.Size != sizeof( JPTRC_CIRCULAR_HEADER_CHUNK ) ||
+		 Header->Reserved != 0 ||
+		 Header->FixedDataEnd < 
+			sizeof( JPTRC_FILE_HEADER ) + sizeof( JPTRC_CIRCULAR_HEADER_CHUNK ) ||
+		 Header->FixedDataEnd > JPTRC_SEGMENT_SIZE ||
+		 ( Header->FixedDataEnd % JPTRC_CHUNK_ALIGNMENT ) != 0 ||
+		 ( Header->HeadSequenceNumber != 0 &&
+			( Header->HeadOffset <= JPTRC_SEGMENT_SIZE ||
+			  Header->HeadOffset > Part->Size ||
+			  ( Header->HeadOffset % JPTRC_CHUNK_ALIGNMENT ) != 0 ) ) )
 	{
-		Hr = JPTRCR_E_FILE_EMPTY;
-		goto Cleanup;
+		return JPTRCR_E_CORRUPT_CHUNK;
 	}
 
 	//
-	// Crate a file mapping.
+	// Copy the header - scanning requires mapping other chunks.
 	//
-	FileMapping = CreateFileMapping(
-		FileHandle,
-		NULL,
-		PAGE_READONLY | SEC_COMMIT,
-		0,
-		0,
+	FixedDataEnd		= Header->FixedDataEnd;
+	HeadSequenceNumber	= Header->HeadSequenceNumber;
+	HeadOffset			= Header->HeadOffset;
+
+	//
+	// Segment 0 contains image info chunks only, scan it first.
+	//
+	Hr = JptrcrpScanChunks( 
+		File, 
+		sizeof( JPTRC_FILE_HEADER ), 
+		FixedDataEnd, 
 		NULL );
-	if ( FileMapping == NULL )
+	if ( FAILED( Hr ) || HeadSequenceNumber == 0 )
 	{
-		Hr = HRESULT_FROM_WIN32( GetLastError() );
-		goto Cleanup;
+		return Hr;
 	}
 
 	//
-	// Allocate and initialize own file structure.
+	// Walk backwards from the head segment to determine the number
+	// of live segments.
 	//
-	File = ( PJPTRCRP_FILE ) malloc( sizeof( JPTRCRP_FILE ) );
-	if ( File == NULL )
+	HeadSegment		= ( ULONG ) ( ( HeadOffset - 1 ) / JPTRC_SEGMENT_SIZE );
+	Segment			= HeadSegment;
+	LiveSegments	= 0;
+
+	while ( LiveSegments < RingSegments &&
+			LiveSegments < HeadSequenceNumber )
 	{
-		Hr = E_OUTOFMEMORY;
-		goto Cleanup;
-	}
+		PJPTRC_SEGMENT_HEADER_CHUNK SegmentHeader;
 
-	File->Signature			= JPTRCRP_FILE_SIGNATURE;
-	File->File.Handle		= FileHandle;
-	File->File.Mapping		= FileMapping;
-	File->File.Size			= FileSize.QuadPart;
+		Hr = JptrcrpMap( 
+			File, 
+			( ULONGLONG ) Segment * JPTRC_SEGMENT_SIZE, 
+			&SegmentHeader );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
 
-	if ( ! JphtInitializeHashtable(
-		&File->ModulesTable,
-		JptrcrpAllocateHashtableMemory,
-		JptrcrpFreeHashtableMemory,
-		JptrcrpHashModule,
-		JptrcrpEqualsModule,
-		63 ) )
+		if ( SegmentHeader->Header.Type != JPTRC_CHUNK_TYPE_SEGMENT_HEADER ||
+			 SegmentHeader->Header.Reserved != 0 ||
+			 SegmentHeader->Header.Size != sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) ||
+			 SegmentHeader->SequenceNumber != HeadSequenceNumber - LiveSegments )
+		{
+			//
+			// Never written or already overwritten.
+			//
+			break;
+		}
+
+		LiveSegments++;
+		Segment = ( Segment == 1 ) ? RingSegments : Segment - 1;
+	}
+
+	if ( LiveSegments == 0 )
 	{
-		Hr = E_OUTOFMEMORY;
-		goto Cleanup;
+		//
+		// Even the head segment does not match.
+		//
+		return JPTRCR_E_CORRUPT_CHUNK;
+	}
+
+	//
+	// Scan live segments in order. Segment refers to the segment 
+	// preceding the oldest live segment.
+	//
+	for ( Index = 0; Index < LiveSegments; Index++ )
+	{
+		ULONGLONG SegmentOffset;
+
+		Segment = ( Segment == RingSegments ) ? 1 : Segment + 1;
+		SegmentOffset = ( ULONGLONG ) Segment * JPTRC_SEGMENT_SIZE;
+
+		Hr = JptrcrpScanChunks( 
+			File, 
+			SegmentOffset,
+			Segment == HeadSegment 
+				? HeadOffset 
+				: SegmentOffset + JPTRC_SEGMENT_SIZE,
+			NULL );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+	}
+
+	ASSERT( Segment == HeadSegment );
+
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Check whether the chunk at the given offset is a plausible
+		index chunk. Offset is relative to the beginning of the part.
+--*/
+static BOOL JptrcrsIsValidIndexChunk(
+	__in PJPTRCRP_FILE_PART Part,
+	__in ULONGLONG Offset,
+	__in PJPTRC_INDEX_CHUNK Chunk
+	)
+{
+	PJPTRC_INDEX_CLIENT Clients;
+	ULONG Index;
+	ULONG MaxCount;
+
+	if ( Chunk->Header.Type != JPTRC_CHUNK_TYPE_INDEX ||
+		 Chunk->Header.Reserved != 0 ||
+		 Chunk->Header.Size < FIELD_OFFSET( JPTRC_INDEX_CHUNK, Data ) ||
+		 Chunk->Header.Size > JPTRC_SEGMENT_SIZE - ( Offset % JPTRC_SEGMENT_SIZE ) ||
+		 Offset + Chunk->Header.Size > Part->Size )
+	{
+		return FALSE;
+	}
+
+	//
+	// Check counts individually first to rule out overflows.
+	//
+	MaxCount = Chunk->Header.Size / sizeof( ULONGLONG );
+	if ( Chunk->ImageInfoCount > MaxCount ||
+		 Chunk->SegmentCount > MaxCount ||
+		 Chunk->ClientCount > MaxCount ||
+		 Chunk->ChunkCount > MaxCount ||
+		 Chunk->Header.Size != JPTRC_INDEX_CHUNK_SIZE(
+			Chunk->ImageInfoCount,
+			Chunk->SegmentCount,
+			Chunk->ClientCount,
+			Chunk->ChunkCount ) )
+	{
+		return FALSE;
+	}
+
+	if ( Chunk->PreviousIndexOffset >= Offset ||
+		 Chunk->StartOffset > Chunk->EndOffset ||
+		 Chunk->EndOffset > Offset )
+	{
+		return FALSE;
+	}
+
+	Clients = JPTRC_INDEX_CLIENTS( Chunk );
+	for ( Index = 0; Index < Chunk->ClientCount; Index++ )
+	{
+		if ( Clients[ Index ].FirstChunk > Chunk->ChunkCount ||
+			 Clients[ Index ].ChunkCount > 
+				Chunk->ChunkCount - Clients[ Index ].FirstChunk )
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*++
+	Routine Description:
+		Collect the offsets of all index chunks, oldest first, by 
+		following the chain starting at the trailer. Offsets are
+		relative to the beginning of the part.
+
+	Return Value:
+		S_OK if the index is complete and consistent.
+		S_FALSE if the file lacks a usable index and needs to be 
+			scanned.
+		Any other failure HRESULT.
+--*/
+static HRESULT JptrcrsCollectIndexChunks(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__out PULONGLONG *IndexOffsets,
+	__out PULONG IndexCount
+	)
+{
+	ULONG Capacity = 0;
+	ULONG Count = 0;
+	PJPTRC_INDEX_CHUNK Chunk;
+	HRESULT Hr;
+	ULONG Index;
+	ULONGLONG Offset;
+	PULONGLONG Offsets = NULL;
+	PJPTRC_INDEX_TRAILER_CHUNK Trailer;
+
+	ASSERT( File );
+	ASSERT( IndexOffsets );
+	ASSERT( IndexCount );
+
+	*IndexOffsets	= NULL;
+	*IndexCount		= 0;
+
+	//
+	// The trailer, if present, occupies the last bytes of the file.
+	//
+	if ( Part->Size < sizeof( JPTRC_FILE_HEADER ) + 
+			sizeof( JPTRC_INDEX_TRAILER_CHUNK ) ||
+		 ( Part->Size % JPTRC_CHUNK_ALIGNMENT ) != 0 )
+	{
+		return S_FALSE;
+	}
+
+	Hr = JptrcrsMapPart( 
+		File, 
+		Part,
+		Part->Size - sizeof( JPTRC_INDEX_TRAILER_CHUNK ), 
+		&Trailer );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	if ( Trailer->Header.Type != JPTRC_CHUNK_TYPE_INDEX_TRAILER ||
+		 Trailer->Header.Reserved != 0 ||
+		 Trailer->Header.Size != sizeof( JPTRC_INDEX_TRAILER_CHUNK ) ||
+		 Trailer->LastIndexOffset < sizeof( JPTRC_FILE_HEADER ) ||
+		 Trailer->LastIndexOffset >= 
+			Part->Size - sizeof( JPTRC_INDEX_TRAILER_CHUNK ) ||
+		 ( Trailer->LastIndexOffset % JPTRC_CHUNK_ALIGNMENT ) != 0 )
+	{
+		return S_FALSE;
+	}
+
+	//
+	// Walk the chain backwards. Offsets are strictly decreasing, so 
+	// the walk terminates.
+	//
+	Offset = Trailer->LastIndexOffset;
+	for ( ;; )
+	{
+		Hr = JptrcrsMapPart( File, Part, Offset, &Chunk );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		if ( ! JptrcrsIsValidIndexChunk( Part, Offset, Chunk ) )
+		{
+			Hr = S_FALSE;
+			goto Cleanup;
+		}
+
+		if ( Count == Capacity )
+		{
+			PULONGLONG NewOffsets;
+
+			Capacity = Capacity == 0 ? 64 : Capacity * 2;
+			NewOffsets = ( PULONGLONG ) realloc( 
+				Offsets, 
+				Capacity * sizeof( ULONGLONG ) );
+			if ( NewOffsets == NULL )
+			{
+				Hr = E_OUTOFMEMORY;
+				goto Cleanup;
+			}
+
+			Offsets = NewOffsets;
+		}
+
+		Offsets[ Count++ ] = Offset;
+
+		if ( Chunk->PreviousIndexOffset == 0 )
+		{
+			if ( Chunk->StartOffset != sizeof( JPTRC_FILE_HEADER ) )
+			{
+				Hr = S_FALSE;
+				goto Cleanup;
+			}
+
+			break;
+		}
+		
+		Offset = Chunk->PreviousIndexOffset;
+	}
+
+	//
+	// Reverse to obtain file order.
+	//
+	for ( Index = 0; Index < Count / 2; Index++ )
+	{
+		ULONGLONG Temp = Offsets[ Index ];
+		Offsets[ Index ] = Offsets[ Count - Index - 1 ];
+		Offsets[ Count - Index - 1 ] = Temp;
+	}
+
+	//
+	// Ranges must be contiguous - any gap would contain chunks not
+	// covered by the index.
+	//
+	for ( Index = 1; Index < Count; Index++ )
+	{
+		ULONG PreviousSize;
+
+		Hr = JptrcrsMapPart( File, Part, Offsets[ Index - 1 ], &Chunk );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		PreviousSize = Chunk->Header.Size;
+
+		Hr = JptrcrsMapPart( File, Part, Offsets[ Index ], &Chunk );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		if ( Chunk->StartOffset != Offsets[ Index - 1 ] + PreviousSize )
+		{
+			Hr = S_FALSE;
+			goto Cleanup;
+		}
+	}
+
+	*IndexOffsets	= Offsets;
+	*IndexCount		= Count;
+	Offsets			= NULL;
+	Hr				= S_OK;
+
+Cleanup:
+	free( Offsets );
+	return Hr;
+}
+
+/*++
+	Routine Description:
+		Load image info chunks and register clients as listed by
+		a single index chunk. Offset is relative to the beginning
+		of the part.
+--*/
+static HRESULT JptrcrsLoadIndexChunk(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part,
+	__in ULONGLONG Offset
+	)
+{
+	PJPTRC_INDEX_CHUNK Chunk;
+	PJPTRC_INDEX_CLIENT Clients;
+	HRESULT Hr;
+	PULONGLONG ImageInfoOffsets = NULL;
+	ULONG ImageInfoCount;
+	ULONG Index;
+
+	Hr = JptrcrsMapPart( File, Part, Offset, &Chunk );
+	if ( FAILED( Hr ) )
+	{
+		return Hr;
+	}
+
+	//
+	// Loading modules requires mapping other chunks, so copy the
+	// image info offsets first.
+	//
+	ImageInfoCount = Chunk->ImageInfoCount;
+	if ( ImageInfoCount > 0 )
+	{
+		ImageInfoOffsets = ( PULONGLONG ) malloc( 
+			ImageInfoCount * sizeof( ULONGLONG ) );
+		if ( ImageInfoOffsets == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		CopyMemory(
+			ImageInfoOffsets,
+			JPTRC_INDEX_IMAGE_INFO_OFFSETS( Chunk ),
+			ImageInfoCount * sizeof( ULONGLONG ) );
+	}
+
+	for ( Index = 0; Index < ImageInfoCount; Index++ )
+	{
+		PJPTRC_CHUNK_HEADER MetadataChunk;
+		
+		if ( ImageInfoOffsets[ Index ] < sizeof( JPTRC_FILE_HEADER ) ||
+			 ImageInfoOffsets[ Index ] >= Offset ||
+			 ( ImageInfoOffsets[ Index ] % JPTRC_CHUNK_ALIGNMENT ) != 0 )
+		{
+			Hr = JPTRCR_E_CORRUPT_CHUNK;
+			goto Cleanup;
+		}
+
+		Hr = JptrcrsMapPart( File, Part, ImageInfoOffsets[ Index ], &MetadataChunk );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		if ( MetadataChunk->Reserved != 0 )
+		{
+			Hr = JPTRCR_E_CORRUPT_CHUNK;
+			goto Cleanup;
+		}
+		else if ( MetadataChunk->Size > JPTRC_SEGMENT_SIZE -
+					( ImageInfoOffsets[ Index ] % JPTRC_SEGMENT_SIZE ) )
+		{
+			Hr = JPTRCR_E_CHUNK_STRADDLES_SEGMENT;
+			goto Cleanup;
+		}
+		else if ( MetadataChunk->Type == JPTRC_CHUNK_TYPE_IMAGE_INFO )
+		{
+			Hr = JptrcrsLoadModuleForImage( 
+				File, 
+				( PJPTRC_IMAGE_INFO_CHUNK ) MetadataChunk );
+		}
+		else if ( MetadataChunk->Type == JPTRC_CHUNK_TYPE_SYMBOL_TABLE )
+		{
+			Hr = JptrcrpLoadSymbolTable( 
+				File, 
+				( PJPTRC_SYMBOL_TABLE_CHUNK ) MetadataChunk );
+		}
+		else if ( MetadataChunk->Type == JPTRC_CHUNK_TYPE_CALIBRATION )
+		{
+			Hr = JptrcrpLoadCalibration( 
+				File, 
+				( PJPTRC_CALIBRATION_CHUNK ) MetadataChunk );
+		}
+		else
+		{
+			Hr = JPTRCR_E_CORRUPT_CHUNK;
+		}
+
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+	}
+
+	//
+	// Register clients. This does not require mapping, so the chunk
+	// remains mapped.
+	//
+	Hr = JptrcrsMapPart( File, Part, Offset, &Chunk );
+	if ( FAILED( Hr ) )
+	{
+		goto Cleanup;
+	}
+
+	Clients = JPTRC_INDEX_CLIENTS( Chunk );
+	for ( Index = 0; Index < Chunk->ClientCount; Index++ )
+	{
+		JPTRCR_CLIENT Client;
+
+		if ( Clients[ Index ].ChunkCount == 0 )
+		{
+			continue;
+		}
+
+		Client.ProcessId	= Clients[ Index ].ProcessId;
+		Client.ThreadId		= Clients[ Index ].ThreadId;
+
+		Hr = JptrcrpRegisterIndexedClient(
+			File,
+			&Client,
+			Part->BaseOffset + Offset,
+			Part->BaseOffset,
+			Clients[ Index ].FirstChunk,
+			Clients[ Index ].ChunkCount );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+	}
+
+	Hr = S_OK;
+
+Cleanup:
+	free( ImageInfoOffsets );
+	return Hr;
+}
+
+/*++
+	Routine Description:
+		Perform inventory using the index chunks. Only index chunks
+		and image info chunks are read, trace buffer chunks are 
+		not touched until the calls of the respective client are
+		enumerated.
+
+	Return Value:
+		S_OK if inventory has been performed.
+		S_FALSE if the file lacks a usable index and needs to be 
+			scanned. Nothing has been registered in this case.
+		Any other failure HRESULT.
+--*/
+static HRESULT JptrcrsPerformIndexedFileInventory(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_FILE_PART Part
+	)
+{
+	HRESULT Hr;
+	ULONG Index;
+	ULONG IndexCount;
+	PULONGLONG IndexOffsets;
+
+	Hr = JptrcrsCollectIndexChunks( File, Part, &IndexOffsets, &IndexCount );
+	if ( Hr != S_OK )
+	{
+		return Hr;
+	}
+
+	for ( Index = 0; Index < IndexCount; Index++ )
+	{
+		Hr = JptrcrsLoadIndexChunk( File, Part, IndexOffsets[ Index ] );
+		if ( FAILED( Hr ) )
+		{
+			break;
+		}
+	}
+
+	free( IndexOffsets );
+	return Hr;
+}
+
+/*++
+	Routine Description:
+		Open a file and create a mapping. BaseOffset is not 
+		assigned.
+--*/
+static HRESULT JptrcrsOpenPart(
+	__in PCWSTR FilePath,
+	__out PJPTRCRP_FILE_PART Part
+	)
+{
+	HANDLE FileHandle;
+	HANDLE FileMapping;
+	LARGE_INTEGER FileSize;
+	HRESULT Hr;
+
+	//
+	// Open the file for reading. The file may still be open for
+	// writing by the tracing session.
+	//
+	FileHandle = CreateFile(
+		FilePath,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		0,
+		NULL );
+	if ( FileHandle == INVALID_HANDLE_VALUE )
+	{
+		return HRESULT_FROM_WIN32( GetLastError() );
+	}
+
+	if ( GetFileType( FileHandle ) != FILE_TYPE_DISK )
+	{
+		Hr = E_INVALIDARG;
+		goto Cleanup;
+	}
+
+	FileSize.LowPart = GetFileSize( FileHandle, ( PDWORD ) &FileSize.HighPart );
+	if ( FileSize.LowPart == INVALID_FILE_SIZE &&
+		 GetLastError() != ERROR_SUCCESS )
+	{
+		Hr = HRESULT_FROM_WIN32( GetLastError() );
+		goto Cleanup;
+	}
+
+	if ( FileSize.QuadPart == 0 )
+	{
+		Hr = JPTRCR_E_FILE_EMPTY;
+		goto Cleanup;
+	}
+
+	//
+	// Crate a file mapping.
+	//
+	FileMapping = CreateFileMapping(
+		FileHandle,
+		NULL,
+		PAGE_READONLY | SEC_COMMIT,
+		0,
+		0,
+		NULL );
+	if ( FileMapping == NULL )
+	{
+		Hr = HRESULT_FROM_WIN32( GetLastError() );
+		goto Cleanup;
+	}
+
+	Part->Handle			= FileHandle;
+	Part->Mapping			= FileMapping;
+	Part->Size				= FileSize.QuadPart;
+	Part->BaseOffset		= 0;
+	Part->SequenceNumber	= 0;
+
+	Hr = S_OK;
+
+Cleanup:
+	if ( FAILED( Hr ) )
+	{
+		VERIFY( CloseHandle( FileHandle ) );
+	}
+
+	return Hr;
+}
+
+/*++
+	Routine Description:
+		Assign logical offsets to all parts in their current order.
+		Parts are aligned to mapping boundaries.
+--*/
+static VOID JptrcrsAssignBaseOffsets(
+	__in PJPTRCRP_FILE File
+	)
+{
+	ULONGLONG BaseOffset = 0;
+	ULONG Index;
+
+	//
+	// Existing mappings refer to the previous layout.
+	//
+	( VOID ) JptrcrsTrimMappings( File, 0 );
+
+	for ( Index = 0; Index < File->PartCount; Index++ )
+	{
+		File->Parts[ Index ].BaseOffset = BaseOffset;
+
+		BaseOffset += File->Parts[ Index ].Size;
+		BaseOffset = ( BaseOffset + JPTRCRP_MAPPING_WINDOW_SIZE - 1 ) &
+			~( ( ULONGLONG ) JPTRCRP_MAPPING_WINDOW_SIZE - 1 );
+	}
+}
+
+static int __cdecl JptrcrsComparePartSequenceNumbers(
+	__in const void *Lhs,
+	__in const void *Rhs
+	)
+{
+	ULONG LhsNumber = ( ( PJPTRCRP_FILE_PART ) Lhs )->SequenceNumber;
+	ULONG RhsNumber = ( ( PJPTRCRP_FILE_PART ) Rhs )->SequenceNumber;
+
+	return LhsNumber < RhsNumber ? -1 : ( LhsNumber > RhsNumber ? 1 : 0 );
+}
+
+/*++
+	Routine Description:
+		Read the continuation chunks of all parts, check that the
+		parts are consecutive members of the same set and sort
+		them.
+--*/
+static HRESULT JptrcrsOrderFileSet(
+	__in PJPTRCRP_FILE File
+	)
+{
+	PJPTRC_CONTINUATION_CHUNK Chunk;
+	HRESULT Hr;
+	ULONG Index;
+	ULONGLONG SetId = 0;
+
+	ASSERT( File->PartCount > 1 );
+
+	JptrcrsAssignBaseOffsets( File );
+
+	for ( Index = 0; Index < File->PartCount; Index++ )
+	{
+		Hr = JptrcrsMapPart( 
+			File, 
+			&File->Parts[ Index ], 
+			sizeof( JPTRC_FILE_HEADER ), 
+			&Chunk );
+		if ( Hr == JPTRCR_E_EOF )
+		{
+			return JPTRCR_E_FILE_SET_MISMATCH;
+		}
+		else if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+
+		if ( File->Parts[ Index ].Size < 
+				sizeof( JPTRC_FILE_HEADER ) + sizeof( JPTRC_CONTINUATION_CHUNK ) ||
+			 Chunk->Header.Type != JPTRC_CHUNK_TYPE_CONTINUATION ||
+			 Chunk->Header.Reserved != 0 ||
+			 Chunk->Header.Size != sizeof( JPTRC_CONTINUATION_CHUNK ) ||
+			 Chunk->Reserved != 0 ||
+			 ( Index > 0 && Chunk->SetId != SetId ) )
+		{
+			return JPTRCR_E_FILE_SET_MISMATCH;
+		}
+
+		SetId = Chunk->SetId;
+		File->Parts[ Index ].SequenceNumber = Chunk->SequenceNumber;
+	}
+
+	qsort( 
+		File->Parts, 
+		File->PartCount, 
+		sizeof( JPTRCRP_FILE_PART ), 
+		JptrcrsComparePartSequenceNumbers );
+
+	for ( Index = 1; Index < File->PartCount; Index++ )
+	{
+		if ( File->Parts[ Index ].SequenceNumber != 
+			 File->Parts[ Index - 1 ].SequenceNumber + 1 )
+		{
+			return JPTRCR_E_FILE_SET_MISMATCH;
+		}
+	}
+
+	JptrcrsAssignBaseOffsets( File );
+
+	return S_OK;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Exports.
+ *
+ */
+
+HRESULT JptrcrOpenFile(
+	__in PCWSTR FilePath,
+	__out JPTRCRHANDLE *Handle
+	)
+{
+	if ( ! FilePath || ! Handle )
+	{
+		return E_INVALIDARG;
+	}
+
+	return JptrcrOpenFileSet( 1, &FilePath, Handle );
+}
+
+HRESULT JptrcrOpenFileSet(
+	__in ULONG FileCount,
+	__in_ecount( FileCount ) PCWSTR *FilePaths,
+	__out JPTRCRHANDLE *Handle
+	)
+{
+	DWORD AdditionalOptions;
+	PJPTRCRP_FILE File = NULL;
+	USHORT Characteristics;
+	HRESULT Hr;
+	ULONG Index;
+	
+	BOOL ClientsTableInitialited = FALSE;
+	BOOL ModulesTableInitialited = FALSE;
+	BOOL SymbolsTableInitialized = FALSE;
+	BOOL SymInitialized = FALSE;
+
+	if ( FileCount == 0 || 
+		 FileCount > MAXULONG / sizeof( JPTRCRP_FILE_PART ) ||
+		 ! FilePaths || 
+		 ! Handle )
+	{
+		return E_INVALIDARG;
+	}
+
+	*Handle = NULL;
+
+	for ( Index = 0; Index < FileCount; Index++ )
+	{
+		if ( FilePaths[ Index ] == NULL )
+		{
+			return E_INVALIDARG;
+		}
+	}
+
+	//
+	// Allocate and initialize own file structure.
+	//
+	File = ( PJPTRCRP_FILE ) malloc( 
+		FIELD_OFFSET( JPTRCRP_FILE, Parts[ FileCount ] ) );
+	if ( File == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	ZeroMemory( File, FIELD_OFFSET( JPTRCRP_FILE, Parts[ FileCount ] ) );
+
+	File->Signature			= JPTRCRP_FILE_SIGNATURE;
+
+	InitializeCriticalSection( &File->Lock );
+
+	InitializeListHead( &File->Mappings.LruListHead );
+	File->Mappings.Capacity			= JPTRCRP_DEFAULT_MAPPING_CAPACITY;
+	File->Mappings.LastMapIndex		= ( ULONGLONG ) -1;
+
+	JptrcrpInitializeArena( &File->ChunkRefArena );
+
+	//
+	// Open the files. PartCount only covers opened files.
+	//
+	for ( Index = 0; Index < FileCount; Index++ )
+	{
+		Hr = JptrcrsOpenPart( FilePaths[ Index ], &File->Parts[ Index ] );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		File->PartCount++;
 	}
-	ModulesTableInitialited = TRUE;
+
+	if ( ! JphtInitializeHashtable(
+		&File->ModulesTable,
+		JptrcrpAllocateHashtableMemory,
+		JptrcrpFreeHashtableMemory,
+		JptrcrpHashModule,
+		JptrcrpEqualsModule,
+		63 ) )
+	{
+		Hr = E_OUTOFMEMORY;
+		goto Cleanup;
+	}
+	ModulesTableInitialited = TRUE;
 
 	if ( ! JphtInitializeHashtable(
 		&File->ClientsTable,
@@ -306,16 +1438,25 @@ HRESULT JptrcrOpenFile(
 	ClientsTableInitialited = TRUE;
 
 	//
-	// Initialize dbghelp.
+	// The table caches all procedures encountered, which usually
+	// amount to a few thousand.
 	//
-	if ( ! SymInitialize( JPTRCRP_SYM_PSEUDO_HANDLE, NULL, FALSE ) )
+	if ( ! JphtInitializeHashtable(
+		&File->SymbolsTable,
+		JptrcrpAllocateHashtableMemory,
+		JptrcrpFreeHashtableMemory,
+		JptrcrpHashSymbol,
+		JptrcrpEqualsSymbol,
+		2047 ) )
 	{
-		Hr = HRESULT_FROM_WIN32( GetLastError() );
+		Hr = E_OUTOFMEMORY;
 		goto Cleanup;
 	}
-	SymInitialized = TRUE;
-	File->SymHandle = JPTRCRP_SYM_PSEUDO_HANDLE;
+	SymbolsTableInitialized = TRUE;
 
+	//
+	// Initialize dbghelp.
+	//
 	AdditionalOptions = 
 			SYMOPT_DEFERRED_LOADS |
 			SYMOPT_CASE_INSENSITIVE |
@@ -323,57 +1464,146 @@ HRESULT JptrcrOpenFile(
 #if DBG
 	AdditionalOptions |= SYMOPT_DEBUG;
 #endif
-	SymSetOptions( SymGetOptions() | AdditionalOptions );
 
-	File->CurrentMapping.Offset			= 0;
-	File->CurrentMapping.MappedAddress	= NULL;
+	EnterCriticalSection( &JptrcrpDbghelpLock );
+	SymInitialized = SymInitialize( JPTRCRP_SYM_PSEUDO_HANDLE, NULL, FALSE );
+	if ( SymInitialized )
+	{
+		SymSetOptions( SymGetOptions() | AdditionalOptions );
+	}
+	else
+	{
+		Hr = HRESULT_FROM_WIN32( GetLastError() );
+	}
+	LeaveCriticalSection( &JptrcrpDbghelpLock );
 
-	Hr = JptrcrsReadFileHeader( File );
-	if ( FAILED( Hr ) )
+	if ( ! SymInitialized )
 	{
 		goto Cleanup;
 	}
+	File->SymHandle = JPTRCRP_SYM_PSEUDO_HANDLE;
+
+	if ( File->PartCount > 1 )
+	{
+		Hr = JptrcrsOrderFileSet( File );
+	}
+	else
+	{
+		JptrcrsAssignBaseOffsets( File );
+		Hr = S_OK;
+	}
 
-	//
-	// File opened and appears to be valid, perform inventory.
-	//
-	Hr = JptrcrsPerformFileInventory( File );
 	if ( FAILED( Hr ) )
 	{
 		goto Cleanup;
 	}
 
+	for ( Index = 0; Index < File->PartCount; Index++ )
+	{
+		PJPTRCRP_FILE_PART Part = &File->Parts[ Index ];
+		BOOL LastPart = ( Index == File->PartCount - 1 );
+
+		Hr = JptrcrsReadFileHeader( File, Part, &Characteristics );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		//
+		// File opened and appears to be valid, perform inventory. 
+		// Prefer the index, scan the file if it has none (e.g. 
+		// because tracing has not been stopped properly).
+		//
+		if ( Characteristics & JPTRC_CHARACTERISTIC_CIRCULAR )
+		{
+			if ( File->PartCount > 1 )
+			{
+				Hr = JPTRCR_E_FILE_SET_MISMATCH;
+			}
+			else
+			{
+				Hr = JptrcrsPerformCircularFileInventory( File, Part );
+			}
+		}
+		else
+		{
+			//
+			// Only the last part may still be written to.
+			//
+			File->Tail.Supported	= TRUE;
+			File->Tail.ScannedEnd	= Part->BaseOffset + Part->Size;
+
+			Hr = JptrcrsPerformIndexedFileInventory( File, Part );
+			if ( Hr == S_FALSE )
+			{
+				TRACE( ( L"No usable index, scanning file\n" ) );
+				Hr = JptrcrsPerformFileInventory( 
+					File, 
+					Part,
+					LastPart ? &File->Tail.ScannedEnd : NULL );
+			}
+		}
+
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+	}
+
 	*Handle = File;
 
 Cleanup:
 	if ( FAILED( Hr ) )
 	{
-		if ( SymInitialized )
-		{
-			SymCleanup( JPTRCRP_SYM_PSEUDO_HANDLE );
-		}
+		( VOID ) JptrcrsTrimMappings( File, 0 );
 
 		if ( ClientsTableInitialited )
 		{
+			JphtEnumerateEntries( 
+				&File->ClientsTable,
+				JptrcrsRemoveAndDeleteClient,
+				NULL );
 			JphtDeleteHashtable( &File->ClientsTable );
 		}
 
+		JptrcrpDeleteArena( &File->ChunkRefArena );
+
+		if ( SymbolsTableInitialized )
+		{
+			JphtEnumerateEntries( 
+				&File->SymbolsTable,
+				JptrcrpRemoveAndDeleteSymbol,
+				NULL );
+			JphtDeleteHashtable( &File->SymbolsTable );
+		}
+
+		free( File->SymbolIds.Entries );
+		JptrcrpDeleteRetiredSymbols( File );
+
 		if ( ModulesTableInitialited )
 		{
+			JphtEnumerateEntries( 
+				&File->ModulesTable,
+				JptrcrpRemoveAndDeleteModule,
+				NULL );
 			JphtDeleteHashtable( &File->ModulesTable );
 		}
 
-		if ( File != NULL )
+		if ( SymInitialized )
 		{
-			free( File );
+			EnterCriticalSection( &JptrcrpDbghelpLock );
+			SymCleanup( JPTRCRP_SYM_PSEUDO_HANDLE );
+			LeaveCriticalSection( &JptrcrpDbghelpLock );
 		}
 
-		if ( FileMapping != NULL )
+		for ( Index = 0; Index < File->PartCount; Index++ )
 		{
-			VERIFY( CloseHandle( FileMapping ) );
+			VERIFY( CloseHandle( File->Parts[ Index ].Mapping ) );
+			VERIFY( CloseHandle( File->Parts[ Index ].Handle ) );
 		}
 
-		VERIFY( CloseHandle( FileHandle ) );
+		DeleteCriticalSection( &File->Lock );
+		free( File );
 	}
 
 	return Hr;
@@ -384,6 +1614,7 @@ JPTRCRAPI HRESULT JptrcrCloseFile(
 	)
 {
 	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) Handle;
+	ULONG Index;
 
 	if ( ! File ||
 		 File->Signature != JPTRCRP_FILE_SIGNATURE )
@@ -391,7 +1622,7 @@ JPTRCRAPI HRESULT JptrcrCloseFile(
 		return E_INVALIDARG;
 	}
 
-	UnmapViewOfFile( File->CurrentMapping.MappedAddress );
+	( VOID ) JptrcrsTrimMappings( File, 0 );
 
 	//
 	// Delete all dependents.
@@ -400,29 +1631,141 @@ JPTRCRAPI HRESULT JptrcrCloseFile(
 		&File->ClientsTable,
 		JptrcrsRemoveAndDeleteClient,
 		NULL );
+	JphtEnumerateEntries( 
+		&File->SymbolsTable,
+		JptrcrpRemoveAndDeleteSymbol,
+		NULL );
 	JphtEnumerateEntries( 
 		&File->ModulesTable,
 		JptrcrpRemoveAndDeleteModule,
 		NULL );
 
 	JphtDeleteHashtable( &File->ClientsTable );
+	JphtDeleteHashtable( &File->SymbolsTable );
 	JphtDeleteHashtable( &File->ModulesTable );
 
-	VERIFY( CloseHandle( File->File.Mapping ) );
-	VERIFY( CloseHandle( File->File.Handle ) );
+	JptrcrpDeleteArena( &File->ChunkRefArena );
+
+	free( File->SymbolIds.Entries );
+	JptrcrpDeleteRetiredSymbols( File );
+
+	for ( Index = 0; Index < File->PartCount; Index++ )
+	{
+		VERIFY( CloseHandle( File->Parts[ Index ].Mapping ) );
+		VERIFY( CloseHandle( File->Parts[ Index ].Handle ) );
+	}
+
+	DeleteCriticalSection( &File->Lock );
 	free( File );
 
 	return S_OK;
 }
 
+HRESULT JptrcrRefreshFile(
+	__in JPTRCRHANDLE FileHandle,
+	__in_opt JPTRCR_REFRESH_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	LARGE_INTEGER FileSize;
+	HRESULT Hr;
+	PJPTRCRP_FILE_PART Part;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE )
+	{
+		return E_INVALIDARG;
+	}
+
+	if ( ! File->Tail.Supported )
+	{
+		return JPTRCR_E_REFRESH_NOT_SUPPORTED;
+	}
+
+	//
+	// N.B. Readers on other threads are blocked for the duration 
+	// of the refresh, including the callbacks.
+	//
+	EnterCriticalSection( &File->Lock );
+
+	Part = &File->Parts[ File->PartCount - 1 ];
+
+	if ( ! GetFileSizeEx( Part->Handle, &FileSize ) )
+	{
+		Hr = HRESULT_FROM_WIN32( GetLastError() );
+		goto Cleanup;
+	}
+
+	if ( ( ULONGLONG ) FileSize.QuadPart > Part->Size )
+	{
+		HANDLE FileMapping;
+
+		//
+		// The mapping object is limited to the size the file had
+		// when it was created - replace it. Views of the old 
+		// mapping may be smaller than a window, so discard them.
+		//
+		FileMapping = CreateFileMapping(
+			Part->Handle,
+			NULL,
+			PAGE_READONLY | SEC_COMMIT,
+			0,
+			0,
+			NULL );
+		if ( FileMapping == NULL )
+		{
+			Hr = HRESULT_FROM_WIN32( GetLastError() );
+			goto Cleanup;
+		}
+
+		( VOID ) JptrcrsTrimMappings( File, 0 );
+		File->Mappings.LastMapIndex = ( ULONGLONG ) -1;
+
+		VERIFY( CloseHandle( Part->Mapping ) );
+		Part->Mapping	= FileMapping;
+		Part->Size		= FileSize.QuadPart;
+	}
+
+	if ( File->Tail.ScannedEnd >= Part->BaseOffset + Part->Size )
+	{
+		Hr = S_FALSE;
+		goto Cleanup;
+	}
+
+	JptrcrpResetClientUpdates( File );
+
+	Hr = JptrcrpScanChunks(
+		File,
+		File->Tail.ScannedEnd,
+		Part->BaseOffset + Part->Size,
+		&File->Tail.ScannedEnd );
+
+	//
+	// Report the chunks registered so far even if scanning has 
+	// failed midway.
+	//
+	if ( JptrcrpReportClientUpdates( File, Callback, Context ) == 0 &&
+		 SUCCEEDED( Hr ) )
+	{
+		Hr = S_FALSE;
+	}
+
+Cleanup:
+	LeaveCriticalSection( &File->Lock );
+
+	return Hr;
+}
+
 HRESULT JptrcrpMap( 
 	__in PJPTRCRP_FILE File,
 	__in ULONGLONG Offset,
 	__out PVOID *MappedAddress
 	)
 {
-	LARGE_INTEGER Li;
+	PJPTRCRP_MAPPING Mapping;
 	ULONGLONG MapIndex;
+	PJPTRCRP_FILE_PART Part;
 
 	ASSERT( File && File->Signature == JPTRCRP_FILE_SIGNATURE );
 	ASSERT( MappedAddress );
@@ -433,76 +1776,197 @@ HRESULT JptrcrpMap(
 		return E_INVALIDARG;
 	}
 
-	if ( Offset >= File->File.Size )
+	*MappedAddress = NULL;
+
+	Part = JptrcrsFindPart( File, Offset );
+	if ( Part == NULL )
 	{
 		return JPTRCR_E_EOF;
 	}
 
-	*MappedAddress = NULL;
-
-	//
-	// Action required?
-	//
-	MapIndex = Offset / ( JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_MAP_AT_ONCE );
-	if ( File->CurrentMapping.MappedAddress != NULL &&
-		 MapIndex == File->CurrentMapping.MapIndex )
+	MapIndex = Offset / JPTRCRP_MAPPING_WINDOW_SIZE;
+	Mapping = JptrcrsLookupMapping( File, MapIndex );
+	if ( Mapping != NULL )
 	{
-		ASSERT( File->CurrentMapping.Offset <= Offset );
-		ASSERT( File->CurrentMapping.Offset + 
-			( JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_MAP_AT_ONCE ) > Offset );
+		File->Mappings.Statistics.Hits++;
 
 		//
-		// Already mapped.
+		// Make it the most recently used window.
 		//
+		if ( File->Mappings.LruListHead.Flink != &Mapping->ListEntry )
+		{
+			RemoveEntryList( &Mapping->ListEntry );
+			InsertHeadList( &File->Mappings.LruListHead, &Mapping->ListEntry );
+		}
 	}
 	else
 	{
-		ULONG SizeToMap;
+		HRESULT Hr;
 
-		//
-		// Re-mapping required.
-		//
-		// Unmap.
-		//
-		if ( File->CurrentMapping.MappedAddress != NULL )
+		File->Mappings.Statistics.Misses++;
+
+		Hr = JptrcrsMapWindow( File, Part, MapIndex, &Mapping );
+		if ( FAILED( Hr ) )
 		{
-			if ( ! UnmapViewOfFile( File->CurrentMapping.MappedAddress ) )
-			{
-				return HRESULT_FROM_WIN32( GetLastError() );
-			}
+			return Hr;
 		}
+	}
 
+	if ( MapIndex != File->Mappings.LastMapIndex )
+	{
 		//
-		// Map. If we are at the end of the file, we may have to map
-		// less than JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_MAP_AT_ONCE.
+		// Moving on to the adjacent window indicates a sequential
+		// scan - stay one window ahead.
 		//
-		File->CurrentMapping.MapIndex	= MapIndex;
-		File->CurrentMapping.Offset		= MapIndex * 
-			( JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_MAP_AT_ONCE );
-		
-		SizeToMap = ( ULONG ) min( 
-			( ULONGLONG ) ( JPTRC_SEGMENT_SIZE * JPTRCRP_SEGMENTS_MAP_AT_ONCE ),
-			( File->File.Size - File->CurrentMapping.Offset ) );
-
-		Li.QuadPart = File->CurrentMapping.Offset;
-		File->CurrentMapping.MappedAddress = 
-			File->CurrentMapping.MappedAddress = MapViewOfFile(
-				File->File.Mapping,
-				FILE_MAP_READ,
-				Li.HighPart,
-				Li.LowPart,
-				SizeToMap );
-		if ( File->CurrentMapping.MappedAddress == NULL )
-		{
-			File->CurrentMapping.MapIndex	= 0;
-			File->CurrentMapping.Offset		= 0;
+		if ( MapIndex == File->Mappings.LastMapIndex + 1 )
+		{
+			JptrcrsPrefetchWindow( File, Part, MapIndex );
+		}
+
+		File->Mappings.LastMapIndex = MapIndex;
+	}
+
+	ASSERT( File->Mappings.LruListHead.Flink == &Mapping->ListEntry );
+
+	*MappedAddress = ( PUCHAR ) Mapping->MappedAddress + 
+		( Offset - MapIndex * JPTRCRP_MAPPING_WINDOW_SIZE );
+
+	return S_OK;
+}
+
+VOID JptrcrpInitializePrivateMapping(
+	__out PJPTRCRP_PRIVATE_MAPPING Mapping
+	)
+{
+	ASSERT( Mapping );
+
+	Mapping->MapIndex		= ( ULONGLONG ) -1;
+	Mapping->MappedAddress	= NULL;
+}
+
+HRESULT JptrcrpMapPrivate( 
+	__in PJPTRCRP_FILE File,
+	__inout PJPTRCRP_PRIVATE_MAPPING Mapping,
+	__in ULONGLONG Offset,
+	__out PVOID *MappedAddress
+	)
+{
+	LARGE_INTEGER Li;
+	ULONGLONG MapIndex;
+	PJPTRCRP_FILE_PART Part;
+	ULONGLONG WindowOffset;
+
+	ASSERT( File && File->Signature == JPTRCRP_FILE_SIGNATURE );
+	ASSERT( Mapping );
+	ASSERT( MappedAddress );
+
+	*MappedAddress = NULL;
+
+	MapIndex		= Offset / JPTRCRP_MAPPING_WINDOW_SIZE;
+	WindowOffset	= MapIndex * JPTRCRP_MAPPING_WINDOW_SIZE;
+
+	if ( MapIndex != Mapping->MapIndex )
+	{
+		Part = JptrcrsFindPart( File, Offset );
+		if ( Part == NULL )
+		{
+			return JPTRCR_E_EOF;
+		}
+
+		JptrcrpUnmapPrivate( Mapping );
+
+		Li.QuadPart = WindowOffset - Part->BaseOffset;
+		Mapping->MappedAddress = MapViewOfFile(
+			Part->Mapping,
+			FILE_MAP_READ,
+			Li.HighPart,
+			Li.LowPart,
+			( SIZE_T ) min( 
+				( ULONGLONG ) JPTRCRP_MAPPING_WINDOW_SIZE,
+				( Part->BaseOffset + Part->Size - WindowOffset ) ) );
+		if ( Mapping->MappedAddress == NULL )
+		{
 			return HRESULT_FROM_WIN32( GetLastError() );
 		}
+
+		Mapping->MapIndex = MapIndex;
+	}
+
+	*MappedAddress = ( PUCHAR ) Mapping->MappedAddress + 
+		( Offset - WindowOffset );
+
+	return S_OK;
+}
+
+VOID JptrcrpUnmapPrivate(
+	__inout PJPTRCRP_PRIVATE_MAPPING Mapping
+	)
+{
+	ASSERT( Mapping );
+
+	if ( Mapping->MappedAddress != NULL )
+	{
+		VERIFY( UnmapViewOfFile( Mapping->MappedAddress ) );
+	}
+
+	JptrcrpInitializePrivateMapping( Mapping );
+}
+
+BOOL JptrcrpIsMappedPrivate(
+	__in PJPTRCRP_PRIVATE_MAPPING Mapping,
+	__in ULONGLONG Offset
+	)
+{
+	ASSERT( Mapping );
+
+	return ( Mapping->MappedAddress != NULL &&
+			 Mapping->MapIndex == Offset / JPTRCRP_MAPPING_WINDOW_SIZE )
+		? TRUE
+		: FALSE;
+}
+
+HRESULT JptrcrSetMappingCacheCapacity(
+	__in JPTRCRHANDLE FileHandle,
+	__in ULONG Capacity
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 Capacity == 0 ||
+		 Capacity > JPTRCRP_MAX_MAPPING_CAPACITY )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnterCriticalSection( &File->Lock );
+
+	File->Mappings.Capacity = Capacity;
+	( VOID ) JptrcrsTrimMappings( File, Capacity );
+
+	LeaveCriticalSection( &File->Lock );
+
+	return S_OK;
+}
+
+HRESULT JptrcrGetMappingStatistics(
+	__in JPTRCRHANDLE FileHandle,
+	__out PJPTRCR_MAPPING_STATISTICS Statistics
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 Statistics == NULL )
+	{
+		return E_INVALIDARG;
 	}
 
-	*MappedAddress = ( PUCHAR ) 
-		File->CurrentMapping.MappedAddress + 
-		( Offset - File->CurrentMapping.Offset );
+	EnterCriticalSection( &File->Lock );
+	*Statistics = File->Mappings.Statistics;
+	LeaveCriticalSection( &File->Lock );
 
 	return S_OK;
 }
\ No newline at end of file
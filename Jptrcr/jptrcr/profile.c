@@ -0,0 +1,1184 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Per-procedure profile aggregation.
+ *
+ *		Clients are distributed among a pool of worker threads. Each
+ *		worker walks the transitions of a client once, keeping the
+ *		pending calls on an explicit stack, and aggregates into its
+ *		own tables. The tables of all workers are merged afterwards.
+ *
+ *		Workers neither touch the file structure nor the client
+ *		structures - they operate on a snapshot of chunk offsets and
+ *		map chunks using private mappings.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#define JPTRCRAPI
+
+#include <stdlib.h>
+#include <jptrcrp.h>
+
+#define JPTRCRP_PROFILE_SIGNATURE		'frpJ'
+#define JPTRCRP_MAX_PROFILE_THREADS		16
+#define JPTRCRP_INITIAL_STACK_CAPACITY	64
+
+/*++
+	Structure Description:
+		Aggregated calls of a procedure. Times are in ticks.
+--*/
+typedef struct _JPTRCRP_PROFILE_PROCEDURE
+{
+	union
+	{
+		//
+		// Backpointer to JPTRCRP_PROFILE_PROCEDURE::Procedure.
+		//
+		PULONGLONG Procedure;
+		JPHT_HASHTABLE_ENTRY HashtableEntry;
+	} u;
+
+	ULONGLONG Procedure;
+
+	ULONGLONG CallCount;
+	ULONGLONG InclusiveTicks;
+	ULONGLONG ExclusiveTicks;
+	ULONGLONG MinTicks;
+	ULONGLONG MaxTicks;
+	ULONGLONG Histogram[ JPTRCR_PROFILE_HISTOGRAM_BUCKETS ];
+
+	//
+	// Calls of this procedure pending on the stack of the client
+	// currently being aggregated. Used to account for recursive
+	// calls only once.
+	//
+	ULONG ActiveCalls;
+} JPTRCRP_PROFILE_PROCEDURE, *PJPTRCRP_PROFILE_PROCEDURE;
+
+typedef struct _JPTRCRP_PROFILE_EDGE_KEY
+{
+	ULONGLONG Caller;
+	ULONGLONG Callee;
+} JPTRCRP_PROFILE_EDGE_KEY, *PJPTRCRP_PROFILE_EDGE_KEY;
+
+typedef struct _JPTRCRP_PROFILE_EDGE
+{
+	union
+	{
+		//
+		// Backpointer to JPTRCRP_PROFILE_EDGE::Key.
+		//
+		PJPTRCRP_PROFILE_EDGE_KEY Key;
+		JPHT_HASHTABLE_ENTRY HashtableEntry;
+	} u;
+
+	JPTRCRP_PROFILE_EDGE_KEY Key;
+
+	ULONGLONG CallCount;
+	ULONGLONG InclusiveTicks;
+} JPTRCRP_PROFILE_EDGE, *PJPTRCRP_PROFILE_EDGE;
+
+/*++
+	Structure Description:
+		Procedures and edges. All entries are allocated from the
+		arena.
+--*/
+typedef struct _JPTRCRP_PROFILE_TABLES
+{
+	//
+	// Table of JPTRCRP_PROFILE_PROCEDURE, indexed by ULONGLONG
+	// procedure VA.
+	//
+	JPHT_HASHTABLE ProceduresTable;
+
+	//
+	// Table of JPTRCRP_PROFILE_EDGE, indexed by
+	// JPTRCRP_PROFILE_EDGE_KEY*.
+	//
+	JPHT_HASHTABLE EdgesTable;
+
+	JPTRCRP_ARENA Arena;
+} JPTRCRP_PROFILE_TABLES, *PJPTRCRP_PROFILE_TABLES;
+
+typedef struct _JPTRCRP_PROFILE
+{
+	ULONG Signature;
+	PJPTRCRP_FILE File;
+	JPTRCRP_PROFILE_TABLES Tables;
+} JPTRCRP_PROFILE, *PJPTRCRP_PROFILE;
+
+/*++
+	Structure Description:
+		Call that has been entered but has not returned yet.
+--*/
+typedef struct _JPTRCRP_PROFILE_FRAME
+{
+	PJPTRCRP_PROFILE_PROCEDURE Procedure;
+	ULONGLONG EntryTimestamp;
+
+	//
+	// Accumulated durations of direct child calls.
+	//
+	ULONGLONG ChildTicks;
+} JPTRCRP_PROFILE_FRAME, *PJPTRCRP_PROFILE_FRAME;
+
+typedef struct _JPTRCRP_PROFILE_SCAN
+{
+	PJPTRCRP_FILE File;
+
+	//
+	// Clients, largest first.
+	//
+	ULONG ClientCount;
+	PJPTRCRP_CLIENT_CHUNKS Clients;
+
+	//
+	// Index of the next client to be picked up.
+	//
+	volatile LONG NextClient;
+
+	//
+	// Set when a worker has failed - remaining clients are skipped.
+	//
+	volatile LONG Failed;
+} JPTRCRP_PROFILE_SCAN, *PJPTRCRP_PROFILE_SCAN;
+
+typedef struct _JPTRCRP_PROFILE_WORKER
+{
+	PJPTRCRP_PROFILE_SCAN Scan;
+
+	//
+	// Tables to aggregate into. The first worker uses the tables
+	// of the profile, all others use OwnTables.
+	//
+	PJPTRCRP_PROFILE_TABLES Tables;
+	JPTRCRP_PROFILE_TABLES OwnTables;
+
+	JPTRCRP_PRIVATE_MAPPING Mapping;
+	JPTRCRP_TRANSITION_BUFFER DecodeBuffer;
+
+	ULONG StackDepth;
+	ULONG StackCapacity;
+	PJPTRCRP_PROFILE_FRAME Stack;
+
+	HRESULT Result;
+} JPTRCRP_PROFILE_WORKER, *PJPTRCRP_PROFILE_WORKER;
+
+typedef struct _JPTRCRP_PROFILE_MERGE_CONTEXT
+{
+	PJPTRCRP_PROFILE_TABLES Target;
+	HRESULT Hr;
+} JPTRCRP_PROFILE_MERGE_CONTEXT, *PJPTRCRP_PROFILE_MERGE_CONTEXT;
+
+typedef struct _JPTRCRP_PROFILE_ENUM_CONTEXT
+{
+	PJPTRCRP_PROFILE Profile;
+	union
+	{
+		JPTRCR_ENUM_PROFILE_ENTRIES_ROUTINE EntriesCallback;
+		JPTRCR_ENUM_PROFILE_EDGES_ROUTINE EdgesCallback;
+	} u;
+	PVOID Context;
+} JPTRCRP_PROFILE_ENUM_CONTEXT, *PJPTRCRP_PROFILE_ENUM_CONTEXT;
+
+/*----------------------------------------------------------------------
+ *
+ * Hashtable routines.
+ *
+ */
+
+static ULONG JptrcrsHashEdge(
+	__in ULONG_PTR KeyPtr
+	)
+{
+	PJPTRCRP_PROFILE_EDGE_KEY Key = ( PJPTRCRP_PROFILE_EDGE_KEY ) ( PVOID ) KeyPtr;
+
+	return ( ( ULONG ) Key->Caller * 31 ) ^
+		( ULONG ) ( Key->Caller >> 32 ) ^
+		( ULONG ) Key->Callee ^
+		( ULONG ) ( Key->Callee >> 32 );
+}
+
+static BOOLEAN JptrcrsEqualsEdge(
+	__in ULONG_PTR KeyLhs,
+	__in ULONG_PTR KeyRhs
+	)
+{
+	PJPTRCRP_PROFILE_EDGE_KEY Lhs = ( PJPTRCRP_PROFILE_EDGE_KEY ) ( PVOID ) KeyLhs;
+	PJPTRCRP_PROFILE_EDGE_KEY Rhs = ( PJPTRCRP_PROFILE_EDGE_KEY ) ( PVOID ) KeyRhs;
+
+	return ( Lhs->Caller == Rhs->Caller && Lhs->Callee == Rhs->Callee )
+		? TRUE
+		: FALSE;
+}
+
+/*++
+	Routine Description:
+		Remove an entry. The entry itself is freed along with
+		the arena.
+--*/
+static VOID JptrcrsRemoveProfileEntry(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID Context
+	)
+{
+	PJPHT_HASHTABLE_ENTRY RemovedEntry;
+
+	UNREFERENCED_PARAMETER( Context );
+
+	JphtRemoveEntryHashtable(
+		Hashtable,
+		Entry->Key,
+		&RemovedEntry );
+	ASSERT( RemovedEntry == Entry );
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Private routines.
+ *
+ */
+
+static HRESULT JptrcrsInitializeProfileTables(
+	__out PJPTRCRP_PROFILE_TABLES Tables
+	)
+{
+	if ( ! JphtInitializeHashtable(
+		&Tables->ProceduresTable,
+		JptrcrpAllocateHashtableMemory,
+		JptrcrpFreeHashtableMemory,
+		JptrcrpHashSymbol,
+		JptrcrpEqualsSymbol,
+		2047 ) )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	if ( ! JphtInitializeHashtable(
+		&Tables->EdgesTable,
+		JptrcrpAllocateHashtableMemory,
+		JptrcrpFreeHashtableMemory,
+		JptrcrsHashEdge,
+		JptrcrsEqualsEdge,
+		4095 ) )
+	{
+		JphtDeleteHashtable( &Tables->ProceduresTable );
+		return E_OUTOFMEMORY;
+	}
+
+	JptrcrpInitializeArena( &Tables->Arena );
+
+	return S_OK;
+}
+
+static VOID JptrcrsDeleteProfileTables(
+	__in PJPTRCRP_PROFILE_TABLES Tables
+	)
+{
+	JphtEnumerateEntries(
+		&Tables->ProceduresTable,
+		JptrcrsRemoveProfileEntry,
+		NULL );
+	JphtEnumerateEntries(
+		&Tables->EdgesTable,
+		JptrcrsRemoveProfileEntry,
+		NULL );
+
+	JphtDeleteHashtable( &Tables->ProceduresTable );
+	JphtDeleteHashtable( &Tables->EdgesTable );
+
+	JptrcrpDeleteArena( &Tables->Arena );
+}
+
+static PJPTRCRP_PROFILE_PROCEDURE JptrcrsGetProfileProcedure(
+	__in PJPTRCRP_PROFILE_TABLES Tables,
+	__in ULONGLONG Procedure
+	)
+{
+	PJPHT_HASHTABLE_ENTRY Entry;
+	PJPTRCRP_PROFILE_PROCEDURE ProfileProcedure;
+	PJPHT_HASHTABLE_ENTRY OldEntry;
+
+	Entry = JphtGetEntryHashtable(
+		&Tables->ProceduresTable,
+		( ULONG_PTR ) ( PVOID ) &Procedure );
+	if ( Entry != NULL )
+	{
+		return CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_PROFILE_PROCEDURE,
+			u.HashtableEntry );
+	}
+
+	ProfileProcedure = ( PJPTRCRP_PROFILE_PROCEDURE ) JptrcrpAllocateArena(
+		&Tables->Arena,
+		sizeof( JPTRCRP_PROFILE_PROCEDURE ) );
+	if ( ProfileProcedure == NULL )
+	{
+		return NULL;
+	}
+
+	ZeroMemory( ProfileProcedure, sizeof( JPTRCRP_PROFILE_PROCEDURE ) );
+	ProfileProcedure->Procedure		= Procedure;
+	ProfileProcedure->MinTicks		= ( ULONGLONG ) -1;
+	ProfileProcedure->u.Procedure	= &ProfileProcedure->Procedure;
+
+	JphtPutEntryHashtable(
+		&Tables->ProceduresTable,
+		&ProfileProcedure->u.HashtableEntry,
+		&OldEntry );
+	ASSERT( OldEntry == NULL );
+
+	return ProfileProcedure;
+}
+
+static PJPTRCRP_PROFILE_EDGE JptrcrsGetProfileEdge(
+	__in PJPTRCRP_PROFILE_TABLES Tables,
+	__in ULONGLONG Caller,
+	__in ULONGLONG Callee
+	)
+{
+	PJPHT_HASHTABLE_ENTRY Entry;
+	PJPTRCRP_PROFILE_EDGE Edge;
+	JPTRCRP_PROFILE_EDGE_KEY Key;
+	PJPHT_HASHTABLE_ENTRY OldEntry;
+
+	Key.Caller = Caller;
+	Key.Callee = Callee;
+
+	Entry = JphtGetEntryHashtable(
+		&Tables->EdgesTable,
+		( ULONG_PTR ) ( PVOID ) &Key );
+	if ( Entry != NULL )
+	{
+		return CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_PROFILE_EDGE,
+			u.HashtableEntry );
+	}
+
+	Edge = ( PJPTRCRP_PROFILE_EDGE ) JptrcrpAllocateArena(
+		&Tables->Arena,
+		sizeof( JPTRCRP_PROFILE_EDGE ) );
+	if ( Edge == NULL )
+	{
+		return NULL;
+	}
+
+	ZeroMemory( Edge, sizeof( JPTRCRP_PROFILE_EDGE ) );
+	Edge->Key	= Key;
+	Edge->u.Key	= &Edge->Key;
+
+	JphtPutEntryHashtable(
+		&Tables->EdgesTable,
+		&Edge->u.HashtableEntry,
+		&OldEntry );
+	ASSERT( OldEntry == NULL );
+
+	return Edge;
+}
+
+static ULONG JptrcrsGetHistogramBucket(
+	__in ULONGLONG Ticks
+	)
+{
+	ULONG Bucket = 0;
+
+	//
+	// floor( log2( Ticks ) ).
+	//
+	if ( Ticks >> 32 )	{ Ticks >>= 32;	Bucket += 32; }
+	if ( Ticks >> 16 )	{ Ticks >>= 16;	Bucket += 16; }
+	if ( Ticks >> 8 )	{ Ticks >>= 8;	Bucket += 8; }
+	if ( Ticks >> 4 )	{ Ticks >>= 4;	Bucket += 4; }
+	if ( Ticks >> 2 )	{ Ticks >>= 2;	Bucket += 2; }
+	if ( Ticks >> 1 )	{ Bucket += 1; }
+
+	return min( Bucket, JPTRCR_PROFILE_HISTOGRAM_BUCKETS - 1 );
+}
+
+/*++
+	Routine Description:
+		Account for a call that has returned. The frame has already
+		been popped off the stack.
+
+	Parameters:
+		Frame			- Frame of the call.
+		CallerFrame		- Frame of the caller, NULL for top level
+						  calls.
+		ExitTimestamp	- Timestamp of the exit transition.
+--*/
+static HRESULT JptrcrsAccountCall(
+	__in PJPTRCRP_PROFILE_TABLES Tables,
+	__in PJPTRCRP_PROFILE_FRAME Frame,
+	__in_opt PJPTRCRP_PROFILE_FRAME CallerFrame,
+	__in ULONGLONG ExitTimestamp
+	)
+{
+	PJPTRCRP_PROFILE_PROCEDURE Procedure = Frame->Procedure;
+	ULONGLONG Ticks;
+
+	//
+	// Timestamps of different processors may be slightly skewed.
+	//
+	Ticks = ( ExitTimestamp >= Frame->EntryTimestamp )
+		? ExitTimestamp - Frame->EntryTimestamp
+		: 0;
+
+	Procedure->CallCount++;
+	Procedure->ExclusiveTicks += ( Ticks >= Frame->ChildTicks )
+		? Ticks - Frame->ChildTicks
+		: 0;
+	Procedure->MinTicks = min( Procedure->MinTicks, Ticks );
+	Procedure->MaxTicks = max( Procedure->MaxTicks, Ticks );
+	Procedure->Histogram[ JptrcrsGetHistogramBucket( Ticks ) ]++;
+
+	ASSERT( Procedure->ActiveCalls > 0 );
+	if ( --Procedure->ActiveCalls == 0 )
+	{
+		//
+		// Outermost call of a recursion - inner calls are already
+		// covered by this one.
+		//
+		Procedure->InclusiveTicks += Ticks;
+	}
+
+	if ( CallerFrame != NULL )
+	{
+		PJPTRCRP_PROFILE_EDGE Edge;
+
+		CallerFrame->ChildTicks += Ticks;
+
+		Edge = JptrcrsGetProfileEdge(
+			Tables,
+			CallerFrame->Procedure->Procedure,
+			Procedure->Procedure );
+		if ( Edge == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		Edge->CallCount++;
+		Edge->InclusiveTicks += Ticks;
+	}
+
+	return S_OK;
+}
+
+static HRESULT JptrcrsPushProfileFrame(
+	__in PJPTRCRP_PROFILE_WORKER Worker,
+	__in PJPTRCRP_PROFILE_PROCEDURE Procedure,
+	__in ULONGLONG EntryTimestamp
+	)
+{
+	PJPTRCRP_PROFILE_FRAME Frame;
+
+	if ( Worker->StackDepth == Worker->StackCapacity )
+	{
+		PJPTRCRP_PROFILE_FRAME NewStack;
+		ULONG NewCapacity = Worker->StackCapacity == 0
+			? JPTRCRP_INITIAL_STACK_CAPACITY
+			: Worker->StackCapacity * 2;
+
+		if ( NewCapacity <= Worker->StackCapacity ||
+			 NewCapacity > ( ( SIZE_T ) -1 ) /
+				sizeof( JPTRCRP_PROFILE_FRAME ) )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		NewStack = ( PJPTRCRP_PROFILE_FRAME ) realloc(
+			Worker->Stack,
+			NewCapacity * sizeof( JPTRCRP_PROFILE_FRAME ) );
+		if ( NewStack == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		Worker->Stack			= NewStack;
+		Worker->StackCapacity	= NewCapacity;
+	}
+
+	Frame = &Worker->Stack[ Worker->StackDepth++ ];
+	Frame->Procedure		= Procedure;
+	Frame->EntryTimestamp	= EntryTimestamp;
+	Frame->ChildTicks		= 0;
+
+	Procedure->ActiveCalls++;
+
+	return S_OK;
+}
+
+/*++
+	Routine Description:
+		Walk the transitions of a client once. Each exit transition
+		ends the innermost pending call, as in JptrcrsBuildCallIndex.
+--*/
+static HRESULT JptrcrsAggregateClient(
+	__in PJPTRCRP_PROFILE_WORKER Worker,
+	__in PJPTRCRP_CLIENT_CHUNKS Client
+	)
+{
+	ULONG Chunk;
+	HRESULT Hr = S_OK;
+
+	ASSERT( Worker->StackDepth == 0 );
+
+	for ( Chunk = 0; Chunk < Client->ChunkCount; Chunk++ )
+	{
+		PJPTRC_CHUNK_HEADER ChunkHeader;
+		ULONG Index;
+		ULONG TransitionCount;
+		PJPTRC_PROCEDURE_TRANSITION32 Transitions;
+
+		Hr = JptrcrpMapPrivate(
+			Worker->Scan->File,
+			&Worker->Mapping,
+			Client->ChunkOffsets[ Chunk ],
+			&ChunkHeader );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		Hr = JptrcrpGetChunkTransitions(
+			ChunkHeader,
+			&Worker->DecodeBuffer,
+			&Transitions,
+			&TransitionCount );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+
+		for ( Index = 0; Index < TransitionCount; Index++ )
+		{
+			PJPTRC_PROCEDURE_TRANSITION32 Transition = &Transitions[ Index ];
+
+			switch ( Transition->Type )
+			{
+			case JPTRC_PROCEDURE_TRANSITION_ENTRY:
+				{
+					PJPTRCRP_PROFILE_PROCEDURE Procedure;
+
+					Procedure = JptrcrsGetProfileProcedure(
+						Worker->Tables,
+						Transition->Procedure );
+					if ( Procedure == NULL )
+					{
+						Hr = E_OUTOFMEMORY;
+						goto Cleanup;
+					}
+
+					Hr = JptrcrsPushProfileFrame(
+						Worker,
+						Procedure,
+						Transition->Timestamp );
+				}
+				break;
+
+			case JPTRC_PROCEDURE_TRANSITION_EXIT:
+			case JPTRC_PROCEDURE_TRANSITION_UNWIND:
+				if ( Worker->StackDepth > 0 )
+				{
+					Worker->StackDepth--;
+
+					Hr = JptrcrsAccountCall(
+						Worker->Tables,
+						&Worker->Stack[ Worker->StackDepth ],
+						Worker->StackDepth > 0
+							? &Worker->Stack[ Worker->StackDepth - 1 ]
+							: NULL,
+						Transition->Timestamp );
+				}
+				else
+				{
+					//
+					// Exit on top level, see JptrcrsBuildCallIndex.
+					//
+				}
+				break;
+
+			default:
+				Hr = JPTRCR_E_INVALID_TRANSITION;
+				break;
+			}
+
+			if ( FAILED( Hr ) )
+			{
+				goto Cleanup;
+			}
+		}
+	}
+
+Cleanup:
+	//
+	// Calls that have not returned are not accounted for.
+	//
+	while ( Worker->StackDepth > 0 )
+	{
+		Worker->Stack[ --Worker->StackDepth ].Procedure->ActiveCalls--;
+	}
+
+	return Hr;
+}
+
+static DWORD CALLBACK JptrcrsProfileWorker(
+	__in PVOID PvWorker
+	)
+{
+	PJPTRCRP_PROFILE_WORKER Worker = ( PJPTRCRP_PROFILE_WORKER ) PvWorker;
+	PJPTRCRP_PROFILE_SCAN Scan = Worker->Scan;
+
+	for ( ;; )
+	{
+		LONG Index;
+
+		if ( Scan->Failed )
+		{
+			break;
+		}
+
+		Index = InterlockedIncrement( &Scan->NextClient ) - 1;
+		if ( Index >= ( LONG ) Scan->ClientCount )
+		{
+			break;
+		}
+
+		Worker->Result = JptrcrsAggregateClient(
+			Worker,
+			&Scan->Clients[ Index ] );
+		if ( FAILED( Worker->Result ) )
+		{
+			InterlockedExchange( &Scan->Failed, TRUE );
+			break;
+		}
+	}
+
+	JptrcrpUnmapPrivate( &Worker->Mapping );
+
+	return 0;
+}
+
+static VOID JptrcrsMergeProfileProcedure(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_PROFILE_MERGE_CONTEXT Context = 
+		( PJPTRCRP_PROFILE_MERGE_CONTEXT ) PvContext;
+	PJPTRCRP_PROFILE_PROCEDURE Source;
+	PJPTRCRP_PROFILE_PROCEDURE Merged;
+	ULONG Bucket;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	if ( FAILED( Context->Hr ) )
+	{
+		return;
+	}
+
+	Source = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_PROFILE_PROCEDURE,
+		u.HashtableEntry );
+
+	Merged = JptrcrsGetProfileProcedure( Context->Target, Source->Procedure );
+	if ( Merged == NULL )
+	{
+		Context->Hr = E_OUTOFMEMORY;
+		return;
+	}
+
+	Merged->CallCount		+= Source->CallCount;
+	Merged->InclusiveTicks	+= Source->InclusiveTicks;
+	Merged->ExclusiveTicks	+= Source->ExclusiveTicks;
+	Merged->MinTicks		= min( Merged->MinTicks, Source->MinTicks );
+	Merged->MaxTicks		= max( Merged->MaxTicks, Source->MaxTicks );
+
+	for ( Bucket = 0; Bucket < JPTRCR_PROFILE_HISTOGRAM_BUCKETS; Bucket++ )
+	{
+		Merged->Histogram[ Bucket ] += Source->Histogram[ Bucket ];
+	}
+}
+
+static VOID JptrcrsMergeProfileEdge(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_PROFILE_MERGE_CONTEXT Context = 
+		( PJPTRCRP_PROFILE_MERGE_CONTEXT ) PvContext;
+	PJPTRCRP_PROFILE_EDGE Source;
+	PJPTRCRP_PROFILE_EDGE Merged;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	if ( FAILED( Context->Hr ) )
+	{
+		return;
+	}
+
+	Source = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_PROFILE_EDGE,
+		u.HashtableEntry );
+
+	Merged = JptrcrsGetProfileEdge(
+		Context->Target,
+		Source->Key.Caller,
+		Source->Key.Callee );
+	if ( Merged == NULL )
+	{
+		Context->Hr = E_OUTOFMEMORY;
+		return;
+	}
+
+	Merged->CallCount		+= Source->CallCount;
+	Merged->InclusiveTicks	+= Source->InclusiveTicks;
+}
+
+/*++
+	Routine Description:
+		Merge the tables of a worker into the tables of the
+		profile.
+--*/
+static HRESULT JptrcrsMergeProfileTables(
+	__in PJPTRCRP_PROFILE_TABLES Target,
+	__in PJPTRCRP_PROFILE_TABLES Source
+	)
+{
+	JPTRCRP_PROFILE_MERGE_CONTEXT Context;
+
+	Context.Target	= Target;
+	Context.Hr		= S_OK;
+
+	JphtEnumerateEntries(
+		&Source->ProceduresTable,
+		JptrcrsMergeProfileProcedure,
+		&Context );
+	JphtEnumerateEntries(
+		&Source->EdgesTable,
+		JptrcrsMergeProfileEdge,
+		&Context );
+
+	return Context.Hr;
+}
+
+static int __cdecl JptrcrsCompareClientChunkCounts(
+	__in const void *Lhs,
+	__in const void *Rhs
+	)
+{
+	PJPTRCRP_CLIENT_CHUNKS ClientLhs = ( PJPTRCRP_CLIENT_CHUNKS ) Lhs;
+	PJPTRCRP_CLIENT_CHUNKS ClientRhs = ( PJPTRCRP_CLIENT_CHUNKS ) Rhs;
+
+	//
+	// Descending.
+	//
+	if ( ClientLhs->ChunkCount > ClientRhs->ChunkCount )
+	{
+		return -1;
+	}
+	else if ( ClientLhs->ChunkCount < ClientRhs->ChunkCount )
+	{
+		return 1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+/*++
+	Routine Description:
+		Aggregate all clients into the tables of the profile.
+--*/
+static HRESULT JptrcrsAggregateClients(
+	__in PJPTRCRP_PROFILE Profile
+	)
+{
+	HRESULT Hr;
+	ULONG InitializedWorkers = 0;
+	JPTRCRP_PROFILE_SCAN Scan;
+	SYSTEM_INFO SystemInfo;
+	ULONG Thread;
+	ULONG ThreadCount;
+	HANDLE Threads[ JPTRCRP_MAX_PROFILE_THREADS - 1 ];
+	ULONG Worker;
+	ULONG WorkerCount;
+	JPTRCRP_PROFILE_WORKER Workers[ JPTRCRP_MAX_PROFILE_THREADS ];
+	ULONG WorkerThreadCount = 0;
+
+	ZeroMemory( &Scan, sizeof( JPTRCRP_PROFILE_SCAN ) );
+	Scan.File = Profile->File;
+
+	Hr = JptrcrpGetClientChunks(
+		Profile->File,
+		&Scan.Clients,
+		&Scan.ClientCount );
+	if ( Hr != S_OK )
+	{
+		//
+		// No clients - nothing to aggregate.
+		//
+		return SUCCEEDED( Hr ) ? S_OK : Hr;
+	}
+
+	//
+	// Start with the largest clients s.t. they do not end up
+	// delaying completion.
+	//
+	qsort(
+		Scan.Clients,
+		Scan.ClientCount,
+		sizeof( JPTRCRP_CLIENT_CHUNKS ),
+		JptrcrsCompareClientChunkCounts );
+
+	GetSystemInfo( &SystemInfo );
+
+	WorkerCount = min(
+		min( SystemInfo.dwNumberOfProcessors, Scan.ClientCount ),
+		JPTRCRP_MAX_PROFILE_THREADS );
+	WorkerCount = max( WorkerCount, 1 );
+
+	ZeroMemory( Workers, sizeof( Workers ) );
+	for ( Worker = 0; Worker < WorkerCount; Worker++ )
+	{
+		Workers[ Worker ].Scan = &Scan;
+		JptrcrpInitializePrivateMapping( &Workers[ Worker ].Mapping );
+
+		if ( Worker == 0 )
+		{
+			Workers[ Worker ].Tables = &Profile->Tables;
+		}
+		else
+		{
+			Hr = JptrcrsInitializeProfileTables(
+				&Workers[ Worker ].OwnTables );
+			if ( FAILED( Hr ) )
+			{
+				goto Cleanup;
+			}
+
+			Workers[ Worker ].Tables = &Workers[ Worker ].OwnTables;
+		}
+
+		InitializedWorkers++;
+	}
+
+	//
+	// The calling thread acts as first worker.
+	//
+	ThreadCount = WorkerCount;
+	for ( Thread = 1; Thread < ThreadCount; Thread++ )
+	{
+		Threads[ WorkerThreadCount ] = CreateThread(
+			NULL,
+			0,
+			JptrcrsProfileWorker,
+			&Workers[ Thread ],
+			0,
+			NULL );
+		if ( Threads[ WorkerThreadCount ] == NULL )
+		{
+			//
+			// Make do with fewer threads.
+			//
+			break;
+		}
+
+		WorkerThreadCount++;
+	}
+
+	( VOID ) JptrcrsProfileWorker( &Workers[ 0 ] );
+
+	if ( WorkerThreadCount > 0 )
+	{
+		VERIFY( WAIT_OBJECT_0 == WaitForMultipleObjects(
+			WorkerThreadCount,
+			Threads,
+			TRUE,
+			INFINITE ) );
+
+		for ( Thread = 0; Thread < WorkerThreadCount; Thread++ )
+		{
+			VERIFY( CloseHandle( Threads[ Thread ] ) );
+		}
+	}
+
+	Hr = S_OK;
+	for ( Worker = 0; Worker < WorkerCount; Worker++ )
+	{
+		if ( FAILED( Workers[ Worker ].Result ) )
+		{
+			Hr = Workers[ Worker ].Result;
+			goto Cleanup;
+		}
+	}
+
+	for ( Worker = 1; Worker < WorkerCount; Worker++ )
+	{
+		Hr = JptrcrsMergeProfileTables(
+			&Profile->Tables,
+			&Workers[ Worker ].OwnTables );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+	}
+
+Cleanup:
+	for ( Worker = 0; Worker < InitializedWorkers; Worker++ )
+	{
+		if ( Worker > 0 )
+		{
+			JptrcrsDeleteProfileTables( &Workers[ Worker ].OwnTables );
+		}
+
+		free( Workers[ Worker ].Stack );
+		JptrcrpDeleteTransitionBuffer( &Workers[ Worker ].DecodeBuffer );
+	}
+
+	free( Scan.Clients );
+
+	return Hr;
+}
+
+static VOID JptrcrsEnumProfileProcedure(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_PROFILE_ENUM_CONTEXT Context =
+		( PJPTRCRP_PROFILE_ENUM_CONTEXT ) PvContext;
+	PJPTRCRP_FILE File;
+	JPTRCR_PROFILE_ENTRY ProfileEntry;
+	PJPTRCRP_PROFILE_PROCEDURE Procedure;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	File = Context->Profile->File;
+	Procedure = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_PROFILE_PROCEDURE,
+		u.HashtableEntry );
+
+	if ( Procedure->CallCount == 0 )
+	{
+		//
+		// Only called by calls that have not returned.
+		//
+		return;
+	}
+
+	ProfileEntry.Procedure		= Procedure->Procedure;
+	ProfileEntry.CallCount		= Procedure->CallCount;
+	ProfileEntry.InclusiveTime	= JptrcrpTicksToNanoseconds(
+		File, Procedure->InclusiveTicks );
+	ProfileEntry.ExclusiveTime	= JptrcrpTicksToNanoseconds(
+		File, Procedure->ExclusiveTicks );
+	ProfileEntry.MinDuration	= JptrcrpTicksToNanoseconds(
+		File, Procedure->MinTicks );
+	ProfileEntry.MaxDuration	= JptrcrpTicksToNanoseconds(
+		File, Procedure->MaxTicks );
+
+	CopyMemory(
+		ProfileEntry.Histogram,
+		Procedure->Histogram,
+		sizeof( ProfileEntry.Histogram ) );
+
+	JptrcrpResolveSymbol(
+		File,
+		Procedure->Procedure,
+		&ProfileEntry.Symbol,
+		&ProfileEntry.Module );
+
+	( Context->u.EntriesCallback )( &ProfileEntry, Context->Context );
+}
+
+static VOID JptrcrsEnumProfileEdge(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID PvContext
+	)
+{
+	PJPTRCRP_PROFILE_ENUM_CONTEXT Context =
+		( PJPTRCRP_PROFILE_ENUM_CONTEXT ) PvContext;
+	PJPTRCRP_PROFILE_EDGE Edge;
+	JPTRCR_PROFILE_EDGE ProfileEdge;
+
+	UNREFERENCED_PARAMETER( Hashtable );
+	ASSERT( Context );
+
+	Edge = CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_PROFILE_EDGE,
+		u.HashtableEntry );
+
+	ProfileEdge.Caller			= Edge->Key.Caller;
+	ProfileEdge.Callee			= Edge->Key.Callee;
+	ProfileEdge.CallCount		= Edge->CallCount;
+	ProfileEdge.InclusiveTime	= JptrcrpTicksToNanoseconds(
+		Context->Profile->File,
+		Edge->InclusiveTicks );
+
+	( Context->u.EdgesCallback )( &ProfileEdge, Context->Context );
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Exports.
+ *
+ */
+
+HRESULT JptrcrCreateProfile(
+	__in JPTRCRHANDLE FileHandle,
+	__out JPTRCRPROFILEHANDLE *ProfileHandle
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+	PJPTRCRP_PROFILE Profile;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 ProfileHandle == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	*ProfileHandle = NULL;
+
+	Profile = ( PJPTRCRP_PROFILE ) malloc( sizeof( JPTRCRP_PROFILE ) );
+	if ( Profile == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	Profile->Signature	= JPTRCRP_PROFILE_SIGNATURE;
+	Profile->File		= File;
+
+	Hr = JptrcrsInitializeProfileTables( &Profile->Tables );
+	if ( FAILED( Hr ) )
+	{
+		free( Profile );
+		return Hr;
+	}
+
+	//
+	// Hold the lock while the workers scan the file so that the
+	// parts are not remapped by JptrcrRefreshFile underneath.
+	//
+	EnterCriticalSection( &File->Lock );
+	Hr = JptrcrsAggregateClients( Profile );
+	LeaveCriticalSection( &File->Lock );
+
+	if ( FAILED( Hr ) )
+	{
+		JptrcrsDeleteProfileTables( &Profile->Tables );
+		free( Profile );
+		return Hr;
+	}
+
+	*ProfileHandle = Profile;
+	return S_OK;
+}
+
+HRESULT JptrcrEnumProfileEntries(
+	__in JPTRCRPROFILEHANDLE ProfileHandle,
+	__in JPTRCR_ENUM_PROFILE_ENTRIES_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	JPTRCRP_PROFILE_ENUM_CONTEXT EnumContext;
+	PJPTRCRP_PROFILE Profile = ( PJPTRCRP_PROFILE ) ProfileHandle;
+
+	if ( Profile == NULL ||
+		 Profile->Signature != JPTRCRP_PROFILE_SIGNATURE ||
+		 Callback == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnumContext.Profile				= Profile;
+	EnumContext.u.EntriesCallback	= Callback;
+	EnumContext.Context				= Context;
+
+	//
+	// Symbols and clock are resolved through the file.
+	//
+	EnterCriticalSection( &Profile->File->Lock );
+
+	JphtEnumerateEntries(
+		&Profile->Tables.ProceduresTable,
+		JptrcrsEnumProfileProcedure,
+		&EnumContext );
+
+	LeaveCriticalSection( &Profile->File->Lock );
+
+	return S_OK;
+}
+
+HRESULT JptrcrEnumProfileEdges(
+	__in JPTRCRPROFILEHANDLE ProfileHandle,
+	__in JPTRCR_ENUM_PROFILE_EDGES_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	JPTRCRP_PROFILE_ENUM_CONTEXT EnumContext;
+	PJPTRCRP_PROFILE Profile = ( PJPTRCRP_PROFILE ) ProfileHandle;
+
+	if ( Profile == NULL ||
+		 Profile->Signature != JPTRCRP_PROFILE_SIGNATURE ||
+		 Callback == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnumContext.Profile			= Profile;
+	EnumContext.u.EdgesCallback	= Callback;
+	EnumContext.Context			= Context;
+
+	//
+	// Symbols and clock are resolved through the file.
+	//
+	EnterCriticalSection( &Profile->File->Lock );
+
+	JphtEnumerateEntries(
+		&Profile->Tables.EdgesTable,
+		JptrcrsEnumProfileEdge,
+		&EnumContext );
+
+	LeaveCriticalSection( &Profile->File->Lock );
+
+	return S_OK;
+}
+
+HRESULT JptrcrDeleteProfile(
+	__in JPTRCRPROFILEHANDLE ProfileHandle
+	)
+{
+	PJPTRCRP_PROFILE Profile = ( PJPTRCRP_PROFILE ) ProfileHandle;
+
+	if ( Profile == NULL ||
+		 Profile->Signature != JPTRCRP_PROFILE_SIGNATURE )
+	{
+		return E_INVALIDARG;
+	}
+
+	JptrcrsDeleteProfileTables( &Profile->Tables );
+
+	Profile->Signature = 0;
+	free( Profile );
+
+	return S_OK;
+}
@@ -0,0 +1,235 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Scanning of transition sequences.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <jptrcrp.h>
+
+#if defined( _M_IX86 ) || defined( _M_X64 )
+#include <emmintrin.h>
+#define JPTRCRP_SCAN_SSE2
+#endif
+
+//
+// Depth change caused by each transition type. Type 3 is invalid.
+//
+static const LONG JptrcrsDepthDelta[ 4 ] = { 1, -1, -1, 0 };
+
+C_ASSERT( JPTRC_PROCEDURE_TRANSITION_ENTRY == 0 );
+C_ASSERT( JPTRC_PROCEDURE_TRANSITION_EXIT == 1 );
+C_ASSERT( JPTRC_PROCEDURE_TRANSITION_UNWIND == 2 );
+
+/*----------------------------------------------------------------------
+ *
+ * Private routines.
+ *
+ */
+
+/*++
+	Routine Description:
+		Continue a scan at StartIndex, with Scan reflecting the
+		state after the first StartIndex transitions.
+--*/
+static HRESULT JptrcrsContinueScan(
+	__in_ecount( TransitionCount ) CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG StartIndex,
+	__in ULONG TransitionCount,
+	__in LONG TargetDepth,
+	__inout PJPTRCRP_DEPTH_SCAN Scan
+	)
+{
+	LONG Depth = Scan->FinalDepth;
+	ULONG EntryCount = Scan->EntryCount;
+	ULONG Index;
+
+	for ( Index = StartIndex; Index < TransitionCount; Index++ )
+	{
+		ULONG Type = ( ULONG ) Transitions[ Index ].Type;
+
+		if ( Type > JPTRC_PROCEDURE_TRANSITION_UNWIND )
+		{
+			return JPTRCR_E_INVALID_TRANSITION;
+		}
+
+		EntryCount	+= ( Type == JPTRC_PROCEDURE_TRANSITION_ENTRY );
+		Depth		+= JptrcrsDepthDelta[ Type ];
+
+		if ( Depth == TargetDepth && Scan->BoundaryIndex == TransitionCount )
+		{
+			Scan->BoundaryIndex = Index;
+		}
+	}
+
+	Scan->EntryCount	= EntryCount;
+	Scan->FinalDepth	= Depth;
+
+	return S_OK;
+}
+
+#ifdef JPTRCRP_SCAN_SSE2
+
+static BOOL JptrcrsIsSse2Available()
+{
+#if defined( _M_X64 )
+	return TRUE;
+#else
+	return IsProcessorFeaturePresent( PF_XMMI64_INSTRUCTIONS_AVAILABLE );
+#endif
+}
+
+/*++
+	Routine Description:
+		Scan blocks of 4 transitions at a time: the type bits of
+		the transitions are gathered into a single vector, turned
+		into depth deltas and summed up as a prefix sum. The rest
+		is left to JptrcrsContinueScan.
+--*/
+static HRESULT JptrcrsScanTransitionDepthSse2(
+	__in_ecount( TransitionCount ) CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG TransitionCount,
+	__in LONG TargetDepth,
+	__out PJPTRCRP_DEPTH_SCAN Scan
+	)
+{
+	ULONG BlockCount = TransitionCount & ~3UL;
+	__m128i Depth		= _mm_setzero_si128();
+	__m128i Entries		= _mm_setzero_si128();
+	ULONG Index;
+	__m128i Invalid		= _mm_setzero_si128();
+	const __m128i MinusOne	= _mm_set1_epi32( -1 );
+	const __m128i Target	= _mm_set1_epi32( TargetDepth );
+	const __m128i TypeMask	= _mm_set1_epi32( 3 );
+
+	C_ASSERT( sizeof( JPTRC_PROCEDURE_TRANSITION32 ) == sizeof( __m128i ) );
+
+	Scan->BoundaryIndex = TransitionCount;
+
+	for ( Index = 0; Index < BlockCount; Index += 4 )
+	{
+		const __m128i *Block = ( const __m128i* ) &Transitions[ Index ];
+		__m128i Delta;
+		__m128i IsEntry;
+		__m128i Types;
+
+		//
+		// The type occupies the lowest bits of the first dword.
+		//
+		Types = _mm_unpacklo_epi64(
+			_mm_unpacklo_epi32(
+				_mm_loadu_si128( Block ),
+				_mm_loadu_si128( Block + 1 ) ),
+			_mm_unpacklo_epi32(
+				_mm_loadu_si128( Block + 2 ),
+				_mm_loadu_si128( Block + 3 ) ) );
+		Types = _mm_and_si128( Types, TypeMask );
+
+		Invalid = _mm_or_si128( Invalid, _mm_cmpeq_epi32( Types, TypeMask ) );
+
+		//
+		// IsEntry is -1 for entries, 0 otherwise. Delta is +1 for
+		// entries, -1 otherwise.
+		//
+		IsEntry	= _mm_cmpeq_epi32( Types, _mm_setzero_si128() );
+		Entries	= _mm_sub_epi32( Entries, IsEntry );
+		Delta	= _mm_sub_epi32( MinusOne, _mm_add_epi32( IsEntry, IsEntry ) );
+
+		//
+		// Running depth after each transition of the block.
+		//
+		Delta	= _mm_add_epi32( Delta, _mm_slli_si128( Delta, 4 ) );
+		Delta	= _mm_add_epi32( Delta, _mm_slli_si128( Delta, 8 ) );
+		Delta	= _mm_add_epi32( Delta, Depth );
+
+		if ( Scan->BoundaryIndex == TransitionCount )
+		{
+			ULONG Lane;
+			ULONG Mask = ( ULONG ) _mm_movemask_ps( _mm_castsi128_ps(
+				_mm_cmpeq_epi32( Delta, Target ) ) );
+
+			if ( BitScanForward( &Lane, Mask ) )
+			{
+				Scan->BoundaryIndex = Index + Lane;
+			}
+		}
+
+		Depth = _mm_shuffle_epi32( Delta, _MM_SHUFFLE( 3, 3, 3, 3 ) );
+	}
+
+	if ( _mm_movemask_epi8( Invalid ) != 0 )
+	{
+		return JPTRCR_E_INVALID_TRANSITION;
+	}
+
+	Entries = _mm_add_epi32( Entries, _mm_srli_si128( Entries, 8 ) );
+	Entries = _mm_add_epi32( Entries, _mm_srli_si128( Entries, 4 ) );
+
+	Scan->EntryCount	= ( ULONG ) _mm_cvtsi128_si32( Entries );
+	Scan->FinalDepth	= _mm_cvtsi128_si32( Depth );
+
+	return JptrcrsContinueScan(
+		Transitions,
+		BlockCount,
+		TransitionCount,
+		TargetDepth,
+		Scan );
+}
+
+#endif // JPTRCRP_SCAN_SSE2
+
+/*----------------------------------------------------------------------
+ *
+ * Internal routines.
+ *
+ */
+
+HRESULT JptrcrpScanTransitionDepthScalar(
+	__in_ecount( TransitionCount ) CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG TransitionCount,
+	__in LONG TargetDepth,
+	__out PJPTRCRP_DEPTH_SCAN Scan
+	)
+{
+	ASSERT( Transitions || TransitionCount == 0 );
+	ASSERT( Scan );
+
+	Scan->EntryCount	= 0;
+	Scan->FinalDepth	= 0;
+	Scan->BoundaryIndex	= TransitionCount;
+
+	return JptrcrsContinueScan(
+		Transitions,
+		0,
+		TransitionCount,
+		TargetDepth,
+		Scan );
+}
+
+HRESULT JptrcrpScanTransitionDepth(
+	__in_ecount( TransitionCount ) CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG TransitionCount,
+	__in LONG TargetDepth,
+	__out PJPTRCRP_DEPTH_SCAN Scan
+	)
+{
+	ASSERT( Transitions || TransitionCount == 0 );
+	ASSERT( Scan );
+
+#ifdef JPTRCRP_SCAN_SSE2
+	if ( JptrcrsIsSse2Available() )
+	{
+		return JptrcrsScanTransitionDepthSse2(
+			Transitions,
+			TransitionCount,
+			TargetDepth,
+			Scan );
+	}
+#endif
+
+	return JptrcrpScanTransitionDepthScalar(
+		Transitions,
+		TransitionCount,
+		TargetDepth,
+		Scan );
+}
@@ -0,0 +1,518 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Symbol handling. Symbols embedded in the trace file and
+ *		symbols resolved using dbghelp are cached per file.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#define JPTRCRAPI
+
+#include <stdlib.h>
+#include <jptrcrp.h>
+#include <jptrcsym.h>
+
+#define JPTRCRP_MAX_SYM_LENGTH	64
+
+typedef struct _JPTRCRP_SYMBOL_INFO
+{
+	SYMBOL_INFO Info;
+	WCHAR __NameBuffer[ JPTRCRP_MAX_SYM_LENGTH - 1 ];
+} JPTRCRP_SYMBOL_INFO, *PJPTRCRP_SYMBOL_INFO;
+
+/*++
+	Structure Description:
+		Cached result of resolving a procedure. Entries for procedures
+		that could not be resolved end before the Info field.
+--*/
+typedef struct _JPTRCRP_CACHED_SYMBOL
+{
+	union
+	{
+		//
+		// Backpointer to JPTRCRP_CACHED_SYMBOL::Procedure.
+		//
+		PULONGLONG Procedure;
+		JPHT_HASHTABLE_ENTRY HashtableEntry;
+	} u;
+
+	ULONGLONG Procedure;
+
+	//
+	// Handed out as JPTRCR_CALL::Symbol. Points to Info, NULL if
+	// the procedure could not be resolved.
+	//
+	PSYMBOL_INFO Symbol;
+
+	//
+	// Handed out as JPTRCR_CALL::Module, NULL if unknown. Looked up
+	// on first use as image info chunks may follow symbol table
+	// chunks.
+	//
+	PJPTRCR_MODULE Module;
+	BOOL ModuleResolved;
+
+	//
+	// ID handed out as JPTRCR_CALL_RECORD::SymbolId, 
+	// JPTRCR_INVALID_SYMBOL_ID if none has been assigned yet.
+	//
+	ULONG Id;
+
+	//
+	// Link in JPTRCRP_FILE::RetiredSymbols.
+	//
+	struct _JPTRCRP_CACHED_SYMBOL *NextRetired;
+
+	//
+	// The name follows.
+	//
+	SYMBOL_INFO Info;
+} JPTRCRP_CACHED_SYMBOL, *PJPTRCRP_CACHED_SYMBOL;
+
+/*----------------------------------------------------------------------
+ *
+ * Private routines.
+ *
+ */
+
+/*++
+	Routine Description:
+		Resolve a procedure using dbghelp and create a cache entry
+		for the result, whether successful or not.
+--*/
+static HRESULT JptrcrsResolveSymbolFromDbghelp(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG Procedure,
+	__out PJPTRCRP_CACHED_SYMBOL *CachedSymbol
+	)
+{
+	PJPTRCRP_CACHED_SYMBOL Entry;
+	DWORD64 Displacement;
+	ULONG NameLength;
+	JPTRCRP_SYMBOL_INFO SymbolInfo;
+	BOOL Resolved;
+
+	ASSERT( File );
+	ASSERT( CachedSymbol );
+
+	SymbolInfo.Info.SizeOfStruct	= sizeof( SYMBOL_INFO );
+	SymbolInfo.Info.MaxNameLen		= JPTRCRP_MAX_SYM_LENGTH;
+
+	EnterCriticalSection( &JptrcrpDbghelpLock );
+	Resolved = SymFromAddr(
+		File->SymHandle,
+		Procedure,
+		&Displacement,
+		&SymbolInfo.Info );
+	LeaveCriticalSection( &JptrcrpDbghelpLock );
+
+	if ( ! Resolved )
+	{
+		//
+		// Cache the failure as well - retrying is expensive and
+		// will not yield a different result.
+		//
+		Entry = ( PJPTRCRP_CACHED_SYMBOL ) malloc( 
+			FIELD_OFFSET( JPTRCRP_CACHED_SYMBOL, Info ) );
+		if ( Entry == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		Entry->Symbol			= NULL;
+		Entry->Module			= NULL;
+		Entry->ModuleResolved	= TRUE;
+		Entry->Id				= JPTRCR_INVALID_SYMBOL_ID;
+	}
+	else
+	{
+		ASSERT( Displacement == 0 );
+
+		//
+		// NameLen does not account for truncation.
+		//
+		NameLength = min( SymbolInfo.Info.NameLen, JPTRCRP_MAX_SYM_LENGTH - 1 );
+
+		Entry = ( PJPTRCRP_CACHED_SYMBOL ) malloc( FIELD_OFFSET( 
+			JPTRCRP_CACHED_SYMBOL, 
+			Info.Name[ NameLength + 1 ] ) );
+		if ( Entry == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		CopyMemory( 
+			&Entry->Info, 
+			&SymbolInfo.Info, 
+			FIELD_OFFSET( SYMBOL_INFO, Name[ NameLength ] ) );
+		Entry->Info.Name[ NameLength ]	= L'\0';
+		Entry->Info.NameLen				= NameLength;
+		Entry->Info.MaxNameLen			= NameLength + 1;
+
+		Entry->Symbol			= &Entry->Info;
+		Entry->Module			= NULL;
+		Entry->ModuleResolved	= FALSE;
+		Entry->Id				= JPTRCR_INVALID_SYMBOL_ID;
+	}
+
+	Entry->Procedure	= Procedure;
+	Entry->u.Procedure	= &Entry->Procedure;
+
+	*CachedSymbol = Entry;
+	return S_OK;
+}
+
+static PJPTRCR_MODULE JptrcrsGetSymbolModule(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRCRP_CACHED_SYMBOL CachedSymbol
+	)
+{
+	if ( ! CachedSymbol->ModuleResolved )
+	{
+		ASSERT( CachedSymbol->Symbol != NULL );
+
+		//
+		// The image may not have been recorded.
+		//
+		if ( FAILED( JptrcrGetModule( 
+			File, 
+			CachedSymbol->Symbol->ModBase,
+			&CachedSymbol->Module ) ) )
+		{
+			CachedSymbol->Module = NULL;
+		}
+
+		CachedSymbol->ModuleResolved = TRUE;
+	}
+
+	return CachedSymbol->Module;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Hashtable routines.
+ *
+ */
+
+ULONG JptrcrpHashSymbol(
+	__in ULONG_PTR ProcedurePtr
+	)
+{
+	PULONGLONG Procedure = ( PULONGLONG ) ( PVOID ) ProcedurePtr;
+
+	//
+	// Fold the upper half for 64 bit addresses.
+	//
+	return ( ULONG ) *Procedure ^ ( ULONG ) ( *Procedure >> 32 );
+}
+
+BOOLEAN JptrcrpEqualsSymbol(
+	__in ULONG_PTR KeyLhs,
+	__in ULONG_PTR KeyRhs
+	)
+{
+	PULONGLONG ProcedureLhs = ( PULONGLONG ) ( PVOID ) KeyLhs;
+	PULONGLONG ProcedureRhs = ( PULONGLONG ) ( PVOID ) KeyRhs;
+
+	return ( *ProcedureLhs == *ProcedureRhs ) ? TRUE : FALSE;
+}
+
+VOID JptrcrpRemoveAndDeleteSymbol(
+	__in PJPHT_HASHTABLE Hashtable,
+	__in PJPHT_HASHTABLE_ENTRY Entry,
+	__in_opt PVOID Context
+	)
+{
+	PJPHT_HASHTABLE_ENTRY RemovedEntry;
+
+	UNREFERENCED_PARAMETER( Context );
+
+	JphtRemoveEntryHashtable(
+		Hashtable,
+		Entry->Key,
+		&RemovedEntry );
+	ASSERT( RemovedEntry == Entry );
+
+	free( CONTAINING_RECORD(
+		Entry,
+		JPTRCRP_CACHED_SYMBOL,
+		u.HashtableEntry ) );
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Internal routines.
+ *
+ */
+
+HRESULT JptrcrpLoadSymbolTable(
+	__in PJPTRCRP_FILE File,
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk
+	)
+{
+	ULONG Index;
+	PJPTRC_SYMBOL Symbol;
+
+	ASSERT( File );
+	ASSERT( Chunk );
+
+	if ( ! JptrcsymIsValidChunk( Chunk ) )
+	{
+		return JPTRCR_E_CORRUPT_CHUNK;
+	}
+
+	Symbol = Chunk->Symbols;
+	for ( Index = 0; Index < Chunk->SymbolCount; Index++ )
+	{
+		PJPTRCRP_CACHED_SYMBOL EmbeddedSymbol;
+		INT NameLength;
+		PJPHT_HASHTABLE_ENTRY OldEntry;
+
+		EmbeddedSymbol = ( PJPTRCRP_CACHED_SYMBOL ) malloc(
+			FIELD_OFFSET(
+				JPTRCRP_CACHED_SYMBOL,
+				Info.Name[ Symbol->NameLength + 1 ] ) );
+		if ( EmbeddedSymbol == NULL )
+		{
+			return E_OUTOFMEMORY;
+		}
+
+		ZeroMemory( 
+			EmbeddedSymbol, 
+			FIELD_OFFSET( JPTRCRP_CACHED_SYMBOL, Info.Name ) );
+
+		//
+		// Names are stored as ANSI strings, SYMBOL_INFO uses WCHARs.
+		// Name is null-terminated, as ensured by JptrcsymIsValidChunk.
+		//
+		NameLength = MultiByteToWideChar(
+			CP_ACP,
+			0,
+			Symbol->Name,
+			Symbol->NameLength + 1,
+			EmbeddedSymbol->Info.Name,
+			Symbol->NameLength + 1 );
+		if ( NameLength == 0 )
+		{
+			free( EmbeddedSymbol );
+			return HRESULT_FROM_WIN32( GetLastError() );
+		}
+
+		EmbeddedSymbol->Info.SizeOfStruct	= sizeof( SYMBOL_INFO );
+		EmbeddedSymbol->Info.ModBase		= Symbol->ModuleBase;
+		EmbeddedSymbol->Info.Address		= Symbol->Procedure;
+		EmbeddedSymbol->Info.NameLen		= NameLength - 1;
+		EmbeddedSymbol->Info.MaxNameLen		= Symbol->NameLength + 1;
+
+		EmbeddedSymbol->Procedure		= Symbol->Procedure;
+		EmbeddedSymbol->Symbol			= &EmbeddedSymbol->Info;
+		EmbeddedSymbol->Module			= NULL;
+		EmbeddedSymbol->ModuleResolved	= FALSE;
+
+		EmbeddedSymbol->u.Procedure = &EmbeddedSymbol->Procedure;
+
+		//
+		// Later descriptions supersede earlier ones as well as
+		// any symbol obtained from dbghelp.
+		//
+		JphtPutEntryHashtable(
+			&File->SymbolsTable,
+			&EmbeddedSymbol->u.HashtableEntry,
+			&OldEntry );
+		if ( OldEntry != NULL )
+		{
+			PJPTRCRP_CACHED_SYMBOL OldSymbol = CONTAINING_RECORD(
+				OldEntry,
+				JPTRCRP_CACHED_SYMBOL,
+				u.HashtableEntry );
+
+			//
+			// IDs are stable - the new description takes over.
+			//
+			if ( OldSymbol->Id != JPTRCR_INVALID_SYMBOL_ID )
+			{
+				EmbeddedSymbol->Id = OldSymbol->Id;
+				File->SymbolIds.Entries[ OldSymbol->Id - 1 ] = EmbeddedSymbol;
+			}
+
+			//
+			// The old symbol may have been handed out already when
+			// the chunk has been picked up by JptrcrRefreshFile.
+			//
+			OldSymbol->NextRetired	= File->RetiredSymbols;
+			File->RetiredSymbols	= OldSymbol;
+		}
+
+		Symbol = JPTRCSYM_NEXT_SYMBOL( Symbol );
+	}
+
+	return S_OK;
+}
+
+VOID JptrcrpResolveSymbol(
+	__in PJPTRCRP_FILE File,
+	__in ULONGLONG Procedure,
+	__out PSYMBOL_INFO *Symbol,
+	__out PJPTRCR_MODULE *Module
+	)
+{
+	PJPTRCRP_CACHED_SYMBOL CachedSymbol;
+	PJPHT_HASHTABLE_ENTRY Entry;
+
+	ASSERT( File );
+	ASSERT( Symbol );
+	ASSERT( Module );
+
+	Entry = JphtGetEntryHashtable(
+		&File->SymbolsTable,
+		( ULONG_PTR ) &Procedure );
+	if ( Entry != NULL )
+	{
+		CachedSymbol = CONTAINING_RECORD(
+			Entry,
+			JPTRCRP_CACHED_SYMBOL,
+			u.HashtableEntry );
+	}
+	else
+	{
+		PJPHT_HASHTABLE_ENTRY OldEntry;
+
+		if ( FAILED( JptrcrsResolveSymbolFromDbghelp(
+			File,
+			Procedure,
+			&CachedSymbol ) ) )
+		{
+			//
+			// Out of memory - report the procedure as unresolved
+			// rather than failing the enumeration.
+			//
+			*Symbol = NULL;
+			*Module = NULL;
+			return;
+		}
+
+		JphtPutEntryHashtable(
+			&File->SymbolsTable,
+			&CachedSymbol->u.HashtableEntry,
+			&OldEntry );
+		ASSERT( OldEntry == NULL );
+	}
+
+	*Symbol = CachedSymbol->Symbol;
+	*Module = JptrcrsGetSymbolModule( File, CachedSymbol );
+}
+
+ULONG JptrcrpGetSymbolId(
+	__in PJPTRCRP_FILE File,
+	__in_opt PSYMBOL_INFO Symbol
+	)
+{
+	PJPTRCRP_CACHED_SYMBOL CachedSymbol;
+
+	ASSERT( File );
+
+	if ( Symbol == NULL )
+	{
+		return JPTRCR_INVALID_SYMBOL_ID;
+	}
+
+	//
+	// Symbols handed out always point to the Info field.
+	//
+	CachedSymbol = CONTAINING_RECORD( Symbol, JPTRCRP_CACHED_SYMBOL, Info );
+	if ( CachedSymbol->Id == JPTRCR_INVALID_SYMBOL_ID )
+	{
+		if ( File->SymbolIds.Count == File->SymbolIds.Capacity )
+		{
+			PJPTRCRP_CACHED_SYMBOL *NewEntries;
+			ULONG NewCapacity = File->SymbolIds.Capacity == 0
+				? 256
+				: File->SymbolIds.Capacity * 2;
+
+			if ( NewCapacity <= File->SymbolIds.Capacity ||
+				 NewCapacity > ( ( SIZE_T ) -1 ) / sizeof( PVOID ) )
+			{
+				return JPTRCR_INVALID_SYMBOL_ID;
+			}
+
+			NewEntries = ( PJPTRCRP_CACHED_SYMBOL* ) realloc(
+				File->SymbolIds.Entries,
+				NewCapacity * sizeof( PJPTRCRP_CACHED_SYMBOL ) );
+			if ( NewEntries == NULL )
+			{
+				return JPTRCR_INVALID_SYMBOL_ID;
+			}
+
+			File->SymbolIds.Entries		= NewEntries;
+			File->SymbolIds.Capacity	= NewCapacity;
+		}
+
+		File->SymbolIds.Entries[ File->SymbolIds.Count++ ] = CachedSymbol;
+		CachedSymbol->Id = File->SymbolIds.Count;
+	}
+
+	return CachedSymbol->Id;
+}
+
+VOID JptrcrpDeleteRetiredSymbols(
+	__in PJPTRCRP_FILE File
+	)
+{
+	ASSERT( File );
+
+	while ( File->RetiredSymbols != NULL )
+	{
+		PJPTRCRP_CACHED_SYMBOL Symbol = File->RetiredSymbols;
+		File->RetiredSymbols = Symbol->NextRetired;
+		free( Symbol );
+	}
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Exports.
+ *
+ */
+
+HRESULT JptrcrEnumSymbols(
+	__in JPTRCRHANDLE FileHandle,
+	__in ULONG FirstSymbolId,
+	__in JPTRCR_ENUM_SYMBOLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	ULONG Id;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 FirstSymbolId == JPTRCR_INVALID_SYMBOL_ID ||
+		 Callback == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	EnterCriticalSection( &File->Lock );
+
+	//
+	// N.B. The callback may cause further IDs to be assigned.
+	//
+	for ( Id = FirstSymbolId; Id <= File->SymbolIds.Count; Id++ )
+	{
+		PJPTRCRP_CACHED_SYMBOL CachedSymbol = File->SymbolIds.Entries[ Id - 1 ];
+
+		ASSERT( CachedSymbol->Id == Id );
+		ASSERT( CachedSymbol->Symbol != NULL );
+
+		( Callback )(
+			Id,
+			CachedSymbol->Symbol,
+			JptrcrsGetSymbolModule( File, CachedSymbol ),
+			Context );
+	}
+
+	LeaveCriticalSection( &File->Lock );
+
+	return S_OK;
+}
@@ -0,0 +1,513 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Merged timeline of all clients.
+ *
+ *		Transitions of each client are ordered by timestamp, so a
+ *		global order is obtained by a k-way merge: a binary heap
+ *		holds one cursor per client, keyed by the timestamp of the
+ *		client's next transition.
+ *
+ *		Each client holds a copy of the transitions of its current
+ *		chunk, so that windows of the mapping cache may be evicted
+ *		while the timeline is being read. The buffer is reused for
+ *		subsequent chunks - no memory is allocated per transition.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#define JPTRCRAPI
+
+#include <stdlib.h>
+#include <jptrcrp.h>
+
+#define JPTRCRP_TIMELINE_SIGNATURE	'ltrJ'
+
+C_ASSERT( JptrcrEntryTransition == JPTRC_PROCEDURE_TRANSITION_ENTRY );
+C_ASSERT( JptrcrExitTransition == JPTRC_PROCEDURE_TRANSITION_EXIT );
+C_ASSERT( JptrcrUnwindTransition == JPTRC_PROCEDURE_TRANSITION_UNWIND );
+
+/*++
+	Structure Description:
+		Position of the timeline within the transitions of a
+		client.
+--*/
+typedef struct _JPTRCRP_TIMELINE_CLIENT
+{
+	PJPTRCRP_CLIENT_CHUNKS Chunks;
+
+	//
+	// Index of the next chunk to be loaded.
+	//
+	ULONG NextChunk;
+
+	//
+	// Transitions of the current chunk and the index of the next
+	// transition to be returned.
+	//
+	JPTRCRP_TRANSITION_BUFFER Buffer;
+	ULONG TransitionCount;
+	ULONG Index;
+} JPTRCRP_TIMELINE_CLIENT, *PJPTRCRP_TIMELINE_CLIENT;
+
+typedef struct _JPTRCRP_TIMELINE
+{
+	ULONG Signature;
+	PJPTRCRP_FILE File;
+
+	//
+	// Inclusive range of timestamps to be returned.
+	//
+	JPTRCR_TIMESTAMP_RANGE Range;
+
+	//
+	// Snapshot of chunks, see JptrcrpGetClientChunks.
+	//
+	PJPTRCRP_CLIENT_CHUNKS ClientChunks;
+
+	ULONG ClientCount;
+	PJPTRCRP_TIMELINE_CLIENT Clients;
+
+	//
+	// Min-heap of indexes into Clients. Only clients having
+	// transitions left are on the heap.
+	//
+	ULONG HeapSize;
+	PULONG Heap;
+
+	//
+	// Error that occurred while advancing a client, reported by
+	// all subsequent reads.
+	//
+	HRESULT Failure;
+} JPTRCRP_TIMELINE, *PJPTRCRP_TIMELINE;
+
+/*----------------------------------------------------------------------
+ *
+ * Private routines.
+ *
+ */
+
+/*++
+	Routine Description:
+		Load the next chunk of a client that has transitions within
+		the timeline's range. Chunks ending before the start of the
+		range are skipped without being copied.
+
+	Return Value:
+		S_OK if a chunk has been loaded. Index refers to the first
+			transition within the range.
+		S_FALSE if no chunks are left.
+		Any error HRESULT on failure.
+--*/
+static HRESULT JptrcrsLoadNextTimelineChunk(
+	__in PJPTRCRP_TIMELINE Timeline,
+	__in PJPTRCRP_TIMELINE_CLIENT Client
+	)
+{
+	while ( Client->NextChunk < Client->Chunks->ChunkCount )
+	{
+		PJPTRC_CHUNK_HEADER ChunkHeader;
+		HRESULT Hr;
+		ULONG TransitionCount;
+		PJPTRC_PROCEDURE_TRANSITION32 Transitions;
+
+		Hr = JptrcrpMap(
+			Timeline->File,
+			Client->Chunks->ChunkOffsets[ Client->NextChunk++ ],
+			&ChunkHeader );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+
+		//
+		// N.B. The transitions of the current chunk have all been
+		// returned, so the buffer can be reused.
+		//
+		Client->TransitionCount	= 0;
+		Hr = JptrcrpGetChunkTransitions(
+			ChunkHeader,
+			&Client->Buffer,
+			&Transitions,
+			&TransitionCount );
+		if ( FAILED( Hr ) )
+		{
+			return Hr;
+		}
+
+		if ( TransitionCount == 0 ||
+			 Transitions[ TransitionCount - 1 ].Timestamp <
+				Timeline->Range.Start )
+		{
+			continue;
+		}
+
+		if ( Transitions != Client->Buffer.Transitions )
+		{
+			//
+			// Plain chunk - copy the transitions out of the mapped
+			// window.
+			//
+			Hr = JptrcrpReserveTransitionBuffer(
+				&Client->Buffer,
+				TransitionCount );
+			if ( FAILED( Hr ) )
+			{
+				return Hr;
+			}
+
+			CopyMemory(
+				Client->Buffer.Transitions,
+				Transitions,
+				TransitionCount * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+		}
+
+		Client->TransitionCount	= TransitionCount;
+		Client->Index			= 0;
+
+		while ( Client->Buffer.Transitions[ Client->Index ].Timestamp <
+			Timeline->Range.Start )
+		{
+			//
+			// Terminates as the last transition is within the range.
+			//
+			Client->Index++;
+		}
+
+		return S_OK;
+	}
+
+	return S_FALSE;
+}
+
+/*++
+	Routine Description:
+		Move to the next transition of a client.
+
+	Return Value:
+		S_OK if the client has a next transition.
+		S_FALSE if the client has no transitions left.
+		Any error HRESULT on failure.
+--*/
+static HRESULT JptrcrsAdvanceTimelineClient(
+	__in PJPTRCRP_TIMELINE Timeline,
+	__in PJPTRCRP_TIMELINE_CLIENT Client
+	)
+{
+	if ( ++Client->Index < Client->TransitionCount )
+	{
+		return S_OK;
+	}
+	else
+	{
+		return JptrcrsLoadNextTimelineChunk( Timeline, Client );
+	}
+}
+
+static __inline ULONGLONG JptrcrsTimelineKey(
+	__in PJPTRCRP_TIMELINE Timeline,
+	__in ULONG ClientIndex
+	)
+{
+	PJPTRCRP_TIMELINE_CLIENT Client = &Timeline->Clients[ ClientIndex ];
+	return Client->Buffer.Transitions[ Client->Index ].Timestamp;
+}
+
+/*++
+	Routine Description:
+		Compare heap elements. Ties are broken by client index so
+		that the order of transitions is deterministic.
+--*/
+static __inline BOOL JptrcrsTimelineLess(
+	__in PJPTRCRP_TIMELINE Timeline,
+	__in ULONG Left,
+	__in ULONG Right
+	)
+{
+	ULONGLONG LeftKey = JptrcrsTimelineKey( Timeline, Left );
+	ULONGLONG RightKey = JptrcrsTimelineKey( Timeline, Right );
+
+	return LeftKey < RightKey || ( LeftKey == RightKey && Left < Right );
+}
+
+static VOID JptrcrsSiftDownTimelineHeap(
+	__in PJPTRCRP_TIMELINE Timeline,
+	__in ULONG Position
+	)
+{
+	PULONG Heap = Timeline->Heap;
+	ULONG Element = Heap[ Position ];
+
+	for ( ;; )
+	{
+		ULONG Child = 2 * Position + 1;
+		if ( Child >= Timeline->HeapSize )
+		{
+			break;
+		}
+
+		if ( Child + 1 < Timeline->HeapSize &&
+			 JptrcrsTimelineLess( Timeline, Heap[ Child + 1 ], Heap[ Child ] ) )
+		{
+			Child++;
+		}
+
+		if ( ! JptrcrsTimelineLess( Timeline, Heap[ Child ], Element ) )
+		{
+			break;
+		}
+
+		Heap[ Position ] = Heap[ Child ];
+		Position = Child;
+	}
+
+	Heap[ Position ] = Element;
+}
+
+static VOID JptrcrsDeleteTimeline(
+	__in PJPTRCRP_TIMELINE Timeline
+	)
+{
+	ULONG Index;
+
+	if ( Timeline->Clients != NULL )
+	{
+		for ( Index = 0; Index < Timeline->ClientCount; Index++ )
+		{
+			JptrcrpDeleteTransitionBuffer( &Timeline->Clients[ Index ].Buffer );
+		}
+	}
+
+	free( Timeline->Clients );
+	free( Timeline->Heap );
+	free( Timeline->ClientChunks );
+
+	Timeline->Signature = 0;
+	free( Timeline );
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Exports.
+ *
+ */
+
+HRESULT JptrcrCreateTimeline(
+	__in JPTRCRHANDLE FileHandle,
+	__in_opt PJPTRCR_TIMESTAMP_RANGE Range,
+	__out JPTRCRTIMELINEHANDLE *TimelineHandle
+	)
+{
+	PJPTRCRP_FILE File = ( PJPTRCRP_FILE ) FileHandle;
+	HRESULT Hr;
+	ULONG Index;
+	PJPTRCRP_TIMELINE Timeline;
+
+	if ( File == NULL ||
+		 File->Signature != JPTRCRP_FILE_SIGNATURE ||
+		 ( Range != NULL && Range->Start > Range->End ) ||
+		 TimelineHandle == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	*TimelineHandle = NULL;
+
+	Timeline = ( PJPTRCRP_TIMELINE ) malloc( sizeof( JPTRCRP_TIMELINE ) );
+	if ( Timeline == NULL )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	ZeroMemory( Timeline, sizeof( JPTRCRP_TIMELINE ) );
+	Timeline->Signature	= JPTRCRP_TIMELINE_SIGNATURE;
+	Timeline->File		= File;
+	Timeline->Failure	= S_OK;
+
+	if ( Range != NULL )
+	{
+		Timeline->Range = *Range;
+	}
+	else
+	{
+		Timeline->Range.Start	= 0;
+		Timeline->Range.End		= ( ULONGLONG ) -1;
+	}
+
+	EnterCriticalSection( &File->Lock );
+
+	Hr = JptrcrpGetClientChunks(
+		File,
+		&Timeline->ClientChunks,
+		&Timeline->ClientCount );
+	if ( FAILED( Hr ) )
+	{
+		goto Cleanup;
+	}
+	else if ( Hr == S_FALSE )
+	{
+		//
+		// No clients, the timeline is empty.
+		//
+		*TimelineHandle = Timeline;
+		Hr = S_OK;
+		goto Cleanup;
+	}
+
+	Timeline->Clients = ( PJPTRCRP_TIMELINE_CLIENT ) malloc(
+		Timeline->ClientCount * sizeof( JPTRCRP_TIMELINE_CLIENT ) );
+	Timeline->Heap = ( PULONG ) malloc(
+		Timeline->ClientCount * sizeof( ULONG ) );
+	if ( Timeline->Clients == NULL || Timeline->Heap == NULL )
+	{
+		Hr = E_OUTOFMEMORY;
+		goto Cleanup;
+	}
+
+	ZeroMemory(
+		Timeline->Clients,
+		Timeline->ClientCount * sizeof( JPTRCRP_TIMELINE_CLIENT ) );
+
+	for ( Index = 0; Index < Timeline->ClientCount; Index++ )
+	{
+		PJPTRCRP_TIMELINE_CLIENT Client = &Timeline->Clients[ Index ];
+		Client->Chunks = &Timeline->ClientChunks[ Index ];
+
+		Hr = JptrcrsLoadNextTimelineChunk( Timeline, Client );
+		if ( FAILED( Hr ) )
+		{
+			goto Cleanup;
+		}
+		else if ( Hr == S_OK )
+		{
+			Timeline->Heap[ Timeline->HeapSize++ ] = Index;
+		}
+	}
+
+	//
+	// Heapify.
+	//
+	for ( Index = Timeline->HeapSize / 2; Index > 0; Index-- )
+	{
+		JptrcrsSiftDownTimelineHeap( Timeline, Index - 1 );
+	}
+
+	*TimelineHandle = Timeline;
+	Hr = S_OK;
+
+Cleanup:
+	LeaveCriticalSection( &File->Lock );
+
+	if ( FAILED( Hr ) )
+	{
+		JptrcrsDeleteTimeline( Timeline );
+	}
+
+	return Hr;
+}
+
+HRESULT JptrcrReadTimeline(
+	__in JPTRCRTIMELINEHANDLE TimelineHandle,
+	__in ULONG MaxRecords,
+	__out_ecount_part( MaxRecords, *RecordsRead )
+		PJPTRCR_TRANSITION_RECORD Records,
+	__out PULONG RecordsRead
+	)
+{
+	ULONG Count = 0;
+	HRESULT Hr;
+	PJPTRCRP_TIMELINE Timeline = ( PJPTRCRP_TIMELINE ) TimelineHandle;
+
+	if ( Timeline == NULL ||
+		 Timeline->Signature != JPTRCRP_TIMELINE_SIGNATURE ||
+		 MaxRecords == 0 ||
+		 Records == NULL ||
+		 RecordsRead == NULL )
+	{
+		return E_INVALIDARG;
+	}
+
+	*RecordsRead = 0;
+
+	if ( FAILED( Timeline->Failure ) )
+	{
+		return Timeline->Failure;
+	}
+
+	//
+	// The timeline itself is owned by the caller, only loading
+	// chunks requires the file lock.
+	//
+	EnterCriticalSection( &Timeline->File->Lock );
+
+	while ( Count < MaxRecords && Timeline->HeapSize > 0 )
+	{
+		ULONG ClientIndex = Timeline->Heap[ 0 ];
+		PJPTRCRP_TIMELINE_CLIENT Client = &Timeline->Clients[ ClientIndex ];
+		PJPTRCR_TRANSITION_RECORD Record = &Records[ Count ];
+		PJPTRC_PROCEDURE_TRANSITION32 Transition =
+			&Client->Buffer.Transitions[ Client->Index ];
+
+		if ( Transition->Timestamp > Timeline->Range.End )
+		{
+			//
+			// All remaining transitions are beyond the range.
+			//
+			Timeline->HeapSize = 0;
+			break;
+		}
+
+		Record->Client		= Client->Chunks->Information;
+		Record->Timestamp	= Transition->Timestamp;
+		Record->Procedure	= Transition->Procedure;
+		Record->Type		= ( ULONG ) Transition->Type;
+		Record->Info		= Transition->Info.CallerIp;
+		Count++;
+
+		Hr = JptrcrsAdvanceTimelineClient( Timeline, Client );
+		if ( FAILED( Hr ) )
+		{
+			Timeline->Failure = Hr;
+			break;
+		}
+		else if ( Hr == S_FALSE )
+		{
+			Timeline->Heap[ 0 ] = Timeline->Heap[ --Timeline->HeapSize ];
+		}
+
+		if ( Timeline->HeapSize > 0 )
+		{
+			JptrcrsSiftDownTimelineHeap( Timeline, 0 );
+		}
+	}
+
+	LeaveCriticalSection( &Timeline->File->Lock );
+
+	*RecordsRead = Count;
+
+	if ( FAILED( Timeline->Failure ) )
+	{
+		return Timeline->Failure;
+	}
+	else
+	{
+		return Timeline->HeapSize > 0 ? S_OK : S_FALSE;
+	}
+}
+
+HRESULT JptrcrDeleteTimeline(
+	__in JPTRCRTIMELINEHANDLE TimelineHandle
+	)
+{
+	PJPTRCRP_TIMELINE Timeline = ( PJPTRCRP_TIMELINE ) TimelineHandle;
+
+	if ( Timeline == NULL ||
+		 Timeline->Signature != JPTRCRP_TIMELINE_SIGNATURE )
+	{
+		return E_INVALIDARG;
+	}
+
+	JptrcrsDeleteTimeline( Timeline );
+	return S_OK;
+}
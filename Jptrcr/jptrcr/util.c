@@ -13,6 +13,24 @@
 #include <strsafe.h>
 #pragma warning( pop )
 
+//
+// Size of regular arena blocks. Larger requests are served from
+// dedicated blocks.
+//
+#define JPTRCRP_ARENA_BLOCK_SIZE		( 64 * 1024 )
+
+typedef struct _JPTRCRP_ARENA_BLOCK
+{
+	struct _JPTRCRP_ARENA_BLOCK *Next;
+	SIZE_T Size;
+	SIZE_T Used;
+
+	//
+	// ULONGLONG to ensure proper alignment of the data.
+	//
+	ULONGLONG Data[ ANYSIZE_ARRAY ];
+} JPTRCRP_ARENA_BLOCK, *PJPTRCRP_ARENA_BLOCK;
+
 PVOID JptrcrpAllocateHashtableMemory(
 	__in SIZE_T Size 
 	)
@@ -47,4 +65,117 @@ VOID JptrcrpDbgPrint(
 	{
 		OutputDebugString( Buffer );
 	}
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Arena routines.
+ *
+ */
+
+VOID JptrcrpInitializeArena(
+	__out PJPTRCRP_ARENA Arena
+	)
+{
+	ASSERT( Arena );
+	Arena->CurrentBlock = NULL;
+}
+
+PVOID JptrcrpAllocateArena(
+	__in PJPTRCRP_ARENA Arena,
+	__in SIZE_T Size
+	)
+{
+	PJPTRCRP_ARENA_BLOCK Block;
+	PJPTRCRP_ARENA_BLOCK CurrentBlock;
+	PVOID Mem;
+
+	ASSERT( Arena );
+	ASSERT( Size > 0 );
+
+	if ( Size > ( ( SIZE_T ) -1 ) - 
+		FIELD_OFFSET( JPTRCRP_ARENA_BLOCK, Data ) - sizeof( ULONGLONG ) )
+	{
+		return NULL;
+	}
+
+	//
+	// Keep allocations aligned.
+	//
+	Size = ( Size + sizeof( ULONGLONG ) - 1 ) & ~( sizeof( ULONGLONG ) - 1 );
+
+	CurrentBlock = Arena->CurrentBlock;
+	if ( CurrentBlock != NULL &&
+		 Size <= CurrentBlock->Size - CurrentBlock->Used )
+	{
+		Mem = ( PUCHAR ) CurrentBlock->Data + CurrentBlock->Used;
+		CurrentBlock->Used += Size;
+		return Mem;
+	}
+
+	if ( Size > JPTRCRP_ARENA_BLOCK_SIZE / 4 )
+	{
+		//
+		// Serve from a dedicated block. The current block is likely
+		// to still have some space left - keep using it.
+		//
+		Block = ( PJPTRCRP_ARENA_BLOCK ) malloc( 
+			FIELD_OFFSET( JPTRCRP_ARENA_BLOCK, Data ) + Size );
+		if ( Block == NULL )
+		{
+			return NULL;
+		}
+
+		Block->Size	= Size;
+		Block->Used	= Size;
+
+		if ( CurrentBlock != NULL )
+		{
+			Block->Next			= CurrentBlock->Next;
+			CurrentBlock->Next	= Block;
+		}
+		else
+		{
+			Block->Next			= NULL;
+			Arena->CurrentBlock	= Block;
+		}
+
+		return Block->Data;
+	}
+
+	//
+	// Start a new block, the rest of the current block is wasted.
+	//
+	Block = ( PJPTRCRP_ARENA_BLOCK ) malloc( 
+		FIELD_OFFSET( JPTRCRP_ARENA_BLOCK, Data ) + JPTRCRP_ARENA_BLOCK_SIZE );
+	if ( Block == NULL )
+	{
+		return NULL;
+	}
+
+	Block->Next			= CurrentBlock;
+	Block->Size			= JPTRCRP_ARENA_BLOCK_SIZE;
+	Block->Used			= Size;
+	Arena->CurrentBlock	= Block;
+
+	return Block->Data;
+}
+
+VOID JptrcrpDeleteArena(
+	__in PJPTRCRP_ARENA Arena
+	)
+{
+	PJPTRCRP_ARENA_BLOCK Block;
+
+	ASSERT( Arena );
+
+	Block = Arena->CurrentBlock;
+	while ( Block != NULL )
+	{
+		PJPTRCRP_ARENA_BLOCK Next = Block->Next;
+		free( Block );
+		Block = Next;
+	}
+
+	Arena->CurrentBlock = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,429 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Batched call enumeration tests. Calls read in blocks are
+ *		compared against the calls reported by the callback-based
+ *		enumeration routines.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <string.h>
+#include <jptrcfmt.h>
+#include <jptrcsym.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define MAX_CALLS					8
+#define CHUNK_CAPACITY				256
+
+typedef struct _CALLBACK_CONTEXT
+{
+	ULONG Counter;
+	JPTRCR_CALL Calls[ MAX_CALLS ];
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+typedef struct _SYMBOLS_CONTEXT
+{
+	ULONG Counter;
+	ULONG Ids[ MAX_CALLS ];
+	WCHAR Names[ MAX_CALLS ][ 8 ];
+} SYMBOLS_CONTEXT, *PSYMBOLS_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+static void AppendSymbol(
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+	__in ULONGLONG Procedure,
+	__in PCSTR Name
+	)
+{
+	TEST( JptrcsymAppendSymbol(
+		Chunk,
+		CHUNK_CAPACITY,
+		Procedure,
+		0x10000000,
+		Name,
+		( USHORT ) strlen( Name ) ) );
+}
+
+/*++
+	Routine Description:
+		Write the calls of WriteNestedCallsTraceFile. Only A and B
+		have embedded symbols.
+--*/
+static void WriteTraceFile()
+{
+	ULONGLONG Buffer[ CHUNK_CAPACITY / sizeof( ULONGLONG ) ];
+	PJPTRC_SYMBOL_TABLE_CHUNK Table = ( PJPTRC_SYMBOL_TABLE_CHUNK ) Buffer;
+
+	ZeroMemory( Buffer, sizeof( Buffer ) );
+
+	JptrcsymInitializeChunk( Table );
+	AppendSymbol( Table, 0x10000, "A" );
+	AppendSymbol( Table, 0x20000, "B" );
+
+	WriteNestedCallsTraceFile( FilePath, Table, Table->Header.Size );
+}
+
+static void CollectCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->Counter < MAX_CALLS );
+	if ( Ctx->Counter < MAX_CALLS )
+	{
+		Ctx->Calls[ Ctx->Counter++ ] = *Call;
+	}
+}
+
+static void CollectSymbolsCallback(
+	__in ULONG SymbolId,
+	__in PSYMBOL_INFO Symbol,
+	__in_opt PJPTRCR_MODULE Module,
+	__in_opt PVOID Context
+	)
+{
+	PSYMBOLS_CONTEXT Ctx = ( PSYMBOLS_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	UNREFERENCED_PARAMETER( Module );
+
+	TEST( Ctx->Counter < MAX_CALLS );
+	if ( Ctx->Counter < MAX_CALLS )
+	{
+		Ctx->Ids[ Ctx->Counter ] = SymbolId;
+		TEST( 0 == wcsncpy_s(
+			Ctx->Names[ Ctx->Counter ],
+			_countof( Ctx->Names[ Ctx->Counter ] ),
+			Symbol->Name,
+			_TRUNCATE ) );
+		Ctx->Counter++;
+	}
+}
+
+/*++
+	Routine Description:
+		Read all calls a cursor yields using blocks of the given
+		size.
+--*/
+static ULONG ReadCalls(
+	__in JPTRCRHANDLE Handle,
+	__in PJPTRCR_CALL_CURSOR Cursor,
+	__in ULONG BlockSize,
+	__out_ecount( MAX_CALLS ) PJPTRCR_CALL_RECORD Records
+	)
+{
+	ULONG Count = 0;
+	HRESULT Hr;
+
+	do
+	{
+		ULONG Read;
+
+		TEST( Count + BlockSize <= MAX_CALLS );
+		if ( Count + BlockSize > MAX_CALLS ) break;
+
+		Hr = JptrcrReadCalls( Handle, Cursor, BlockSize, Records + Count, &Read );
+		TEST( SUCCEEDED( Hr ) );
+		TEST( Read <= BlockSize );
+		TEST( Hr == S_FALSE || Read == BlockSize );
+
+		Count += Read;
+	}
+	while ( Hr == S_OK );
+
+	//
+	// Reading beyond the end is benign.
+	//
+	if ( Hr == S_FALSE )
+	{
+		ULONG Read;
+		TEST_HR( S_FALSE, JptrcrReadCalls( Handle, Cursor, 1, Records, &Read ) );
+		TEST( Read == 0 );
+	}
+
+	return Count;
+}
+
+static void CompareCalls(
+	__in PCALLBACK_CONTEXT Ctx,
+	__in ULONG RecordCount,
+	__in PJPTRCR_CALL_RECORD Records
+	)
+{
+	ULONG Index;
+
+	TEST( Ctx->Counter == RecordCount );
+	if ( Ctx->Counter != RecordCount ) return;
+
+	for ( Index = 0; Index < RecordCount; Index++ )
+	{
+		PJPTRCR_CALL Call = &Ctx->Calls[ Index ];
+		PJPTRCR_CALL_RECORD Record = &Records[ Index ];
+
+		TEST( Record->CallHandle.Chunk == Call->CallHandle.Chunk );
+		TEST( Record->CallHandle.Index == Call->CallHandle.Index );
+		TEST( Record->Procedure == Call->Procedure );
+		TEST( Record->EntryTimestamp == Call->EntryTimestamp );
+		TEST( Record->ExitTimestamp == Call->ExitTimestamp );
+		TEST( Record->Duration == Call->Duration );
+		TEST( Record->CallerIp == Call->CallerIp );
+		TEST( Record->ChildCalls == Call->ChildCalls );
+		TEST( Record->Result == Call->Result.ReturnValue );
+		TEST( Record->EntryType == ( USHORT ) Call->EntryType );
+		TEST( Record->ExitType == ( USHORT ) Call->ExitType );
+		TEST( ( Record->SymbolId == JPTRCR_INVALID_SYMBOL_ID ) ==
+			  ( Call->Symbol == NULL ) );
+	}
+}
+
+static void TestReadTopLevelCalls()
+{
+	ULONG BlockSize;
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	JPTRCR_CALL_CURSOR Cursor;
+	JPTRCRHANDLE Handle;
+	JPTRCR_CALL_RECORD Records[ MAX_CALLS ];
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectCallsCallback, &Ctx ) );
+	TEST( Ctx.Counter == 2 );
+
+	for ( BlockSize = 1; BlockSize <= 3; BlockSize++ )
+	{
+		TEST_OK( JptrcrInitializeCallCursor( Handle, &Client, NULL, &Cursor ) );
+		CompareCalls(
+			&Ctx,
+			ReadCalls( Handle, &Cursor, BlockSize, Records ),
+			Records );
+	}
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestReadChildCalls()
+{
+	ULONG BlockSize;
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	JPTRCR_CALL_CURSOR Cursor;
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+	JPTRCR_CALL_RECORD Records[ MAX_CALLS ];
+	CALLBACK_CONTEXT TopLevelCtx;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &TopLevelCtx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectCallsCallback, &TopLevelCtx ) );
+	TEST( TopLevelCtx.Counter == 2 );
+
+	//
+	// Children of A, and children of E: F and G are derived from
+	// the same node, which must be split across blocks of size 1.
+	//
+	for ( Index = 0; Index < TopLevelCtx.Counter; Index++ )
+	{
+		ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+		TEST_OK( JptrcrEnumChildCalls(
+			Handle,
+			&TopLevelCtx.Calls[ Index ].CallHandle,
+			CollectCallsCallback,
+			&Ctx ) );
+
+		for ( BlockSize = 1; BlockSize <= 3; BlockSize++ )
+		{
+			TEST_OK( JptrcrInitializeCallCursor(
+				Handle,
+				NULL,
+				&TopLevelCtx.Calls[ Index ].CallHandle,
+				&Cursor ) );
+			CompareCalls(
+				&Ctx,
+				ReadCalls( Handle, &Cursor, BlockSize, Records ),
+				Records );
+		}
+	}
+
+	//
+	// Children of C and of D, which has none.
+	//
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumChildCalls(
+		Handle,
+		&TopLevelCtx.Calls[ 0 ].CallHandle,
+		CollectCallsCallback,
+		&Ctx ) );
+	TEST( Ctx.Counter == 3 );
+
+	TEST_OK( JptrcrInitializeCallCursor(
+		Handle,
+		NULL,
+		&Ctx.Calls[ 1 ].CallHandle,
+		&Cursor ) );
+	TEST( 1 == ReadCalls( Handle, &Cursor, 1, Records ) );
+	TEST( Records[ 0 ].Procedure == 0x40000 );
+
+	TEST_HR( S_FALSE, JptrcrInitializeCallCursor(
+		Handle,
+		NULL,
+		&Records[ 0 ].CallHandle,
+		&Cursor ) );
+	TEST( 0 == ReadCalls( Handle, &Cursor, 1, Records ) );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestSymbolIds()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	JPTRCR_CALL_CURSOR Cursor;
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+	JPTRCR_CALL_RECORD Records[ MAX_CALLS ];
+	JPTRCR_CALL_RECORD ChildRecords[ MAX_CALLS ];
+	SYMBOLS_CONTEXT SymCtx;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_OK( JptrcrInitializeCallCursor( Handle, &Client, NULL, &Cursor ) );
+	TEST( 2 == ReadCalls( Handle, &Cursor, 2, Records ) );
+
+	TEST_OK( JptrcrInitializeCallCursor(
+		Handle,
+		NULL,
+		&Records[ 0 ].CallHandle,
+		&Cursor ) );
+	TEST( 3 == ReadCalls( Handle, &Cursor, 3, ChildRecords ) );
+
+	//
+	// A and both calls of B refer to embedded symbols.
+	//
+	TEST( Records[ 0 ].SymbolId != JPTRCR_INVALID_SYMBOL_ID );
+	TEST( ChildRecords[ 0 ].SymbolId != JPTRCR_INVALID_SYMBOL_ID );
+	TEST( ChildRecords[ 0 ].SymbolId != Records[ 0 ].SymbolId );
+	TEST( ChildRecords[ 2 ].SymbolId == ChildRecords[ 0 ].SymbolId );
+
+	//
+	// E and C cannot be resolved.
+	//
+	TEST( Records[ 1 ].SymbolId == JPTRCR_INVALID_SYMBOL_ID );
+	TEST( ChildRecords[ 1 ].SymbolId == JPTRCR_INVALID_SYMBOL_ID );
+
+	ZeroMemory( &SymCtx, sizeof( SYMBOLS_CONTEXT ) );
+	TEST_OK( JptrcrEnumSymbols( Handle, 1, CollectSymbolsCallback, &SymCtx ) );
+	TEST( SymCtx.Counter == 2 );
+
+	for ( Index = 0; Index < SymCtx.Counter; Index++ )
+	{
+		TEST( SymCtx.Ids[ Index ] == Index + 1 );
+
+		if ( SymCtx.Ids[ Index ] == Records[ 0 ].SymbolId )
+		{
+			TEST( 0 == wcscmp( SymCtx.Names[ Index ], L"A" ) );
+		}
+		else
+		{
+			TEST( SymCtx.Ids[ Index ] == ChildRecords[ 0 ].SymbolId );
+			TEST( 0 == wcscmp( SymCtx.Names[ Index ], L"B" ) );
+		}
+	}
+
+	//
+	// Incremental retrieval.
+	//
+	ZeroMemory( &SymCtx, sizeof( SYMBOLS_CONTEXT ) );
+	TEST_OK( JptrcrEnumSymbols( Handle, 2, CollectSymbolsCallback, &SymCtx ) );
+	TEST( SymCtx.Counter == 1 );
+
+	ZeroMemory( &SymCtx, sizeof( SYMBOLS_CONTEXT ) );
+	TEST_OK( JptrcrEnumSymbols( Handle, 3, CollectSymbolsCallback, &SymCtx ) );
+	TEST( SymCtx.Counter == 0 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestInvalidCursorArguments()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	JPTRCR_CLIENT UnknownClient = { 4, 9 };
+	JPTRCR_CALL_CURSOR Cursor;
+	JPTRCRHANDLE Handle;
+	JPTRCR_CALL_HANDLE InvalidHandle;
+	ULONG Read;
+	JPTRCR_CALL_RECORD Records[ MAX_CALLS ];
+	SYMBOLS_CONTEXT SymCtx;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_HR( E_INVALIDARG, JptrcrInitializeCallCursor( NULL, &Client, NULL, &Cursor ) );
+	TEST_HR( E_INVALIDARG, JptrcrInitializeCallCursor( Handle, NULL, NULL, &Cursor ) );
+	TEST_HR( E_INVALIDARG, JptrcrInitializeCallCursor( Handle, &Client, NULL, NULL ) );
+
+	TEST_HR( S_FALSE, JptrcrInitializeCallCursor( Handle, &UnknownClient, NULL, &Cursor ) );
+	TEST_HR( S_FALSE, JptrcrReadCalls( Handle, &Cursor, MAX_CALLS, Records, &Read ) );
+	TEST( Read == 0 );
+
+	TEST_OK( JptrcrInitializeCallCursor( Handle, &Client, NULL, &Cursor ) );
+	TEST_HR( E_INVALIDARG, JptrcrReadCalls( Handle, &Cursor, 0, Records, &Read ) );
+	TEST_HR( E_INVALIDARG, JptrcrReadCalls( Handle, &Cursor, 1, NULL, &Read ) );
+	TEST_HR( E_INVALIDARG, JptrcrReadCalls( Handle, &Cursor, 1, Records, NULL ) );
+
+	TEST_HR( S_FALSE, JptrcrReadCalls( Handle, &Cursor, MAX_CALLS, Records, &Read ) );
+	TEST( Read == 2 );
+
+	//
+	// Index of B's exit transition.
+	//
+	InvalidHandle		= Records[ 0 ].CallHandle;
+	InvalidHandle.Index	= 2;
+	TEST_HR( E_INVALIDARG, JptrcrInitializeCallCursor(
+		Handle,
+		&Client,
+		&InvalidHandle,
+		&Cursor ) );
+	TEST_HR( JPTRCR_E_INVALID_CALL_HANDLE, JptrcrInitializeCallCursor(
+		Handle,
+		NULL,
+		&InvalidHandle,
+		&Cursor ) );
+
+	TEST_HR( E_INVALIDARG, JptrcrEnumSymbols(
+		Handle,
+		JPTRCR_INVALID_SYMBOL_ID,
+		CollectSymbolsCallback,
+		&SymCtx ) );
+	TEST_HR( E_INVALIDARG, JptrcrEnumSymbols( Handle, 1, NULL, &SymCtx ) );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( BatchedCalls )
+	CFIX_FIXTURE_ENTRY( TestReadTopLevelCalls )
+	CFIX_FIXTURE_ENTRY( TestReadChildCalls )
+	CFIX_FIXTURE_ENTRY( TestSymbolIds )
+	CFIX_FIXTURE_ENTRY( TestInvalidCursorArguments )
+CFIX_END_FIXTURE()
@@ -0,0 +1,297 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Calibration chunk tests. Trace files are synthesized s.t. their
+ *		contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define TRACE_CHUNK_SIZE		FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, \
+									Transitions[ 2 ] )
+#define CALIBRATION_CHUNK_SIZE	JPTRC_CALIBRATION_CHUNK_SIZE( 2 )
+#define FILE_SIZE				( sizeof( JPTRC_FILE_HEADER ) + \
+									2 * CALIBRATION_CHUNK_SIZE + \
+									TRACE_CHUNK_SIZE )
+
+//
+// The call takes 4000 ticks.
+//
+#define CALL_ENTRY_TIMESTAMP	1000
+#define CALL_EXIT_TIMESTAMP		5000
+
+typedef struct _CALLBACK_CONTEXT
+{
+	JPTRCRHANDLE Handle;
+	ULONG Counter;
+	ULONGLONG Duration;
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+typedef struct _CALIBRATION
+{
+	ULONGLONG Frequency;
+	ULONGLONG Timestamp;
+	ULONGLONG SystemTime;
+	LONGLONG ProcessorOffset;
+} CALIBRATION, *PCALIBRATION;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+static VOID WriteCalibrationChunk(
+	__in PJPTRC_CALIBRATION_CHUNK Chunk,
+	__in PCALIBRATION Calibration
+	)
+{
+	Chunk->Header.Type			= JPTRC_CHUNK_TYPE_CALIBRATION;
+	Chunk->Header.Size			= CALIBRATION_CHUNK_SIZE;
+	Chunk->Frequency			= Calibration->Frequency;
+	Chunk->Timestamp			= Calibration->Timestamp;
+	Chunk->SystemTime			= Calibration->SystemTime;
+	Chunk->ProcessorCount		= 2;
+	Chunk->ProcessorOffsets[ 0 ]	= 0;
+	Chunk->ProcessorOffsets[ 1 ]	= Calibration->ProcessorOffset;
+}
+
+/*++
+	Routine Description:
+		Write a file containing a calibration chunk, a trace buffer
+		chunk holding a single call, and another calibration chunk.
+		If Calibrations is NULL, pad chunks are written in place of
+		the calibration chunks.
+--*/
+static void WriteTraceFile(
+	__in_ecount_opt( 2 ) CALIBRATION Calibrations[ 2 ]
+	)
+{
+	ULONGLONG Buffer[ FILE_SIZE / sizeof( ULONGLONG ) ];
+	PJPTRC_FILE_HEADER Header = ( PJPTRC_FILE_HEADER ) Buffer;
+	PJPTRC_CHUNK_HEADER First;
+	PJPTRC_CHUNK_HEADER Last;
+	PJPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+
+	C_ASSERT( ( FILE_SIZE % sizeof( ULONGLONG ) ) == 0 );
+
+	ZeroMemory( Buffer, sizeof( Buffer ) );
+
+	InitializeTraceFileHeader( Header );
+
+	First	= ( PJPTRC_CHUNK_HEADER ) ( Header + 1 );
+	Chunk	= ( PJPTRC_TRACE_BUFFER_CHUNK32 ) 
+		( ( PUCHAR ) First + CALIBRATION_CHUNK_SIZE );
+	Last	= ( PJPTRC_CHUNK_HEADER ) ( ( PUCHAR ) Chunk + TRACE_CHUNK_SIZE );
+
+	if ( Calibrations != NULL )
+	{
+		WriteCalibrationChunk( 
+			( PJPTRC_CALIBRATION_CHUNK ) First, 
+			&Calibrations[ 0 ] );
+		WriteCalibrationChunk( 
+			( PJPTRC_CALIBRATION_CHUNK ) Last, 
+			&Calibrations[ 1 ] );
+	}
+	else
+	{
+		First->Type	= JPTRC_CHUNK_TYPE_PAD;
+		First->Size	= CALIBRATION_CHUNK_SIZE;
+		Last->Type	= JPTRC_CHUNK_TYPE_PAD;
+		Last->Size	= CALIBRATION_CHUNK_SIZE;
+	}
+
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+	Chunk->Header.Size		= TRACE_CHUNK_SIZE;
+	Chunk->Client.ProcessId	= 4;
+	Chunk->Client.ThreadId	= 8;
+
+	Chunk->Transitions[ 0 ].Type		= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+	Chunk->Transitions[ 0 ].Timestamp	= CALL_ENTRY_TIMESTAMP;
+	Chunk->Transitions[ 0 ].Procedure	= 0x10000;
+	Chunk->Transitions[ 1 ].Type		= JPTRC_PROCEDURE_TRANSITION_EXIT;
+	Chunk->Transitions[ 1 ].Timestamp	= CALL_EXIT_TIMESTAMP;
+	Chunk->Transitions[ 1 ].Procedure	= 0x10000;
+
+	WriteTempTraceFile( FilePath, Buffer, sizeof( Buffer ) );
+}
+
+static void CollectDurationCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Call->EntryTimestamp == CALL_ENTRY_TIMESTAMP );
+	TEST( Call->ExitTimestamp == CALL_EXIT_TIMESTAMP );
+
+	Ctx->Duration = Call->Duration;
+	Ctx->Counter++;
+}
+
+static void CollectDurationClientsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST_OK( JptrcrEnumCalls( Ctx->Handle, Client, CollectDurationCallback, Ctx ) );
+}
+
+/*++
+	Routine Description:
+		Open the file and return the duration of the single call.
+--*/
+static ULONGLONG GetCallDuration(
+	__in JPTRCRHANDLE Handle
+	)
+{
+	CALLBACK_CONTEXT Ctx;
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	Ctx.Handle = Handle;
+	TEST_OK( JptrcrEnumClients( Handle, CollectDurationClientsCallback, &Ctx ) );
+	TEST( Ctx.Counter == 1 );
+
+	return Ctx.Duration;
+}
+
+static void TestMeasuredFrequency()
+{
+	CALIBRATION Calibrations[ 2 ] = 
+	{
+		{ 2000000000, 500, 1000000, 30 },
+		{ 1000000000, 10000, 1000095, -20 }
+	};
+	JPTRCR_CLOCK_INFO ClockInfo;
+	JPTRCRHANDLE Handle;
+	ULONGLONG Nanoseconds;
+
+	WriteTraceFile( Calibrations );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	//
+	// Latest frequency wins, earliest point is reported.
+	//
+	TEST_OK( JptrcrGetClockInfo( Handle, &ClockInfo ) );
+	TEST( ClockInfo.Frequency == 1000000000 );
+	TEST( ClockInfo.Timestamp == 500 );
+	TEST( ClockInfo.SystemTime.dwLowDateTime == 1000000 );
+	TEST( ClockInfo.SystemTime.dwHighDateTime == 0 );
+	TEST( ClockInfo.MaximumProcessorSkew == 30 );
+
+	TEST( GetCallDuration( Handle ) == 4000 );
+
+	TEST_OK( JptrcrTicksToNanoseconds( Handle, 3000000000, &Nanoseconds ) );
+	TEST( Nanoseconds == 3000000000 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestDerivedFrequency()
+{
+	//
+	// No frequency measured - 2 s of system time span 4e6 ticks,
+	// i.e. 2 MHz.
+	//
+	CALIBRATION Calibrations[ 2 ] = 
+	{
+		{ 0, 500, 10000000, 0 },
+		{ 0, 4000500, 30000000, 0 }
+	};
+	JPTRCR_CLOCK_INFO ClockInfo;
+	JPTRCRHANDLE Handle;
+
+	WriteTraceFile( Calibrations );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_OK( JptrcrGetClockInfo( Handle, &ClockInfo ) );
+	TEST( ClockInfo.Frequency == 2000000 );
+	TEST( ClockInfo.MaximumProcessorSkew == 0 );
+
+	TEST( GetCallDuration( Handle ) == 2000000 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestNoCalibration()
+{
+	JPTRCR_CLOCK_INFO ClockInfo;
+	JPTRCRHANDLE Handle;
+	ULONGLONG Nanoseconds;
+
+	WriteTraceFile( NULL );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_HR( JPTRCR_E_NO_CALIBRATION, JptrcrGetClockInfo( Handle, &ClockInfo ) );
+	TEST_HR( JPTRCR_E_NO_CALIBRATION, 
+		JptrcrTicksToNanoseconds( Handle, 1, &Nanoseconds ) );
+
+	TEST( GetCallDuration( Handle ) == 0 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestCorruptCalibrationChunk()
+{
+	CALIBRATION Calibrations[ 2 ] = 
+	{
+		{ 2000000000, 500, 1000000, 0 },
+		{ 1000000000, 10000, 1000095, 0 }
+	};
+	JPTRCRHANDLE Handle;
+	HANDLE File;
+	DWORD Written;
+	ULONG ProcessorCount = 3;
+
+	WriteTraceFile( Calibrations );
+
+	//
+	// Claim more processor offsets than the chunk holds.
+	//
+	File = CreateFile(
+		FilePath,
+		GENERIC_WRITE,
+		0,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL );
+	TEST( File != INVALID_HANDLE_VALUE );
+	TEST( INVALID_SET_FILE_POINTER != SetFilePointer(
+		File,
+		sizeof( JPTRC_FILE_HEADER ) + 
+			FIELD_OFFSET( JPTRC_CALIBRATION_CHUNK, ProcessorCount ),
+		NULL,
+		FILE_BEGIN ) );
+	TEST( WriteFile( File, &ProcessorCount, sizeof( ULONG ), &Written, NULL ) );
+	TEST( CloseHandle( File ) );
+
+	TEST_HR( JPTRCR_E_CORRUPT_CHUNK, JptrcrOpenFile( FilePath, &Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( Calibration )
+	CFIX_FIXTURE_ENTRY( TestMeasuredFrequency )
+	CFIX_FIXTURE_ENTRY( TestDerivedFrequency )
+	CFIX_FIXTURE_ENTRY( TestNoCalibration )
+	CFIX_FIXTURE_ENTRY( TestCorruptCalibrationChunk )
+CFIX_END_FIXTURE()
@@ -0,0 +1,260 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Circular file tests. Trace files are synthesized s.t. their
+ *		contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <stdlib.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define RING_SEGMENTS		4
+#define FILE_SIZE			( ( RING_SEGMENTS + 1 ) * JPTRC_SEGMENT_SIZE )
+#define TRACE_CHUNK_SIZE	FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, \
+								Transitions[ 2 ] )
+
+typedef struct _CALLBACK_CONTEXT
+{
+	JPTRCRHANDLE Handle;
+	ULONG Counter;
+	ULONGLONG Timestamps[ RING_SEGMENTS ];
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+/*++
+	Routine Description:
+		Write a circular file. Each ring segment contains a single
+		call of thread 8, timestamps are derived from the sequence
+		number.
+
+	Parameters:
+		SequenceNumbers	- Sequence number of each ring segment, 0
+						  for segments that have never been written.
+		HeadSegment		- Head segment index (1-based), 0 if none.
+--*/
+static void WriteCircularFile(
+	__in ULONG SequenceNumbers[ RING_SEGMENTS ],
+	__in ULONG HeadSegment
+	)
+{
+	PUCHAR Buffer;
+	PJPTRC_CIRCULAR_HEADER_CHUNK CircularHeader;
+	HANDLE File;
+	PJPTRC_FILE_HEADER Header;
+	ULONG Segment;
+	DWORD Written;
+	WCHAR TempPath[ MAX_PATH ];
+
+	Buffer = ( PUCHAR ) malloc( FILE_SIZE );
+	TEST( Buffer != NULL );
+	if ( Buffer == NULL ) return;
+
+	ZeroMemory( Buffer, FILE_SIZE );
+
+	Header = ( PJPTRC_FILE_HEADER ) Buffer;
+	Header->Signature		= JPTRC_HEADER_SIGNATURE;
+	Header->Version			= JPTRC_HEADER_VERSION;
+	Header->Characteristics	= JPTRC_CHARACTERISTIC_TIMESTAMP_TSC |
+							  JPTRC_CHARACTERISTIC_32BIT |
+							  JPTRC_CHARACTERISTIC_CIRCULAR;
+
+	CircularHeader = ( PJPTRC_CIRCULAR_HEADER_CHUNK ) ( Header + 1 );
+	CircularHeader->Header.Type		= JPTRC_CHUNK_TYPE_CIRCULAR_HEADER;
+	CircularHeader->Header.Size		= sizeof( JPTRC_CIRCULAR_HEADER_CHUNK );
+	CircularHeader->FixedDataEnd	= sizeof( JPTRC_FILE_HEADER ) +
+									  sizeof( JPTRC_CIRCULAR_HEADER_CHUNK );
+	CircularHeader->HeadSequenceNumber = HeadSegment == 0
+		? 0
+		: SequenceNumbers[ HeadSegment - 1 ];
+	CircularHeader->HeadOffset		= HeadSegment * JPTRC_SEGMENT_SIZE +
+		sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) + TRACE_CHUNK_SIZE;
+
+	for ( Segment = 1; Segment <= RING_SEGMENTS; Segment++ )
+	{
+		PUCHAR SegmentBase = Buffer + Segment * JPTRC_SEGMENT_SIZE;
+		PJPTRC_SEGMENT_HEADER_CHUNK SegmentHeader;
+		PJPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+		PJPTRC_PAD_CHUNK Pad;
+		ULONG SequenceNumber = SequenceNumbers[ Segment - 1 ];
+
+		if ( SequenceNumber == 0 )
+		{
+			continue;
+		}
+
+		SegmentHeader = ( PJPTRC_SEGMENT_HEADER_CHUNK ) SegmentBase;
+		SegmentHeader->Header.Type		= JPTRC_CHUNK_TYPE_SEGMENT_HEADER;
+		SegmentHeader->Header.Size		= sizeof( JPTRC_SEGMENT_HEADER_CHUNK );
+		SegmentHeader->SequenceNumber	= SequenceNumber;
+
+		Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 ) ( SegmentHeader + 1 );
+		Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+		Chunk->Header.Size		= TRACE_CHUNK_SIZE;
+		Chunk->Client.ProcessId	= 4;
+		Chunk->Client.ThreadId	= 8;
+
+		Chunk->Transitions[ 0 ].Type		= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+		Chunk->Transitions[ 0 ].Timestamp	= SequenceNumber * 100;
+		Chunk->Transitions[ 0 ].Procedure	= 0x10000;
+		Chunk->Transitions[ 1 ].Type		= JPTRC_PROCEDURE_TRANSITION_EXIT;
+		Chunk->Transitions[ 1 ].Timestamp	= SequenceNumber * 100 + 1;
+		Chunk->Transitions[ 1 ].Procedure	= 0x10000;
+
+		Pad = ( PJPTRC_PAD_CHUNK ) ( ( PUCHAR ) Chunk + TRACE_CHUNK_SIZE );
+
+		if ( Segment == HeadSegment )
+		{
+			//
+			// Remainder of head segment has not been written yet
+			// and contains stale data.
+			//
+			FillMemory(
+				Pad,
+				SegmentBase + JPTRC_SEGMENT_SIZE - ( PUCHAR ) Pad,
+				0xAB );
+		}
+		else
+		{
+			Pad->Header.Type	= JPTRC_CHUNK_TYPE_PAD;
+			Pad->Header.Size	= ( ULONG )
+				( SegmentBase + JPTRC_SEGMENT_SIZE - ( PUCHAR ) Pad );
+		}
+	}
+
+	TEST( GetTempPath( _countof( TempPath ), TempPath ) );
+	TEST( GetTempFileName( TempPath, L"jtr", 0, FilePath ) );
+
+	File = CreateFile(
+		FilePath,
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL );
+	TEST( File != INVALID_HANDLE_VALUE );
+	TEST( WriteFile( File, Buffer, FILE_SIZE, &Written, NULL ) );
+	TEST( Written == FILE_SIZE );
+	TEST( CloseHandle( File ) );
+
+	free( Buffer );
+}
+
+static void CollectCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Call->Procedure == 0x10000 );
+	TEST( Call->EntryType == JptrcrNormalEntry );
+	TEST( Call->ExitType == JptrcrNormalExit );
+
+	TEST( Ctx->Counter < RING_SEGMENTS );
+	if ( Ctx->Counter < RING_SEGMENTS )
+	{
+		Ctx->Timestamps[ Ctx->Counter++ ] = Call->EntryTimestamp;
+	}
+}
+
+static void CollectClientsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Client->ProcessId == 4 );
+	TEST( Client->ThreadId == 8 );
+
+	TEST_OK( JptrcrEnumCalls( Ctx->Handle, Client, CollectCallsCallback, Ctx ) );
+}
+
+/*++
+	Routine Description:
+		Open the file and check that the calls of exactly the
+		given sequence numbers are enumerated, in order.
+--*/
+static void OpenAndVerifyCircularFile(
+	__in ULONG ExpectedCount,
+	__in ULONG FirstExpectedSequenceNumber
+	)
+{
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	Ctx.Handle = Handle;
+	TEST_OK( JptrcrEnumClients( Handle, CollectClientsCallback, &Ctx ) );
+
+	TEST( Ctx.Counter == ExpectedCount );
+	for ( Index = 0; Index < Ctx.Counter; Index++ )
+	{
+		TEST( Ctx.Timestamps[ Index ] ==
+			( FirstExpectedSequenceNumber + Index ) * 100 );
+	}
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestOpenEmptyCircularFile()
+{
+	ULONG SequenceNumbers[ RING_SEGMENTS ] = { 0, 0, 0, 0 };
+
+	WriteCircularFile( SequenceNumbers, 0 );
+	OpenAndVerifyCircularFile( 0, 0 );
+}
+
+static void TestOpenUnwrappedCircularFile()
+{
+	ULONG SequenceNumbers[ RING_SEGMENTS ] = { 1, 2, 0, 0 };
+
+	WriteCircularFile( SequenceNumbers, 2 );
+	OpenAndVerifyCircularFile( 2, 1 );
+}
+
+static void TestOpenWrappedCircularFile()
+{
+	ULONG SequenceNumbers[ RING_SEGMENTS ] = { 5, 6, 3, 4 };
+
+	WriteCircularFile( SequenceNumbers, 2 );
+	OpenAndVerifyCircularFile( 4, 3 );
+}
+
+static void TestOpenCircularFileWithStaleHeader()
+{
+	//
+	// Segment 3 has been overwritten after the header has last
+	// been updated.
+	//
+	ULONG SequenceNumbers[ RING_SEGMENTS ] = { 5, 6, 7, 4 };
+
+	WriteCircularFile( SequenceNumbers, 2 );
+	OpenAndVerifyCircularFile( 3, 4 );
+}
+
+CFIX_BEGIN_FIXTURE( CircularFile )
+	CFIX_FIXTURE_ENTRY( TestOpenEmptyCircularFile )
+	CFIX_FIXTURE_ENTRY( TestOpenUnwrappedCircularFile )
+	CFIX_FIXTURE_ENTRY( TestOpenWrappedCircularFile )
+	CFIX_FIXTURE_ENTRY( TestOpenCircularFileWithStaleHeader )
+CFIX_END_FIXTURE()
@@ -0,0 +1,293 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Compact chunk encoding/decoding tests.
+ *
+ *		N.B. jptrccmp.h does not depend on the reader, these tests
+ *		therefore only exercise the codec. They also run on 
+ *		non-Windows hosts, see tests/host.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <string.h>
+#include <jptrccmp.h>
+#include <cfix.h>
+
+#define TEST CFIX_ASSERT
+
+#define MAX_TRANSITIONS		( JPTRC_SEGMENT_SIZE / sizeof( JPTRC_PROCEDURE_TRANSITION32 ) )
+#define MAX_DICTIONARY		1024
+#define SLOT_COUNT			2048
+#define CHUNK_CAPACITY		( FIELD_OFFSET( JPTRC_COMPACT_TRACE_BUFFER_CHUNK32, \
+								Procedures[ MAX_DICTIONARY ] ) + JPTRC_SEGMENT_SIZE )
+
+static JPTRC_PROCEDURE_TRANSITION32 Input[ MAX_TRANSITIONS ];
+static JPTRC_PROCEDURE_TRANSITION32 Output[ MAX_TRANSITIONS ];
+static JPTRCCMP_SLOT Slots[ SLOT_COUNT ];
+static ULONG Dictionary[ MAX_DICTIONARY ];
+static ULONGLONG ChunkBuffer[ CHUNK_CAPACITY / sizeof( ULONGLONG ) + 1 ];
+static ULONG RandomState;
+
+#define RANDOM_MAX			0x7FFF
+
+/*++
+	Routine Description:
+		Pseudo random numbers in the range 0..RANDOM_MAX. Unlike 
+		rand(), the sequence does not depend on the C runtime, so 
+		the tests behave the same when run on the build host (see 
+		tests/host).
+--*/
+static void SeedRandom(
+	__in ULONG Seed
+	)
+{
+	RandomState = Seed;
+}
+
+static ULONG NextRandom()
+{
+	RandomState = RandomState * 214013 + 2531011;
+	return ( RandomState >> 16 ) & RANDOM_MAX;
+}
+
+static void InitializeEncoder(
+	__out PJPTRCCMP_ENCODER Encoder
+	)
+{
+	ZeroMemory( Encoder, sizeof( JPTRCCMP_ENCODER ) );
+	ZeroMemory( Slots, sizeof( Slots ) );
+
+	Encoder->SlotCount			= SLOT_COUNT;
+	Encoder->Slots				= Slots;
+	Encoder->DictionaryCapacity	= MAX_DICTIONARY;
+	Encoder->Dictionary			= Dictionary;
+}
+
+/*++
+	Routine Description:
+		Generate a plausible sequence of properly nested transitions,
+		using a fixed seed.
+--*/
+static void GenerateTransitions(
+	__in ULONG Count,
+	__in ULONG ProcedureCount,
+	__in ULONGLONG StartTimestamp
+	)
+{
+	ULONG Index;
+	ULONG Stack[ 64 ];
+	ULONG Depth = 0;
+	ULONGLONG Timestamp = StartTimestamp;
+
+	for ( Index = 0; Index < Count; Index++ )
+	{
+		BOOL Enter = ( Depth == 0 ) ||
+			( Depth < _countof( Stack ) && ( NextRandom() % 2 ) == 0 );
+
+		Timestamp += NextRandom() % 2000;
+
+		//
+		// Simulate thread migration to a CPU with a slightly
+		// lagging TSC now and then.
+		//
+		if ( ( NextRandom() % 64 ) == 0 && Timestamp > StartTimestamp + 100 )
+		{
+			Timestamp -= NextRandom() % 100;
+		}
+
+		Input[ Index ].__Unused		= 0;
+		Input[ Index ].Timestamp	= Timestamp;
+
+		if ( Enter )
+		{
+			ULONG Procedure = 0x80500000 + ( NextRandom() % ProcedureCount ) * 16;
+			Stack[ Depth++ ] = Procedure;
+
+			Input[ Index ].Type				= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+			Input[ Index ].Procedure		= Procedure;
+			Input[ Index ].Info.CallerIp	= 0x80400000 + NextRandom() * 3;
+		}
+		else
+		{
+			Input[ Index ].Procedure	= Stack[ --Depth ];
+
+			if ( ( NextRandom() % 16 ) == 0 )
+			{
+				Input[ Index ].Type					= JPTRC_PROCEDURE_TRANSITION_UNWIND;
+				Input[ Index ].Info.Exception.Code	= 0xC0000005;
+			}
+			else
+			{
+				Input[ Index ].Type				= JPTRC_PROCEDURE_TRANSITION_EXIT;
+				Input[ Index ].Info.ReturnValue	= ( NextRandom() % 4 ) ? 0 : NextRandom();
+			}
+		}
+	}
+}
+
+static void TestRoundTrip()
+{
+	JPTRCCMP_ENCODER Encoder;
+	PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 Chunk =
+		( PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 ) ChunkBuffer;
+	ULONG Iteration;
+
+	InitializeEncoder( &Encoder );
+	SeedRandom( 42 );
+
+	for ( Iteration = 0; Iteration < 100; Iteration++ )
+	{
+		ULONG Count = 1 + NextRandom() * MAX_TRANSITIONS / RANDOM_MAX;
+		if ( Count > MAX_TRANSITIONS )
+		{
+			Count = MAX_TRANSITIONS;
+		}
+
+		GenerateTransitions(
+			Count,
+			500,
+			Iteration == 0 ? 0 : JPTRCCMP_TIMESTAMP_MASK - 0xFFFFFFFF );
+
+		Chunk->Client.ProcessId	= 4;
+		Chunk->Client.ThreadId	= 8;
+
+		TEST( JptrccmpEncodeTransitions(
+			&Encoder,
+			Count,
+			Input,
+			CHUNK_CAPACITY,
+			Chunk ) );
+		TEST( Chunk->Header.Type == JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT );
+		TEST( ( Chunk->Header.Size % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+		TEST( Chunk->TransitionCount == Count );
+		TEST( Chunk->ProcedureCount <= 500 );
+		TEST( Chunk->Client.ProcessId == 4 );
+		TEST( Chunk->Client.ThreadId == 8 );
+
+		//
+		// Unless the chunk is tiny, it must be substantially smaller 
+		// than the plain chunk.
+		//
+		TEST( Count < 1000 || Chunk->Header.Size * 2 <
+			( ULONG ) FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, Transitions[ Count ] ) );
+
+		ZeroMemory( Output, sizeof( Output ) );
+		TEST( JptrccmpDecodeTransitions( Chunk, Count, Output ) );
+		TEST( 0 == memcmp( Input, Output, Count * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) ) );
+	}
+}
+
+static void TestDictionaryOverflow()
+{
+	JPTRCCMP_ENCODER Encoder;
+	PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 Chunk =
+		( PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 ) ChunkBuffer;
+
+	InitializeEncoder( &Encoder );
+	SeedRandom( 1 );
+
+	//
+	// More distinct procedures than the dictionary can hold.
+	//
+	GenerateTransitions( MAX_TRANSITIONS, 0x10000, 0 );
+	TEST( ! JptrccmpEncodeTransitions(
+		&Encoder,
+		MAX_TRANSITIONS,
+		Input,
+		CHUNK_CAPACITY,
+		Chunk ) );
+
+	//
+	// Encoder must still be usable.
+	//
+	GenerateTransitions( 100, 10, 0 );
+	TEST( JptrccmpEncodeTransitions(
+		&Encoder,
+		100,
+		Input,
+		CHUNK_CAPACITY,
+		Chunk ) );
+	TEST( JptrccmpDecodeTransitions( Chunk, 100, Output ) );
+	TEST( 0 == memcmp( Input, Output, 100 * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) ) );
+}
+
+static void TestGenerationWrap()
+{
+	JPTRCCMP_ENCODER Encoder;
+	PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 Chunk =
+		( PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 ) ChunkBuffer;
+	ULONG Iteration;
+
+	InitializeEncoder( &Encoder );
+	SeedRandom( 7 );
+
+	for ( Iteration = 0; Iteration < 0x10010; Iteration++ )
+	{
+		GenerateTransitions( 8, 4, Iteration );
+		TEST( JptrccmpEncodeTransitions(
+			&Encoder,
+			8,
+			Input,
+			CHUNK_CAPACITY,
+			Chunk ) );
+		TEST( Chunk->ProcedureCount <= 4 );
+	}
+
+	TEST( JptrccmpDecodeTransitions( Chunk, 8, Output ) );
+	TEST( 0 == memcmp( Input, Output, 8 * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) ) );
+}
+
+static void TestDecodeCorruptChunk()
+{
+	JPTRCCMP_ENCODER Encoder;
+	PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 Chunk =
+		( PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 ) ChunkBuffer;
+	ULONG Size;
+
+	InitializeEncoder( &Encoder );
+	SeedRandom( 3 );
+
+	GenerateTransitions( 1000, 50, 0 );
+	TEST( JptrccmpEncodeTransitions(
+		&Encoder,
+		1000,
+		Input,
+		CHUNK_CAPACITY,
+		Chunk ) );
+	Size = Chunk->Header.Size;
+
+	//
+	// Output too small.
+	//
+	TEST( ! JptrccmpDecodeTransitions( Chunk, 999, Output ) );
+
+	//
+	// Truncated.
+	//
+	Chunk->Header.Size = Size - 2 * JPTRC_CHUNK_ALIGNMENT;
+	TEST( ! JptrccmpDecodeTransitions( Chunk, 1000, Output ) );
+	Chunk->Header.Size = FIELD_OFFSET( JPTRC_COMPACT_TRACE_BUFFER_CHUNK32, Procedures );
+	TEST( ! JptrccmpDecodeTransitions( Chunk, 1000, Output ) );
+	Chunk->Header.Size = Size;
+
+	//
+	// Trailing garbage.
+	//
+	Chunk->TransitionCount = 999;
+	TEST( ! JptrccmpDecodeTransitions( Chunk, 1000, Output ) );
+	Chunk->TransitionCount = 1000;
+
+	//
+	// Dictionary index out of range.
+	//
+	Chunk->ProcedureCount = 1;
+	TEST( ! JptrccmpDecodeTransitions( Chunk, 1000, Output ) );
+}
+
+CFIX_BEGIN_FIXTURE( CompactChunk )
+	CFIX_FIXTURE_ENTRY( TestRoundTrip )
+	CFIX_FIXTURE_ENTRY( TestDictionaryOverflow )
+	CFIX_FIXTURE_ENTRY( TestGenerationWrap )
+	CFIX_FIXTURE_ENTRY( TestDecodeCorruptChunk )
+CFIX_END_FIXTURE()
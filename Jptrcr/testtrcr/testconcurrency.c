@@ -0,0 +1,327 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for sharing a file handle among threads.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define MAX_RECORDS			16
+#define READER_THREADS		8
+#define ITERATIONS			200
+#define NESTED_READER_TIMEOUT	10000
+
+typedef struct _CALL_COUNTS
+{
+	JPTRCRHANDLE Handle;
+	ULONG Calls;
+	ULONG ActiveCalls;
+	ULONG TimelineRecords;
+} CALL_COUNTS, *PCALL_COUNTS;
+
+typedef struct _NESTED_READER_CONTEXT
+{
+	JPTRCR_CLIENT Client;
+	ULONG OuterCalls;
+	CALL_COUNTS Counts;
+} NESTED_READER_CONTEXT, *PNESTED_READER_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+static JPTRCRHANDLE SharedHandle;
+static CALL_COUNTS Expected;
+
+static void CountCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALL_COUNTS Counts = ( PCALL_COUNTS ) Context;
+	TEST( Counts );
+
+	Counts->Calls++;
+
+	//
+	// Descend to build and use the call index.
+	//
+	TEST( SUCCEEDED( JptrcrEnumChildCalls(
+		Counts->Handle,
+		&Call->CallHandle,
+		CountCallsCallback,
+		Counts ) ) );
+}
+
+static void CountActiveCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALL_COUNTS Counts = ( PCALL_COUNTS ) Context;
+	UNREFERENCED_PARAMETER( Call );
+	TEST( Counts );
+
+	Counts->ActiveCalls++;
+}
+
+static void CountClientCallsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PCALL_COUNTS Counts = ( PCALL_COUNTS ) Context;
+	TEST( Counts );
+
+	TEST( SUCCEEDED( JptrcrEnumCalls(
+		Counts->Handle,
+		Client,
+		CountCallsCallback,
+		Counts ) ) );
+
+	TEST( SUCCEEDED( JptrcrEnumActiveCalls(
+		Counts->Handle,
+		Client,
+		35,
+		CountActiveCallsCallback,
+		Counts ) ) );
+}
+
+static void CountCalls(
+	__in JPTRCRHANDLE Handle,
+	__out PCALL_COUNTS Counts
+	)
+{
+	JPTRCR_TRANSITION_RECORD Records[ MAX_RECORDS ];
+	ULONG Read;
+	JPTRCRTIMELINEHANDLE Timeline;
+	ULONG Index;
+
+	ZeroMemory( Counts, sizeof( CALL_COUNTS ) );
+	Counts->Handle = Handle;
+
+	TEST_OK( JptrcrEnumClients(
+		Handle,
+		CountClientCallsCallback,
+		Counts ) );
+
+	//
+	// Each thread uses its own timeline.
+	//
+	TEST_OK( JptrcrCreateTimeline( Handle, NULL, &Timeline ) );
+	TEST_HR( S_FALSE, JptrcrReadTimeline(
+		Timeline,
+		_countof( Records ),
+		Records,
+		&Read ) );
+	TEST_OK( JptrcrDeleteTimeline( Timeline ) );
+
+	for ( Index = 1; Index < Read; Index++ )
+	{
+		TEST( Records[ Index - 1 ].Timestamp < Records[ Index ].Timestamp );
+	}
+
+	Counts->TimelineRecords = Read;
+}
+
+static DWORD CALLBACK ReaderThreadProc(
+	__in PVOID Unused
+	)
+{
+	CALL_COUNTS Counts;
+	ULONG Iteration;
+
+	UNREFERENCED_PARAMETER( Unused );
+
+	for ( Iteration = 0; Iteration < ITERATIONS; Iteration++ )
+	{
+		CountCalls( SharedHandle, &Counts );
+
+		TEST( Counts.Calls == Expected.Calls );
+		TEST( Counts.ActiveCalls == Expected.ActiveCalls );
+		TEST( Counts.TimelineRecords == Expected.TimelineRecords );
+
+		//
+		// Shrink the cache every now and then to force other
+		// threads to remap.
+		//
+		if ( Iteration % 16 == 0 )
+		{
+			TEST_OK( JptrcrSetMappingCacheCapacity(
+				SharedHandle,
+				( Iteration % 32 == 0 ) ? 1 : 16 ) );
+		}
+	}
+
+	return 0;
+}
+
+static void TestConcurrentReaders()
+{
+	ULONG Index;
+	JPTRCR_MAPPING_STATISTICS Statistics;
+	HANDLE Threads[ READER_THREADS ];
+
+	WriteInterleavedTraceFile( FilePath );
+
+	//
+	// Use a separate handle for the expected results so that the
+	// shared one starts without any indexes built.
+	//
+	TEST_OK( JptrcrOpenFile( FilePath, &SharedHandle ) );
+	CountCalls( SharedHandle, &Expected );
+	TEST_OK( JptrcrCloseFile( SharedHandle ) );
+
+	TEST( Expected.Calls == 5 );
+	TEST( Expected.ActiveCalls == 3 );
+	TEST( Expected.TimelineRecords == 10 );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &SharedHandle ) );
+
+	for ( Index = 0; Index < READER_THREADS; Index++ )
+	{
+		Threads[ Index ] = CfixCreateThread(
+			NULL,
+			0,
+			ReaderThreadProc,
+			NULL,
+			0,
+			NULL );
+		TEST( Threads[ Index ] );
+	}
+
+	TEST( WAIT_OBJECT_0 == WaitForMultipleObjects(
+		_countof( Threads ), Threads, TRUE, INFINITE ) );
+
+	for ( Index = 0; Index < READER_THREADS; Index++ )
+	{
+		TEST( CloseHandle( Threads[ Index ] ) );
+	}
+
+	TEST_OK( JptrcrGetMappingStatistics( SharedHandle, &Statistics ) );
+	TEST( Statistics.Hits + Statistics.Misses > 0 );
+
+	TEST_OK( JptrcrCloseFile( SharedHandle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void CaptureClientCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PNESTED_READER_CONTEXT Nested = ( PNESTED_READER_CONTEXT ) Context;
+	TEST( Nested );
+
+	if ( Client->ThreadId == 8 )
+	{
+		Nested->Client = *Client;
+	}
+}
+
+static DWORD CALLBACK NestedReaderThreadProc(
+	__in PVOID PvContext
+	)
+{
+	PNESTED_READER_CONTEXT Nested = ( PNESTED_READER_CONTEXT ) PvContext;
+	JPTRCR_CALL_CURSOR Cursor;
+	ULONG Read;
+	JPTRCR_CALL_RECORD Records[ MAX_RECORDS ];
+
+	TEST_OK( JptrcrEnumCalls(
+		SharedHandle,
+		&Nested->Client,
+		CountCallsCallback,
+		&Nested->Counts ) );
+
+	TEST_OK( JptrcrInitializeCallCursor(
+		SharedHandle,
+		&Nested->Client,
+		NULL,
+		&Cursor ) );
+	TEST_HR( S_FALSE, JptrcrReadCalls(
+		SharedHandle,
+		&Cursor,
+		_countof( Records ),
+		Records,
+		&Read ) );
+	TEST( Read == 1 );
+
+	return 0;
+}
+
+static void RunNestedReaderCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PNESTED_READER_CONTEXT Nested = ( PNESTED_READER_CONTEXT ) Context;
+	HANDLE Thread;
+
+	UNREFERENCED_PARAMETER( Call );
+	TEST( Nested );
+
+	Nested->OuterCalls++;
+
+	//
+	// The other thread would never get past the file lock if 
+	// callbacks were invoked with the lock held.
+	//
+	Thread = CfixCreateThread(
+		NULL,
+		0,
+		NestedReaderThreadProc,
+		Nested,
+		0,
+		NULL );
+	TEST( Thread );
+
+	TEST( WAIT_OBJECT_0 == WaitForSingleObject( 
+		Thread, 
+		NESTED_READER_TIMEOUT ) );
+	TEST( CloseHandle( Thread ) );
+}
+
+static void TestCallbacksDoNotBlockReaders()
+{
+	NESTED_READER_CONTEXT Nested;
+
+	WriteInterleavedTraceFile( FilePath );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &SharedHandle ) );
+
+	ZeroMemory( &Nested, sizeof( NESTED_READER_CONTEXT ) );
+	Nested.Counts.Handle = SharedHandle;
+
+	TEST_OK( JptrcrEnumClients(
+		SharedHandle,
+		CaptureClientCallback,
+		&Nested ) );
+	TEST( Nested.Client.ThreadId == 8 );
+
+	TEST_OK( JptrcrEnumCalls(
+		SharedHandle,
+		&Nested.Client,
+		RunNestedReaderCallback,
+		&Nested ) );
+
+	//
+	// Thread 8 made one top level call with two callees.
+	//
+	TEST( Nested.OuterCalls == 1 );
+	TEST( Nested.Counts.Calls == 3 );
+
+	TEST_OK( JptrcrCloseFile( SharedHandle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( Concurrency )
+	CFIX_FIXTURE_ENTRY( TestConcurrentReaders )
+	CFIX_FIXTURE_ENTRY( TestCallbacksDoNotBlockReaders )
+CFIX_END_FIXTURE()
@@ -0,0 +1,222 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Index chunk tests. Trace files are synthesized s.t. their
+ *		contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define TRANSITIONS_PER_CHUNK	4
+#define TRACE_CHUNK_SIZE		FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, \
+									Transitions[ TRANSITIONS_PER_CHUNK ] )
+
+#define CLIENT_COUNT			2
+#define CHUNK_COUNT				3
+#define INDEX_CHUNK_SIZE		JPTRC_INDEX_CHUNK_SIZE( 0, 1, CLIENT_COUNT, CHUNK_COUNT )
+
+#define INDEX_CHUNK_OFFSET		( sizeof( JPTRC_FILE_HEADER ) + \
+									CHUNK_COUNT * TRACE_CHUNK_SIZE )
+
+typedef enum
+{
+	IndexComplete,
+	IndexMissingTrailer,
+	IndexBrokenChain
+} INDEX_KIND;
+
+typedef struct _CALLBACK_CONTEXT
+{
+	JPTRCRHANDLE Handle;
+	ULONG Counter;
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+/*++
+	Routine Description:
+		Write a file containing 3 trace buffer chunks of 2 clients
+		(thread 8 owning the first and third chunk), each holding 2
+		top level calls.
+--*/
+static void WriteTraceFile(
+	__in INDEX_KIND Kind
+	)
+{
+	UCHAR Buffer[ INDEX_CHUNK_OFFSET + INDEX_CHUNK_SIZE +
+		sizeof( JPTRC_INDEX_TRAILER_CHUNK ) ];
+	PJPTRC_FILE_HEADER Header = ( PJPTRC_FILE_HEADER ) Buffer;
+	PJPTRC_INDEX_CHUNK Index;
+	PJPTRC_INDEX_CLIENT Clients;
+	PULONGLONG ChunkOffsets;
+	PJPTRC_INDEX_SEGMENT Segment;
+	PJPTRC_INDEX_TRAILER_CHUNK Trailer;
+	ULONG ChunkIndex;
+	ULONG Size;
+
+	ZeroMemory( Buffer, sizeof( Buffer ) );
+
+	InitializeTraceFileHeader( Header );
+
+	for ( ChunkIndex = 0; ChunkIndex < CHUNK_COUNT; ChunkIndex++ )
+	{
+		PJPTRC_TRACE_BUFFER_CHUNK32 Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 )
+			( Buffer + sizeof( JPTRC_FILE_HEADER ) + ChunkIndex * TRACE_CHUNK_SIZE );
+		ULONG Transition;
+
+		Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+		Chunk->Header.Size		= TRACE_CHUNK_SIZE;
+		Chunk->Client.ProcessId	= 4;
+		Chunk->Client.ThreadId	= ( ChunkIndex == 1 ) ? 12 : 8;
+
+		for ( Transition = 0; Transition < TRANSITIONS_PER_CHUNK; Transition++ )
+		{
+			Chunk->Transitions[ Transition ].Type = ( Transition % 2 ) == 0
+				? JPTRC_PROCEDURE_TRANSITION_ENTRY
+				: JPTRC_PROCEDURE_TRANSITION_EXIT;
+			Chunk->Transitions[ Transition ].Timestamp	=
+				ChunkIndex * 100 + Transition;
+			Chunk->Transitions[ Transition ].Procedure	= 0x10000;
+		}
+	}
+
+	Index = ( PJPTRC_INDEX_CHUNK ) ( Buffer + INDEX_CHUNK_OFFSET );
+	Index->Header.Type			= JPTRC_CHUNK_TYPE_INDEX;
+	Index->Header.Size			= INDEX_CHUNK_SIZE;
+	Index->PreviousIndexOffset	= 0;
+	Index->StartOffset			= ( Kind == IndexBrokenChain )
+		? sizeof( JPTRC_FILE_HEADER ) + TRACE_CHUNK_SIZE
+		: sizeof( JPTRC_FILE_HEADER );
+	Index->EndOffset			= INDEX_CHUNK_OFFSET;
+	Index->ImageInfoCount		= 0;
+	Index->SegmentCount			= 1;
+	Index->ClientCount			= CLIENT_COUNT;
+	Index->ChunkCount			= CHUNK_COUNT;
+
+	Segment = JPTRC_INDEX_SEGMENTS( Index );
+	Segment->Offset			= 0;
+	Segment->MinTimestamp	= 0;
+	Segment->MaxTimestamp	= ( CHUNK_COUNT - 1 ) * 100 + TRANSITIONS_PER_CHUNK - 1;
+
+	Clients = JPTRC_INDEX_CLIENTS( Index );
+	Clients[ 0 ].ProcessId	= 4;
+	Clients[ 0 ].ThreadId	= 8;
+	Clients[ 0 ].FirstChunk	= 0;
+	Clients[ 0 ].ChunkCount	= 2;
+	Clients[ 1 ].ProcessId	= 4;
+	Clients[ 1 ].ThreadId	= 12;
+	Clients[ 1 ].FirstChunk	= 2;
+	Clients[ 1 ].ChunkCount	= 1;
+
+	ChunkOffsets = JPTRC_INDEX_CHUNK_OFFSETS( Index );
+	ChunkOffsets[ 0 ] = sizeof( JPTRC_FILE_HEADER );
+	ChunkOffsets[ 1 ] = sizeof( JPTRC_FILE_HEADER ) + 2 * TRACE_CHUNK_SIZE;
+	ChunkOffsets[ 2 ] = sizeof( JPTRC_FILE_HEADER ) + TRACE_CHUNK_SIZE;
+
+	Trailer = ( PJPTRC_INDEX_TRAILER_CHUNK )
+		( Buffer + INDEX_CHUNK_OFFSET + INDEX_CHUNK_SIZE );
+	Trailer->Header.Type		= JPTRC_CHUNK_TYPE_INDEX_TRAILER;
+	Trailer->Header.Size		= sizeof( JPTRC_INDEX_TRAILER_CHUNK );
+	Trailer->LastIndexOffset	= INDEX_CHUNK_OFFSET;
+
+	Size = ( Kind == IndexMissingTrailer )
+		? sizeof( Buffer ) - sizeof( JPTRC_INDEX_TRAILER_CHUNK )
+		: sizeof( Buffer );
+
+	WriteTempTraceFile( FilePath, Buffer, Size );
+}
+
+static void CountCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+	Ctx->Counter++;
+
+	TEST( Call->Procedure == 0x10000 );
+	TEST( Call->EntryType == JptrcrNormalEntry );
+	TEST( Call->ExitType == JptrcrNormalExit );
+	TEST( Call->ChildCalls == 0 );
+}
+
+static void CountClientsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	CALLBACK_CONTEXT SubCtx;
+
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+	Ctx->Counter++;
+
+	TEST( Client->ProcessId == 4 );
+	TEST( Client->ThreadId == 8 || Client->ThreadId == 12 );
+
+	SubCtx.Handle	= Ctx->Handle;
+	SubCtx.Counter	= 0;
+	TEST_OK( JptrcrEnumCalls( Ctx->Handle, Client, CountCallsCallback, &SubCtx ) );
+
+	TEST( SubCtx.Counter == ( Client->ThreadId == 8 ? 4 : 2 ) );
+}
+
+static void OpenAndVerifyTraceFile(
+	__in INDEX_KIND Kind
+	)
+{
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+
+	WriteTraceFile( Kind );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	//
+	// Enumerate twice - indexed chunk refs are loaded on first use.
+	//
+	Ctx.Handle	= Handle;
+	Ctx.Counter	= 0;
+	TEST_OK( JptrcrEnumClients( Handle, CountClientsCallback, &Ctx ) );
+	TEST( Ctx.Counter == CLIENT_COUNT );
+
+	Ctx.Counter	= 0;
+	TEST_OK( JptrcrEnumClients( Handle, CountClientsCallback, &Ctx ) );
+	TEST( Ctx.Counter == CLIENT_COUNT );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestOpenIndexedFile()
+{
+	OpenAndVerifyTraceFile( IndexComplete );
+}
+
+static void TestOpenFileWithoutTrailer()
+{
+	OpenAndVerifyTraceFile( IndexMissingTrailer );
+}
+
+static void TestOpenFileWithBrokenIndex()
+{
+	OpenAndVerifyTraceFile( IndexBrokenChain );
+}
+
+CFIX_BEGIN_FIXTURE( IndexChunk )
+	CFIX_FIXTURE_ENTRY( TestOpenIndexedFile )
+	CFIX_FIXTURE_ENTRY( TestOpenFileWithoutTrailer )
+	CFIX_FIXTURE_ENTRY( TestOpenFileWithBrokenIndex )
+CFIX_END_FIXTURE()
@@ -0,0 +1,239 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Inventory tests. Files span multiple scan tasks s.t. they are
+ *		scanned in parallel on multiprocessor machines.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <string.h>
+#include <jptrcfmt.h>
+#include <jptrcsym.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+//
+// The reader scans 16 segments per task.
+//
+#define SEGMENTS			48
+#define SYMBOL_SEGMENT		40
+#define STRADDLE_SEGMENT	20
+#define CORRUPT_SEGMENT		36
+#define CHUNK_CAPACITY		256
+
+typedef enum
+{
+	LayoutConforming,
+
+	//
+	// A pad chunk crosses the boundary between STRADDLE_SEGMENT
+	// and its successor.
+	//
+	LayoutStraddling,
+
+	//
+	// The trace chunk of CORRUPT_SEGMENT uses the reserved field.
+	//
+	LayoutCorrupt
+} FILE_LAYOUT;
+
+typedef struct _CALLBACK_CONTEXT
+{
+	ULONG Counter;
+	ULONGLONG LastTimestamp;
+	PSYMBOL_INFO Symbol;
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+/*++
+	Routine Description:
+		Write a file of SEGMENTS segments. Each segment begins with
+		a trace buffer chunk holding a single call to 0x10000,
+		segments alternate between thread 8 and thread 12.
+		The symbol for 0x10000 is only defined in SYMBOL_SEGMENT.
+--*/
+static void WriteTraceFile(
+	__in FILE_LAYOUT Layout
+	)
+{
+	PUCHAR Buffer;
+	ULONG Segment;
+
+	Buffer = AllocateSegmentedTraceFile( SEGMENTS );
+	if ( Buffer == NULL ) return;
+
+	for ( Segment = 0; Segment < SEGMENTS; Segment++ )
+	{
+		PUCHAR Position = GetSegmentPosition( Buffer, Segment );
+		PJPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+		PJPTRC_PAD_CHUNK Pad;
+
+		if ( Layout == LayoutStraddling &&
+			 Segment == STRADDLE_SEGMENT + 1 )
+		{
+			//
+			// Covered by the preceding pad chunk.
+			//
+			Position += JPTRC_CHUNK_ALIGNMENT;
+		}
+
+		Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 ) Position;
+		Position = BuildSingleCallChunk(
+			Position,
+			( Segment % 2 ) == 0 ? 8 : 12,
+			Segment * 100 );
+
+		if ( Layout == LayoutCorrupt && Segment == CORRUPT_SEGMENT )
+		{
+			Chunk->Header.Reserved = 1;
+		}
+
+		if ( Segment == SYMBOL_SEGMENT )
+		{
+			PJPTRC_SYMBOL_TABLE_CHUNK Table =
+				( PJPTRC_SYMBOL_TABLE_CHUNK ) Position;
+
+			JptrcsymInitializeChunk( Table );
+			TEST( JptrcsymAppendSymbol(
+				Table,
+				CHUNK_CAPACITY,
+				0x10000,
+				0x10000000,
+				"Foo",
+				3 ) );
+
+			Position += Table->Header.Size;
+		}
+
+		Pad = PadSegment( Buffer, Segment, Position );
+
+		if ( Layout == LayoutStraddling && Segment == STRADDLE_SEGMENT )
+		{
+			Pad->Header.Size += JPTRC_CHUNK_ALIGNMENT;
+		}
+	}
+
+	WriteSegmentedTraceFile( FilePath, Buffer, SEGMENTS );
+}
+
+static void CheckCallCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Call->Procedure == 0x10000 );
+	TEST( Call->ExitTimestamp == Call->EntryTimestamp + 1 );
+
+	//
+	// Calls must be delivered in file order.
+	//
+	if ( Ctx->Counter > 0 )
+	{
+		TEST( Call->EntryTimestamp == Ctx->LastTimestamp + 200 );
+	}
+
+	Ctx->LastTimestamp	= Call->EntryTimestamp;
+	Ctx->Symbol			= Call->Symbol;
+	Ctx->Counter++;
+}
+
+static void CheckClient(
+	__in JPTRCRHANDLE Handle,
+	__in ULONG ThreadId
+	)
+{
+	JPTRCR_CLIENT Client;
+	CALLBACK_CONTEXT Ctx;
+
+	Client.ProcessId	= 4;
+	Client.ThreadId		= ThreadId;
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CheckCallCallback, &Ctx ) );
+	TEST( Ctx.Counter == SEGMENTS / 2 );
+
+	//
+	// The symbol table follows most trace chunks, but it must
+	// nevertheless have been loaded.
+	//
+	TEST( Ctx.Symbol != NULL );
+	if ( Ctx.Symbol != NULL )
+	{
+		TEST( 0 == wcscmp( Ctx.Symbol->Name, L"Foo" ) );
+	}
+}
+
+static void CountClientsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PULONG Count = ( PULONG ) Context;
+	TEST( Count );
+	if ( ! Count ) return;
+
+	TEST( Client->ProcessId == 4 );
+	TEST( Client->ThreadId == 8 || Client->ThreadId == 12 );
+	( *Count )++;
+}
+
+static void OpenAndCheckFile()
+{
+	ULONG ClientCount = 0;
+	JPTRCRHANDLE Handle;
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_OK( JptrcrEnumClients( Handle, CountClientsCallback, &ClientCount ) );
+	TEST( ClientCount == 2 );
+
+	CheckClient( Handle, 8 );
+	CheckClient( Handle, 12 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+}
+
+static void TestInventoryOfConformingFile()
+{
+	WriteTraceFile( LayoutConforming );
+	OpenAndCheckFile();
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestInventoryOfStraddlingFile()
+{
+	//
+	// Cannot be scanned in parallel - must fall back to a
+	// sequential scan.
+	//
+	WriteTraceFile( LayoutStraddling );
+	OpenAndCheckFile();
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestInventoryOfCorruptFile()
+{
+	JPTRCRHANDLE Handle;
+
+	WriteTraceFile( LayoutCorrupt );
+	TEST_HR( JPTRCR_E_RESERVED_FIELDS_USED,
+		JptrcrOpenFile( FilePath, &Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( Inventory )
+	CFIX_FIXTURE_ENTRY( TestInventoryOfConformingFile )
+	CFIX_FIXTURE_ENTRY( TestInventoryOfStraddlingFile )
+	CFIX_FIXTURE_ENTRY( TestInventoryOfCorruptFile )
+CFIX_END_FIXTURE()
@@ -0,0 +1,194 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Mapping cache tests. Trace files are synthesized s.t. their
+ *		contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+//
+// The reader maps windows of 4 segments.
+//
+#define SEGMENTS_PER_WINDOW	4
+#define WINDOWS				4
+#define SEGMENTS			( WINDOWS * SEGMENTS_PER_WINDOW )
+
+typedef struct _CALLBACK_CONTEXT
+{
+	ULONG Counter;
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+/*++
+	Routine Description:
+		Write a file spanning WINDOWS mapping windows. Each window
+		begins with a trace buffer chunk holding a single call,
+		windows alternate between thread 8 and thread 12.
+--*/
+static void WriteTraceFile()
+{
+	PUCHAR Buffer;
+	ULONG Segment;
+
+	Buffer = AllocateSegmentedTraceFile( SEGMENTS );
+	if ( Buffer == NULL ) return;
+
+	for ( Segment = 0; Segment < SEGMENTS; Segment++ )
+	{
+		PUCHAR Position = GetSegmentPosition( Buffer, Segment );
+
+		if ( ( Segment % SEGMENTS_PER_WINDOW ) == 0 )
+		{
+			ULONG Window = Segment / SEGMENTS_PER_WINDOW;
+
+			Position = BuildSingleCallChunk(
+				Position,
+				( Window % 2 ) == 0 ? 8 : 12,
+				Window * 100 );
+		}
+
+		PadSegment( Buffer, Segment, Position );
+	}
+
+	WriteSegmentedTraceFile( FilePath, Buffer, SEGMENTS );
+}
+
+static void CountCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Call->Procedure == 0x10000 );
+	Ctx->Counter++;
+}
+
+/*++
+	Routine Description:
+		Enumerate the calls of both threads. The chunks of the
+		threads are located in alternating windows.
+--*/
+static void EnumInterleavedClients(
+	__in JPTRCRHANDLE Handle
+	)
+{
+	JPTRCR_CLIENT FirstClient = { 4, 8 };
+	JPTRCR_CLIENT SecondClient = { 4, 12 };
+	CALLBACK_CONTEXT Ctx;
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &FirstClient, CountCallsCallback, &Ctx ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &SecondClient, CountCallsCallback, &Ctx ) );
+	TEST( Ctx.Counter == WINDOWS );
+}
+
+static void TestSequentialScanPrefetches()
+{
+	JPTRCRHANDLE Handle;
+	JPTRCR_MAPPING_STATISTICS Statistics;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	//
+	// The file has no index and has been scanned sequentially.
+	//
+	TEST_OK( JptrcrGetMappingStatistics( Handle, &Statistics ) );
+	TEST( Statistics.Prefetches > 0 );
+	TEST( Statistics.Misses + Statistics.Prefetches == WINDOWS );
+	TEST( Statistics.Remaps == 0 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestInterleavedAccessHitsCache()
+{
+	JPTRCRHANDLE Handle;
+	JPTRCR_MAPPING_STATISTICS Before;
+	JPTRCR_MAPPING_STATISTICS After;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_OK( JptrcrGetMappingStatistics( Handle, &Before ) );
+	EnumInterleavedClients( Handle );
+	TEST_OK( JptrcrGetMappingStatistics( Handle, &After ) );
+
+	//
+	// All windows remain mapped.
+	//
+	TEST( After.Misses == Before.Misses );
+	TEST( After.Remaps == 0 );
+	TEST( After.Hits > Before.Hits );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestInterleavedAccessWithSingleWindow()
+{
+	JPTRCRHANDLE Handle;
+	JPTRCR_MAPPING_STATISTICS Before;
+	JPTRCR_MAPPING_STATISTICS After;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_OK( JptrcrSetMappingCacheCapacity( Handle, 1 ) );
+
+	TEST_OK( JptrcrGetMappingStatistics( Handle, &Before ) );
+	EnumInterleavedClients( Handle );
+	TEST_OK( JptrcrGetMappingStatistics( Handle, &After ) );
+
+	//
+	// Every window change requires remapping.
+	//
+	TEST( After.Misses - Before.Misses >= WINDOWS - 1 );
+	TEST( After.Remaps - Before.Remaps == After.Misses - Before.Misses );
+	TEST( After.Prefetches == Before.Prefetches );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestSetInvalidCapacity()
+{
+	JPTRCRHANDLE Handle;
+	JPTRCR_MAPPING_STATISTICS Statistics;
+
+	WriteTraceFile();
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	TEST_HR( E_INVALIDARG, JptrcrSetMappingCacheCapacity( NULL, 1 ) );
+	TEST_HR( E_INVALIDARG, JptrcrSetMappingCacheCapacity( Handle, 0 ) );
+	TEST_HR( E_INVALIDARG, JptrcrSetMappingCacheCapacity( Handle, 129 ) );
+	TEST_OK( JptrcrSetMappingCacheCapacity( Handle, 128 ) );
+
+	TEST_HR( E_INVALIDARG, JptrcrGetMappingStatistics( NULL, &Statistics ) );
+	TEST_HR( E_INVALIDARG, JptrcrGetMappingStatistics( Handle, NULL ) );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( MappingCache )
+	CFIX_FIXTURE_ENTRY( TestSequentialScanPrefetches )
+	CFIX_FIXTURE_ENTRY( TestInterleavedAccessHitsCache )
+	CFIX_FIXTURE_ENTRY( TestInterleavedAccessWithSingleWindow )
+	CFIX_FIXTURE_ENTRY( TestSetInvalidCapacity )
+CFIX_END_FIXTURE()
@@ -0,0 +1,248 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Call nesting tests. Trace files are synthesized s.t. their
+ *		contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define MAX_CALLS					8
+
+typedef struct _CALLBACK_CONTEXT
+{
+	JPTRCRHANDLE Handle;
+	ULONG Counter;
+	JPTRCR_CALL Calls[ MAX_CALLS ];
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+static void CollectCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->Counter < MAX_CALLS );
+	if ( Ctx->Counter < MAX_CALLS )
+	{
+		Ctx->Calls[ Ctx->Counter++ ] = *Call;
+	}
+}
+
+static void CountCallsRecursiveCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	Ctx->Counter++;
+
+	if ( Call->EntryType == JptrcrNormalEntry )
+	{
+		TEST_OK( JptrcrEnumChildCalls(
+			Ctx->Handle,
+			&Call->CallHandle,
+			CountCallsRecursiveCallback,
+			Ctx ) );
+	}
+}
+
+static void EnumChildCalls(
+	__in JPTRCRHANDLE Handle,
+	__in PJPTRCR_CALL_HANDLE CallerHandle,
+	__out PCALLBACK_CONTEXT Ctx
+	)
+{
+	//
+	// The handle may point into Ctx.
+	//
+	JPTRCR_CALL_HANDLE Caller = *CallerHandle;
+
+	ZeroMemory( Ctx, sizeof( CALLBACK_CONTEXT ) );
+	Ctx->Handle = Handle;
+	TEST_OK( JptrcrEnumChildCalls(
+		Handle,
+		&Caller,
+		CollectCallsCallback,
+		Ctx ) );
+}
+
+static void TestEnumTopLevelCalls()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+
+	WriteNestedCallsTraceFile( FilePath, NULL, 0 );
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectCallsCallback, &Ctx ) );
+
+	//
+	// The exit without entry is ignored, H is not reported.
+	//
+	TEST( Ctx.Counter == 2 );
+
+	TEST( Ctx.Calls[ 0 ].Procedure == 0x10000 );
+	TEST( Ctx.Calls[ 0 ].EntryType == JptrcrNormalEntry );
+	TEST( Ctx.Calls[ 0 ].ExitType == JptrcrNormalExit );
+	TEST( Ctx.Calls[ 0 ].EntryTimestamp == 1 );
+	TEST( Ctx.Calls[ 0 ].ExitTimestamp == 10 );
+	TEST( Ctx.Calls[ 0 ].ChildCalls == 4 );
+	TEST( Ctx.Calls[ 0 ].Result.ReturnValue == 4 );
+
+	TEST( Ctx.Calls[ 1 ].Procedure == 0x50000 );
+	TEST( Ctx.Calls[ 1 ].ExitType == JptrcrNormalExit );
+	TEST( Ctx.Calls[ 1 ].ChildCalls == 1 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestEnumChildCalls()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+	CALLBACK_CONTEXT TopLevelCtx;
+
+	WriteNestedCallsTraceFile( FilePath, NULL, 0 );
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &TopLevelCtx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectCallsCallback, &TopLevelCtx ) );
+	TEST( TopLevelCtx.Counter == 2 );
+	if ( TopLevelCtx.Counter != 2 ) return;
+
+	//
+	// Children of A.
+	//
+	EnumChildCalls( Handle, &TopLevelCtx.Calls[ 0 ].CallHandle, &Ctx );
+	TEST( Ctx.Counter == 3 );
+	if ( Ctx.Counter != 3 ) return;
+
+	TEST( Ctx.Calls[ 0 ].Procedure == 0x20000 );
+	TEST( Ctx.Calls[ 0 ].ChildCalls == 0 );
+	TEST( Ctx.Calls[ 1 ].Procedure == 0x30000 );
+	TEST( Ctx.Calls[ 1 ].ChildCalls == 1 );
+	TEST( Ctx.Calls[ 1 ].EntryTimestamp == 4 );
+	TEST( Ctx.Calls[ 1 ].ExitTimestamp == 7 );
+	TEST( Ctx.Calls[ 2 ].Procedure == 0x20000 );
+	TEST( Ctx.Calls[ 2 ].ExitType == JptrcrException );
+
+	//
+	// Children of C, which returns in the second chunk.
+	//
+	EnumChildCalls( Handle, &Ctx.Calls[ 1 ].CallHandle, &Ctx );
+	TEST( Ctx.Counter == 1 );
+	TEST( Ctx.Calls[ 0 ].Procedure == 0x40000 );
+	TEST( Ctx.Calls[ 0 ].EntryTimestamp == 5 );
+	TEST( Ctx.Calls[ 0 ].ExitTimestamp == 6 );
+
+	//
+	// Children of D - none.
+	//
+	EnumChildCalls( Handle, &Ctx.Calls[ 0 ].CallHandle, &Ctx );
+	TEST( Ctx.Counter == 0 );
+
+	//
+	// Children of E: F is ended by a synthetic exit, G gets
+	// a synthetic entry.
+	//
+	EnumChildCalls( Handle, &TopLevelCtx.Calls[ 1 ].CallHandle, &Ctx );
+	TEST( Ctx.Counter == 2 );
+	if ( Ctx.Counter != 2 ) return;
+
+	TEST( Ctx.Calls[ 0 ].Procedure == 0x60000 );
+	TEST( Ctx.Calls[ 0 ].EntryType == JptrcrNormalEntry );
+	TEST( Ctx.Calls[ 0 ].ExitType == JptrcrSyntheticExit );
+	TEST( Ctx.Calls[ 1 ].Procedure == 0x70000 );
+	TEST( Ctx.Calls[ 1 ].EntryType == JptrcrSyntheticEntry );
+	TEST( Ctx.Calls[ 1 ].ExitType == JptrcrNormalExit );
+	TEST( Ctx.Calls[ 1 ].CallHandle.Chunk == NULL );
+	TEST( Ctx.Calls[ 0 ].ExitTimestamp == Ctx.Calls[ 1 ].EntryTimestamp );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestEnumCallsRecursively()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+
+	WriteNestedCallsTraceFile( FilePath, NULL, 0 );
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	Ctx.Handle = Handle;
+	TEST_OK( JptrcrEnumCalls(
+		Handle,
+		&Client,
+		CountCallsRecursiveCallback,
+		&Ctx ) );
+
+	//
+	// A, B, C, D, B, E, F, G.
+	//
+	TEST( Ctx.Counter == 8 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestEnumChildCallsInvalidHandle()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+	JPTRCR_CALL_HANDLE InvalidHandle;
+
+	WriteNestedCallsTraceFile( FilePath, NULL, 0 );
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectCallsCallback, &Ctx ) );
+	TEST( Ctx.Counter == 2 );
+
+	//
+	// Index of B's exit transition.
+	//
+	InvalidHandle		= Ctx.Calls[ 0 ].CallHandle;
+	InvalidHandle.Index	= 2;
+
+	TEST_HR( JPTRCR_E_INVALID_CALL_HANDLE, JptrcrEnumChildCalls(
+		Handle,
+		&InvalidHandle,
+		CollectCallsCallback,
+		&Ctx ) );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( CallNesting )
+	CFIX_FIXTURE_ENTRY( TestEnumTopLevelCalls )
+	CFIX_FIXTURE_ENTRY( TestEnumChildCalls )
+	CFIX_FIXTURE_ENTRY( TestEnumCallsRecursively )
+	CFIX_FIXTURE_ENTRY( TestEnumChildCallsInvalidHandle )
+CFIX_END_FIXTURE()
@@ -0,0 +1,259 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for profile aggregation.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define PROC_A				0x10000
+#define PROC_B				0x20000
+#define PROC_C				0x30000
+
+#define MAX_ENTRIES			8
+
+typedef struct _PROFILE_CONTEXT
+{
+	ULONG EntryCount;
+	JPTRCR_PROFILE_ENTRY Entries[ MAX_ENTRIES ];
+	ULONG EdgeCount;
+	JPTRCR_PROFILE_EDGE Edges[ MAX_ENTRIES ];
+} PROFILE_CONTEXT, *PPROFILE_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+//
+// Thread 8: A calls B, then recurses into A.
+//
+// Ticks:	A	0 - 100		incl 100, excl 70
+//			B	10 - 30		incl 20
+//			A	40 - 50		incl 10 (covered by outer A)
+//
+static const TRANSITION Thread8Transitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_A,		1000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_B,		1010 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_B,		1030 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_A,		1040 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_A,		1050 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_A,		1100 }
+};
+
+//
+// Thread 12: C calls B twice and never returns.
+//
+static const TRANSITION Thread12Transitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_C,		2000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_B,		2002 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_B,		2004 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_B,		2010 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_B,		2011 }
+};
+
+static void CreateTraceFile()
+{
+	JPTRC_CALIBRATION_CHUNK Calibration;
+	HANDLE File = CreateTempTraceFile( FilePath );
+
+	//
+	// One tick per nanosecond, so that durations equal tick counts.
+	//
+	ZeroMemory( &Calibration, sizeof( JPTRC_CALIBRATION_CHUNK ) );
+	Calibration.Header.Type	= JPTRC_CHUNK_TYPE_CALIBRATION;
+	Calibration.Header.Size	= JPTRC_CALIBRATION_CHUNK_SIZE( 0 );
+	Calibration.Frequency	= 1000000000;
+
+	AppendToTraceFile( File, &Calibration, Calibration.Header.Size );
+	AppendTraceBufferChunk(
+		File,
+		8,
+		_countof( Thread8Transitions ),
+		Thread8Transitions );
+	AppendTraceBufferChunk(
+		File,
+		12,
+		_countof( Thread12Transitions ),
+		Thread12Transitions );
+
+	TEST( CloseHandle( File ) );
+}
+
+static void CollectEntriesCallback(
+	__in PJPTRCR_PROFILE_ENTRY Entry,
+	__in_opt PVOID Context
+	)
+{
+	PPROFILE_CONTEXT Ctx = ( PPROFILE_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->EntryCount < MAX_ENTRIES );
+	if ( Ctx->EntryCount >= MAX_ENTRIES ) return;
+
+	Ctx->Entries[ Ctx->EntryCount++ ] = *Entry;
+}
+
+static void CollectEdgesCallback(
+	__in PJPTRCR_PROFILE_EDGE Edge,
+	__in_opt PVOID Context
+	)
+{
+	PPROFILE_CONTEXT Ctx = ( PPROFILE_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->EdgeCount < MAX_ENTRIES );
+	if ( Ctx->EdgeCount >= MAX_ENTRIES ) return;
+
+	Ctx->Edges[ Ctx->EdgeCount++ ] = *Edge;
+}
+
+static PJPTRCR_PROFILE_ENTRY FindEntry(
+	__in PPROFILE_CONTEXT Ctx,
+	__in ULONGLONG Procedure
+	)
+{
+	ULONG Index;
+
+	for ( Index = 0; Index < Ctx->EntryCount; Index++ )
+	{
+		if ( Ctx->Entries[ Index ].Procedure == Procedure )
+		{
+			return &Ctx->Entries[ Index ];
+		}
+	}
+
+	return NULL;
+}
+
+static PJPTRCR_PROFILE_EDGE FindEdge(
+	__in PPROFILE_CONTEXT Ctx,
+	__in ULONGLONG Caller,
+	__in ULONGLONG Callee
+	)
+{
+	ULONG Index;
+
+	for ( Index = 0; Index < Ctx->EdgeCount; Index++ )
+	{
+		if ( Ctx->Edges[ Index ].Caller == Caller &&
+			 Ctx->Edges[ Index ].Callee == Callee )
+		{
+			return &Ctx->Edges[ Index ];
+		}
+	}
+
+	return NULL;
+}
+
+static ULONGLONG SumHistogram(
+	__in PJPTRCR_PROFILE_ENTRY Entry
+	)
+{
+	ULONG Index;
+	ULONGLONG Sum = 0;
+
+	for ( Index = 0; Index < JPTRCR_PROFILE_HISTOGRAM_BUCKETS; Index++ )
+	{
+		Sum += Entry->Histogram[ Index ];
+	}
+
+	return Sum;
+}
+
+static void TestProfileAggregation()
+{
+	PJPTRCR_PROFILE_ENTRY A;
+	PJPTRCR_PROFILE_ENTRY B;
+	PROFILE_CONTEXT Ctx;
+	PJPTRCR_PROFILE_EDGE Edge;
+	JPTRCRHANDLE Handle;
+	JPTRCRPROFILEHANDLE Profile;
+
+	CreateTraceFile();
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+	TEST_OK( JptrcrCreateProfile( Handle, &Profile ) );
+
+	ZeroMemory( &Ctx, sizeof( PROFILE_CONTEXT ) );
+	TEST_OK( JptrcrEnumProfileEntries( Profile, CollectEntriesCallback, &Ctx ) );
+	TEST_OK( JptrcrEnumProfileEdges( Profile, CollectEdgesCallback, &Ctx ) );
+
+	//
+	// C has not returned and does not show up.
+	//
+	TEST( Ctx.EntryCount == 2 );
+	TEST( FindEntry( &Ctx, PROC_C ) == NULL );
+
+	A = FindEntry( &Ctx, PROC_A );
+	B = FindEntry( &Ctx, PROC_B );
+	TEST( A != NULL );
+	TEST( B != NULL );
+	if ( A == NULL || B == NULL ) goto Cleanup;
+
+	TEST( A->CallCount == 2 );
+	TEST( A->Histogram[ 3 ] == 1 );		// 10 ticks.
+	TEST( A->Histogram[ 6 ] == 1 );		// 100 ticks.
+	TEST( SumHistogram( A ) == 2 );
+
+	//
+	// Recursion is only accounted once in the inclusive time.
+	//
+	TEST( A->InclusiveTime == A->MaxDuration );
+	TEST( A->ExclusiveTime < A->InclusiveTime );
+	TEST( A->MinDuration < A->MaxDuration );
+
+	TEST( B->CallCount == 3 );
+	TEST( B->Histogram[ 0 ] == 1 );		// 1 tick.
+	TEST( B->Histogram[ 1 ] == 1 );		// 2 ticks.
+	TEST( B->Histogram[ 4 ] == 1 );		// 20 ticks.
+	TEST( B->InclusiveTime == B->ExclusiveTime );
+	TEST( B->InclusiveTime < A->InclusiveTime );
+
+	//
+	// Edges.
+	//
+	TEST( Ctx.EdgeCount == 3 );
+
+	Edge = FindEdge( &Ctx, PROC_A, PROC_B );
+	TEST( Edge != NULL && Edge->CallCount == 1 );
+
+	Edge = FindEdge( &Ctx, PROC_A, PROC_A );
+	TEST( Edge != NULL && Edge->CallCount == 1 );
+
+	Edge = FindEdge( &Ctx, PROC_C, PROC_B );
+	TEST( Edge != NULL && Edge->CallCount == 2 );
+
+Cleanup:
+	TEST_OK( JptrcrDeleteProfile( Profile ) );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestProfileInvalidHandle()
+{
+	JPTRCRPROFILEHANDLE Profile;
+
+	TEST_HR( E_INVALIDARG, JptrcrCreateProfile( NULL, &Profile ) );
+	TEST_HR( E_INVALIDARG, JptrcrEnumProfileEntries(
+		NULL, CollectEntriesCallback, NULL ) );
+	TEST_HR( E_INVALIDARG, JptrcrEnumProfileEdges(
+		NULL, CollectEdgesCallback, NULL ) );
+	TEST_HR( E_INVALIDARG, JptrcrDeleteProfile( NULL ) );
+}
+
+CFIX_BEGIN_FIXTURE( Profile )
+	CFIX_FIXTURE_ENTRY( TestProfileAggregation )
+	CFIX_FIXTURE_ENTRY( TestProfileInvalidHandle )
+CFIX_END_FIXTURE()
@@ -0,0 +1,329 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		File set tests. Sets of rotated trace files are synthesized
+ *		s.t. their contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define SET_SIZE			3
+#define SET_ID				0x1234567890ULL
+
+#define TRACE_CHUNK_SIZE	FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, \
+								Transitions[ 2 ] )
+#define TRACE_CHUNK_OFFSET	( sizeof( JPTRC_FILE_HEADER ) + \
+								sizeof( JPTRC_CONTINUATION_CHUNK ) )
+#define INDEX_CHUNK_OFFSET	( TRACE_CHUNK_OFFSET + TRACE_CHUNK_SIZE )
+#define INDEX_CHUNK_SIZE	JPTRC_INDEX_CHUNK_SIZE( 0, 1, 1, 1 )
+
+typedef struct _CALLBACK_CONTEXT
+{
+	JPTRCRHANDLE Handle;
+	ULONG Counter;
+	ULONGLONG Timestamps[ SET_SIZE ];
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePaths[ SET_SIZE ][ MAX_PATH ];
+
+/*++
+	Routine Description:
+		Write a member of a file set, containing a single call of
+		thread 8 whose timestamps are derived from the sequence
+		number. The first member of the set is indexed, the
+		others are not.
+--*/
+static void WriteSetMember(
+	__in ULONG SequenceNumber,
+	__in ULONGLONG SetId,
+	__in PWSTR FilePath
+	)
+{
+	UCHAR Buffer[ INDEX_CHUNK_OFFSET + INDEX_CHUNK_SIZE +
+		sizeof( JPTRC_INDEX_TRAILER_CHUNK ) ];
+	PJPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+	PJPTRC_CONTINUATION_CHUNK Continuation;
+	HANDLE File;
+	PJPTRC_FILE_HEADER Header;
+	ULONG Size;
+	DWORD Written;
+	WCHAR TempPath[ MAX_PATH ];
+
+	ZeroMemory( Buffer, sizeof( Buffer ) );
+
+	Header = ( PJPTRC_FILE_HEADER ) Buffer;
+	Header->Signature		= JPTRC_HEADER_SIGNATURE;
+	Header->Version			= JPTRC_HEADER_VERSION;
+	Header->Characteristics	= JPTRC_CHARACTERISTIC_TIMESTAMP_TSC |
+							  JPTRC_CHARACTERISTIC_32BIT;
+
+	Continuation = ( PJPTRC_CONTINUATION_CHUNK ) ( Header + 1 );
+	Continuation->Header.Type		= JPTRC_CHUNK_TYPE_CONTINUATION;
+	Continuation->Header.Size		= sizeof( JPTRC_CONTINUATION_CHUNK );
+	Continuation->SequenceNumber	= SequenceNumber;
+	Continuation->SetId				= SetId;
+
+	Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 ) ( Buffer + TRACE_CHUNK_OFFSET );
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+	Chunk->Header.Size		= TRACE_CHUNK_SIZE;
+	Chunk->Client.ProcessId	= 4;
+	Chunk->Client.ThreadId	= 8;
+
+	Chunk->Transitions[ 0 ].Type		= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+	Chunk->Transitions[ 0 ].Timestamp	= SequenceNumber * 100;
+	Chunk->Transitions[ 0 ].Procedure	= 0x10000;
+	Chunk->Transitions[ 1 ].Type		= JPTRC_PROCEDURE_TRANSITION_EXIT;
+	Chunk->Transitions[ 1 ].Timestamp	= SequenceNumber * 100 + 1;
+	Chunk->Transitions[ 1 ].Procedure	= 0x10000;
+
+	if ( SequenceNumber == 0 )
+	{
+		PJPTRC_INDEX_CHUNK Index;
+		PJPTRC_INDEX_CLIENT Client;
+		PJPTRC_INDEX_SEGMENT Segment;
+		PJPTRC_INDEX_TRAILER_CHUNK Trailer;
+
+		Index = ( PJPTRC_INDEX_CHUNK ) ( Buffer + INDEX_CHUNK_OFFSET );
+		Index->Header.Type			= JPTRC_CHUNK_TYPE_INDEX;
+		Index->Header.Size			= INDEX_CHUNK_SIZE;
+		Index->PreviousIndexOffset	= 0;
+		Index->StartOffset			= sizeof( JPTRC_FILE_HEADER );
+		Index->EndOffset			= INDEX_CHUNK_OFFSET;
+		Index->ImageInfoCount		= 0;
+		Index->SegmentCount			= 1;
+		Index->ClientCount			= 1;
+		Index->ChunkCount			= 1;
+
+		Segment = JPTRC_INDEX_SEGMENTS( Index );
+		Segment->Offset			= 0;
+		Segment->MinTimestamp	= 0;
+		Segment->MaxTimestamp	= 1;
+
+		Client = JPTRC_INDEX_CLIENTS( Index );
+		Client->ProcessId	= 4;
+		Client->ThreadId	= 8;
+		Client->FirstChunk	= 0;
+		Client->ChunkCount	= 1;
+
+		JPTRC_INDEX_CHUNK_OFFSETS( Index )[ 0 ] = TRACE_CHUNK_OFFSET;
+
+		Trailer = ( PJPTRC_INDEX_TRAILER_CHUNK )
+			( Buffer + INDEX_CHUNK_OFFSET + INDEX_CHUNK_SIZE );
+		Trailer->Header.Type		= JPTRC_CHUNK_TYPE_INDEX_TRAILER;
+		Trailer->Header.Size		= sizeof( JPTRC_INDEX_TRAILER_CHUNK );
+		Trailer->LastIndexOffset	= INDEX_CHUNK_OFFSET;
+
+		Size = sizeof( Buffer );
+	}
+	else
+	{
+		Size = INDEX_CHUNK_OFFSET;
+	}
+
+	TEST( GetTempPath( MAX_PATH, TempPath ) );
+	TEST( GetTempFileName( TempPath, L"jtr", 0, FilePath ) );
+
+	File = CreateFile(
+		FilePath,
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL );
+	TEST( File != INVALID_HANDLE_VALUE );
+	TEST( WriteFile( File, Buffer, Size, &Written, NULL ) );
+	TEST( Written == Size );
+	TEST( CloseHandle( File ) );
+}
+
+static void WriteSet()
+{
+	ULONG Index;
+
+	for ( Index = 0; Index < SET_SIZE; Index++ )
+	{
+		WriteSetMember( Index, SET_ID, FilePaths[ Index ] );
+	}
+}
+
+static void DeleteSet()
+{
+	ULONG Index;
+
+	for ( Index = 0; Index < SET_SIZE; Index++ )
+	{
+		TEST( DeleteFile( FilePaths[ Index ] ) );
+	}
+}
+
+static void CollectCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Call->Procedure == 0x10000 );
+	TEST( Call->EntryType == JptrcrNormalEntry );
+	TEST( Call->ExitType == JptrcrNormalExit );
+
+	TEST( Ctx->Counter < SET_SIZE );
+	if ( Ctx->Counter < SET_SIZE )
+	{
+		Ctx->Timestamps[ Ctx->Counter++ ] = Call->EntryTimestamp;
+	}
+}
+
+static void CollectClientsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Client->ProcessId == 4 );
+	TEST( Client->ThreadId == 8 );
+
+	TEST_OK( JptrcrEnumCalls( Ctx->Handle, Client, CollectCallsCallback, Ctx ) );
+}
+
+/*++
+	Routine Description:
+		Check that the calls of exactly the given sequence numbers
+		are enumerated, in order.
+--*/
+static void VerifyCalls(
+	__in JPTRCRHANDLE Handle,
+	__in ULONG ExpectedCount,
+	__in ULONG FirstExpectedSequenceNumber
+	)
+{
+	CALLBACK_CONTEXT Ctx;
+	ULONG Index;
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	Ctx.Handle = Handle;
+	TEST_OK( JptrcrEnumClients( Handle, CollectClientsCallback, &Ctx ) );
+
+	TEST( Ctx.Counter == ExpectedCount );
+	for ( Index = 0; Index < Ctx.Counter; Index++ )
+	{
+		TEST( Ctx.Timestamps[ Index ] ==
+			( FirstExpectedSequenceNumber + Index ) * 100 );
+	}
+}
+
+static void TestOpenFileSetInOrder()
+{
+	JPTRCRHANDLE Handle;
+	PCWSTR Paths[ SET_SIZE ];
+
+	WriteSet();
+
+	Paths[ 0 ] = FilePaths[ 0 ];
+	Paths[ 1 ] = FilePaths[ 1 ];
+	Paths[ 2 ] = FilePaths[ 2 ];
+
+	TEST_OK( JptrcrOpenFileSet( SET_SIZE, Paths, &Handle ) );
+	VerifyCalls( Handle, SET_SIZE, 0 );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	DeleteSet();
+}
+
+static void TestOpenFileSetOutOfOrder()
+{
+	JPTRCRHANDLE Handle;
+	PCWSTR Paths[ SET_SIZE ];
+
+	WriteSet();
+
+	Paths[ 0 ] = FilePaths[ 2 ];
+	Paths[ 1 ] = FilePaths[ 0 ];
+	Paths[ 2 ] = FilePaths[ 1 ];
+
+	TEST_OK( JptrcrOpenFileSet( SET_SIZE, Paths, &Handle ) );
+	VerifyCalls( Handle, SET_SIZE, 0 );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	//
+	// Subset, not beginning with the first file.
+	//
+	Paths[ 1 ] = FilePaths[ 1 ];
+	TEST_OK( JptrcrOpenFileSet( 2, Paths, &Handle ) );
+	VerifyCalls( Handle, 2, 1 );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	DeleteSet();
+}
+
+static void TestOpenSingleFileOfSet()
+{
+	JPTRCRHANDLE Handle;
+
+	WriteSet();
+
+	TEST_OK( JptrcrOpenFile( FilePaths[ 1 ], &Handle ) );
+	VerifyCalls( Handle, 1, 1 );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	DeleteSet();
+}
+
+static void TestOpenInconsistentFileSet()
+{
+	JPTRCRHANDLE Handle;
+	PCWSTR Paths[ SET_SIZE ];
+
+	WriteSet();
+
+	//
+	// Gap.
+	//
+	Paths[ 0 ] = FilePaths[ 0 ];
+	Paths[ 1 ] = FilePaths[ 2 ];
+	TEST_HR( JPTRCR_E_FILE_SET_MISMATCH,
+		JptrcrOpenFileSet( 2, Paths, &Handle ) );
+
+	//
+	// Duplicate.
+	//
+	Paths[ 1 ] = FilePaths[ 0 ];
+	TEST_HR( JPTRCR_E_FILE_SET_MISMATCH,
+		JptrcrOpenFileSet( 2, Paths, &Handle ) );
+
+	//
+	// Different sets.
+	//
+	TEST( DeleteFile( FilePaths[ 1 ] ) );
+	WriteSetMember( 1, SET_ID + 1, FilePaths[ 1 ] );
+
+	Paths[ 1 ] = FilePaths[ 1 ];
+	TEST_HR( JPTRCR_E_FILE_SET_MISMATCH,
+		JptrcrOpenFileSet( 2, Paths, &Handle ) );
+
+	TEST_HR( E_INVALIDARG, JptrcrOpenFileSet( 0, Paths, &Handle ) );
+
+	DeleteSet();
+}
+
+CFIX_BEGIN_FIXTURE( FileSet )
+	CFIX_FIXTURE_ENTRY( TestOpenFileSetInOrder )
+	CFIX_FIXTURE_ENTRY( TestOpenFileSetOutOfOrder )
+	CFIX_FIXTURE_ENTRY( TestOpenSingleFileOfSet )
+	CFIX_FIXTURE_ENTRY( TestOpenInconsistentFileSet )
+CFIX_END_FIXTURE()
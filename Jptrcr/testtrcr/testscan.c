@@ -0,0 +1,208 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for transition scanning. Compares the vectorized
+ *		implementation against the scalar one.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <jptrcrp.h>
+#include <stdlib.h>
+#include <cfix.h>
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define E JPTRC_PROCEDURE_TRANSITION_ENTRY
+#define X JPTRC_PROCEDURE_TRANSITION_EXIT
+#define U JPTRC_PROCEDURE_TRANSITION_UNWIND
+
+#define LARGE_COUNT		100003
+
+static ULONG Seed;
+
+static ULONG Random()
+{
+	Seed = Seed * 1103515245 + 12345;
+	return Seed >> 16;
+}
+
+static void FillTransitions(
+	__in ULONG Count,
+	__in_ecount( Count ) const ULONG *Types,
+	__out_ecount( Count ) PJPTRC_PROCEDURE_TRANSITION32 Transitions
+	)
+{
+	ULONG Index;
+
+	ZeroMemory( Transitions, Count * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+
+	for ( Index = 0; Index < Count; Index++ )
+	{
+		Transitions[ Index ].Type		= Types[ Index ];
+		Transitions[ Index ].Timestamp	= Index;
+		Transitions[ Index ].Procedure	= 0x10000 + Index;
+	}
+}
+
+/*++
+	Routine Description:
+		Generate a random walk of calls, biased towards deep
+		nesting if Bias > 50.
+--*/
+static void FillRandomTransitions(
+	__in ULONG Count,
+	__in ULONG Bias,
+	__out_ecount( Count ) PJPTRC_PROCEDURE_TRANSITION32 Transitions
+	)
+{
+	ULONG Index;
+
+	ZeroMemory( Transitions, Count * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+
+	for ( Index = 0; Index < Count; Index++ )
+	{
+		if ( Random() % 100 < Bias )
+		{
+			Transitions[ Index ].Type = E;
+		}
+		else
+		{
+			Transitions[ Index ].Type = ( Random() % 4 == 0 ) ? U : X;
+		}
+
+		Transitions[ Index ].Timestamp	= Index;
+		Transitions[ Index ].Procedure	= Random();
+		Transitions[ Index ].Info.CallerIp	= Random();
+	}
+}
+
+static void CompareScans(
+	__in_ecount( Count ) PJPTRC_PROCEDURE_TRANSITION32 Transitions,
+	__in ULONG Count,
+	__in LONG TargetDepth
+	)
+{
+	JPTRCRP_DEPTH_SCAN Scalar;
+	JPTRCRP_DEPTH_SCAN Scan;
+
+	TEST_OK( JptrcrpScanTransitionDepthScalar(
+		Transitions, Count, TargetDepth, &Scalar ) );
+	TEST_OK( JptrcrpScanTransitionDepth(
+		Transitions, Count, TargetDepth, &Scan ) );
+
+	TEST( Scan.EntryCount == Scalar.EntryCount );
+	TEST( Scan.FinalDepth == Scalar.FinalDepth );
+	TEST( Scan.BoundaryIndex == Scalar.BoundaryIndex );
+}
+
+static void TestScanKnownSequence()
+{
+	static const ULONG Types[] = { E, E, X, E, U, X, X };
+	JPTRC_PROCEDURE_TRANSITION32 Transitions[ _countof( Types ) ];
+	JPTRCRP_DEPTH_SCAN Scan;
+
+	FillTransitions( _countof( Types ), Types, Transitions );
+
+	//
+	// Depths: 1 2 1 2 1 0 -1
+	//
+	TEST_OK( JptrcrpScanTransitionDepth(
+		Transitions, _countof( Types ), 0, &Scan ) );
+	TEST( Scan.EntryCount == 3 );
+	TEST( Scan.FinalDepth == -1 );
+	TEST( Scan.BoundaryIndex == 5 );
+
+	TEST_OK( JptrcrpScanTransitionDepth(
+		Transitions, _countof( Types ), -1, &Scan ) );
+	TEST( Scan.BoundaryIndex == 6 );
+
+	TEST_OK( JptrcrpScanTransitionDepth(
+		Transitions, _countof( Types ), 2, &Scan ) );
+	TEST( Scan.BoundaryIndex == 1 );
+
+	TEST_OK( JptrcrpScanTransitionDepth(
+		Transitions, _countof( Types ), 3, &Scan ) );
+	TEST( Scan.BoundaryIndex == _countof( Types ) );
+
+	TEST_OK( JptrcrpScanTransitionDepth(
+		Transitions, 0, 0, &Scan ) );
+	TEST( Scan.EntryCount == 0 );
+	TEST( Scan.FinalDepth == 0 );
+	TEST( Scan.BoundaryIndex == 0 );
+}
+
+static void TestScanMatchesScalar()
+{
+	ULONG Bias;
+	ULONG Count;
+	LONG Target;
+	PJPTRC_PROCEDURE_TRANSITION32 Transitions;
+
+	Transitions = ( PJPTRC_PROCEDURE_TRANSITION32 ) malloc(
+		( LARGE_COUNT + 1 ) * sizeof( JPTRC_PROCEDURE_TRANSITION32 ) );
+	TEST( Transitions != NULL );
+	if ( Transitions == NULL )
+	{
+		return;
+	}
+
+	Seed = 1;
+
+	//
+	// Short sequences cover all remainder lengths. Start at an
+	// odd index to rule out alignment assumptions.
+	//
+	for ( Count = 0; Count < 67; Count++ )
+	{
+		for ( Bias = 30; Bias <= 70; Bias += 20 )
+		{
+			FillRandomTransitions( Count + 1, Bias, Transitions );
+
+			for ( Target = -3; Target <= 3; Target++ )
+			{
+				CompareScans( Transitions + 1, Count, Target );
+			}
+
+			CompareScans( Transitions + 1, Count, JPTRCRP_NO_TARGET_DEPTH );
+		}
+	}
+
+	//
+	// Deeply nested.
+	//
+	FillRandomTransitions( LARGE_COUNT, 55, Transitions );
+	CompareScans( Transitions, LARGE_COUNT, 0 );
+	CompareScans( Transitions, LARGE_COUNT, 1000 );
+	CompareScans( Transitions, LARGE_COUNT, JPTRCRP_NO_TARGET_DEPTH );
+
+	free( Transitions );
+}
+
+static void TestScanInvalidTransition()
+{
+	JPTRC_PROCEDURE_TRANSITION32 Transitions[ 11 ];
+	ULONG Index;
+	JPTRCRP_DEPTH_SCAN Scan;
+
+	//
+	// Invalid type within blocks and within the remainder.
+	//
+	for ( Index = 0; Index < _countof( Transitions ); Index++ )
+	{
+		FillRandomTransitions( _countof( Transitions ), 50, Transitions );
+		Transitions[ Index ].Type = 3;
+
+		TEST_HR( JPTRCR_E_INVALID_TRANSITION, JptrcrpScanTransitionDepth(
+			Transitions, _countof( Transitions ), 0, &Scan ) );
+		TEST_HR( JPTRCR_E_INVALID_TRANSITION, JptrcrpScanTransitionDepthScalar(
+			Transitions, _countof( Transitions ), 0, &Scan ) );
+	}
+}
+
+CFIX_BEGIN_FIXTURE( TransitionScan )
+	CFIX_FIXTURE_ENTRY( TestScanKnownSequence )
+	CFIX_FIXTURE_ENTRY( TestScanMatchesScalar )
+	CFIX_FIXTURE_ENTRY( TestScanInvalidTransition )
+CFIX_END_FIXTURE()
@@ -0,0 +1,244 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for seeking the calls active at a point in time.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define PROC_A				0x10000
+#define PROC_B				0x20000
+#define PROC_C				0x30000
+#define PROC_D				0x40000
+#define PROC_E				0x50000
+#define PROC_F				0x60000
+
+#define MAX_CALLS			8
+
+typedef struct _CALLBACK_CONTEXT
+{
+	ULONG Counter;
+	JPTRCR_CALL Calls[ MAX_CALLS ];
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+//
+// A (10 - ) calls B (20 - 30), C (40 - 100) and E (110 - ).
+// C calls D (60 - 70), E calls F (120 - 130).
+//
+static const TRANSITION FirstChunkTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_A,		10 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_B,		20 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_B,		30 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_C,		40 }
+};
+
+static const TRANSITION SecondChunkTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_D,		60 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_D,		70 }
+};
+
+static const TRANSITION ThirdChunkTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_C,		100 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_E,		110 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		PROC_F,		120 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		PROC_F,		130 }
+};
+
+static void CreateTraceFile()
+{
+	HANDLE File = CreateTempTraceFile( FilePath );
+
+	AppendTraceBufferChunk(
+		File,
+		8,
+		_countof( FirstChunkTransitions ),
+		FirstChunkTransitions );
+	AppendTraceBufferChunk(
+		File,
+		8,
+		_countof( SecondChunkTransitions ),
+		SecondChunkTransitions );
+	AppendTraceBufferChunk(
+		File,
+		8,
+		_countof( ThirdChunkTransitions ),
+		ThirdChunkTransitions );
+
+	TEST( CloseHandle( File ) );
+}
+
+static void CollectCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->Counter < MAX_CALLS );
+	if ( Ctx->Counter >= MAX_CALLS ) return;
+
+	Ctx->Calls[ Ctx->Counter++ ] = *Call;
+}
+
+/*++
+	Routine Description:
+		Check that the call stack at the given time consists of
+		the given procedures, outermost first.
+--*/
+static void CheckActiveCalls(
+	__in JPTRCRHANDLE Handle,
+	__in ULONGLONG Timestamp,
+	__in ULONG ExpectedCount,
+	__in_ecount( ExpectedCount ) const ULONG *ExpectedProcedures
+	)
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	ULONG Index;
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_HR(
+		ExpectedCount > 0 ? S_OK : S_FALSE,
+		JptrcrEnumActiveCalls(
+			Handle,
+			&Client,
+			Timestamp,
+			CollectCallsCallback,
+			&Ctx ) );
+	TEST( Ctx.Counter == ExpectedCount );
+	if ( Ctx.Counter != ExpectedCount ) return;
+
+	for ( Index = 0; Index < ExpectedCount; Index++ )
+	{
+		TEST( Ctx.Calls[ Index ].Procedure == ExpectedProcedures[ Index ] );
+		TEST( Ctx.Calls[ Index ].EntryTimestamp <= Timestamp );
+		TEST( Ctx.Calls[ Index ].ExitTimestamp == 0 ||
+			  Ctx.Calls[ Index ].ExitTimestamp >= Timestamp );
+	}
+}
+
+static void TestSeekActiveCalls()
+{
+	static const ULONG A[]		= { PROC_A };
+	static const ULONG AB[]		= { PROC_A, PROC_B };
+	static const ULONG AC[]		= { PROC_A, PROC_C };
+	static const ULONG ACD[]	= { PROC_A, PROC_C, PROC_D };
+	static const ULONG AE[]		= { PROC_A, PROC_E };
+	static const ULONG AEF[]	= { PROC_A, PROC_E, PROC_F };
+
+	JPTRCRHANDLE Handle;
+
+	CreateTraceFile();
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	CheckActiveCalls( Handle, 5, 0, NULL );
+	CheckActiveCalls( Handle, 10, _countof( A ), A );
+	CheckActiveCalls( Handle, 25, _countof( AB ), AB );
+	CheckActiveCalls( Handle, 30, _countof( AB ), AB );
+	CheckActiveCalls( Handle, 35, _countof( A ), A );
+
+	//
+	// Between chunks and within a chunk before its first entry -
+	// both rely on the stack snapshot taken at the chunk boundary.
+	//
+	CheckActiveCalls( Handle, 50, _countof( AC ), AC );
+	CheckActiveCalls( Handle, 65, _countof( ACD ), ACD );
+	CheckActiveCalls( Handle, 80, _countof( AC ), AC );
+	CheckActiveCalls( Handle, 105, _countof( A ), A );
+
+	CheckActiveCalls( Handle, 125, _countof( AEF ), AEF );
+
+	//
+	// Beyond the end of the trace.
+	//
+	CheckActiveCalls( Handle, 1000, _countof( AE ), AE );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestActiveCallsProperties()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT ChildCtx;
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+
+	CreateTraceFile();
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumActiveCalls(
+		Handle, &Client, 65, CollectCallsCallback, &Ctx ) );
+	TEST( Ctx.Counter == 3 );
+	if ( Ctx.Counter != 3 ) goto Cleanup;
+
+	//
+	// A has not returned, all other calls are callees.
+	//
+	TEST( Ctx.Calls[ 0 ].ExitType == JptrcrSyntheticExit );
+	TEST( Ctx.Calls[ 0 ].ExitTimestamp == 0 );
+	TEST( Ctx.Calls[ 0 ].ChildCalls == 5 );
+
+	TEST( Ctx.Calls[ 1 ].ExitType == JptrcrNormalExit );
+	TEST( Ctx.Calls[ 1 ].EntryTimestamp == 40 );
+	TEST( Ctx.Calls[ 1 ].ExitTimestamp == 100 );
+	TEST( Ctx.Calls[ 1 ].ChildCalls == 1 );
+
+	//
+	// Handles can be used to walk the tree.
+	//
+	ZeroMemory( &ChildCtx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumChildCalls(
+		Handle,
+		&Ctx.Calls[ 1 ].CallHandle,
+		CollectCallsCallback,
+		&ChildCtx ) );
+	TEST( ChildCtx.Counter == 1 );
+	TEST( ChildCtx.Calls[ 0 ].Procedure == PROC_D );
+
+	//
+	// Unknown client.
+	//
+	Client.ThreadId = 12;
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_HR( S_FALSE, JptrcrEnumActiveCalls(
+		Handle, &Client, 65, CollectCallsCallback, &Ctx ) );
+	TEST( Ctx.Counter == 0 );
+
+Cleanup:
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestActiveCallsInvalidArguments()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+
+	TEST_HR( E_INVALIDARG, JptrcrEnumActiveCalls(
+		NULL, &Client, 0, CollectCallsCallback, NULL ) );
+}
+
+CFIX_BEGIN_FIXTURE( Seek )
+	CFIX_FIXTURE_ENTRY( TestSeekActiveCalls )
+	CFIX_FIXTURE_ENTRY( TestActiveCallsProperties )
+	CFIX_FIXTURE_ENTRY( TestActiveCallsInvalidArguments )
+CFIX_END_FIXTURE()
@@ -0,0 +1,306 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Staging block tests.
+ *
+ *		N.B. jptrcstg.h is used by the kernel mode agent, these tests
+ *		exercise the packing logic in user mode.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <stdlib.h>
+#include <jptrcstg.h>
+#include <cfix.h>
+
+#define TEST CFIX_ASSERT
+
+#define SEGMENTS_PER_BLOCK	2
+#define BLOCK_SIZE			( SEGMENTS_PER_BLOCK * JPTRC_SEGMENT_SIZE )
+#define MAX_CHUNK_SIZE		( JPTRC_SEGMENT_SIZE / 3 )
+
+static ULONGLONG BlockBuffer[ BLOCK_SIZE / sizeof( ULONGLONG ) ];
+static ULONGLONG ChunkBuffer[ JPTRC_SEGMENT_SIZE / sizeof( ULONGLONG ) ];
+
+/*++
+	Routine Description:
+		Prepare a chunk of the given size whose contents are
+		derived from Tag.
+--*/
+static PJPTRC_CHUNK_HEADER PrepareChunk(
+	__in ULONG Size,
+	__in ULONG Tag
+	)
+{
+	PJPTRC_CHUNK_HEADER Chunk = ( PJPTRC_CHUNK_HEADER ) ChunkBuffer;
+	PULONG Body = ( PULONG ) ( Chunk + 1 );
+	ULONG Index;
+
+	Chunk->Type		= JPTRC_CHUNK_TYPE_IMAGE_INFO;
+	Chunk->Reserved	= 0;
+	Chunk->Size		= Size;
+
+	for ( Index = 0; Index < ( Size - sizeof( JPTRC_CHUNK_HEADER ) ) / sizeof( ULONG ); Index++ )
+	{
+		Body[ Index ] = Tag + Index;
+	}
+
+	return Chunk;
+}
+
+static ULONG RandomChunkSize()
+{
+	ULONG Size = 2 * sizeof( JPTRC_CHUNK_HEADER ) +
+		( ( ULONG ) rand() * 37 ) % MAX_CHUNK_SIZE;
+	return ( Size + JPTRC_CHUNK_ALIGNMENT - 1 ) & ~( JPTRC_CHUNK_ALIGNMENT - 1 );
+}
+
+/*++
+	Routine Description:
+		Walk the chunks of a block and check that no chunk straddles
+		a segment boundary and that chunks appear in the order
+		they were appended.
+
+	Return Value:
+		Number of non-pad chunks.
+--*/
+static ULONG VerifyBlock(
+	__in PJPTRCSTG_BLOCK Block,
+	__in ULONG FirstTag
+	)
+{
+	ULONG Chunks = 0;
+	ULONG Offset = 0;
+
+	while ( Offset < Block->Used )
+	{
+		PJPTRC_CHUNK_HEADER Chunk =
+			( PJPTRC_CHUNK_HEADER ) ( Block->Buffer + Offset );
+
+		TEST( Chunk->Reserved == 0 );
+		TEST( Chunk->Size >= sizeof( JPTRC_CHUNK_HEADER ) );
+		TEST( ( Chunk->Size % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+		TEST( Offset / JPTRC_SEGMENT_SIZE ==
+			( Offset + Chunk->Size - 1 ) / JPTRC_SEGMENT_SIZE );
+
+		if ( Chunk->Type == JPTRC_CHUNK_TYPE_PAD )
+		{
+			//
+			// Pads only occur at the end of a segment.
+			//
+			TEST( ( ( Offset + Chunk->Size ) % JPTRC_SEGMENT_SIZE ) == 0 );
+		}
+		else
+		{
+			TEST( Chunk->Type == JPTRC_CHUNK_TYPE_IMAGE_INFO );
+			TEST( ( ( PULONG ) ( Chunk + 1 ) )[ 0 ] == FirstTag + Chunks * 1000 );
+			Chunks++;
+		}
+
+		Offset += Chunk->Size;
+	}
+
+	TEST( Offset == Block->Used );
+	return Chunks;
+}
+
+static void TestFillBlocks()
+{
+	JPTRCSTG_BLOCK Block;
+	ULONG FirstTag = 0;
+	ULONG Iteration;
+	ULONG Tag = 0;
+
+	srand( 11 );
+
+	Block.Capacity				= BLOCK_SIZE;
+	Block.Buffer				= ( PUCHAR ) BlockBuffer;
+	Block.NextSequenceNumber	= 0;
+	JptrcstgResetBlock( &Block, 0 );
+
+	for ( Iteration = 0; Iteration < 8; Iteration++ )
+	{
+		ULONG Appended = Iteration == 0 ? 0 : 1;
+		ULONGLONG Offset;
+		ULONG Size;
+
+		for ( ;; )
+		{
+			ULONG UsedBefore = Block.Used;
+
+			Size = RandomChunkSize();
+			if ( ! JptrcstgAppendChunk(
+				&Block,
+				PrepareChunk( Size, Tag ),
+				NULL,
+				0,
+				&Offset ) )
+			{
+				break;
+			}
+
+			TEST( Offset >= Block.FileOffset + UsedBefore );
+			TEST( Offset + Size == Block.FileOffset + Block.Used );
+
+			Tag += 1000;
+			Appended++;
+		}
+
+		TEST( Appended > 0 );
+		TEST( Block.Used <= Block.Capacity );
+		TEST( VerifyBlock( &Block, FirstTag ) == Appended );
+
+		//
+		// Block is full - a retry must fail again, the block
+		// must remain unchanged.
+		//
+		if ( Block.Used == Block.Capacity )
+		{
+			TEST( ! JptrcstgAppendChunk(
+				&Block,
+				PrepareChunk( Size, Tag ),
+				NULL,
+				0,
+				NULL ) );
+			TEST( Block.Used == Block.Capacity );
+		}
+
+		//
+		// Continue in next block - the chunk must now fit.
+		//
+		FirstTag = Tag;
+		JptrcstgResetBlock( &Block, Block.FileOffset + Block.Capacity );
+		TEST( JptrcstgAppendChunk(
+			&Block,
+			PrepareChunk( Size, Tag ),
+			NULL,
+			0,
+			&Offset ) );
+		TEST( Offset == ( Iteration + 1 ) * ( ULONGLONG ) BLOCK_SIZE );
+
+		Tag += 1000;
+	}
+}
+
+static void TestAppendWithBody()
+{
+	JPTRCSTG_BLOCK Block;
+	PJPTRC_CHUNK_HEADER Chunk;
+	ULONGLONG Offset;
+
+	Block.Capacity				= BLOCK_SIZE;
+	Block.Buffer				= ( PUCHAR ) BlockBuffer;
+	Block.NextSequenceNumber	= 0;
+	JptrcstgResetBlock( &Block, JPTRC_SEGMENT_SIZE * 8 );
+
+	//
+	// Leave 16 bytes in the first segment.
+	//
+	Block.Used = JPTRC_SEGMENT_SIZE - 16;
+
+	//
+	// Header and body passed separately.
+	//
+	Chunk = PrepareChunk( 64, 0 );
+	TEST( JptrcstgAppendChunk(
+		&Block,
+		Chunk,
+		( PUCHAR ) ChunkBuffer + 16,
+		48,
+		&Offset ) );
+
+	TEST( Offset == JPTRC_SEGMENT_SIZE * 9 );
+	TEST( Block.Used == JPTRC_SEGMENT_SIZE + 64 );
+	TEST( 0 == memcmp( Block.Buffer + JPTRC_SEGMENT_SIZE, ChunkBuffer, 64 ) );
+
+	//
+	// Pad chunk covers the remainder of the first segment.
+	//
+	Chunk = ( PJPTRC_CHUNK_HEADER ) ( Block.Buffer + JPTRC_SEGMENT_SIZE - 16 );
+	TEST( Chunk->Type == JPTRC_CHUNK_TYPE_PAD );
+	TEST( Chunk->Size == 16 );
+	TEST( 0 == ( ( PULONGLONG ) ( Chunk + 1 ) )[ 0 ] );
+
+	//
+	// Chunk fitting exactly.
+	//
+	Block.Used = BLOCK_SIZE - 64;
+	TEST( JptrcstgAppendChunk( &Block, PrepareChunk( 64, 0 ), NULL, 0, NULL ) );
+	TEST( Block.Used == BLOCK_SIZE );
+	TEST( ! JptrcstgAppendChunk( &Block, PrepareChunk( 8 + 8, 0 ), NULL, 0, NULL ) );
+}
+
+static void TestSegmentHeaders()
+{
+	JPTRCSTG_BLOCK Block;
+	ULONG Iteration;
+	ULONGLONG Offset;
+	ULONG Segment;
+	ULONG Size = 0;
+
+	srand( 13 );
+
+	Block.Capacity				= BLOCK_SIZE;
+	Block.Buffer				= ( PUCHAR ) BlockBuffer;
+	Block.NextSequenceNumber	= 1;
+	JptrcstgResetBlock( &Block, JPTRC_SEGMENT_SIZE );
+
+	for ( Iteration = 0; Iteration < 4; Iteration++ )
+	{
+		if ( Iteration > 0 )
+		{
+			//
+			// Carry over the chunk that did not fit.
+			//
+			JptrcstgResetBlock( &Block, Block.FileOffset + Block.Capacity );
+			TEST( JptrcstgAppendChunk(
+				&Block,
+				PrepareChunk( Size, 0 ),
+				NULL,
+				0,
+				&Offset ) );
+			TEST( Offset == Block.FileOffset + 
+				sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) );
+		}
+
+		for ( ;; )
+		{
+			Size = RandomChunkSize();
+			if ( ! JptrcstgAppendChunk(
+				&Block,
+				PrepareChunk( Size, 0 ),
+				NULL,
+				0,
+				NULL ) )
+			{
+				break;
+			}
+		}
+
+		//
+		// Each segment must begin with a segment header carrying
+		// consecutive sequence numbers.
+		//
+		TEST( Block.Used == Block.Capacity );
+		TEST( Block.NextSequenceNumber == 
+			( Iteration + 1 ) * SEGMENTS_PER_BLOCK + 1 );
+
+		for ( Segment = 0; Segment < SEGMENTS_PER_BLOCK; Segment++ )
+		{
+			PJPTRC_SEGMENT_HEADER_CHUNK Header = ( PJPTRC_SEGMENT_HEADER_CHUNK )
+				( Block.Buffer + Segment * JPTRC_SEGMENT_SIZE );
+
+			TEST( Header->Header.Type == JPTRC_CHUNK_TYPE_SEGMENT_HEADER );
+			TEST( Header->Header.Reserved == 0 );
+			TEST( Header->Header.Size == sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) );
+			TEST( Header->SequenceNumber == 
+				Iteration * SEGMENTS_PER_BLOCK + Segment + 1 );
+		}
+	}
+}
+
+CFIX_BEGIN_FIXTURE( StagingBlock )
+	CFIX_FIXTURE_ENTRY( TestFillBlocks )
+	CFIX_FIXTURE_ENTRY( TestAppendWithBody )
+	CFIX_FIXTURE_ENTRY( TestSegmentHeaders )
+CFIX_END_FIXTURE()
@@ -0,0 +1,318 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Symbol table chunk tests. Trace files are synthesized s.t. their
+ *		contents are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <string.h>
+#include <jptrcfmt.h>
+#include <jptrcsym.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define CHUNK_CAPACITY		256
+#define TRACE_CHUNK_SIZE	FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, \
+								Transitions[ 6 ] )
+
+typedef struct _CALLBACK_CONTEXT
+{
+	JPTRCRHANDLE Handle;
+	ULONG Counter;
+	PSYMBOL_INFO Symbols[ 3 ];
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+
+static void AppendSymbol(
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+	__in ULONGLONG Procedure,
+	__in PCSTR Name
+	)
+{
+	TEST( JptrcsymAppendSymbol(
+		Chunk,
+		CHUNK_CAPACITY,
+		Procedure,
+		0x10000000,
+		Name,
+		( USHORT ) strlen( Name ) ) );
+}
+
+static void TestBuildAndValidateChunk()
+{
+	ULONGLONG Buffer[ CHUNK_CAPACITY / sizeof( ULONGLONG ) ];
+	PJPTRC_SYMBOL_TABLE_CHUNK Chunk = ( PJPTRC_SYMBOL_TABLE_CHUNK ) Buffer;
+	PJPTRC_SYMBOL Symbol;
+	CHAR LongName[ CHUNK_CAPACITY ];
+
+	JptrcsymInitializeChunk( Chunk );
+	TEST( JptrcsymIsValidChunk( Chunk ) );
+
+	AppendSymbol( Chunk, 0x10000, "Foo" );
+	AppendSymbol( Chunk, 0x20000, "BarBarBar" );
+
+	TEST( Chunk->SymbolCount == 2 );
+	TEST( ( Chunk->Header.Size % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+	TEST( JptrcsymIsValidChunk( Chunk ) );
+
+	Symbol = Chunk->Symbols;
+	TEST( Symbol->Procedure == 0x10000 );
+	TEST( Symbol->NameLength == 3 );
+	TEST( 0 == strcmp( Symbol->Name, "Foo" ) );
+
+	Symbol = JPTRCSYM_NEXT_SYMBOL( Symbol );
+	TEST( Symbol->Procedure == 0x20000 );
+	TEST( 0 == strcmp( Symbol->Name, "BarBarBar" ) );
+
+	//
+	// Chunk full.
+	//
+	FillMemory( LongName, sizeof( LongName ), 'x' );
+	TEST( ! JptrcsymAppendSymbol(
+		Chunk,
+		CHUNK_CAPACITY,
+		0x30000,
+		0x10000000,
+		LongName,
+		sizeof( LongName ) ) );
+	TEST( Chunk->SymbolCount == 2 );
+	TEST( JptrcsymIsValidChunk( Chunk ) );
+
+	//
+	// Unterminated name.
+	//
+	Symbol->Name[ Symbol->NameLength ] = 'x';
+	TEST( ! JptrcsymIsValidChunk( Chunk ) );
+	Symbol->Name[ Symbol->NameLength ] = '\0';
+
+	//
+	// Symbol exceeding chunk.
+	//
+	Symbol->Size += JPTRC_CHUNK_ALIGNMENT;
+	TEST( ! JptrcsymIsValidChunk( Chunk ) );
+	Symbol->Size -= JPTRC_CHUNK_ALIGNMENT;
+
+	//
+	// Null procedure.
+	//
+	Symbol->Procedure = 0;
+	TEST( ! JptrcsymIsValidChunk( Chunk ) );
+	Symbol->Procedure = 0x20000;
+
+	//
+	// Trailing garbage.
+	//
+	Chunk->SymbolCount = 1;
+	TEST( ! JptrcsymIsValidChunk( Chunk ) );
+	Chunk->SymbolCount = 2;
+
+	TEST( JptrcsymIsValidChunk( Chunk ) );
+}
+
+/*++
+	Routine Description:
+		Write a file containing two symbol table chunks, the second
+		redefining a procedure of the first, followed by a trace
+		buffer chunk holding 3 top level calls. No image info
+		chunks are written, so the symbols cannot be obtained
+		from dbghelp.
+--*/
+static void WriteTraceFile()
+{
+	ULONGLONG Buffer[ ( sizeof( JPTRC_FILE_HEADER ) + 2 * CHUNK_CAPACITY +
+		TRACE_CHUNK_SIZE ) / sizeof( ULONGLONG ) ];
+	PJPTRC_FILE_HEADER Header = ( PJPTRC_FILE_HEADER ) Buffer;
+	PJPTRC_SYMBOL_TABLE_CHUNK FirstTable;
+	PJPTRC_SYMBOL_TABLE_CHUNK SecondTable;
+	PJPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+	PJPTRC_PAD_CHUNK Pad;
+	ULONG Transition;
+
+	C_ASSERT( ( sizeof( Buffer ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+
+	ZeroMemory( Buffer, sizeof( Buffer ) );
+
+	InitializeTraceFileHeader( Header );
+
+	FirstTable = ( PJPTRC_SYMBOL_TABLE_CHUNK ) ( Header + 1 );
+	JptrcsymInitializeChunk( FirstTable );
+	AppendSymbol( FirstTable, 0x10000, "Foo" );
+	AppendSymbol( FirstTable, 0x20000, "Bar" );
+
+	SecondTable = ( PJPTRC_SYMBOL_TABLE_CHUNK )
+		( ( PUCHAR ) FirstTable + FirstTable->Header.Size );
+	JptrcsymInitializeChunk( SecondTable );
+	AppendSymbol( SecondTable, 0x20000, "BarRedefined" );
+
+	Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 )
+		( ( PUCHAR ) SecondTable + SecondTable->Header.Size );
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+	Chunk->Header.Size		= TRACE_CHUNK_SIZE;
+	Chunk->Client.ProcessId	= 4;
+	Chunk->Client.ThreadId	= 8;
+
+	for ( Transition = 0; Transition < 6; Transition++ )
+	{
+		Chunk->Transitions[ Transition ].Type = ( Transition % 2 ) == 0
+			? JPTRC_PROCEDURE_TRANSITION_ENTRY
+			: JPTRC_PROCEDURE_TRANSITION_EXIT;
+		Chunk->Transitions[ Transition ].Timestamp	= Transition;
+		Chunk->Transitions[ Transition ].Procedure	=
+			( Transition / 2 + 1 ) * 0x10000;
+	}
+
+	//
+	// Pad remainder.
+	//
+	Pad = ( PJPTRC_PAD_CHUNK ) ( ( PUCHAR ) Chunk + TRACE_CHUNK_SIZE );
+	if ( ( PUCHAR ) Pad < ( PUCHAR ) Buffer + sizeof( Buffer ) )
+	{
+		Pad->Header.Type	= JPTRC_CHUNK_TYPE_PAD;
+		Pad->Header.Size	= ( ULONG )
+			( ( PUCHAR ) Buffer + sizeof( Buffer ) - ( PUCHAR ) Pad );
+	}
+
+	WriteTempTraceFile( FilePath, Buffer, sizeof( Buffer ) );
+}
+
+static void CheckSymbolsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	//
+	// No image info chunk - the module is unknown.
+	//
+	TEST( Call->Module == NULL );
+
+	switch ( Call->Procedure )
+	{
+	case 0x10000:
+		TEST( Call->Symbol != NULL );
+		if ( Call->Symbol == NULL ) break;
+		TEST( 0 == wcscmp( Call->Symbol->Name, L"Foo" ) );
+		TEST( Call->Symbol->ModBase == 0x10000000 );
+		break;
+
+	case 0x20000:
+		TEST( Call->Symbol != NULL );
+		if ( Call->Symbol == NULL ) break;
+		TEST( 0 == wcscmp( Call->Symbol->Name, L"BarRedefined" ) );
+		break;
+
+	case 0x30000:
+		TEST( Call->Symbol == NULL );
+		break;
+
+	default:
+		TEST( !"Unexpected procedure" );
+	}
+
+	Ctx->Counter++;
+}
+
+static void CheckSymbolsClientsCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST_OK( JptrcrEnumCalls( Ctx->Handle, Client, CheckSymbolsCallback, Ctx ) );
+}
+
+static void TestResolveEmbeddedSymbols()
+{
+	CALLBACK_CONTEXT Ctx;
+	JPTRCRHANDLE Handle;
+
+	WriteTraceFile();
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	Ctx.Handle = Handle;
+	TEST_OK( JptrcrEnumClients( Handle, CheckSymbolsClientsCallback, &Ctx ) );
+	TEST( Ctx.Counter == 3 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void CollectSymbolsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->Counter < _countof( Ctx->Symbols ) );
+	if ( Ctx->Counter < _countof( Ctx->Symbols ) )
+	{
+		Ctx->Symbols[ Ctx->Counter++ ] = Call->Symbol;
+	}
+}
+
+static void TestSymbolsRemainValid()
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT FirstCtx;
+	CALLBACK_CONTEXT SecondCtx;
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+
+	WriteTraceFile();
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	ZeroMemory( &FirstCtx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectSymbolsCallback, &FirstCtx ) );
+	TEST( FirstCtx.Counter == 3 );
+
+	ZeroMemory( &SecondCtx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CollectSymbolsCallback, &SecondCtx ) );
+	TEST( SecondCtx.Counter == 3 );
+
+	//
+	// Symbols are handed out from the cache - both successful and
+	// failed lookups yield the same result again.
+	//
+	for ( Index = 0; Index < 3; Index++ )
+	{
+		TEST( FirstCtx.Symbols[ Index ] == SecondCtx.Symbols[ Index ] );
+	}
+
+	TEST( FirstCtx.Symbols[ 0 ] != NULL );
+	TEST( FirstCtx.Symbols[ 2 ] == NULL );
+
+	if ( FirstCtx.Symbols[ 0 ] != NULL )
+	{
+		TEST( 0 == wcscmp( FirstCtx.Symbols[ 0 ]->Name, L"Foo" ) );
+	}
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( SymbolTable )
+	CFIX_FIXTURE_ENTRY( TestBuildAndValidateChunk )
+	CFIX_FIXTURE_ENTRY( TestResolveEmbeddedSymbols )
+	CFIX_FIXTURE_ENTRY( TestSymbolsRemainValid )
+CFIX_END_FIXTURE()
@@ -0,0 +1,293 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for reading files that are still being written to.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define MAX_CLIENTS			4
+
+typedef struct _REFRESH_CONTEXT
+{
+	ULONG Counter;
+	struct
+	{
+		JPTRCR_CLIENT Client;
+		BOOL NewClient;
+		ULONG NewChunks;
+	} Updates[ MAX_CLIENTS ];
+} REFRESH_CONTEXT, *PREFRESH_CONTEXT;
+
+typedef struct _CALLBACK_CONTEXT
+{
+	ULONG Counter;
+	JPTRCR_CALL LastCall;
+} CALLBACK_CONTEXT, *PCALLBACK_CONTEXT;
+
+static WCHAR FilePath[ MAX_PATH ];
+static ULONGLONG Timestamp;
+
+//
+// A (0x10000) calls B (0x20000). A returns in a later chunk.
+//
+static const TRANSITION FirstChunkTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x10000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x20000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x20000 }
+};
+
+static const TRANSITION SecondChunkTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x30000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x30000 }
+};
+
+static const TRANSITION ThirdChunkTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x10000 }
+};
+
+/*++
+	Routine Description:
+		Build a trace buffer chunk, assigning consecutive timestamps
+		to its transitions.
+--*/
+static ULONG BuildChunk(
+	__in ULONG ThreadId,
+	__in ULONG TransitionCount,
+	__in const TRANSITION *Transitions,
+	__out PCHUNK_BUFFER Buffer
+	)
+{
+	ULONG Index;
+	ULONG Size;
+
+	Size = BuildTraceBufferChunk( 
+		ThreadId, 
+		TransitionCount, 
+		Transitions, 
+		Buffer );
+
+	for ( Index = 0; Index < TransitionCount; Index++ )
+	{
+		Buffer->Chunk.Transitions[ Index ].Timestamp = Timestamp++;
+	}
+
+	return Size;
+}
+
+/*++
+	Routine Description:
+		Create a file holding the header and the first chunk. The
+		returned handle may be used to append further chunks.
+--*/
+static HANDLE CreateTraceFile()
+{
+	CHUNK_BUFFER Buffer;
+	HANDLE File;
+
+	Timestamp = 1;
+
+	File = CreateTempTraceFile( FilePath );
+	AppendToTraceFile( File, &Buffer, BuildChunk(
+		8,
+		_countof( FirstChunkTransitions ),
+		FirstChunkTransitions,
+		&Buffer ) );
+
+	return File;
+}
+
+static void RefreshCallback(
+	__in PJPTRCR_CLIENT Client,
+	__in BOOL NewClient,
+	__in ULONG NewChunks,
+	__in_opt PVOID Context
+	)
+{
+	PREFRESH_CONTEXT Ctx = ( PREFRESH_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	TEST( Ctx->Counter < MAX_CLIENTS );
+	if ( Ctx->Counter >= MAX_CLIENTS ) return;
+
+	Ctx->Updates[ Ctx->Counter ].Client		= *Client;
+	Ctx->Updates[ Ctx->Counter ].NewClient	= NewClient;
+	Ctx->Updates[ Ctx->Counter ].NewChunks	= NewChunks;
+	Ctx->Counter++;
+}
+
+static void CountCallsCallback(
+	__in PJPTRCR_CALL Call,
+	__in_opt PVOID Context
+	)
+{
+	PCALLBACK_CONTEXT Ctx = ( PCALLBACK_CONTEXT ) Context;
+	TEST( Ctx );
+	if ( ! Ctx ) return;
+
+	Ctx->LastCall = *Call;
+	Ctx->Counter++;
+}
+
+/*++
+	Routine Description:
+		Check the calls of thread 8. As long as A has not returned,
+		it is not reported.
+--*/
+static void CheckTopLevelCallOfThread8(
+	__in JPTRCRHANDLE Handle,
+	__in BOOL Returned
+	)
+{
+	JPTRCR_CLIENT Client = { 4, 8 };
+	CALLBACK_CONTEXT Ctx;
+	CALLBACK_CONTEXT ChildCtx;
+
+	ZeroMemory( &Ctx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumCalls( Handle, &Client, CountCallsCallback, &Ctx ) );
+
+	if ( ! Returned )
+	{
+		TEST( Ctx.Counter == 0 );
+		return;
+	}
+
+	TEST( Ctx.Counter == 1 );
+	TEST( Ctx.LastCall.Procedure == 0x10000 );
+	TEST( Ctx.LastCall.ExitType == JptrcrNormalExit );
+
+	ZeroMemory( &ChildCtx, sizeof( CALLBACK_CONTEXT ) );
+	TEST_OK( JptrcrEnumChildCalls(
+		Handle,
+		&Ctx.LastCall.CallHandle,
+		CountCallsCallback,
+		&ChildCtx ) );
+	TEST( ChildCtx.Counter == 1 );
+	TEST( ChildCtx.LastCall.Procedure == 0x20000 );
+}
+
+static void TestOpenFileWithIncompleteChunk()
+{
+	CHUNK_BUFFER Buffer;
+	HANDLE File;
+	JPTRCRHANDLE Handle;
+
+	File = CreateTraceFile();
+
+	//
+	// Only half of the chunk has made it to disk.
+	//
+	AppendToTraceFile( File, &Buffer, BuildChunk(
+		12,
+		_countof( SecondChunkTransitions ),
+		SecondChunkTransitions,
+		&Buffer ) / 2 );
+	TEST( CloseHandle( File ) );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+	CheckTopLevelCallOfThread8( Handle, FALSE );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestRefreshGrowingFile()
+{
+	CHUNK_BUFFER Buffer;
+	ULONG ChunkSize;
+	REFRESH_CONTEXT Ctx;
+	HANDLE File;
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+
+	File = CreateTraceFile();
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+	CheckTopLevelCallOfThread8( Handle, FALSE );
+
+	//
+	// Nothing has been appended yet.
+	//
+	ZeroMemory( &Ctx, sizeof( REFRESH_CONTEXT ) );
+	TEST_HR( S_FALSE, JptrcrRefreshFile( Handle, RefreshCallback, &Ctx ) );
+	TEST( Ctx.Counter == 0 );
+
+	//
+	// Begin writing a chunk of a new thread - not visible yet.
+	//
+	ChunkSize = BuildChunk(
+		12,
+		_countof( SecondChunkTransitions ),
+		SecondChunkTransitions,
+		&Buffer );
+	AppendToTraceFile( File, &Buffer, ChunkSize / 2 );
+
+	TEST_HR( S_FALSE, JptrcrRefreshFile( Handle, RefreshCallback, &Ctx ) );
+	TEST( Ctx.Counter == 0 );
+
+	//
+	// Complete the chunk and let A return.
+	//
+	AppendToTraceFile( File, ( PUCHAR ) &Buffer + ChunkSize / 2, ChunkSize - ChunkSize / 2 );
+	AppendToTraceFile( File, &Buffer, BuildChunk(
+		8,
+		_countof( ThirdChunkTransitions ),
+		ThirdChunkTransitions,
+		&Buffer ) );
+
+	TEST_OK( JptrcrRefreshFile( Handle, RefreshCallback, &Ctx ) );
+	TEST( Ctx.Counter == 2 );
+
+	for ( Index = 0; Index < Ctx.Counter; Index++ )
+	{
+		TEST( Ctx.Updates[ Index ].Client.ProcessId == 4 );
+		TEST( Ctx.Updates[ Index ].NewChunks == 1 );
+
+		if ( Ctx.Updates[ Index ].Client.ThreadId == 8 )
+		{
+			TEST( ! Ctx.Updates[ Index ].NewClient );
+		}
+		else
+		{
+			TEST( Ctx.Updates[ Index ].Client.ThreadId == 12 );
+			TEST( Ctx.Updates[ Index ].NewClient );
+		}
+	}
+
+	//
+	// The call index of thread 8 must have been rebuilt.
+	//
+	CheckTopLevelCallOfThread8( Handle, TRUE );
+
+	ZeroMemory( &Ctx, sizeof( REFRESH_CONTEXT ) );
+	TEST_HR( S_FALSE, JptrcrRefreshFile( Handle, RefreshCallback, &Ctx ) );
+	TEST( Ctx.Counter == 0 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( CloseHandle( File ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestRefreshInvalidHandle()
+{
+	TEST_HR( E_INVALIDARG, JptrcrRefreshFile( NULL, NULL, NULL ) );
+}
+
+CFIX_BEGIN_FIXTURE( Tail )
+	CFIX_FIXTURE_ENTRY( TestOpenFileWithIncompleteChunk )
+	CFIX_FIXTURE_ENTRY( TestRefreshGrowingFile )
+	CFIX_FIXTURE_ENTRY( TestRefreshInvalidHandle )
+CFIX_END_FIXTURE()
@@ -0,0 +1,163 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Tests for the merged timeline.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <jptrcfmt.h>
+#include <jptrcr.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+#define TEST_HR( Hr, Expr ) CFIX_ASSERT_EQUALS_DWORD( ( ULONG ) Hr, ( Expr ) )
+#define TEST_OK( Expr ) TEST_HR( S_OK, Expr )
+
+#define MAX_RECORDS			32
+
+static WCHAR FilePath[ MAX_PATH ];
+
+/*++
+	Routine Description:
+		Read the entire timeline, MaxRecords at a time.
+--*/
+static ULONG ReadTimeline(
+	__in JPTRCRHANDLE Handle,
+	__in_opt PJPTRCR_TIMESTAMP_RANGE Range,
+	__in ULONG MaxRecords,
+	__out_ecount( MAX_RECORDS ) PJPTRCR_TRANSITION_RECORD Records
+	)
+{
+	ULONG Count = 0;
+	HRESULT Hr;
+	JPTRCRTIMELINEHANDLE Timeline;
+
+	TEST_OK( JptrcrCreateTimeline( Handle, Range, &Timeline ) );
+
+	do
+	{
+		ULONG Read;
+
+		TEST( Count + MaxRecords <= MAX_RECORDS );
+		if ( Count + MaxRecords > MAX_RECORDS ) break;
+
+		Hr = JptrcrReadTimeline( Timeline, MaxRecords, &Records[ Count ], &Read );
+		TEST( SUCCEEDED( Hr ) );
+		TEST( Read <= MaxRecords );
+		TEST( Hr == S_FALSE || Read == MaxRecords );
+
+		Count += Read;
+	}
+	while ( Hr == S_OK );
+
+	TEST_OK( JptrcrDeleteTimeline( Timeline ) );
+
+	return Count;
+}
+
+static void TestReadMergedTimeline()
+{
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+	ULONG MaxRecords;
+	JPTRCR_TRANSITION_RECORD Records[ MAX_RECORDS ];
+
+	WriteInterleavedTraceFile( FilePath );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	for ( MaxRecords = 1; MaxRecords <= 11; MaxRecords += 5 )
+	{
+		TEST( ReadTimeline( Handle, NULL, MaxRecords, Records ) == 10 );
+
+		for ( Index = 0; Index < 10; Index++ )
+		{
+			TEST( Records[ Index ].Timestamp == ( Index + 1 ) * 10 );
+			TEST( Records[ Index ].Client.ProcessId == 4 );
+			TEST( Records[ Index ].Client.ThreadId ==
+				( ( Index == 1 || Index == 3 || Index == 5 || Index == 8 )
+					? 12 : 8 ) );
+		}
+
+		TEST( Records[ 0 ].Procedure == 0x10000 );
+		TEST( Records[ 0 ].Type == JptrcrEntryTransition );
+		TEST( Records[ 8 ].Procedure == 0x40000 );
+		TEST( Records[ 8 ].Type == JptrcrUnwindTransition );
+		TEST( Records[ 9 ].Procedure == 0x10000 );
+		TEST( Records[ 9 ].Type == JptrcrExitTransition );
+	}
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestReadTimelineRange()
+{
+	JPTRCRHANDLE Handle;
+	ULONG Index;
+	JPTRCR_TIMESTAMP_RANGE Range;
+	JPTRCR_TRANSITION_RECORD Records[ MAX_RECORDS ];
+
+	WriteInterleavedTraceFile( FilePath );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+
+	//
+	// Skips the first chunk of thread 8 entirely.
+	//
+	Range.Start	= 55;
+	Range.End	= 80;
+	TEST( ReadTimeline( Handle, &Range, 4, Records ) == 3 );
+
+	for ( Index = 0; Index < 3; Index++ )
+	{
+		TEST( Records[ Index ].Timestamp == ( Index + 6 ) * 10 );
+	}
+
+	//
+	// Single timestamp.
+	//
+	Range.Start	= 40;
+	Range.End	= 40;
+	TEST( ReadTimeline( Handle, &Range, 4, Records ) == 1 );
+	TEST( Records[ 0 ].Client.ThreadId == 12 );
+
+	//
+	// Beyond the end.
+	//
+	Range.Start	= 101;
+	Range.End	= 200;
+	TEST( ReadTimeline( Handle, &Range, 4, Records ) == 0 );
+
+	TEST_OK( JptrcrCloseFile( Handle ) );
+	TEST( DeleteFile( FilePath ) );
+}
+
+static void TestTimelineInvalidArguments()
+{
+	JPTRCRHANDLE Handle;
+	JPTRCR_TIMESTAMP_RANGE Range = { 2, 1 };
+	JPTRCR_TRANSITION_RECORD Record;
+	ULONG Read;
+	JPTRCRTIMELINEHANDLE Timeline;
+
+	TEST_HR( E_INVALIDARG, JptrcrCreateTimeline( NULL, NULL, &Timeline ) );
+	TEST_HR( E_INVALIDARG, JptrcrReadTimeline( NULL, 1, &Record, &Read ) );
+	TEST_HR( E_INVALIDARG, JptrcrDeleteTimeline( NULL ) );
+
+	WriteInterleavedTraceFile( FilePath );
+
+	TEST_OK( JptrcrOpenFile( FilePath, &Handle ) );
+	TEST_HR( E_INVALIDARG, JptrcrCreateTimeline( Handle, &Range, &Timeline ) );
+	TEST_OK( JptrcrCloseFile( Handle ) );
+
+	TEST( DeleteFile( FilePath ) );
+}
+
+CFIX_BEGIN_FIXTURE( Timeline )
+	CFIX_FIXTURE_ENTRY( TestReadMergedTimeline )
+	CFIX_FIXTURE_ENTRY( TestReadTimelineRange )
+	CFIX_FIXTURE_ENTRY( TestTimelineInvalidArguments )
+CFIX_END_FIXTURE()
@@ -0,0 +1,379 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Routines for synthesizing trace files.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <windows.h>
+#include <stdlib.h>
+#include <cfix.h>
+#include "tracegen.h"
+
+#define TEST CFIX_ASSERT
+
+#define NESTED_CALLS_FIRST_CHUNK_TRANSITIONS	5
+#define NESTED_CALLS_SECOND_CHUNK_TRANSITIONS	11
+
+static const TRANSITION Thread8FirstTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x10000,	10 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x20000,	30 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x20000,	50 }
+};
+
+static const TRANSITION Thread12Transitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x30000,	20 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x30000,	40 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x40000,	60 },
+	{ JPTRC_PROCEDURE_TRANSITION_UNWIND,	0x40000,	90 }
+};
+
+static const TRANSITION Thread8SecondTransitions[] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x50000,	70 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x50000,	80 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x10000,	100 }
+};
+
+static const TRANSITION NestedCallsFirstChunkTransitions[ 
+	NESTED_CALLS_FIRST_CHUNK_TRANSITIONS ] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x10000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x20000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x20000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x30000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x40000 }
+};
+
+static const TRANSITION NestedCallsSecondChunkTransitions[ 
+	NESTED_CALLS_SECOND_CHUNK_TRANSITIONS ] =
+{
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x40000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x30000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x20000 },
+	{ JPTRC_PROCEDURE_TRANSITION_UNWIND,	0x20000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x10000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x90000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x50000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x60000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x70000 },
+	{ JPTRC_PROCEDURE_TRANSITION_EXIT,		0x50000 },
+	{ JPTRC_PROCEDURE_TRANSITION_ENTRY,		0x80000 }
+};
+
+VOID InitializeTraceFileHeader(
+	__out PJPTRC_FILE_HEADER Header
+	)
+{
+	ZeroMemory( Header, sizeof( JPTRC_FILE_HEADER ) );
+	Header->Signature		= JPTRC_HEADER_SIGNATURE;
+	Header->Version			= JPTRC_HEADER_VERSION;
+	Header->Characteristics	= JPTRC_CHARACTERISTIC_TIMESTAMP_TSC |
+							  JPTRC_CHARACTERISTIC_32BIT;
+}
+
+ULONG BuildTraceBufferChunk(
+	__in ULONG ThreadId,
+	__in ULONG TransitionCount,
+	__in_ecount( TransitionCount ) const TRANSITION *Transitions,
+	__out PCHUNK_BUFFER Buffer
+	)
+{
+	ULONG Index;
+
+	TEST( TransitionCount <= ANYSIZE_ARRAY + MAX_CHUNK_TRANSITIONS );
+
+	ZeroMemory( Buffer, sizeof( CHUNK_BUFFER ) );
+
+	Buffer->Chunk.Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+	Buffer->Chunk.Header.Size		= FIELD_OFFSET(
+		JPTRC_TRACE_BUFFER_CHUNK32,
+		Transitions[ TransitionCount ] );
+	Buffer->Chunk.Client.ProcessId	= 4;
+	Buffer->Chunk.Client.ThreadId	= ThreadId;
+
+	for ( Index = 0; Index < TransitionCount; Index++ )
+	{
+		Buffer->Chunk.Transitions[ Index ].Type		= Transitions[ Index ].Type;
+		Buffer->Chunk.Transitions[ Index ].Timestamp	= Transitions[ Index ].Timestamp;
+		Buffer->Chunk.Transitions[ Index ].Procedure	= Transitions[ Index ].Procedure;
+	}
+
+	return Buffer->Chunk.Header.Size;
+}
+
+HANDLE CreateTempTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath
+	)
+{
+	HANDLE File;
+	JPTRC_FILE_HEADER Header;
+	WCHAR TempPath[ MAX_PATH ];
+
+	TEST( GetTempPath( _countof( TempPath ), TempPath ) );
+	TEST( GetTempFileName( TempPath, L"jtr", 0, FilePath ) );
+
+	File = CreateFile(
+		FilePath,
+		GENERIC_WRITE,
+		FILE_SHARE_READ,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL );
+	TEST( File != INVALID_HANDLE_VALUE );
+
+	InitializeTraceFileHeader( &Header );
+	AppendToTraceFile( File, &Header, sizeof( JPTRC_FILE_HEADER ) );
+
+	return File;
+}
+
+VOID AppendToTraceFile(
+	__in HANDLE File,
+	__in_bcount( Size ) const VOID *Buffer,
+	__in ULONG Size
+	)
+{
+	DWORD Written;
+
+	TEST( WriteFile( File, Buffer, Size, &Written, NULL ) );
+	TEST( Written == Size );
+}
+
+VOID AppendTraceBufferChunk(
+	__in HANDLE File,
+	__in ULONG ThreadId,
+	__in ULONG TransitionCount,
+	__in_ecount( TransitionCount ) const TRANSITION *Transitions
+	)
+{
+	CHUNK_BUFFER Buffer;
+
+	AppendToTraceFile( File, &Buffer, BuildTraceBufferChunk(
+		ThreadId,
+		TransitionCount,
+		Transitions,
+		&Buffer ) );
+}
+
+VOID WriteTempTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath,
+	__in_bcount( Size ) const VOID *Contents,
+	__in ULONG Size
+	)
+{
+	HANDLE File;
+	WCHAR TempPath[ MAX_PATH ];
+
+	TEST( GetTempPath( _countof( TempPath ), TempPath ) );
+	TEST( GetTempFileName( TempPath, L"jtr", 0, FilePath ) );
+
+	File = CreateFile(
+		FilePath,
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL );
+	TEST( File != INVALID_HANDLE_VALUE );
+
+	AppendToTraceFile( File, Contents, Size );
+
+	TEST( CloseHandle( File ) );
+}
+
+VOID WriteInterleavedTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath
+	)
+{
+	HANDLE File = CreateTempTraceFile( FilePath );
+
+	AppendTraceBufferChunk(
+		File,
+		8,
+		_countof( Thread8FirstTransitions ),
+		Thread8FirstTransitions );
+	AppendTraceBufferChunk(
+		File,
+		12,
+		_countof( Thread12Transitions ),
+		Thread12Transitions );
+	AppendTraceBufferChunk(
+		File,
+		8,
+		_countof( Thread8SecondTransitions ),
+		Thread8SecondTransitions );
+
+	TEST( CloseHandle( File ) );
+}
+
+/*++
+	Routine Description:
+		Build a chunk of thread 8 using consecutive timestamps.
+		Unlike BuildTraceBufferChunk, the number of transitions
+		is not limited by CHUNK_BUFFER.
+--*/
+static PUCHAR BuildSequentialChunk(
+	__in PUCHAR Buffer,
+	__in ULONG TransitionCount,
+	__in const TRANSITION *Transitions,
+	__inout PULONGLONG Timestamp
+	)
+{
+	PJPTRC_TRACE_BUFFER_CHUNK32 Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 ) Buffer;
+	ULONG Index;
+
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+	Chunk->Header.Size		= FIELD_OFFSET(
+		JPTRC_TRACE_BUFFER_CHUNK32,
+		Transitions[ TransitionCount ] );
+	Chunk->Client.ProcessId	= 4;
+	Chunk->Client.ThreadId	= 8;
+
+	for ( Index = 0; Index < TransitionCount; Index++ )
+	{
+		Chunk->Transitions[ Index ].Type		= Transitions[ Index ].Type;
+		Chunk->Transitions[ Index ].Timestamp	= ( *Timestamp )++;
+		Chunk->Transitions[ Index ].Procedure	= Transitions[ Index ].Procedure;
+		Chunk->Transitions[ Index ].Info.ReturnValue = Index;
+	}
+
+	return Buffer + Chunk->Header.Size;
+}
+
+VOID WriteNestedCallsTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath,
+	__in_bcount_opt( PrefixSize ) const VOID *Prefix,
+	__in ULONG PrefixSize
+	)
+{
+	ULONGLONG Buffer[ ( sizeof( JPTRC_FILE_HEADER ) +
+		MAX_NESTED_CALLS_PREFIX_SIZE +
+		2 * sizeof( JPTRC_TRACE_BUFFER_CHUNK32 ) +
+		( NESTED_CALLS_FIRST_CHUNK_TRANSITIONS + 
+		  NESTED_CALLS_SECOND_CHUNK_TRANSITIONS ) *
+			sizeof( JPTRC_PROCEDURE_TRANSITION32 ) ) / sizeof( ULONGLONG ) + 1 ];
+	PJPTRC_FILE_HEADER Header = ( PJPTRC_FILE_HEADER ) Buffer;
+	PJPTRC_PAD_CHUNK Pad;
+	PUCHAR Position;
+	ULONGLONG Timestamp = 1;
+
+	TEST( PrefixSize <= MAX_NESTED_CALLS_PREFIX_SIZE );
+	TEST( Prefix != NULL || PrefixSize == 0 );
+
+	ZeroMemory( Buffer, sizeof( Buffer ) );
+
+	InitializeTraceFileHeader( Header );
+
+	Position = ( PUCHAR ) ( Header + 1 );
+	if ( Prefix != NULL )
+	{
+		CopyMemory( Position, Prefix, PrefixSize );
+		Position += PrefixSize;
+	}
+
+	Position = BuildSequentialChunk(
+		Position,
+		NESTED_CALLS_FIRST_CHUNK_TRANSITIONS,
+		NestedCallsFirstChunkTransitions,
+		&Timestamp );
+	Position = BuildSequentialChunk(
+		Position,
+		NESTED_CALLS_SECOND_CHUNK_TRANSITIONS,
+		NestedCallsSecondChunkTransitions,
+		&Timestamp );
+
+	//
+	// Pad remainder.
+	//
+	Pad = ( PJPTRC_PAD_CHUNK ) Position;
+	if ( ( PUCHAR ) Pad < ( PUCHAR ) Buffer + sizeof( Buffer ) )
+	{
+		Pad->Header.Type	= JPTRC_CHUNK_TYPE_PAD;
+		Pad->Header.Size	= ( ULONG )
+			( ( PUCHAR ) Buffer + sizeof( Buffer ) - ( PUCHAR ) Pad );
+	}
+
+	WriteTempTraceFile( FilePath, Buffer, sizeof( Buffer ) );
+}
+
+PUCHAR AllocateSegmentedTraceFile(
+	__in ULONG SegmentCount
+	)
+{
+	PUCHAR Buffer;
+
+	Buffer = ( PUCHAR ) malloc( SegmentCount * JPTRC_SEGMENT_SIZE );
+	TEST( Buffer != NULL );
+	if ( Buffer != NULL )
+	{
+		ZeroMemory( Buffer, SegmentCount * JPTRC_SEGMENT_SIZE );
+		InitializeTraceFileHeader( ( PJPTRC_FILE_HEADER ) Buffer );
+	}
+
+	return Buffer;
+}
+
+PUCHAR GetSegmentPosition(
+	__in PUCHAR Buffer,
+	__in ULONG Segment
+	)
+{
+	PUCHAR SegmentBase = Buffer + Segment * JPTRC_SEGMENT_SIZE;
+
+	return Segment == 0
+		? SegmentBase + sizeof( JPTRC_FILE_HEADER )
+		: SegmentBase;
+}
+
+PUCHAR BuildSingleCallChunk(
+	__in PUCHAR Position,
+	__in ULONG ThreadId,
+	__in ULONG Timestamp
+	)
+{
+	PJPTRC_TRACE_BUFFER_CHUNK32 Chunk = ( PJPTRC_TRACE_BUFFER_CHUNK32 ) Position;
+
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER;
+	Chunk->Header.Size		= SINGLE_CALL_CHUNK_SIZE;
+	Chunk->Client.ProcessId	= 4;
+	Chunk->Client.ThreadId	= ThreadId;
+
+	Chunk->Transitions[ 0 ].Type		= JPTRC_PROCEDURE_TRANSITION_ENTRY;
+	Chunk->Transitions[ 0 ].Timestamp	= Timestamp;
+	Chunk->Transitions[ 0 ].Procedure	= 0x10000;
+	Chunk->Transitions[ 1 ].Type		= JPTRC_PROCEDURE_TRANSITION_EXIT;
+	Chunk->Transitions[ 1 ].Timestamp	= Timestamp + 1;
+	Chunk->Transitions[ 1 ].Procedure	= 0x10000;
+
+	return Position + SINGLE_CALL_CHUNK_SIZE;
+}
+
+PJPTRC_PAD_CHUNK PadSegment(
+	__in PUCHAR Buffer,
+	__in ULONG Segment,
+	__in PUCHAR Position
+	)
+{
+	PJPTRC_PAD_CHUNK Pad = ( PJPTRC_PAD_CHUNK ) Position;
+
+	Pad->Header.Type	= JPTRC_CHUNK_TYPE_PAD;
+	Pad->Header.Size	= ( ULONG )
+		( Buffer + ( Segment + 1 ) * JPTRC_SEGMENT_SIZE - Position );
+
+	return Pad;
+}
+
+VOID WriteSegmentedTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath,
+	__in PUCHAR Buffer,
+	__in ULONG SegmentCount
+	)
+{
+	WriteTempTraceFile( FilePath, Buffer, SegmentCount * JPTRC_SEGMENT_SIZE );
+	free( Buffer );
+}
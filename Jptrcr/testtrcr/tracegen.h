@@ -0,0 +1,232 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Routines for synthesizing trace files s.t. their contents 
+ *		are known exactly.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#include <jptrcfmt.h>
+
+//
+// Maximum number of transitions in a CHUNK_BUFFER.
+//
+#define MAX_CHUNK_TRANSITIONS	8
+
+typedef struct _TRANSITION
+{
+	ULONG Type;
+	ULONG Procedure;
+
+	//
+	// May be left 0 by tests assigning timestamps themselves.
+	//
+	ULONG Timestamp;
+} TRANSITION;
+
+typedef struct _CHUNK_BUFFER
+{
+	JPTRC_TRACE_BUFFER_CHUNK32 Chunk;
+	JPTRC_PROCEDURE_TRANSITION32 MoreTransitions[ MAX_CHUNK_TRANSITIONS ];
+} CHUNK_BUFFER, *PCHUNK_BUFFER;
+
+/*++
+	Routine Description:
+		Initialize the header of a 32 bit trace file using TSC 
+		timestamps.
+--*/
+VOID InitializeTraceFileHeader(
+	__out PJPTRC_FILE_HEADER Header
+	);
+
+/*++
+	Routine Description:
+		Build a trace buffer chunk of client 4/ThreadId.
+
+	Return Value:
+		Size of the chunk.
+--*/
+ULONG BuildTraceBufferChunk(
+	__in ULONG ThreadId,
+	__in ULONG TransitionCount,
+	__in_ecount( TransitionCount ) const TRANSITION *Transitions,
+	__out PCHUNK_BUFFER Buffer
+	);
+
+/*++
+	Routine Description:
+		Create a temporary trace file and write the file header. 
+		The file is opened for writing, but may be read 
+		concurrently.
+
+	Parameters:
+		FilePath	- Path of the file created.
+
+	Return Value:
+		Handle, to be closed by the caller.
+--*/
+HANDLE CreateTempTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath
+	);
+
+VOID AppendToTraceFile(
+	__in HANDLE File,
+	__in_bcount( Size ) const VOID *Buffer,
+	__in ULONG Size
+	);
+
+/*++
+	Routine Description:
+		Build and append a trace buffer chunk, see 
+		BuildTraceBufferChunk.
+--*/
+VOID AppendTraceBufferChunk(
+	__in HANDLE File,
+	__in ULONG ThreadId,
+	__in ULONG TransitionCount,
+	__in_ecount( TransitionCount ) const TRANSITION *Transitions
+	);
+
+/*++
+	Routine Description:
+		Write a temporary trace file consisting of the given 
+		contents, including the file header.
+
+	Parameters:
+		FilePath	- Path of the file created.
+--*/
+VOID WriteTempTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath,
+	__in_bcount( Size ) const VOID *Contents,
+	__in ULONG Size
+	);
+
+/*++
+	Routine Description:
+		Write a temporary trace file in which thread 8 writes two
+		chunks and thread 12 one chunk in between:
+
+		Thread 8:  Entry 0x10000 @10, Entry 0x20000 @30, 
+				   Exit 0x20000 @50 | Entry 0x50000 @70, 
+				   Exit 0x50000 @80, Exit 0x10000 @100
+		Thread 12: Entry 0x30000 @20, Exit 0x30000 @40,
+				   Entry 0x40000 @60, Unwind 0x40000 @90
+
+		Timestamps are unique across threads.
+
+	Parameters:
+		FilePath	- Path of the file created.
+--*/
+VOID WriteInterleavedTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath
+	);
+
+//
+// Maximum size of the chunks preceding the calls written by
+// WriteNestedCallsTraceFile.
+//
+#define MAX_NESTED_CALLS_PREFIX_SIZE	256
+
+/*++
+	Routine Description:
+		Write a temporary trace file holding nested calls of 
+		thread 8, split across two chunks:
+
+		A (0x10000) calls B, C and B again. C calls D and returns in 
+		the next chunk. An exit without entry follows on top level.
+		E calls F, whose exit transition has been lost. H never 
+		returns.
+
+		Timestamps start at 1 and are incremented by each 
+		transition. The return value of each transition is its
+		index within the chunk.
+
+	Parameters:
+		FilePath	- Path of the file created.
+		Prefix		- Chunks to be written ahead of the calls, 
+					  e.g. a symbol table chunk.
+		PrefixSize	- Size of Prefix, at most 
+					  MAX_NESTED_CALLS_PREFIX_SIZE.
+--*/
+VOID WriteNestedCallsTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath,
+	__in_bcount_opt( PrefixSize ) const VOID *Prefix,
+	__in ULONG PrefixSize
+	);
+
+/*++
+	Routine Description:
+		Allocate a zeroed buffer of SegmentCount segments for a 
+		trace file and initialize the file header. Segments are
+		to be filled using GetSegmentPosition, BuildSingleCallChunk
+		and PadSegment.
+
+	Return Value:
+		Buffer, to be released using WriteSegmentedTraceFile.
+--*/
+PUCHAR AllocateSegmentedTraceFile(
+	__in ULONG SegmentCount
+	);
+
+/*++
+	Routine Description:
+		Get the first free position of a segment, i.e. the
+		segment base or, for the first segment, the position 
+		following the file header.
+--*/
+PUCHAR GetSegmentPosition(
+	__in PUCHAR Buffer,
+	__in ULONG Segment
+	);
+
+//
+// Size of a chunk built by BuildSingleCallChunk.
+//
+#define SINGLE_CALL_CHUNK_SIZE	FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, \
+									Transitions[ 2 ] )
+
+/*++
+	Routine Description:
+		Build a trace buffer chunk of client 4/ThreadId holding a 
+		single call to 0x10000 that is entered at Timestamp and 
+		returns one tick later.
+
+	Return Value:
+		Position following the chunk.
+--*/
+PUCHAR BuildSingleCallChunk(
+	__in PUCHAR Position,
+	__in ULONG ThreadId,
+	__in ULONG Timestamp
+	);
+
+/*++
+	Routine Description:
+		Fill the remainder of a segment, starting at Position, 
+		with a pad chunk.
+
+	Return Value:
+		Pad chunk.
+--*/
+PJPTRC_PAD_CHUNK PadSegment(
+	__in PUCHAR Buffer,
+	__in ULONG Segment,
+	__in PUCHAR Position
+	);
+
+/*++
+	Routine Description:
+		Write the buffer obtained from AllocateSegmentedTraceFile to
+		a temporary trace file and free it.
+
+	Parameters:
+		FilePath	- Path of the file created.
+--*/
+VOID WriteSegmentedTraceFile(
+	__out_ecount( MAX_PATH ) PWSTR FilePath,
+	__in PUCHAR Buffer,
+	__in ULONG SegmentCount
+	);
@@ -78,8 +78,127 @@ typedef struct _JPFBT_STATISTICS
 	ULONG EventsCaptured;
 	ULONG ExceptionsUnwindings;
 	ULONG ThreadTeardowns;
+
+	//
+	// Totals over all per-processor buffer pools. Use
+	// JpfbtQueryBufferPoolStatistics for per-pool figures.
+	//
+	struct
+	{
+		ULONG Count;
+		ULONG Depletions;
+		ULONG Steals;
+	} BufferPools;
+
+	//
+	// Buffers added at runtime, see JpfbtSetBufferPoolLimits. 
+	// BufferCount includes the buffers allocated during 
+	// initialization.
+	//
+	struct
+	{
+		ULONG BufferCount;
+		ULONG Count;
+		ULONG Allocated;
+		ULONG Released;
+		ULONG FailedAllocations;
+	} BufferSlabs;
+
+	//
+	// Partially filled buffers handed to the collector after 
+	// PartialBufferTimeout and wakeups of the collector due to
+	// LowWatermark, see JPFBT_BUFFER_POOL_LIMITS.
+	//
+	struct
+	{
+		ULONG PartialBuffersFlushed;
+		ULONG LowWatermarkTriggers;
+	} Collector;
 } JPFBT_STATISTICS, *PJPFBT_STATISTICS;
 
+/*++
+	Structure Description:
+		Statistics of a single per-processor buffer pool.
+
+		Depletions counts how often the pool's free list was found
+		empty, Steals how many buffers were taken from other pools
+		as a consequence.
+--*/
+typedef struct _JPFBT_BUFFER_POOL_STATISTICS
+{
+	ULONG Free;
+	ULONG Depletions;
+	ULONG Steals;
+} JPFBT_BUFFER_POOL_STATISTICS, *PJPFBT_BUFFER_POOL_STATISTICS;
+
+/*++
+	Structure Description:
+		Limits for growing and shrinking the set of buffers at 
+		runtime.
+
+		Whenever less than LowWatermark buffers are free or the
+		free lists have run dry, another slab of SlabBufferCount 
+		buffers is allocated, provided that the total number of 
+		buffers does not exceed MaxBufferCount. 
+
+		Once no such shortage has been observed for 
+		IdleReleaseTimeout milliseconds, the most recently 
+		allocated slab is released. 0 disables releasing slabs.
+
+		The buffers allocated during initialization are never
+		released.
+
+		Regardless of MaxBufferCount, a thread taking a buffer from
+		a per-processor pool that holds less than its share of 
+		LowWatermark (LowWatermark divided by the number of pools)
+		wakes the collector, at most once per collector run. 
+		0 disables the watermark.
+
+		A buffer a thread has been writing to for more than 
+		PartialBufferTimeout milliseconds is handed to the collector
+		even if it is not full yet, so that events of threads
+		that have gone quiet are not held back indefinitely. 
+		0 disables flushing partially filled buffers.
+--*/
+typedef struct _JPFBT_BUFFER_POOL_LIMITS
+{
+	ULONG MaxBufferCount;
+	ULONG SlabBufferCount;
+	ULONG LowWatermark;
+	ULONG IdleReleaseTimeout;
+	ULONG PartialBufferTimeout;
+} JPFBT_BUFFER_POOL_LIMITS, *PJPFBT_BUFFER_POOL_LIMITS;
+
+/*++
+	Structure Description:
+		Call of an instrumented procedure that is active on the
+		current thread, see JpfbtGetActiveCall.
+--*/
+typedef struct _JPFBT_ACTIVE_CALL
+{
+	PVOID Procedure;
+
+	//
+	// Caller continuation address.
+	//
+	ULONG_PTR ReturnAddress;
+
+	//
+	// Timestamp counter (rdtsc) read when the call has been 
+	// entered, right before the entry event routine is called.
+	// 0 unless JPFBT_FLAG_TRACK_ACTIVE_CALLS has been specified.
+	//
+	ULONGLONG EntryTimestamp;
+
+	//
+	// Flags free for use by event routines. Set to 0 when the
+	// call is entered and retained until the call returns. The
+	// pointer is only valid during the current event. NULL unless
+	// JPFBT_FLAG_TRACK_ACTIVE_CALLS has been specified.
+	//
+	PULONG Flags;
+} JPFBT_ACTIVE_CALL, *PJPFBT_ACTIVE_CALL;
+
 /*++
 	Routine Description:
 		Routine called at procedure event/exit.
@@ -154,6 +273,12 @@ typedef VOID ( JPFBTCALLTYPE * JPFBT_PROCESS_BUFFER_ROUTINE ) (
 //
 #define JPFBT_FLAG_DISABLE_EAGER_BUFFER_COLLECTION	4
 
+//
+// Maintain entry timestamp and flags of active calls, see 
+// JpfbtGetActiveCall. Costs a timestamp read per call entry.
+//
+#define JPFBT_FLAG_TRACK_ACTIVE_CALLS		8
+
 /*++
 	Routine Description:
 		Initialize library. Initialization and Unininitialization
@@ -181,6 +306,7 @@ typedef VOID ( JPFBTCALLTYPE * JPFBT_PROCESS_BUFFER_ROUTINE ) (
 					  JPFBT_FLAG_INTERCEPT_EXCEPTIONS
 					  JPFBT_FLAG_DISABLE_LAZY_ALLOCATION
 					  JPFBT_FLAG_DISABLE_EAGER_BUFFER_COLLECTION
+					  JPFBT_FLAG_TRACK_ACTIVE_CALLS
 		EntryEvRt.  - Routine called on entry of hooked function.
 		ExitEvRt.   - Routine called on exit of hooked function.
 		ExcepEvRt.  - Routine called when a traced routine is unwound after
@@ -246,6 +372,13 @@ NTSTATUS JPFBTCALLTYPE JpfbtUninitialize();
 		If no buffer is currently ready for being processed, the 
 		routine blocks until a buffer becomes available.
 
+		Buffers are processed in the order they became ready for
+		processing, regardless of the thread or processor that
+		filled them.
+
+		If buffer pool limits have been set, this routine also
+		grows or shrinks the set of buffers.
+
 		This routine must only be called if JPFBT_FLAG_AUTOCOLLECT
 		has *not* been specified on the call to JpfbtInitialize.
 
@@ -324,6 +457,12 @@ NTSTATUS JpfbtRemoveInstrumentationAllProcedures();
 		Get buffer. For use from within event routines.
 
 		Threadsafe.
+
+		The thread's current buffer is kept from being flushed
+		(see JPFBT_BUFFER_POOL_LIMITS.PartialBufferTimeout) until
+		the event routine returns. Callers outside of event routines
+		must call JpfbtCompleteBuffer once they have finished 
+		writing to the buffer.
 		
 	Parameters:
 		Size in bytes the buffer must provide.
@@ -335,6 +474,40 @@ PUCHAR JPFBTCALLTYPE JpfbtGetBuffer(
 	__in ULONG RequiredSize 
 	);
 
+/*++
+	Routine Description:
+		Signal that the current thread has finished writing to the
+		buffer obtained from JpfbtGetBuffer s.t. it may be flushed.
+		Only required when JpfbtGetBuffer has been called outside of
+		event routines, a no-op otherwise.
+
+		Threadsafe.
+--*/
+VOID JPFBTCALLTYPE JpfbtCompleteBuffer();
+
+/*++
+	Routine Description:
+		Get a call active on the current thread. For use from
+		within event routines.
+
+	Parameters:
+		Depth		- 0 denotes the call the current event is 
+					  reported for, 1 the innermost instrumented
+					  call it has been called from, etc. During
+					  the exit event, the call reported is still 
+					  available at depth 0.
+		Call		- Result.
+
+	Return Value:
+		TRUE on success.
+		FALSE if there are not more than Depth active calls or no
+			event is being reported.
+--*/
+BOOLEAN JPFBTCALLTYPE JpfbtGetActiveCall(
+	__in ULONG Depth,
+	__out PJPFBT_ACTIVE_CALL Call
+	);
+
 /*++
 	Routine Description:
 		Should be called by an application whenever a thread that
@@ -373,3 +546,53 @@ NTSTATUS JpfbtCheckProcedureInstrumentability(
 NTSTATUS JpfbtQueryStatistics(
 	__out PJPFBT_STATISTICS Statistics
 	);
+
+/*++
+	Routine Description:
+		Query statistics of each per-processor buffer pool.
+
+	Parameters:
+		MaxPools	- Capacity of Pools.
+		Pools		- Receives one element per pool.
+		PoolCount	- Receives the number of pools.
+
+	Return Value:
+		STATUS_BUFFER_TOO_SMALL if MaxPools < *PoolCount.
+--*/
+NTSTATUS JpfbtQueryBufferPoolStatistics(
+	__in ULONG MaxPools,
+	__out_ecount_part( MaxPools, *PoolCount ) PJPFBT_BUFFER_POOL_STATISTICS Pools,
+	__out PULONG PoolCount
+	);
+
+/*++
+	Routine Description:
+		Set limits for growing and shrinking the set of buffers.
+		By default, the number of buffers is fixed to the number
+		specified during initialization.
+
+		Slabs are allocated and released by the buffer collector,
+		i.e. during JpfbtProcessBuffers. Lowering MaxBufferCount
+		releases slabs as soon as all their buffers have been
+		processed.
+
+		Partially filled buffers are flushed during 
+		JpfbtProcessBuffers as well. Callers not relying on
+		JPFBT_FLAG_AUTOCOLLECT should thus pass a timeout not
+		exceeding PartialBufferTimeout.
+
+		Callable at PASSIVE_LEVEL. Routine is threadsafe.
+
+	Parameters:
+		Limits		- New limits. A MaxBufferCount not exceeding
+					  the initial number of buffers disables
+					  growth.
+
+	Return Value:
+		STATUS_SUCCESS on success.
+		STATUS_INVALID_PARAMETER if growth is enabled but 
+			SlabBufferCount is 0 or too large.
+--*/
+NTSTATUS JpfbtSetBufferPoolLimits(
+	__in PJPFBT_BUFFER_POOL_LIMITS Limits
+	);
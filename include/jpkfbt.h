@@ -18,6 +18,26 @@
 
 typedef PVOID JPKFBT_SESSION;
 
+/*++
+	Structure Description:
+		Symbol of an instrumented procedure, see JpkfbtRecordSymbols.
+--*/
+typedef struct _JPKFBT_SYMBOL
+{
+	JPFBT_PROCEDURE Procedure;
+
+	//
+	// Load address of the module containing the procedure.
+	//
+	ULONGLONG ModuleBase;
+
+	//
+	// Null-terminated name of the procedure, not including the 
+	// module name.
+	//
+	PCSTR Name;
+} JPKFBT_SYMBOL, *PJPKFBT_SYMBOL;
+
 /*++
 	Routine Description:
 		Attach to the kernel running process by loading the 
@@ -88,6 +108,31 @@ NTSTATUS JpkfbtInitializeTracing(
 	__in_opt PCWSTR LogFilePath
 	);
 
+/*++
+	Routine Description:
+		Initialize tracing subsystem. See JpkfbtInitializeTracing.
+
+		By specifying JPKFBT_LOG_FLAG_CIRCULAR, the log file is
+		used as a ring buffer of fixed size, s.t. tracing can be 
+		left enabled indefinitely.
+
+		By specifying JPKFBT_LOG_FLAG_FILTER_DURATION, only calls
+		exceeding a threshold are recorded.
+
+	Parameters:
+		LogOptions	- Options for writing the log file. NULL to 
+					  use defaults. Must be NULL for 
+					  JpkfbtTracingTypeWmk.
+--*/
+NTSTATUS JpkfbtInitializeTracingEx(
+	__in JPKFBT_SESSION SessionHandle,
+	__in JPKFBT_TRACING_TYPE Type,
+	__in ULONG BufferCount,
+	__in ULONG BufferSize,
+	__in_opt PCWSTR LogFilePath,
+	__in_opt PJPKFBT_LOG_OPTIONS LogOptions
+	);
+
 /*++
 	Routine Description:
 		Shutdown tracing subsystem.
@@ -164,4 +209,86 @@ NTSTATUS JpkfbtCheckProcedureInstrumentability(
 NTSTATUS JpkfbtQueryStatistics(
 	__in JPKFBT_SESSION SessionHandle,
 	__out PJPKFBT_STATISTICS Statistics 
+	);
+
+/*++
+	Routine Description:
+		Record the symbols of instrumented procedures in the trace
+		file s.t. the trace can be symbolized without access to 
+		the images or their debug symbols. Symbols should be 
+		recorded once per procedure, after the procedure has been 
+		instrumented.
+
+		Routine is threadsafe.
+
+	Parameters:
+		Session			- Handle obtained by JpkfbtAttach.
+		SymbolCount		- # of symbols.
+		Symbols			- Symbols to record.
+
+	Return Value:
+		STATUS_SUCCESS on success
+		STATUS_NOT_SUPPORTED for JpkfbtTracingTypeWmk.
+		(any NTSTATUS) on failure.
+--*/
+NTSTATUS JpkfbtRecordSymbols(
+	__in JPKFBT_SESSION SessionHandle,
+	__in ULONG SymbolCount,
+	__in_ecount( SymbolCount ) CONST JPKFBT_SYMBOL *Symbols
+	);
+
+/*++
+	Routine Description:
+		Let the set of buffers grow under load and shrink once
+		idle, and bound the time events may remain in partially
+		filled buffers. See JpfbtSetBufferPoolLimits.
+
+		Tracing must have been initialized.
+
+	Parameters:
+		Session			- Handle obtained by JpkfbtAttach.
+		Limits			- New limits.
+
+	Return Value:
+		STATUS_SUCCESS on success
+		(any NTSTATUS) on failure.
+--*/
+NTSTATUS JpkfbtSetBufferPoolLimits(
+	__in JPKFBT_SESSION SessionHandle,
+	__in PJPFBT_BUFFER_POOL_LIMITS Limits
+	);
+
+/*++
+	Routine Description:
+		Replace the procedure-specific thresholds used in filtered
+		mode, see JPKFBT_LOG_FLAG_FILTER_DURATION. Procedures not
+		listed are subject to JPKFBT_LOG_OPTIONS.DurationThreshold.
+
+		While procedure-specific thresholds are set, all callers of
+		a call recorded are recorded as well, as if 
+		JPKFBT_LOG_FLAG_KEEP_ANCESTORS had been specified - otherwise,
+		a caller with a higher threshold than its callee could be 
+		skipped before it turns out to be slow, and would then be lost.
+
+		Tracing must have been initialized in filtered mode.
+
+		Routine is threadsafe.
+
+	Parameters:
+		Session			- Handle obtained by JpkfbtAttach.
+		ThresholdCount	- # of thresholds, 0 to remove all 
+						  procedure-specific thresholds. Must not
+						  exceed JPKFBT_MAX_PROCEDURE_THRESHOLDS.
+		Thresholds		- Thresholds.
+
+	Return Value:
+		STATUS_SUCCESS on success
+		STATUS_NOT_SUPPORTED if tracing has not been initialized
+			in filtered mode.
+		(any NTSTATUS) on failure.
+--*/
+NTSTATUS JpkfbtSetProcedureThresholds(
+	__in JPKFBT_SESSION SessionHandle,
+	__in ULONG ThresholdCount,
+	__in_ecount( ThresholdCount ) CONST JPKFBT_PROCEDURE_THRESHOLD *Thresholds
 	);
\ No newline at end of file
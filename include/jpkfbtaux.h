@@ -25,6 +25,105 @@ typedef enum _JPKFBT_TRACING_TYPE
 	JpkfbtTracingTypeMax = 1
 } JPKFBT_TRACING_TYPE;
 
+/*++
+	Structure Description:
+		Options for writing the trace file. Zero-initialized
+		members denote default values.
+
+		Does not apply to JpkfbtTracingTypeWmk.
+--*/
+typedef struct _JPKFBT_LOG_OPTIONS
+{
+	//
+	// Interval, in milliseconds, in which staged trace data is
+	// written and file buffers are flushed.
+	//
+	ULONG FlushInterval;
+
+	//
+	// Combination of JPKFBT_LOG_FLAG_* flags.
+	//
+	ULONG Flags;
+
+	//
+	// Size of the log file, in MB. For JPKFBT_LOG_FLAG_CIRCULAR, the
+	// file is preallocated to this size. Otherwise, the log file is 
+	// rotated once it has grown beyond this size (0: unlimited).
+	//
+	ULONG MaximumFileSize;
+
+	//
+	// Interval, in seconds, after which the log file is rotated 
+	// (0: never). Must be 0 for JPKFBT_LOG_FLAG_CIRCULAR.
+	//
+	// When rotating, tracing continues in a new file located in the 
+	// same directory. The files are named after the original log file,
+	// with a sequence number inserted in front of the extension, e.g.
+	// trace.jtrc, trace.0001.jtrc, trace.0002.jtrc, etc.
+	//
+	ULONG RotationInterval;
+
+	//
+	// Calls returning in less than DurationThreshold microseconds
+	// are not recorded. Only applies to JPKFBT_LOG_FLAG_FILTER_DURATION,
+	// must be 0 otherwise. See JpkfbtSetProcedureThresholds.
+	//
+	ULONG DurationThreshold;
+} JPKFBT_LOG_OPTIONS, *PJPKFBT_LOG_OPTIONS;
+
+//
+// Flight recorder mode: The log file is preallocated to 
+// MaximumFileSize MB and used as a ring buffer, i.e. once the file
+// is full, the oldest trace data is overwritten.
+//
+#define JPKFBT_LOG_FLAG_CIRCULAR				1
+
+//
+// Filtered mode: Calls are only recorded once they return, and only
+// if they have taken at least DurationThreshold microseconds. A call
+// recorded appears as an entry immediately followed by its exit, 
+// unless it contains calls recorded: A caller that has exceeded its 
+// threshold by the time a call it contains is recorded has its entry
+// recorded at that time, so transitions remain in timestamp order.
+// A caller that has not exceeded its threshold by then is not 
+// recorded.
+//
+#define JPKFBT_LOG_FLAG_FILTER_DURATION			2
+
+//
+// In filtered mode, retain all instrumented callers of each call
+// recorded, regardless of their duration, s.t. the trace reflects 
+// the call hierarchy.
+//
+// Implied once procedure-specific thresholds have been set: A caller
+// whose threshold exceeds that of a call it contains may not have 
+// exceeded its threshold yet when the call is recorded, and skipping
+// it would lose it if it exceeds its threshold later. Calls lost 
+// nevertheless, e.g. because their entry could not be buffered, are
+// counted in JPKFBT_STATISTICS.Tracing.FilteredCallsLost.
+//
+#define JPKFBT_LOG_FLAG_KEEP_ANCESTORS			4
+
+#define JPKFBT_LOG_MIN_CIRCULAR_FILE_SIZE		8
+
+/*++
+	Structure Description:
+		Procedure-specific threshold for filtered mode, see
+		JPKFBT_LOG_FLAG_FILTER_DURATION.
+--*/
+typedef struct _JPKFBT_PROCEDURE_THRESHOLD
+{
+	JPFBT_PROCEDURE Procedure;
+
+	//
+	// Threshold in microseconds, overrides 
+	// JPKFBT_LOG_OPTIONS.DurationThreshold. 0 records all calls.
+	//
+	ULONG DurationThreshold;
+} JPKFBT_PROCEDURE_THRESHOLD, *PJPKFBT_PROCEDURE_THRESHOLD;
+
+#define JPKFBT_MAX_PROCEDURE_THRESHOLDS			65536
+
 typedef struct _JPKFBT_STATISTICS
 {
 	ULONG InstrumentedRoutinesCount;
@@ -52,9 +151,34 @@ typedef struct _JPKFBT_STATISTICS
 		ULONG UnwindEventsDropped;
 		ULONG ImageInfoEventsDropped;
 		ULONG FailedChunkFlushes;
+
+		//
+		// Filtered mode: Calls that exceeded their threshold but
+		// could not be recorded because their entry had been 
+		// skipped, see JPKFBT_LOG_FLAG_KEEP_ANCESTORS.
+		//
+		ULONG FilteredCallsLost;
 	} Tracing;
 
 	ULONG EventsCaptured;
 	ULONG ExceptionsUnwindings;
 	ULONG ThreadTeardowns;
+
+	//
+	// See JpkfbtSetBufferPoolLimits.
+	//
+	struct
+	{
+		ULONG BufferCount;
+		ULONG Count;
+		ULONG Allocated;
+		ULONG Released;
+		ULONG FailedAllocations;
+	} BufferSlabs;
+
+	struct
+	{
+		ULONG PartialBuffersFlushed;
+		ULONG LowWatermarkTriggers;
+	} Collector;
 } JPKFBT_STATISTICS, *PJPKFBT_STATISTICS;
\ No newline at end of file
@@ -0,0 +1,478 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Encoding and decoding of JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT
+ *		chunks. See jptrcfmt.h for a description of the format.
+ *
+ *		The routines neither allocate memory nor depend on any runtime
+ *		library routines and can thus be used both in kernel and
+ *		user mode.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#include <jptrcfmt.h>
+
+#define JPTRCCMP_MAX_VARINT_SIZE		10
+#define JPTRCCMP_TIMESTAMP_MASK			\
+	( ( ( ULONGLONG ) 0x0FFFFFFF << 32 ) | 0xFFFFFFFF )
+
+typedef struct _JPTRCCMP_SLOT
+{
+	ULONG Procedure;
+	USHORT Index;
+
+	//
+	// Slot is occupied iff Generation == JPTRCCMP_ENCODER::Generation.
+	//
+	USHORT Generation;
+} JPTRCCMP_SLOT, *PJPTRCCMP_SLOT;
+
+/*++
+	Structure Description:
+		Encoder state. All memory is provided by the caller, the
+		encoder itself never allocates memory.
+
+		The structure must be zero-initialized before the scratch
+		members are assigned. A single encoder must not be used
+		concurrently.
+--*/
+typedef struct _JPTRCCMP_ENCODER
+{
+	//
+	// Scratch hashtable mapping procedures to dictionary indexes.
+	// SlotCount must be a power of 2 and greater than
+	// DictionaryCapacity.
+	//
+	ULONG SlotCount;
+	PJPTRCCMP_SLOT Slots;
+
+	//
+	// Scratch dictionary, holds up to DictionaryCapacity (<= MAXUSHORT)
+	// entries. Encoding a chunk referring to more procedures fails.
+	//
+	ULONG DictionaryCapacity;
+	PULONG Dictionary;
+
+	USHORT Generation;
+} JPTRCCMP_ENCODER, *PJPTRCCMP_ENCODER;
+
+/*----------------------------------------------------------------------
+ *
+ * Helpers.
+ *
+ */
+
+static __inline ULONGLONG JptrccmpZigZag64(
+	__in LONGLONG Value
+	)
+{
+	return ( ( ULONGLONG ) Value << 1 ) ^ ( ULONGLONG ) ( Value >> 63 );
+}
+
+static __inline LONGLONG JptrccmpUnZigZag64(
+	__in ULONGLONG Value
+	)
+{
+	return ( LONGLONG ) ( ( Value >> 1 ) ^ ( 0 - ( Value & 1 ) ) );
+}
+
+static __inline ULONG JptrccmpZigZag32(
+	__in LONG Value
+	)
+{
+	return ( ( ULONG ) Value << 1 ) ^ ( ULONG ) ( Value >> 31 );
+}
+
+static __inline LONG JptrccmpUnZigZag32(
+	__in ULONG Value
+	)
+{
+	return ( LONG ) ( ( Value >> 1 ) ^ ( 0 - ( Value & 1 ) ) );
+}
+
+static __inline BOOLEAN JptrccmpWriteVarint(
+	__inout PUCHAR *Cursor,
+	__in PUCHAR Limit,
+	__in ULONGLONG Value
+	)
+{
+	PUCHAR Ptr = *Cursor;
+
+	while ( Value >= 0x80 )
+	{
+		if ( Ptr >= Limit )
+		{
+			return FALSE;
+		}
+
+		*Ptr++	= ( UCHAR ) ( Value | 0x80 );
+		Value	>>= 7;
+	}
+
+	if ( Ptr >= Limit )
+	{
+		return FALSE;
+	}
+
+	*Ptr++ = ( UCHAR ) Value;
+	*Cursor = Ptr;
+	return TRUE;
+}
+
+static __inline BOOLEAN JptrccmpReadVarint(
+	__inout PUCHAR *Cursor,
+	__in PUCHAR Limit,
+	__out ULONGLONG *Value
+	)
+{
+	PUCHAR Ptr = *Cursor;
+	ULONG Shift = 0;
+	ULONGLONG Result = 0;
+
+	for ( ;; )
+	{
+		UCHAR Byte;
+
+		if ( Ptr >= Limit || Shift >= 7 * JPTRCCMP_MAX_VARINT_SIZE )
+		{
+			return FALSE;
+		}
+
+		Byte	= *Ptr++;
+		Result	|= ( ( ULONGLONG ) ( Byte & 0x7f ) ) << Shift;
+		Shift	+= 7;
+
+		if ( ( Byte & 0x80 ) == 0 )
+		{
+			break;
+		}
+	}
+
+	*Value	= Result;
+	*Cursor	= Ptr;
+	return TRUE;
+}
+
+/*++
+	Routine Description:
+		Look up the dictionary index of a procedure, adding the
+		procedure to the dictionary if necessary.
+
+	Return Value:
+		FALSE if the dictionary is full.
+--*/
+static __inline BOOLEAN JptrccmpLookupProcedure(
+	__in PJPTRCCMP_ENCODER Encoder,
+	__in ULONG Procedure,
+	__inout PULONG ProcedureCount,
+	__out PUSHORT Index
+	)
+{
+	ULONG Slot;
+
+	//
+	// Fibonacci hashing - procedures are at least 16 byte aligned,
+	// so the low bits carry little information.
+	//
+	Slot = ( ( Procedure >> 4 ) * 0x9E3779B1 ) & ( Encoder->SlotCount - 1 );
+
+	for ( ;; )
+	{
+		PJPTRCCMP_SLOT Entry = &Encoder->Slots[ Slot ];
+
+		if ( Entry->Generation != Encoder->Generation )
+		{
+			//
+			// Free slot - procedure not yet in dictionary.
+			//
+			if ( *ProcedureCount >= Encoder->DictionaryCapacity )
+			{
+				return FALSE;
+			}
+
+			Entry->Procedure	= Procedure;
+			Entry->Index		= ( USHORT ) *ProcedureCount;
+			Entry->Generation	= Encoder->Generation;
+
+			Encoder->Dictionary[ *ProcedureCount ] = Procedure;
+			( *ProcedureCount )++;
+
+			*Index = Entry->Index;
+			return TRUE;
+		}
+		else if ( Entry->Procedure == Procedure )
+		{
+			*Index = Entry->Index;
+			return TRUE;
+		}
+
+		Slot = ( Slot + 1 ) & ( Encoder->SlotCount - 1 );
+	}
+}
+
+/*----------------------------------------------------------------------
+ *
+ * Encoding/Decoding.
+ *
+ */
+
+/*++
+	Routine Description:
+		Encode a sequence of transitions into a compact chunk.
+
+		The caller is responsible for initializing Chunk->Client.
+		All other members are initialized by this routine.
+
+	Parameters:
+		Encoder			- Encoder, see JPTRCCMP_ENCODER.
+		TransitionCount	- Number of transitions.
+		Transitions		- Transitions to encode.
+		ChunkCapacity	- Size of buffer pointed to by Chunk. Must be
+						  large enough to hold the dictionary at
+						  maximum capacity, i.e. at least
+						  FIELD_OFFSET( JPTRC_COMPACT_TRACE_BUFFER_CHUNK32,
+							Procedures[ DictionaryCapacity ] ).
+		Chunk			- Resulting chunk. Chunk->Header.Size is
+						  JPTRC_CHUNK_ALIGNMENT-aligned.
+
+	Return Value:
+		TRUE on success.
+		FALSE if the encoded chunk does not fit into ChunkCapacity
+		or the dictionary capacity has been exceeded. The caller
+		should fall back to using an uncompressed chunk in this case.
+--*/
+static __inline BOOLEAN JptrccmpEncodeTransitions(
+	__in PJPTRCCMP_ENCODER Encoder,
+	__in ULONG TransitionCount,
+	__in_ecount( TransitionCount )
+		CONST JPTRC_PROCEDURE_TRANSITION32 *Transitions,
+	__in ULONG ChunkCapacity,
+	__out_bcount( ChunkCapacity ) PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32 Chunk
+	)
+{
+	ULONG Index;
+	ULONGLONG PreviousTimestamp;
+	ULONG ProcedureCount = 0;
+	PUCHAR Stream;
+	PUCHAR StreamCursor;
+	PUCHAR StreamLimit;
+	ULONG StreamSize;
+	ULONG TotalSize;
+
+	if ( TransitionCount == 0 ||
+		 Encoder->DictionaryCapacity > MAXUSHORT ||
+		 Encoder->SlotCount <= Encoder->DictionaryCapacity ||
+		 ( Encoder->SlotCount & ( Encoder->SlotCount - 1 ) ) != 0 ||
+		 ChunkCapacity < ( ULONG ) FIELD_OFFSET(
+			JPTRC_COMPACT_TRACE_BUFFER_CHUNK32,
+			Procedures[ Encoder->DictionaryCapacity ] ) )
+	{
+		return FALSE;
+	}
+
+	//
+	// Invalidate all slots by advancing the generation. Only when
+	// the generation wraps, the table has to be cleared.
+	//
+	Encoder->Generation++;
+	if ( Encoder->Generation == 0 )
+	{
+		RtlZeroMemory(
+			Encoder->Slots,
+			Encoder->SlotCount * sizeof( JPTRCCMP_SLOT ) );
+		Encoder->Generation = 1;
+	}
+
+	//
+	// The size of the dictionary is not known in advance. Therefore,
+	// encode the stream behind the dictionary at maximum capacity
+	// and move it down afterwards.
+	//
+	Stream = ( PUCHAR ) &Chunk->Procedures[ Encoder->DictionaryCapacity ];
+	StreamCursor = Stream;
+	StreamLimit = ( PUCHAR ) Chunk + ChunkCapacity;
+
+	PreviousTimestamp = Transitions[ 0 ].Timestamp;
+
+	for ( Index = 0; Index < TransitionCount; Index++ )
+	{
+		CONST JPTRC_PROCEDURE_TRANSITION32 *Transition = &Transitions[ Index ];
+		USHORT ProcedureIndex;
+		ULONGLONG Info;
+
+		if ( ! JptrccmpLookupProcedure(
+			Encoder,
+			Transition->Procedure,
+			&ProcedureCount,
+			&ProcedureIndex ) )
+		{
+			return FALSE;
+		}
+
+		if ( Transition->Type == JPTRC_PROCEDURE_TRANSITION_ENTRY )
+		{
+			Info = JptrccmpZigZag32( ( LONG )
+				( Transition->Info.CallerIp - Transition->Procedure ) );
+		}
+		else
+		{
+			Info = Transition->Info.ReturnValue;
+		}
+
+		if ( ! JptrccmpWriteVarint(
+				&StreamCursor,
+				StreamLimit,
+				( JptrccmpZigZag64( ( LONGLONG )
+					( ( ULONGLONG ) Transition->Timestamp - PreviousTimestamp ) ) << 2 ) |
+					Transition->Type ) ||
+			 ! JptrccmpWriteVarint(
+				&StreamCursor,
+				StreamLimit,
+				ProcedureIndex ) ||
+			 ! JptrccmpWriteVarint(
+				&StreamCursor,
+				StreamLimit,
+				Info ) )
+		{
+			return FALSE;
+		}
+
+		PreviousTimestamp = Transition->Timestamp;
+	}
+
+	StreamSize = ( ULONG ) ( StreamCursor - Stream );
+	TotalSize = ( ULONG ) FIELD_OFFSET(
+		JPTRC_COMPACT_TRACE_BUFFER_CHUNK32,
+		Procedures[ ProcedureCount ] ) + StreamSize;
+	TotalSize = ( TotalSize + ( JPTRC_CHUNK_ALIGNMENT - 1 ) ) &
+		~( JPTRC_CHUNK_ALIGNMENT - 1 );
+
+	if ( TotalSize > ChunkCapacity )
+	{
+		return FALSE;
+	}
+
+	//
+	// Assemble chunk: dictionary, followed by stream and padding.
+	//
+	RtlCopyMemory(
+		Chunk->Procedures,
+		Encoder->Dictionary,
+		ProcedureCount * sizeof( ULONG ) );
+	RtlMoveMemory(
+		&Chunk->Procedures[ ProcedureCount ],
+		Stream,
+		StreamSize );
+	RtlZeroMemory(
+		( PUCHAR ) &Chunk->Procedures[ ProcedureCount ] + StreamSize,
+		TotalSize - FIELD_OFFSET(
+			JPTRC_COMPACT_TRACE_BUFFER_CHUNK32,
+			Procedures[ ProcedureCount ] ) - StreamSize );
+
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT;
+	Chunk->Header.Reserved	= 0;
+	Chunk->Header.Size		= TotalSize;
+	Chunk->TransitionCount	= TransitionCount;
+	Chunk->ProcedureCount	= ( USHORT ) ProcedureCount;
+	Chunk->Reserved			= 0;
+	Chunk->BaseTimestamp	= Transitions[ 0 ].Timestamp;
+
+	return TRUE;
+}
+
+/*++
+	Routine Description:
+		Decode a compact chunk. The chunk is fully validated, so
+		it may stem from an untrusted file.
+
+	Parameters:
+		Chunk				- Chunk, Chunk->Header.Size bytes must
+							  be readable.
+		TransitionCapacity	- Capacity of Transitions array. Must be
+							  at least Chunk->TransitionCount.
+		Transitions			- Decoded transitions.
+
+	Return Value:
+		TRUE on success.
+		FALSE if chunk is malformed or Transitions is too small.
+--*/
+static __inline BOOLEAN JptrccmpDecodeTransitions(
+	__in CONST JPTRC_COMPACT_TRACE_BUFFER_CHUNK32 *Chunk,
+	__in ULONG TransitionCapacity,
+	__out_ecount( TransitionCapacity )
+		PJPTRC_PROCEDURE_TRANSITION32 Transitions
+	)
+{
+	ULONG Index;
+	ULONGLONG Timestamp;
+	PUCHAR StreamCursor;
+	PUCHAR StreamLimit;
+
+	if ( Chunk->Header.Type != JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT ||
+		 Chunk->Reserved != 0 ||
+		 Chunk->TransitionCount > TransitionCapacity ||
+		 Chunk->BaseTimestamp > JPTRCCMP_TIMESTAMP_MASK ||
+		 Chunk->Header.Size < ( ULONG ) FIELD_OFFSET(
+			JPTRC_COMPACT_TRACE_BUFFER_CHUNK32,
+			Procedures[ Chunk->ProcedureCount ] ) )
+	{
+		return FALSE;
+	}
+
+	StreamCursor	= ( PUCHAR ) &Chunk->Procedures[ Chunk->ProcedureCount ];
+	StreamLimit		= ( PUCHAR ) Chunk + Chunk->Header.Size;
+	Timestamp		= Chunk->BaseTimestamp;
+
+	for ( Index = 0; Index < Chunk->TransitionCount; Index++ )
+	{
+		ULONGLONG TypeAndDelta;
+		ULONGLONG ProcedureIndex;
+		ULONGLONG Info;
+		ULONG Type;
+
+		if ( ! JptrccmpReadVarint( &StreamCursor, StreamLimit, &TypeAndDelta ) ||
+			 ! JptrccmpReadVarint( &StreamCursor, StreamLimit, &ProcedureIndex ) ||
+			 ! JptrccmpReadVarint( &StreamCursor, StreamLimit, &Info ) )
+		{
+			return FALSE;
+		}
+
+		Type		= ( ULONG ) ( TypeAndDelta & 3 );
+		Timestamp	+= ( ULONGLONG ) JptrccmpUnZigZag64( TypeAndDelta >> 2 );
+
+		if ( Type > JPTRC_PROCEDURE_TRANSITION_UNWIND ||
+			 ProcedureIndex >= Chunk->ProcedureCount ||
+			 Info > MAXULONG ||
+			 Timestamp > JPTRCCMP_TIMESTAMP_MASK )
+		{
+			return FALSE;
+		}
+
+		Transitions[ Index ].Type		= Type;
+		Transitions[ Index ].__Unused	= 0;
+		Transitions[ Index ].Timestamp	= Timestamp;
+		Transitions[ Index ].Procedure	=
+			Chunk->Procedures[ ( ULONG ) ProcedureIndex ];
+
+		if ( Type == JPTRC_PROCEDURE_TRANSITION_ENTRY )
+		{
+			Transitions[ Index ].Info.CallerIp =
+				Transitions[ Index ].Procedure +
+				( ULONG ) JptrccmpUnZigZag32( ( ULONG ) Info );
+		}
+		else
+		{
+			Transitions[ Index ].Info.ReturnValue = ( ULONG ) Info;
+		}
+	}
+
+	//
+	// Only padding may follow.
+	//
+	return ( StreamLimit - StreamCursor ) < JPTRC_CHUNK_ALIGNMENT
+		? TRUE
+		: FALSE;
+}
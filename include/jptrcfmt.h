@@ -28,6 +28,8 @@
  *		Johannes Passing (johannes.passing@googlemail.com)
  */
 
+#include <jptrcport.h>
+
 #pragma pack( push, 4 )
 #pragma warning( push )
 #pragma warning( disable: 4214 ) // ULONGLONG Bitfields
@@ -51,6 +53,11 @@
 #define JPTRC_CHARACTERISTIC_32BIT					4
 #define JPTRC_CHARACTERISTIC_64BIT					8
 
+//
+// File is used as a ring buffer, see JPTRC_CIRCULAR_HEADER_CHUNK.
+//
+#define JPTRC_CHARACTERISTIC_CIRCULAR				16
+
 /*++
 	Structure Description:
 		Header of the file. Implementations must verify the values
@@ -88,6 +95,14 @@ typedef struct _JPTRC_CHUNK_HEADER
 #define JPTRC_CHUNK_TYPE_PAD			0
 #define JPTRC_CHUNK_TYPE_IMAGE_INFO		1
 #define JPTRC_CHUNK_TYPE_TRACE_BUFFER	2
+#define JPTRC_CHUNK_TYPE_TRACE_BUFFER_COMPACT	3
+#define JPTRC_CHUNK_TYPE_INDEX			4
+#define JPTRC_CHUNK_TYPE_INDEX_TRAILER	5
+#define JPTRC_CHUNK_TYPE_CIRCULAR_HEADER	6
+#define JPTRC_CHUNK_TYPE_SEGMENT_HEADER	7
+#define JPTRC_CHUNK_TYPE_CONTINUATION	8
+#define JPTRC_CHUNK_TYPE_SYMBOL_TABLE	9
+#define JPTRC_CHUNK_TYPE_CALIBRATION	10
 
 #define JPTRC_PROCEDURE_TRANSITION_ENTRY				0
 #define JPTRC_PROCEDURE_TRANSITION_EXIT					1
@@ -154,6 +169,66 @@ typedef struct _JPTRC_TRACE_BUFFER_CHUNK32
 	JPTRC_PROCEDURE_TRANSITION32 Transitions[ ANYSIZE_ARRAY ];
 } JPTRC_TRACE_BUFFER_CHUNK32, *PJPTRC_TRACE_BUFFER_CHUNK32;
 
+/*++
+	Structure Description:
+		Compact, delta-encoded equivalent of JPTRC_TRACE_BUFFER_CHUNK32.
+		The structure is of variable length and structured as follows:
+
+		+-----------------------------------------+
+		| JPTRC_COMPACT_TRACE_BUFFER_CHUNK32      |
+		| members                                 |
+		+-----------------------------------------+
+		| Procedure dictionary                    |
+		| (ProcedureCount ULONGs)                 |
+		+-----------------------------------------+
+		| Encoded transitions                     |
+		| (TransitionCount records)               |
+		+-[JPTRC_CHUNK_ALIGNMENT aligned]---------+
+
+		Each transition is encoded as a sequence of 3 LEB128-style
+		varints (7 bits per byte, least significant group first, high
+		bit set on all but the last byte):
+
+		 1) ( ZigZag( TimestampDelta ) << 2 ) | Type, where
+			TimestampDelta is relative to the previous transition's
+			timestamp or BaseTimestamp for the first transition.
+		 2) Index into the procedure dictionary.
+		 3) Info - for ENTRY transitions, ZigZag( CallerIp - Procedure ),
+			for EXIT and UNWIND transitions, the raw Info value.
+
+		ZigZag( x ) maps signed to unsigned values: 
+		( x << 1 ) ^ ( x >> 63 ).
+
+		Client must be at the same offset as in 
+		JPTRC_TRACE_BUFFER_CHUNK32.
+--*/
+typedef struct _JPTRC_COMPACT_TRACE_BUFFER_CHUNK32
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	struct
+	{
+		ULONG ProcessId;
+		ULONG ThreadId;
+	} Client;
+
+	ULONG TransitionCount;
+
+	USHORT ProcedureCount;
+
+	//
+	// Unused, must be 0.
+	//
+	USHORT Reserved;
+
+	ULONGLONG BaseTimestamp;
+
+	ULONG Procedures[ ANYSIZE_ARRAY ];
+} JPTRC_COMPACT_TRACE_BUFFER_CHUNK32, *PJPTRC_COMPACT_TRACE_BUFFER_CHUNK32;
+
+C_ASSERT( FIELD_OFFSET( JPTRC_COMPACT_TRACE_BUFFER_CHUNK32, Client ) ==
+		  FIELD_OFFSET( JPTRC_TRACE_BUFFER_CHUNK32, Client ) );
+
 /*++
 	Structure Description:
 		Information about a module that has been involved in
@@ -210,5 +285,368 @@ typedef struct _JPTRC_PAD_CHUNK
 	JPTRC_CHUNK_HEADER Header;
 } JPTRC_PAD_CHUNK, *PJPTRC_PAD_CHUNK;
 
+/*++
+	Structure Description:
+		Timestamp range of all trace buffer chunks located in a 
+		segment.
+--*/
+typedef struct _JPTRC_INDEX_SEGMENT
+{
+	//
+	// File offset of segment, a multiple of JPTRC_SEGMENT_SIZE.
+	//
+	ULONGLONG Offset;
+
+	ULONGLONG MinTimestamp;
+	ULONGLONG MaxTimestamp;
+} JPTRC_INDEX_SEGMENT, *PJPTRC_INDEX_SEGMENT;
+
+/*++
+	Structure Description:
+		Trace buffer chunks of a client, given as a range of 
+		the chunk offset array of the enclosing index chunk.
+--*/
+typedef struct _JPTRC_INDEX_CLIENT
+{
+	ULONG ProcessId;
+	ULONG ThreadId;
+	ULONG FirstChunk;
+	ULONG ChunkCount;
+} JPTRC_INDEX_CLIENT, *PJPTRC_INDEX_CLIENT;
+
+/*++
+	Structure Description:
+		Index of all chunks located in the range 
+		[StartOffset, EndOffset). Index chunks are written 
+		periodically and form a backward chain via 
+		PreviousIndexOffset; the ranges of subsequent index chunks
+		are contiguous except for the index chunks themselves 
+		(and padding preceding them).
+
+		The structure is of variable length and structured as 
+		follows:
+
+		+-----------------------------------------+
+		| JPTRC_INDEX_CHUNK members               |
+		+-----------------------------------------+
+		| ULONGLONG ImageInfoOffsets[]            |
+		| (ImageInfoCount entries, image info,    |
+		| symbol table and calibration chunks)    |
+		+-----------------------------------------+
+		| JPTRC_INDEX_SEGMENT Segments[]          |
+		| (SegmentCount entries)                  |
+		+-----------------------------------------+
+		| JPTRC_INDEX_CLIENT Clients[]            |
+		| (ClientCount entries)                   |
+		+-----------------------------------------+
+		| ULONGLONG ChunkOffsets[]                |
+		| (ChunkCount entries, grouped by client, |
+		| in file order)                          |
+		+-----------------------------------------+
+
+		Pad chunks, index chunks and trailer chunks are not indexed.
+--*/
+typedef struct _JPTRC_INDEX_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	//
+	// File offset of preceding index chunk, 0 for the first one.
+	//
+	ULONGLONG PreviousIndexOffset;
+
+	ULONGLONG StartOffset;
+	ULONGLONG EndOffset;
+
+	ULONG ImageInfoCount;
+	ULONG SegmentCount;
+	ULONG ClientCount;
+	ULONG ChunkCount;
+
+	ULONGLONG Data[ ANYSIZE_ARRAY ];
+} JPTRC_INDEX_CHUNK, *PJPTRC_INDEX_CHUNK;
+
+#define JPTRC_INDEX_IMAGE_INFO_OFFSETS( Chunk )						\
+	( ( PULONGLONG ) ( Chunk )->Data )
+#define JPTRC_INDEX_SEGMENTS( Chunk )								\
+	( ( PJPTRC_INDEX_SEGMENT ) ( JPTRC_INDEX_IMAGE_INFO_OFFSETS( Chunk ) +	\
+		( Chunk )->ImageInfoCount ) )
+#define JPTRC_INDEX_CLIENTS( Chunk )								\
+	( ( PJPTRC_INDEX_CLIENT ) ( JPTRC_INDEX_SEGMENTS( Chunk ) +		\
+		( Chunk )->SegmentCount ) )
+#define JPTRC_INDEX_CHUNK_OFFSETS( Chunk )							\
+	( ( PULONGLONG ) ( JPTRC_INDEX_CLIENTS( Chunk ) +				\
+		( Chunk )->ClientCount ) )
+
+/*++
+	Routine Description:
+		Calculate the size required by an index chunk.
+--*/
+#define JPTRC_INDEX_CHUNK_SIZE( Images, Segments, Clients, Chunks )	\
+	( FIELD_OFFSET( JPTRC_INDEX_CHUNK, Data ) +						\
+	  ( Images ) * sizeof( ULONGLONG ) +							\
+	  ( Segments ) * sizeof( JPTRC_INDEX_SEGMENT ) +				\
+	  ( Clients ) * sizeof( JPTRC_INDEX_CLIENT ) +					\
+	  ( Chunks ) * sizeof( ULONGLONG ) )
+
+/*++
+	Structure Description:
+		Last chunk of a completely written file. Because of its
+		fixed size, it can be located by readers without scanning
+		the file. Files lacking a trailer (e.g. because they are
+		still being written or have been truncated) have to be
+		scanned.
+--*/
+typedef struct _JPTRC_INDEX_TRAILER_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	//
+	// File offset of last index chunk.
+	//
+	ULONGLONG LastIndexOffset;
+} JPTRC_INDEX_TRAILER_CHUNK, *PJPTRC_INDEX_TRAILER_CHUNK;
+
+C_ASSERT( ( sizeof( JPTRC_INDEX_TRAILER_CHUNK ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+C_ASSERT( ( FIELD_OFFSET( JPTRC_INDEX_CHUNK, Data ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+
+/*++
+	Structure Description:
+		Header of a file having the JPTRC_CHARACTERISTIC_CIRCULAR
+		characteristic. Such a file has a fixed size, a multiple of
+		JPTRC_SEGMENT_SIZE, and is structured as follows:
+
+		+-----------------------------------------+
+		| Segment 0:                              |
+		|  JPTRC_FILE_HEADER                      |
+		|  JPTRC_CIRCULAR_HEADER_CHUNK            |
+		|  Image info chunks, pad chunks          |
+		|  (up to FixedDataEnd)                   |
+		+-----------------------------------------+
+		| Segments 1..n: ring                     |
+		|  Each segment starts with a             |
+		|  JPTRC_SEGMENT_HEADER_CHUNK, followed   |
+		|  by arbitrary chunks                    |
+		+-----------------------------------------+
+
+		Segment 0 is never overwritten. The ring segments are
+		written in order, wrapping around to segment 1 after the
+		last segment.
+
+		The segment containing HeadOffset is the head, i.e. the 
+		most recently written segment. Going backwards from the head, 
+		all segments whose sequence numbers decrease by one each
+		are live. Chunks of the head segment beyond HeadOffset and
+		segments not matching the expected sequence number (e.g. 
+		because they have never been written or have been 
+		overwritten after the header was last updated) are to be
+		ignored.
+
+		Index and index trailer chunks are not used in circular 
+		files.
+--*/
+typedef struct _JPTRC_CIRCULAR_HEADER_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	//
+	// Offset, relative to the start of the file, of the end of the 
+	// last chunk within segment 0.
+	//
+	ULONG FixedDataEnd;
+
+	//
+	// Unused, must be 0.
+	//
+	ULONG Reserved;
+
+	//
+	// Sequence number of head segment, 0 if no ring segment has 
+	// been written yet.
+	//
+	ULONGLONG HeadSequenceNumber;
+
+	//
+	// File offset of the end of the last chunk within the head
+	// segment.
+	//
+	ULONGLONG HeadOffset;
+} JPTRC_CIRCULAR_HEADER_CHUNK, *PJPTRC_CIRCULAR_HEADER_CHUNK;
+
+/*++
+	Structure Description:
+		First chunk of each ring segment of a circular file.
+--*/
+typedef struct _JPTRC_SEGMENT_HEADER_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	//
+	// Number of segments written before this one plus one. Not 
+	// reset when wrapping around.
+	//
+	ULONGLONG SequenceNumber;
+} JPTRC_SEGMENT_HEADER_CHUNK, *PJPTRC_SEGMENT_HEADER_CHUNK;
+
+C_ASSERT( ( sizeof( JPTRC_CIRCULAR_HEADER_CHUNK ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+C_ASSERT( sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) == 16 );
+
+/*++
+	Structure Description:
+		Identifies a file as part of a set of files that has been
+		produced by rotating the log file. If present, this chunk
+		immediately follows the file header.
+
+		Each file of a set is self-contained, i.e. it contains
+		image info chunks for all images that trace buffer chunks
+		may refer to. The files of a set can be processed 
+		individually or, if consecutive, as a single trace.
+--*/
+typedef struct _JPTRC_CONTINUATION_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	//
+	// Position of the file within the set, starting at 0.
+	//
+	ULONG SequenceNumber;
+
+	//
+	// Unused, must be 0.
+	//
+	ULONG Reserved;
+
+	//
+	// Identifies the set, equal for all files of a set.
+	//
+	ULONGLONG SetId;
+} JPTRC_CONTINUATION_CHUNK, *PJPTRC_CONTINUATION_CHUNK;
+
+C_ASSERT( ( sizeof( JPTRC_CONTINUATION_CHUNK ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+
+/*++
+	Structure Description:
+		Name of an instrumented procedure, as resolved by the
+		controller when the procedure was instrumented. The 
+		structure is of variable length, the name immediately
+		follows the fixed members and is null-terminated.
+--*/
+typedef struct _JPTRC_SYMBOL
+{
+	//
+	// Procedure VA and load address of the enclosing image. The
+	// image is described by an image info chunk.
+	//
+	ULONGLONG Procedure;
+	ULONGLONG ModuleBase;
+
+	//
+	// Size of the entire structure, including the name and padding.
+	// A multiple of JPTRC_CHUNK_ALIGNMENT.
+	//
+	USHORT Size;
+
+	//
+	// Length of name, in bytes, excluding the terminating null.
+	//
+	USHORT NameLength;
+
+	//
+	// Unused, must be 0.
+	//
+	ULONG Reserved;
+
+	CHAR Name[ ANYSIZE_ARRAY ];
+} JPTRC_SYMBOL, *PJPTRC_SYMBOL;
+
+#define JPTRC_SYMBOL_SIZE( NameLength )								\
+	( ( FIELD_OFFSET( JPTRC_SYMBOL, Name[ ( NameLength ) + 1 ] ) +	\
+		JPTRC_CHUNK_ALIGNMENT - 1 ) & ~( JPTRC_CHUNK_ALIGNMENT - 1 ) )
+
+/*++
+	Structure Description:
+		Table of symbols of instrumented procedures. Embedding
+		symbols allows a trace to be symbolized without access to
+		the images or their debug symbols. 
+		
+		Symbol table chunks may appear anywhere in the file, a 
+		procedure may be described by more than one chunk - the 
+		last description wins.
+
+		The structure is of variable length, SymbolCount 
+		consecutive JPTRC_SYMBOL structures follow the fixed 
+		members.
+--*/
+typedef struct _JPTRC_SYMBOL_TABLE_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	ULONG SymbolCount;
+
+	//
+	// Unused, must be 0.
+	//
+	ULONG Reserved;
+
+	JPTRC_SYMBOL Symbols[ ANYSIZE_ARRAY ];
+} JPTRC_SYMBOL_TABLE_CHUNK, *PJPTRC_SYMBOL_TABLE_CHUNK;
+
+C_ASSERT( ( FIELD_OFFSET( JPTRC_SYMBOL, Name ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+C_ASSERT( ( FIELD_OFFSET( JPTRC_SYMBOL_TABLE_CHUNK, Symbols ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+
+/*++
+	Structure Description:
+		Relates the Timestamp fields of the file to wall clock time.
+
+		Calibration chunks are written at the beginning of a file
+		and periodically thereafter; each chunk holds a pair of 
+		a timestamp and the system time taken at the same instant.
+		As the frequency is measured by the producer, later chunks
+		carry more accurate values.
+
+		The structure is of variable length, ProcessorCount 
+		processor offsets follow the fixed members.
+--*/
+typedef struct _JPTRC_CALIBRATION_CHUNK
+{
+	JPTRC_CHUNK_HEADER Header;
+
+	//
+	// Timestamp ticks per second. 0 if unknown.
+	//
+	ULONGLONG Frequency;
+
+	//
+	// Timestamp and system time (100ns units since 1601, UTC)
+	// taken at the same instant.
+	//
+	ULONGLONG Timestamp;
+	ULONGLONG SystemTime;
+
+	//
+	// Number of entries in ProcessorOffsets, 0 if the offsets
+	// have not been measured.
+	//
+	ULONG ProcessorCount;
+
+	//
+	// Unused, must be 0.
+	//
+	ULONG Reserved;
+
+	//
+	// Offset, in ticks, of each processor's timestamp counter 
+	// relative to the counter of the first processor. Offsets
+	// are only accurate to the resolution of the clock used to 
+	// measure them.
+	//
+	LONGLONG ProcessorOffsets[ ANYSIZE_ARRAY ];
+} JPTRC_CALIBRATION_CHUNK, *PJPTRC_CALIBRATION_CHUNK;
+
+#define JPTRC_CALIBRATION_CHUNK_SIZE( ProcessorCount )			\
+	FIELD_OFFSET( JPTRC_CALIBRATION_CHUNK, ProcessorOffsets[ ProcessorCount ] )
+
+C_ASSERT( ( FIELD_OFFSET( JPTRC_CALIBRATION_CHUNK, ProcessorOffsets ) % JPTRC_CHUNK_ALIGNMENT ) == 0 );
+
 #pragma pack( pop )
 #pragma warning( pop )
\ No newline at end of file
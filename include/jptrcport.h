@@ -0,0 +1,69 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Definitions jptrcfmt.h and jptrccmp.h require when being
+ *		compiled on non-Windows hosts, e.g. by the host tests in
+ *		tests/host. On Windows, these are provided by the SDK or
+ *		DDK headers, so this file has no effect.
+ *
+ *		N.B. The Windows data model (LLP64) is assumed, i.e. ULONG
+ *		is 32 bit wide.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#ifndef _WIN32
+
+#include <stddef.h>
+#include <string.h>
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned char BOOLEAN, *PBOOLEAN;
+typedef short SHORT, *PSHORT;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int LONG, *PLONG;
+typedef unsigned int ULONG, *PULONG;
+typedef long long LONGLONG, *PLONGLONG;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+
+#ifndef TRUE
+#define TRUE						1
+#endif
+#ifndef FALSE
+#define FALSE						0
+#endif
+
+#define CONST						const
+#define ANYSIZE_ARRAY				1
+
+#define MAXUSHORT					0xffff
+#define MAXULONG					0xffffffff
+
+#define FIELD_OFFSET( Type, Field )	( ( LONG ) offsetof( Type, Field ) )
+#define C_ASSERT( e )				_Static_assert( e, #e )
+
+#define RtlZeroMemory( Dest, Length ) \
+	memset( ( Dest ), 0, ( Length ) )
+#define RtlCopyMemory( Dest, Source, Length ) \
+	memcpy( ( Dest ), ( Source ), ( Length ) )
+#define RtlMoveMemory( Dest, Source, Length ) \
+	memmove( ( Dest ), ( Source ), ( Length ) )
+
+//
+// SAL annotations.
+//
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __in_ecount( Count )
+#define __in_bcount( Size )
+#define __out_ecount( Count )
+#define __out_bcount( Size )
+
+#endif
\ No newline at end of file
@@ -4,9 +4,16 @@
  * Purpose:
  *		Trace file reader.
  *
- *		N.B. Several files can be managed concurrently by this library,
- *		however, concurrent operations on the same file handle are 
- *		not interlocked.
+ *		N.B. Several files can be managed concurrently by this library.
+ *		A file handle may be shared by multiple threads: Operations
+ *		on the same handle are serialized, with callbacks being 
+ *		invoked while other threads are blocked. Calls are the 
+ *		exception: JptrcrEnumCalls, JptrcrEnumChildCalls and 
+ *		JptrcrEnumActiveCalls invoke their callbacks without blocking
+ *		other threads, and may be used by several threads at once.
+ *		Cursors and timeline handles are per-thread state and must 
+ *		not be used by multiple threads concurrently. JptrcrCloseFile
+ *		must not be called while other threads still use the handle.
  *
  * Copyright:
  *		Johannes Passing (johannes.passing@googlemail.com)
@@ -100,6 +107,7 @@ typedef struct _JPTRCR_CALL
 
 	//
 	// Symbol information, may be NULL if symbols are unavailable.
+	// Remains valid until the file is closed.
 	//
 	PSYMBOL_INFO Symbol;
 
@@ -133,12 +141,127 @@ typedef struct _JPTRCR_CALL
 		//
 		ULONG ExceptionCode;
 	} Result;
+
+	//
+	// Duration of the call in nanoseconds. 0 if the file does not
+	// contain calibration information, see JptrcrGetClockInfo.
+	//
+	ULONGLONG Duration;
 } JPTRCR_CALL, *PJPTRCR_CALL;
 
+/*++
+	Structure Description:
+		Relates the timestamps of a trace to wall clock time.
+--*/
+typedef struct _JPTRCR_CLOCK_INFO
+{
+	//
+	// Timestamp ticks per second.
+	//
+	ULONGLONG Frequency;
+
+	//
+	// Timestamp and system time (UTC) of the earliest calibration
+	// point contained in the trace.
+	//
+	ULONGLONG Timestamp;
+	FILETIME SystemTime;
+
+	//
+	// Largest offset between the timestamp counters of any two
+	// processors, in ticks. 0 if not measured. 
+	//
+	// N.B. Threads may migrate between processors, so durations may
+	// be skewed by up to this amount.
+	//
+	ULONGLONG MaximumProcessorSkew;
+} JPTRCR_CLOCK_INFO, *PJPTRCR_CLOCK_INFO;
+
+/*++
+	Structure Description:
+		Statistics of the cache of mapped file windows. See
+		JptrcrSetMappingCacheCapacity.
+--*/
+typedef struct _JPTRCR_MAPPING_STATISTICS
+{
+	//
+	// Accesses served by a window that has already been mapped.
+	//
+	ULONGLONG Hits;
+
+	//
+	// Accesses that required a window to be mapped.
+	//
+	ULONGLONG Misses;
+
+	//
+	// Windows unmapped to make room for other windows.
+	//
+	ULONGLONG Remaps;
+
+	//
+	// Windows mapped in advance during sequential scans.
+	//
+	ULONGLONG Prefetches;
+} JPTRCR_MAPPING_STATISTICS, *PJPTRCR_MAPPING_STATISTICS;
+
+#define JPTRCR_INVALID_SYMBOL_ID	0
+
+/*++
+	Structure Description:
+		Compact representation of a call, see JptrcrReadCalls.
+		Rather than pointing to symbol information, records 
+		refer to symbols by ID, see JptrcrEnumSymbols.
+--*/
+typedef struct _JPTRCR_CALL_RECORD
+{
+	//
+	// See JPTRCR_CALL.
+	//
+	JPTRCR_CALL_HANDLE CallHandle;
+	ULONGLONG Procedure;
+	ULONGLONG EntryTimestamp;
+	ULONGLONG ExitTimestamp;
+	ULONGLONG Duration;
+
+	//
+	// JPTRCR_INVALID_SYMBOL_ID if symbols are unavailable.
+	//
+	ULONG SymbolId;
+
+	ULONG CallerIp;
+	ULONG ChildCalls;
+
+	//
+	// Return value or exception code, depending on ExitType.
+	//
+	ULONG Result;
+
+	//
+	// JPTRCR_CALL_ENTRY_TYPE and JPTRCR_CALL_EXIT_TYPE.
+	//
+	USHORT EntryType;
+	USHORT ExitType;
+} JPTRCR_CALL_RECORD, *PJPTRCR_CALL_RECORD;
+
+/*++
+	Structure Description:
+		Position within a sequence of calls, see 
+		JptrcrInitializeCallCursor. Contents are opaque.
+--*/
+typedef struct _JPTRCR_CALL_CURSOR
+{
+	PVOID Chunk;
+	ULONG Index;
+	ULONG Flags;
+} JPTRCR_CALL_CURSOR, *PJPTRCR_CALL_CURSOR;
+
 
 /*++
 	Routine Description:
-		Open a file for reading. The file may still be written to.
+		Open a file for reading. The file may still be written to,
+		in which case a trailing chunk that has not been written
+		completely is ignored. See JptrcrRefreshFile.
 
 	Parameters:
 		FilePath		- Path to file to be opened.
@@ -149,6 +272,32 @@ JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrOpenFile(
 	__out JPTRCRHANDLE *FileHandle
 	);
 
+/*++
+	Routine Description:
+		Open a set of files that has been produced by rotating the
+		log file (see JPKFBT_LOG_OPTIONS) and read them as a single 
+		trace. 
+		
+		The files may be passed in any order but must be consecutive
+		members of the same set.
+
+	Parameters:
+		FileCount		- Number of files.
+		FilePaths		- Paths to files to be opened.
+		FileHandle		- Opaque handle used for subsequent calls.
+
+	Return Value:
+		S_OK on success.
+		JPTRCR_E_FILE_SET_MISMATCH if the files do not belong to the 
+			same set or are not consecutive.
+		Any other failure HRESULT.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrOpenFileSet(
+	__in ULONG FileCount,
+	__in_ecount( FileCount ) PCWSTR *FilePaths,
+	__out JPTRCRHANDLE *FileHandle
+	);
+
 /*++
 	Routine Description:
 		Close the file.
@@ -157,6 +306,102 @@ JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrCloseFile(
 	__in JPTRCRHANDLE FileHandle
 	);
 
+typedef VOID ( JPTRCRCALLTYPE * JPTRCR_REFRESH_ROUTINE ) (
+	__in PJPTRCR_CLIENT Client,
+	__in BOOL NewClient,
+	__in ULONG NewChunks,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Pick up chunks that have been appended to the (last) file
+		since it has been opened or refreshed last. Used to follow
+		a trace that is still being written.
+
+		Calls of clients having received new chunks are re-indexed
+		on next use - call handles and cursors of these clients
+		obtained before become invalid.
+
+		N.B. Must not be called from within an enumeration callback.
+
+	Parameters:
+		Callback		- Invoked once for each client that either
+						  is new or has received new chunks.
+
+	Return Value:
+		S_OK if new trace buffer chunks have been found.
+		S_FALSE if no trace buffer chunks have been added, e.g.
+			because the only new chunk is still incomplete.
+		JPTRCR_E_REFRESH_NOT_SUPPORTED if the file is circular.
+		Any other failure HRESULT.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrRefreshFile(
+	__in JPTRCRHANDLE FileHandle,
+	__in_opt JPTRCR_REFRESH_ROUTINE Callback,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Set the maximum number of file windows kept mapped. Each 
+		window spans 1 MB of address space. Larger capacities avoid
+		remapping when calls of many clients are enumerated in an
+		interleaved fashion.
+
+		N.B. Must not be called from within an enumeration callback.
+
+	Parameters:
+		Capacity		- Number of windows, 1 to 128. The default
+						  is 16.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrSetMappingCacheCapacity(
+	__in JPTRCRHANDLE FileHandle,
+	__in ULONG Capacity
+	);
+
+/*++
+	Routine Description:
+		Obtain statistics of the cache of mapped file windows,
+		accumulated since the file has been opened.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrGetMappingStatistics(
+	__in JPTRCRHANDLE FileHandle,
+	__out PJPTRCR_MAPPING_STATISTICS Statistics
+	);
+
+
+/*++
+	Routine Description:
+		Obtain calibration information of the timestamps used 
+		in the trace.
+
+	Return Value:
+		S_OK on success.
+		JPTRCR_E_NO_CALIBRATION if the file does not contain
+			calibration information.
+		Any other failure HRESULT.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrGetClockInfo(
+	__in JPTRCRHANDLE FileHandle,
+	__out PJPTRCR_CLOCK_INFO ClockInfo
+	);
+
+/*++
+	Routine Description:
+		Convert a timestamp difference to nanoseconds.
+
+	Return Value:
+		S_OK on success.
+		JPTRCR_E_NO_CALIBRATION if the file does not contain
+			calibration information.
+		Any other failure HRESULT.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrTicksToNanoseconds(
+	__in JPTRCRHANDLE FileHandle,
+	__in ULONGLONG Ticks,
+	__out PULONGLONG Nanoseconds
+	);
 
 typedef VOID ( JPTRCRCALLTYPE * JPTRCR_ENUM_CLIENTS_ROUTINE ) (
 	__in PJPTRCR_CLIENT Client,
@@ -227,6 +472,337 @@ JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrEnumChildCalls(
 	__in_opt PVOID Context
 	);
 
+/*++
+	Routine Description:
+		Enumerate the calls of a client that are active at a given 
+		point in time, i.e. the call stack of the client at this 
+		time. Calls are reported outermost first; the handles of 
+		the calls may be used for JptrcrEnumChildCalls.
+
+		Seeking takes logarithmic time in the number of chunks and
+		calls of the client once the call index has been built.
+
+		Calls that have not returned by the end of the trace are
+		reported with ExitType JptrcrSyntheticExit and an 
+		ExitTimestamp of 0.
+
+	Parameters:
+		Client			- Client whose call stack is to be obtained.
+		Timestamp		- Point in time. A call is active if it has
+						  been entered at or before and has not
+						  returned before this time.
+
+	Return Value:
+		S_OK if calls have been reported.
+		S_FALSE if client unknown or no calls are active.
+		Any error HRESULT on failure.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrEnumActiveCalls(
+	__in JPTRCRHANDLE FileHandle,
+	__in PJPTRCR_CLIENT Client,
+	__in ULONGLONG Timestamp,
+	__in JPTRCR_ENUM_CALLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Initialize a cursor for reading calls using JptrcrReadCalls.
+		Either the top level calls of a client or the direct child 
+		calls of a caller are read, i.e. the same calls 
+		JptrcrEnumCalls or JptrcrEnumChildCalls would report.
+
+	Parameters:
+		Client			- Client whose top level calls are to be read.
+		CallerHandle	- Caller whose child calls are to be read.
+						  Exactly one of Client and CallerHandle must
+						  be specified.
+		Cursor			- Cursor, positioned before the first call.
+
+	Return Value:
+		S_OK if successfully initialized.
+		S_FALSE if client unknown or there are no calls. The cursor
+			is initialized nevertheless.
+		Any error HRESULT on failure.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrInitializeCallCursor(
+	__in JPTRCRHANDLE FileHandle,
+	__in_opt PJPTRCR_CLIENT Client,
+	__in_opt PJPTRCR_CALL_HANDLE CallerHandle,
+	__out PJPTRCR_CALL_CURSOR Cursor
+	);
+
+/*++
+	Routine Description:
+		Read the next block of calls and advance the cursor.
+
+	Parameters:
+		Cursor			- Cursor initialized by 
+						  JptrcrInitializeCallCursor.
+		MaxRecords		- Capacity of Records.
+		Records			- Receives the calls.
+		RecordsRead		- Number of records returned.
+
+	Return Value:
+		S_OK if the buffer has been filled. More calls may follow.
+		S_FALSE if all calls have been read. Records may have been
+			returned nevertheless.
+		Any error HRESULT on failure.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrReadCalls(
+	__in JPTRCRHANDLE FileHandle,
+	__inout PJPTRCR_CALL_CURSOR Cursor,
+	__in ULONG MaxRecords,
+	__out_ecount_part( MaxRecords, *RecordsRead ) PJPTRCR_CALL_RECORD Records,
+	__out PULONG RecordsRead
+	);
+
+typedef VOID ( JPTRCRCALLTYPE * JPTRCR_ENUM_SYMBOLS_ROUTINE ) (
+	__in ULONG SymbolId,
+	__in PSYMBOL_INFO Symbol,
+	__in_opt PJPTRCR_MODULE Module,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Enumerate symbols that have been assigned an ID, in ascending
+		order of IDs. IDs are assigned consecutively as calls are 
+		read, so consumers may maintain their own table of symbols 
+		by enumerating the symbols with IDs beyond the ones already
+		known after each block of calls read.
+
+	Parameters:
+		FirstSymbolId	- ID to start with. IDs start at 1.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrEnumSymbols(
+	__in JPTRCRHANDLE FileHandle,
+	__in ULONG FirstSymbolId,
+	__in JPTRCR_ENUM_SYMBOLS_ROUTINE Callback,
+	__in_opt PVOID Context
+	);
+
+typedef PVOID JPTRCRPROFILEHANDLE;
+
+#define JPTRCR_PROFILE_HISTOGRAM_BUCKETS	32
+
+/*++
+	Structure Description:
+		Aggregated calls of a single procedure, see 
+		JptrcrCreateProfile.
+
+		Times are in nanoseconds and 0 if the file does not contain
+		calibration information.
+--*/
+typedef struct _JPTRCR_PROFILE_ENTRY
+{
+	ULONGLONG Procedure;
+
+	//
+	// See JPTRCR_CALL.
+	//
+	PSYMBOL_INFO Symbol;
+	PJPTRCR_MODULE Module;
+
+	ULONGLONG CallCount;
+
+	//
+	// Time spent in the procedure including and excluding child
+	// calls. Recursive calls are only accounted for once in
+	// InclusiveTime.
+	//
+	ULONGLONG InclusiveTime;
+	ULONGLONG ExclusiveTime;
+
+	ULONGLONG MinDuration;
+	ULONGLONG MaxDuration;
+
+	//
+	// Bucket i counts calls lasting [2^i, 2^(i+1)) timestamp 
+	// ticks, bucket 0 also counts calls lasting 0 ticks, the last
+	// bucket all longer calls. Use JptrcrTicksToNanoseconds to 
+	// convert bucket bounds.
+	//
+	ULONGLONG Histogram[ JPTRCR_PROFILE_HISTOGRAM_BUCKETS ];
+} JPTRCR_PROFILE_ENTRY, *PJPTRCR_PROFILE_ENTRY;
+
+/*++
+	Structure Description:
+		Calls from one procedure to another, see 
+		JptrcrCreateProfile.
+--*/
+typedef struct _JPTRCR_PROFILE_EDGE
+{
+	ULONGLONG Caller;
+	ULONGLONG Callee;
+	ULONGLONG CallCount;
+
+	//
+	// Time spent in the callee when called by the caller, in
+	// nanoseconds.
+	//
+	ULONGLONG InclusiveTime;
+} JPTRCR_PROFILE_EDGE, *PJPTRCR_PROFILE_EDGE;
+
+/*++
+	Routine Description:
+		Aggregate the calls of all clients by procedure. Each 
+		client's transitions are walked once, clients are processed
+		in parallel.
+
+		Calls are matched as by JptrcrEnumCalls, i.e. each exit 
+		transition ends the innermost pending call. Calls that have 
+		not returned by the end of the trace are not accounted for.
+
+		N.B. Must not be called from within an enumeration callback.
+
+	Parameters:
+		ProfileHandle	- Profile, to be deleted using 
+						  JptrcrDeleteProfile before the file is
+						  closed.
+
+	Return Value:
+		S_OK on success.
+		Any error HRESULT on failure.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrCreateProfile(
+	__in JPTRCRHANDLE FileHandle,
+	__out JPTRCRPROFILEHANDLE *ProfileHandle
+	);
+
+typedef VOID ( JPTRCRCALLTYPE * JPTRCR_ENUM_PROFILE_ENTRIES_ROUTINE ) (
+	__in PJPTRCR_PROFILE_ENTRY Entry,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Enumerate the procedures of a profile, in no particular
+		order.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrEnumProfileEntries(
+	__in JPTRCRPROFILEHANDLE ProfileHandle,
+	__in JPTRCR_ENUM_PROFILE_ENTRIES_ROUTINE Callback,
+	__in_opt PVOID Context
+	);
+
+typedef VOID ( JPTRCRCALLTYPE * JPTRCR_ENUM_PROFILE_EDGES_ROUTINE ) (
+	__in PJPTRCR_PROFILE_EDGE Edge,
+	__in_opt PVOID Context
+	);
+
+/*++
+	Routine Description:
+		Enumerate the caller/callee pairs of a profile, in no 
+		particular order. Top level calls have no caller and are
+		not reported.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrEnumProfileEdges(
+	__in JPTRCRPROFILEHANDLE ProfileHandle,
+	__in JPTRCR_ENUM_PROFILE_EDGES_ROUTINE Callback,
+	__in_opt PVOID Context
+	);
+
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrDeleteProfile(
+	__in JPTRCRPROFILEHANDLE ProfileHandle
+	);
+
+typedef PVOID JPTRCRTIMELINEHANDLE;
+
+/*++
+	Structure Description:
+		Inclusive range of timestamps.
+--*/
+typedef struct _JPTRCR_TIMESTAMP_RANGE
+{
+	ULONGLONG Start;
+	ULONGLONG End;
+} JPTRCR_TIMESTAMP_RANGE, *PJPTRCR_TIMESTAMP_RANGE;
+
+typedef enum _JPTRCR_TRANSITION_TYPE
+{
+	JptrcrEntryTransition,
+	JptrcrExitTransition,
+	JptrcrUnwindTransition
+} JPTRCR_TRANSITION_TYPE;
+
+/*++
+	Structure Description:
+		Single procedure transition, see JptrcrReadTimeline.
+--*/
+typedef struct _JPTRCR_TRANSITION_RECORD
+{
+	JPTRCR_CLIENT Client;
+	ULONGLONG Timestamp;
+	ULONGLONG Procedure;
+
+	//
+	// JPTRCR_TRANSITION_TYPE.
+	//
+	ULONG Type;
+
+	//
+	// Caller IP for entry transitions, return value or exception
+	// code for exit and unwind transitions.
+	//
+	ULONG Info;
+} JPTRCR_TRANSITION_RECORD, *PJPTRCR_TRANSITION_RECORD;
+
+/*++
+	Routine Description:
+		Create a timeline that merges the transitions of all clients
+		in order of their timestamps. Transitions having the same 
+		timestamp are returned in client order.
+
+		The timeline reflects the clients and chunks known at the 
+		time it is created. 
+
+	Parameters:
+		Range			- Range of timestamps to be returned. If NULL,
+						  all transitions are returned.
+		TimelineHandle	- Timeline, to be deleted using 
+						  JptrcrDeleteTimeline before the file is
+						  closed.
+
+	Return Value:
+		S_OK on success.
+		Any error HRESULT on failure.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrCreateTimeline(
+	__in JPTRCRHANDLE FileHandle,
+	__in_opt PJPTRCR_TIMESTAMP_RANGE Range,
+	__out JPTRCRTIMELINEHANDLE *TimelineHandle
+	);
+
+/*++
+	Routine Description:
+		Read the next block of transitions.
+
+	Parameters:
+		MaxRecords		- Capacity of Records.
+		Records			- Receives the transitions.
+		RecordsRead		- Number of records returned.
+
+	Return Value:
+		S_OK if the buffer has been filled. More transitions may 
+			follow.
+		S_FALSE if all transitions have been read. Records may have
+			been returned nevertheless.
+		Any error HRESULT on failure. Once a read has failed, the
+			timeline can only be deleted.
+--*/
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrReadTimeline(
+	__in JPTRCRTIMELINEHANDLE TimelineHandle,
+	__in ULONG MaxRecords,
+	__out_ecount_part( MaxRecords, *RecordsRead ) 
+		PJPTRCR_TRANSITION_RECORD Records,
+	__out PULONG RecordsRead
+	);
+
+JPTRCRAPI HRESULT JPTRCRCALLTYPE JptrcrDeleteTimeline(
+	__in JPTRCRTIMELINEHANDLE TimelineHandle
+	);
+
 #ifdef __cplusplus
 } // extern "C" 
 #endif
\ No newline at end of file
@@ -158,3 +158,39 @@
 //
 #define JPTRCR_E_MODULE_UNKNOWN          ((HRESULT)0xC004940CL)
 
+//
+// MessageId: JPTRCR_E_CORRUPT_CHUNK
+//
+// MessageText:
+//
+// The file contains a corrupt chunk.
+//
+#define JPTRCR_E_CORRUPT_CHUNK           ((HRESULT)0xC004940DL)
+
+//
+// MessageId: JPTRCR_E_FILE_SET_MISMATCH
+//
+// MessageText:
+//
+// The files do not form a consecutive set of rotated trace files.
+//
+#define JPTRCR_E_FILE_SET_MISMATCH       ((HRESULT)0xC004940EL)
+
+//
+// MessageId: JPTRCR_E_NO_CALIBRATION
+//
+// MessageText:
+//
+// The file does not contain timestamp calibration information.
+//
+#define JPTRCR_E_NO_CALIBRATION          ((HRESULT)0xC004940FL)
+
+//
+// MessageId: JPTRCR_E_REFRESH_NOT_SUPPORTED
+//
+// MessageText:
+//
+// The trace cannot be refreshed. Circular files do not support refreshing.
+//
+#define JPTRCR_E_REFRESH_NOT_SUPPORTED   ((HRESULT)0xC0049410L)
+
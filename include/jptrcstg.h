@@ -0,0 +1,175 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Packing of chunks into staging blocks. A staging block covers
+ *		one or more consecutive segments of a trace file and is
+ *		written to the file at once.
+ *
+ *		Chunks never straddle segment boundaries - if a chunk does
+ *		not fit into the remainder of the current segment, the
+ *		remainder is filled with a JPTRC_CHUNK_TYPE_PAD chunk.
+ *
+ *		Optionally, each segment is started with a 
+ *		JPTRC_SEGMENT_HEADER_CHUNK, as required for circular files.
+ *
+ *		The routines do not allocate memory and can thus be used
+ *		both in kernel and user mode.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#include <jptrcfmt.h>
+
+/*++
+	Structure Description:
+		Staging block. All memory is provided by the caller.
+--*/
+typedef struct _JPTRCSTG_BLOCK
+{
+	//
+	// File offset of the beginning of the block, a multiple of
+	// JPTRC_SEGMENT_SIZE.
+	//
+	ULONGLONG FileOffset;
+
+	//
+	// Size of Buffer, a multiple of JPTRC_SEGMENT_SIZE.
+	//
+	ULONG Capacity;
+
+	//
+	// Number of bytes used, always a multiple of JPTRC_CHUNK_ALIGNMENT.
+	//
+	ULONG Used;
+
+	PUCHAR Buffer;
+
+	//
+	// Sequence number to be assigned to the next segment begun
+	// in this block, 0 if segments do not carry segment header
+	// chunks. Not touched by JptrcstgResetBlock - when advancing
+	// to another block, the caller has to carry the value over.
+	//
+	ULONGLONG NextSequenceNumber;
+} JPTRCSTG_BLOCK, *PJPTRCSTG_BLOCK;
+
+/*++
+	Routine Description:
+		Reset a block s.t. it covers the segments starting at
+		FileOffset.
+
+	Parameters:
+		Block		- Block.
+		FileOffset	- File offset, a multiple of JPTRC_SEGMENT_SIZE.
+--*/
+static __inline VOID JptrcstgResetBlock(
+	__in PJPTRCSTG_BLOCK Block,
+	__in ULONGLONG FileOffset
+	)
+{
+	Block->FileOffset	= FileOffset;
+	Block->Used			= 0;
+}
+
+/*++
+	Routine Description:
+		Append a chunk to a block, preceded by a pad chunk if
+		necessary.
+
+	Parameters:
+		Block		- Block.
+		Chunk		- Header, always defines overall size, which must
+					  not exceed JPTRC_SEGMENT_SIZE, or 
+					  JPTRC_SEGMENT_SIZE less the size of a segment
+					  header chunk if segment headers are used.
+		Body		- if non-null, chunk header and body are copied
+					  separately.
+		BodySize	- Size of body. This size is included in Chunk->Size.
+		ChunkOffset	- File offset the chunk has been placed at.
+
+	Return Value:
+		TRUE if the chunk has been appended.
+		FALSE if the block is full. The block may have been padded
+			in this case. The caller has to write the block, reset
+			it to the subsequent file offset and retry.
+--*/
+static __inline BOOLEAN JptrcstgAppendChunk(
+	__in PJPTRCSTG_BLOCK Block,
+	__in CONST JPTRC_CHUNK_HEADER *Chunk,
+	__in_opt /*_bcount( BodySize )*/ CONST VOID *Body,
+	__in_opt ULONG BodySize,
+	__out_opt PULONGLONG ChunkOffset
+	)
+{
+	ULONG HeaderSize = Chunk->Size - BodySize;
+	ULONG RemainingSizeWithinCurrentSegment;
+
+	if ( Block->Used == Block->Capacity )
+	{
+		return FALSE;
+	}
+
+	RemainingSizeWithinCurrentSegment = JPTRC_SEGMENT_SIZE -
+		( Block->Used % JPTRC_SEGMENT_SIZE );
+
+	if ( RemainingSizeWithinCurrentSegment < Chunk->Size )
+	{
+		//
+		// Chunk would straddle segment boundary, padding required.
+		// Zero the pad chunk's body to avoid writing arbitrary
+		// memory contents to the file.
+		//
+		PJPTRC_PAD_CHUNK PadChunk =
+			( PJPTRC_PAD_CHUNK ) ( Block->Buffer + Block->Used );
+
+		PadChunk->Header.Type		= JPTRC_CHUNK_TYPE_PAD;
+		PadChunk->Header.Reserved	= 0;
+		PadChunk->Header.Size		= RemainingSizeWithinCurrentSegment;
+
+		RtlZeroMemory(
+			PadChunk + 1,
+			RemainingSizeWithinCurrentSegment - sizeof( JPTRC_PAD_CHUNK ) );
+
+		Block->Used += RemainingSizeWithinCurrentSegment;
+
+		if ( Block->Used == Block->Capacity )
+		{
+			return FALSE;
+		}
+	}
+
+	if ( Block->NextSequenceNumber != 0 && 
+		 ( Block->Used % JPTRC_SEGMENT_SIZE ) == 0 )
+	{
+		//
+		// Beginning of a new segment.
+		//
+		PJPTRC_SEGMENT_HEADER_CHUNK SegmentHeader =
+			( PJPTRC_SEGMENT_HEADER_CHUNK ) ( Block->Buffer + Block->Used );
+
+		SegmentHeader->Header.Type		= JPTRC_CHUNK_TYPE_SEGMENT_HEADER;
+		SegmentHeader->Header.Reserved	= 0;
+		SegmentHeader->Header.Size		= sizeof( JPTRC_SEGMENT_HEADER_CHUNK );
+		SegmentHeader->SequenceNumber	= Block->NextSequenceNumber++;
+
+		Block->Used += sizeof( JPTRC_SEGMENT_HEADER_CHUNK );
+	}
+
+	RtlCopyMemory( Block->Buffer + Block->Used, Chunk, HeaderSize );
+
+	if ( Body != NULL )
+	{
+		RtlCopyMemory( Block->Buffer + Block->Used + HeaderSize, Body, BodySize );
+	}
+
+	if ( ChunkOffset != NULL )
+	{
+		*ChunkOffset = Block->FileOffset + Block->Used;
+	}
+
+	Block->Used += Chunk->Size;
+
+	return TRUE;
+}
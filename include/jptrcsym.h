@@ -0,0 +1,150 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Building and validation of JPTRC_CHUNK_TYPE_SYMBOL_TABLE
+ *		chunks. See jptrcfmt.h for a description of the format.
+ *
+ *		The routines do not allocate memory and can thus be used
+ *		both in kernel and user mode.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#include <jptrcfmt.h>
+
+//
+// Maximum size of a symbol table chunk. Larger tables have to be
+// split into multiple chunks.
+//
+#define JPTRCSYM_MAX_CHUNK_SIZE		( 64 * 1024 )
+
+C_ASSERT( JPTRCSYM_MAX_CHUNK_SIZE <=
+	JPTRC_SEGMENT_SIZE - sizeof( JPTRC_SEGMENT_HEADER_CHUNK ) );
+
+#define JPTRCSYM_NEXT_SYMBOL( Symbol )								\
+	( ( PJPTRC_SYMBOL ) ( ( PUCHAR ) ( Symbol ) + ( Symbol )->Size ) )
+
+/*++
+	Routine Description:
+		Initialize an empty symbol table chunk.
+--*/
+static __inline VOID JptrcsymInitializeChunk(
+	__out PJPTRC_SYMBOL_TABLE_CHUNK Chunk
+	)
+{
+	Chunk->Header.Type		= JPTRC_CHUNK_TYPE_SYMBOL_TABLE;
+	Chunk->Header.Reserved	= 0;
+	Chunk->Header.Size		= FIELD_OFFSET( JPTRC_SYMBOL_TABLE_CHUNK, Symbols );
+	Chunk->SymbolCount		= 0;
+	Chunk->Reserved			= 0;
+}
+
+/*++
+	Routine Description:
+		Append a symbol to a chunk.
+
+	Parameters:
+		Chunk		- Chunk, initialized by JptrcsymInitializeChunk.
+		Capacity	- Size of the buffer holding the chunk, must not
+					  exceed JPTRCSYM_MAX_CHUNK_SIZE.
+		Procedure	- Procedure VA.
+		ModuleBase	- Load address of the enclosing image.
+		Name		- Name, need not be null-terminated.
+		NameLength	- Length of name, in bytes.
+
+	Return Value:
+		TRUE if the symbol has been appended.
+		FALSE if the chunk is full. The caller has to write the
+			chunk, reinitialize it and retry.
+--*/
+static __inline BOOLEAN JptrcsymAppendSymbol(
+	__in PJPTRC_SYMBOL_TABLE_CHUNK Chunk,
+	__in ULONG Capacity,
+	__in ULONGLONG Procedure,
+	__in ULONGLONG ModuleBase,
+	__in_bcount( NameLength ) CONST CHAR *Name,
+	__in USHORT NameLength
+	)
+{
+	PJPTRC_SYMBOL Symbol;
+	ULONG SymbolSize = JPTRC_SYMBOL_SIZE( ( ULONG ) NameLength );
+
+	if ( SymbolSize > MAXUSHORT ||
+		 SymbolSize > Capacity - Chunk->Header.Size )
+	{
+		return FALSE;
+	}
+
+	Symbol = ( PJPTRC_SYMBOL ) ( ( PUCHAR ) Chunk + Chunk->Header.Size );
+	Symbol->Procedure	= Procedure;
+	Symbol->ModuleBase	= ModuleBase;
+	Symbol->Size		= ( USHORT ) SymbolSize;
+	Symbol->NameLength	= NameLength;
+	Symbol->Reserved	= 0;
+
+	//
+	// Zero the terminator and padding to avoid writing arbitrary
+	// memory contents to the file.
+	//
+	RtlCopyMemory( Symbol->Name, Name, NameLength );
+	RtlZeroMemory(
+		Symbol->Name + NameLength,
+		SymbolSize - FIELD_OFFSET( JPTRC_SYMBOL, Name[ NameLength ] ) );
+
+	Chunk->Header.Size += SymbolSize;
+	Chunk->SymbolCount++;
+
+	return TRUE;
+}
+
+/*++
+	Routine Description:
+		Check that a chunk is a well-formed symbol table chunk,
+		i.e. that all symbols lie within the chunk and all names
+		are null-terminated. The entire chunk, i.e.
+		Chunk->Header.Size bytes, must be accessible.
+--*/
+static __inline BOOLEAN JptrcsymIsValidChunk(
+	__in CONST JPTRC_SYMBOL_TABLE_CHUNK *Chunk
+	)
+{
+	ULONG Index;
+	ULONG Remaining;
+	CONST JPTRC_SYMBOL *Symbol;
+
+	if ( Chunk->Header.Type != JPTRC_CHUNK_TYPE_SYMBOL_TABLE ||
+		 Chunk->Header.Reserved != 0 ||
+		 Chunk->Header.Size < FIELD_OFFSET( JPTRC_SYMBOL_TABLE_CHUNK, Symbols ) ||
+		 Chunk->Header.Size > JPTRCSYM_MAX_CHUNK_SIZE ||
+		 Chunk->Reserved != 0 )
+	{
+		return FALSE;
+	}
+
+	Remaining	= Chunk->Header.Size - FIELD_OFFSET( JPTRC_SYMBOL_TABLE_CHUNK, Symbols );
+	Symbol		= Chunk->Symbols;
+
+	for ( Index = 0; Index < Chunk->SymbolCount; Index++ )
+	{
+		if ( Remaining < ( ULONG ) FIELD_OFFSET( JPTRC_SYMBOL, Name ) ||
+			 Symbol->Size < JPTRC_SYMBOL_SIZE( ( ULONG ) Symbol->NameLength ) ||
+			 Symbol->Size > Remaining ||
+			 ( Symbol->Size % JPTRC_CHUNK_ALIGNMENT ) != 0 ||
+			 Symbol->Reserved != 0 ||
+			 Symbol->Procedure == 0 ||
+			 Symbol->Name[ Symbol->NameLength ] != '\0' )
+		{
+			return FALSE;
+		}
+
+		Remaining -= Symbol->Size;
+		Symbol = JPTRCSYM_NEXT_SYMBOL( Symbol );
+	}
+
+	//
+	// No trailing garbage.
+	//
+	return ( BOOLEAN ) ( Remaining == 0 );
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Minimal stand-in for cfix, sufficient to run fixtures that
+ *		only use CFIX_ASSERT. Each fixture defines a table of test
+ *		routines that is run by main.c.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#include <stddef.h>
+
+typedef struct _HOST_TEST_ENTRY
+{
+	const char *Name;
+	void ( *Routine )( void );
+} HOST_TEST_ENTRY;
+
+/*++
+	Routine Description:
+		Report a failed assertion and abort the current test.
+--*/
+void HostTestFail(
+	const char *File,
+	int Line,
+	const char *Expression
+	);
+
+#define CFIX_ASSERT( Expr )											\
+	( ( Expr ) ? ( void ) 0 : HostTestFail( __FILE__, __LINE__, #Expr ) )
+
+#define CFIX_BEGIN_FIXTURE( Name )									\
+	const HOST_TEST_ENTRY HostFixture_##Name[] = {
+#define CFIX_FIXTURE_ENTRY( Routine )								\
+	{ #Routine, Routine },
+#define CFIX_END_FIXTURE()											\
+	{ NULL, NULL } };
@@ -0,0 +1,17 @@
+#pragma once
+
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Minimal stand-in for windows.h, sufficient for the tests 
+ *		built by this directory's Makefile.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+
+#include <jptrcport.h>
+
+typedef int BOOL;
+
+#define ZeroMemory					RtlZeroMemory
+#define _countof( Array )			( sizeof( Array ) / sizeof( ( Array )[ 0 ] ) )
@@ -0,0 +1,65 @@
+/*----------------------------------------------------------------------
+ * Purpose:
+ *		Runs the fixtures that do not depend on Windows on the 
+ *		build host.
+ *
+ * Copyright:
+ *		Johannes Passing (johannes.passing@googlemail.com)
+ */
+#include <setjmp.h>
+#include <stdio.h>
+#include <cfix.h>
+
+extern const HOST_TEST_ENTRY HostFixture_CompactChunk[];
+
+static const struct
+{
+	const char *Name;
+	const HOST_TEST_ENTRY *Entries;
+} Fixtures[] =
+{
+	{ "CompactChunk", HostFixture_CompactChunk }
+};
+
+static jmp_buf TestAbort;
+
+void HostTestFail(
+	const char *File,
+	int Line,
+	const char *Expression
+	)
+{
+	fprintf( stderr, "%s(%d): Assertion failed: %s\n", File, Line, Expression );
+	longjmp( TestAbort, 1 );
+}
+
+int main( void )
+{
+	unsigned Failures = 0;
+	size_t Fixture;
+	unsigned Tests = 0;
+
+	for ( Fixture = 0; Fixture < sizeof( Fixtures ) / sizeof( Fixtures[ 0 ] ); Fixture++ )
+	{
+		const HOST_TEST_ENTRY *Entry;
+
+		for ( Entry = Fixtures[ Fixture ].Entries; Entry->Routine != NULL; Entry++ )
+		{
+			Tests++;
+
+			if ( setjmp( TestAbort ) == 0 )
+			{
+				Entry->Routine();
+				printf( "ok      %s.%s\n", Fixtures[ Fixture ].Name, Entry->Name );
+			}
+			else
+			{
+				Failures++;
+				printf( "FAILED  %s.%s\n", Fixtures[ Fixture ].Name, Entry->Name );
+			}
+		}
+	}
+
+	printf( "%u tests, %u failures\n", Tests, Failures );
+	return Failures == 0 ? 0 : 1;
+}
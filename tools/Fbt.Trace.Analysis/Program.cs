@@ -9,50 +9,23 @@ namespace Fbt.Trace.Analysis
 {
     class Program
     {
-        private delegate string GetNameDelegate(TraceCall call);
+        private delegate string GetNameDelegate(TraceProfileEntry entry);
 
         private class RankingItem : IComparable<RankingItem>
         {
-            public int CallCount;
+            public UInt64 CallCount;
+            public UInt64 InclusiveTime;
+            public UInt64 ExclusiveTime;
             public string FunctionName;
 
-            public RankingItem(string funcName, int callCount)
+            public RankingItem(string funcName)
             {
-                this.CallCount = callCount;
                 this.FunctionName = funcName;
             }
 
             public int CompareTo(RankingItem other)
             {
-                return this.CallCount - other.CallCount;
-            }
-        }
-
-        private static void Traverse(
-            ICollection<TraceCall> calls,
-            Dictionary<string, RankingItem> routines,
-            ref uint totalCount,
-            GetNameDelegate getName)
-        {
-            foreach (TraceCall call in calls)
-            {
-                if (routines.ContainsKey(getName(call)))
-                {
-                    RankingItem item = routines[getName(call)];
-                    item.CallCount++;
-                }
-                else
-                {
-                    routines[getName(call)] =
-                        new RankingItem(getName(call), 1);
-                }
-
-                totalCount++;
-
-                if (!call.IsSynthetic)
-                {
-                    Traverse(call.Calls, routines, ref totalCount, getName);
-                }
+                return this.CallCount.CompareTo(other.CallCount);
             }
         }
 
@@ -63,14 +36,28 @@ namespace Fbt.Trace.Analysis
         {
             Dictionary<string, RankingItem> routines = 
                 new Dictionary<string, RankingItem>();
-            uint totalCount = 0;
+            UInt64 totalCount = 0;
 
             //
-            // Build histogram.
+            // Build histogram from the natively aggregated profile.
             //
-            foreach (TraceClient client in file.Clients)
+            TraceProfile profile = file.CreateProfile();
+            foreach (TraceProfileEntry entry in profile.Entries)
             {
-                Traverse(client.Calls, routines, ref totalCount, getName);
+                string name = getName(entry);
+
+                RankingItem item;
+                if (!routines.TryGetValue(name, out item))
+                {
+                    item = new RankingItem(name);
+                    routines[name] = item;
+                }
+
+                item.CallCount += entry.CallCount;
+                item.InclusiveTime += entry.InclusiveTime;
+                item.ExclusiveTime += entry.ExclusiveTime;
+
+                totalCount += entry.CallCount;
             }
 
             //
@@ -90,7 +77,12 @@ namespace Fbt.Trace.Analysis
                     break;
                 }
 
-                Console.WriteLine("{0,60}\t{1}", item.FunctionName, item.CallCount);
+                Console.WriteLine(
+                    "{0,60}\t{1}\t{2}\t{3}", 
+                    item.FunctionName, 
+                    item.CallCount,
+                    item.InclusiveTime,
+                    item.ExclusiveTime);
             }
 
             Console.WriteLine();
@@ -157,8 +149,8 @@ namespace Fbt.Trace.Analysis
                             ShowMostCalled(
                                 traceFile, 
                                 100,
-                                delegate (TraceCall call) {
-                                    return call.ToString();
+                                delegate (TraceProfileEntry entry) {
+                                    return entry.ToString();
                                 });
                             break;
 
@@ -166,9 +158,9 @@ namespace Fbt.Trace.Analysis
                             ShowMostCalled(
                                 traceFile,
                                 100,
-                                delegate(TraceCall call)
+                                delegate(TraceProfileEntry entry)
                                 {
-                                    return GetFunctionNamePrefix(call.FunctionName);
+                                    return GetFunctionNamePrefix(entry.FunctionName);
                                 });
                             break;
 
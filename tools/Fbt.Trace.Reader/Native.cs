@@ -90,6 +90,57 @@ namespace Fbt.Trace.Reader
         //
     }
 
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    internal struct JPTRCR_CALL_RECORD
+    {
+        public JPTRCR_CALL_HANDLE CallHandle;
+        public UInt64 Procedure;
+        public UInt64 EntryTimestamp;
+        public UInt64 ExitTimestamp;
+        public UInt64 Duration;
+        public UInt32 SymbolId;
+        public UInt32 CallerIp;
+        public UInt32 ChildCalls;
+        public UInt32 Result;
+        public UInt16 EntryType;
+        public UInt16 ExitType;
+    }
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    internal struct JPTRCR_CALL_CURSOR
+    {
+        public IntPtr Chunk;
+        public UInt32 Index;
+        public UInt32 Flags;
+    }
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    internal struct JPTRCR_PROFILE_ENTRY
+    {
+        public UInt64 Procedure;
+        public IntPtr Symbol;
+        public IntPtr Module;
+        public UInt64 CallCount;
+        public UInt64 InclusiveTime;
+        public UInt64 ExclusiveTime;
+        public UInt64 MinDuration;
+        public UInt64 MaxDuration;
+
+        [MarshalAs(
+            UnmanagedType.ByValArray,
+            SizeConst = Native.ProfileHistogramBuckets)]
+        public UInt64[] Histogram;
+    }
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    internal struct JPTRCR_PROFILE_EDGE
+    {
+        public UInt64 Caller;
+        public UInt64 Callee;
+        public UInt64 CallCount;
+        public UInt64 InclusiveTime;
+    }
+
     /*--------------------------------------------------------------
      *
      * Native bridge.
@@ -127,6 +178,27 @@ namespace Fbt.Trace.Reader
             ref JPTRCR_CALL Call,
             IntPtr Context);
 
+        internal delegate void EnumSymbolsRoutine(
+            UInt32 SymbolId,
+            IntPtr Symbol,
+            IntPtr Module,
+            IntPtr Context);
+
+        internal delegate void EnumProfileEntriesRoutine(
+            ref JPTRCR_PROFILE_ENTRY Entry,
+            IntPtr Context);
+
+        internal delegate void EnumProfileEdgesRoutine(
+            ref JPTRCR_PROFILE_EDGE Edge,
+            IntPtr Context);
+
+        //
+        // Number of calls retrieved per JptrcrReadCalls call.
+        //
+        internal const int CallsPerBlock = 4096;
+
+        internal const int ProfileHistogramBuckets = 32;
+
         [DllImport("jptrcr.dll", 
             CallingConvention=CallingConvention.StdCall, 
             CharSet=CharSet.Unicode)]
@@ -167,6 +239,183 @@ namespace Fbt.Trace.Reader
             ref JPTRCR_CALL_HANDLE CallerHandle,
             IntPtr Callback,
             IntPtr Context);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrInitializeCallCursor(
+            Native.TraceFileHandle FileHandle,
+            ref JPTRCR_CLIENT Client,
+            IntPtr CallerHandle,
+            out JPTRCR_CALL_CURSOR Cursor);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrInitializeCallCursor(
+            Native.TraceFileHandle FileHandle,
+            IntPtr Client,
+            ref JPTRCR_CALL_HANDLE CallerHandle,
+            out JPTRCR_CALL_CURSOR Cursor);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrReadCalls(
+            Native.TraceFileHandle FileHandle,
+            ref JPTRCR_CALL_CURSOR Cursor,
+            UInt32 MaxRecords,
+            [Out] JPTRCR_CALL_RECORD[] Records,
+            out UInt32 RecordsRead);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrEnumSymbols(
+            Native.TraceFileHandle FileHandle,
+            UInt32 FirstSymbolId,
+            IntPtr Callback,
+            IntPtr Context);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrCreateProfile(
+            Native.TraceFileHandle FileHandle,
+            out IntPtr ProfileHandle);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrEnumProfileEntries(
+            IntPtr ProfileHandle,
+            IntPtr Callback,
+            IntPtr Context);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrEnumProfileEdges(
+            IntPtr ProfileHandle,
+            IntPtr Callback,
+            IntPtr Context);
+
+        [DllImport("jptrcr.dll",
+            CallingConvention = CallingConvention.StdCall,
+            CharSet = CharSet.Unicode)]
+        internal extern static int JptrcrDeleteProfile(
+            IntPtr ProfileHandle);
+
+        /*++
+            Read all calls a cursor yields, in blocks of CallsPerBlock.
+        --*/
+        internal static ICollection<TraceCall> ReadCalls(
+            Native.TraceFileHandle Handle,
+            TraceSymbols Symbols,
+            JPTRCR_CALL_CURSOR Cursor)
+        {
+            ICollection<TraceCall> Accu = new LinkedList<TraceCall>();
+            JPTRCR_CALL_RECORD[] Records = new JPTRCR_CALL_RECORD[CallsPerBlock];
+            int Hr;
+
+            do
+            {
+                UInt32 Read;
+                Hr = Native.JptrcrReadCalls(
+                    Handle,
+                    ref Cursor,
+                    (UInt32)Records.Length,
+                    Records,
+                    out Read);
+                if (Hr < 0)
+                {
+                    throw new Win32Exception(Hr);
+                }
+
+                //
+                // Pick up names of symbols first referred to by
+                // this block.
+                //
+                Symbols.Refresh();
+
+                for (int i = 0; i < Read; i++)
+                {
+                    Accu.Add(new TraceCall(Handle, Symbols, Records[i]));
+                }
+            }
+            while (Hr == 0);
+
+            return Accu;
+        }
+    }
+
+    /*--------------------------------------------------------------
+     *
+     * Symbols, indexed by ID.
+     * 
+     */
+    internal class TraceSymbols
+    {
+        private Native.TraceFileHandle Handle;
+        private List<string> Names = new List<string>();
+        private List<JPTRCR_MODULE> Modules = new List<JPTRCR_MODULE>();
+
+        internal TraceSymbols(Native.TraceFileHandle Handle)
+        {
+            this.Handle = Handle;
+        }
+
+        internal void Refresh()
+        {
+            Native.EnumSymbolsRoutine Delegate =
+                delegate(UInt32 SymbolId, IntPtr Symbol, IntPtr Module, IntPtr Context)
+                {
+                    SYMBOL_INFO Sym = (SYMBOL_INFO)Marshal.PtrToStructure(
+                        Symbol,
+                        typeof(SYMBOL_INFO));
+
+                    JPTRCR_MODULE Mod = new JPTRCR_MODULE();
+                    if (Module != IntPtr.Zero)
+                    {
+                        Mod = (JPTRCR_MODULE)Marshal.PtrToStructure(
+                            Module,
+                            typeof(JPTRCR_MODULE));
+                    }
+
+                    this.Names.Add(Sym.Name);
+                    this.Modules.Add(Mod);
+                };
+
+            IntPtr Callback = Marshal.GetFunctionPointerForDelegate(
+                Delegate);
+
+            int Hr = Native.JptrcrEnumSymbols(
+                this.Handle,
+                (UInt32)this.Names.Count + 1,
+                Callback,
+                IntPtr.Zero);
+            if (Hr < 0)
+            {
+                throw new Win32Exception(Hr);
+            }
+        }
+
+        internal bool Lookup(
+            UInt32 SymbolId, 
+            out string Name, 
+            out JPTRCR_MODULE Module)
+        {
+            if (SymbolId == 0 || SymbolId > this.Names.Count)
+            {
+                Name = null;
+                Module = new JPTRCR_MODULE();
+                return false;
+            }
+
+            Name = this.Names[(int)SymbolId - 1];
+            Module = this.Modules[(int)SymbolId - 1];
+            return true;
+        }
     }
 
     /*--------------------------------------------------------------
@@ -177,22 +426,26 @@ namespace Fbt.Trace.Reader
     public class TraceCall
     {
         private Native.TraceFileHandle Handle;
+        private TraceSymbols Symbols;
         private string Function;
         private JPTRCR_MODULE Module;
-        private JPTRCR_CALL Call;
+        private JPTRCR_CALL_RECORD Call;
         private JPTRCR_CALL_ENTRY_TYPE EntryType;
 
         internal TraceCall(
             Native.TraceFileHandle Handle,
-            JPTRCR_CALL Call, 
-            JPTRCR_MODULE Module,
-            SYMBOL_INFO SymInfo)
+            TraceSymbols Symbols,
+            JPTRCR_CALL_RECORD Call)
         {
             this.Handle = Handle;
-            this.Function = SymInfo.Name;
+            this.Symbols = Symbols;
             this.Call = Call;
-            this.Module = Module;
             this.EntryType = ( JPTRCR_CALL_ENTRY_TYPE ) Call.EntryType;
+
+            if (!Symbols.Lookup(Call.SymbolId, out this.Function, out this.Module))
+            {
+                this.Function = String.Format("0x{0:x}", Call.Procedure);
+            }
         }
 
         public String FunctionName
@@ -231,35 +484,24 @@ namespace Fbt.Trace.Reader
         {
             get
             {
-                ICollection<TraceCall> Accu = new LinkedList<TraceCall>();
-
-                Native.EnumCallsRoutine Delegate =
-                    delegate(ref JPTRCR_CALL Call, IntPtr Context)
-                    {
-                        SYMBOL_INFO Sym = (SYMBOL_INFO)Marshal.PtrToStructure(
-                            Call.Symbol,
-                            typeof(SYMBOL_INFO));
+                JPTRCR_CALL_CURSOR Cursor;
 
-                        JPTRCR_MODULE Module = (JPTRCR_MODULE)Marshal.PtrToStructure(
-                            Call.Module,
-                            typeof(JPTRCR_MODULE));
-                        Accu.Add(new TraceCall(this.Handle, Call, Module, Sym));
-                    };
-
-                IntPtr Callback = Marshal.GetFunctionPointerForDelegate(
-                    Delegate);
+                if (this.IsSynthetic)
+                {
+                    return new LinkedList<TraceCall>();
+                }
 
-                int Hr = Native.JptrcrEnumChildCalls(
+                int Hr = Native.JptrcrInitializeCallCursor(
                     this.Handle,
+                    IntPtr.Zero,
                     ref this.Call.CallHandle,
-                    Callback,
-                    IntPtr.Zero);
+                    out Cursor);
                 if (Hr < 0)
                 {
                     throw new Win32Exception(Hr);
                 }
 
-                return Accu;
+                return Native.ReadCalls(this.Handle, this.Symbols, Cursor);
             }
         }
 
@@ -269,17 +511,252 @@ namespace Fbt.Trace.Reader
         }
     }
 
+    /*--------------------------------------------------------------
+     *
+     * Profile, aggregated natively.
+     * 
+     */
+    public class TraceProfileEntry
+    {
+        private JPTRCR_PROFILE_ENTRY Entry;
+        private string Function;
+        private JPTRCR_MODULE Module;
+
+        internal TraceProfileEntry(JPTRCR_PROFILE_ENTRY Entry)
+        {
+            this.Entry = Entry;
+
+            if (Entry.Symbol != IntPtr.Zero)
+            {
+                SYMBOL_INFO Sym = (SYMBOL_INFO)Marshal.PtrToStructure(
+                    Entry.Symbol,
+                    typeof(SYMBOL_INFO));
+                this.Function = Sym.Name;
+            }
+            else
+            {
+                this.Function = String.Format("0x{0:x}", Entry.Procedure);
+            }
+
+            if (Entry.Module != IntPtr.Zero)
+            {
+                this.Module = (JPTRCR_MODULE)Marshal.PtrToStructure(
+                    Entry.Module,
+                    typeof(JPTRCR_MODULE));
+            }
+        }
+
+        public UInt64 Procedure
+        {
+            get
+            {
+                return this.Entry.Procedure;
+            }
+        }
+
+        public String FunctionName
+        {
+            get
+            {
+                return this.Function;
+            }
+        }
+
+        public String ModuleName
+        {
+            get
+            {
+                return this.Module.Name;
+            }
+        }
+
+        public UInt64 CallCount
+        {
+            get
+            {
+                return this.Entry.CallCount;
+            }
+        }
+
+        //
+        // Times are in nanoseconds.
+        //
+        public UInt64 InclusiveTime
+        {
+            get
+            {
+                return this.Entry.InclusiveTime;
+            }
+        }
+
+        public UInt64 ExclusiveTime
+        {
+            get
+            {
+                return this.Entry.ExclusiveTime;
+            }
+        }
+
+        public UInt64 MinDuration
+        {
+            get
+            {
+                return this.Entry.MinDuration;
+            }
+        }
+
+        public UInt64 MaxDuration
+        {
+            get
+            {
+                return this.Entry.MaxDuration;
+            }
+        }
+
+        //
+        // Bucket i counts calls lasting [2^i, 2^(i+1)) ticks.
+        //
+        public UInt64[] Histogram
+        {
+            get
+            {
+                return this.Entry.Histogram;
+            }
+        }
+
+        public override String ToString()
+        {
+            return this.Module.Name + "!" + this.FunctionName;
+        }
+    }
+
+    public class TraceProfileEdge
+    {
+        private JPTRCR_PROFILE_EDGE Edge;
+
+        internal TraceProfileEdge(JPTRCR_PROFILE_EDGE Edge)
+        {
+            this.Edge = Edge;
+        }
+
+        public UInt64 Caller
+        {
+            get
+            {
+                return this.Edge.Caller;
+            }
+        }
+
+        public UInt64 Callee
+        {
+            get
+            {
+                return this.Edge.Callee;
+            }
+        }
+
+        public UInt64 CallCount
+        {
+            get
+            {
+                return this.Edge.CallCount;
+            }
+        }
+
+        public UInt64 InclusiveTime
+        {
+            get
+            {
+                return this.Edge.InclusiveTime;
+            }
+        }
+    }
+
+    public class TraceProfile
+    {
+        private ICollection<TraceProfileEntry> entries = 
+            new LinkedList<TraceProfileEntry>();
+        private ICollection<TraceProfileEdge> edges = 
+            new LinkedList<TraceProfileEdge>();
+
+        internal TraceProfile(Native.TraceFileHandle Handle)
+        {
+            IntPtr ProfileHandle;
+            int Hr = Native.JptrcrCreateProfile(Handle, out ProfileHandle);
+            if (Hr < 0)
+            {
+                throw new Win32Exception(Hr);
+            }
+
+            try
+            {
+                Native.EnumProfileEntriesRoutine EntriesDelegate =
+                    delegate(ref JPTRCR_PROFILE_ENTRY Entry, IntPtr Context)
+                    {
+                        this.entries.Add(new TraceProfileEntry(Entry));
+                    };
+
+                Hr = Native.JptrcrEnumProfileEntries(
+                    ProfileHandle,
+                    Marshal.GetFunctionPointerForDelegate(EntriesDelegate),
+                    IntPtr.Zero);
+                if (Hr < 0)
+                {
+                    throw new Win32Exception(Hr);
+                }
+
+                Native.EnumProfileEdgesRoutine EdgesDelegate =
+                    delegate(ref JPTRCR_PROFILE_EDGE Edge, IntPtr Context)
+                    {
+                        this.edges.Add(new TraceProfileEdge(Edge));
+                    };
+
+                Hr = Native.JptrcrEnumProfileEdges(
+                    ProfileHandle,
+                    Marshal.GetFunctionPointerForDelegate(EdgesDelegate),
+                    IntPtr.Zero);
+                if (Hr < 0)
+                {
+                    throw new Win32Exception(Hr);
+                }
+            }
+            finally
+            {
+                Native.JptrcrDeleteProfile(ProfileHandle);
+            }
+        }
+
+        public ICollection<TraceProfileEntry> Entries
+        {
+            get
+            {
+                return this.entries;
+            }
+        }
+
+        public ICollection<TraceProfileEdge> Edges
+        {
+            get
+            {
+                return this.edges;
+            }
+        }
+    }
+
     public class TraceClient
     {
         private Native.TraceFileHandle Handle;
+        private TraceSymbols Symbols;
         private JPTRCR_CLIENT Client;
 
         internal TraceClient(
             Native.TraceFileHandle Handle,
+            TraceSymbols Symbols,
             JPTRCR_CLIENT Client
             )
         {
             this.Handle = Handle;
+            this.Symbols = Symbols;
             this.Client = Client;
         }
 
@@ -303,35 +780,19 @@ namespace Fbt.Trace.Reader
         {
             get
             {
-                ICollection<TraceCall> Accu = new LinkedList<TraceCall>();
-
-                Native.EnumCallsRoutine Delegate =
-                    delegate(ref JPTRCR_CALL Call, IntPtr Context)
-                    {
-                        SYMBOL_INFO Sym = (SYMBOL_INFO) Marshal.PtrToStructure(
-                            Call.Symbol,
-                            typeof(SYMBOL_INFO));
-
-                        JPTRCR_MODULE Module = (JPTRCR_MODULE) Marshal.PtrToStructure(
-                            Call.Module,
-                            typeof(JPTRCR_MODULE));
-                        Accu.Add(new TraceCall(this.Handle, Call, Module, Sym));
-                    };
-
-                IntPtr Callback = Marshal.GetFunctionPointerForDelegate(
-                    Delegate);
+                JPTRCR_CALL_CURSOR Cursor;
 
-                int Hr = Native.JptrcrEnumCalls(
+                int Hr = Native.JptrcrInitializeCallCursor(
                     this.Handle,
                     ref this.Client,
-                    Callback,
-                    IntPtr.Zero);
+                    IntPtr.Zero,
+                    out Cursor);
                 if (Hr < 0)
                 {
                     throw new Win32Exception(Hr);
                 }
 
-                return Accu;
+                return Native.ReadCalls(this.Handle, this.Symbols, Cursor);
             }
         }
     }
@@ -339,6 +800,7 @@ namespace Fbt.Trace.Reader
     public class TraceFile : IDisposable
     {
         private Native.TraceFileHandle Handle;
+        private TraceSymbols Symbols;
 
         public TraceFile(string Path)
         {
@@ -352,6 +814,7 @@ namespace Fbt.Trace.Reader
             }
 
             this.Handle = new Native.TraceFileHandle(RawHandle);
+            this.Symbols = new TraceSymbols(this.Handle);
         }
 
         public void Dispose()
@@ -368,7 +831,7 @@ namespace Fbt.Trace.Reader
                 Native.EnumClientsRoutine Delegate = 
                     delegate (ref JPTRCR_CLIENT Client, IntPtr Context)
                     {
-                        Accu.Add(new TraceClient(this.Handle, Client));
+                        Accu.Add(new TraceClient(this.Handle, this.Symbols, Client));
                     };
 
                 IntPtr Callback = Marshal.GetFunctionPointerForDelegate(
@@ -387,5 +850,9 @@ namespace Fbt.Trace.Reader
             }
         }
 
+        public TraceProfile CreateProfile()
+        {
+            return new TraceProfile(this.Handle);
+        }
     }
 }